@@ -207,6 +207,22 @@ def get_extensions():
         if os.getenv("XFORMERS_ENABLE_DEBUG_ASSERTIONS", "0") != "1":
             nvcc_flags.append("-DNDEBUG")
         nvcc_flags += shlex.split(os.getenv("NVCC_FLAGS", ""))
+        # The cutlass attention kernels are instantiated for every dtype -
+        # builds which only need some of them can leave out the others, eg
+        # `XFORMERS_MEM_EFF_ATTENTION_DTYPES=f16,bf16`
+        mem_eff_dtypes = os.getenv("XFORMERS_MEM_EFF_ATTENTION_DTYPES", "f32,f16,bf16")
+        mem_eff_dtypes_list = [d.strip() for d in mem_eff_dtypes.split(",")]
+        for dtype in mem_eff_dtypes_list:
+            assert dtype in ["f32", "f16", "bf16"], f"Invalid dtype: {dtype}"
+        for dtype in ["f32", "f16", "bf16"]:
+            if dtype not in mem_eff_dtypes_list:
+                nvcc_flags.append(
+                    f"-DXFORMERS_MEM_EFF_ATTENTION_DISABLE_{dtype.upper()}"
+                )
+        # Records the cycles spent in every phase of the cutlass attention
+        # forward kernels (see `mem_eff_attention/kernel_profile.h`)
+        if os.getenv("XFORMERS_MEM_EFF_ATTENTION_PROFILE", "0") == "1":
+            nvcc_flags.append("-DXFORMERS_MEM_EFF_ATTENTION_PROFILE")
         cuda_version = get_cuda_version(CUDA_HOME)
         if cuda_version >= 1102:
             nvcc_flags += [
@@ -0,0 +1,109 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+import pytest
+import torch
+
+import xformers.ops as xops
+from xformers.ops.bias_dropout_res_layernorm import _bias_dropout_res_layernorm_torch
+
+cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
+_built = (
+    xops.BiasDropoutResLayerNormOp.FORWARD_OPERATOR.__name__ != "no_such_operator"
+)
+fused_only = pytest.mark.skipif(
+    not _built, reason="xFormers was built without the fused LayerNorm op"
+)
+
+_dtypes = [torch.float, torch.half, torch.bfloat16]
+_atol = {torch.float: 1e-4, torch.half: 2e-2, torch.bfloat16: 6e-2}
+
+
+def _inputs(shape, dtype, affine: bool, bias: bool):
+    x = torch.randn(shape, device="cuda", dtype=dtype, requires_grad=True)
+    residual = torch.randn(shape, device="cuda", dtype=dtype, requires_grad=True)
+    N = shape[-1]
+    vectors = [
+        torch.randn([N], device="cuda", dtype=dtype, requires_grad=True)
+        if enabled
+        else None
+        for enabled in [bias, affine, affine]
+    ]
+    return x, residual, vectors
+
+
+@cuda_only
+@fused_only
+@pytest.mark.parametrize("pre_norm", [False, True])
+@pytest.mark.parametrize("affine", [False, True])
+@pytest.mark.parametrize("bias", [False, True])
+@pytest.mark.parametrize("shape", [(3, 5, 64), (7, 768), (2, 4096)])
+@pytest.mark.parametrize("dtype", _dtypes, ids=str)
+def test_forward_backward(shape, dtype, bias: bool, affine: bool, pre_norm: bool):
+    torch.manual_seed(0)
+    x, residual, (b, w, nb) = _inputs(shape, dtype, affine=affine, bias=bias)
+    assert xops.is_fused_bias_dropout_res_layernorm_supported(x, residual, b, w, nb)
+    inputs = [t for t in [x, residual, b, w, nb] if t is not None]
+
+    out = xops.bias_dropout_res_layernorm(
+        x, residual, b, w, nb, p=0.0, pre_norm=pre_norm
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, inputs, grad_out)
+
+    # Reference in f32
+    inputs32 = [t.detach().float().requires_grad_() for t in inputs]
+    it = iter(inputs32)
+    x32, residual32 = next(it), next(it)
+    b32, w32, nb32 = [next(it) if t is not None else None for t in [b, w, nb]]
+    ref = _bias_dropout_res_layernorm_torch(
+        x32, residual32, b32, w32, nb32, 0.0, pre_norm, 1e-5
+    )
+    ref_grads = torch.autograd.grad(ref, inputs32, grad_out.float())
+
+    atol = _atol[dtype]
+    assert out.dtype == dtype
+    assert torch.allclose(out.float(), ref, atol=atol, rtol=atol)
+    # The weight/bias gradients are sums over all the rows
+    for name, g, rg in zip(["x", "residual", "b", "w", "nb"], grads, ref_grads):
+        tol = atol * (shape[0] if g.ndim == 1 else 1)
+        assert g.shape == rg.shape, name
+        assert torch.allclose(g.float(), rg, atol=tol, rtol=atol), name
+
+
+@cuda_only
+@fused_only
+@pytest.mark.parametrize("pre_norm", [False, True])
+@pytest.mark.parametrize("p", [0.1, 0.5])
+@pytest.mark.parametrize("dtype", _dtypes, ids=str)
+def test_dropout(dtype, p: float, pre_norm: bool):
+    torch.manual_seed(0)
+    x, residual, (b, w, nb) = _inputs((256, 1024), dtype, affine=True, bias=True)
+
+    out = xops.bias_dropout_res_layernorm(x, residual, b, w, nb, p=p, pre_norm=pre_norm)
+    (grad_x,) = torch.autograd.grad(out, [x], torch.ones_like(out))
+
+    # The mask regenerated by the backward should match the forward: the
+    # dropped elements of `x` have no gradient
+    dropped = (grad_x == 0).float().mean().item()
+    assert abs(dropped - p) < 0.02
+
+    # Different calls use different masks
+    out2 = xops.bias_dropout_res_layernorm(
+        x, residual, b, w, nb, p=p, pre_norm=pre_norm
+    )
+    assert not torch.allclose(out, out2)
+
+
+@cuda_only
+def test_fallback():
+    # N is not a multiple of the vector size: the PyTorch path is used
+    shape = (4, 30)
+    x = torch.randn(shape, device="cuda")
+    residual = torch.randn(shape, device="cuda")
+    assert not xops.is_fused_bias_dropout_res_layernorm_supported(x, residual)
+    out = xops.bias_dropout_res_layernorm(x, residual)
+    ref = torch.nn.functional.layer_norm(x + residual, [30])
+    assert torch.allclose(out, ref, atol=1e-5)
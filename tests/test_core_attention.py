@@ -129,6 +129,30 @@ def test_amp_attention_sparsecs(device):
     assert r.dtype == expected_device
 
 
+@pytest.mark.parametrize("device", _devices)
+def test_fused_sparsecs_attention(device):
+    b, s, d = 8, 96, 40
+    keys_per_query = 12
+
+    q, k, v = torch.randn(3, b, s, d, device=device).unbind(0)
+    # Same number of keys for every query, so that SparseCS keeps all of them
+    columns = torch.rand(s, s, device=device).argsort(-1)[:, :keys_per_query]
+    m = torch.zeros(s, s, dtype=torch.bool, device=device)
+    m.scatter_(1, columns, True)
+
+    q1, k1, v1 = (x.clone().requires_grad_() for x in (q, k, v))
+    q2, k2, v2 = (x.clone().requires_grad_() for x in (q, k, v))
+    r_fused = scaled_dot_product_attention(q1, k1, v1, SparseCS(m, device))
+    r_ref = scaled_dot_product_attention(q2, k2, v2, m)
+    assert torch.allclose(r_fused, r_ref, atol=1e-5, rtol=1e-4)
+
+    grad = torch.randn_like(r_ref)
+    r_fused.backward(grad)
+    r_ref.backward(grad)
+    for x1, x2 in ((q1, q2), (k1, k2), (v1, v2)):
+        assert torch.allclose(x1.grad, x2.grad, atol=1e-4, rtol=1e-3)
+
+
 @pytest.mark.skipif(
     not _is_blocksparse_available, reason="Blocksparse is not available"
 )
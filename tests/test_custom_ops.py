@@ -15,6 +15,12 @@ from xformers.components.attention.core import (
     _create_random_sparsity,
     _sparse_bmm,
 )
+from xformers.sparse import _csr_ops
+from xformers.sparse.utils import (
+    _get_transpose_info,
+    _nonzero_mask_to_batched_csr_indices,
+    _nonzero_mask_to_sparse_csr_indices,
+)
 
 cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
 _devices = ["cpu", "cuda"] if torch.cuda.is_available() else ["cpu"]
@@ -89,6 +95,25 @@ def test_matmul_with_mask(device, contiguous, is_sparse):
     assert torch.allclose(res, res_gt)
 
 
+@cuda_only
+@pytest.mark.parametrize("K", [17, 3000, 9000])
+def test_matmul_with_sparse_mask_reused(K):
+    device = torch.device("cuda")
+    B, L = 4, 40
+    a = torch.rand(B, L, K, device=device)
+    b = torch.rand(B, K, L, device=device)
+    fn = torch.ops.xformers.matmul_with_mask
+
+    # the same mask gives the same results when its CSR form is reused, and
+    # a new mask doesn't reuse it
+    for _ in range(2):
+        mask = (torch.rand(B, L, L, device=device) > 0.5).to_sparse()
+        for _ in range(2):
+            res = fn(a, b, mask).to_dense()
+            res_gt = _baseline_matmul_with_sparse_mask(a, b, mask).to_dense()
+            assert torch.allclose(res, res_gt, rtol=1e-4)
+
+
 @pytest.mark.parametrize("is_sparse", [True, False])
 @pytest.mark.parametrize("contiguous", [True, False])
 @pytest.mark.parametrize("device", _devices)
@@ -214,6 +239,39 @@ def test_sddmm_csr_per_nnz(nnz):
     assert torch.allclose(res, res_gt, atol=1e-6)
 
 
+@cuda_only
+@pytest.mark.parametrize("op", ["csr_sddmm", "coo_sddmm"])
+@pytest.mark.parametrize("K", [32, 17])
+def test_sddmm_skewed_rows(op, K):
+    device = torch.device("cuda")
+    B, L, M = 4, 300, 1000
+    a = torch.rand(B, L, K, device=device)
+    b = torch.rand(B, M, K, device=device)
+    # power-law row lengths, with some empty rows
+    row_nnz = (M / torch.arange(1, L + 1, device=device) ** 1.5).long()
+    row_nnz[L // 2 :: 7] = 0
+    mask = torch.arange(M, device=device)[None] < row_nnz[:, None]
+    mask = mask[:, torch.randperm(M, device=device)]
+
+    mask_csr = xformers.components.attention.core.SparseCS(mask, device)
+    row_indices = mask_csr.row_indices
+    row_offsets = mask_csr.row_offsets
+    column_indices = mask_csr.column_indices
+
+    fn = getattr(torch.ops.xformers, op)
+    fn_gt = torch.ops.xformers.sddmm_sputnik
+
+    if op == "coo_sddmm":
+        row_coo, _ = _csr_to_coo(L, M, row_offsets, column_indices)
+        res = fn(a, b, row_indices, row_coo, column_indices)
+    else:
+        res = fn(a, b, row_indices, row_offsets, column_indices)
+    res_gt = fn_gt(a, b, row_indices, row_offsets, column_indices)
+
+    assert res.dtype == res_gt.dtype
+    assert torch.allclose(res, res_gt, atol=1e-5)
+
+
 @cuda_only
 @pytest.mark.parametrize("prob", [0.5, 1])
 @pytest.mark.parametrize("K", [32, 17])
@@ -247,6 +305,142 @@ def test_sddmm_coo(L, M, K, prob):
     assert torch.allclose(res, res_gt, atol=1e-6)
 
 
+@pytest.mark.parametrize("device", _devices)
+def test_sputnik_per_batch_patterns(device):
+    B, L, M, K = 4, 30, 20, 32
+    mask = torch.rand(B, L, M, device=device) > 0.6
+    # no empty rows, so that the dense softmax is defined
+    mask[:, :, 0] = True
+    a = torch.rand(B, L, K, device=device, requires_grad=True)
+    b = torch.rand(B, M, K, device=device, requires_grad=True)
+    v = torch.rand(B, M, K, device=device, requires_grad=True)
+
+    row_indices, row_offsets, column_indices = _nonzero_mask_to_batched_csr_indices(
+        mask, device
+    )
+    assert row_offsets.shape == (B * L + 1,)
+    transp_info = _get_transpose_info(
+        B * L, B * M, row_indices, row_offsets, column_indices
+    )
+
+    att = _csr_ops._sddmm.apply(
+        a, b, row_indices, row_offsets, column_indices, transp_info
+    )
+    prob = _csr_ops._SparseSoftmax.apply(
+        L, M, row_indices, att, row_offsets, column_indices
+    )
+    out = _csr_ops._spmm.apply(
+        v, row_indices, prob, row_offsets, column_indices, L, transp_info
+    )
+
+    a_ = a.detach().requires_grad_()
+    b_ = b.detach().requires_grad_()
+    v_ = v.detach().requires_grad_()
+    att_gt = a_ @ b_.transpose(-2, -1)
+    prob_gt = att_gt.masked_fill(~mask, float("-inf")).softmax(-1)
+    out_gt = prob_gt @ v_
+
+    assert att.shape == (1, mask.sum())
+    assert torch.allclose(att[0], att_gt[mask], atol=1e-5)
+    assert torch.allclose(prob[0], prob_gt[mask], atol=1e-5)
+    assert torch.allclose(out, out_gt, atol=1e-5)
+
+    grad = torch.randn_like(out)
+    out.backward(grad)
+    out_gt.backward(grad)
+    assert torch.allclose(a.grad, a_.grad, atol=1e-4)
+    assert torch.allclose(b.grad, b_.grad, atol=1e-4)
+    assert torch.allclose(v.grad, v_.grad, atol=1e-4)
+
+
+@pytest.mark.parametrize("p", [0.0, 0.3])
+@pytest.mark.parametrize("device", _devices)
+def test_sparse_softmax_attention(device, p):
+    B, L, M, K = 4, 30, 20, 32
+    mask = torch.rand(L, M, device=device) > 0.6
+    q = torch.rand(B, L, K, device=device, requires_grad=True)
+    k = torch.rand(B, M, K, device=device, requires_grad=True)
+    v = torch.rand(B, M, K, device=device, requires_grad=True)
+
+    row_indices, row_offsets, column_indices = _nonzero_mask_to_sparse_csr_indices(
+        mask, device
+    )
+    transp_info = _get_transpose_info(L, M, row_indices, row_offsets, column_indices)
+
+    torch.manual_seed(0)
+    out = _csr_ops._sparse_softmax_attention.apply(
+        q, k, v, row_indices, row_offsets, column_indices, transp_info, p
+    )
+
+    # the unfused chain, with the same dropout mask
+    q_ = q.detach().requires_grad_()
+    k_ = k.detach().requires_grad_()
+    v_ = v.detach().requires_grad_()
+    att = _csr_ops._sddmm.apply(
+        q_, k_, row_indices, row_offsets, column_indices, transp_info
+    )
+    prob = _csr_ops._SparseSoftmax.apply(
+        L, M, row_indices, att, row_offsets, column_indices
+    )
+    torch.manual_seed(0)
+    prob = torch.nn.functional.dropout(prob, p)
+    out_gt = _csr_ops._spmm.apply(
+        v_, row_indices, prob, row_offsets, column_indices, L, transp_info
+    )
+
+    assert torch.allclose(out, out_gt, atol=1e-5)
+
+    grad = torch.randn_like(out)
+    out.backward(grad)
+    out_gt.backward(grad)
+    assert torch.allclose(q.grad, q_.grad, atol=1e-4)
+    assert torch.allclose(k.grad, k_.grad, atol=1e-4)
+    assert torch.allclose(v.grad, v_.grad, atol=1e-4)
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_sparse_attention_compressed_indices(device):
+    B, L, M, K = 4, 30, 20, 32
+    mask = torch.rand(L, M, device=device) > 0.6
+    q = torch.rand(B, L, K, device=device)
+    k = torch.rand(B, M, K, device=device)
+    v = torch.rand(B, M, K, device=device)
+    grad = torch.randn(B, L, K, device=device)
+
+    row_indices, row_offsets, column_indices = _nonzero_mask_to_sparse_csr_indices(
+        mask, device
+    )
+    row_indices_t, row_offsets_t, column_indices_t, _ = _get_transpose_info(
+        L, M, row_indices, row_offsets, column_indices
+    )
+
+    res = []
+    for dtype in [torch.int32, torch.int16]:
+        ci, ci_t = column_indices.to(dtype), column_indices_t.to(dtype)
+        out, lse = torch.ops.xformers.sparse_attention_sputnik(
+            q, k, v, row_indices, row_offsets, ci, 0.5
+        )
+        grads = torch.ops.xformers.sparse_attention_backward_sputnik(
+            grad,
+            q,
+            k,
+            v,
+            out,
+            lse,
+            row_indices,
+            row_offsets,
+            ci,
+            row_indices_t,
+            row_offsets_t,
+            ci_t,
+            0.5,
+        )
+        res.append((out, lse, *grads))
+
+    for r32, r16 in zip(*res):
+        assert torch.equal(r32, r16)
+
+
 @pytest.mark.parametrize("device", _devices)
 def test_sddmm_sputnik_backward(device):
     contiguous = True
@@ -380,6 +574,49 @@ def test_spmm_sputnik_backward(device):
     assert torch.allclose(grad_b, b.grad, atol=1e-7)
 
 
+@pytest.mark.parametrize("activation", ["none", "relu", "gelu"])
+@pytest.mark.parametrize("device", _devices)
+def test_spmm_bias_act_sputnik(device, activation):
+    B, M, L, K = 8, 16, 30, 32
+    prob = 0.5
+
+    a = _create_random_sparsity(torch.rand(B, M, L, device=device), prob)
+    # centered so that the activations see both signs
+    b = torch.rand(B, L, K, device=device) - 0.5
+    bias = torch.rand(M, device=device) - 0.5
+    b.requires_grad_(True)
+    bias.requires_grad_(True)
+
+    a_csr = xformers.components.attention.core.SparseCS(a, device)
+    a_csr.values.requires_grad_(True)
+    act = {
+        "none": lambda x: x,
+        "relu": torch.nn.functional.relu,
+        "gelu": torch.nn.functional.gelu,
+    }[activation]
+
+    res = a_csr.spmm_bias_act(b, bias, activation)
+    grad_out = torch.rand_like(res)
+    res.backward(grad_out)
+    grad_a = a_csr.values.grad.clone()
+    grad_b = b.grad.clone()
+    grad_bias = bias.grad.clone()
+
+    a = a.to_sparse()
+    a.requires_grad_(True)
+    b.grad = None
+    bias.grad = None
+    res_gt = act(torch.bmm(a, b) + bias[:, None])
+    res_gt.backward(grad_out)
+
+    assert torch.allclose(res, res_gt, atol=1e-6)
+    assert torch.allclose(
+        grad_a, a.grad.coalesce().values().reshape_as(grad_a), atol=1e-5
+    )
+    assert torch.allclose(grad_b, b.grad, atol=1e-5)
+    assert torch.allclose(grad_bias, bias.grad, atol=1e-5)
+
+
 @cuda_only
 def test_csr_transpose():
     B, L, K = 8, 30, 40
@@ -3,8 +3,10 @@
 # This source code is licensed under the BSD license found in the
 # LICENSE file in the root directory of this source tree.
 
+import itertools
 import math
 import random
+import tempfile
 from typing import Sequence, Type
 
 import pytest
@@ -33,7 +35,9 @@ def generate_test_shapes_B_Mq_Mkv_H_K_Kv(op):
         for M in [2, 3, 15, 31, 32, 34, 68, 72, 90, 132, 136]:
             shapes.append((B, M, Mkv, H, K, K))
             shapes.append((B, Mq, M, H, K, K))
-        for _K in [1, 2, 3, 31, 34, 36, 38, 40, 64, 256 + 2, 256 + 8, 512]:
+        for _K in [
+            1, 2, 3, 31, 34, 36, 38, 40, 64, 160, 192, 256, 256 + 2, 256 + 8, 512
+        ]:
             if _K <= op.SUPPORTED_MAX_K:
                 shapes.append((B, Mq, Mkv, H, _K, _K))
         # Different value for K / Kv
@@ -388,7 +392,7 @@ def test_cu_seqlen_forward(
             )
         all_o.append(ref_attention_bmhk(all_q[-1], all_k[-1], all_v[-1], attn_bias))
 
-    out, _ = op.FORWARD_OPERATOR(
+    out, _, _, _ = op.FORWARD_OPERATOR(
         torch.cat(all_q, dim=1),
         torch.cat(all_k, dim=1),
         torch.cat(all_v, dim=1),
@@ -407,6 +411,1612 @@ def test_cu_seqlen_forward(
     )
 
 
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+def test_cu_seqlen_forward_skewed(dtype, causal):
+    # One long sequence and many short ones: most of the work is in a few
+    # tiles, which the persistent scheduler should pick up first
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    num_heads, k, scale = 3, 64, 3
+    seqlens = [2000] + [1, 17, 64, 65, 200] * 8
+
+    all_q, all_k, all_v, all_o = [], [], [], []
+    for seqlen in seqlens:
+        q, k_, v = [
+            torch.randn((1, seqlen, num_heads, k), device=device, dtype=dtype) * scale
+            for _ in range(3)
+        ]
+        attn_bias = None
+        if causal:
+            attn_bias = create_attn_bias(
+                xformers.ops.LowerTriangularMask,
+                batch_size=num_heads,
+                q_len=seqlen,
+                kv_len=seqlen,
+                dtype=dtype,
+                device=device,
+            )
+        all_q.append(q)
+        all_k.append(k_)
+        all_v.append(v)
+        all_o.append(ref_attention_bmhk(q, k_, v, attn_bias))
+    cu_seqlen = torch.tensor(
+        [0] + list(itertools.accumulate(seqlens)), dtype=torch.int32, device=device
+    )
+
+    out, _, _, _ = op.FORWARD_OPERATOR(
+        torch.cat(all_q, dim=1),
+        torch.cat(all_k, dim=1),
+        torch.cat(all_v, dim=1),
+        max_seqlen_q=max(seqlens),
+        cu_seqlens_q=cu_seqlen,
+        cu_seqlens_k=cu_seqlen,
+        compute_logsumexp=False,
+        causal=causal,
+    )
+    assert_allclose(
+        out.float(),
+        torch.cat(all_o, dim=1),
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+
+@pytest.mark.parametrize("window_size", [None, 40])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.float, torch.bfloat16])
+def test_cpu_forward_cutlass(dtype, causal, window_size):
+    if window_size is not None and not causal:
+        pytest.skip("window_size requires causal=True")
+    torch.manual_seed(0)
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    num_heads, num_kv_heads, k, kv = 4, 2, 40, 24
+    seqlens_q = [1, 70, 16, 130]
+    seqlens_k = [5, 70, 90, 130]
+
+    all_q, all_k, all_v, all_o, all_lse = [], [], [], [], []
+    for q_len, kv_len in zip(seqlens_q, seqlens_k):
+        q = torch.randn([1, q_len, num_heads, k], dtype=dtype)
+        k_ = torch.randn([1, kv_len, num_kv_heads, k], dtype=dtype)
+        v = torch.randn([1, kv_len, num_kv_heads, kv], dtype=dtype)
+        # Top-left aligned, as the CUDA kernels
+        mask = torch.ones([q_len, kv_len], dtype=torch.bool).tril()
+        if window_size is not None:
+            mask = mask.triu(-window_size + 1)
+        scores = torch.einsum(
+            "bmhk,bnhk->bhmn",
+            q.float() / k**0.5,
+            k_.float().repeat_interleave(num_heads // num_kv_heads, dim=2),
+        )
+        if causal:
+            scores = scores.masked_fill(~mask, -math.inf)
+        attn = scores.softmax(-1)
+        all_o.append(
+            torch.einsum(
+                "bhmn,bnhk->bmhk",
+                attn,
+                v.float().repeat_interleave(num_heads // num_kv_heads, dim=2),
+            )
+        )
+        all_lse.append(scores.logsumexp(-1)[0])
+        all_q.append(q)
+        all_k.append(k_)
+        all_v.append(v)
+
+    cu_seqlens_q, cu_seqlens_k = [
+        torch.tensor([0] + list(itertools.accumulate(seqlens)), dtype=torch.int32)
+        for seqlens in [seqlens_q, seqlens_k]
+    ]
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        torch.cat(all_q, dim=1),
+        torch.cat(all_k, dim=1),
+        torch.cat(all_v, dim=1),
+        max_seqlen_q=max(seqlens_q),
+        cu_seqlens_q=cu_seqlens_q,
+        cu_seqlens_k=cu_seqlens_k,
+        compute_logsumexp=True,
+        causal=causal,
+        window_size=window_size,
+    )
+    assert out.dtype == dtype
+    assert lse.shape == (len(seqlens_q), num_heads, 160)
+    assert_allclose(
+        out.float(),
+        torch.cat(all_o, dim=1),
+        "out",
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+    for seq_id, ref_lse in enumerate(all_lse):
+        q_len = ref_lse.shape[-1]
+        assert_allclose(lse[seq_id, :, :q_len], ref_lse, f"seq{seq_id} lse", 2e-4)
+        assert (lse[seq_id, :, q_len:] == math.inf).all()
+
+    # BMHK: same as the second sequence
+    out_bmhk, _, _, _ = op.FORWARD_OPERATOR(
+        all_q[1],
+        all_k[1],
+        all_v[1],
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=False,
+        causal=causal,
+        window_size=window_size,
+    )
+    assert_allclose(out_bmhk, out[:, 1:71], "out BMHK")
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+def test_cu_seqlen_forward_cuda_graph(causal):
+    # With an upper bound for `max_seqlen_q`, the op only reads the sequence
+    # lengths on the device: a captured graph works for any batch composition
+    device = "cuda"
+    dtype = torch.half
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    num_heads, k, capacity, max_num_seqs = 2, 64, 512, 8
+    query, key, value = [
+        torch.randn((1, capacity, num_heads, k), device=device, dtype=dtype)
+        for _ in range(3)
+    ]
+    cu_seqlen = torch.zeros([max_num_seqs + 1], dtype=torch.int32, device=device)
+
+    def run():
+        return op.FORWARD_OPERATOR(
+            query,
+            key,
+            value,
+            max_seqlen_q=capacity,
+            cu_seqlens_q=cu_seqlen,
+            cu_seqlens_k=cu_seqlen,
+            compute_logsumexp=False,
+            causal=causal,
+        )[0]
+
+    # Warmup on a side stream before capturing
+    stream = torch.cuda.Stream()
+    stream.wait_stream(torch.cuda.current_stream())
+    with torch.cuda.stream(stream):
+        run()
+    torch.cuda.current_stream().wait_stream(stream)
+    graph = torch.cuda.CUDAGraph()
+    with torch.cuda.graph(graph):
+        out = run()
+
+    for seqlens in [
+        [300, 1, 17, 64, 65, 0, 3, 1],
+        [64] * 8,
+        [500, 12, 0, 0, 0, 0, 0, 0],
+    ]:
+        cu_seqlen.copy_(
+            torch.tensor([0] + list(itertools.accumulate(seqlens)), dtype=torch.int32)
+        )
+        graph.replay()
+        start = 0
+        for seqlen in seqlens:
+            if seqlen == 0:
+                continue
+            q, k_, v = [x[:, start : start + seqlen] for x in [query, key, value]]
+            attn_bias = None
+            if causal:
+                attn_bias = create_attn_bias(
+                    xformers.ops.LowerTriangularMask,
+                    batch_size=num_heads,
+                    q_len=seqlen,
+                    kv_len=seqlen,
+                    dtype=dtype,
+                    device=device,
+                )
+            assert_allclose(
+                out[:, start : start + seqlen].float(),
+                ref_attention_bmhk(q, k_, v, attn_bias),
+                atol=op.FORWARD_ERROR_ATOL[dtype],
+                rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+            )
+            start += seqlen
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [32, 64, 128])
+def test_cu_seqlen_backward(k, dtype, causal):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    r = random.Random(k)
+    torch.manual_seed(r.randint(0, 128))
+    num_heads, max_q_len, max_kv_len = 2, 200, 300
+    scale = 3
+
+    q_lens = [r.randint(1, max_q_len) for _ in range(6)]
+    kv_lens = [r.randint(1, max_kv_len) for _ in range(6)]
+    cu_seqlen_q = [0]
+    cu_seqlen_k = [0]
+    for q_len, kv_len in zip(q_lens, kv_lens):
+        cu_seqlen_q += [cu_seqlen_q[-1] + q_len]
+        cu_seqlen_k += [cu_seqlen_k[-1] + kv_len]
+    cu_seqlen_q = torch.tensor(cu_seqlen_q, dtype=torch.int32, device=device)
+    cu_seqlen_k = torch.tensor(cu_seqlen_k, dtype=torch.int32, device=device)
+
+    query = torch.randn((1, sum(q_lens), num_heads, k), device=device, dtype=dtype)
+    key = torch.randn((1, sum(kv_lens), num_heads, k), device=device, dtype=dtype)
+    value = torch.randn((1, sum(kv_lens), num_heads, k), device=device, dtype=dtype)
+    query, key, value = query * scale, key * scale, value * scale
+    if not op.supports(
+        xformers.ops.AttentionOpDispatch.from_arguments(
+            query=query, key=key, value=value
+        )
+    ):
+        pytest.skip("unsupported configuration")
+
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=max(q_lens),
+        cu_seqlens_q=cu_seqlen_q,
+        cu_seqlens_k=cu_seqlen_k,
+        compute_logsumexp=True,
+        causal=causal,
+    )
+    grad_out = torch.randn_like(out)
+    grad_q, grad_k, grad_v = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out,
+        query,
+        key,
+        value,
+        lse,
+        out,
+        causal=causal,
+        cu_seqlens_q=cu_seqlen_q,
+        cu_seqlens_k=cu_seqlen_k,
+        max_seqlen_q=max(q_lens),
+    )
+
+    # Same tolerances as `test_backward`
+    atol, rtol = 2e-4 + 2e-6 * k * max_kv_len * math.sqrt(max_q_len), 1e-4
+    if dtype is torch.half:
+        atol, rtol = 5e-2 * 1.4 ** (max_kv_len // 64), 2e-2
+    if dtype is torch.bfloat16:
+        atol, rtol = 0.5 * 1.4 ** (max_kv_len // 64), 0.1
+    for seq_id, (q_len, kv_len) in enumerate(zip(q_lens, kv_lens)):
+        q_slice = slice(cu_seqlen_q[seq_id], cu_seqlen_q[seq_id + 1])
+        kv_slice = slice(cu_seqlen_k[seq_id], cu_seqlen_k[seq_id + 1])
+        query_ref, key_ref, value_ref = [
+            x[:, s].detach().clone().requires_grad_(True)
+            for x, s in [(query, q_slice), (key, kv_slice), (value, kv_slice)]
+        ]
+        attn_bias = None
+        if causal:
+            attn_bias = create_attn_bias(
+                xformers.ops.LowerTriangularMask,
+                batch_size=num_heads,
+                q_len=q_len,
+                kv_len=kv_len,
+                dtype=dtype,
+                device=device,
+            )
+        ref = ref_attention_bmhk(query_ref, key_ref, value_ref, attn_bias)
+        ref.backward(grad_out[:, q_slice])
+        for name, grad, x_ref in [
+            ("query", grad_q[:, q_slice], query_ref),
+            ("key", grad_k[:, kv_slice], key_ref),
+            ("value", grad_v[:, kv_slice], value_ref),
+        ]:
+            assert_allclose(grad, x_ref.grad, f"seq{seq_id} {name} grad", atol, rtol)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [32, 64, 128])
+@pytest.mark.parametrize("page_size", [128, 256])
+def test_paged_kv_forward(page_size, k, dtype, causal):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    r = random.Random(page_size + k)
+    torch.manual_seed(r.randint(0, 128))
+    batch_size, num_heads, q_len, max_pages = 5, 3, 32, 4
+    num_pages = batch_size * max_pages + 3
+    scale = 3
+
+    k_pages = torch.randn(
+        [num_pages, page_size, num_heads, k], device=device, dtype=dtype
+    )
+    v_pages = torch.randn(
+        [num_pages, page_size, num_heads, k], device=device, dtype=dtype
+    )
+    query = (
+        torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+        * scale
+    )
+    # Pages are shuffled, and some of them are not used
+    block_tables = torch.randperm(num_pages, device=device, dtype=torch.int32)
+    block_tables = block_tables[: batch_size * max_pages].view(batch_size, max_pages)
+    seqlens_k = [r.randint(q_len, max_pages * page_size) for _ in range(batch_size)]
+
+    out, _, _, _ = op.FORWARD_OPERATOR(
+        query,
+        k_pages,
+        v_pages,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=False,
+        causal=causal,
+        block_tables=block_tables,
+        seqlens_k=torch.tensor(seqlens_k, dtype=torch.int32, device=device),
+    )
+    for b, kv_len in enumerate(seqlens_k):
+        # Gather the pages of this sequence into a contiguous K/V
+        key = k_pages[block_tables[b].long()].flatten(0, 1)[:kv_len]
+        value = v_pages[block_tables[b].long()].flatten(0, 1)[:kv_len]
+        attn_bias = None
+        if causal:
+            attn_bias = create_attn_bias(
+                xformers.ops.LowerTriangularMask,
+                batch_size=num_heads,
+                q_len=q_len,
+                kv_len=kv_len,
+                dtype=dtype,
+                device=device,
+            )
+        ref = ref_attention_bmhk(query[b : b + 1], key[None], value[None], attn_bias)
+        assert_allclose(
+            out[b : b + 1].float(),
+            ref,
+            atol=op.FORWARD_ERROR_ATOL[dtype],
+            rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+        )
+
+
+@cuda_only
+@pytest.mark.parametrize("paged", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [64, 128, 256])
+@pytest.mark.parametrize("q_len", [1, 4])
+def test_decode_forward(q_len, k, dtype, paged):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(q_len + k)
+    batch_size, num_heads, num_kv_heads, page_size, max_pages = 3, 8, 2, 64, 40
+    query = torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+    k_pages, v_pages = [
+        torch.randn(
+            [batch_size * max_pages, page_size, num_kv_heads, k],
+            device=device,
+            dtype=dtype,
+        )
+        for _ in range(2)
+    ]
+    block_tables = torch.randperm(batch_size * max_pages, device=device)
+    block_tables = block_tables.view(batch_size, max_pages).int()
+    seqlens_k = [2000, 7, max_pages * page_size]
+    kwargs = {}
+    if paged:
+        key, value = k_pages, v_pages
+        kwargs["block_tables"] = block_tables
+        kwargs["seqlens_k"] = torch.tensor(seqlens_k, dtype=torch.int32, device=device)
+    else:
+        seqlens_k = [max_pages * page_size] * batch_size
+        key, value = [
+            x[block_tables.long()].flatten(1, 2) for x in [k_pages, v_pages]
+        ]
+
+    xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=True,
+        causal=False,
+        **kwargs,
+    )
+    stats = xformers.ops.memory_efficient_attention_kernel_stats()
+    assert any(name.startswith("cutlassF_decode_") for name in stats["kernels"])
+
+    for b, kv_len in enumerate(seqlens_k):
+        key_b, value_b = [
+            x[block_tables[b].long()].flatten(0, 1)[None, :kv_len]
+            for x in [k_pages, v_pages]
+        ]
+        key_b, value_b = [
+            x.repeat_interleave(num_heads // num_kv_heads, dim=2)
+            for x in [key_b, value_b]
+        ]
+        ref = ref_attention_bmhk(query[b : b + 1], key_b, value_b, None)
+        assert_allclose(
+            out[b : b + 1].float(),
+            ref,
+            atol=op.FORWARD_ERROR_ATOL[dtype],
+            rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+        )
+        scores = torch.einsum(
+            "mhk,nhk->hmn", query[b].float(), key_b[0].float()
+        ) / math.sqrt(k)
+        assert_allclose(lse[b, :, :q_len], scores.logsumexp(-1), atol=2e-3)
+    assert (lse[:, :, q_len:] == math.inf).all()
+
+
+@cuda_only
+@pytest.mark.parametrize("shared_kv", [False, True])
+def test_decode_l2_persist_kv(shared_kv):
+    # The L2 hints / window only change where K/V are cached
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(0)
+    B, H, K, kv_len = 4, 8, 128, 3000
+    query = torch.randn([B, 1, H, K], device="cuda", dtype=dtype)
+    key, value = [
+        torch.randn([1 if shared_kv else B, kv_len, H, K], device="cuda", dtype=dtype)
+        for _ in range(2)
+    ]
+    key, value = key.expand(B, -1, -1, -1), value.expand(B, -1, -1, -1)
+    outs = [
+        op.FORWARD_OPERATOR(
+            query,
+            key,
+            value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=None,
+            compute_logsumexp=False,
+            causal=False,
+            l2_persist_kv=l2_persist_kv,
+        )[0]
+        for l2_persist_kv in [False, True]
+    ]
+    assert torch.equal(outs[0], outs[1])
+    out_ref = ref_attention(query, key, value)
+    assert_allclose(
+        outs[0].float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("num_splits_key", [None, 1, 3, 16])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [64, 128, 256])
+@pytest.mark.parametrize("q_len", [1, 16])
+def test_split_key_forward(q_len, k, dtype, causal, num_splits_key):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    batch_size, num_heads, kv_len = 2, 3, 4000
+    torch.manual_seed(q_len + k)
+    scale = 3
+    query, key, value = [
+        torch.randn([batch_size, seqlen, num_heads, k], device=device, dtype=dtype)
+        * scale
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+
+    # The keys are only split automatically without the logsumexp
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=num_splits_key is not None,
+        causal=causal,
+        num_splits_key=num_splits_key,
+    )
+    attn_bias = None
+    if causal:
+        attn_bias = create_attn_bias(
+            xformers.ops.LowerTriangularMask,
+            batch_size=batch_size * num_heads,
+            q_len=q_len,
+            kv_len=kv_len,
+            dtype=dtype,
+            device=device,
+        )
+    ref = ref_attention_bmhk(query, key, value, attn_bias)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+    if num_splits_key is None:
+        return
+
+    # Compare the logsumexp with the one computed without splitting the keys
+    _, ref_lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=True,
+        causal=causal,
+        num_splits_key=1,
+    )
+    assert_allclose(lse[:, :, :q_len], ref_lse[:, :, :q_len], atol=1e-3)
+
+
+@cuda_only
+def test_split_key_forward_masked_rows():
+    # The queries whose keys are all masked have no split to reduce
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    batch_size, num_heads, q_len, kv_len, k = 1, 2, 8, 2000, 64
+    torch.manual_seed(0)
+    query, key, value = [
+        torch.randn([batch_size, seqlen, num_heads, k], device=device)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    attn_bias = torch.zeros([batch_size, num_heads, q_len, kv_len], device=device)
+    attn_bias[:, :, ::2] = float("-inf")
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        max_seqlen_q=None,
+        compute_logsumexp=True,
+        causal=False,
+        attn_bias=attn_bias,
+        num_splits_key=4,
+    )
+    assert (out[:, ::2] == 0).all()
+    assert (lse[:, :, :q_len:2] == -math.inf).all()
+    ref = ref_attention_bmhk(
+        query[:, 1::2],
+        key,
+        value,
+        attn_bias[:, :, 1::2].reshape([batch_size * num_heads, q_len // 2, kv_len]),
+    )
+    assert_allclose(out[:, 1::2], ref, atol=op.FORWARD_ERROR_ATOL[torch.float])
+
+
+@cuda_only
+@pytest.mark.parametrize("num_splits_key", [None, 1, 4])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [64, 256])
+@pytest.mark.parametrize("q_len", [1, 200])
+def test_forward_out(q_len, k, dtype, num_splits_key):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(q_len + k)
+    batch_size, num_heads, kv_len, scale = 2, 3, 1000, 3
+    query = torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+    key = torch.randn([batch_size, kv_len, num_heads, k], device=device, dtype=dtype)
+    value = torch.randn([batch_size, kv_len, num_heads, k], device=device, dtype=dtype)
+    query, key, value = query * scale, key * scale, value * scale
+
+    # Write directly into a slice of a larger [B, M, H * K + 16] buffer
+    buffer = torch.zeros(
+        [batch_size, q_len, num_heads * k + 16], device=device, dtype=dtype
+    )
+    out_view = buffer[:, :, 16:].unflatten(-1, (num_heads, k))
+    output_accum = torch.empty(
+        [batch_size, q_len, num_heads, 2 * k], device=device, dtype=torch.float
+    )[..., :k]
+    out, _, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=False,
+        causal=False,
+        num_splits_key=num_splits_key,
+        out=out_view,
+        output_accum=output_accum if num_splits_key == 1 else None,
+    )
+    assert out.data_ptr() == out_view.data_ptr()
+    assert (buffer[:, :, :16] == 0).all()
+    ref = ref_attention_bmhk(query, key, value, None)
+    assert_allclose(
+        buffer[:, :, 16:].unflatten(-1, (num_heads, k)).float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+
+def test_qkvpacked_unsupported():
+    qkv = torch.randn([2, 10, 3, 4, 32])
+    with pytest.raises(ValueError, match="Expected shape"):
+        xformers.ops.memory_efficient_attention_qkvpacked(qkv[:, :, :2])
+    with pytest.raises(ValueError, match="dtype and the device"):
+        xformers.ops.memory_efficient_attention_qkvpacked(
+            qkv, torch.zeros([8, 10, 10], dtype=torch.half)
+        )
+    # The cutlass kernels are CUDA-only
+    with pytest.raises(NotImplementedError, match="does not support"):
+        xformers.ops.memory_efficient_attention_qkvpacked(qkv)
+
+
+@cuda_only
+@pytest.mark.parametrize("attn_bias_type", [None, xformers.ops.LowerTriangularMask])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+@pytest.mark.parametrize("k", [32, 128])
+def test_qkvpacked(k, dtype, attn_bias_type):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(k)
+    batch_size, seqlen, num_heads = 2, 100, 3
+    qkv = torch.randn(
+        [batch_size, seqlen, 3, num_heads, k], device="cuda", dtype=dtype
+    ).requires_grad_(True)
+    attn_bias = create_attn_bias(
+        attn_bias_type,
+        batch_size=batch_size * num_heads,
+        q_len=seqlen,
+        kv_len=seqlen,
+        dtype=dtype,
+        device="cuda",
+    )
+    out = xformers.ops.memory_efficient_attention_qkvpacked(qkv, attn_bias)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+    grad_qkv = qkv.grad
+    assert grad_qkv.shape == qkv.shape
+    assert grad_qkv.is_contiguous()
+
+    qkv.grad = None
+    query, key, value = qkv.unbind(2)
+    out_ref = ref_attention_bmhk(query, key, value, attn_bias)
+    out_ref.backward(grad_out)
+    assert_allclose(
+        out.float(),
+        out_ref.float(),
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+    atol = 2e-4 + 2e-6 * k * seqlen
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2
+        rtol = 5e-2
+    assert_allclose(grad_qkv, qkv.grad, "grad_qkv", atol=atol, rtol=rtol)
+
+
+@cuda_only
+@pytest.mark.parametrize("attn_bias_type", [None, xformers.ops.LowerTriangularMask])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+def test_grouped_attention(dtype, attn_bias_type):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    # (batch, seqlen_q, seqlen_k, num_heads, K): two groups of shapes
+    shapes = [(2, 50, 50, 4, 64), (1, 197, 120, 4, 64), (3, 10, 30, 4, 64)]
+    shapes += [(2, 64, 64, 2, 128), (1, 33, 77, 2, 128)]
+    problems = [
+        [
+            torch.randn([b, seqlen, h, k], device="cuda", dtype=dtype).requires_grad_(
+                True
+            )
+            for seqlen in [m, n, n]
+        ]
+        for b, m, n, h, k in shapes
+    ]
+    attn_bias = None if attn_bias_type is None else attn_bias_type()
+    xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    outs = xformers.ops.memory_efficient_attention_grouped(
+        *[[p[i] for p in problems] for i in range(3)], attn_bias=attn_bias
+    )
+    # A single forward launch per group
+    stats = xformers.ops.memory_efficient_attention_kernel_stats()
+    assert sum(stats["kernels"].values()) == 2
+    grad_outs = [torch.randn_like(out) for out in outs]
+    torch.autograd.backward(outs, grad_outs)
+
+    atol = 2e-4 + 2e-6 * 128 * 200
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2
+        rtol = 5e-2
+    for (query, key, value), out, grad_out in zip(problems, outs, grad_outs):
+        grads = [x.grad for x in [query, key, value]]
+        query.grad, key.grad, value.grad = None, None, None
+        out_ref = xformers.ops.memory_efficient_attention(
+            query, key, value, attn_bias, op=op
+        )
+        out_ref.backward(grad_out)
+        assert_allclose(
+            out.float(),
+            out_ref.float(),
+            atol=op.FORWARD_ERROR_ATOL[dtype],
+            rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+        )
+        for name, grad, x in zip(["query", "key", "value"], grads, [query, key, value]):
+            assert_allclose(grad, x.grad, f"{name} grad", atol=atol, rtol=rtol)
+
+
+@cuda_only
+@pytest.mark.skipif(
+    not hasattr(torch, "jagged"), reason="requires jagged nested tensors (PyTorch 2.2+)"
+)
+@pytest.mark.parametrize("scale,softcap", [(None, None), (0.3, 20.0)])
+@pytest.mark.parametrize("attn_bias_type", [None, xformers.ops.LowerTriangularMask])
+def test_nested_attention(attn_bias_type, scale, softcap):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(0)
+    seqlens_q, seqlens_k, h, k = [50, 197, 10], [50, 120, 30], 4, 64
+    sequences = [
+        [
+            torch.randn([1, seqlen, h, k], device="cuda", dtype=dtype).requires_grad_()
+            for seqlen in [m, n, n]
+        ]
+        for m, n in zip(seqlens_q, seqlens_k)
+    ]
+    # Jagged nested tensors of shape [batch, (seqlen), h, k]
+    query, key, value = [
+        torch.nested.nested_tensor(
+            [s[i][0].detach() for s in sequences], layout=torch.jagged
+        ).requires_grad_()
+        for i in range(3)
+    ]
+    attn_bias = None if attn_bias_type is None else attn_bias_type()
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, scale=scale, softcap=softcap
+    )
+    assert out.is_nested
+    grad_out = torch.randn_like(out.values())
+    out.values().backward(grad_out)
+
+    for i, (q, k_, v) in enumerate(sequences):
+        out_ref = xformers.ops.memory_efficient_attention(
+            q, k_, v, attn_bias, op=op, scale=scale, softcap=softcap
+        )
+        start = sum(seqlens_q[:i])
+        out_ref.backward(grad_out[None, start : start + seqlens_q[i]])
+        assert_allclose(
+            out.values()[start : start + seqlens_q[i]].float(),
+            out_ref[0].float(),
+            atol=op.FORWARD_ERROR_ATOL[dtype],
+            rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+        )
+        for x, x_ref, seqlens in [
+            (query, q, seqlens_q),
+            (key, k_, seqlens_k),
+            (value, v, seqlens_k),
+        ]:
+            grad = x.grad.values()[sum(seqlens[:i]) : sum(seqlens[: i + 1])]
+            assert_allclose(grad, x_ref.grad[0], "grad", atol=5e-2, rtol=5e-2)
+
+
+@cuda_only
+@pytest.mark.skipif(
+    not hasattr(torch.nested, "narrow"), reason="requires torch.nested.narrow"
+)
+def test_nested_attention_with_holes():
+    x = torch.randn([3, 20, 4, 64], device="cuda", dtype=torch.half)
+    # The sequences are strided in the values of the nested tensor
+    query = torch.nested.narrow(
+        x,
+        dim=1,
+        start=0,
+        length=torch.tensor([5, 10, 20], device="cuda"),
+        layout=torch.jagged,
+    )
+    with pytest.raises(NotImplementedError, match="holes"):
+        xformers.ops.memory_efficient_attention(query, query, query)
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_unpad_inputs(device):
+    torch.manual_seed(0)
+    B, M, h, k = 3, 300, 2, 5
+    padding_mask = torch.rand([B, M], device=device) > 0.3
+    padding_mask[1] = False
+    x, y = [
+        torch.randn([B, M, h, k], device=device).requires_grad_() for _ in range(2)
+    ]
+    (x_unpad, y_unpad), cu_seqlens, max_seqlen = xformers.ops.unpad_inputs(
+        [x, y], padding_mask
+    )
+    seqlens = padding_mask.sum(1)
+    assert cu_seqlens.tolist() == [0] + seqlens.cumsum(0).tolist()
+    assert max_seqlen == M
+    total = cu_seqlens[-1].item()
+    for out, ref in [(x_unpad, x), (y_unpad, y)]:
+        assert out.shape == (1, B * M, h, k)
+        assert torch.equal(out[0, :total], ref[padding_mask])
+        assert not out[0, total:].any()
+
+    out = xformers.ops.pad_output(x_unpad * 2, padding_mask, cu_seqlens)
+    assert torch.equal(out, x * 2 * padding_mask[:, :, None, None])
+    out.sum().backward()
+    assert torch.equal(x.grad, 2.0 * padding_mask[:, :, None, None].expand_as(x))
+
+
+@cuda_only
+@pytest.mark.parametrize("softcap", [None, 5.0])
+@pytest.mark.parametrize("attn_bias_type", [None, torch.Tensor])
+def test_custom_scale_softcap(attn_bias_type, softcap):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.float
+    torch.manual_seed(0)
+    B, M, N, H, K, scale = 2, 97, 130, 3, 40, 0.7
+    query, key, value = [
+        torch.randn([B, seqlen, H, K], device="cuda", dtype=dtype).requires_grad_()
+        for seqlen in [M, N, N]
+    ]
+    attn_bias = None
+    if attn_bias_type is torch.Tensor:
+        attn_bias = torch.randn([B, H, M, N], device="cuda", dtype=dtype)
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, op=op, scale=scale, softcap=softcap
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [query, key, value], grad_out)
+
+    scores = torch.einsum("bmhk,bnhk->bhmn", query, key) * scale
+    if softcap is not None:
+        scores = softcap * torch.tanh(scores / softcap)
+    if attn_bias is not None:
+        scores = scores + attn_bias
+    out_ref = torch.einsum("bhmn,bnhk->bmhk", scores.softmax(-1), value)
+    grads_ref = torch.autograd.grad(out_ref, [query, key, value], grad_out)
+    assert_allclose(out, out_ref, "out", atol=op.FORWARD_ERROR_ATOL[dtype])
+    for name, grad, grad_ref in zip(["query", "key", "value"], grads, grads_ref):
+        assert_allclose(grad, grad_ref, f"{name} grad", atol=2e-3, rtol=1e-3)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+@pytest.mark.parametrize("q_len", [1, 16])
+def test_shared_prefix(q_len, dtype, causal):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(q_len)
+    batch_size, num_heads, num_kv_heads, k = 6, 4, 2, 64
+    prefix_len, suffix_len = 1000, q_len + 20
+    query = torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+    prefix_key, prefix_value = [
+        torch.randn([1, prefix_len, num_kv_heads, k], device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    suffix_key, suffix_value = [
+        torch.randn(
+            [batch_size, suffix_len, num_kv_heads, k], device=device, dtype=dtype
+        )
+        for _ in range(2)
+    ]
+    out = xformers.ops.memory_efficient_attention_shared_prefix(
+        query, prefix_key, prefix_value, suffix_key, suffix_value, causal=causal
+    )
+
+    key, value = [
+        torch.cat([prefix.expand(batch_size, -1, -1, -1), suffix], dim=1)
+        for prefix, suffix in [(prefix_key, suffix_key), (prefix_value, suffix_value)]
+    ]
+    key, value = [
+        x.repeat_interleave(num_heads // num_kv_heads, dim=2) for x in [key, value]
+    ]
+    attn_bias = None
+    if causal:
+        # Causal over the suffix only
+        attn_bias = torch.zeros(
+            [q_len, prefix_len + suffix_len], device=device, dtype=torch.float
+        )
+        attn_bias[:, prefix_len:] = torch.triu(
+            torch.full([q_len, suffix_len], float("-inf"), device=device), diagonal=1
+        )
+        attn_bias = attn_bias.expand(batch_size * num_heads, -1, -1)
+    ref = ref_attention_bmhk(query, key, value, attn_bias)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+@pytest.mark.parametrize("num_inputs", [1, 3, 20])
+def test_merge_attentions(num_inputs, dtype):
+    device = "cuda"
+    torch.manual_seed(num_inputs)
+    B, M, H, Kv = 2, 37, 3, 40
+    outs = [
+        torch.randn([B, M, H, Kv], device=device, dtype=dtype, requires_grad=True)
+        for _ in range(num_inputs)
+    ]
+    # Padded like the logsumexp of the cutlass forward
+    lses = [
+        (torch.randn([B, H, 64], device=device) * 4)[:, :, :M]
+        for _ in range(num_inputs)
+    ]
+    # Sets without any key
+    lses[0][:, :, :5] = float("-inf")
+    if num_inputs == 1:
+        lses[0][:, 1, 5:] = float("-inf")
+    for lse in lses:
+        lse.requires_grad_(True)
+
+    out, lse = xformers.ops.merge_attentions(outs, lses)
+    ref_lse = torch.stack([x.float() for x in lses]).logsumexp(0)
+    ref_out = sum(
+        torch.exp(lse_i - ref_lse).nan_to_num(0.0).transpose(1, 2).unsqueeze(-1)
+        * out_i.float()
+        for out_i, lse_i in zip(outs, lses)
+    )
+    atol, rtol = (4e-3, 1e-2) if dtype == torch.half else (1e-5, 1e-5)
+    assert out.dtype == dtype and lse.shape == (B, H, M)
+    assert_allclose(out.float(), ref_out, "out", atol=atol, rtol=rtol)
+    assert torch.equal(lse.isinf(), ref_lse.isinf())
+    assert_allclose(lse.nan_to_num(0.0), ref_lse.nan_to_num(0.0), "lse")
+
+    grad_out = torch.randn_like(out)
+    grad_lse = torch.randn_like(lse)
+    grads = torch.autograd.grad([out, lse], [*outs, *lses], [grad_out, grad_lse])
+    ref_grads = torch.autograd.grad(
+        [ref_out, ref_lse.nan_to_num(0.0)],
+        [*outs, *lses],
+        [grad_out.float(), grad_lse],
+    )
+    for i, (grad, ref_grad) in enumerate(zip(grads, ref_grads)):
+        assert_allclose(
+            grad.float(),
+            ref_grad.float().nan_to_num(0.0),
+            f"grad {i}",
+            atol=atol * 10,
+            rtol=rtol,
+        )
+
+
+def _ring_attention_worker(rank, world_size, init_url, causal, shard_len):
+    torch.distributed.init_process_group(
+        backend="nccl", rank=rank, world_size=world_size, init_method=init_url
+    )
+    torch.cuda.set_device(rank)
+    device = f"cuda:{rank}"
+    torch.manual_seed(0)
+    B, M, H, Hkv, K = 2, shard_len * world_size, 4, 2, 64
+    query = torch.randn([B, M, H, K], device=device, dtype=torch.half)
+    key, value = [
+        torch.randn([B, M, Hkv, K], device=device, dtype=torch.half)
+        for _ in range(2)
+    ]
+    grad_out = torch.randn([B, M, H, K], device=device, dtype=torch.half)
+    shards = [
+        x.chunk(world_size, dim=1)[rank].detach().clone().requires_grad_(True)
+        for x in [query, key, value]
+    ]
+    out = xformers.ops.ring_attention(*shards, causal=causal)
+    out.backward(grad_out.chunk(world_size, dim=1)[rank])
+
+    query, key, value = [x.float().requires_grad_(True) for x in [query, key, value]]
+    attn_bias = None
+    if causal:
+        attn_bias = torch.triu(
+            torch.full([M, M], float("-inf"), device=device), diagonal=1
+        ).expand(B * H, -1, -1)
+    ref = ref_attention_bmhk(
+        query,
+        key.repeat_interleave(H // Hkv, dim=2),
+        value.repeat_interleave(H // Hkv, dim=2),
+        attn_bias,
+    )
+    ref.backward(grad_out.float())
+    assert_allclose(out.float(), ref.chunk(world_size, dim=1)[rank], "out", 2e-3)
+    for name, shard, x in zip(["query", "key", "value"], shards, [query, key, value]):
+        assert_allclose(
+            shard.grad.float(),
+            x.grad.chunk(world_size, dim=1)[rank],
+            f"grad_{name}",
+            atol=2e-2,
+            rtol=1e-2,
+        )
+    torch.distributed.destroy_process_group()
+
+
+@cuda_only
+@pytest.mark.skipif(torch.cuda.device_count() < 2, reason="requires 2 GPUs")
+# 100: the LSE of every shard is padded
+@pytest.mark.parametrize("shard_len", [96, 100])
+@pytest.mark.parametrize("causal", [False, True])
+def test_ring_attention(causal, shard_len):
+    world_size = min(torch.cuda.device_count(), 4)
+    init_url = "file://" + tempfile.mkstemp()[1]
+    torch.multiprocessing.spawn(
+        _ring_attention_worker,
+        args=(world_size, init_url, causal, shard_len),
+        nprocs=world_size,
+    )
+
+
+@cuda_only
+def test_kernel_stats():
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    # The key rows are not aligned on 8 halfs
+    key = torch.randn([1, 64, 1, 65], device="cuda", dtype=torch.half)[..., :64]
+    query = torch.randn([1, 64, 1, 64], device="cuda", dtype=torch.half)
+    value = torch.randn([1, 64, 1, 64], device="cuda", dtype=torch.half)
+    xformers.ops.memory_efficient_attention(query, key, value, op=op)
+    xformers.ops.memory_efficient_attention(query, key.contiguous(), value, op=op)
+
+    stats = xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    fwd_kernels = {
+        name: count
+        for name, count in stats["kernels"].items()
+        if name.startswith("cutlassF_f16_")
+    }
+    assert sum(fwd_kernels.values()) == 2, stats
+    assert any("_notaligned_64x64_" in name for name in fwd_kernels), stats
+    assert any("_aligned_64x64_" in name for name in fwd_kernels), stats
+    assert stats["fallbacks"] == {"cutlassF:unaligned_key": 1}, stats
+    assert xformers.ops.memory_efficient_attention_kernel_stats() == {
+        "kernels": {},
+        "fallbacks": {},
+    }
+
+
+@cuda_only
+@pytest.mark.parametrize("attn_bias_type", [None, xformers.ops.LowerTriangularMask])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [32, 128, 256])
+@pytest.mark.parametrize("num_heads,num_kv_heads", [(8, 1), (8, 2), (6, 6)])
+def test_grouped_query_attention(num_heads, num_kv_heads, k, dtype, attn_bias_type):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    batch_size, q_len, kv_len = 2, 100, 140
+    torch.manual_seed(num_heads * num_kv_heads + k)
+    scale = 3
+    query = torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+    key = torch.randn([batch_size, kv_len, num_kv_heads, k], device=device, dtype=dtype)
+    value = torch.randn(
+        [batch_size, kv_len, num_kv_heads, k], device=device, dtype=dtype
+    )
+    query, key, value = [(x * scale).requires_grad_(True) for x in [query, key, value]]
+    attn_bias = create_attn_bias(
+        attn_bias_type,
+        batch_size=batch_size * num_heads,
+        q_len=q_len,
+        kv_len=kv_len,
+        dtype=dtype,
+        device=device,
+    )
+    out = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, op=op)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+
+    # Reference: materialize the key/value heads for every query head
+    query_ref, key_ref, value_ref = [
+        x.detach().clone().requires_grad_(True) for x in [query, key, value]
+    ]
+    ref = ref_attention_bmhk(
+        query_ref,
+        key_ref.repeat_interleave(num_heads // num_kv_heads, dim=2),
+        value_ref.repeat_interleave(num_heads // num_kv_heads, dim=2),
+        attn_bias,
+    )
+    ref.backward(grad_out)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+    # Same tolerances as `test_backward`, but dK/dV sum over the group
+    atol = 2e-4 + 2e-6 * k * kv_len * math.sqrt(q_len)
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2
+        rtol = 2e-2
+        atol *= 1.4 ** (max(q_len, kv_len) // 64)
+    if dtype is torch.bfloat16:
+        atol = 0.5
+        rtol = 0.1
+        atol *= 1.4 ** (max(q_len, kv_len) // 64)
+    for name, x, x_ref in [
+        ("query", query, query_ref),
+        ("key", key, key_ref),
+        ("value", value, value_ref),
+    ]:
+        assert x.grad.shape == x.shape
+        group_atol = atol if name == "query" else atol * num_heads // num_kv_heads
+        assert_allclose(x.grad, x_ref.grad, f"{name} grad", group_atol, rtol)
+
+
+@cuda_only
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("k", [32, 128])
+@pytest.mark.parametrize("window_size", [1, 40, 128, 1000])
+def test_sliding_window(window_size, k, dtype):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    batch_size, num_heads, q_len, kv_len = 2, 3, 300, 320
+    torch.manual_seed(window_size + k)
+    scale = 3
+    query, key, value = [
+        (
+            torch.randn([batch_size, seqlen, num_heads, k], device=device, dtype=dtype)
+            * scale
+        ).requires_grad_(True)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    attn_bias = xformers.ops.LowerTriangularMaskWithWindow(
+        window_size, [batch_size * num_heads, q_len, kv_len], dtype=dtype, device=device
+    )
+    out = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, op=op)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+
+    query_ref, key_ref, value_ref = [
+        x.detach().clone().requires_grad_(True) for x in [query, key, value]
+    ]
+    ref = ref_attention_bmhk(query_ref, key_ref, value_ref, attn_bias)
+    ref.backward(grad_out)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+    # Same tolerances as `test_backward`
+    atol = 2e-4 + 2e-6 * k * kv_len * math.sqrt(q_len)
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2
+        rtol = 2e-2
+        atol *= 1.4 ** (max(q_len, kv_len) // 64)
+    if dtype is torch.bfloat16:
+        atol = 0.5
+        rtol = 0.1
+        atol *= 1.4 ** (max(q_len, kv_len) // 64)
+    for name, x, x_ref in [
+        ("query", query, query_ref),
+        ("key", key, key_ref),
+        ("value", value, value_ref),
+    ]:
+        assert_allclose(x.grad, x_ref.grad, f"{name} grad", atol, rtol)
+
+
+def apply_rope_ref(x, cos, sin, positions=None):
+    # x: [B, M, H, K] / cos, sin: [max_position, K] / positions: [B, M]
+    if positions is None:
+        cos = cos[: x.shape[1], None, :]
+        sin = sin[: x.shape[1], None, :]
+    else:
+        cos = cos[positions.long()][:, :, None, :]
+        sin = sin[positions.long()][:, :, None, :]
+    x1, x2 = x.float().chunk(2, dim=-1)
+    return (x.float() * cos + torch.cat([-x2, x1], dim=-1) * sin).to(x.dtype)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize(
+    "dtype", list(xformers.ops.MemoryEfficientAttentionCutlassOp.SUPPORTED_DTYPES)
+)
+@pytest.mark.parametrize("positions", [None, "offset", "random"])
+@pytest.mark.parametrize("k", [32, 128])
+def test_rotary_embedding(k, dtype, causal, positions):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(k)
+    batch_size, num_heads, q_len, kv_len, scale = 2, 3, 200, 250, 3
+    max_position = kv_len + 50
+    query, key, value = [
+        (
+            torch.randn([batch_size, seqlen, num_heads, k], device=device, dtype=dtype)
+            * scale
+        ).requires_grad_(True)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    inv_freq = 1.0 / (10000 ** (torch.arange(0, k, 2, device=device) / k))
+    freqs = torch.arange(max_position, device=device)[:, None] * inv_freq[None]
+    emb = torch.cat([freqs, freqs], dim=-1)
+    cos, sin = emb.cos(), emb.sin()
+    positions_q = positions_k = None
+    if positions == "offset":
+        # eg the queries are the last tokens of the keys, with per-sequence
+        # offsets
+        offsets = torch.tensor([0, 50], device=device, dtype=torch.int32)
+        positions_q = offsets[:, None] + torch.arange(
+            kv_len - q_len, kv_len, device=device, dtype=torch.int32
+        )
+        positions_k = offsets[:, None] + torch.arange(
+            kv_len, device=device, dtype=torch.int32
+        )
+    elif positions == "random":
+        positions_q, positions_k = [
+            torch.randint(0, max_position, [batch_size, seqlen], device=device).int()
+            for seqlen in [q_len, kv_len]
+        ]
+
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=causal,
+        rope_cos=cos,
+        rope_sin=sin,
+        rope_positions_q=positions_q,
+        rope_positions_k=positions_k,
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out,
+        query,
+        key,
+        value,
+        lse,
+        out,
+        causal=causal,
+        rope_cos=cos,
+        rope_sin=sin,
+        rope_positions_q=positions_q,
+        rope_positions_k=positions_k,
+    )
+
+    query_ref, key_ref, value_ref = [
+        x.detach().clone().requires_grad_(True) for x in [query, key, value]
+    ]
+    attn_bias = None
+    if causal:
+        attn_bias = create_attn_bias(
+            xformers.ops.LowerTriangularMask,
+            batch_size=batch_size * num_heads,
+            q_len=q_len,
+            kv_len=kv_len,
+            dtype=dtype,
+            device=device,
+        )
+    ref = ref_attention_bmhk(
+        apply_rope_ref(query_ref, cos, sin, positions_q),
+        apply_rope_ref(key_ref, cos, sin, positions_k),
+        value_ref,
+        attn_bias,
+    )
+    ref.backward(grad_out)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+
+    # Same tolerances as `test_backward`
+    atol = 2e-4 + 2e-6 * k * kv_len * math.sqrt(q_len)
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2 * 1.4 ** (kv_len // 64)
+        rtol = 2e-2
+    if dtype is torch.bfloat16:
+        atol = 0.5 * 1.4 ** (kv_len // 64)
+        rtol = 0.1
+    for name, grad, x_ref in zip(
+        ["query", "key", "value"], grads, [query_ref, key_ref, value_ref]
+    ):
+        assert_allclose(grad, x_ref.grad, f"{name} grad", atol, rtol)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+@pytest.mark.parametrize("bias_type", ["alibi", "rel_pos"])
+def test_generated_bias(bias_type, dtype, causal):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    batch_size, num_heads, q_len, kv_len, k, max_distance = 2, 4, 150, 200, 64, 40
+    query, key, value = [
+        torch.randn(
+            [batch_size, seqlen, num_heads, k], device=device, dtype=dtype
+        ).requires_grad_(True)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    distance = (
+        torch.arange(kv_len, device=device)[None, :]
+        - torch.arange(q_len, device=device)[:, None]
+    )
+    kwargs = {}
+    if bias_type == "alibi":
+        slopes = 2 ** (-8 * torch.arange(1, num_heads + 1, device=device) / num_heads)
+        kwargs["alibi_slopes"] = slopes
+        bias = slopes[:, None, None] * distance[None]
+    else:
+        # eg a bucketed relative position bias, expanded for every distance
+        table = torch.randn([num_heads, 2 * max_distance + 1], device=device)
+        kwargs["rel_pos_bias"] = table
+        bias = table[:, distance.clamp(-max_distance, max_distance) + max_distance]
+    if causal:
+        bias = bias + torch.triu(
+            torch.full_like(bias, float("-inf")), diagonal=1
+        )
+    bias = bias[None].expand(batch_size, -1, -1, -1)
+
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=causal,
+        **kwargs,
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out, query, key, value, lse, out, causal=causal, **kwargs
+    )
+
+    ref = ref_attention_bmhk(
+        query, key, value, bias.reshape([batch_size * num_heads, q_len, kv_len])
+    )
+    ref.backward(grad_out)
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+    atol = 2e-4 + 2e-6 * k * kv_len * math.sqrt(q_len)
+    rtol = 1e-4
+    if dtype is torch.half:
+        atol = 5e-2
+        rtol = 2e-2
+    for name, grad, x in zip(["query", "key", "value"], grads, [query, key, value]):
+        assert_allclose(grad, x.grad, f"{name} grad", atol, rtol)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("k", [64, 256])
+def test_block_mask(k, causal):
+    device = "cuda"
+    dtype = torch.half
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(k)
+    batch_size, num_heads, q_len, kv_len, block_size = 2, 3, 700, 600, 128
+    query, key, value = [
+        torch.randn(
+            [batch_size, seqlen, num_heads, k], device=device, dtype=dtype
+        ).requires_grad_(True)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    num_q_blocks = (q_len + block_size - 1) // block_size
+    num_k_blocks = (kv_len + block_size - 1) // block_size
+    block_mask = (
+        torch.rand([1, num_heads, num_q_blocks, num_k_blocks], device=device) < 0.4
+    )
+    # Every query keeps at least the keys of its diagonal block
+    block_mask |= torch.eye(num_q_blocks, num_k_blocks, device=device).bool()
+    # Queries whose keys are all masked have a zero output
+    block_mask[:, 0, -1] = False
+    block_mask = block_mask.expand(batch_size, -1, -1, -1)
+
+    mask = block_mask.repeat_interleave(block_size, 2).repeat_interleave(
+        block_size, 3
+    )[:, :, :q_len, :kv_len]
+    if causal:
+        mask = mask & torch.ones(
+            [q_len, kv_len], device=device, dtype=torch.bool
+        ).tril()
+    # The rows without any key are computed unmasked, and zeroed afterwards
+    row_valid = mask.any(-1, keepdim=True)
+    bias = torch.zeros(mask.shape, device=device).masked_fill(
+        ~mask & row_valid, float("-inf")
+    )
+
+    kwargs = dict(block_mask=block_mask, block_mask_size=block_size)
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=causal,
+        **kwargs,
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out, query, key, value, lse, out, causal=causal, **kwargs
+    )
+
+    ref = ref_attention_bmhk(
+        query, key, value, bias.reshape([batch_size * num_heads, q_len, kv_len])
+    )
+    ref = ref * row_valid.permute(0, 2, 1, 3)
+    ref.backward(grad_out)
+    masked_rows = slice((num_q_blocks - 1) * block_size, q_len)
+    assert (out[:, masked_rows, 0] == 0).all()
+    assert (lse[:, 0, masked_rows] == float("-inf")).all()
+    assert_allclose(
+        out.float(),
+        ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
+    )
+    for name, grad, x in zip(["query", "key", "value"], grads, [query, key, value]):
+        assert_allclose(grad, x.grad, f"{name} grad", 5e-2, 2e-2)
+
+
+@cuda_only
+@pytest.mark.parametrize("k", [64, 256])
+def test_backward_keys_without_queries(k):
+    device = "cuda"
+    dtype = torch.half
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(k)
+    # Causal with more keys than queries: the last keys get no gradient
+    batch_size, num_heads, q_len, kv_len = 2, 3, 100, 300
+    query, key, value = [
+        torch.randn([batch_size, seqlen, num_heads, k], device=device, dtype=dtype)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=True,
+    )
+    grad_out = torch.randn_like(out)
+    # dK/dV are not initialized before the kernel: make sure that their
+    # memory is likely to start with garbage
+    garbage = torch.full(
+        [4, batch_size, kv_len, num_heads, k], math.nan, device=device, dtype=dtype
+    )
+    del garbage
+    _, grad_k, grad_v = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out, query, key, value, lse, out, causal=True
+    )
+    assert grad_k.isfinite().all() and grad_v.isfinite().all()
+    assert (grad_k[:, q_len:] == 0).all()
+    assert (grad_v[:, q_len:] == 0).all()
+
+
+@cuda_only
+@pytest.mark.parametrize("num_splits_query", [None, 2, 5])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+@pytest.mark.parametrize("k", [64, 128])
+def test_backward_split_query(k, dtype, causal, num_splits_query):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(k)
+    # A single (batch, head): not enough blocks to fill the GPU without
+    # splitting the queries
+    batch_size, num_heads, q_len, kv_len = 1, 1, 1000, 700
+    query, key, value = [
+        torch.randn([batch_size, seqlen, num_heads, k], device=device, dtype=dtype)
+        for seqlen in [q_len, kv_len, kv_len]
+    ]
+    out, lse, _, _ = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=causal,
+    )
+    grad_out = torch.randn_like(out)
+    grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out,
+        query,
+        key,
+        value,
+        lse,
+        out,
+        causal=causal,
+        num_splits_query=num_splits_query,
+    )
+    ref_grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out, query, key, value, lse, out, causal=causal, num_splits_query=1
+    )
+    atol, rtol = 1e-4, 1e-4
+    if dtype is torch.half:
+        atol, rtol = 2e-2, 2e-2
+    for name, grad, ref_grad in zip(["query", "key", "value"], grads, ref_grads):
+        assert_allclose(grad, ref_grad, f"{name} grad", atol, rtol)
+
+    # The splits are reduced in a fixed order
+    grads_again = torch.ops.xformers.efficient_attention_backward_cutlass(
+        grad_out,
+        query,
+        key,
+        value,
+        lse,
+        out,
+        causal=causal,
+        num_splits_query=num_splits_query,
+    )
+    for grad, grad_again in zip(grads, grads_again):
+        assert torch.equal(grad, grad_again)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+def test_backward_deterministic(dtype, causal):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    batch_size, num_heads, num_kv_heads, q_len, kv_len, k = 2, 8, 2, 1500, 1000, 128
+    query = torch.randn([batch_size, q_len, num_heads, k], device=device, dtype=dtype)
+    key, value = [
+        torch.randn([batch_size, kv_len, num_kv_heads, k], device=device, dtype=dtype)
+        for _ in range(2)
+    ]
+    out, lse, rng_seed, rng_offset = op.FORWARD_OPERATOR(
+        query,
+        key,
+        value,
+        max_seqlen_q=None,
+        cu_seqlens_q=None,
+        cu_seqlens_k=None,
+        compute_logsumexp=True,
+        causal=causal,
+        dropout_p=0.1,
+    )
+    grad_out = torch.randn_like(out)
+    all_grads = [
+        torch.ops.xformers.efficient_attention_backward_cutlass(
+            grad_out,
+            query,
+            key,
+            value,
+            lse,
+            out,
+            causal=causal,
+            dropout_p=0.1,
+            rng_seed=rng_seed,
+            rng_offset=rng_offset,
+            deterministic=True,
+        )
+        for _ in range(3)
+    ]
+    for grads in all_grads[1:]:
+        for grad, ref_grad in zip(grads, all_grads[0]):
+            assert torch.equal(grad, ref_grad)
+
+
 @pytest.mark.parametrize("k_len", [5, 6, 32])
 @pytest.mark.parametrize("batch_size", [1, 4])
 @pytest.mark.parametrize("kv_len", [128, 512])
@@ -425,6 +2035,41 @@ def test_key_query_all_ones(device, q_len, kv_len, batch_size, k_len):
     assert_allclose(out, ref, atol=1e-5)
 
 
+@pytest.mark.parametrize("attn_bias_type", [None, torch.Tensor])
+@pytest.mark.parametrize("dtype", [torch.half, torch.bfloat16])
+def test_cpu_half_precision(dtype, attn_bias_type):
+    torch.manual_seed(0)
+    op = xformers.ops.MemoryEfficientAttentionOp
+    B, M, N, H, K = 2, 75, 130, 3, 32
+    query, key, value = [
+        torch.randn([B, L, H, K], dtype=dtype).requires_grad_(True)
+        for L in [M, N, N]
+    ]
+    attn_bias = create_attn_bias(attn_bias_type, B * H, M, N, "cpu", dtype)
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, op=op
+    )
+    assert out.dtype == dtype
+    # Reference in float32, from the same half-precision inputs
+    refs = [x.detach().float().requires_grad_(True) for x in [query, key, value]]
+    ref = ref_attention_bmhk(*refs, attn_bias)
+    assert_allclose(
+        out.float(),
+        ref,
+        "out",
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+    grad = torch.randn_like(out)
+    out.backward(grad)
+    ref.backward(grad.float())
+    atol = {torch.half: 1e-2, torch.bfloat16: 5e-2}[dtype]
+    for name, x, x_ref in zip("qkv", [query, key, value], refs):
+        assert x.grad.dtype == dtype
+        assert_allclose(x.grad.float(), x_ref.grad, f"{name} grad", atol, 1e-2)
+
+
 @pytest.mark.parametrize(
     "op_device_dtype_B_Mq_Mkv_H_K_Kv",
     _op_device_dtype_B_Mq_Mkv_H_K_Kv,
@@ -452,7 +2097,7 @@ def test_logsumexp(op_device_dtype_B_Mq_Mkv_H_K_Kv):
     )
 
     if op is xformers.ops.MemoryEfficientAttentionCutlassOp:
-        _, lse = op.FORWARD_OPERATOR(
+        _, lse, _, _ = op.FORWARD_OPERATOR(
             query.unsqueeze(2),
             key.unsqueeze(2),
             value.unsqueeze(2),
@@ -621,11 +2266,16 @@ def test_dropout(device, q_len, kv_len, batch_size, k_len, p, seed):
 
     attn_bias = None
 
+    op = xformers.ops.MemoryEfficientAttentionOp
     torch.manual_seed(seed)
-    out = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, p)
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, p, op=op
+    )
 
     torch.manual_seed(seed)
-    out2 = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, p)
+    out2 = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, p, op=op
+    )
 
     assert_allclose(out, out2)
 
@@ -675,7 +2325,9 @@ def test_dropout_backward(device, q_len, kv_len, batch_size, k_len, p):
 
     seed = 42
     torch.manual_seed(seed)
-    out = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, p)
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, p, op=xformers.ops.MemoryEfficientAttentionOp
+    )
 
     out.backward(grad_out)
 
@@ -704,6 +2356,53 @@ def test_dropout_backward(device, q_len, kv_len, batch_size, k_len, p):
     assert_allclose(grad_v, value.grad, "grad_v", atol=atol)
 
 
+@cuda_only
+@pytest.mark.parametrize("k_len", [5, 32])
+@pytest.mark.parametrize("p", [0.3, 0.7])
+@pytest.mark.parametrize("batch_size", [1, 2])
+@pytest.mark.parametrize("kv_len", [32, 96, 160])
+@pytest.mark.parametrize("q_len", [2, 33, 70])
+def test_dropout_cutlass(q_len, kv_len, batch_size, p, k_len):
+    device = "cuda"
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    seed = 42
+    query = torch.randn((batch_size, q_len, k_len), device=device)
+    key = torch.randn((batch_size, kv_len, k_len), device=device)
+    value = torch.randn((batch_size, kv_len, kv_len), device=device)
+
+    # Recover the mask: with a uniform attention and `value = I`, the
+    # output is the mask scaled by `1 / ((1 - p) * kv_len)`
+    torch.manual_seed(seed)
+    out = xformers.ops.memory_efficient_attention(
+        torch.zeros_like(query),
+        key,
+        torch.eye(kv_len, device=device).expand_as(value),
+        None,
+        p,
+        op=op,
+    )
+    mask = (out > 0).float()
+    p_value = binom_test(mask.sum().item(), mask.numel(), p=1 - p)
+    assert p_value > 0.0001, p_value
+
+    query.requires_grad_(True)
+    key.requires_grad_(True)
+    value.requires_grad_(True)
+    torch.manual_seed(seed)
+    out = xformers.ops.memory_efficient_attention(query, key, value, None, p, op=op)
+    grad_out = torch.randn_like(out)
+    out.backward(grad_out)
+    grads = [x.grad for x in [query, key, value]]
+    for x in [query, key, value]:
+        x.grad = None
+
+    ref = ref_attention(query, key, value, None, mask, p)
+    ref.backward(grad_out)
+    assert_allclose(out, ref, atol=2e-4)
+    for name, grad, x in zip(["query", "key", "value"], grads, [query, key, value]):
+        assert_allclose(grad, x.grad, f"grad_{name}", atol=5e-4)
+
+
 @pytest.mark.parametrize("k_len", [32])
 @pytest.mark.parametrize("batch_size", [1])
 @pytest.mark.parametrize("kv_len", [3 * 32])
@@ -818,3 +2517,412 @@ def test_cuda_streams(
         atol=op.FORWARD_ERROR_ATOL[dtype],
         rtol=op.FORWARD_ERROR_RTOL.get(dtype, 1e-5),
     )
+
+
+@pytest.mark.parametrize("varlen", [False, True])
+def test_cutlass_meta(varlen: bool):
+    # Shapes only, without running the kernels (eg for `torch.compile`)
+    B, M, N, H, K, Kv = 3, 70, 50, 4, 32, 16
+    if varlen:
+        B, M, N = 1, 3 * M, 3 * N
+    query = torch.empty([B, M, H, K], device="meta", dtype=torch.half)
+    key = torch.empty([B, N, H, K], device="meta", dtype=torch.half)
+    value = torch.empty([B, N, H, Kv], device="meta", dtype=torch.half)
+    cu_seqlens = torch.empty([4], device="meta", dtype=torch.int32)
+    out, lse, _, _ = torch.ops.xformers.efficient_attention_forward_cutlass(
+        query=query,
+        key=key,
+        value=value,
+        cu_seqlens_q=cu_seqlens if varlen else None,
+        cu_seqlens_k=cu_seqlens if varlen else None,
+        max_seqlen_q=40 if varlen else -1,
+        compute_logsumexp=True,
+        causal=False,
+    )
+    assert out.shape == (B, M, H, Kv) and out.dtype == torch.half
+    # Padded to a multiple of 32
+    assert lse.shape == ((3, H, 64) if varlen else (B, H, 96))
+    assert lse.dtype == torch.float
+
+    grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+        out, query, key, value, lse, out, causal=False
+    )
+    grad_q, grad_k, grad_v = grads
+    assert grad_q.shape == query.shape
+    assert grad_k.shape == key.shape
+    assert grad_v.shape == value.shape
+
+
+@cuda_only
+@pytest.mark.parametrize("num_keys", [16, 77, 128])
+def test_short_keys_cross_attention(num_keys):
+    # Enough query tiles for several of them per block
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(0)
+    B, M, H, K = 2, 4099, 8, 64
+    query = torch.randn([B, M, H, K], device="cuda", dtype=dtype)
+    key, value = [
+        torch.randn([B, num_keys, H, K], device="cuda", dtype=dtype) for _ in range(2)
+    ]
+    out = xformers.ops.memory_efficient_attention(query, key, value, op=op)
+    out_ref = ref_attention(query, key, value)
+    assert_allclose(
+        out.float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("num_draft", [7, 40])
+def test_tree_attention(num_draft):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(0)
+    B, H, K, num_prefix = 2, 4, 64, 100
+    num_keys = num_prefix + num_draft
+    # Random trees: the parent of every draft is a previous draft (or the prefix)
+    parents = torch.stack(
+        [
+            torch.tensor([torch.randint(-1, i, []).item() for i in range(num_draft)])
+            for _ in range(B)
+        ]
+    ).cuda()
+    attn_bias = xformers.ops.TreeAttentionMask.from_parents(parents, num_keys)
+
+    # Walk the trees from every draft for the reference
+    dense = torch.full([B, 1, num_draft, num_keys], float("-inf"))
+    dense[..., :num_prefix] = 0
+    for b in range(B):
+        for i in range(num_draft):
+            j = i
+            while j >= 0:
+                dense[b, 0, i, num_prefix + j] = 0
+                j = parents[b, j].item()
+    assert torch.equal(attn_bias.to_tensor().cpu(), dense)
+
+    query = torch.randn([B, num_draft, H, K], device="cuda", dtype=dtype)
+    key, value = [
+        torch.randn([B, num_keys, H, K], device="cuda", dtype=dtype) for _ in range(2)
+    ]
+    out = xformers.ops.memory_efficient_attention(query, key, value, attn_bias, op=op)
+    ref_bias = dense.expand(B, H, -1, -1).reshape(B * H, num_draft, num_keys)
+    out_ref = ref_attention(query, key, value, ref_bias.cuda())
+    assert_allclose(
+        out.float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+    query.requires_grad_(True)
+    with pytest.raises(NotImplementedError):
+        xformers.ops.memory_efficient_attention(query, key, value, attn_bias, op=op)
+
+
+@cuda_only
+def test_64bit_indexing():
+    # The offsets of the last keys overflow 32-bit indices
+    if torch.cuda.get_device_properties(0).total_memory < 24 * 2**30:
+        pytest.skip("not enough GPU memory")
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(0)
+    M, N, K, H_buffer = 64, 2**20 + 256, 64, 32
+    query = torch.randn([1, M, 1, K], device="cuda", dtype=dtype)
+    # Views with `strideM = H_buffer * K`
+    key, value = [
+        torch.randn([1, N, H_buffer, K], device="cuda", dtype=dtype)[:, :, :1]
+        for _ in range(2)
+    ]
+    assert key.stride(1) * N > 2**31
+    out = xformers.ops.memory_efficient_attention(query, key, value, op=op)
+    out_ref = ref_attention(query, key, value)
+    assert_allclose(
+        out.float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("dtype", [torch.half, torch.bfloat16])
+def test_int8_qk(dtype, causal):
+    if torch.cuda.get_device_capability()[0] < 8:
+        pytest.skip("int8 query/key require Sm80+")
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    B, M, H, K = 2, 257, 4, 80
+    query, key, value = [
+        torch.randn([B, M, H, K], device="cuda", dtype=dtype) for _ in range(3)
+    ]
+    query_i8, q_scale = xformers.ops.quantize_qk_per_token(query)
+    key_i8, k_scale = xformers.ops.quantize_qk_per_token(key)
+    attn_bias, ref_bias = None, None
+    if causal:
+        attn_bias = xformers.ops.LowerTriangularMask()
+        ref_bias = xformers.ops.LowerTriangularMask(
+            [B * H, M, M], dtype=torch.float, device="cuda"
+        )
+    out = xformers.ops.memory_efficient_attention_int8_qk(
+        query_i8, key_i8, value, q_scale, k_scale, attn_bias
+    )
+    assert out.dtype == dtype
+    # Attention of the dequantized query and key
+    out_ref = ref_attention(
+        query_i8.float() * q_scale.unsqueeze(-1),
+        key_i8.float() * k_scale.unsqueeze(-1),
+        value,
+        ref_bias,
+    )
+    assert_allclose(
+        out.float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+def _dequantize_kv_cache(q: torch.Tensor, scale: torch.Tensor) -> torch.Tensor:
+    if q.dtype == torch.uint8:
+        q = torch.stack([q & 15, q >> 4], dim=-1).flatten(-2).float() - 8
+    x = q.float().unflatten(-1, (scale.shape[-1], -1)) * scale.unsqueeze(-1)
+    return x.flatten(-2)
+
+
+@cuda_only
+@pytest.mark.parametrize("group_size", [None, 32], ids=["token", "group32"])
+@pytest.mark.parametrize("bits", [8, 4])
+@pytest.mark.parametrize("M", [1, 40])
+def test_quantized_kv_cache(M, bits, group_size):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    dtype = torch.half
+    torch.manual_seed(M)
+    B, N, H, H_kv, K = 3, 1000, 8, 2, 128
+    query = torch.randn([B, M, H, K], device="cuda", dtype=dtype)
+    key, value = [
+        torch.randn([B, N, H_kv, K], device="cuda", dtype=dtype) for _ in range(2)
+    ]
+    key_q, k_scale = xformers.ops.quantize_kv_cache(key, bits, group_size)
+    value_q, v_scale = xformers.ops.quantize_kv_cache(value, bits, group_size)
+    assert key_q.shape[-1] == (K if bits == 8 else K // 2)
+    # M=1 dequantizes in the decode kernel, M=40 before the attention
+    out = xformers.ops.memory_efficient_attention_quantized_kv(
+        query, key_q, value_q, k_scale, v_scale
+    )
+    assert out.dtype == dtype
+    key_ref, value_ref = [
+        _dequantize_kv_cache(x, s).repeat_interleave(H // H_kv, dim=2)
+        for x, s in [(key_q, k_scale), (value_q, v_scale)]
+    ]
+    out_ref = ref_attention(query, key_ref, value_ref)
+    assert_allclose(
+        out.float(),
+        out_ref,
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("mask", [None, "causal", "window"])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+def test_attention_key_scores(dtype, mask):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(0)
+    B, M, N, H, H_kv, K = 2, 70, 300, 4, 2, 96
+    if mask is not None:
+        M = N
+    query = torch.randn([B, M, H, K], device="cuda", dtype=dtype)
+    key, value = [
+        torch.randn([B, N, H_kv, K], device="cuda", dtype=dtype) for _ in range(2)
+    ]
+    attn_bias = {
+        None: None,
+        "causal": xformers.ops.LowerTriangularMask([M, N], device="cuda"),
+        "window": xformers.ops.LowerTriangularMaskWithWindow(
+            33, [M, N], device="cuda"
+        ),
+    }[mask]
+    out, scores = xformers.ops.memory_efficient_attention_with_key_scores(
+        query, key, value, attn_bias
+    )
+    assert scores.shape == (B, H, N) and scores.dtype == torch.float
+
+    key_ref = key.float().repeat_interleave(H // H_kv, dim=2)
+    value_ref = value.float().repeat_interleave(H // H_kv, dim=2)
+    attn = torch.einsum("bmhk,bnhk->bhmn", query.float(), key_ref) * K**-0.5
+    if attn_bias is not None:
+        attn = attn + attn_bias.to_tensor()
+    attn = attn.softmax(-1)
+    assert_allclose(scores, attn.sum(2), "scores", atol=1e-3, rtol=1e-3)
+    # Every query distributes a probability of 1 over the keys
+    assert_allclose(scores.sum(-1), torch.full_like(scores[..., 0], M), "sum")
+    assert_allclose(
+        out.float(),
+        torch.einsum("bhmn,bnhk->bmhk", attn, value_ref),
+        atol=op.FORWARD_ERROR_ATOL[dtype],
+        rtol=op.FORWARD_ERROR_RTOL[dtype],
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("mask", [None, "causal", "tensor"])
+@pytest.mark.parametrize("K", [30, 64])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+def test_cutlass_cpp_autograd(dtype, K, mask):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    if not op.supports_cpp(None):
+        pytest.skip("not built")
+    torch.manual_seed(K)
+    B, M, N, H = 2, 50, 70, 3
+    query, key, value = [
+        torch.randn([B, S, H, K], device="cuda", dtype=dtype, requires_grad=True)
+        for S in [M, N, N]
+    ]
+    attn_bias = {
+        None: None,
+        "causal": xformers.ops.LowerTriangularMask(),
+        "tensor": torch.randn([B, H, M, N], device="cuda", dtype=dtype),
+    }[mask]
+    # Padded to a multiple of 8 in C++ for K=30
+    out = op.apply_cpp(query, key, value, attn_bias, 0.0, 0.5)
+    ref = op.apply(query, key, value, attn_bias, 0.0, 0.5)
+    atol, rtol = op.FORWARD_ERROR_ATOL[dtype], op.FORWARD_ERROR_RTOL[dtype]
+    assert out.shape == ref.shape
+    assert_allclose(out, ref, "out", atol=atol, rtol=rtol)
+
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [query, key, value], grad_out)
+    ref_grads = torch.autograd.grad(ref, [query, key, value], grad_out)
+    for name, g, ref_g in zip(["query", "key", "value"], grads, ref_grads):
+        assert g.shape == ref_g.shape
+        assert_allclose(g, ref_g, name, atol=atol * 4, rtol=rtol * 4)
+
+    # Inference, and under autocast (cast in C++)
+    with torch.no_grad():
+        out = op.apply_cpp(query, key, value, attn_bias, 0.0, 0.5)
+        assert_allclose(out, ref, "no_grad", atol=atol, rtol=rtol)
+    with torch.autocast("cuda", dtype=torch.half):
+        out = op.AUTOGRAD_OPERATOR(query.float(), key.float(), value.float())
+    assert out.dtype == torch.half
+
+
+@cuda_only
+@pytest.mark.parametrize("K", [32, 128])
+def test_cutlass_tf32(K):
+    if torch.cuda.get_device_capability()[0] < 8:
+        pytest.skip("TF32 requires Sm80+")
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(K)
+    B, M, N, H = 2, 100, 130, 3
+    query, key, value = [
+        torch.randn([B, S, H, K], device="cuda", requires_grad=True)
+        for S in [M, N, N]
+    ]
+    ref = ref_attention_bmhk(query, key, value, None)
+    grad_out = torch.randn_like(ref)
+    ref_grads = torch.autograd.grad(ref, [query, key, value], grad_out)
+
+    # The f32 kernels use TF32 math only when PyTorch allows it for matmuls
+    xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    torch.backends.cuda.matmul.allow_tf32 = True
+    try:
+        out = xformers.ops.memory_efficient_attention(query, key, value, op=(op, op))
+        grads = torch.autograd.grad(out, [query, key, value], grad_out)
+    finally:
+        torch.backends.cuda.matmul.allow_tf32 = False
+    kernels = xformers.ops.memory_efficient_attention_kernel_stats()["kernels"]
+    assert any(k.startswith("cutlassF_f32") and k.endswith("_tf32") for k in kernels)
+    assert any(k.startswith("cutlassB_f32") and k.endswith("_tf32") for k in kernels)
+
+    # TF32 has a 10 bits mantissa, like f16
+    assert_allclose(out, ref, "out", atol=2e-3, rtol=2e-3)
+    for name, g, ref_g in zip(["query", "key", "value"], grads, ref_grads):
+        assert_allclose(g, ref_g, name, atol=2e-2, rtol=2e-2)
+
+
+@cuda_only
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("K", [16, 32])
+@pytest.mark.parametrize("dtype", [torch.half, torch.float])
+def test_small_head_dim_128x32(dtype, K, causal):
+    op = xformers.ops.MemoryEfficientAttentionCutlassOp
+    torch.manual_seed(K)
+    B, M, N, H = 2, 300, 200, 3
+    query, key, value = [
+        torch.randn([B, S, H, K], device="cuda", dtype=dtype, requires_grad=True)
+        for S in [M, N, N]
+    ]
+    attn_bias = xformers.ops.LowerTriangularMask() if causal else None
+    xformers.ops.memory_efficient_attention_kernel_stats(reset=True)
+    out = xformers.ops.memory_efficient_attention(
+        query, key, value, attn_bias, op=(op, op)
+    )
+    kernels = xformers.ops.memory_efficient_attention_kernel_stats()["kernels"]
+    assert any("_128x32_" in name for name in kernels), kernels
+
+    ref_bias = None
+    if causal:
+        ref_bias = xformers.ops.LowerTriangularMask([B * H, M, N], device="cuda")
+    ref = ref_attention_bmhk(query, key, value, ref_bias)
+    atol, rtol = op.FORWARD_ERROR_ATOL[dtype], op.FORWARD_ERROR_RTOL[dtype]
+    assert_allclose(out.float(), ref, "out", atol=atol, rtol=rtol)
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, [query, key, value], grad_out)
+    ref_grads = torch.autograd.grad(ref, [query, key, value], grad_out.float())
+    for name, g, ref_g in zip(["query", "key", "value"], grads, ref_grads):
+        assert_allclose(g.float(), ref_g, name, atol=atol * 10, rtol=rtol * 10)
+
+
+@cuda_only
+@pytest.mark.parametrize("weight", [False, True])
+@pytest.mark.parametrize("norm", ["rms", "layer"])
+@pytest.mark.parametrize("dtype", [torch.half, torch.bfloat16, torch.float])
+def test_qk_norm(dtype, norm, weight):
+    op = xformers.ops.MemoryEfficientAttentionQKNormOp
+    if op.NORM_OPERATOR.__name__ == "no_such_operator":
+        pytest.skip("qk_norm is not built")
+    torch.manual_seed(0)
+    B, M, N, H, K = 2, 100, 150, 3, 64
+    query, key, value = [
+        torch.randn([B, S, H, K], device="cuda", dtype=dtype, requires_grad=True)
+        for S in [M, N, N]
+    ]
+    inputs = [query, key, value]
+    q_weight, k_weight = None, None
+    if weight:
+        q_weight, k_weight = [
+            (torch.rand([K], device="cuda", dtype=dtype) + 0.5).requires_grad_()
+            for _ in range(2)
+        ]
+        inputs += [q_weight, k_weight]
+    out = xformers.ops.memory_efficient_attention_qk_norm(
+        query, key, value, q_weight=q_weight, k_weight=k_weight, norm=norm
+    )
+
+    def ref_norm(x, w):
+        x = x.float()
+        if norm == "layer":
+            x = x - x.mean(-1, keepdim=True)
+        x = x * torch.rsqrt(x.pow(2).mean(-1, keepdim=True) + 1e-6)
+        return x if w is None else x * w.float()
+
+    ref = ref_attention_bmhk(
+        ref_norm(query, q_weight), ref_norm(key, k_weight), value.float(), None
+    )
+    atol = xformers.ops.MemoryEfficientAttentionCutlassOp.FORWARD_ERROR_ATOL[dtype]
+    rtol = xformers.ops.MemoryEfficientAttentionCutlassOp.FORWARD_ERROR_RTOL[dtype]
+    assert_allclose(out.float(), ref, "out", atol=atol, rtol=rtol)
+    grad_out = torch.randn_like(out)
+    grads = torch.autograd.grad(out, inputs, grad_out)
+    ref_grads = torch.autograd.grad(ref, inputs, grad_out.float())
+    names = ["query", "key", "value", "q_weight", "k_weight"]
+    for name, g, ref_g in zip(names, grads, ref_grads):
+        # The weight gradients are summed over all the rows
+        scale = 10 if name in ["query", "key", "value"] else 40
+        assert_allclose(g.float(), ref_g, name, atol=atol * scale, rtol=rtol * scale)
@@ -247,6 +247,72 @@ def test_sparse_softmax(tensor_type, device):
     ), f"{torch.max(torch.abs(a_grad- a_sparse.grad.to_dense()))}"
 
 
+@pytest.mark.parametrize("dtype", [torch.float16, torch.bfloat16])
+@pytest.mark.parametrize("device", _devices)
+def test_csr_reduced_precision(device, dtype):
+    _seed()
+    N, H, W, L = 8, 64, 64, 32
+    atol, rtol = (2e-2, 1e-2) if dtype == torch.float16 else (1e-1, 2e-2)
+
+    a_sparse = _create_csr_tensor(device, dtype, shape=(N, H, W), sparsity=0.8)
+    a = a_sparse.to_dense()
+    mask = a != 0
+    b = torch.randn(N, W, L, device=device, dtype=dtype)
+
+    # spmm, accumulated in float32
+    res = a_sparse @ b
+    assert res.dtype == dtype
+    assert torch.allclose(res.float(), a.float() @ b.float(), atol=atol, rtol=rtol)
+
+    # sddmm
+    q = torch.randn(N, H, L, device=device, dtype=dtype)
+    k = torch.randn(N, W, L, device=device, dtype=dtype)
+    res = masked_matmul(q, k.transpose(-2, -1), a_sparse).to_dense()
+    ref = torch.where(mask, q.float() @ k.float().transpose(-2, -1), 0.0)
+    assert res.dtype == dtype
+    assert torch.allclose(res.float(), ref, atol=atol * 4, rtol=rtol)
+
+    # sparse softmax
+    res = torch.softmax(a_sparse, dim=-1).to_dense()
+    ref = torch.softmax(a.float().masked_fill(~mask, float("-inf")), dim=-1)
+    ref = ref.nan_to_num()
+    assert res.dtype == dtype
+    assert torch.allclose(res.float(), ref, atol=atol, rtol=rtol)
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_csr_transpose_info(device):
+    _seed()
+    B, H, W = 2, 48, 80
+    a_sparse = _create_csr_tensor(device, torch.float32, shape=(B, H, W), sparsity=0.7)
+    a = a_sparse.to_dense()
+    row_offsets = a_sparse._csr_row_offsets
+    column_indices = a_sparse._csr_column_indices
+
+    row_indices_t, row_offsets_t, column_indices_t, perm = (
+        torch.ops.xformers.csr_transpose_info(H, W, row_offsets, column_indices)
+    )
+    ref = SparseCSRTensor.from_dense(a.transpose(-2, -1).contiguous())
+    assert torch.equal(row_offsets_t, ref._csr_row_offsets)
+    assert torch.equal(column_indices_t, ref._csr_column_indices)
+    assert torch.equal(a_sparse.values()[:, perm], ref.values())
+    row_nnz_t = torch.diff(row_offsets_t)[row_indices_t.long()]
+    assert torch.all(row_nnz_t[:-1] >= row_nnz_t[1:])
+    assert torch.equal(row_indices_t, ref._csr_row_indices)
+
+    # the transpose info is reused for the same pattern tensors
+    info = a_sparse._csr_transp_info
+    for t, t_ref in zip(info, (row_indices_t, row_offsets_t, column_indices_t, perm)):
+        assert torch.equal(t, t_ref)
+    b_sparse = SparseCSRTensor(row_offsets, column_indices, a_sparse.values(), a.shape)
+    assert b_sparse._csr_row_indices is a_sparse._csr_row_indices
+    assert all(t is t_ref for t, t_ref in zip(b_sparse._csr_transp_info, info))
+
+    # transposing twice gives the original matrix
+    a_tt = a_sparse.transpose(-2, -1).transpose(-2, -1)
+    assert torch.equal(a_tt.to_dense(), a)
+
+
 @pytest.mark.parametrize("tensor_type", _tensor_types)
 @pytest.mark.parametrize("device", _devices)
 def test_deepcopy(tensor_type, device):
@@ -6,6 +6,7 @@
 import copy
 import functools
 import random
+import tempfile
 from contextlib import nullcontext
 from typing import ContextManager, Optional, Sequence, cast
 
@@ -13,6 +14,7 @@ import pytest
 import torch
 
 import xformers.ops.swiglu_op as xsw
+from xformers.ops import swiglu_tensor_parallel
 
 torch.backends.cuda.matmul.allow_tf32 = False
 cuda_only = pytest.mark.skipif(not torch.cuda.is_available(), reason="requires CUDA")
@@ -230,3 +232,489 @@ def test_forward_backward(
         )
         # Ensure `gout >> atol`, so that the test is meaningful
         assert gout.norm(2) > BACKWARD_ATOL[dtype] / BACKWARD_RTOL[dtype]
+
+
+def _packed_fused_setup(
+    device,
+    bias: bool,
+    B: int = 512,
+    dtype=torch.float16,
+    in_features: int = 256,
+    hidden_features: int = 384,
+    requires_grad: bool = False,
+    seed: int = 0,
+):
+    """
+    Returns `SwiGLUPackedFusedOp`, a `SwiGLU` module on `device` and an input
+    of shape [B, in_features] - or skips the test if the op does not support
+    them
+    """
+    op = xsw.SwiGLUPackedFusedOp
+    if not op.supports(
+        xsw.SwiGLUOpDispatch(
+            device=device,
+            dtype=dtype,
+            dtype_autocast_gpu=None,
+            packed_weights=True,
+            bias_enabled=bias,
+        )
+    ):
+        pytest.skip("Not supported by operator")
+    torch.manual_seed(seed)
+    x = torch.randn(
+        [B, in_features], device=device, dtype=dtype, requires_grad=requires_grad
+    )
+    module = xsw.SwiGLU(
+        in_features=in_features, hidden_features=hidden_features, bias=bias
+    )
+    return op, module.to(device).to(dtype), x
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_forward_no_grad(device, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias)
+
+    # Reference: the training forward, which also writes x1 / x2
+    out = xsw.swiglu(x, *module._ordered_params(), op=op)
+    assert out.requires_grad
+    with torch.no_grad():
+        out_no_grad = xsw.swiglu(x, *module._ordered_params(), op=op)
+    with torch.inference_mode():
+        out_inference = xsw.swiglu(x, *module._ordered_params(), op=op)
+    assert not out_no_grad.requires_grad
+    assert torch.equal(out_no_grad, out.detach())
+    assert torch.equal(out_inference, out.detach())
+
+
+def _cuda_memory_usage(fn):
+    """
+    Returns the output of `fn()`, the memory it still holds after returning
+    and its peak memory usage (in bytes)
+    """
+    torch.cuda.synchronize()
+    torch.cuda.reset_peak_memory_stats()
+    before = torch.cuda.memory_allocated()
+    out = fn()
+    torch.cuda.synchronize()
+    return (
+        out,
+        torch.cuda.memory_allocated() - before,
+        torch.cuda.max_memory_allocated() - before,
+    )
+
+
+@cuda_only
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+def test_packed_forward_no_grad_memory(bias: bool):
+    op, module, x = _packed_fused_setup("cuda", bias)
+    params = module._ordered_params()
+
+    def forward():
+        return xsw.swiglu(x, *params, op=op)
+
+    with torch.no_grad():
+        out, kept_no_grad, peak_no_grad = _cuda_memory_usage(forward)
+    _, kept, peak = _cuda_memory_usage(forward)
+    # Only the output outlives the no-grad forward, while the training
+    # forward also keeps the [B, H] x1 / x2 for the backward
+    out_bytes = out.untyped_storage().nbytes()
+    assert kept_no_grad == out_bytes
+    x1_bytes = x.shape[0] * module.hidden_features * x.element_size()
+    assert kept >= out_bytes + 2 * x1_bytes
+    assert peak_no_grad < peak
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_recompute(device, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias, requires_grad=True)
+    grad = torch.randn_like(x)
+
+    def run(recompute: bool):
+        out = xsw.swiglu(x, *module._ordered_params(), op=op, recompute=recompute)
+        out.backward(grad)
+        grads = {name: p.grad for name, p in module.named_parameters()}
+        grads["x"] = x.grad
+        module.zero_grad(set_to_none=True)
+        x.grad = None
+        return out, grads
+
+    out_ref, grads_ref = run(recompute=False)
+    out, grads = run(recompute=True)
+    # x1 / x2 are recomputed with the same kernel
+    assert torch.equal(out, out_ref)
+    for name, gref in grads_ref.items():
+        assert torch.equal(grads[name], gref), name
+
+
+@sm80_only
+@pytest.mark.parametrize("dtype", _dtypes, ids=[str(x) for x in _dtypes])
+def test_gemm_silu_bw_fused(dtype):
+    torch.manual_seed(0)
+    B, H, O = 1000, 384, 256
+    device = "cuda"
+    dx5 = torch.randn([B, O], device=device, dtype=dtype)
+    w3 = torch.randn([O, H], device=device, dtype=dtype) / O**0.5
+    x1 = torch.randn([B, H], device=device, dtype=dtype)
+    x2 = torch.randn([B, H], device=device, dtype=dtype)
+
+    dx1dx2, x4 = torch.ops.xformers.gemm_silu_bw_fused(dx5, w3, x1, x2)
+    dx1dx2_ref, x4_ref = torch.ops.xformers.silu_bw_fused(x1, x2, dx5 @ w3)
+    # The reference rounds dx4 to `dtype` before the silu backward
+    assert_allclose(dx1dx2, dx1dx2_ref, msg="dx1dx2", atol=2e-2, rtol=2e-2)
+    assert_allclose(x4, x4_ref, msg="x4", atol=1e-2, rtol=4e-3)
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("B", [1, 5, 64])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_forward_small_batch(device, B: int, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias, B=B, seed=B)
+
+    with torch.no_grad():
+        # Decode-size batches run the whole MLP in a single kernel
+        out = xsw.swiglu(x, *module._ordered_params(), op=op)
+        ref = xsw.swiglu(x, *module._ordered_params(), op=xsw.SwiGLUEagerOp)
+        ref_f32 = module.float()(x.float())
+    assert_allclose(out, ref, ref_f32, "fw", atol=1e-2, rtol=4e-3)
+
+
+@sm80_only
+@pytest.mark.parametrize("dtype", _dtypes, ids=[str(x) for x in _dtypes])
+@pytest.mark.parametrize("B", [1, 17, 64, 200])
+@pytest.mark.parametrize("I", [256, 8192])
+def test_dual_gemm_small_batch(dtype, B: int, I: int):
+    # Small batches use smaller tiles, and split-k for large `I`
+    torch.manual_seed(B)
+    H = 512
+    device = "cuda"
+    x = torch.randn([B, I], device=device, dtype=dtype)
+    w1 = torch.randn([H, I], device=device, dtype=dtype) / I**0.5
+    w2 = torch.randn([H, I], device=device, dtype=dtype) / I**0.5
+    b1 = torch.randn([H], device=device, dtype=dtype)
+    b2 = torch.randn([H], device=device, dtype=dtype)
+
+    x1, x2, x4 = torch.ops.xformers.dual_gemm_silu_identity_mul(x, w1, b1, w2, b2)
+    x4_no_grad = torch.ops.xformers.dual_gemm_silu_identity_mul_no_grad(
+        x, w1, b1, w2, b2
+    )
+    x1_ref = (x.float() @ w1.float().t() + b1.float()).to(dtype)
+    x2_ref = (x.float() @ w2.float().t() + b2.float()).to(dtype)
+    x4_ref = torch.nn.functional.silu(x1_ref.float()) * x2_ref.float()
+    assert_allclose(x1, x1_ref, msg="x1", atol=1e-2, rtol=4e-3)
+    assert_allclose(x2, x2_ref, msg="x2", atol=1e-2, rtol=4e-3)
+    assert_allclose(x4, x4_ref, msg="x4", atol=2e-2, rtol=1e-2)
+    assert_allclose(x4_no_grad, x4_ref, msg="x4_no_grad", atol=2e-2, rtol=1e-2)
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_strided_input(device, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias)
+    # [B, M, I] slice of a larger activation: the rows are strided
+    x_full = torch.cat([x, torch.randn_like(x)], dim=-1).view([4, 128, 512])
+    x = x_full[..., :256].requires_grad_()
+    assert not x.is_contiguous()
+    x_ref = x.detach().reshape([-1, 256]).clone().requires_grad_()
+    grad = torch.randn_like(x)
+
+    out = xsw.swiglu(x, *module._ordered_params(), op=op)
+    out.backward(grad)
+    grads = {name: p.grad for name, p in module.named_parameters()}
+    module.zero_grad(set_to_none=True)
+    out_ref = xsw.swiglu(x_ref, *module._ordered_params(), op=op)
+    out_ref.backward(grad.reshape([-1, 256]))
+
+    assert out.shape == x.shape
+    assert x.grad.shape == x.shape
+    assert_allclose(out.reshape([-1, 256]), out_ref, msg="fw", atol=1e-3, rtol=1e-3)
+    assert_allclose(
+        x.grad.reshape([-1, 256]), x_ref.grad, msg="dx", atol=1e-3, rtol=1e-3
+    )
+    for name, p in module.named_parameters():
+        assert_allclose(grads[name], p.grad, msg=name, atol=1e-2, rtol=1e-3)
+
+
+@cuda_only
+@pytest.mark.parametrize("grad", [False, True], ids=["nograd", "grad"])
+def test_packed_strided_input_no_copy(grad: bool):
+    op, module, x = _packed_fused_setup("cuda", bias=False)
+    x_full = torch.cat([x, torch.randn_like(x)], dim=-1).view([4, 128, 512])
+    x_strided = x_full[..., :256]
+    x_contiguous = x_strided.contiguous()
+    params = module._ordered_params()
+
+    def usage(x):
+        with torch.set_grad_enabled(grad):
+            _, kept, peak = _cuda_memory_usage(lambda: xsw.swiglu(x, *params, op=op))
+        return kept, peak
+
+    usage(x_contiguous)  # Warmup
+    # A copy of the strided input would show in the peak usage, and in the
+    # memory kept for the backward
+    assert usage(x_strided) == usage(x_contiguous)
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_accumulate_grad(device, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias)
+    micro_batches = [(torch.randn_like(x), torch.randn_like(x)) for _ in range(3)]
+
+    def run(accumulate_grad: bool):
+        ptrs = None
+        for x, grad in micro_batches:
+            out = xsw.swiglu(
+                x, *module._ordered_params(), op=op, accumulate_grad=accumulate_grad
+            )
+            out.backward(grad)
+            if accumulate_grad:
+                # The same buffers are used for all the micro-batches
+                new_ptrs = {n: p.grad.data_ptr() for n, p in module.named_parameters()}
+                assert ptrs is None or new_ptrs == ptrs
+                ptrs = new_ptrs
+        grads = {name: p.grad for name, p in module.named_parameters()}
+        module.zero_grad(set_to_none=True)
+        return grads
+
+    grads_ref = run(accumulate_grad=False)
+    grads = run(accumulate_grad=True)
+    for name, gref in grads_ref.items():
+        assert_allclose(grads[name], gref, msg=name, atol=2e-2, rtol=1e-2)
+
+
+@pytest.mark.parametrize("device", _devices)
+def test_packed_accumulate_grad_hooks(device):
+    op, module, x = _packed_fused_setup(device, bias=False)
+    w3 = module.w3.weight
+    seen = []
+    w3.register_post_accumulate_grad_hook(lambda p: seen.append(p.grad.clone()))
+    for _ in range(2):
+        out = xsw.swiglu(x, *module._ordered_params(), op=op, accumulate_grad=True)
+        out.backward(torch.randn_like(out))
+    # `w3` has a hook: its gradients go through `AccumulateGrad`
+    assert len(seen) == 2
+    assert_allclose(seen[-1], w3.grad, msg="w3")
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("device", _devices)
+def test_packed_overlap_wgrad(device, bias: bool):
+    op, module, x = _packed_fused_setup(device, bias, requires_grad=True)
+    grad = torch.randn_like(x)
+
+    def run(overlap_wgrad: bool):
+        out = xsw.swiglu(
+            x, *module._ordered_params(), op=op, overlap_wgrad=overlap_wgrad
+        )
+        out.backward(grad)
+        grads = {name: p.grad for name, p in module.named_parameters()}
+        grads["x"] = x.grad
+        module.zero_grad(set_to_none=True)
+        x.grad = None
+        return grads
+
+    grads_ref = run(overlap_wgrad=False)
+    grads = run(overlap_wgrad=True)
+    # Same kernels, only on a different stream
+    for name, gref in grads_ref.items():
+        assert torch.equal(grads[name], gref), name
+
+
+def _dequantize_weight(q: torch.Tensor, scale: torch.Tensor) -> torch.Tensor:
+    if q.dtype == torch.uint8:
+        q = torch.stack([q & 15, q >> 4], dim=-1).flatten(-2).float() - 8
+    w = q.float().unflatten(-1, (scale.shape[-1], -1)) * scale.float().unsqueeze(-1)
+    return w.flatten(-2).to(scale.dtype)
+
+
+@sm80_only
+@pytest.mark.parametrize("group_size", [None, 64], ids=["channel", "group64"])
+@pytest.mark.parametrize("bits", [8, 4])
+@pytest.mark.parametrize("B", [1, 17, 200])
+def test_swiglu_quantized(B: int, bits: int, group_size: Optional[int]):
+    torch.manual_seed(B)
+    dtype = torch.float16
+    device = "cuda"
+    module = xsw.SwiGLU(in_features=256, hidden_features=384, bias=True)
+    module = module.to(device).to(dtype)
+    x = torch.randn([B, 256], device=device, dtype=dtype)
+    w1w2 = module.w12.weight.view([2, 384, 256])
+    b1b2 = module.w12.bias.view([2, 384])
+
+    q12, s12 = xsw.swiglu_quantize_weight(w1w2, bits=bits, group_size=group_size)
+    q3, s3 = xsw.swiglu_quantize_weight(
+        module.w3.weight, bits=bits, group_size=group_size
+    )
+    assert q12.shape[-1] == (256 if bits == 8 else 128)
+    with torch.no_grad():
+        # B <= 64 dequantizes in the fused kernel, larger batches before the gemms
+        out = xsw.swiglu_quantized(x, q12, s12, b1b2, q3, s3, module.w3.bias)
+        w1, w2 = _dequantize_weight(q12, s12).unbind(0)
+        b1, b2 = b1b2.unbind(0)
+        ref = xsw.swiglu(
+            x,
+            w1,
+            b1,
+            w2,
+            b2,
+            _dequantize_weight(q3, s3),
+            module.w3.bias,
+            op=xsw.SwiGLUEagerOp,
+        )
+    assert_allclose(out, ref, msg="fw", atol=2e-2, rtol=1e-2)
+
+    # f32 activations are cast under autocast, the quantized weights are not
+    with torch.no_grad(), torch.autocast("cuda", dtype=dtype):
+        out_autocast = xsw.swiglu_quantized(
+            x.float(), q12, s12, b1b2.float(), q3, s3, module.w3.bias.float()
+        )
+    assert out_autocast.dtype == dtype
+    assert_allclose(out_autocast, out, msg="autocast", atol=1e-3, rtol=1e-3)
+
+
+def _prune_2_4(w: torch.Tensor) -> torch.Tensor:
+    # Keeps the 2 largest values of every group of 4 inputs
+    groups = w.unflatten(-1, (-1, 4))
+    mask = torch.zeros_like(groups, dtype=torch.bool)
+    mask.scatter_(-1, groups.abs().topk(2, dim=-1).indices, True)
+    return (groups * mask).flatten(-2)
+
+
+@sm80_only
+@pytest.mark.parametrize("dtype", _dtypes, ids=[str(x) for x in _dtypes])
+@pytest.mark.parametrize("B", [1, 100])
+def test_swiglu_sparse24(dtype, B: int):
+    torch.manual_seed(B)
+    device = "cuda"
+    module = xsw.SwiGLU(in_features=256, hidden_features=384, bias=True)
+    module = module.to(device).to(dtype)
+    with torch.no_grad():
+        module.w12.weight.copy_(_prune_2_4(module.w12.weight))
+        module.w3.weight.copy_(_prune_2_4(module.w3.weight))
+    x = torch.randn([B, 256], device=device, dtype=dtype)
+
+    w1w2 = xsw.swiglu_sparse24_compress(module.w12.weight)
+    w3 = xsw.swiglu_sparse24_compress(module.w3.weight)
+    assert w1w2[0].shape == (768, 128)
+    with torch.no_grad():
+        out = xsw.swiglu_sparse24(x, w1w2, module.w12.bias, w3, module.w3.bias)
+        ref = xsw.swiglu(x, *module._ordered_params(), op=xsw.SwiGLUEagerOp)
+        ref_f32 = module.float()(x.float())
+    assert_allclose(out, ref, ref_f32, "fw", atol=2e-2, rtol=1e-2)
+
+    # Not 2:4 sparse
+    with pytest.raises(RuntimeError):
+        xsw.swiglu_sparse24_compress(torch.ones([32, 64], device=device, dtype=dtype))
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+@pytest.mark.parametrize("B", [5, 200])
+def test_packed_cpu(B: int, bias: bool):
+    op, module, x = _packed_fused_setup(
+        "cpu",
+        bias,
+        B=B,
+        dtype=torch.float,
+        in_features=64,
+        hidden_features=96,
+        requires_grad=True,
+        seed=B,
+    )
+    module_ref = copy.deepcopy(module)
+    x_ref = x.detach().clone().requires_grad_()
+    grad = torch.randn_like(x)
+
+    out = xsw.swiglu(x, *module._ordered_params(), op=op)
+    out_ref = xsw.swiglu(x_ref, *module_ref._ordered_params(), op=xsw.SwiGLUEagerOp)
+    assert_allclose(out, out_ref, msg="fw", atol=1e-5, rtol=1e-5)
+    out.backward(grad)
+    out_ref.backward(grad)
+    assert_allclose(x.grad, x_ref.grad, msg="dx", atol=1e-5, rtol=1e-5)
+    for (name, p), p_ref in zip(module.named_parameters(), module_ref.parameters()):
+        assert_allclose(p.grad, p_ref.grad, msg=name, atol=1e-4, rtol=1e-5)
+
+    # Inference: x1 / x2 are computed by blocks of rows, and not kept
+    with torch.inference_mode():
+        out_inference = xsw.swiglu(x, *module._ordered_params(), op=op)
+    assert_allclose(out_inference, out_ref, msg="inference", atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("bias", [False, True], ids=["nobias", "bias"])
+def test_packed_meta(bias: bool):
+    # Shapes only, without running the kernels (eg for `torch.compile`)
+    B, D, H = 5, 64, 96
+
+    def empty(*shape: int) -> torch.Tensor:
+        return torch.empty(shape, device="meta", dtype=torch.half, requires_grad=True)
+
+    x, w1w2, w3 = empty(2, B, D), empty(2, H, D), empty(D, H)
+    biases = [empty(2, H), empty(D)] if bias else [None, None]
+    out = torch.ops.xformers.swiglu_packedw(x, w1w2, biases[0], w3, biases[1])
+    assert out.shape == (2, B, D) and out.device.type == "meta"
+    out.backward(torch.empty_like(out))
+    for p in [x, w1w2, w3, *biases]:
+        if p is not None:
+            assert p.grad is not None and p.grad.shape == p.shape
+
+
+def _tensor_parallel_worker(rank, world_size, init_url, sequence_parallel):
+    torch.distributed.init_process_group(
+        backend="nccl", rank=rank, world_size=world_size, init_method=init_url
+    )
+    torch.cuda.set_device(rank)
+    device = f"cuda:{rank}"
+    torch.manual_seed(0)
+    B, D, H = 24 * world_size, 128, 64 * world_size
+    dtype = torch.float
+    module = xsw.SwiGLU(in_features=D, hidden_features=H, bias=True)
+    module = module.to(device).to(dtype)
+    x = torch.randn([B, D], device=device, dtype=dtype, requires_grad=True)
+    grad = torch.randn([B, D], device=device, dtype=dtype)
+    # Hidden features sharded across the ranks
+    hidden = slice(rank * H // world_size, (rank + 1) * H // world_size)
+    w1w2 = module.w12.weight.view(2, H, D)[:, hidden].detach().clone()
+    b1b2 = module.w12.bias.view(2, H)[:, hidden].detach().clone()
+    w3 = module.w3.weight[:, hidden].detach().clone()
+    b3 = module.w3.bias.detach().clone()
+    shards = [w.requires_grad_(True) for w in [w1w2, b1b2, w3, b3]]
+    x_local, grad_local = x.detach(), grad
+    if sequence_parallel:
+        x_local, grad_local = [t.chunk(world_size)[rank] for t in [x_local, grad]]
+    x_local = x_local.clone().requires_grad_(True)
+
+    out = swiglu_tensor_parallel(
+        x_local, *shards, num_chunks=3, sequence_parallel=sequence_parallel
+    )
+    out.backward(grad_local)
+    ref = module(x)
+    ref.backward(grad)
+    if sequence_parallel:
+        ref, x_grad = ref.chunk(world_size)[rank], x.grad.chunk(world_size)[rank]
+    else:
+        x_grad = x.grad
+    assert_allclose(out, ref, msg="fw", atol=1e-4, rtol=1e-4)
+    assert_allclose(x_local.grad, x_grad, msg="dx", atol=1e-4, rtol=1e-4)
+    ref_grads = [
+        module.w12.weight.grad.view(2, H, D)[:, hidden],
+        module.w12.bias.grad.view(2, H)[:, hidden],
+        module.w3.weight.grad[:, hidden],
+        module.w3.bias.grad,
+    ]
+    for name, shard, ref_grad in zip(["w1w2", "b1b2", "w3", "b3"], shards, ref_grads):
+        assert_allclose(shard.grad, ref_grad, msg=name, atol=1e-3, rtol=1e-4)
+    torch.distributed.destroy_process_group()
+
+
+@cuda_only
+@pytest.mark.skipif(torch.cuda.device_count() < 2, reason="requires 2 GPUs")
+@pytest.mark.parametrize("sequence_parallel", [False, True], ids=["ar", "sp"])
+def test_swiglu_tensor_parallel(sequence_parallel: bool):
+    world_size = min(torch.cuda.device_count(), 4)
+    init_url = "file://" + tempfile.mkstemp()[1]
+    torch.multiprocessing.spawn(
+        _tensor_parallel_worker,
+        args=(world_size, init_url, sequence_parallel),
+        nprocs=world_size,
+    )
@@ -0,0 +1,202 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+"""
+Device time of the individual kernels of the csrc operators, over a sweep of
+shapes. The operators are called directly (without autograd), and the kernels
+are timed on the GPU by the profiler, so the results don't include the Python
+dispatch. Kernels are reported by their name, which contains the template
+arguments of the instantiation, eg
+`attention_kernel_batched<AttentionKernel<cutlass::half_t, cutlass::arch::Sm80, ...`
+
+    python xformers/benchmarks/benchmark_kernels.py --filter attention_kernel
+"""
+
+import argparse
+import itertools
+import re
+from typing import Callable, Dict, Iterator, List, Tuple
+
+import torch
+from torch.autograd import DeviceType
+from torch.profiler import ProfilerActivity, profile
+
+from xformers.components.attention.core import SparseCS, _create_random_sparsity
+
+device = torch.device("cuda")
+
+ATTENTION_SHAPES = [
+    # Format: [B, M, H, K]
+    (1, 4096, 16, 64),
+    (8, 1024, 16, 64),
+    (32, 256, 16, 128),
+    (256, 197, 6, 64),
+    (8, 2048, 8, 32),
+]
+SPUTNIK_SHAPES = [
+    # Format: [B, M, K], sparsity
+    ((96, 3136, 32), 0.9844),
+    ((192, 784, 32), 0.9375),
+    ((32, 1024, 128), 0.95),
+    ((8, 4096, 128), 0.99),
+]
+SWIGLU_SHAPES = [
+    # Format: [B, D, H]
+    (4728, 1536, 2736),
+    (4728, 1536, 1024),
+    (32768, 2048, 5632),
+    (64, 4096, 11008),
+]
+DTYPE2STR = {torch.float: "f32", torch.half: "f16", torch.bfloat16: "b16"}
+
+Case = Tuple[str, Callable[[], None]]
+
+
+def attention_cases() -> Iterator[Case]:
+    for (B, M, H, K), dtype in itertools.product(
+        ATTENTION_SHAPES, [torch.half, torch.bfloat16, torch.float]
+    ):
+        query, key, value = [
+            torch.randn([B, M, H, K], device=device, dtype=dtype) for _ in range(3)
+        ]
+        out, lse, _, _ = torch.ops.xformers.efficient_attention_forward_cutlass(
+            query=query,
+            key=key,
+            value=value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=-1,
+            compute_logsumexp=True,
+            causal=False,
+        )
+        grad = torch.randn_like(out)
+        sub_label = f"{DTYPE2STR[dtype]} B={B}, M={M}, H={H}, K={K}"
+
+        def fw(query=query, key=key, value=value) -> None:
+            torch.ops.xformers.efficient_attention_forward_cutlass(
+                query=query,
+                key=key,
+                value=value,
+                cu_seqlens_q=None,
+                cu_seqlens_k=None,
+                max_seqlen_q=-1,
+                compute_logsumexp=True,
+                causal=False,
+            )
+
+        def bw(grad=grad, query=query, key=key, value=value, lse=lse, out=out) -> None:
+            torch.ops.xformers.efficient_attention_backward_cutlass(
+                grad, query, key, value, lse, out, causal=False
+            )
+
+        yield f"attention fw {sub_label}", fw
+        yield f"attention bw {sub_label}", bw
+
+
+def sputnik_cases() -> Iterator[Case]:
+    for (B, M, K), prob in SPUTNIK_SHAPES:
+        a = torch.rand(B, M, K, device=device)
+        b = torch.rand(B, M, K, device=device)
+        mask = _create_random_sparsity(
+            torch.ones(1, M, M, dtype=torch.bool), prob, divisible_by=16
+        )
+        mask = SparseCS(mask, device)
+        values = torch.rand(B, mask.values.shape[-1], device=device)
+        sub_label = f"B={B}, M={M}, K={K}, prob={prob:0.4f}"
+
+        def sddmm(a=a, b=b, mask=mask) -> None:
+            torch.ops.xformers.sddmm_sputnik(
+                a, b, mask.row_indices, mask.row_offsets, mask.column_indices
+            )
+
+        def spmm(b=b, values=values, mask=mask, M=M) -> None:
+            torch.ops.xformers.spmm_sputnik(
+                b,
+                mask.row_indices,
+                values,
+                mask.row_offsets,
+                mask.column_indices,
+                M,
+            )
+
+        yield f"sddmm {sub_label}", sddmm
+        yield f"spmm {sub_label}", spmm
+
+
+def swiglu_cases() -> Iterator[Case]:
+    for (B, D, H), dtype in itertools.product(
+        SWIGLU_SHAPES, [torch.half, torch.bfloat16]
+    ):
+        x = torch.randn([B, D], device=device, dtype=dtype)
+        w1, w2 = [torch.randn([H, D], device=device, dtype=dtype) for _ in range(2)]
+        b1, b2 = [torch.randn([H], device=device, dtype=dtype) for _ in range(2)]
+
+        def dual_gemm(x=x, w1=w1, b1=b1, w2=w2, b2=b2) -> None:
+            torch.ops.xformers.dual_gemm_silu_identity_mul(x, w1, b1, w2, b2)
+
+        yield f"dual_gemm {DTYPE2STR[dtype]} B={B}, D={D}, H={H}", dual_gemm
+
+
+def profile_kernels(
+    fn: Callable[[], None], iters: int, warmup: int
+) -> List[Tuple[str, int, float]]:
+    """
+    Returns the (name, launches per call, average time in us) of the kernels
+    launched by ``fn``
+    """
+    for _ in range(warmup):
+        fn()
+    torch.cuda.synchronize()
+    with profile(activities=[ProfilerActivity.CUDA]) as prof:
+        for _ in range(iters):
+            fn()
+        torch.cuda.synchronize()
+    kernels = []
+    for evt in prof.key_averages():
+        if evt.device_type != DeviceType.CUDA or evt.count == 0:
+            continue
+        kernels.append(
+            (evt.key, evt.count // iters, evt.self_cuda_time_total / evt.count)
+        )
+    return sorted(kernels, key=lambda k: -k[1] * k[2])
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "--ops",
+        default="attention,sputnik,swiglu",
+        type=str,
+        help="Operators to benchmark (coma separated)",
+    )
+    parser.add_argument(
+        "--filter", default=None, type=str, help="Only report kernels matching"
+    )
+    parser.add_argument("--iters", default=20, type=int)
+    parser.add_argument("--warmup", default=3, type=int)
+    args = parser.parse_args()
+
+    all_cases: Dict[str, Callable[[], Iterator[Case]]] = {
+        "attention": attention_cases,
+        "sputnik": sputnik_cases,
+        "swiglu": swiglu_cases,
+    }
+    kernel_filter = re.compile(args.filter) if args.filter is not None else None
+    for name in args.ops.split(","):
+        for label, fn in all_cases[name]():
+            try:
+                kernels = profile_kernels(fn, args.iters, args.warmup)
+            except RuntimeError as e:
+                print(f"{label}: skipped ({str(e).splitlines()[0]})")
+                continue
+            print(label)
+            for kernel, launches, time_us in kernels:
+                if kernel_filter is not None and not kernel_filter.search(kernel):
+                    continue
+                print(f"  {time_us:10.1f}us x{launches:<3d} {kernel}")
+
+
+if __name__ == "__main__":
+    main()
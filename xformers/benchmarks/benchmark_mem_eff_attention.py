@@ -7,11 +7,11 @@
 import itertools
 import math
 from functools import partial
-from typing import cast
+from typing import Sequence, Tuple, cast
 
 import torch
 from torch.utils import benchmark
-from utils import benchmark_main_helper
+from utils import benchmark_main_helper, benchmark_stress_helper, with_roofline
 
 import xformers.ops
 
@@ -65,6 +65,47 @@ def ref_attention(q, k, v, attn_bias, p=0.0):
     return out.permute((0, 2, 1, 3))
 
 
+def attention_cost(
+    seqlens_q: Sequence[int],
+    seqlens_k: Sequence[int],
+    num_heads: int,
+    K: int,
+    Kv: int,
+    dtype: torch.dtype,
+    causal: bool,
+    backward: bool,
+) -> Tuple[float, float]:
+    """
+    FLOPs and bytes moved by an attention over sequences of the given lengths
+    (one per batch element, or the sequences of a variable-length batch).
+    With `causal`, only the (query, key) pairs which are not masked are
+    counted. A bias tensor is broadcast, and its reads are not counted
+    """
+    num_pairs = 0
+    for m, n in zip(seqlens_q, seqlens_k):
+        if not causal:
+            num_pairs += m * n
+        elif m <= n:
+            num_pairs += m * (m + 1) // 2
+        else:
+            num_pairs += n * (n + 1) // 2 + (m - n) * n
+    rows_q, rows_k = sum(seqlens_q), sum(seqlens_k)
+    elem = torch.tensor([], dtype=dtype).element_size()
+    if not backward:
+        # Q @ K.T and P @ V. Reads Q/K/V, writes the output
+        flops = 2 * num_pairs * num_heads * (K + Kv)
+        bytes_moved = elem * num_heads * (rows_q + rows_k) * (K + Kv)
+    else:
+        # Q @ K.T again, dV, dP, dQ and dK. Reads Q/K/V/out/grad_out and the
+        # logsumexp, writes dQ/dK/dV
+        flops = 2 * num_pairs * num_heads * (3 * K + 2 * Kv)
+        bytes_moved = (
+            elem * num_heads * 2 * (rows_q + rows_k) * (K + Kv)
+            + 4 * num_heads * rows_q
+        )
+    return flops, bytes_moved
+
+
 min_run_time = 0.5
 device = torch.device("cuda")
 
@@ -176,6 +217,8 @@ def benchmark_forward(shape, num_threads: int, attn_bias_type, dtype):
         torch.float: "f32",
     }[dtype]
     sub_label = f"{dtype_str} B={B}, M={M}, H={H}, K={K}"
+    causal = attn_bias_type is xformers.ops.LowerTriangularMask
+    cost = attention_cost([M] * B, [M] * B, H, K, K, dtype, causal, backward=False)
 
     try:
         r = xformers.ops.memory_efficient_attention(q, k, v, attn_bias, op=op).float()
@@ -192,35 +235,43 @@ def benchmark_forward(shape, num_threads: int, attn_bias_type, dtype):
     except RuntimeError:  # OOM
         pass
 
-    yield benchmark.Timer(
-        stmt="fn(q, k, v, attn_bias, p)",
-        globals={
-            "q": q,
-            "k": k,
-            "v": v,
-            "attn_bias": attn_bias,
-            "p": p,
-            "fn": partial(xformers.ops.memory_efficient_attention, op=op),
-        },
-        label=f"attention (attn_bias={attn_bias_type})",
-        description=op.NAME,
-        sub_label=sub_label,
-        num_threads=num_threads,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt="fn(q, k, v, attn_bias, p)",
+            globals={
+                "q": q,
+                "k": k,
+                "v": v,
+                "attn_bias": attn_bias,
+                "p": p,
+                "fn": partial(xformers.ops.memory_efficient_attention, op=op),
+            },
+            label=f"attention (attn_bias={attn_bias_type})",
+            description=op.NAME,
+            sub_label=sub_label,
+            num_threads=num_threads,
+        ),
+        *cost,
+        dtype,
     )
-    yield benchmark.Timer(
-        stmt="fn(q, k, v, attn_bias, p)",
-        globals={
-            "q": q,
-            "k": k,
-            "v": v,
-            "attn_bias": attn_bias,
-            "p": p,
-            "fn": ref_attention,
-        },
-        label=f"attention (attn_bias={attn_bias_type})",
-        description="eager",
-        sub_label=sub_label,
-        num_threads=num_threads,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt="fn(q, k, v, attn_bias, p)",
+            globals={
+                "q": q,
+                "k": k,
+                "v": v,
+                "attn_bias": attn_bias,
+                "p": p,
+                "fn": ref_attention,
+            },
+            label=f"attention (attn_bias={attn_bias_type})",
+            description="eager",
+            sub_label=sub_label,
+            num_threads=num_threads,
+        ),
+        *cost,
+        dtype,
     )
 
 
@@ -260,20 +311,26 @@ def benchmark_backward(shape, num_threads: int, attn_bias_type, dtype):
         torch.float: "f32",
     }[dtype]
     sub_label = f"{dtype_str} B={B}, M={M}, H={H}, K={K}"
+    causal = attn_bias_type is xformers.ops.LowerTriangularMask
+    cost = attention_cost([M] * B, [M] * B, H, K, K, dtype, causal, backward=True)
 
     out = xformers.ops.memory_efficient_attention(q, k, v, attn_bias, p, op=op)
     grad_benchmark = torch.ones_like(q)
 
-    yield benchmark.Timer(
-        stmt="out.backward(grad, retain_graph=True)",
-        globals={
-            "out": out,
-            "grad": grad_benchmark,
-        },
-        label=f"attention backward (attn_bias={attn_bias_type})",
-        description=op.NAME,
-        sub_label=sub_label,
-        num_threads=num_threads,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt="out.backward(grad, retain_graph=True)",
+            globals={
+                "out": out,
+                "grad": grad_benchmark,
+            },
+            label=f"attention backward (attn_bias={attn_bias_type})",
+            description=op.NAME,
+            sub_label=sub_label,
+            num_threads=num_threads,
+        ),
+        *cost,
+        dtype,
     )
     del out
 
@@ -295,16 +352,20 @@ def benchmark_backward(shape, num_threads: int, attn_bias_type, dtype):
         qkv.grad = None
         del r, grad
 
-        yield benchmark.Timer(
-            stmt="out.backward(grad, retain_graph=True)",
-            globals={
-                "out": ref_attention(q, k, v, attn_bias),
-                "grad": grad_benchmark,
-            },
-            label=f"attention backward (attn_bias={attn_bias_type})",
-            description="vanilla",
-            sub_label=sub_label,
-            num_threads=num_threads,
+        yield with_roofline(
+            benchmark.Timer(
+                stmt="out.backward(grad, retain_graph=True)",
+                globals={
+                    "out": ref_attention(q, k, v, attn_bias),
+                    "grad": grad_benchmark,
+                },
+                label=f"attention backward (attn_bias={attn_bias_type})",
+                description="vanilla",
+                sub_label=sub_label,
+                num_threads=num_threads,
+            ),
+            *cost,
+            dtype,
         )
     except RuntimeError:  # OOM
         pass
@@ -312,3 +373,81 @@ def benchmark_backward(shape, num_threads: int, attn_bias_type, dtype):
 
 benchmark_main_helper(benchmark_forward, CASES, min_run_time=min_run_time)
 benchmark_main_helper(benchmark_backward, CASES, min_run_time=min_run_time)
+
+
+# Mixed shapes of the sustained load benchmarks, called in turn. K > 128 uses
+# the f32 `output_accum` buffer in the forward
+STRESS_SHAPES = [
+    (32, 197, 16, 64),
+    (1, 4096, 16, 40),
+    (16, 1024, 16, 128),
+    (8, 512, 16, 256),
+]
+STRESS_CASES = list(
+    product_dict(
+        attn_bias_type=[type(None), xformers.ops.LowerTriangularMask],
+        dtype=[torch.half, torch.bfloat16, torch.float],
+    )
+)
+
+
+def stress_attention(attn_bias_type, dtype):
+    fw_calls, fwbw_calls = [], []
+    for shape in STRESS_SHAPES:
+        B, M, H, K = shape
+        dispatch = xformers.ops.AttentionOpDispatch(
+            dtype=dtype,
+            device=device,
+            k=K,
+            attn_bias_type=attn_bias_type,
+            has_dropout=False,
+            kv_len=M,
+            q_len=M,
+        )
+        try:
+            op = dispatch.op if FORCE_OP is None else FORCE_OP
+        except NotImplementedError:
+            continue
+        if not op.supports(dispatch):
+            continue
+        qkv, q, k, v = create_tensors(shape, dtype, requires_grad=True)
+        attn_bias = create_attn_bias(
+            attn_bias_type,
+            batch_size=B,
+            num_heads=H,
+            q_len=M,
+            kv_len=M,
+            device=device,
+            dtype=dtype,
+        )
+        fn = partial(
+            xformers.ops.memory_efficient_attention,
+            q,
+            k,
+            v,
+            attn_bias,
+            op=op,
+        )
+
+        # The output keeps the logsumexp saved for the backward alive
+        def fwbw(fn=fn, qkv=qkv):
+            out = fn()
+            # Includes the `delta` buffer of the backward
+            return torch.autograd.grad(out, [qkv], torch.ones_like(out))
+
+        fw_calls.append(fn)
+        fwbw_calls.append(fwbw)
+
+    if not fw_calls:
+        return
+    dtype_str = {
+        torch.bfloat16: "b16",
+        torch.half: "f16",
+        torch.float: "f32",
+    }[dtype]
+    causal = "causal" if attn_bias_type is xformers.ops.LowerTriangularMask else ""
+    yield f"attention fw {dtype_str} {causal}", fw_calls
+    yield f"attention fwbw {dtype_str} {causal}", fwbw_calls
+
+
+benchmark_stress_helper(stress_attention, STRESS_CASES)
@@ -4,9 +4,11 @@
 # LICENSE file in the root directory of this source tree.
 
 import itertools
+from functools import partial
 
 import torch
 from torch.utils import benchmark
+from utils import benchmark_stress_helper, is_stress_run
 
 from xformers.components.attention._sputnik_sparse import _csr_to_coo
 from xformers.components.attention.core import SparseCS, _create_random_sparsity
@@ -107,11 +109,49 @@ vit_sizes = [
 SPARSITIES = [0.70, 0.80, 0.85, 0.90, 0.93, 0.95, 0.97]
 vit_config = list(itertools.product(vit_sizes, SPARSITIES))
 
-results = []
 
-print("Swin Transformer")
-results += bench_sddmm(swin_t_config)
-print("ViT")
-results += bench_sddmm(vit_config)
-print("Basic cases")
-results += bench_sddmm(basic_config)
+def stress_sddmm(backend):
+    device = torch.device("cuda")
+    calls = []
+    for (B, M, K), prob in STRESS_CONFIGS:
+        a = torch.rand(B, M, K, device=device)
+        b = torch.rand(B, M, K, device=device)
+        mask = _create_random_sparsity(
+            torch.ones(1, M, M, dtype=torch.bool), prob, divisible_by=16
+        )
+        mask = SparseCS(mask, device)
+        calls.append(
+            partial(
+                _get_fn(backend),
+                a,
+                b,
+                mask.row_indices,
+                mask.row_offsets,
+                mask.column_indices,
+            )
+        )
+    yield f"sddmm {backend}", calls
+
+
+# Mixed sizes and sparsities of the sustained load benchmarks, called in turn
+STRESS_CONFIGS = [
+    swin_t_config[0],
+    swin_t_config[2],
+    (vit_sizes[0], 0.9),
+    (BASIC_SIZES[3], 0.99),
+]
+
+if is_stress_run():
+    benchmark_stress_helper(
+        stress_sddmm,
+        [{"backend": b} for b in ["csr_sputnik", "csr_ge", "coo_ge", "csr_to_coo"]],
+    )
+else:
+    results = []
+
+    print("Swin Transformer")
+    results += bench_sddmm(swin_t_config)
+    print("ViT")
+    results += bench_sddmm(vit_config)
+    print("Basic cases")
+    results += bench_sddmm(basic_config)
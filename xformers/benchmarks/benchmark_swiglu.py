@@ -7,11 +7,11 @@
 import itertools
 from contextlib import nullcontext
 from functools import partial
-from typing import Any
+from typing import Any, Tuple
 
 import torch
 from torch.utils import benchmark
-from utils import benchmark_main_helper
+from utils import benchmark_main_helper, benchmark_stress_helper, with_roofline
 
 import xformers.ops.swiglu_op as xsw
 
@@ -60,6 +60,21 @@ DTYPE2STR = {
 }
 
 
+def swiglu_cost(B: int, D: int, H: int, backward: bool) -> Tuple[float, float]:
+    """
+    FLOPs of the 3 gemms for `B` rows of `D` features (in and out) and `H`
+    hidden features, and number of elements moved: the inputs, weights and
+    outputs, and the activations kept for the backward (x1, x2, x4)
+    """
+    flops = 2 * B * D * 2 * H + 2 * B * H * D
+    if not backward:
+        return flops, 2 * B * D + 3 * H * D + 3 * B * H
+    # The gradients of the activations and of the weights: twice the gemms.
+    # Reads grad_out, x, x1/x2 and the weights, writes dx and the gradients of
+    # the weights, and dx1/dx2 are written and read back
+    return 2 * flops, 3 * B * D + 6 * H * D + 6 * B * H
+
+
 def benchmark_swiglu(shape, dtype, bias: bool):
     if dtype == "autocast_half":
         inp_dtype, model_dtype, autocast = torch.float, torch.float, True
@@ -76,31 +91,44 @@ def benchmark_swiglu(shape, dtype, bias: bool):
     dtype_str = DTYPE2STR.get(dtype, dtype)
     bstr = "bias" if bias else "nobi"
     sub_label = f"{dtype_str} B={shape[0]}, I={shape[1]}, H={shape[2]} {bstr}"
+    compute_dtype = torch.half if dtype == "autocast_half" else dtype
+    elem = torch.tensor([], dtype=compute_dtype).element_size()
+    flops, numel = swiglu_cost(*shape, backward=False)
 
     params = module._ordered_params()
 
     PREFIX = 'with torch.autocast("cuda", dtype=torch.half):\n    ' if autocast else ""
-    yield benchmark.Timer(
-        stmt=f"{PREFIX}fn(x, *args)",
-        globals={
-            "x": x,
-            "args": params,
-            "fn": partial(xsw.swiglu, op=OP),
-        },
-        label="swiglu_fw",
-        description=OP.NAME,
-        sub_label=sub_label,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt=f"{PREFIX}fn(x, *args)",
+            globals={
+                "x": x,
+                "args": params,
+                "fn": partial(xsw.swiglu, op=OP),
+            },
+            label="swiglu_fw",
+            description=OP.NAME,
+            sub_label=sub_label,
+        ),
+        flops,
+        numel * elem,
+        compute_dtype,
     )
-    yield benchmark.Timer(
-        stmt=f"{PREFIX}fn(x, *args)",
-        globals={
-            "x": x,
-            "args": params,
-            "fn": partial(xsw.swiglu, op=xsw.SwiGLUEagerOp),
-        },
-        label="swiglu_fw",
-        description="eager",
-        sub_label=sub_label,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt=f"{PREFIX}fn(x, *args)",
+            globals={
+                "x": x,
+                "args": params,
+                "fn": partial(xsw.swiglu, op=xsw.SwiGLUEagerOp),
+            },
+            label="swiglu_fw",
+            description="eager",
+            sub_label=sub_label,
+        ),
+        flops,
+        numel * elem,
+        compute_dtype,
     )
 
 
@@ -123,38 +151,93 @@ def benchmark_swiglu_bw(shape, dtype, bias: bool):
     dtype_str = DTYPE2STR.get(dtype, dtype)
     bstr = "bias" if bias else "nobi"
     sub_label = f"{dtype_str} B={shape[0]}, I={shape[1]}, H={shape[2]} {bstr}"
+    compute_dtype = torch.half if dtype == "autocast_half" else dtype
+    elem = torch.tensor([], dtype=compute_dtype).element_size()
+    flops, numel = swiglu_cost(*shape, backward=True)
 
     params = module._ordered_params()
     with cm():
         out = xsw.swiglu(x, *params, op=OP)
     grad = torch.zeros_like(out)
 
-    yield benchmark.Timer(
-        stmt="out.backward(grad, retain_graph=True)",
-        globals={
-            "out": out,
-            "grad": grad,
-        },
-        label="swiglu_bw",
-        description=OP.NAME,
-        sub_label=sub_label,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt="out.backward(grad, retain_graph=True)",
+            globals={
+                "out": out,
+                "grad": grad,
+            },
+            label="swiglu_bw",
+            description=OP.NAME,
+            sub_label=sub_label,
+        ),
+        flops,
+        numel * elem,
+        compute_dtype,
     )
     del out
 
     with cm():
         out = xsw.swiglu(x, *params, op=xsw.SwiGLUEagerOp)
 
-    yield benchmark.Timer(
-        stmt="out.backward(grad, retain_graph=True)",
-        globals={
-            "out": out,
-            "grad": grad,
-        },
-        label="swiglu_bw",
-        description="eager",
-        sub_label=sub_label,
+    yield with_roofline(
+        benchmark.Timer(
+            stmt="out.backward(grad, retain_graph=True)",
+            globals={
+                "out": out,
+                "grad": grad,
+            },
+            label="swiglu_bw",
+            description="eager",
+            sub_label=sub_label,
+        ),
+        flops,
+        numel * elem,
+        compute_dtype,
     )
 
 
+# Mixed shapes of the sustained load benchmarks, called in turn
+STRESS_SHAPES = [
+    (9456, 1536, 2736),
+    (4440, 1536, 2736),
+    (4728, 1536, 1024),
+    (1024, 1536, 2736),
+]
+STRESS_CASES = list(
+    product_dict(dtype=[torch.bfloat16, torch.half], bias=[True, False])
+)
+
+
+def stress_swiglu(dtype, bias: bool):
+    fw_calls, fwbw_calls = [], []
+    for shape in STRESS_SHAPES:
+        x = torch.randn(shape[:2], device=device, dtype=dtype, requires_grad=True)
+        module = (
+            xsw.SwiGLU(in_features=shape[1], hidden_features=shape[2], bias=bias)
+            .to(device)
+            .to(dtype)
+        )
+        params = module._ordered_params()
+        inputs = [x] + [p for p in params if p is not None]
+
+        # `SwiGLUPackedFusedOp` runs the `SwiGLUPackedWeights` autograd
+        # function: the output keeps the activations it saves alive
+        def fw(x=x, params=params):
+            return xsw.swiglu(x, *params, op=OP)
+
+        def fwbw(x=x, params=params, inputs=inputs):
+            out = xsw.swiglu(x, *params, op=OP)
+            return torch.autograd.grad(out, inputs, torch.ones_like(out))
+
+        fw_calls.append(fw)
+        fwbw_calls.append(fwbw)
+
+    sub_label = f"{DTYPE2STR[dtype].strip()} {'bias' if bias else 'nobi'}"
+    yield f"swiglu_fw SwiGLUPackedWeights saved {sub_label}", fw_calls
+    yield f"swiglu_fwbw SwiGLUPackedWeights {sub_label}", fwbw_calls
+
+
 benchmark_main_helper(benchmark_swiglu, CASES, min_run_time=min_run_time)
 benchmark_main_helper(benchmark_swiglu_bw, CASES, min_run_time=min_run_time)
+benchmark_stress_helper(stress_swiglu, STRESS_CASES)
@@ -0,0 +1,107 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+"""
+Breakdown of the cycles of the cutlass attention forward kernels by phase
+(loads and MM0, softmax, MM1, epilogue), for one shape. Requires a build with
+``XFORMERS_MEM_EFF_ATTENTION_PROFILE=1``::
+
+    XFORMERS_MEM_EFF_ATTENTION_PROFILE=1 python setup.py develop
+    python xformers/benchmarks/profile_mem_eff_attention.py \\
+        --shape 16,1024,16,64 --dtype f16 --causal
+
+The cycles are measured with ``clock64()`` on every warp, so they include the
+time the warps wait for each other (counted in the phase in which they wait),
+and the instrumentation itself slows the kernels down slightly.
+"""
+
+import argparse
+from typing import List, Optional
+
+import torch
+
+import xformers.ops
+from xformers.ops.memory_efficient_attention import (
+    MEMORY_EFFICIENT_ATTENTION_PROFILE_PHASES,
+)
+
+DTYPES = {"f16": torch.half, "bf16": torch.bfloat16, "f32": torch.float}
+
+
+def _summarize(name: str, cycles: torch.Tensor, top: int) -> None:
+    phases = MEMORY_EFFICIENT_ATTENTION_PROFILE_PHASES
+    # Leaves out the CTAs which exited without processing any query
+    cta_ids = (cycles.sum(dim=(1, 2)) > 0).nonzero().flatten()
+    if cta_ids.numel() == 0:
+        return
+    cycles = cycles[cta_ids]
+    # [num_ctas, num_phases]: average of the warps of a CTA
+    per_cta = cycles.double().mean(dim=1)
+    total = per_cta.sum(dim=1)
+    share = per_cta.sum(dim=0) / total.sum()
+    print(f"{name}: {per_cta.shape[0]} CTAs, {cycles.shape[1]} warps per CTA")
+    print("  " + " | ".join(f"{p:>9}" for p in phases))
+    print("  " + " | ".join(f"{100 * s:>8.1f}%" for s in share.tolist()))
+    print(
+        f"  cycles per CTA: mean {total.mean():.0f}, min {total.min():.0f}, "
+        f"max {total.max():.0f} (max/mean {total.max() / total.mean():.2f})"
+    )
+    # Imbalance between the warps of a CTA: time spent waiting at barriers
+    warp_total = cycles.double().sum(dim=2)
+    spread = (warp_total.max(dim=1).values - warp_total.min(dim=1).values).mean()
+    print(f"  warp spread in a CTA: {spread:.0f} cycles on average")
+    print(f"  slowest CTAs (cycles: {', '.join(phases)}):")
+    slowest = total.argsort(descending=True)[:top]
+    for i in slowest.tolist():
+        row = ", ".join(f"{c:.0f}" for c in per_cta[i].tolist())
+        print(f"    #{cta_ids[i].item()}: {total[i]:.0f} ({row})")
+
+
+def main(argv: Optional[List[str]] = None) -> None:
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument(
+        "--shape", default="16,1024,16,64", help="B,M,H,K of the query/key/value"
+    )
+    parser.add_argument("--kv-len", default=None, type=int, help="Defaults to M")
+    parser.add_argument("--dtype", default="f16", choices=list(DTYPES.keys()))
+    parser.add_argument("--causal", action="store_true")
+    parser.add_argument(
+        "--iters", default=10, type=int, help="Launches profiled (after a warmup)"
+    )
+    parser.add_argument(
+        "--top", default=5, type=int, help="Number of slowest CTAs displayed"
+    )
+    args = parser.parse_args(argv)
+
+    B, M, H, K = [int(x) for x in args.shape.split(",")]
+    N = M if args.kv_len is None else args.kv_len
+    dtype = DTYPES[args.dtype]
+    q = torch.randn([B, M, H, K], device="cuda", dtype=dtype)
+    k = torch.randn([B, N, H, K], device="cuda", dtype=dtype)
+    v = torch.randn([B, N, H, K], device="cuda", dtype=dtype)
+    attn_bias = xformers.ops.LowerTriangularMask() if args.causal else None
+
+    def run():
+        xformers.ops.memory_efficient_attention(
+            q, k, v, attn_bias, op=xformers.ops.MemoryEfficientAttentionCutlassOp
+        )
+
+    run()
+    xformers.ops.memory_efficient_attention_profile(reset=True)
+    for _ in range(args.iters):
+        run()
+    torch.cuda.synchronize()
+    profile = xformers.ops.memory_efficient_attention_profile(reset=True)
+    if not profile:
+        raise RuntimeError(
+            "No profile recorded: xFormers should be built with "
+            "XFORMERS_MEM_EFF_ATTENTION_PROFILE=1"
+        )
+    for name, cycles in profile.items():
+        _summarize(name, cycles.cpu(), args.top)
+
+
+if __name__ == "__main__":
+    main()
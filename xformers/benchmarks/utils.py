@@ -7,14 +7,18 @@ import argparse
 import contextlib
 import copy
 import glob
+import json
 import logging
 import math
 import os
 import pickle
+import subprocess
+import sys
 import tempfile
+import time
 from collections import defaultdict, namedtuple
 from dataclasses import replace
-from typing import Any, Dict, Generator, List, Set, Tuple
+from typing import Any, Callable, Dict, Generator, List, Optional, Set, Tuple
 
 import matplotlib.pyplot as plt
 import numpy as np
@@ -258,6 +262,208 @@ def _finalize_results(results: List[Tuple[Dict[str, Any], Any]]) -> List[Any]:
 
 BASELINE_DESCRIPTIONS = ["eager", "vanilla"]
 
+# Dense peaks of the GPUs: FLOP/s of the tensor cores in f16/bf16 and of the
+# f32 units (without TF32), and memory bandwidth in bytes/s. The first match
+# on the device name is used
+_DEVICE_PEAKS = [
+    # (name, f16/bf16, f32, bandwidth)
+    ("H100 PCIe", 756e12, 51e12, 2.0e12),
+    ("H100", 989e12, 67e12, 3.35e12),
+    ("A100-SXM4-80GB", 312e12, 19.5e12, 2.04e12),
+    ("A100 80GB PCIe", 312e12, 19.5e12, 1.94e12),
+    ("A100", 312e12, 19.5e12, 1.555e12),
+    ("A10", 125e12, 31.2e12, 0.6e12),
+    ("V100", 125e12, 15.7e12, 0.9e12),
+    ("T4", 65e12, 8.1e12, 0.32e12),
+]
+
+
+def with_roofline(
+    timer: benchmark.Timer, flops: float, bytes_moved: float, dtype: torch.dtype
+) -> benchmark.Timer:
+    """
+    Attaches the cost of a benchmark (FLOPs, and bytes read/written from/to
+    memory at least once), so that `benchmark_main_helper` reports the
+    achieved TFLOP/s and GB/s compared to the peaks of the device
+    """
+    timer.roofline = (flops, bytes_moved, dtype)  # type: ignore
+    return timer
+
+
+def _device_peaks(args: argparse.Namespace) -> Dict[torch.dtype, Tuple[float, float]]:
+    peaks: Dict[torch.dtype, Tuple[float, float]] = {}
+    try:
+        name = torch.cuda.get_device_name(torch.cuda.current_device())
+    except RuntimeError:  # No GPU
+        name = ""
+    for device_name, f16_flops, f32_flops, bandwidth in _DEVICE_PEAKS:
+        if device_name in name:
+            peaks = {
+                torch.half: (f16_flops, bandwidth),
+                torch.bfloat16: (f16_flops, bandwidth),
+                torch.float: (f32_flops, bandwidth),
+            }
+            break
+    for dtype in [torch.half, torch.bfloat16, torch.float]:
+        flops, bandwidth = peaks.get(dtype, (math.nan, math.nan))
+        if args.peak_tflops is not None:
+            flops = args.peak_tflops * 1e12
+        if args.peak_gbps is not None:
+            bandwidth = args.peak_gbps * 1e9
+        peaks[dtype] = (flops, bandwidth)
+    return peaks
+
+
+def _roofline_report(
+    roofline: Tuple[float, float, torch.dtype],
+    time_s: float,
+    peaks: Dict[torch.dtype, Tuple[float, float]],
+    threshold: float,
+) -> Tuple[str, bool]:
+    """
+    Achieved FLOP/s and bytes/s, and whether the case is above ``threshold``
+    of the peak of the resource it is bound by
+    """
+    flops, bytes_moved, dtype = roofline
+    peak_flops, peak_bandwidth = peaks[dtype]
+    achieved_flops, achieved_bandwidth = flops / time_s, bytes_moved / time_s
+    compute_frac = achieved_flops / peak_flops
+    memory_frac = achieved_bandwidth / peak_bandwidth
+    # Arithmetic intensity compared to the ridge point of the device
+    bound = "compute" if flops / bytes_moved > peak_flops / peak_bandwidth else "memory"
+    frac = compute_frac if bound == "compute" else memory_frac
+    passed = math.isnan(frac) or frac >= threshold
+    report = (
+        f"{achieved_flops / 1e12:.1f} TFLOP/s ({100 * compute_frac:.0f}% of peak), "
+        f"{achieved_bandwidth / 1e9:.0f} GB/s ({100 * memory_frac:.0f}%), "
+        f"{bound}-bound: {'PASS' if passed else 'FAIL'}"
+    )
+    return report, passed
+
+
+def _git_commit() -> str:
+    try:
+        return (
+            subprocess.check_output(
+                ["git", "rev-parse", "--short", "HEAD"],
+                cwd=os.path.dirname(os.path.abspath(__file__)),
+                stderr=subprocess.DEVNULL,
+            )
+            .decode("ascii")
+            .strip()
+        )
+    except (OSError, subprocess.CalledProcessError):
+        pass
+    try:
+        import xformers
+
+        return xformers.__version__
+    except (ImportError, AttributeError):
+        return "unknown"
+
+
+def _baseline_records(
+    benchmark_name: str, results: List[Tuple[Dict[str, Any], Any]], commit: str
+) -> Dict[str, Dict[str, Any]]:
+    """
+    Results of a run, keyed by benchmark, case (``label`` and ``sub_label``,
+    which contain the shape and dtype), algorithm and GPU. The commit is
+    stored next to the timings, so that runs of different builds can be
+    compared case by case
+    """
+    records: Dict[str, Dict[str, Any]] = {}
+    for metadata, r in results:
+        spec = r.task_spec
+        record = {
+            "benchmark": benchmark_name,
+            "label": spec.label,
+            "sub_label": spec.sub_label,
+            "algorithm": metadata.get(META_ALGORITHM, spec.description),
+            "num_threads": spec.num_threads,
+            "env": spec.env,
+            "commit": commit,
+            "median_s": r.median,
+            "mean_s": r.mean,
+            "mem_mb": getattr(r, "mem_use", None),
+        }
+        key = "|".join(
+            str(record[k])
+            for k in ["benchmark", "label", "sub_label", "algorithm", "env"]
+        )
+        records[f"{key}|{spec.num_threads}"] = record
+    return records
+
+
+def save_baseline(
+    path: str, benchmark_name: str, results: List[Tuple[Dict[str, Any], Any]]
+) -> None:
+    """
+    Adds the results to the JSON file ``path`` (created if needed), replacing
+    the previous results of the same cases
+    """
+    records: Dict[str, Dict[str, Any]] = {}
+    if os.path.exists(path):
+        with open(path, "r") as fd:
+            records = json.load(fd)
+    records.update(_baseline_records(benchmark_name, results, _git_commit()))
+    with open(path, "w") as fd:
+        json.dump(records, fd, indent=2, sort_keys=True)
+    print(f"Saved baseline to {path}")
+
+
+def compare_baselines(
+    baseline: Dict[str, Dict[str, Any]],
+    current: Dict[str, Dict[str, Any]],
+    threshold: float,
+    benchmark_name: Optional[str] = None,
+) -> List[str]:
+    """
+    Prints the speedup of every case of ``current`` also in ``baseline``
+    (median times, higher is better), and returns the cases which are more
+    than ``threshold`` slower (eg ``0.05`` for 5%)
+    """
+    rows: List[Tuple[str, float, float, float, str]] = []
+    regressions: List[str] = []
+    for key, new in sorted(current.items()):
+        old = baseline.get(key)
+        if old is None or (
+            benchmark_name is not None and new["benchmark"] != benchmark_name
+        ):
+            continue
+        speedup = old["median_s"] / new["median_s"]
+        status = ""
+        if speedup < 1 / (1 + threshold):
+            status = "REGRESSION"
+        elif speedup > 1 + threshold:
+            status = "improved"
+        case = (
+            f"{new['benchmark']} {new['label']} {new['sub_label']} "
+            f"[{new['algorithm']}]"
+        )
+        if status == "REGRESSION":
+            regressions.append(f"{case}: {speedup:.2f}x")
+        rows.append(
+            (case, old["median_s"] * 1e6, new["median_s"] * 1e6, speedup, status)
+        )
+    if not rows:
+        print("No case in common with the baseline")
+        return regressions
+    commits = sorted({v["commit"] for v in baseline.values()}) + ["->"]
+    commits += sorted({v["commit"] for v in current.values()})
+    print(f"Comparison to the baseline ({' '.join(commits)}):")
+    width = max(len(row[0]) for row in rows)
+    print(f"{'case':<{width}} | base (us) |  new (us) | speedup")
+    for case, old_us, new_us, speedup, status in rows:
+        print(
+            f"{case:<{width}} | {old_us:>9.1f} | {new_us:>9.1f} | "
+            f"{speedup:>6.2f}x {status}"
+        )
+    if regressions:
+        print(f"{len(regressions)} cases regressed by more than {threshold:.0%}:")
+        for regression in regressions:
+            print(f"  {regression}")
+    return regressions
+
 
 def _render_bar_plot(results: List[Any], store_results_folder: str) -> None:
     runtime: Dict[str, Dict[str, float]] = defaultdict(dict)
@@ -317,15 +523,7 @@ def _render_bar_plot(results: List[Any], store_results_folder: str) -> None:
         print(f"Saved plot: {filename_full}")
 
 
-def benchmark_main_helper(
-    benchmark_fn, cases: List[Dict[str, Any]], *, min_run_time: int = 2
-) -> None:
-    """
-    Helper function to run benchmarks.
-    Supports loading previous results for comparison, and saving current results to file.
-    """
-    SKIP_VANILLA_TASKS_IF_ALREADY_DONE = True
-
+def _parse_args() -> argparse.Namespace:
     parser = argparse.ArgumentParser()
     parser.add_argument(
         "--fn", default=None, type=str, help="Only benchmark this function"
@@ -339,7 +537,63 @@ def benchmark_main_helper(
         type=str,
         help="Compare to previously stored benchmarks (coma separated)",
     )
-    args = parser.parse_args()
+    parser.add_argument(
+        "--roofline-threshold",
+        default=0.5,
+        type=float,
+        help="Cases below this fraction of the peak they are bound by fail",
+    )
+    parser.add_argument(
+        "--peak-tflops", default=None, type=float, help="Override the device peak"
+    )
+    parser.add_argument(
+        "--peak-gbps", default=None, type=float, help="Override the device peak"
+    )
+    parser.add_argument(
+        "--save-baseline",
+        default=None,
+        type=str,
+        help="Add the results to this JSON file (one entry per case and GPU)",
+    )
+    parser.add_argument(
+        "--check-baseline",
+        default=None,
+        type=str,
+        help="Report the speedups / regressions compared to this JSON file",
+    )
+    parser.add_argument(
+        "--regression-threshold",
+        default=0.05,
+        type=float,
+        help="Cases slower than the baseline by more than this fraction regress",
+    )
+    parser.add_argument(
+        "--stress",
+        action="store_true",
+        help="Run the sustained load benchmarks (peak memory, fragmentation and "
+        "steady-state throughput) instead of the latency ones",
+    )
+    parser.add_argument(
+        "--stress-iters",
+        default=200,
+        type=int,
+        help="Number of back-to-back calls of the sustained load benchmarks",
+    )
+    return parser.parse_args()
+
+
+def benchmark_main_helper(
+    benchmark_fn, cases: List[Dict[str, Any]], *, min_run_time: int = 2
+) -> None:
+    """
+    Helper function to run benchmarks.
+    Supports loading previous results for comparison, and saving current results to file.
+    """
+    SKIP_VANILLA_TASKS_IF_ALREADY_DONE = True
+
+    args = _parse_args()
+    if args.stress:
+        return
 
     if args.fn is not None and args.fn != benchmark_fn.__name__:
         print(f'Skipping benchmark "{benchmark_fn.__name__}"')
@@ -391,6 +645,9 @@ def benchmark_main_helper(
                                 continue
                         results_compare_to.append((metadata, r))
 
+    peaks = _device_peaks(args)
+    failed_cases: List[str] = []
+
     pbar = tqdm.tqdm(cases, leave=False)
     for case in pbar:
         # pbar.set_description(str(case))
@@ -427,6 +684,8 @@ def benchmark_main_helper(
                     continue
 
                 memory = math.inf
+                roofline = getattr(benchmark_object, "roofline", None)
+                roofline_report = None
                 try:
                     torch.cuda.synchronize()
                     torch.cuda.reset_peak_memory_stats()
@@ -441,6 +700,15 @@ def benchmark_main_helper(
                     name = measurement.task_spec.description
                     memory = torch.cuda.max_memory_allocated() / 2**20
                     measurement.mem_use = memory
+                    if roofline is not None:
+                        roofline_report, passed = _roofline_report(
+                            roofline, measurement.mean, peaks, args.roofline_threshold
+                        )
+                        if not passed and is_optimized:
+                            failed_cases.append(
+                                f"{measurement.task_spec.sub_label} [{name}]: "
+                                f"{roofline_report}"
+                            )
                 except RuntimeError as e:
                     if "CUDA out of memory" not in str(e):
                         raise
@@ -448,6 +716,8 @@ def benchmark_main_helper(
                 finally:
                     del benchmark_object
                 pbar.write(f"{name}: memory used: {memory} MB")
+                if roofline_report is not None:
+                    pbar.write(f"{name}: {roofline_report}")
         except RuntimeError as e:
             if "CUDA out of memory" not in str(e):
                 raise
@@ -474,8 +744,27 @@ def benchmark_main_helper(
 
     results_for_print = _finalize_results(results + results_compare_to)
     benchmark.Compare(results_for_print).print()
+    if failed_cases:
+        print(
+            f"{len(failed_cases)} cases below {args.roofline_threshold:.0%} of the "
+            "peak they are bound by:"
+        )
+        for case in failed_cases:
+            print(f"  {case}")
     _render_bar_plot(results_for_print, store_results_folder)
 
+    if args.check_baseline is not None:
+        with open(args.check_baseline, "r") as fd:
+            baseline = json.load(fd)
+        compare_baselines(
+            baseline,
+            _baseline_records(benchmark_fn.__name__, results, _git_commit()),
+            args.regression_threshold,
+            benchmark_name=benchmark_fn.__name__,
+        )
+    if args.save_baseline is not None:
+        save_baseline(args.save_baseline, benchmark_fn.__name__, results)
+
     # Save runs to a file
     if args.label is not None:
         write_to_path = os.path.join(
@@ -484,3 +773,110 @@ def benchmark_main_helper(
         with open(write_to_path, "wb+") as fd:
             pickle.dump(results, fd)
         print(f"Saved results to {write_to_path}")
+
+
+def _stress_run(calls: List[Callable[[], Any]], iterations: int) -> Dict[str, float]:
+    torch.cuda.synchronize()
+    torch.cuda.empty_cache()
+    allocated_before = torch.cuda.memory_allocated()
+    torch.cuda.reset_peak_memory_stats()
+    # A warmup (first calls, allocations of the cache...), then the steady state
+    warmup = max(len(calls), iterations // 10)
+    begin = 0.0
+    out = None
+    for i in range(warmup + iterations):
+        if i == warmup:
+            torch.cuda.synchronize()
+            begin = time.perf_counter()
+        # The outputs of a call are freed after the next one, like the
+        # activations of consecutive layers
+        out = calls[i % len(calls)]()
+    torch.cuda.synchronize()
+    elapsed = time.perf_counter() - begin
+    stats = torch.cuda.memory_stats()
+    del out
+    reserved = stats["reserved_bytes.all.current"]
+    allocated = stats["allocated_bytes.all.current"]
+    return {
+        "peak (MB)": (stats["allocated_bytes.all.peak"] - allocated_before) / 2**20,
+        "reserved (MB)": reserved / 2**20,
+        "fragmentation": (reserved - allocated) / reserved if reserved else 0.0,
+        "inactive split (MB)": stats["inactive_split_bytes.all.current"] / 2**20,
+        "alloc retries": stats["num_alloc_retries"],
+        "calls/s": iterations / elapsed,
+    }
+
+
+def is_stress_run() -> bool:
+    """For the scripts which do not use `benchmark_main_helper`"""
+    return _parse_args().stress
+
+
+def benchmark_stress_helper(stress_fn, cases: List[Dict[str, Any]]) -> None:
+    """
+    Sustained load benchmarks, which run with ``--stress`` instead of the
+    latency ones. ``stress_fn(**case)`` yields ``(sub_label, calls)``, where
+    ``calls`` run the op once each, on inputs of different shapes. They are
+    called in turn, back to back, so that the caching allocator has to reuse
+    blocks of different sizes, and the report has:
+
+    - the peak memory above what was allocated before (the inputs): the
+      outputs, the activations saved for the backward, the workspaces...
+    - the memory reserved by the cache at the end, the fraction of it which
+      is not allocated, the free parts of split blocks (unusable for larger
+      allocations), and the number of times the cache had to be flushed
+    - the throughput in calls/s after a warmup
+    """
+    args = _parse_args()
+    if not args.stress or (args.fn is not None and args.fn != stress_fn.__name__):
+        return
+
+    report: Dict[str, Dict[str, str]] = defaultdict(dict)
+    for case in tqdm.tqdm(cases, leave=False):
+        try:
+            for sub_label, calls in stress_fn(**case):
+                row = _stress_run(calls, args.stress_iters)
+                for metric, value in row.items():
+                    report[metric][sub_label] = (
+                        f"{value:.3f}" if metric == "fragmentation" else f"{value:.1f}"
+                    )
+                del calls
+        except NotImplementedError:
+            continue
+        except RuntimeError as e:
+            if "CUDA out of memory" not in str(e):
+                raise
+            print(f"{case}: skipped (OOM)")
+    pretty_print(
+        report,
+        title=f"{stress_fn.__name__} ({args.stress_iters} calls)",
+        units="",
+    )
+
+
+def _compare_main() -> None:
+    """
+    Compares two files saved with ``--save-baseline``, eg before and after an
+    upgrade, and exits with an error if some cases regressed::
+
+        python xformers/benchmarks/benchmark_swiglu.py --save-baseline old.json
+        # (upgrade)
+        python xformers/benchmarks/benchmark_swiglu.py --save-baseline new.json
+        python xformers/benchmarks/utils.py compare old.json new.json
+    """
+    parser = argparse.ArgumentParser()
+    parser.add_argument("command", choices=["compare"])
+    parser.add_argument("baseline", type=str)
+    parser.add_argument("current", type=str)
+    parser.add_argument("--regression-threshold", default=0.05, type=float)
+    args = parser.parse_args()
+    with open(args.baseline, "r") as fd:
+        baseline = json.load(fd)
+    with open(args.current, "r") as fd:
+        current = json.load(fd)
+    if compare_baselines(baseline, current, args.regression_threshold):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    _compare_main()
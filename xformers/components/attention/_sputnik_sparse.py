@@ -8,6 +8,11 @@ import torch
 
 from xformers.ops import masked_matmul
 from xformers.sparse import SparseCSRTensor
+from xformers.sparse._csr_ops import (
+    _sparse_attention,
+    _sparse_softmax_attention,
+    _spmm_bias_act,
+)
 
 # TODO: this is here for BC
 from xformers.sparse.utils import _csr_to_coo, _dense_to_sparse  # noqa: F401
@@ -20,7 +25,8 @@ class SparseCS:
         if matrix.ndim == 2:
             matrix = matrix[None]
         assert matrix.ndim == 3
-        self._mat = SparseCSRTensor.from_dense(matrix).to(device)
+        # build the pattern (and its transpose) directly on the target device
+        self._mat = SparseCSRTensor.from_dense(matrix.to(device))
 
     @property
     def device(self):
@@ -96,10 +102,63 @@ class SparseCS:
         out = torch.nn.functional.softmax(self._mat, -1)
         return type(self)._wrap(out)
 
+    def attention(self, q, k, v, scale):
+        """
+        softmax(scale * q @ k^T) @ v over the nonzeros of the mask, fused in a
+        single kernel which does not materialize the attention matrix
+        """
+        return _sparse_attention.apply(
+            q,
+            k,
+            v,
+            self.row_indices,
+            self.row_offsets,
+            self.column_indices,
+            self._transp_info,
+            scale,
+        )
+
+    def softmax_attention(self, q, k, v, scale, p=0.0):
+        """
+        dropout(softmax(scale * q @ k^T), p) @ v over the nonzeros of the mask.
+        Unlike `attention`, the attention probabilities are materialized, which
+        supports dropout, and the gradients of q and k are computed in a single
+        pass over them
+        """
+        return _sparse_softmax_attention.apply(
+            q * scale,
+            k,
+            v,
+            self.row_indices,
+            self.row_offsets,
+            self.column_indices,
+            self._transp_info,
+            p,
+        )
+
     def spmm(self, b):
         out = torch.bmm(self._mat, b)
         return out
 
+    def spmm_bias_act(self, b, bias=None, activation="none"):
+        """
+        activation(self @ b + bias[:, None]), where `bias` has one element per
+        row and `activation` is one of "none", "relu" and "gelu". The bias
+        and the activation are applied in the epilogue of the spmm kernel,
+        which is what a linear layer with a sparse weight needs
+        """
+        return _spmm_bias_act.apply(
+            b,
+            self.row_indices,
+            self.values,
+            self.row_offsets,
+            self.column_indices,
+            self.shape[0],
+            self._transp_info,
+            bias,
+            activation,
+        )
+
     def transpose(self):
         out = torch.transpose(self._mat, -2, -1)
         return type(self)._wrap(out)
@@ -294,6 +294,26 @@ def blocksparse_attention(
     return att
 
 
+def _use_sparse_softmax_attention(q, v, att_mask, dropout) -> bool:
+    # The CUDA kernels support heads up to 256, and standard dropout
+    if not (_is_sparse_available and isinstance(att_mask, SparseCS)):
+        return False
+    if att_mask.dtype != torch.bool or q.ndim != 3:
+        return False
+    if dropout is not None and not isinstance(dropout, torch.nn.Dropout):
+        return False
+    return not q.is_cuda or max(q.shape[-1], v.shape[-1]) <= 256
+
+
+def _use_fused_sparse_attention(q, v, att_mask, dropout) -> bool:
+    # The fused kernel doesn't apply dropout, and supports heads up to 256
+    if not _use_sparse_softmax_attention(q, v, att_mask, dropout):
+        return False
+    if dropout is not None and dropout.p > 0.0 and dropout.training:
+        return False
+    return max(q.shape[-1], v.shape[-1]) <= 256
+
+
 def scaled_dot_product_attention(
     q: torch.Tensor,
     k: torch.Tensor,
@@ -331,6 +351,15 @@ def scaled_dot_product_attention(
         if autocast_disabled:
             q, k, v = q.float(), k.float(), v.float()
 
+        if _use_fused_sparse_attention(q, v, att_mask, dropout):
+            return att_mask.attention(q, k, v, scale=1 / math.sqrt(k.size(-1)))
+
+        if _use_sparse_softmax_attention(q, v, att_mask, dropout):
+            p = dropout.p if dropout is not None and dropout.training else 0.0
+            return att_mask.softmax_attention(
+                q, k, v, scale=1 / math.sqrt(k.size(-1)), p=p
+            )
+
         att = scaled_query_key_softmax(q, k, att_mask=att_mask)
 
         #  Optional dropout, could be part of the masking in the future
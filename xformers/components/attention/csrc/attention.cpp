@@ -17,11 +17,27 @@ TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::efficient_attention(Tensor query, Tensor key, Tensor value, bool compute_logsumexp, Tensor? attn_bias, float p) -> (Tensor, Tensor, int, int)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
-      "xformers::efficient_attention_forward_cutlass(Tensor query, Tensor key, Tensor value, Tensor? cu_seqlens_q, Tensor? cu_seqlens_k, int? max_seqlen_q, bool compute_logsumexp, bool causal) -> (Tensor, Tensor)"));
+      "xformers::efficient_attention_forward_cutlass(Tensor query, Tensor key, Tensor value, Tensor? cu_seqlens_q, Tensor? cu_seqlens_k, int? max_seqlen_q, bool compute_logsumexp, bool causal, Tensor? block_tables=None, Tensor? seqlens_k=None, int? num_splits_key=None, Tensor? attn_bias=None, float dropout_p=0.0, int? window_size=None, Tensor? out=None, Tensor? output_accum=None, Tensor? rope_cos=None, Tensor? rope_sin=None, Tensor? rope_positions_q=None, Tensor? rope_positions_k=None, Tensor? alibi_slopes=None, Tensor? rel_pos_bias=None, Tensor? block_mask=None, int block_mask_size=0, float? scale=None, float softcap=0.0, Tensor? tree_mask=None, bool l2_persist_kv=False, Tensor? q_scale=None, Tensor? k_scale=None, Tensor? v_scale=None) -> (Tensor, Tensor, int, int)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::efficient_attention_backward(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor logsumexp, Tensor output, Tensor? attn_bias, float p, int rng_seed, int rng_offset) -> (Tensor, Tensor, Tensor)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
-      "xformers::efficient_attention_backward_cutlass(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor logsumexp, Tensor output, bool causal) -> (Tensor, Tensor, Tensor)"));
+      "xformers::efficient_attention_backward_cutlass(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor logsumexp, Tensor output, bool causal, Tensor? attn_bias=None, float dropout_p=0.0, int rng_seed=0, int rng_offset=0, int? window_size=None, Tensor? cu_seqlens_q=None, Tensor? cu_seqlens_k=None, int? max_seqlen_q=None, Tensor? rope_cos=None, Tensor? rope_sin=None, Tensor? rope_positions_q=None, Tensor? rope_positions_k=None, Tensor? alibi_slopes=None, Tensor? rel_pos_bias=None, int? num_splits_query=None, bool deterministic=False, Tensor? block_mask=None, int block_mask_size=0, float? scale=None, float softcap=0.0) -> (Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::efficient_attention_cutlass(Tensor query, Tensor key, Tensor value, Tensor? attn_bias=None, bool causal=False, float p=0.0, int? window_size=None, float? scale=None, float softcap=0.0) -> Tensor"));
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::_temp_dropout(Tensor out, float p) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::merge_attentions(Tensor[] outs, Tensor[] lses) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::merge_attentions_backward(Tensor grad_out, Tensor? grad_lse, Tensor lse, Tensor[] outs, Tensor[] lses) -> (Tensor[], Tensor[])"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::attention_key_scores(Tensor query, Tensor key, Tensor logsumexp, bool causal, int? window_size=None, float? scale=None, float softcap=0.0) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::qk_norm(Tensor query, Tensor key, Tensor? q_weight, Tensor? k_weight, bool rms_norm, float eps) -> (Tensor, Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::qk_norm_backward(Tensor grad_q, Tensor grad_k, Tensor query, Tensor key, Tensor mean, Tensor rstd, Tensor? q_weight, Tensor? k_weight, bool rms_norm) -> (Tensor, Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::unpad_inputs(Tensor[] inputs, Tensor padding_mask) -> (Tensor[], Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::pad_output(Tensor x, Tensor padding_mask, Tensor cu_seqlens) -> Tensor"));
 }
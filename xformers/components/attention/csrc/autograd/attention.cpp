@@ -0,0 +1,471 @@
+#include <ATen/ATen.h>
+#include <ATen/autocast_mode.h>
+#include <ATen/core/dispatch/Dispatcher.h>
+#include <ATen/core/grad_mode.h>
+#include <torch/autograd.h>
+#include <torch/library.h>
+
+#include <cmath>
+#include <tuple>
+
+// `xformers::efficient_attention_cutlass`: the cutlass forward and backward
+// as a single op, with its autograd and autocast in C++. The Python
+// `MemoryEfficientAttentionCutlassOp` does the same, but its bookkeeping
+// (padding, ctx, reshapes) costs about as much as the kernels for small
+// shapes, and it can't be scripted
+namespace {
+
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t>
+efficient_attention_forward_cutlass(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    c10::optional<int64_t> max_seqlen_q,
+    bool compute_logsumexp,
+    bool causal,
+    const c10::optional<at::Tensor>& block_tables,
+    const c10::optional<at::Tensor>& seqlens_k,
+    c10::optional<int64_t> num_splits_key,
+    const c10::optional<at::Tensor>& attn_bias,
+    double dropout_p,
+    c10::optional<int64_t> window_size,
+    const c10::optional<at::Tensor>& out,
+    const c10::optional<at::Tensor>& output_accum,
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    c10::optional<double> scale,
+    double softcap,
+    const c10::optional<at::Tensor>& tree_mask,
+    bool l2_persist_kv,
+    const c10::optional<at::Tensor>& q_scale,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
+  static auto op =
+      c10::Dispatcher::singleton()
+          .findSchemaOrThrow("xformers::efficient_attention_forward_cutlass", "")
+          .typed<decltype(efficient_attention_forward_cutlass)>();
+  return op.call(
+      query,
+      key,
+      value,
+      cu_seqlens_q,
+      cu_seqlens_k,
+      max_seqlen_q,
+      compute_logsumexp,
+      causal,
+      block_tables,
+      seqlens_k,
+      num_splits_key,
+      attn_bias,
+      dropout_p,
+      window_size,
+      out,
+      output_accum,
+      rope_cos,
+      rope_sin,
+      rope_positions_q,
+      rope_positions_k,
+      alibi_slopes,
+      rel_pos_bias,
+      block_mask,
+      block_mask_size,
+      scale,
+      softcap,
+      tree_mask,
+      l2_persist_kv,
+      q_scale,
+      k_scale,
+      v_scale);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+efficient_attention_backward_cutlass(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& logsumexp,
+    const at::Tensor& out,
+    bool causal,
+    const c10::optional<at::Tensor>& attn_bias,
+    double dropout_p,
+    int64_t rng_seed,
+    int64_t rng_offset,
+    c10::optional<int64_t> window_size,
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    c10::optional<int64_t> max_seqlen_q,
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    c10::optional<int64_t> num_splits_query,
+    bool deterministic,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    c10::optional<double> scale,
+    double softcap) {
+  static auto op =
+      c10::Dispatcher::singleton()
+          .findSchemaOrThrow("xformers::efficient_attention_backward_cutlass", "")
+          .typed<decltype(efficient_attention_backward_cutlass)>();
+  return op.call(
+      grad_out,
+      query,
+      key,
+      value,
+      logsumexp,
+      out,
+      causal,
+      attn_bias,
+      dropout_p,
+      rng_seed,
+      rng_offset,
+      window_size,
+      cu_seqlens_q,
+      cu_seqlens_k,
+      max_seqlen_q,
+      rope_cos,
+      rope_sin,
+      rope_positions_q,
+      rope_positions_k,
+      alibi_slopes,
+      rel_pos_bias,
+      num_splits_query,
+      deterministic,
+      block_mask,
+      block_mask_size,
+      scale,
+      softcap);
+}
+
+// The head dims are zero-padded to 128 bits, which every kernel supports:
+// the scores don't change (the scale is always passed to the kernels), and
+// the extra channels of the output are sliced off
+at::Tensor pad_head_dim(const at::Tensor& x) {
+  int64_t alignment = 16 / x.element_size();
+  int64_t pad = (alignment - x.size(-1) % alignment) % alignment;
+  return pad == 0 ? x : at::constant_pad_nd(x, {0, pad});
+}
+
+// Legacy format of the bias: [batch * num_heads, seqlen_q, seqlen_k]
+c10::optional<at::Tensor> bias_bmhk(
+    const at::Tensor& query,
+    const c10::optional<at::Tensor>& attn_bias) {
+  if (!attn_bias.has_value()) {
+    return c10::nullopt;
+  }
+  at::Tensor bias = *attn_bias;
+  if (bias.dim() == 3) {
+    bias = bias.reshape(
+        {query.size(0), query.size(2), query.size(1), bias.size(-1)});
+  }
+  return bias.to(query.scalar_type());
+}
+
+double default_scale(const at::Tensor& query, c10::optional<double> scale) {
+  return scale.has_value() ? *scale : 1.0 / std::sqrt(double(query.size(-1)));
+}
+
+class MemoryEfficientAttentionCutlass
+    : public torch::autograd::Function<MemoryEfficientAttentionCutlass> {
+ public:
+  static at::Tensor forward(
+      torch::autograd::AutogradContext* ctx,
+      const at::Tensor& query_,
+      const at::Tensor& key_,
+      const at::Tensor& value_,
+      const c10::optional<at::Tensor>& attn_bias,
+      bool causal,
+      double p,
+      c10::optional<int64_t> window_size,
+      c10::optional<double> scale,
+      double softcap) {
+    at::AutoDispatchBelowADInplaceOrView g;
+    int64_t K = query_.size(-1);
+    int64_t Kv = value_.size(-1);
+    double scale_ = default_scale(query_, scale);
+    auto query = pad_head_dim(query_);
+    auto key = pad_head_dim(key_);
+    auto value = pad_head_dim(value_);
+    at::Tensor out, lse;
+    int64_t rng_seed, rng_offset;
+    std::tie(out, lse, rng_seed, rng_offset) =
+        efficient_attention_forward_cutlass(
+            query,
+            key,
+            value,
+            c10::nullopt,
+            c10::nullopt,
+            -1,
+            /*compute_logsumexp=*/true,
+            causal,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            attn_bias,
+            p,
+            window_size,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt,
+            0,
+            scale_,
+            softcap,
+            c10::nullopt,
+            false,
+            c10::nullopt,
+            c10::nullopt,
+            c10::nullopt);
+    ctx->save_for_backward(
+        {query,
+         key,
+         value,
+         lse,
+         out,
+         attn_bias.has_value() ? *attn_bias : at::Tensor()});
+    ctx->saved_data["causal"] = causal;
+    ctx->saved_data["p"] = p;
+    ctx->saved_data["rng_seed"] = rng_seed;
+    ctx->saved_data["rng_offset"] = rng_offset;
+    ctx->saved_data["window_size"] = window_size;
+    ctx->saved_data["scale"] = scale_;
+    ctx->saved_data["softcap"] = softcap;
+    ctx->saved_data["K"] = K;
+    ctx->saved_data["Kv"] = Kv;
+    return Kv == out.size(-1) ? out : out.narrow(-1, 0, Kv);
+  }
+
+  static torch::autograd::variable_list backward(
+      torch::autograd::AutogradContext* ctx,
+      torch::autograd::variable_list grad_outputs) {
+    at::AutoDispatchBelowADInplaceOrView g;
+    auto saved = ctx->get_saved_variables();
+    auto query = saved[0];
+    auto key = saved[1];
+    auto value = saved[2];
+    auto lse = saved[3];
+    auto out = saved[4];
+    c10::optional<at::Tensor> attn_bias;
+    if (saved[5].defined()) {
+      attn_bias = saved[5];
+    }
+    int64_t K = ctx->saved_data["K"].toInt();
+    int64_t Kv = ctx->saved_data["Kv"].toInt();
+    auto grad = grad_outputs[0].to(query.scalar_type());
+    if (Kv != out.size(-1)) {
+      grad = at::constant_pad_nd(grad, {0, out.size(-1) - Kv});
+    }
+    c10::optional<int64_t> window_size;
+    if (!ctx->saved_data["window_size"].isNone()) {
+      window_size = ctx->saved_data["window_size"].toInt();
+    }
+
+    at::Tensor grad_q, grad_k, grad_v;
+    std::tie(grad_q, grad_k, grad_v) = efficient_attention_backward_cutlass(
+        grad,
+        query,
+        key,
+        value,
+        lse,
+        out,
+        ctx->saved_data["causal"].toBool(),
+        attn_bias,
+        ctx->saved_data["p"].toDouble(),
+        ctx->saved_data["rng_seed"].toInt(),
+        ctx->saved_data["rng_offset"].toInt(),
+        window_size,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        false,
+        c10::nullopt,
+        0,
+        ctx->saved_data["scale"].toDouble(),
+        ctx->saved_data["softcap"].toDouble());
+    if (K != query.size(-1) || Kv != value.size(-1)) {
+      grad_q = grad_q.narrow(-1, 0, K);
+      grad_k = grad_k.narrow(-1, 0, K);
+      grad_v = grad_v.narrow(-1, 0, Kv);
+    }
+    // There is no gradient for `attn_bias`
+    return {
+        grad_q,
+        grad_k,
+        grad_v,
+        at::Tensor(),
+        at::Tensor(),
+        at::Tensor(),
+        at::Tensor(),
+        at::Tensor(),
+        at::Tensor()};
+  }
+};
+
+// Inference: no logsumexp
+at::Tensor efficient_attention_cutlass_no_grad(
+    const at::Tensor& query_,
+    const at::Tensor& key_,
+    const at::Tensor& value_,
+    const c10::optional<at::Tensor>& attn_bias,
+    bool causal,
+    double p,
+    c10::optional<int64_t> window_size,
+    c10::optional<double> scale,
+    double softcap) {
+  at::AutoDispatchBelowADInplaceOrView g;
+  // [batch, seqlen, K] (legacy format) are computed with a single head
+  bool legacy = query_.dim() == 3;
+  auto query = legacy ? query_.unsqueeze(2) : query_;
+  auto key = legacy ? key_.unsqueeze(2) : key_;
+  auto value = legacy ? value_.unsqueeze(2) : value_;
+  int64_t Kv = value.size(-1);
+  double scale_ = default_scale(query, scale);
+  auto bias = bias_bmhk(query, attn_bias);
+  at::Tensor out = std::get<0>(efficient_attention_forward_cutlass(
+      pad_head_dim(query),
+      pad_head_dim(key),
+      pad_head_dim(value),
+      c10::nullopt,
+      c10::nullopt,
+      -1,
+      /*compute_logsumexp=*/false,
+      causal,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      bias,
+      p,
+      window_size,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt,
+      0,
+      scale_,
+      softcap,
+      c10::nullopt,
+      false,
+      c10::nullopt,
+      c10::nullopt,
+      c10::nullopt));
+  out = Kv == out.size(-1) ? out : out.narrow(-1, 0, Kv);
+  return legacy ? out.squeeze(2) : out;
+}
+
+at::Tensor efficient_attention_cutlass_autograd(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const c10::optional<at::Tensor>& attn_bias,
+    bool causal,
+    double p,
+    c10::optional<int64_t> window_size,
+    c10::optional<double> scale,
+    double softcap) {
+  bool requires_grad = at::GradMode::is_enabled() &&
+      (query.requires_grad() || key.requires_grad() || value.requires_grad());
+  if (!requires_grad) {
+    return efficient_attention_cutlass_no_grad(
+        query, key, value, attn_bias, causal, p, window_size, scale, softcap);
+  }
+  // Outside of the autograd function, so that autograd sees the reshapes
+  bool legacy = query.dim() == 3;
+  auto query_bmhk = legacy ? query.unsqueeze(2) : query;
+  auto out = MemoryEfficientAttentionCutlass::apply(
+      query_bmhk,
+      legacy ? key.unsqueeze(2) : key,
+      legacy ? value.unsqueeze(2) : value,
+      bias_bmhk(query_bmhk, attn_bias),
+      causal,
+      p,
+      window_size,
+      scale,
+      softcap);
+  return legacy ? out.squeeze(2) : out;
+}
+
+at::Tensor efficient_attention_cutlass_autocast(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const c10::optional<at::Tensor>& attn_bias,
+    bool causal,
+    double p,
+    c10::optional<int64_t> window_size,
+    c10::optional<double> scale,
+    double softcap) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return efficient_attention_cutlass_autograd(
+      at::autocast::cached_cast(exec_type, query),
+      at::autocast::cached_cast(exec_type, key),
+      at::autocast::cached_cast(exec_type, value),
+      at::autocast::cached_cast(exec_type, attn_bias),
+      causal,
+      p,
+      window_size,
+      scale,
+      softcap);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_cutlass"),
+      TORCH_FN(efficient_attention_cutlass_no_grad));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_cutlass"),
+      TORCH_FN(efficient_attention_cutlass_no_grad));
+}
+
+// Shapes only, from the ops in `meta/`
+TORCH_LIBRARY_IMPL(xformers, Meta, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_cutlass"),
+      TORCH_FN(efficient_attention_cutlass_no_grad));
+}
+
+TORCH_LIBRARY_IMPL(xformers, Autograd, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_cutlass"),
+      TORCH_FN(efficient_attention_cutlass_autograd));
+}
+
+TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_cutlass"),
+      TORCH_FN(efficient_attention_cutlass_autocast));
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+// The sputnik ops take a CSR pattern which is either shared by the `batch`
+// matrices of `m` rows (`row_offsets` of size m + 1 and values of shape
+// [batch, nnz]), or specific to each batch element (or head).
+// Per-batch patterns are given as the block-diagonal pattern of the matrix
+// stacking the batch elements along both of its dimensions:
+// - the rows of all the batch elements are concatenated, so `row_offsets` has
+//   size batch * m + 1 and `row_indices` size batch * m
+// - the column indices of batch element b are offset by b times the number of
+//   columns of the pattern
+// - the values have shape [1, nnz]
+// which lets the ops process all the batch elements in a single launch, as
+// one product over the stacked matrices
+inline bool is_batched_pattern(
+    int64_t batch,
+    int64_t m,
+    const at::Tensor& row_offsets) {
+  return batch > 1 && row_offsets.size(0) == batch * m + 1;
+}
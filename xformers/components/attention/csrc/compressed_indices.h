@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+#include <ATen/ATen.h>
+
+// The column indices of a CSR pattern are int32, or int16 when all of them
+// fit (patterns of up to 2^15 columns), which halves the metadata that a
+// kernel reads for every nonzero. The row offsets stay int32, as they count
+// nonzeros. Calls `fn` with a value of the index type of `column_indices`
+template <typename Fn>
+void dispatch_index_type(const at::Tensor& column_indices, Fn&& fn) {
+  at::ScalarType type = column_indices.scalar_type();
+  if (type == at::ScalarType::Short) {
+    fn(int16_t());
+  } else {
+    TORCH_CHECK(
+        type == at::ScalarType::Int,
+        "column indices should be int32 or int16 tensors");
+    fn(int());
+  }
+}
@@ -1,20 +1,18 @@
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
 #include <ATen/Parallel.h>
 #include <torch/library.h>
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <vector>
 
 #include <ATen/cpu/vec/functional.h>
 #include <ATen/cpu/vec/vec.h>
 
-namespace {
+#include "../kv_cache_quantization.h"
 
-template <typename scalar_t>
-void fill_zero(scalar_t* buf, int64_t K) {
-  for (int64_t k = 0; k < K; k++) {
-    buf[k] = 0;
-  }
-}
+namespace {
 
 template <typename scalar_t, int K>
 scalar_t max(scalar_t* buf) {
@@ -25,123 +23,300 @@ scalar_t max(scalar_t* buf) {
   return m;
 }
 
-template <typename scalar_t>
-at::TensorAccessor<scalar_t, 3> _tensor_accessor_or_dummy(
+template <typename scalar_t, size_t N>
+at::TensorAccessor<scalar_t, N> _tensor_accessor_or_dummy(
     const at::Tensor& attn_bias,
-    const std::array<int64_t, 3> zeros) {
+    const std::array<int64_t, N> zeros) {
   if (attn_bias.defined()) {
-    return attn_bias.accessor<scalar_t, 3>();
+    return attn_bias.accessor<scalar_t, N>();
   } else {
-    return at::TensorAccessor<scalar_t, 3>(nullptr, zeros.data(), zeros.data());
+    return at::TensorAccessor<scalar_t, N>(nullptr, zeros.data(), zeros.data());
+  }
+}
+
+// Rows of `scalar_t` that can be read in place as `accum_t`, or nullptr
+template <typename scalar_t>
+const scalar_t* in_place_rows(const scalar_t* src, scalar_t* buf) {
+  return src;
+}
+
+template <typename accum_t, typename scalar_t>
+const accum_t* in_place_rows(const scalar_t* src, accum_t* buf) {
+  return nullptr;
+}
+
+// `num_rows` rows of `n` elements of `src`, `stride` elements apart, as
+// contiguous rows of `accum_t`: `src` itself when the types match and the
+// rows are contiguous, or their conversion in `buf`. Reduced-precision inputs
+// are converted by blocks of rows, once for all the rows of the other operand
+// they meet
+template <typename accum_t, typename scalar_t>
+const accum_t* load_rows(
+    const scalar_t* src,
+    int64_t stride,
+    int64_t num_rows,
+    int64_t n,
+    accum_t* buf) {
+  if (stride == n || num_rows == 1) {
+    const accum_t* rows = in_place_rows(src, buf);
+    if (rows != nullptr) {
+      return rows;
+    }
   }
+  for (int64_t row = 0; row < num_rows; row++) {
+    at::vec::convert(src + row * stride, buf + row * n, n);
+  }
+  return buf;
 }
 
+// Flash-style forward: every task computes a block of `kBlockM` queries of a
+// sequence and a head, and iterates over blocks of `kBlockN` keys with an
+// online softmax, so that the keys and values of a block are read once for
+// all its queries. The dot products, the exponentials and the updates of the
+// output accumulators are vectorized along `K` (or along the keys of the
+// block). Half and bfloat16 inputs are computed in float32 (`accum_t`).
+// The inputs are BMHK, with `H / Hkv` query heads per head of the keys and
+// values. With `cu_seqlens_q/k`, B is 1 and the sequence `s` is made of the
+// queries `[cu_seqlens_q[s], cu_seqlens_q[s + 1])` and of the keys
+// `[cu_seqlens_k[s], cu_seqlens_k[s + 1])`. With `causal`, the query `i` of a
+// sequence attends to its keys `<= i` (and `> i - window_size` if
+// `window_size` is not 0), and the blocks of keys fully masked are skipped
 template <typename scalar_t>
 void attention_kernel(
-    at::TensorAccessor<scalar_t, 3> output,
-    at::TensorAccessor<scalar_t, 2> logsumexp,
-    at::TensorAccessor<scalar_t, 3> query,
-    at::TensorAccessor<scalar_t, 3> key,
-    at::TensorAccessor<scalar_t, 3> value,
-    at::TensorAccessor<scalar_t, 3> buffer,
+    at::TensorAccessor<scalar_t, 4> output, // [B, M, H, Kv]
+    at::TensorAccessor<at::opmath_type<scalar_t>, 3> logsumexp, // [S, H, *]
+    at::TensorAccessor<scalar_t, 4> query, // [B, M, H, K]
+    at::TensorAccessor<scalar_t, 4> key, // [B, N, Hkv, K]
+    at::TensorAccessor<scalar_t, 4> value, // [B, N, Hkv, Kv]
     bool compute_logsumexp,
-    at::TensorAccessor<scalar_t, 3> attn_bias) {
-  // TODO: optimize the code by adding blocking
-  // over multiple dimensions. Doing this allows
-  // the compiler to group reads and operations
-  // for vectorization
-  constexpr int64_t BLOCK = 1; // 8;
-  int64_t K = query.size(2);
-  int64_t B = query.size(0);
-  int64_t M = query.size(1);
-  int64_t N = key.size(1);
+    at::TensorAccessor<scalar_t, 4> attn_bias, // [B, H, M, N]
+    const int32_t* cu_seqlens_q,
+    const int32_t* cu_seqlens_k,
+    int64_t num_seqs,
+    int64_t max_seqlen_q,
+    bool causal,
+    int64_t window_size,
+    double scale_,
+    double softcap) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  constexpr int64_t kBlockM = 16;
+  constexpr int64_t kBlockN = 64;
+  int64_t K = query.size(3);
+  int64_t Kv = value.size(3);
+  int64_t H = query.size(2);
+  int64_t heads_per_kv_head = H / key.size(2);
+  int64_t num_query_blocks = (max_seqlen_q + kBlockM - 1) / kBlockM;
   int64_t grain_size = 1;
-  scalar_t scale = 1.0 / std::sqrt(scalar_t(K));
-  at::parallel_for(0, B, grain_size, [&](int64_t start, int64_t end) {
-    auto buf = buffer[at::get_thread_num()][0].data();
-    for (int64_t i = start; i < end; i++) {
-      for (int64_t j = 0; j < M; j++) {
-        fill_zero<scalar_t>(buf, K);
-        auto aar = query[i][j].data();
-        scalar_t s_prime = 0;
-        scalar_t m_prime = -std::numeric_limits<scalar_t>::infinity();
-        for (int64_t l = 0; l < N; l += BLOCK) {
-          auto bar = key[i][l].data();
-          scalar_t si[BLOCK] = {0};
-          for (int64_t k = 0; k < K; k++) {
-            auto aaar = aar[k] * scale;
-            for (int64_t rr = 0; rr < BLOCK; rr++)
-              si[rr] += aaar * bar[k + K * rr];
+  accum_t scale = scale_;
+  at::parallel_for(
+      0,
+      num_seqs * H * num_query_blocks,
+      grain_size,
+      [&](int64_t start, int64_t end) {
+        std::vector<accum_t> scores(kBlockM * kBlockN);
+        std::vector<accum_t> acc(kBlockM * Kv);
+        std::vector<accum_t> query_buf(kBlockM * K);
+        std::vector<accum_t> key_buf(kBlockN * K);
+        std::vector<accum_t> value_buf(kBlockN * Kv);
+        accum_t m_prime[kBlockM];
+        accum_t s_prime[kBlockM];
+        for (int64_t task = start; task < end; task++) {
+          int64_t seq = task / (H * num_query_blocks);
+          int64_t h = (task / num_query_blocks) % H;
+          int64_t h_kv = h / heads_per_kv_head;
+          int64_t query_start = (task % num_query_blocks) * kBlockM;
+          int64_t b = seq;
+          int64_t q_offset = 0;
+          int64_t k_offset = 0;
+          int64_t seqlen_q = query.size(1);
+          int64_t seqlen_k = key.size(1);
+          if (cu_seqlens_q != nullptr) {
+            b = 0;
+            q_offset = cu_seqlens_q[seq];
+            k_offset = cu_seqlens_k[seq];
+            seqlen_q = cu_seqlens_q[seq + 1] - q_offset;
+            seqlen_k = cu_seqlens_k[seq + 1] - k_offset;
           }
-          if (attn_bias.data() != nullptr) {
-            for (int64_t rr = 0; rr < BLOCK; rr++) {
-              si[rr] += attn_bias[i][j][l + rr];
+          if (query_start >= seqlen_q) {
+            continue;
+          }
+          int64_t num_queries = std::min(kBlockM, seqlen_q - query_start);
+          int64_t key_begin = 0;
+          int64_t key_end = seqlen_k;
+          if (causal) {
+            key_end = std::min(key_end, query_start + num_queries);
+            if (window_size != 0) {
+              key_begin = std::max(int64_t(0), query_start - window_size + 1);
             }
           }
-
-          scalar_t m_i = si[0] > m_prime ? si[0] : m_prime;
-          for (int64_t rr = 1; rr < BLOCK; rr++) {
-            m_i = si[rr] > m_i ? si[rr] : m_i;
+          const accum_t* query_block = load_rows(
+              query[b][q_offset + query_start][h].data(),
+              query.stride(1),
+              num_queries,
+              K,
+              query_buf.data());
+          std::fill(acc.begin(), acc.end(), accum_t(0));
+          for (int64_t j = 0; j < num_queries; j++) {
+            m_prime[j] = -std::numeric_limits<accum_t>::infinity();
+            s_prime[j] = 0;
           }
+          for (int64_t key_start = key_begin; key_start < key_end;
+               key_start += kBlockN) {
+            int64_t num_keys = std::min(kBlockN, key_end - key_start);
+            const accum_t* key_block = load_rows(
+                key[b][k_offset + key_start][h_kv].data(),
+                key.stride(1),
+                num_keys,
+                K,
+                key_buf.data());
+            const accum_t* value_block = load_rows(
+                value[b][k_offset + key_start][h_kv].data(),
+                value.stride(1),
+                num_keys,
+                Kv,
+                value_buf.data());
+            for (int64_t j = 0; j < num_queries; j++) {
+              const accum_t* q = query_block + j * K;
+              accum_t* si = scores.data() + j * kBlockN;
+              for (int64_t l = 0; l < num_keys; l++) {
+                si[l] = scale *
+                    at::vec::map2_reduce_all<accum_t>(
+                            [](Vec x, Vec y) { return x * y; },
+                            [](Vec x, Vec y) { return x + y; },
+                            q,
+                            key_block + l * K,
+                            K);
+              }
+              if (softcap > 0) {
+                for (int64_t l = 0; l < num_keys; l++) {
+                  si[l] = softcap * std::tanh(si[l] / softcap);
+                }
+              }
+              if (attn_bias.data() != nullptr) {
+                auto bias = attn_bias[b][h][query_start + j];
+                for (int64_t l = 0; l < num_keys; l++) {
+                  si[l] += accum_t(bias[key_start + l]);
+                }
+              }
+              if (causal) {
+                int64_t query_pos = query_start + j;
+                for (int64_t l = 0; l < num_keys; l++) {
+                  int64_t key_pos = key_start + l;
+                  if (key_pos > query_pos ||
+                      (window_size != 0 &&
+                       key_pos <= query_pos - window_size)) {
+                    si[l] = -std::numeric_limits<accum_t>::infinity();
+                  }
+                }
+              }
 
-          auto vi = value[i][l].data();
-
-          scalar_t m_delta;
-          scalar_t s_delta[BLOCK];
-          m_delta = std::exp(m_prime - m_i);
-
-          for (int64_t rr = 0; rr < BLOCK; rr++)
-            s_delta[rr] = std::exp(si[rr] - m_i);
-
-          for (int64_t k = 0; k < K; k++) {
-            buf[k] = buf[k] * m_delta;
-            for (int64_t rr = 0; rr < BLOCK; rr++)
-              buf[k] += vi[k + K * rr] * s_delta[rr];
+              accum_t m_i = std::max(
+                  m_prime[j],
+                  at::vec::reduce_all<accum_t>(
+                      [](Vec x, Vec y) { return at::vec::maximum(x, y); },
+                      si,
+                      num_keys));
+              if (m_i == -std::numeric_limits<accum_t>::infinity()) {
+                // Every key so far is masked
+                continue;
+              }
+              accum_t m_delta = std::exp(m_prime[j] - m_i);
+              at::vec::map(
+                  [m_i](Vec x) { return (x - Vec(m_i)).exp(); },
+                  si,
+                  si,
+                  num_keys);
+              s_prime[j] = s_prime[j] * m_delta +
+                  at::vec::reduce_all<accum_t>(
+                               [](Vec x, Vec y) { return x + y; },
+                               si,
+                               num_keys);
+              accum_t* acc_j = acc.data() + j * Kv;
+              at::vec::map(
+                  [m_delta](Vec x) { return x * Vec(m_delta); },
+                  acc_j,
+                  acc_j,
+                  Kv);
+              for (int64_t l = 0; l < num_keys; l++) {
+                accum_t s_delta = si[l];
+                at::vec::map2(
+                    [s_delta](Vec x, Vec v) { return x + v * Vec(s_delta); },
+                    acc_j,
+                    acc_j,
+                    value_block + l * Kv,
+                    Kv);
+              }
+              m_prime[j] = m_i;
+            }
+          }
+          for (int64_t j = 0; j < num_queries; j++) {
+            // Queries without any key get a null output
+            accum_t s = s_prime[j] == 0 ? accum_t(1) : s_prime[j];
+            accum_t* acc_j = acc.data() + j * Kv;
+            at::vec::map([s](Vec x) { return x / Vec(s); }, acc_j, acc_j, Kv);
+            at::vec::convert(
+                acc_j, output[b][q_offset + query_start + j][h].data(), Kv);
+            if (compute_logsumexp) {
+              logsumexp[seq][h][query_start + j] =
+                  m_prime[j] + std::log(s_prime[j]);
+            }
           }
-          s_prime = s_prime * m_delta;
-          for (int64_t rr = 0; rr < BLOCK; rr++)
-            s_prime += s_delta[rr];
-
-          m_prime = m_i;
-        }
-        auto oo = output[i][j].data();
-        for (int64_t k = 0; k < K; k++) {
-          oo[k] = buf[k] / s_prime;
         }
-        if (compute_logsumexp)
-          logsumexp[i][j] = m_prime + std::log(s_prime);
-      }
-    }
-  });
+      });
 }
 
-std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
+// The `efficient_attention` ops take BMK tensors, or on CPU BMHK tensors
+// with any strides as long as the last dimension is contiguous. The bias is
+// [B * H, M, N] in both cases. BMK tensors are seen as BMHK with one head
+at::Tensor as_bmhk(const at::Tensor& x) {
+  return x.dim() == 3 ? x.unsqueeze(2) : x;
+}
+
+// The kernels read rows of contiguous elements
+at::Tensor last_dim_contiguous(const at::Tensor& x) {
+  return x.stride(-1) == 1 ? x : x.contiguous();
+}
+
+// Checks the inputs shared by the forward and the backward, and returns the
+// bias as [B, H, M, N]
+at::Tensor check_attention_inputs(
     const at::Tensor& query,
     const at::Tensor& key,
     const at::Tensor& value,
-    bool compute_logsumexp,
-    const c10::optional<at::Tensor>& attn_bias_,
-    double p) {
+    const c10::optional<at::Tensor>& attn_bias_) {
   TORCH_CHECK(query.dim() == key.dim());
   TORCH_CHECK(query.dim() == value.dim());
-  TORCH_CHECK(query.dim() == 3);
-  TORCH_CHECK(query.size(2) == key.size(2));
-  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(
+      query.dim() == 3 || query.dim() == 4, "expected BMK or BMHK inputs");
+  at::Tensor q = as_bmhk(query);
+  at::Tensor k = as_bmhk(key);
+  at::Tensor v = as_bmhk(value);
+  TORCH_CHECK(q.size(3) == k.size(3));
+  TORCH_CHECK(q.size(0) == k.size(0));
+  TORCH_CHECK(q.size(2) == k.size(2));
 
-  TORCH_CHECK(query.size(0) == value.size(0));
-  TORCH_CHECK(key.size(1) == value.size(1));
+  TORCH_CHECK(q.size(0) == v.size(0));
+  TORCH_CHECK(k.size(1) == v.size(1));
+  TORCH_CHECK(k.size(2) == v.size(2));
   TORCH_CHECK(
-      query.size(2) ==
-      value.size(2)); // TODO: drop this limitation in the future
+      q.size(3) == v.size(3)); // TODO: drop this limitation in the future
+
+  int64_t B = q.size(0);
+  int64_t M = q.size(1);
+  int64_t H = q.size(2);
+  int64_t N = k.size(1);
 
   at::Tensor attn_bias;
   if (attn_bias_.has_value()) {
     attn_bias = *attn_bias_;
-    TORCH_CHECK(query.dim() == attn_bias.dim());
-    TORCH_CHECK(query.size(0) == attn_bias.size(0));
-    TORCH_CHECK(query.size(1) == attn_bias.size(1));
-    TORCH_CHECK(key.size(1) == attn_bias.size(2));
+    TORCH_CHECK(attn_bias.dim() == 3);
+    TORCH_CHECK(attn_bias.size(0) == B * H);
+    TORCH_CHECK(attn_bias.size(1) == M);
+    TORCH_CHECK(attn_bias.size(2) == N);
     TORCH_CHECK(attn_bias.stride(1) == 0);
+    TORCH_CHECK(attn_bias.scalar_type() == query.scalar_type());
+    attn_bias = attn_bias.view({B, H, M, N});
   }
 
   TORCH_CHECK(!query.is_cuda(), "query must be a CPU tensor");
@@ -151,118 +326,631 @@ std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
   TORCH_CHECK(!query.is_sparse(), "query must be a dense tensor");
   TORCH_CHECK(!key.is_sparse(), "key must be a dense tensor");
   TORCH_CHECK(!value.is_sparse(), "value must be a dense tensor");
+  return attn_bias;
+}
 
-  TORCH_CHECK(query.is_contiguous());
-  TORCH_CHECK(key.is_contiguous());
-  TORCH_CHECK(value.is_contiguous());
-
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    bool compute_logsumexp,
+    const c10::optional<at::Tensor>& attn_bias_,
+    double p) {
+  at::Tensor attn_bias = check_attention_inputs(query, key, value, attn_bias_);
   TORCH_CHECK(p == 0, "CPU implementation does not support dropout");
 
+  at::Tensor q = as_bmhk(last_dim_contiguous(query));
+  at::Tensor k = as_bmhk(last_dim_contiguous(key));
+  at::Tensor v = as_bmhk(last_dim_contiguous(value));
+  int64_t B = q.size(0);
+  int64_t M = q.size(1);
+  int64_t H = q.size(2);
+
+  // Same layout as the query: BMK or BMHK
+  at::Tensor res = at::empty(query.sizes(), query.options());
+  // In float32 for half-precision inputs, as the accumulators
+  at::Tensor logsumexp = at::empty(
+      {B, H, M},
+      query.options().dtype(at::toOpMathType(query.scalar_type())));
+
+  const std::array<int64_t, 4> zeros{{0}};
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_kernel",
+      [&] {
+        attention_kernel<scalar_t>(
+            as_bmhk(res).accessor<scalar_t, 4>(),
+            logsumexp.accessor<at::opmath_type<scalar_t>, 3>(),
+            q.accessor<scalar_t, 4>(),
+            k.accessor<scalar_t, 4>(),
+            v.accessor<scalar_t, 4>(),
+            compute_logsumexp,
+            _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros),
+            /*cu_seqlens_q=*/nullptr,
+            /*cu_seqlens_k=*/nullptr,
+            /*num_seqs=*/B,
+            /*max_seqlen_q=*/M,
+            /*causal=*/false,
+            /*window_size=*/0,
+            /*scale=*/1.0 / std::sqrt(double(q.size(3))),
+            /*softcap=*/0.0);
+      });
+
+  // [B, M] for BMK inputs, [B, H, M] for BMHK
+  if (query.dim() == 3) {
+    logsumexp = logsumexp.squeeze(1);
+  }
+  return std::make_tuple(res, logsumexp, 1, 1);
+}
+
+// CPU version of `efficient_attention_forward_cutlass`, with the same
+// arguments and outputs (see attention_forward_generic.cu), for the modes
+// BMHK and 1MHK (`cu_seqlens`). The paged KV-cache, dropout, RoPE, the
+// generated biases and the block mask are only supported on CUDA.
+// `num_splits_key`, `output_accum` and `l2_persist_kv` are specific to the
+// CUDA kernels and ignored. With int8 query/key or a quantized KV-cache, the
+// attention is computed on the dequantized inputs
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> attention_forward_cutlass(
+    const at::Tensor& query, // [b, seqlen, num_heads, K]
+    const at::Tensor& key, // [b, seqlen, num_kv_heads, K]
+    const at::Tensor& value, // [b, seqlen, num_kv_heads, Kv]
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    const c10::optional<int64_t> max_seqlen_q_,
+    bool compute_logsumexp,
+    bool causal,
+    const c10::optional<at::Tensor>& block_tables,
+    const c10::optional<at::Tensor>& seqlens_k,
+    const c10::optional<int64_t> num_splits_key,
+    const c10::optional<at::Tensor>& attn_bias_,
+    double dropout_p,
+    const c10::optional<int64_t> window_size_,
+    const c10::optional<at::Tensor>& out,
+    const c10::optional<at::Tensor>& output_accum,
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    const c10::optional<double> scale,
+    double softcap,
+    const c10::optional<at::Tensor>& tree_mask,
+    bool l2_persist_kv,
+    const c10::optional<at::Tensor>& q_scale,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
+  TORCH_CHECK(!(q_scale.has_value() && v_scale.has_value()));
+  TORCH_CHECK(
+      k_scale.has_value() == (q_scale.has_value() || v_scale.has_value()));
+  if (q_scale.has_value()) {
+    TORCH_CHECK(query.dim() == 4 && key.dim() == 4);
+    TORCH_CHECK(
+        query.scalar_type() == at::ScalarType::Char &&
+            key.scalar_type() == at::ScalarType::Char,
+        "query and key should be int8 with q_scale / k_scale");
+    TORCH_CHECK(q_scale->sizes() == query.sizes().slice(0, 3));
+    TORCH_CHECK(k_scale->sizes() == key.sizes().slice(0, 3));
+    auto dequantize = [](const at::Tensor& x, const at::Tensor& x_scale) {
+      return x.to(at::kFloat) * x_scale.to(at::kFloat).unsqueeze(-1);
+    };
+    auto result = attention_forward_cutlass(
+        dequantize(query, *q_scale),
+        dequantize(key, *k_scale),
+        value.to(at::kFloat),
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q_,
+        compute_logsumexp,
+        causal,
+        block_tables,
+        seqlens_k,
+        num_splits_key,
+        attn_bias_.has_value()
+            ? c10::optional<at::Tensor>(attn_bias_->to(at::kFloat))
+            : c10::nullopt,
+        dropout_p,
+        window_size_,
+        c10::nullopt,
+        output_accum,
+        rope_cos,
+        rope_sin,
+        rope_positions_q,
+        rope_positions_k,
+        alibi_slopes,
+        rel_pos_bias,
+        block_mask,
+        block_mask_size,
+        scale,
+        softcap,
+        tree_mask,
+        l2_persist_kv,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt);
+    at::Tensor res = std::get<0>(result).to(value.scalar_type());
+    if (out.has_value()) {
+      TORCH_CHECK(
+          out->scalar_type() == value.scalar_type(), "out has the wrong dtype");
+      out->copy_(res);
+      res = *out;
+    }
+    std::get<0>(result) = res;
+    return result;
+  }
+  if (v_scale.has_value()) {
+    TORCH_CHECK(
+        check_quantized_kv_cache(key, *k_scale) ==
+            check_quantized_kv_cache(value, *v_scale),
+        "key and value should be quantized to the same number of bits");
+    return attention_forward_cutlass(
+        query,
+        dequantize_kv_cache(key, *k_scale, query.scalar_type()),
+        dequantize_kv_cache(value, *v_scale, query.scalar_type()),
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q_,
+        compute_logsumexp,
+        causal,
+        block_tables,
+        seqlens_k,
+        num_splits_key,
+        attn_bias_,
+        dropout_p,
+        window_size_,
+        out,
+        output_accum,
+        rope_cos,
+        rope_sin,
+        rope_positions_q,
+        rope_positions_k,
+        alibi_slopes,
+        rel_pos_bias,
+        block_mask,
+        block_mask_size,
+        scale,
+        softcap,
+        tree_mask,
+        l2_persist_kv,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt);
+  }
+  TORCH_CHECK(
+      !block_tables.has_value() && !seqlens_k.has_value(),
+      "CPU implementation does not support block_tables");
+  TORCH_CHECK(
+      !rope_cos.has_value() && !rope_sin.has_value() &&
+          !rope_positions_q.has_value() && !rope_positions_k.has_value(),
+      "CPU implementation does not support RoPE");
+  TORCH_CHECK(
+      !alibi_slopes.has_value() && !rel_pos_bias.has_value(),
+      "CPU implementation does not support generated biases");
+  TORCH_CHECK(
+      !block_mask.has_value(),
+      "CPU implementation does not support block_mask");
+  TORCH_CHECK(dropout_p == 0, "CPU implementation does not support dropout");
+
+  TORCH_CHECK(query.dim() == 4);
+  TORCH_CHECK(key.dim() == 4);
+  TORCH_CHECK(value.dim() == 4);
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(key.size(0) == value.size(0));
+  TORCH_CHECK(key.size(1) == value.size(1));
+  TORCH_CHECK(key.size(2) == value.size(2));
+  TORCH_CHECK(
+      query.size(2) % key.size(2) == 0,
+      "number of query heads must be a multiple of the number of key/value heads");
+  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(query.scalar_type() == key.scalar_type());
+  TORCH_CHECK(query.scalar_type() == value.scalar_type());
+
+  for (const at::Tensor* x : {&query, &key, &value}) {
+    TORCH_CHECK(!x->is_cuda(), "inputs must be CPU tensors");
+    TORCH_CHECK(!x->is_sparse(), "inputs must be dense tensors");
+    TORCH_CHECK(
+        x->stride(-1) == 1, "inputs must be contiguous along the last dim");
+  }
+
   int64_t B = query.size(0);
   int64_t M = query.size(1);
-  int64_t K = query.size(2);
-
-  at::Tensor res = at::empty({B, M, K}, query.options());
-  at::Tensor logsumexp = at::empty({B, M}, query.options());
-
-  at::Tensor buffer = at::empty({at::get_num_threads(), 1, K}, query.options());
-  const std::array<int64_t, 3> zeros{{0}};
-
-  AT_DISPATCH_FLOATING_TYPES(query.scalar_type(), "attention_kernel", [&] {
-    attention_kernel<scalar_t>(
-        res.accessor<scalar_t, 3>(),
-        logsumexp.accessor<scalar_t, 2>(),
-        query.accessor<scalar_t, 3>(),
-        key.accessor<scalar_t, 3>(),
-        value.accessor<scalar_t, 3>(),
-        buffer.accessor<scalar_t, 3>(),
-        compute_logsumexp,
-        _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros));
-  });
+  int64_t num_heads = query.size(2);
+  int64_t Kv = value.size(3);
 
-  return std::make_tuple(res, logsumexp, 1, 1);
+  int64_t num_seqs = B;
+  int64_t max_seqlen_q = M;
+  at::Tensor seqstart_q, seqstart_k;
+  TORCH_CHECK(cu_seqlens_q.has_value() == cu_seqlens_k.has_value());
+  if (cu_seqlens_q.has_value()) {
+    TORCH_CHECK(cu_seqlens_q->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(cu_seqlens_k->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(cu_seqlens_q->dim() == 1 && cu_seqlens_k->dim() == 1);
+    TORCH_CHECK(cu_seqlens_q->size(0) == cu_seqlens_k->size(0));
+    TORCH_CHECK(cu_seqlens_q->size(0) >= 1);
+    TORCH_CHECK(!cu_seqlens_q->is_cuda() && !cu_seqlens_k->is_cuda());
+    TORCH_CHECK(B == 1, "cu_seqlen only supports batch_size=1");
+    if (max_seqlen_q_.has_value()) {
+      TORCH_CHECK(*max_seqlen_q_ >= 0);
+      max_seqlen_q = std::min(*max_seqlen_q_, max_seqlen_q);
+    }
+    seqstart_q = cu_seqlens_q->contiguous();
+    seqstart_k = cu_seqlens_k->contiguous();
+    num_seqs = seqstart_q.size(0) - 1;
+    const int32_t* sq = seqstart_q.data_ptr<int32_t>();
+    const int32_t* sk = seqstart_k.data_ptr<int32_t>();
+    for (int64_t s = 0; s < num_seqs; s++) {
+      TORCH_CHECK(
+          0 <= sq[s] && sq[s] <= sq[s + 1] && sq[s + 1] <= M,
+          "invalid cu_seqlens_q");
+      TORCH_CHECK(
+          0 <= sk[s] && sk[s] <= sk[s + 1] && sk[s + 1] <= key.size(1),
+          "invalid cu_seqlens_k");
+      TORCH_CHECK(
+          sq[s + 1] - sq[s] <= max_seqlen_q,
+          "sequence longer than max_seqlen_q");
+    }
+  }
+
+  at::Tensor attn_bias;
+  if (attn_bias_.has_value()) {
+    attn_bias = *attn_bias_;
+    TORCH_CHECK(
+        !cu_seqlens_q.has_value(),
+        "attn_bias is not supported with cu_seqlens");
+    TORCH_CHECK(attn_bias.scalar_type() == query.scalar_type());
+    TORCH_CHECK(attn_bias.dim() == 4);
+    TORCH_CHECK(attn_bias.size(0) == B);
+    TORCH_CHECK(attn_bias.size(1) == num_heads);
+    TORCH_CHECK(attn_bias.size(2) == M);
+    TORCH_CHECK(attn_bias.size(3) >= key.size(1));
+  }
+
+  int64_t window_size = 0;
+  if (window_size_.has_value()) {
+    window_size = *window_size_;
+    TORCH_CHECK(window_size > 0);
+    TORCH_CHECK(causal, "window_size requires causal=True");
+  }
+  TORCH_CHECK(softcap >= 0.0, "softcap should be positive (or 0 to disable)");
+
+  // The tree mask is applied as a bias: 0 for the ancestors of the query
+  // and the keys before the drafts, -inf for the other drafts
+  if (tree_mask.has_value()) {
+    TORCH_CHECK(
+        !causal && !cu_seqlens_q.has_value(),
+        "tree_mask is not supported with causal or cu_seqlens");
+    TORCH_CHECK(tree_mask->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(tree_mask->dim() == 3);
+    TORCH_CHECK(tree_mask->size(0) == B && tree_mask->size(1) == M);
+    TORCH_CHECK(tree_mask->size(2) == (M + 31) / 32);
+    TORCH_CHECK(key.size(1) >= M, "the drafts should be the last keys");
+    int64_t N = key.size(1);
+    at::Tensor shifts = at::arange(32, tree_mask->options());
+    at::Tensor bits = tree_mask->unsqueeze(-1).bitwise_right_shift(shifts);
+    at::Tensor ancestors =
+        bits.bitwise_and(1).flatten(2).narrow(2, 0, M).to(at::kBool);
+    at::Tensor tree_bias = at::zeros({B, 1, M, N}, query.options());
+    tree_bias.narrow(3, N - M, M)
+        .masked_fill_(
+            ancestors.logical_not().unsqueeze(1),
+            -std::numeric_limits<double>::infinity());
+    tree_bias = tree_bias.expand({B, num_heads, M, N});
+    attn_bias = attn_bias.defined() ? attn_bias.narrow(3, 0, N) + tree_bias
+                                    : tree_bias.contiguous();
+  }
+
+  at::Tensor res;
+  if (out.has_value()) {
+    TORCH_CHECK(out->dim() == 4);
+    TORCH_CHECK(out->size(0) == B);
+    TORCH_CHECK(out->size(1) == M);
+    TORCH_CHECK(out->size(2) == num_heads);
+    TORCH_CHECK(out->size(3) == Kv);
+    TORCH_CHECK(out->stride(-1) == 1);
+    TORCH_CHECK(
+        out->scalar_type() == query.scalar_type(), "out has the wrong dtype");
+    res = *out;
+  } else {
+    res = at::empty({B, M, num_heads, Kv}, query.options());
+  }
+
+  // Same layout and padding as the CUDA kernels, as expected by the backward
+  constexpr int64_t kAlignLSE = 32;
+  int64_t lse_dim = (max_seqlen_q + kAlignLSE - 1) / kAlignLSE * kAlignLSE;
+  at::Tensor logsumexp = at::full(
+      {num_seqs, num_heads, compute_logsumexp ? lse_dim : 0},
+      std::numeric_limits<float>::infinity(),
+      query.options().dtype(at::toOpMathType(query.scalar_type())));
+
+  const std::array<int64_t, 4> zeros{{0}};
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_kernel",
+      [&] {
+        attention_kernel<scalar_t>(
+            res.accessor<scalar_t, 4>(),
+            logsumexp.accessor<at::opmath_type<scalar_t>, 3>(),
+            query.accessor<scalar_t, 4>(),
+            key.accessor<scalar_t, 4>(),
+            value.accessor<scalar_t, 4>(),
+            compute_logsumexp,
+            _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros),
+            seqstart_q.defined() ? seqstart_q.data_ptr<int32_t>() : nullptr,
+            seqstart_k.defined() ? seqstart_k.data_ptr<int32_t>() : nullptr,
+            num_seqs,
+            max_seqlen_q,
+            causal,
+            window_size,
+            scale.value_or(1.0 / std::sqrt(double(query.size(3)))),
+            softcap);
+      });
+
+  return std::make_tuple(res, logsumexp, int64_t(0), int64_t(0));
 }
 
+// Blocked backward, with `delta[j] = sum_k(grad_out[j][k] * out[j][k])`:
+//   attn[j][l] = exp(scale * q_j . k_l + bias[j][l] - logsumexp[j])
+//   grad_attn[j][l] = attn[j][l] * (grad_out_j . v_l - delta[j])
+//   grad_v_l = sum_j(attn[j][l] * grad_out_j)
+//   grad_k_l = scale * sum_j(grad_attn[j][l] * q_j)
+//   grad_q_j = scale * sum_l(grad_attn[j][l] * k_l)
+// The tiles of `attn` are computed twice: once by tasks which own a block of
+// keys (and accumulate its grad_k / grad_v), and once by tasks which own a
+// block of queries (for grad_q). This parallelizes over the blocks of the
+// sequences as well as over the batch and the heads, without atomics nor
+// per-thread copies of the gradients, and every gradient is summed in a
+// fixed order. The gradients of a block are accumulated in `accum_t`, and
+// written once. The tensors are BMHK, as in the forward
 template <typename scalar_t>
 void attention_backward_kernel(
-    at::TensorAccessor<scalar_t, 3> grad_q,
-    at::TensorAccessor<scalar_t, 3> grad_k,
-    at::TensorAccessor<scalar_t, 3> grad_v,
-    at::TensorAccessor<scalar_t, 3> grad_out,
-    at::TensorAccessor<scalar_t, 3> q,
-    at::TensorAccessor<scalar_t, 3> k,
-    at::TensorAccessor<scalar_t, 3> v,
-    at::TensorAccessor<scalar_t, 2> logsumexp_normalizer,
-    at::TensorAccessor<scalar_t, 3> buffer,
-    at::TensorAccessor<scalar_t, 3> buffer2,
-    at::TensorAccessor<scalar_t, 3> attn_bias) {
-  int64_t K = q.size(2);
+    at::TensorAccessor<scalar_t, 4> grad_q,
+    at::TensorAccessor<scalar_t, 4> grad_k,
+    at::TensorAccessor<scalar_t, 4> grad_v,
+    at::TensorAccessor<scalar_t, 4> grad_out,
+    at::TensorAccessor<scalar_t, 4> q,
+    at::TensorAccessor<scalar_t, 4> k,
+    at::TensorAccessor<scalar_t, 4> v,
+    at::TensorAccessor<scalar_t, 4> out,
+    at::TensorAccessor<at::opmath_type<scalar_t>, 3> logsumexp_normalizer,
+    at::TensorAccessor<scalar_t, 4> attn_bias) {
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  constexpr int64_t kBlockM = 16;
+  constexpr int64_t kBlockN = 64;
+  int64_t K = q.size(3);
   int64_t B = q.size(0);
   int64_t M = q.size(1);
+  int64_t H = q.size(2);
   int64_t N = k.size(1);
-  int64_t grain_size = 1; // buffer.size(1);
-  scalar_t scale = 1.0 / std::sqrt(scalar_t(K));
-  at::parallel_for(0, B, grain_size, [&](int64_t start, int64_t end) {
-    auto buf = buffer[at::get_thread_num()][0];
-    auto buf2 = buffer2[at::get_thread_num()][0];
-    for (int64_t i = start; i < end; i++) {
-      for (int64_t j = 0; j < M; j++) {
-        for (int64_t k = 0; k < K; k++) {
-          buf[k] = 0;
-        }
-        auto query_i = q[i][j];
-        auto normalizer = logsumexp_normalizer[i][j];
-        scalar_t tmp_sum = 0;
-        for (int64_t l = 0; l < N; l++) {
-          auto key_j = k[i][l];
-          scalar_t si = 0;
-          for (int64_t k = 0; k < K; k++) {
-            si += query_i[k] * key_j[k];
-          }
-          scalar_t attn_b =
-              attn_bias.data() == nullptr ? scalar_t(0) : attn_bias[i][j][l];
-          scalar_t attn_v = std::exp(si * scale - normalizer + attn_b);
-
-          for (int64_t k = 0; k < K; k++) {
-            grad_v[i][l][k] += attn_v * grad_out[i][j][k];
-          }
+  int64_t num_query_blocks = (M + kBlockM - 1) / kBlockM;
+  int64_t num_key_blocks = (N + kBlockN - 1) / kBlockN;
+  int64_t grain_size = 1;
+  accum_t scale = 1.0 / std::sqrt(accum_t(K));
+  auto dot = [K](const accum_t* a, const accum_t* b) {
+    return at::vec::map2_reduce_all<accum_t>(
+        [](Vec x, Vec y) { return x * y; },
+        [](Vec x, Vec y) { return x + y; },
+        a,
+        b,
+        K);
+  };
+  // `y += alpha * x`
+  auto axpy = [K](accum_t* y, accum_t alpha, const accum_t* x) {
+    at::vec::map2(
+        [alpha](Vec a, Vec b) { return a + b * Vec(alpha); }, y, y, x, K);
+  };
+  // Writes `num_rows` contiguous rows of `K` elements to rows of `dst`
+  auto store_rows = [K](const accum_t* src,
+                        scalar_t* dst,
+                        int64_t stride,
+                        int64_t num_rows) {
+    for (int64_t row = 0; row < num_rows; row++) {
+      at::vec::convert(src + row * K, dst + row * stride, K);
+    }
+  };
 
-          // now compute grad_q and grad_k
-          // first compute the gradient for the self-attention
-          // after softmax
-          scalar_t grad_attn_v = 0;
-          for (int64_t k = 0; k < K; k++) {
-            grad_attn_v += grad_out[i][j][k] * v[i][l][k];
-            // grad_attn_v[i][j][l] += grad_out[i][j][k] * v[i][l][k];
-          }
+  // In the order of the rows of `logsumexp_normalizer`: [B, H, M]
+  std::vector<accum_t> delta(B * H * M);
+  at::parallel_for(0, B * H * M, 64, [&](int64_t start, int64_t end) {
+    std::vector<accum_t> buf(2 * K);
+    for (int64_t row = start; row < end; row++) {
+      int64_t i = row / (H * M);
+      int64_t h = (row / M) % H;
+      int64_t j = row % M;
+      delta[row] =
+          dot(load_rows(grad_out[i][j][h].data(), K, 1, K, buf.data()),
+              load_rows(out[i][j][h].data(), K, 1, K, buf.data() + K));
+    }
+  });
 
-          // those are temporaries for the gradient of the softmax
-          scalar_t tmp = attn_v * grad_attn_v * scale;
-          tmp_sum += tmp;
+  // Blocks of rows of the inputs, as `accum_t`
+  struct Blocks {
+    std::vector<accum_t> buf;
+    const accum_t* q = nullptr;
+    const accum_t* grad_out = nullptr;
+    const accum_t* k = nullptr;
+    const accum_t* v = nullptr;
+  };
+  auto load_queries =
+      [&](Blocks& blocks, int64_t i, int64_t h, int64_t query_start) {
+        int64_t rows = std::min(kBlockM, M - query_start);
+        accum_t* buf = blocks.buf.data();
+        blocks.q = load_rows(
+            q[i][query_start][h].data(), q.stride(1), rows, K, buf);
+        blocks.grad_out = load_rows(
+            grad_out[i][query_start][h].data(),
+            grad_out.stride(1),
+            rows,
+            K,
+            buf + kBlockM * K);
+      };
+  auto load_keys =
+      [&](Blocks& blocks, int64_t i, int64_t h, int64_t key_start) {
+        int64_t rows = std::min(kBlockN, N - key_start);
+        accum_t* buf = blocks.buf.data() + 2 * kBlockM * K;
+        blocks.k =
+            load_rows(k[i][key_start][h].data(), k.stride(1), rows, K, buf);
+        blocks.v = load_rows(
+            v[i][key_start][h].data(),
+            v.stride(1),
+            rows,
+            K,
+            buf + kBlockN * K);
+      };
+  auto make_blocks = [&]() {
+    Blocks blocks;
+    blocks.buf.resize(2 * (kBlockM + kBlockN) * K);
+    return blocks;
+  };
 
-          // grad_q is easy
-          for (int64_t k = 0; k < K; k++) {
-            grad_q[i][j][k] += tmp * key_j[k];
-            buf[k] += attn_v * key_j[k];
-          }
+  // Fills `attn` and `grad_attn` [kBlockM][kBlockN] for the loaded tile
+  auto compute_tile = [&](const Blocks& blocks,
+                          int64_t i,
+                          int64_t h,
+                          int64_t query_start,
+                          int64_t num_queries,
+                          int64_t key_start,
+                          int64_t num_keys,
+                          accum_t* attn,
+                          accum_t* grad_attn) {
+    for (int64_t j = 0; j < num_queries; j++) {
+      int64_t query = query_start + j;
+      const accum_t* q_j = blocks.q + j * K;
+      const accum_t* grad_out_j = blocks.grad_out + j * K;
+      accum_t* attn_j = attn + j * kBlockN;
+      accum_t* grad_attn_j = grad_attn + j * kBlockN;
+      accum_t normalizer = logsumexp_normalizer[i][h][query];
+      for (int64_t l = 0; l < num_keys; l++) {
+        attn_j[l] = scale * dot(q_j, blocks.k + l * K) - normalizer;
+        grad_attn_j[l] = dot(grad_out_j, blocks.v + l * K);
+      }
+      if (attn_bias.data() != nullptr) {
+        auto bias = attn_bias[i][h][query];
+        for (int64_t l = 0; l < num_keys; l++) {
+          attn_j[l] += accum_t(bias[key_start + l]);
+        }
+      }
+      at::vec::map([](Vec x) { return x.exp(); }, attn_j, attn_j, num_keys);
+      accum_t delta_j = delta[(i * H + h) * M + query];
+      at::vec::map2(
+          [delta_j](Vec a, Vec g) { return a * (g - Vec(delta_j)); },
+          grad_attn_j,
+          attn_j,
+          grad_attn_j,
+          num_keys);
+    }
+  };
 
-          //  but grad_k is a bit trickier
-          buf2[l] = attn_v;
-          for (int64_t k = 0; k < K; k++) {
-            grad_k[i][l][k] += tmp * query_i[k];
+  // grad_k / grad_v
+  at::parallel_for(
+      0, B * H * num_key_blocks, grain_size, [&](int64_t start, int64_t end) {
+        Blocks blocks = make_blocks();
+        std::vector<accum_t> attn(kBlockM * kBlockN);
+        std::vector<accum_t> grad_attn(kBlockM * kBlockN);
+        std::vector<accum_t> grad_k_acc(kBlockN * K);
+        std::vector<accum_t> grad_v_acc(kBlockN * K);
+        for (int64_t task = start; task < end; task++) {
+          int64_t i = task / (H * num_key_blocks);
+          int64_t h = (task / num_key_blocks) % H;
+          int64_t key_start = (task % num_key_blocks) * kBlockN;
+          int64_t num_keys = std::min(kBlockN, N - key_start);
+          load_keys(blocks, i, h, key_start);
+          std::fill(grad_k_acc.begin(), grad_k_acc.end(), accum_t(0));
+          std::fill(grad_v_acc.begin(), grad_v_acc.end(), accum_t(0));
+          for (int64_t query_start = 0; query_start < M;
+               query_start += kBlockM) {
+            int64_t num_queries = std::min(kBlockM, M - query_start);
+            load_queries(blocks, i, h, query_start);
+            compute_tile(
+                blocks,
+                i,
+                h,
+                query_start,
+                num_queries,
+                key_start,
+                num_keys,
+                attn.data(),
+                grad_attn.data());
+            for (int64_t l = 0; l < num_keys; l++) {
+              accum_t* grad_v_l = grad_v_acc.data() + l * K;
+              accum_t* grad_k_l = grad_k_acc.data() + l * K;
+              for (int64_t j = 0; j < num_queries; j++) {
+                axpy(
+                    grad_v_l,
+                    attn[j * kBlockN + l],
+                    blocks.grad_out + j * K);
+                axpy(
+                    grad_k_l,
+                    scale * grad_attn[j * kBlockN + l],
+                    blocks.q + j * K);
+              }
+            }
           }
+          store_rows(
+              grad_k_acc.data(),
+              grad_k[i][key_start][h].data(),
+              grad_k.stride(1),
+              num_keys);
+          store_rows(
+              grad_v_acc.data(),
+              grad_v[i][key_start][h].data(),
+              grad_v.stride(1),
+              num_keys);
         }
-        for (int64_t l = 0; l < N; l++) {
-          for (int64_t k = 0; k < K; k++) {
-            grad_k[i][l][k] -= buf2[l] * query_i[k] * tmp_sum;
+      });
+
+  // grad_q
+  at::parallel_for(
+      0, B * H * num_query_blocks, grain_size, [&](int64_t start, int64_t end) {
+        Blocks blocks = make_blocks();
+        std::vector<accum_t> attn(kBlockM * kBlockN);
+        std::vector<accum_t> grad_attn(kBlockM * kBlockN);
+        std::vector<accum_t> grad_q_acc(kBlockM * K);
+        for (int64_t task = start; task < end; task++) {
+          int64_t i = task / (H * num_query_blocks);
+          int64_t h = (task / num_query_blocks) % H;
+          int64_t query_start = (task % num_query_blocks) * kBlockM;
+          int64_t num_queries = std::min(kBlockM, M - query_start);
+          load_queries(blocks, i, h, query_start);
+          std::fill(grad_q_acc.begin(), grad_q_acc.end(), accum_t(0));
+          for (int64_t key_start = 0; key_start < N; key_start += kBlockN) {
+            int64_t num_keys = std::min(kBlockN, N - key_start);
+            load_keys(blocks, i, h, key_start);
+            compute_tile(
+                blocks,
+                i,
+                h,
+                query_start,
+                num_queries,
+                key_start,
+                num_keys,
+                attn.data(),
+                grad_attn.data());
+            for (int64_t j = 0; j < num_queries; j++) {
+              accum_t* grad_q_j = grad_q_acc.data() + j * K;
+              for (int64_t l = 0; l < num_keys; l++) {
+                axpy(
+                    grad_q_j,
+                    scale * grad_attn[j * kBlockN + l],
+                    blocks.k + l * K);
+              }
+            }
           }
+          store_rows(
+              grad_q_acc.data(),
+              grad_q[i][query_start][h].data(),
+              grad_q.stride(1),
+              num_queries);
         }
-        for (int64_t k = 0; k < K; k++) {
-          grad_q[i][j][k] -= buf[k] * tmp_sum;
-        }
-      }
-    }
-  });
+      });
 }
 
 std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
@@ -276,75 +964,46 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> attention_backward(
     double p,
     int64_t rng_seed,
     int64_t rng_offset) {
-  TORCH_CHECK(query.dim() == grad_out.dim());
-  TORCH_CHECK(query.dim() == key.dim());
-  TORCH_CHECK(query.dim() == value.dim());
-  TORCH_CHECK(query.dim() == 3);
+  at::Tensor attn_bias = check_attention_inputs(query, key, value, attn_bias_);
+  TORCH_CHECK(grad_out.sizes() == query.sizes());
+  TORCH_CHECK(output.sizes() == grad_out.sizes());
+  TORCH_CHECK(logsumexp.dim() == query.dim() - 1);
 
-  TORCH_CHECK(query.size(0) == grad_out.size(0));
-  TORCH_CHECK(query.size(1) == grad_out.size(1));
-  TORCH_CHECK(query.size(2) == grad_out.size(2));
-
-  TORCH_CHECK(query.size(2) == key.size(2));
-  TORCH_CHECK(query.size(0) == key.size(0));
-
-  TORCH_CHECK(query.size(0) == value.size(0));
-  TORCH_CHECK(key.size(1) == value.size(1));
-  TORCH_CHECK(
-      query.size(2) ==
-      value.size(2)); // TODO: drop this limitation in the future
-
-  at::Tensor attn_bias;
-  if (attn_bias_.has_value()) {
-    attn_bias = *attn_bias_;
-    TORCH_CHECK(query.dim() == attn_bias.dim());
-    TORCH_CHECK(query.size(0) == attn_bias.size(0));
-    TORCH_CHECK(query.size(1) == attn_bias.size(1));
-    TORCH_CHECK(key.size(1) == attn_bias.size(2));
-    TORCH_CHECK(attn_bias.stride(1) == 0);
-  }
-
-  TORCH_CHECK(!query.is_cuda(), "query must be a CPU tensor");
-  TORCH_CHECK(!key.is_cuda(), "key must be a CPU tensor");
-  TORCH_CHECK(!value.is_cuda(), "value must be a CPU tensor");
   TORCH_CHECK(!grad_out.is_cuda(), "grad_out must be a CPU tensor");
-
-  TORCH_CHECK(!query.is_sparse(), "query must be a dense tensor");
-  TORCH_CHECK(!key.is_sparse(), "key must be a dense tensor");
-  TORCH_CHECK(!value.is_sparse(), "value must be a dense tensor");
   TORCH_CHECK(!grad_out.is_sparse(), "grad_out must be a dense tensor");
 
   TORCH_CHECK(p == 0, "CPU implementation does not support dropout");
 
-  int64_t B = query.size(0);
-  int64_t M = query.size(1);
-  int64_t N = key.size(1);
-  int64_t K = query.size(2);
-
-  at::Tensor res = at::empty({B, M, K}, query.options());
-  at::Tensor grad_q = at::zeros_like(query);
-  at::Tensor grad_k = at::zeros_like(key);
-  at::Tensor grad_v = at::zeros_like(value);
+  at::Tensor q = as_bmhk(last_dim_contiguous(query));
+  at::Tensor k = as_bmhk(last_dim_contiguous(key));
+  at::Tensor v = as_bmhk(last_dim_contiguous(value));
+  at::Tensor g = as_bmhk(last_dim_contiguous(grad_out));
+  at::Tensor out = as_bmhk(last_dim_contiguous(output));
+  at::Tensor lse = query.dim() == 3 ? logsumexp.unsqueeze(1) : logsumexp;
+  // Same layouts as the inputs, and every block of rows is written by the
+  // kernel
+  at::Tensor grad_q = at::empty(query.sizes(), query.options());
+  at::Tensor grad_k = at::empty(key.sizes(), key.options());
+  at::Tensor grad_v = at::empty(value.sizes(), value.options());
 
-  at::Tensor buffer = at::empty({at::get_num_threads(), 1, K}, query.options());
-  at::Tensor buffer2 =
-      at::zeros({at::get_num_threads(), 1, N}, query.options());
+  const std::array<int64_t, 4> zeros{{0}};
 
-  const std::array<int64_t, 3> zeros{{0}};
-
-  AT_DISPATCH_FLOATING_TYPES(
-      query.scalar_type(), "attention_backward_kernel", [&] {
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_backward_kernel",
+      [&] {
         attention_backward_kernel<scalar_t>(
-            grad_q.accessor<scalar_t, 3>(),
-            grad_k.accessor<scalar_t, 3>(),
-            grad_v.accessor<scalar_t, 3>(),
-            grad_out.accessor<scalar_t, 3>(),
-            query.accessor<scalar_t, 3>(),
-            key.accessor<scalar_t, 3>(),
-            value.accessor<scalar_t, 3>(),
-            logsumexp.accessor<scalar_t, 2>(),
-            buffer.accessor<scalar_t, 3>(),
-            buffer2.accessor<scalar_t, 3>(),
+            as_bmhk(grad_q).accessor<scalar_t, 4>(),
+            as_bmhk(grad_k).accessor<scalar_t, 4>(),
+            as_bmhk(grad_v).accessor<scalar_t, 4>(),
+            g.accessor<scalar_t, 4>(),
+            q.accessor<scalar_t, 4>(),
+            k.accessor<scalar_t, 4>(),
+            v.accessor<scalar_t, 4>(),
+            out.accessor<scalar_t, 4>(),
+            lse.accessor<at::opmath_type<scalar_t>, 3>(),
             _tensor_accessor_or_dummy<scalar_t>(attn_bias, zeros));
       });
 
@@ -360,4 +1019,7 @@ TORCH_LIBRARY_IMPL(xformers, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::efficient_attention_backward"),
       TORCH_FN(attention_backward));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_forward_cutlass"),
+      TORCH_FN(attention_forward_cutlass));
 }
@@ -1,12 +1,21 @@
+#include <vector>
+
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
 #include <torch/types.h>
 
+#include "../batched_pattern.h"
+#include "sputnik_utils.h"
+
 namespace {
 
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/sddmm_launcher.cc
-// with modifications to add batch support
-// Simple CPU kernel launcher.
+// with modifications to add batch support, to parallelize over blocks of
+// rows, and to vectorize the dot products (in float for the reduced
+// precision types)
+template <typename scalar_t>
 void LaunchSddmm(
     int m,
     int k,
@@ -15,23 +24,35 @@ void LaunchSddmm(
     const int* row_indices,
     const int* row_offsets,
     const int* column_indices,
-    const float* lhs_matrix,
-    const float* rhs_matrix,
-    float* output_values,
+    const scalar_t* lhs_matrix,
+    const scalar_t* rhs_matrix,
+    scalar_t* output_values,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int idx_n = column_indices[j];
-        float accumulator = 0.0f;
-        for (int l = 0; l < k; ++l) {
-          accumulator += lhs_matrix[b * m * k + i * k + l] *
-              rhs_matrix[b * n * k + idx_n * k + l];
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t start, int64_t end) {
+        std::vector<accum_t> lhs_buf(k);
+        std::vector<accum_t> rhs_buf(k);
+        const scalar_t* rhs_matrix_b = rhs_matrix + b * n * k;
+        for (int64_t i = start; i < end; ++i) {
+          const accum_t* lhs =
+              load_row(lhs_matrix + (b * m + i) * k, k, lhs_buf.data());
+          for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
+            const accum_t* rhs = load_row(
+                rhs_matrix_b + int64_t(column_indices[j]) * k,
+                k,
+                rhs_buf.data());
+            output_values[b * nonzeros + j] =
+                at::vec::map2_reduce_all<accum_t>(
+                    [](Vec x, Vec y) { return x * y; },
+                    [](Vec x, Vec y) { return x + y; },
+                    lhs,
+                    rhs,
+                    k);
+          }
         }
-        output_values[b * nonzeros + j] = accumulator;
-      }
-    }
-  }
+      });
 }
 
 at::Tensor sddmm_sputnik(
@@ -44,6 +65,8 @@ at::Tensor sddmm_sputnik(
   TORCH_CHECK(a.dim() == 3);
   TORCH_CHECK(a.size(0) == b.size(0));
   TORCH_CHECK(a.size(2) == b.size(2));
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a should have the same dtype as b");
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
@@ -77,21 +100,40 @@ at::Tensor sddmm_sputnik(
   int n = b.size(1);
 
   int nonzeros = column_indices.size(0);
+  TORCH_CHECK(
+      row_offsets.size(0) == m + 1 || is_batched_pattern(batch, m, row_offsets),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
+
+  // a per-batch pattern is a single [batch * m, batch * n] sparse matrix,
+  // sampled from the [batch * m, k] and [batch * n, k] stacked matrices
+  if (is_batched_pattern(batch, m, row_offsets)) {
+    m *= batch;
+    n *= batch;
+    batch = 1;
+  }
 
   at::Tensor output = at::empty({batch, nonzeros}, a.options());
 
-  LaunchSddmm(
-      m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      a.data_ptr<float>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      batch);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      a.scalar_type(),
+      "sddmm_sputnik",
+      [&] {
+        LaunchSddmm<scalar_t>(
+            m,
+            k,
+            n,
+            nonzeros,
+            row_indices.data_ptr<int>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            a.data_ptr<scalar_t>(),
+            b.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            batch);
+      });
 
   return output;
 }
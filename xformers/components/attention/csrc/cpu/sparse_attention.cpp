@@ -0,0 +1,585 @@
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
+#include <ATen/Parallel.h>
+#include <torch/types.h>
+
+#include "../batched_pattern.h"
+#include "../compressed_indices.h"
+
+namespace {
+
+// Fused sddmm + sparse softmax + spmm: for the rows `i` of the CSR pattern,
+//   out[i] = sum_j(softmax_j(scale * q[i] . k[j]) * v[j])
+// over the nonzeros `j` of the row, with an online softmax so that the
+// scores are never materialized. The pattern is shared by the batch, and
+// `logsumexp` [B, M] is kept for the backward. Rows without nonzeros have
+// `out = 0` and `logsumexp = -inf`
+template <typename scalar_t, typename index_t>
+void SparseAttention(
+    int m,
+    int k,
+    int kv,
+    int n,
+    const scalar_t* query,
+    const scalar_t* key,
+    const scalar_t* value,
+    const int* row_offsets,
+    const index_t* column_indices,
+    double scale,
+    scalar_t* output,
+    float* logsumexp,
+    int batch_size) {
+  using accum_t = at::opmath_type<scalar_t>;
+  at::parallel_for(
+      0, int64_t(batch_size) * m, 16, [&](int64_t start, int64_t end) {
+        std::vector<accum_t> accumulator(kv);
+        for (int64_t row = start; row < end; ++row) {
+          int64_t b = row / m;
+          int i = row % m;
+          const scalar_t* q = query + row * k;
+          std::fill(accumulator.begin(), accumulator.end(), accum_t(0));
+          accum_t max = -INFINITY;
+          accum_t sum = 0;
+          for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
+            int64_t j = b * n + column_indices[l];
+            const scalar_t* key_j = key + j * k;
+            accum_t score = 0;
+            for (int t = 0; t < k; ++t) {
+              score += accum_t(q[t]) * accum_t(key_j[t]);
+            }
+            score *= accum_t(scale);
+            if (score > max) {
+              accum_t correction = std::exp(max - score);
+              sum *= correction;
+              for (int t = 0; t < kv; ++t) {
+                accumulator[t] *= correction;
+              }
+              max = score;
+            }
+            accum_t p = std::exp(score - max);
+            sum += p;
+            const scalar_t* value_j = value + j * kv;
+            for (int t = 0; t < kv; ++t) {
+              accumulator[t] += p * accum_t(value_j[t]);
+            }
+          }
+          scalar_t* out = output + row * kv;
+          for (int t = 0; t < kv; ++t) {
+            out[t] = sum > 0 ? accumulator[t] / sum : accum_t(0);
+          }
+          logsumexp[row] = sum > 0 ? max + std::log(sum) : -INFINITY;
+        }
+      });
+}
+
+// With `p[i][j] = exp(scale * q[i] . k[j] - logsumexp[i])` and
+// `delta[i] = grad_out[i] . out[i]`:
+//   grad_s[i][j] = p[i][j] * (grad_out[i] . v[j] - delta[i])
+//   grad_q[i] = scale * sum_j(grad_s[i][j] * k[j])
+//   grad_k[j] = scale * sum_i(grad_s[i][j] * q[i])
+//   grad_v[j] = sum_i(p[i][j] * grad_out[i])
+// grad_q is computed by rows of the pattern, and grad_k / grad_v by rows of
+// its transpose, so that every gradient has a single writer
+template <typename scalar_t, typename index_t>
+void SparseAttentionBackward(
+    int m,
+    int k,
+    int kv,
+    int n,
+    const scalar_t* grad_out,
+    const scalar_t* query,
+    const scalar_t* key,
+    const scalar_t* value,
+    const scalar_t* output,
+    const float* logsumexp,
+    const int* row_offsets,
+    const index_t* column_indices,
+    const int* row_offsets_t,
+    const index_t* column_indices_t,
+    double scale,
+    scalar_t* grad_query,
+    scalar_t* grad_key,
+    scalar_t* grad_value,
+    int batch_size) {
+  using accum_t = at::opmath_type<scalar_t>;
+  auto dot = [](const scalar_t* a, const scalar_t* b, int size) {
+    accum_t res = 0;
+    for (int t = 0; t < size; ++t) {
+      res += accum_t(a[t]) * accum_t(b[t]);
+    }
+    return res;
+  };
+
+  std::vector<accum_t> delta(int64_t(batch_size) * m);
+  at::parallel_for(
+      0, int64_t(batch_size) * m, 64, [&](int64_t start, int64_t end) {
+        for (int64_t row = start; row < end; ++row) {
+          delta[row] = dot(grad_out + row * kv, output + row * kv, kv);
+        }
+      });
+
+  // grad_q
+  at::parallel_for(
+      0, int64_t(batch_size) * m, 16, [&](int64_t start, int64_t end) {
+        std::vector<accum_t> grad_q(k);
+        for (int64_t row = start; row < end; ++row) {
+          int64_t b = row / m;
+          int i = row % m;
+          const scalar_t* q = query + row * k;
+          const scalar_t* g = grad_out + row * kv;
+          std::fill(grad_q.begin(), grad_q.end(), accum_t(0));
+          for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
+            int64_t j = b * n + column_indices[l];
+            const scalar_t* key_j = key + j * k;
+            accum_t p =
+                std::exp(accum_t(scale) * dot(q, key_j, k) - logsumexp[row]);
+            accum_t grad_s = p * (dot(g, value + j * kv, kv) - delta[row]);
+            for (int t = 0; t < k; ++t) {
+              grad_q[t] += grad_s * accum_t(key_j[t]);
+            }
+          }
+          scalar_t* out = grad_query + row * k;
+          for (int t = 0; t < k; ++t) {
+            out[t] = accum_t(scale) * grad_q[t];
+          }
+        }
+      });
+
+  // grad_k / grad_v
+  at::parallel_for(
+      0, int64_t(batch_size) * n, 16, [&](int64_t start, int64_t end) {
+        std::vector<accum_t> grad_k(k);
+        std::vector<accum_t> grad_v(kv);
+        for (int64_t row = start; row < end; ++row) {
+          int64_t b = row / n;
+          int j = row % n;
+          const scalar_t* key_j = key + row * k;
+          const scalar_t* value_j = value + row * kv;
+          std::fill(grad_k.begin(), grad_k.end(), accum_t(0));
+          std::fill(grad_v.begin(), grad_v.end(), accum_t(0));
+          for (int l = row_offsets_t[j]; l < row_offsets_t[j + 1]; ++l) {
+            int64_t i = b * m + column_indices_t[l];
+            const scalar_t* q = query + i * k;
+            const scalar_t* g = grad_out + i * kv;
+            accum_t p =
+                std::exp(accum_t(scale) * dot(q, key_j, k) - logsumexp[i]);
+            accum_t grad_s = p * (dot(g, value_j, kv) - delta[i]);
+            for (int t = 0; t < kv; ++t) {
+              grad_v[t] += p * accum_t(g[t]);
+            }
+            for (int t = 0; t < k; ++t) {
+              grad_k[t] += grad_s * accum_t(q[t]);
+            }
+          }
+          for (int t = 0; t < k; ++t) {
+            grad_key[row * k + t] = accum_t(scale) * grad_k[t];
+          }
+          for (int t = 0; t < kv; ++t) {
+            grad_value[row * kv + t] = grad_v[t];
+          }
+        }
+      });
+}
+
+// Backward of the unfused sddmm + sparse softmax + spmm chain, from the
+// probabilities `attn` [B, nnz] stored by the forward, and the probabilities
+// `attn_dropped` which multiplied v (`attn` itself without dropout). The
+// dropout mask is `attn_dropped / attn` on the nonzeros of the pattern, so
+// with `g[i][j] = grad_out[i] . v[j]`:
+//   delta[i] = sum_j(attn_dropped[i][j] * g[i][j])
+//   grad_s[i][j] = attn_dropped[i][j] * g[i][j] - attn[i][j] * delta[i]
+//   grad_q[i] = sum_j(grad_s[i][j] * k[j])
+//   grad_k[j] = sum_i(grad_s[i][j] * q[i])
+// and neither the gradient of the probabilities nor the one of the scores
+// go through memory. grad_q and delta are computed by rows of the pattern,
+// and grad_k by rows of its transpose, where `perm` gives the position of
+// the nonzeros in `attn`
+template <typename scalar_t, typename index_t>
+void SparseSoftmaxAttentionBackward(
+    int m,
+    int k,
+    int kv,
+    int n,
+    int nonzeros,
+    const scalar_t* grad_out,
+    const scalar_t* query,
+    const scalar_t* key,
+    const scalar_t* value,
+    const scalar_t* attn,
+    const scalar_t* attn_dropped,
+    const int* row_offsets,
+    const index_t* column_indices,
+    const int* row_offsets_t,
+    const index_t* column_indices_t,
+    const int64_t* perm,
+    scalar_t* grad_query,
+    scalar_t* grad_key,
+    int batch_size) {
+  using accum_t = at::opmath_type<scalar_t>;
+  auto dot = [](const scalar_t* a, const scalar_t* b, int size) {
+    accum_t res = 0;
+    for (int t = 0; t < size; ++t) {
+      res += accum_t(a[t]) * accum_t(b[t]);
+    }
+    return res;
+  };
+
+  // grad_q = sum_j(attn_dropped * g * k[j]) - delta * sum_j(attn * k[j])
+  std::vector<accum_t> delta(int64_t(batch_size) * m);
+  at::parallel_for(
+      0, int64_t(batch_size) * m, 16, [&](int64_t start, int64_t end) {
+        std::vector<accum_t> grad_q(k);
+        std::vector<accum_t> attn_k(k);
+        for (int64_t row = start; row < end; ++row) {
+          int64_t b = row / m;
+          int i = row % m;
+          const scalar_t* g = grad_out + row * kv;
+          const scalar_t* p = attn + b * nonzeros;
+          const scalar_t* p_dropped = attn_dropped + b * nonzeros;
+          std::fill(grad_q.begin(), grad_q.end(), accum_t(0));
+          std::fill(attn_k.begin(), attn_k.end(), accum_t(0));
+          accum_t delta_i = 0;
+          for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
+            int64_t j = b * n + column_indices[l];
+            const scalar_t* key_j = key + j * k;
+            accum_t p_g = accum_t(p_dropped[l]) * dot(g, value + j * kv, kv);
+            accum_t p_l = p[l];
+            delta_i += p_g;
+            for (int t = 0; t < k; ++t) {
+              grad_q[t] += p_g * accum_t(key_j[t]);
+              attn_k[t] += p_l * accum_t(key_j[t]);
+            }
+          }
+          delta[row] = delta_i;
+          scalar_t* out = grad_query + row * k;
+          for (int t = 0; t < k; ++t) {
+            out[t] = grad_q[t] - delta_i * attn_k[t];
+          }
+        }
+      });
+
+  // grad_k
+  at::parallel_for(
+      0, int64_t(batch_size) * n, 16, [&](int64_t start, int64_t end) {
+        std::vector<accum_t> grad_k(k);
+        for (int64_t row = start; row < end; ++row) {
+          int64_t b = row / n;
+          int j = row % n;
+          const scalar_t* value_j = value + row * kv;
+          std::fill(grad_k.begin(), grad_k.end(), accum_t(0));
+          for (int l = row_offsets_t[j]; l < row_offsets_t[j + 1]; ++l) {
+            int64_t i = b * m + column_indices_t[l];
+            int64_t e = b * nonzeros + perm[l];
+            const scalar_t* q = query + i * k;
+            accum_t grad_s =
+                accum_t(attn_dropped[e]) * dot(grad_out + i * kv, value_j, kv) -
+                accum_t(attn[e]) * delta[i];
+            for (int t = 0; t < k; ++t) {
+              grad_k[t] += grad_s * accum_t(q[t]);
+            }
+          }
+          for (int t = 0; t < k; ++t) {
+            grad_key[row * k + t] = grad_k[t];
+          }
+        }
+      });
+}
+
+void check_sparse_attention_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(query.dim() == 3);
+  TORCH_CHECK(key.dim() == 3);
+  TORCH_CHECK(value.dim() == 3);
+  TORCH_CHECK(row_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(0) == value.size(0));
+  TORCH_CHECK(query.size(2) == key.size(2));
+  TORCH_CHECK(key.size(1) == value.size(1));
+  TORCH_CHECK(row_indices.size(0) == query.size(1));
+  TORCH_CHECK(row_offsets.size(0) == query.size(1) + 1);
+  TORCH_CHECK(
+      query.scalar_type() == key.scalar_type() &&
+          query.scalar_type() == value.scalar_type(),
+      "query, key and value should have the same dtype");
+
+  for (const at::Tensor* t : {&query, &key, &value}) {
+    TORCH_CHECK(!t->is_cuda(), "query, key and value must be CPU tensors");
+    TORCH_CHECK(
+        t->is_contiguous(), "query, key and value must be contiguous tensors");
+  }
+  TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
+  TORCH_CHECK(!row_offsets.is_cuda(), "row_offsets must be a CPU tensor");
+  TORCH_CHECK(!column_indices.is_cuda(), "column_offsets must be a CPU tensor");
+
+  TORCH_CHECK(
+      row_offsets.is_contiguous(), "row_offsets must be a contiguous tensor");
+  TORCH_CHECK(
+      column_indices.is_contiguous(),
+      "column_offsets must be a contiguous tensor");
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse_attention_sputnik(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    double scale) {
+  check_sparse_attention_inputs(
+      query, key, value, row_indices, row_offsets, column_indices);
+
+  int batch = query.size(0);
+  int m = query.size(1);
+  int k = query.size(2);
+  int n = key.size(1);
+  int kv = value.size(2);
+
+  at::Tensor output = at::empty({batch, m, kv}, query.options());
+  at::Tensor logsumexp =
+      at::empty({batch, m}, query.options().dtype(at::ScalarType::Float));
+
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        query.scalar_type(),
+        "sparse_attention_sputnik",
+        [&] {
+          SparseAttention<scalar_t, index_t>(
+              m,
+              k,
+              kv,
+              n,
+              query.data_ptr<scalar_t>(),
+              key.data_ptr<scalar_t>(),
+              value.data_ptr<scalar_t>(),
+              row_offsets.data_ptr<int>(),
+              column_indices.data_ptr<index_t>(),
+              scale,
+              output.data_ptr<scalar_t>(),
+              logsumexp.data_ptr<float>(),
+              batch);
+        });
+  });
+
+  return std::make_tuple(output, logsumexp);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+sparse_attention_backward_sputnik(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& output,
+    const at::Tensor& logsumexp,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    double scale) {
+  check_sparse_attention_inputs(
+      query, key, value, row_indices, row_offsets, column_indices);
+  TORCH_CHECK(grad_out.sizes() == output.sizes());
+  TORCH_CHECK(
+      output.size(0) == query.size(0) && output.size(1) == query.size(1) &&
+      output.size(2) == value.size(2));
+  TORCH_CHECK(logsumexp.dim() == 2);
+  TORCH_CHECK(
+      logsumexp.size(0) == query.size(0) && logsumexp.size(1) == query.size(1));
+  TORCH_CHECK(logsumexp.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(row_offsets_t.dim() == 1);
+  TORCH_CHECK(column_indices_t.dim() == 1);
+  TORCH_CHECK(row_offsets_t.size(0) == key.size(1) + 1);
+  TORCH_CHECK(column_indices_t.size(0) == column_indices.size(0));
+  TORCH_CHECK(
+      column_indices_t.scalar_type() == column_indices.scalar_type(),
+      "column_indices and column_indices_t should have the same dtype");
+
+  at::Tensor g = grad_out.contiguous();
+  at::Tensor out = output.contiguous();
+  at::Tensor lse = logsumexp.contiguous();
+  at::Tensor ro_t = row_offsets_t.contiguous();
+  at::Tensor ci_t = column_indices_t.contiguous();
+
+  int batch = query.size(0);
+  int m = query.size(1);
+  int k = query.size(2);
+  int n = key.size(1);
+  int kv = value.size(2);
+
+  at::Tensor grad_query = at::empty_like(query);
+  at::Tensor grad_key = at::empty_like(key);
+  at::Tensor grad_value = at::empty_like(value);
+
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        query.scalar_type(),
+        "sparse_attention_backward_sputnik",
+        [&] {
+          SparseAttentionBackward<scalar_t, index_t>(
+              m,
+              k,
+              kv,
+              n,
+              g.data_ptr<scalar_t>(),
+              query.data_ptr<scalar_t>(),
+              key.data_ptr<scalar_t>(),
+              value.data_ptr<scalar_t>(),
+              out.data_ptr<scalar_t>(),
+              lse.data_ptr<float>(),
+              row_offsets.data_ptr<int>(),
+              column_indices.data_ptr<index_t>(),
+              ro_t.data_ptr<int>(),
+              ci_t.data_ptr<index_t>(),
+              scale,
+              grad_query.data_ptr<scalar_t>(),
+              grad_key.data_ptr<scalar_t>(),
+              grad_value.data_ptr<scalar_t>(),
+              batch);
+        });
+  });
+
+  return std::make_tuple(grad_query, grad_key, grad_value);
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse_softmax_attention_backward_sputnik(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& attn,
+    const at::Tensor& attn_dropped,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    const at::Tensor& perm) {
+  TORCH_CHECK(query.dim() == 3);
+  TORCH_CHECK(key.dim() == 3);
+  TORCH_CHECK(value.dim() == 3);
+  TORCH_CHECK(grad_out.dim() == 3);
+  TORCH_CHECK(row_offsets.dim() == 1);
+
+  // a per-batch pattern is the pattern of the stacked batch elements
+  at::Tensor q = query;
+  at::Tensor k_ = key;
+  at::Tensor v = value;
+  at::Tensor g = grad_out.contiguous();
+  if (is_batched_pattern(query.size(0), query.size(1), row_offsets)) {
+    q = query.reshape({1, -1, query.size(2)});
+    k_ = key.reshape({1, -1, key.size(2)});
+    v = value.reshape({1, -1, value.size(2)});
+    g = g.reshape({1, -1, g.size(2)});
+  }
+  check_sparse_attention_inputs(
+      q, k_, v, row_indices, row_offsets, column_indices);
+  TORCH_CHECK(
+      g.size(0) == q.size(0) && g.size(1) == q.size(1) &&
+      g.size(2) == v.size(2));
+  TORCH_CHECK(attn.dim() == 2);
+  TORCH_CHECK(attn.size(0) == q.size(0));
+  TORCH_CHECK(attn.size(1) == column_indices.size(0));
+  TORCH_CHECK(attn.sizes() == attn_dropped.sizes());
+  TORCH_CHECK(
+      attn.scalar_type() == q.scalar_type() &&
+          attn_dropped.scalar_type() == q.scalar_type(),
+      "attn and attn_dropped should have the dtype of query");
+  TORCH_CHECK(row_offsets_t.dim() == 1);
+  TORCH_CHECK(column_indices_t.dim() == 1);
+  TORCH_CHECK(perm.dim() == 1);
+  TORCH_CHECK(row_offsets_t.size(0) == k_.size(1) + 1);
+  TORCH_CHECK(column_indices_t.size(0) == column_indices.size(0));
+  TORCH_CHECK(
+      column_indices_t.scalar_type() == column_indices.scalar_type(),
+      "column_indices and column_indices_t should have the same dtype");
+  TORCH_CHECK(perm.size(0) == column_indices.size(0));
+  TORCH_CHECK(perm.scalar_type() == at::ScalarType::Long);
+
+  at::Tensor p = attn.contiguous();
+  at::Tensor p_dropped = attn_dropped.contiguous();
+  at::Tensor ro_t = row_offsets_t.contiguous();
+  at::Tensor ci_t = column_indices_t.contiguous();
+  at::Tensor perm_t = perm.contiguous();
+
+  int batch = q.size(0);
+  int m = q.size(1);
+  int k = q.size(2);
+  int n = k_.size(1);
+  int kv = v.size(2);
+  int nonzeros = column_indices.size(0);
+
+  at::Tensor grad_query = at::empty_like(q);
+  at::Tensor grad_key = at::empty_like(k_);
+
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        q.scalar_type(),
+        "sparse_softmax_attention_backward_sputnik",
+        [&] {
+          SparseSoftmaxAttentionBackward<scalar_t, index_t>(
+              m,
+              k,
+              kv,
+              n,
+              nonzeros,
+              g.data_ptr<scalar_t>(),
+              q.data_ptr<scalar_t>(),
+              k_.data_ptr<scalar_t>(),
+              v.data_ptr<scalar_t>(),
+              p.data_ptr<scalar_t>(),
+              p_dropped.data_ptr<scalar_t>(),
+              row_offsets.data_ptr<int>(),
+              column_indices.data_ptr<index_t>(),
+              ro_t.data_ptr<int>(),
+              ci_t.data_ptr<index_t>(),
+              perm_t.data_ptr<int64_t>(),
+              grad_query.data_ptr<scalar_t>(),
+              grad_key.data_ptr<scalar_t>(),
+              batch);
+        });
+  });
+
+  return std::make_tuple(
+      grad_query.view(query.sizes()), grad_key.view(key.sizes()));
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_sputnik"),
+      TORCH_FN(sparse_attention_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_backward_sputnik"),
+      TORCH_FN(sparse_attention_backward_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME(
+          "xformers::sparse_softmax_attention_backward_sputnik"),
+      TORCH_FN(sparse_softmax_attention_backward_sputnik));
+}
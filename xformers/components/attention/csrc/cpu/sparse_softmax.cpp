@@ -1,76 +1,119 @@
+#include <cmath>
+#include <vector>
+
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
 #include <torch/types.h>
 
+#include "sputnik_utils.h"
+
 namespace {
 
+// The reduced precision types are accumulated in float
+template <typename scalar_t>
 void SparseSoftmax(
     int m,
     int n,
     int nonzeros,
-    const float* values,
+    const scalar_t* values,
     const int* row_indices,
     const int* row_offsets,
     const int* column_indices,
-    float* output_values,
+    scalar_t* output_values,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // find the max in a row
-      float max = -INFINITY;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        max = x > max ? x : max;
-      }
-      // compute the normalization constant
-      float norm = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        norm += expf(x - max);
-      }
-      norm = 1.0f / norm;
-
-      // step 3: Normalize the exponentials of the input and store the
-      // results.
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        int offset = b * nonzeros + j;
-        float x = values[offset];
-        float res = expf(x - max) * norm;
-        output_values[offset] = res;
-      }
-    }
-  }
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t start, int64_t end) {
+        std::vector<accum_t> x_buf;
+        std::vector<accum_t> out_buf;
+        for (int64_t i = start; i < end; ++i) {
+          int64_t offset = b * nonzeros + row_offsets[i];
+          int64_t row_nnz = row_offsets[i + 1] - row_offsets[i];
+          if (row_nnz == 0) {
+            continue;
+          }
+          x_buf.resize(row_nnz);
+          out_buf.resize(row_nnz);
+          const accum_t* x = load_row(values + offset, row_nnz, x_buf.data());
+
+          // find the max in a row
+          accum_t max = at::vec::reduce_all<accum_t>(
+              [](Vec& a, Vec& b) { return at::vec::maximum(a, b); },
+              x,
+              row_nnz);
+          // compute the normalization constant from the exponentials
+          at::vec::map(
+              [max](Vec v) { return (v - Vec(max)).exp(); },
+              out_buf.data(),
+              x,
+              row_nnz);
+          accum_t norm = at::vec::reduce_all<accum_t>(
+              [](Vec& a, Vec& b) { return a + b; }, out_buf.data(), row_nnz);
+          norm = accum_t(1) / norm;
+
+          // Normalize the exponentials and store the results
+          at::vec::map(
+              [norm](Vec v) { return v * Vec(norm); },
+              out_buf.data(),
+              out_buf.data(),
+              row_nnz);
+          at::vec::convert(out_buf.data(), output_values + offset, row_nnz);
+        }
+      });
 }
 
+template <typename scalar_t>
 void SparseSoftmaxBackwardKernel(
     int m,
     int n,
-    const float* gradient,
-    const float* values,
+    const scalar_t* gradient,
+    const scalar_t* values,
     const int* row_indices,
     const int* row_offsets,
     const int* column_indices,
-    float* output_values,
+    scalar_t* output_values,
     int nonzeros,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      // Step 1: Compute the intermediate sum used for the gradient
-      float sum = 0.0f;
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        sum += x * g;
-      }
-
-      // step 2: Compute the gradients
-      for (int j = row_offsets[i]; j < row_offsets[i + 1]; ++j) {
-        float x = values[b * nonzeros + j];
-        float g = gradient[b * nonzeros + j];
-        float res = x * (g - sum);
-        output_values[b * nonzeros + j] = res;
-      }
-    }
-  }
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t start, int64_t end) {
+        std::vector<accum_t> x_buf;
+        std::vector<accum_t> g_buf;
+        std::vector<accum_t> out_buf;
+        for (int64_t i = start; i < end; ++i) {
+          int64_t offset = b * nonzeros + row_offsets[i];
+          int64_t row_nnz = row_offsets[i + 1] - row_offsets[i];
+          if (row_nnz == 0) {
+            continue;
+          }
+          x_buf.resize(row_nnz);
+          g_buf.resize(row_nnz);
+          out_buf.resize(row_nnz);
+          const accum_t* x = load_row(values + offset, row_nnz, x_buf.data());
+          const accum_t* g =
+              load_row(gradient + offset, row_nnz, g_buf.data());
+
+          // Step 1: Compute the intermediate sum used for the gradient
+          accum_t sum = at::vec::map2_reduce_all<accum_t>(
+              [](Vec a, Vec b) { return a * b; },
+              [](Vec a, Vec b) { return a + b; },
+              x,
+              g,
+              row_nnz);
+
+          // step 2: Compute the gradients
+          at::vec::map2(
+              [sum](Vec a, Vec b) { return a * (b - Vec(sum)); },
+              out_buf.data(),
+              x,
+              g,
+              row_nnz);
+          at::vec::convert(out_buf.data(), output_values + offset, row_nnz);
+        }
+      });
 }
 
 at::Tensor sparse_softmax_sputnik(
@@ -108,19 +151,32 @@ at::Tensor sparse_softmax_sputnik(
 
   int batch = values.size(0);
   int nonzeros = column_indices.size(0);
+  // per-batch patterns have the rows of all the batch elements
+  int rows = row_offsets.size(0) - 1;
+  TORCH_CHECK(
+      rows == m || (values.size(0) == 1 && m > 0 && rows % m == 0),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
 
   at::Tensor output = at::empty({batch, nonzeros}, values.options());
 
-  SparseSoftmax(
-      m,
-      n,
-      nonzeros,
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      batch);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_sputnik",
+      [&] {
+        SparseSoftmax<scalar_t>(
+            rows,
+            n,
+            nonzeros,
+            values.data_ptr<scalar_t>(),
+            row_indices.data_ptr<int>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            output.data_ptr<scalar_t>(),
+            batch);
+      });
 
   return output;
 }
@@ -141,6 +197,9 @@ at::Tensor sparse_softmax_backward_sputnik(
   TORCH_CHECK(values.size(1) == column_indices.size(0));
   TORCH_CHECK(values.size(0) == grad.size(0));
   TORCH_CHECK(values.size(1) == grad.size(1));
+  TORCH_CHECK(
+      values.scalar_type() == grad.scalar_type(),
+      "values should have the same dtype as grad");
 
   TORCH_CHECK(!grad.is_cuda(), "grad must be a CPU tensor");
   TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
@@ -167,20 +226,33 @@ at::Tensor sparse_softmax_backward_sputnik(
 
   int batch = values.size(0);
   int nonzeros = column_indices.size(0);
+  // per-batch patterns have the rows of all the batch elements
+  int rows = row_offsets.size(0) - 1;
+  TORCH_CHECK(
+      rows == m || (values.size(0) == 1 && m > 0 && rows % m == 0),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
 
   at::Tensor output = at::empty({batch, nonzeros}, values.options());
 
-  SparseSoftmaxBackwardKernel(
-      m,
-      n,
-      grad.data_ptr<float>(),
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      nonzeros,
-      batch);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_backward_sputnik",
+      [&] {
+        SparseSoftmaxBackwardKernel<scalar_t>(
+            rows,
+            n,
+            grad.data_ptr<scalar_t>(),
+            values.data_ptr<scalar_t>(),
+            row_indices.data_ptr<int>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            output.data_ptr<scalar_t>(),
+            nonzeros,
+            batch);
+      });
 
   return output;
 }
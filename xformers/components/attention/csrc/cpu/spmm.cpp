@@ -1,52 +1,108 @@
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/OpMathType.h>
 #include <torch/types.h>
 
+#include "../batched_pattern.h"
+#include "../spmm_activation.h"
+#include "sputnik_utils.h"
+
 namespace {
 // taken from
 // https://github.com/google-research/google-research/blob/master/sgk/sparse/ops/cc/spmm_launcher.cc
-// with slight modifications to add batch support
-// Simple CPU kernel launcher.
+// with modifications to add batch support, to parallelize over blocks of
+// rows, and to compute the rows of the output as vectorized sums of rows of
+// the dense matrix (in float for the reduced precision types), followed by
+// the optional bias (one per row) and activation of `spmm_bias_act_sputnik`
+template <typename scalar_t>
 void LaunchSpmm(
     int m,
     int k,
     int n,
     int nonzeros,
     const int* row_indices,
-    const float* values,
+    const scalar_t* values,
     const int* row_offsets,
     const int* column_indices,
-    const float* dense_matrix,
-    float* output_matrix,
+    const scalar_t* dense_matrix,
+    const float* bias,
+    SpmmActivation activation,
+    scalar_t* preact_matrix,
+    scalar_t* output_matrix,
     int batch_size) {
-  for (int b = 0; b < batch_size; b++) {
-    for (int i = 0; i < m; ++i) {
-      for (int j = 0; j < n; ++j) {
-        float accumulator = 0.0f;
-        for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
-          int column_index = column_indices[l];
-          accumulator += values[b * nonzeros + l] *
-              dense_matrix[b * k * n + column_index * n + j];
+  using accum_t = at::opmath_type<scalar_t>;
+  using Vec = at::vec::Vectorized<accum_t>;
+  parallel_for_rows(
+      batch_size, m, row_offsets, [&](int64_t b, int64_t start, int64_t end) {
+        std::vector<accum_t> accumulator(n);
+        std::vector<accum_t> dense_buf(n);
+        const scalar_t* dense = dense_matrix + b * k * n;
+        for (int64_t i = start; i < end; ++i) {
+          std::fill(accumulator.begin(), accumulator.end(), accum_t(0));
+          for (int l = row_offsets[i]; l < row_offsets[i + 1]; ++l) {
+            Vec value(accum_t(values[b * nonzeros + l]));
+            const accum_t* row = load_row(
+                dense + int64_t(column_indices[l]) * n, n, dense_buf.data());
+            at::vec::map2(
+                [value](Vec x, Vec y) { return x + value * y; },
+                accumulator.data(),
+                accumulator.data(),
+                row,
+                n);
+          }
+          if (bias != nullptr) {
+            accum_t row_bias = bias[i];
+            for (int j = 0; j < n; ++j) {
+              accumulator[j] += row_bias;
+            }
+          }
+          if (preact_matrix != nullptr) {
+            at::vec::convert(
+                accumulator.data(), preact_matrix + (b * m + i) * n, n);
+          }
+          if (activation == SpmmActivation::kRelu) {
+            for (int j = 0; j < n; ++j) {
+              accumulator[j] = std::max(accumulator[j], accum_t(0));
+            }
+          } else if (activation == SpmmActivation::kGelu) {
+            for (int j = 0; j < n; ++j) {
+              accum_t x = accumulator[j];
+              accumulator[j] = accum_t(0.5) * x *
+                  (accum_t(1) + std::erf(x * accum_t(M_SQRT1_2)));
+            }
+          }
+          at::vec::convert(
+              accumulator.data(), output_matrix + (b * m + i) * n, n);
         }
-        output_matrix[b * m * n + i * n + j] = accumulator;
-      }
-    }
-  }
+      });
 }
 
-at::Tensor spmm_sputnik(
+std::tuple<at::Tensor, at::Tensor> spmm_with_epilogue(
     const at::Tensor& b,
     const at::Tensor& row_indices,
     const at::Tensor& values,
     const at::Tensor& row_offsets,
     const at::Tensor& column_indices,
-    int64_t m) {
+    int64_t m,
+    const c10::optional<at::Tensor>& bias,
+    SpmmActivation activation) {
   TORCH_CHECK(b.dim() == 3);
   TORCH_CHECK(values.dim() == 2);
-  TORCH_CHECK(b.size(0) == values.size(0));
+  TORCH_CHECK(
+      b.size(0) == values.size(0) ||
+      (values.size(0) == 1 && is_batched_pattern(b.size(0), m, row_offsets)));
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
   TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(
+      values.scalar_type() == b.scalar_type(),
+      "values should have the same dtype as b");
 
   TORCH_CHECK(!b.is_cuda(), "b must be a CPU tensor");
   TORCH_CHECK(!row_indices.is_cuda(), "row_indices must be a CPU tensor");
@@ -76,26 +132,98 @@ at::Tensor spmm_sputnik(
   int n = b.size(2);
 
   int nonzeros = column_indices.size(0);
+  TORCH_CHECK(
+      row_offsets.size(0) == m + 1 || is_batched_pattern(batch, m, row_offsets),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
+
+  at::Tensor output = at::empty({batch, m, n}, b.options());
+  at::Tensor preact = at::empty(
+      {activation == SpmmActivation::kGelu ? batch : 0, m, n}, b.options());
+
+  at::Tensor bias_f;
+  if (bias.has_value()) {
+    TORCH_CHECK(bias->dim() == 1 && bias->size(0) == m);
+    TORCH_CHECK(!bias->is_cuda(), "bias must be a CPU tensor");
+    bias_f = bias->to(at::kFloat).contiguous();
+  }
+
+  // a per-batch pattern is a single [batch * m, batch * k] sparse matrix
+  // times the [batch * k, n] stacked dense matrices
+  if (is_batched_pattern(batch, m, row_offsets)) {
+    if (bias_f.defined()) {
+      bias_f = bias_f.repeat({batch});
+    }
+    m *= batch;
+    k *= batch;
+    batch = 1;
+  }
   TORCH_CHECK(
       batch == 1 || nonzeros % 4 == 0,
       "If batch size > 1 then number of nonzeros should be a multiple of 4");
 
-  at::Tensor output = at::empty({batch, m, n}, b.options());
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      b.scalar_type(),
+      "spmm_sputnik",
+      [&] {
+        LaunchSpmm<scalar_t>(
+            m,
+            k,
+            n,
+            nonzeros,
+            row_indices.data_ptr<int>(),
+            values.data_ptr<scalar_t>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            b.data_ptr<scalar_t>(),
+            bias_f.defined() ? bias_f.data_ptr<float>() : nullptr,
+            activation,
+            preact.numel() > 0 ? preact.data_ptr<scalar_t>() : nullptr,
+            output.data_ptr<scalar_t>(),
+            batch);
+      });
 
-  LaunchSpmm(
+  return std::make_tuple(output, preact);
+}
+
+at::Tensor spmm_sputnik(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m) {
+  return std::get<0>(spmm_with_epilogue(
+      b,
+      row_indices,
+      values,
+      row_offsets,
+      column_indices,
       m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      values.data_ptr<float>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      batch);
-
-  return output;
+      c10::nullopt,
+      SpmmActivation::kNone));
+}
+
+std::tuple<at::Tensor, at::Tensor> spmm_bias_act_sputnik(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m,
+    const c10::optional<at::Tensor>& bias,
+    c10::string_view activation) {
+  return spmm_with_epilogue(
+      b,
+      row_indices,
+      values,
+      row_offsets,
+      column_indices,
+      m,
+      bias,
+      parse_spmm_activation(activation));
 }
 
 } // namespace
@@ -103,4 +231,7 @@ at::Tensor spmm_sputnik(
 TORCH_LIBRARY_IMPL(xformers, CPU, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::spmm_sputnik"), TORCH_FN(spmm_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::spmm_bias_act_sputnik"),
+      TORCH_FN(spmm_bias_act_sputnik));
 }
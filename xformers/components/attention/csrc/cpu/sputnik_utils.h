@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <ATen/Parallel.h>
+#include <ATen/cpu/vec/functional.h>
+#include <ATen/cpu/vec/vec.h>
+
+// Helpers shared by the CPU sputnik kernels
+namespace {
+
+// Calls `fn(b, row_start, row_end)` in parallel for blocks of consecutive
+// rows of the CSR pattern of every batch element. The blocks are balanced by
+// number of nonzeros, with every row counting as one more (for its output
+// and its empty rows), so that heavy rows don't end up on a single thread
+template <typename Fn>
+void parallel_for_rows(
+    int64_t batch_size,
+    int64_t m,
+    const int* row_offsets,
+    const Fn& fn) {
+  if (batch_size == 0 || m == 0) {
+    return;
+  }
+  int64_t num_tasks = 4 * at::get_num_threads();
+  int64_t blocks_per_batch =
+      std::min(m, std::max<int64_t>(1, num_tasks / batch_size));
+  int64_t cost = row_offsets[m] - row_offsets[0] + m;
+  // `row_bounds[t]` is the first row whose cost prefix reaches `t / blocks`
+  std::vector<int64_t> row_bounds(blocks_per_batch + 1);
+  int64_t row = 0;
+  for (int64_t block = 0; block < blocks_per_batch; ++block) {
+    int64_t target = cost * block / blocks_per_batch;
+    while (row < m && row_offsets[row] - row_offsets[0] + row < target) {
+      ++row;
+    }
+    row_bounds[block] = row;
+  }
+  row_bounds[blocks_per_batch] = m;
+  at::parallel_for(
+      0, batch_size * blocks_per_batch, 1, [&](int64_t start, int64_t end) {
+        for (int64_t task = start; task < end; ++task) {
+          int64_t block = task % blocks_per_batch;
+          if (row_bounds[block] < row_bounds[block + 1]) {
+            fn(task / blocks_per_batch,
+               row_bounds[block],
+               row_bounds[block + 1]);
+          }
+        }
+      });
+}
+
+// `src` if it can be read in place as `accum_t`, or nullptr
+template <typename scalar_t>
+const scalar_t* row_in_place(const scalar_t* src, scalar_t* buf) {
+  return src;
+}
+
+template <typename accum_t, typename scalar_t>
+const accum_t* row_in_place(const scalar_t* src, accum_t* buf) {
+  return nullptr;
+}
+
+// `n` contiguous elements of `src` as `accum_t`: `src` itself when the types
+// match, or their conversion in `buf`
+template <typename accum_t, typename scalar_t>
+const accum_t* load_row(const scalar_t* src, int64_t n, accum_t* buf) {
+  const accum_t* row = row_in_place(src, buf);
+  if (row != nullptr) {
+    return row;
+  }
+  at::vec::convert(src, buf, n);
+  return buf;
+}
+
+} // namespace
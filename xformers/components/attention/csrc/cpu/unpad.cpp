@@ -0,0 +1,78 @@
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <tuple>
+#include <vector>
+
+// Reference implementation of the CUDA kernels in
+// "cuda/mem_eff_attention/unpad.cu", with the same layout of the outputs
+namespace {
+
+void check_padding_mask(const at::Tensor& padding_mask) {
+  TORCH_CHECK(padding_mask.dim() == 2, "padding_mask should be [B, M]");
+  TORCH_CHECK(padding_mask.scalar_type() == at::ScalarType::Bool);
+}
+
+std::tuple<std::vector<at::Tensor>, at::Tensor, at::Tensor> unpad_inputs(
+    at::TensorList inputs,
+    const at::Tensor& padding_mask) {
+  check_padding_mask(padding_mask);
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+
+  at::Tensor seqlens = padding_mask.sum(1, false, at::ScalarType::Int);
+  at::Tensor cu_seqlens =
+      at::zeros({B + 1}, padding_mask.options().dtype(at::ScalarType::Int));
+  at::cumsum_out(
+      cu_seqlens.narrow(0, 1, B), seqlens, 0, at::ScalarType::Int);
+  at::Tensor max_seqlen =
+      B > 0 ? seqlens.amax(0, true) : at::zeros_like(cu_seqlens);
+
+  at::Tensor valid = padding_mask.reshape({B * M}).nonzero().squeeze(1);
+  std::vector<at::Tensor> outputs;
+  for (const at::Tensor& x : inputs) {
+    TORCH_CHECK(x.dim() >= 2);
+    TORCH_CHECK(
+        x.size(0) == B && x.size(1) == M,
+        "inputs should be [B, M, ...] for a [B, M] padding_mask");
+    std::vector<int64_t> shape = x.sizes().vec();
+    shape[0] = 1;
+    shape[1] = B * M;
+    at::Tensor out = at::zeros(shape, x.options());
+    out.select(0, 0)
+        .narrow(0, 0, valid.size(0))
+        .copy_(x.flatten(0, 1).index_select(0, valid));
+    outputs.push_back(out);
+  }
+  return std::make_tuple(outputs, cu_seqlens, max_seqlen);
+}
+
+at::Tensor pad_output(
+    const at::Tensor& x,
+    const at::Tensor& padding_mask,
+    const at::Tensor& cu_seqlens) {
+  check_padding_mask(padding_mask);
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+  TORCH_CHECK(x.dim() >= 2);
+  TORCH_CHECK(
+      x.size(0) == 1 && x.size(1) == B * M,
+      "x should be [1, B * M, ...] for a [B, M] padding_mask");
+  TORCH_CHECK(cu_seqlens.dim() == 1 && cu_seqlens.size(0) == B + 1);
+
+  at::Tensor valid = padding_mask.reshape({B * M}).nonzero().squeeze(1);
+  std::vector<int64_t> shape = x.sizes().vec();
+  shape[0] = B;
+  shape[1] = M;
+  at::Tensor out = at::zeros(shape, x.options());
+  out.view_as(x).select(0, 0).index_copy_(
+      0, valid, x.select(0, 0).narrow(0, 0, valid.size(0)));
+  return out;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::unpad_inputs"), TORCH_FN(unpad_inputs));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::pad_output"), TORCH_FN(pad_output));
+}
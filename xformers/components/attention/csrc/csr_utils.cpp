@@ -0,0 +1,94 @@
+#include <tuple>
+
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+namespace {
+
+// Order of the rows by decreasing number of nonzeros, which the sputnik
+// kernels use to balance the work between thread blocks. The sort is stable,
+// so the order is deterministic
+at::Tensor csr_row_swizzle(const at::Tensor& row_offsets) {
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) >= 1);
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+
+  at::Tensor row_nnz = at::diff(row_offsets);
+  at::Tensor row_indices = std::get<1>(
+      at::sort(row_nnz, /*stable=*/true, /*dim=*/0, /*descending=*/true));
+  return row_indices.to(at::kInt);
+}
+
+// Pattern of the transpose of the m x n CSR pattern given by `row_offsets` and
+// `column_indices`, as (row_indices_t, row_offsets_t, column_indices_t, perm)
+// where `values[:, perm]` are the values in the transposed order.
+// Only uses device ops whose output sizes are known from the input shapes, so
+// it runs on the device of the pattern without synchronizing with the host
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> csr_transpose_info(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) == m + 1);
+  TORCH_CHECK(row_offsets.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(column_indices.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(row_offsets.device() == column_indices.device());
+
+  at::Tensor ro = row_offsets.contiguous();
+  at::Tensor ci = column_indices.contiguous();
+  int64_t nnz = ci.size(0);
+  auto options = ci.options();
+
+  // the row of each nonzero, i.e. the last row starting at or before it
+  at::Tensor row_coo = at::searchsorted(
+                           ro,
+                           at::arange(nnz, options),
+                           /*out_int32=*/true,
+                           /*right=*/true) -
+      1;
+
+  // a stable sort by column keeps the rows of a column in increasing order
+  at::Tensor sorted_columns, perm;
+  std::tie(sorted_columns, perm) =
+      at::sort(ci, /*stable=*/true, /*dim=*/0, /*descending=*/false);
+  at::Tensor column_indices_t = row_coo.index_select(0, perm);
+
+  // each row of the transpose starts after the nonzeros of smaller columns
+  at::Tensor row_offsets_t = at::searchsorted(
+      sorted_columns,
+      at::arange(n + 1, options),
+      /*out_int32=*/true,
+      /*right=*/false);
+  at::Tensor row_indices_t = csr_row_swizzle(row_offsets_t);
+
+  return std::make_tuple(row_indices_t, row_offsets_t, column_indices_t, perm);
+}
+
+} // namespace
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_row_swizzle(Tensor row_offsets) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::csr_transpose_info(int m, int n, Tensor row_offsets, Tensor column_indices) -> (Tensor, Tensor, Tensor, Tensor)"));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_row_swizzle"),
+      TORCH_FN(csr_row_swizzle));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_transpose_info"),
+      TORCH_FN(csr_transpose_info));
+}
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_row_swizzle"),
+      TORCH_FN(csr_row_swizzle));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_transpose_info"),
+      TORCH_FN(csr_transpose_info));
+}
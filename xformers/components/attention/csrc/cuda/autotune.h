@@ -0,0 +1,176 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+#include <c10/util/Exception.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+// Opt-in autotuning of the variants (tile shapes...) of a kernel. When the
+// environment variable `enable_env` is set to 1, the first call for a given
+// problem key (arch, dtype, shapes or their buckets...) benchmarks every
+// compiled variant that supports the problem, and the fastest one is used for
+// all the subsequent calls with the same key. If `cache_env` is also set, the
+// winners are persisted in (and loaded from) this file, one `<key> <variant>`
+// per line.
+// The autotuners are shared by all the translation units (eg the forward and
+// the backward of an op), so they live in a named namespace, with `inline`
+// accessors: an anonymous namespace would give each TU its own copy, loading
+// and appending to the same cache file.
+namespace xformers {
+
+class KernelAutotuner {
+ public:
+  KernelAutotuner(const char* enable_env, const char* cache_env) {
+    const char* enabled = std::getenv(enable_env);
+    enabled_ = enabled != nullptr && std::string(enabled) == "1";
+    const char* cache_path = std::getenv(cache_env);
+    if (!enabled_ || cache_path == nullptr) {
+      return;
+    }
+    cache_path_ = cache_path;
+    std::ifstream file(cache_path_);
+    std::string key;
+    int variant;
+    size_t num_entries = 0;
+    while (file >> key >> variant) {
+      cache_[key] = variant;
+      ++num_entries;
+    }
+    file.close();
+    if (num_entries != cache_.size()) {
+      // Several processes tuned the same keys: keep the last winners only
+      std::ofstream out(cache_path_, std::ios::trunc);
+      for (const auto& entry : cache_) {
+        out << entry.first << " " << entry.second << "\n";
+      }
+    }
+  }
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  // Returns the index of the fastest of the `num_variants` variants for
+  // `key`, where `run(i)` launches variant `i` on the current stream.
+  // Variants which can't run the problem should throw. Returns `fallback`
+  // when autotuning is disabled or not possible (eg during graph capture)
+  template <typename RunFn>
+  int select(
+      const std::string& key,
+      int num_variants,
+      int fallback,
+      RunFn&& run) {
+    if (!enabled_ || num_variants <= 1) {
+      return fallback;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = cache_.find(key);
+      if (it != cache_.end()) {
+        return it->second;
+      }
+    }
+    if (at::cuda::currentStreamCaptureStatus() !=
+        at::cuda::CaptureStatus::None) {
+      return fallback;
+    }
+
+    constexpr int kNumIters = 5;
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    cudaEvent_t start, end;
+    AT_CUDA_CHECK(cudaEventCreate(&start));
+    AT_CUDA_CHECK(cudaEventCreate(&end));
+    int best = fallback;
+    float best_time = std::numeric_limits<float>::infinity();
+    for (int variant = 0; variant < num_variants; ++variant) {
+      try {
+        // Warmup - also surfaces unsupported variants
+        run(variant);
+        AT_CUDA_CHECK(cudaEventRecord(start, stream));
+        for (int i = 0; i < kNumIters; ++i) {
+          run(variant);
+        }
+        AT_CUDA_CHECK(cudaEventRecord(end, stream));
+        AT_CUDA_CHECK(cudaEventSynchronize(end));
+      } catch (const c10::Error&) {
+        // Clear the error state of the failed launch, if any
+        (void)cudaGetLastError();
+        continue;
+      }
+      float time_ms = 0;
+      AT_CUDA_CHECK(cudaEventElapsedTime(&time_ms, start, end));
+      if (time_ms < best_time) {
+        best_time = time_ms;
+        best = variant;
+      }
+    }
+    AT_CUDA_CHECK(cudaEventDestroy(start));
+    AT_CUDA_CHECK(cudaEventDestroy(end));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto inserted = cache_.emplace(key, best);
+    if (!inserted.second) {
+      // Another thread tuned the same key meanwhile
+      return inserted.first->second;
+    }
+    if (!cache_path_.empty()) {
+      std::ofstream file(cache_path_, std::ios::app);
+      file << key << " " << best << "\n";
+    }
+    return best;
+  }
+
+ private:
+  bool enabled_ = false;
+  std::string cache_path_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, int> cache_;
+};
+
+// Tile shapes of the cutlass attention ops, with
+// `XFORMERS_MEM_EFF_ATTENTION_AUTOTUNE(_CACHE)`
+class AttentionAutotuner {
+ public:
+  static KernelAutotuner& get() {
+    static KernelAutotuner autotuner(
+        "XFORMERS_MEM_EFF_ATTENTION_AUTOTUNE",
+        "XFORMERS_MEM_EFF_ATTENTION_AUTOTUNE_CACHE");
+    return autotuner;
+  }
+};
+
+} // namespace xformers
+
+namespace {
+
+using xformers::AttentionAutotuner;
+using xformers::KernelAutotuner;
+
+// Sequence lengths are bucketed by powers of 2
+inline int64_t autotune_bucket(int64_t n) {
+  int64_t bucket = 1;
+  while (bucket < n) {
+    bucket *= 2;
+  }
+  return bucket;
+}
+
+template <typename... Args>
+std::string make_autotune_key(const char* op, const Args&... args) {
+  std::ostringstream key;
+  key << op;
+  // Keys can't contain spaces, as they are separated from the variant by a
+  // space in the cache file
+  (void)std::initializer_list<int>{(key << "_" << args, 0)...};
+  return key.str();
+}
+
+} // namespace
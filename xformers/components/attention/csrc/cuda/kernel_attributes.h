@@ -0,0 +1,104 @@
+#pragma once
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAMacros.h>
+#include <c10/util/Exception.h>
+
+#include <algorithm>
+#include <array>
+#include <mutex>
+
+// Host-side setup of a kernel, done once per device rather than at every
+// launch: the driver calls behind it (`cudaFuncSetAttribute`,
+// `cudaFuncGetAttributes`, occupancy queries) are a measurable part of the
+// latency of small problems, and they don't depend on the problem.
+//
+// The cache is keyed on the `Kernel` type (the .cu files are compiled as
+// C++14, which has no `template <auto>`): a given `Kernel` must always come
+// with the same `kernel_fn`, and the same arguments in all the calls (eg
+// `sizeof(Kernel::SharedStorage)`), as only the first one has an effect.
+namespace {
+
+template <typename Kernel>
+class KernelAttributes {
+ public:
+  // Allows launches with more than 48kb of dynamic shared memory
+  template <typename KernelFn>
+  static void set_max_dynamic_smem(
+      KernelFn* kernel_fn,
+      int device,
+      size_t smem_bytes) {
+    State& s = state(device);
+    std::call_once(s.smem_flag, [&] {
+      AT_CUDA_CHECK(cudaFuncSetAttribute(
+          kernel_fn, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_bytes));
+    });
+  }
+
+  // The arch `kernel_fn` was compiled for, as `major * 10 + minor`
+  template <typename KernelFn>
+  static int binary_version(KernelFn* kernel_fn, int device) {
+    State& s = state(device);
+    std::call_once(s.binary_version_flag, [&] {
+      cudaFuncAttributes attr;
+      AT_CUDA_CHECK(cudaFuncGetAttributes(&attr, kernel_fn));
+      s.binary_version = attr.binaryVersion;
+    });
+    return s.binary_version;
+  }
+
+  template <typename KernelFn>
+  static int max_active_blocks_per_sm(
+      KernelFn* kernel_fn,
+      int device,
+      int num_threads,
+      size_t smem_bytes) {
+    State& s = state(device);
+    std::call_once(s.occupancy_flag, [&] {
+      AT_CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+          &s.max_active_blocks_per_sm, kernel_fn, num_threads, smem_bytes));
+    });
+    return s.max_active_blocks_per_sm;
+  }
+
+ private:
+  // `std::call_once` retries when the function throws, so a failed call
+  // is not cached
+  struct State {
+    std::once_flag smem_flag;
+    std::once_flag binary_version_flag;
+    std::once_flag occupancy_flag;
+    int binary_version = 0;
+    int max_active_blocks_per_sm = 0;
+  };
+
+  static State& state(int device) {
+    static std::array<State, C10_COMPILE_TIME_MAX_GPUS> states;
+    TORCH_CHECK(device >= 0 && device < C10_COMPILE_TIME_MAX_GPUS);
+    return states[device];
+  }
+};
+
+// The Sm80 kernels (and their number of pipeline stages, tile sizes...) are
+// tuned for the 164kb of shared-memory per SM of the A100, but the other
+// parts of the Sm80 family (sm86/sm89: A10G, L4, RTX...) only have 100kb.
+// There, a kernel which needs `smem_bytes` might not fit at all, or only
+// once per SM when it fits twice on A100: a variant with less shared-memory
+// should be used instead.
+inline bool use_small_smem_kernel(
+    const cudaDeviceProp& props,
+    size_t smem_bytes) {
+  constexpr size_t kTunedSmemPerSm = 164 * 1024;
+  if (props.major < 8 || smem_bytes == 0 ||
+      props.sharedMemPerMultiprocessor >= kTunedSmemPerSm) {
+    return false;
+  }
+  if (smem_bytes > props.sharedMemPerBlockOptin) {
+    return true;
+  }
+  size_t blocks_per_sm = props.sharedMemPerMultiprocessor / smem_bytes;
+  size_t tuned_blocks_per_sm = kTunedSmemPerSm / smem_bytes;
+  return blocks_per_sm < std::min(tuned_blocks_per_sm, size_t(2));
+}
+
+} // namespace
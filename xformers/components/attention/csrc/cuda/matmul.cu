@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <mutex>
+
 #include <ATen/ATen.h>
+#include <ATen/OpMathType.h>
+#include <c10/util/intrusive_ptr.h>
 #include <torch/types.h>
 
 #include <ATen/cuda/CUDAContext.h>
@@ -6,35 +13,147 @@
 
 namespace {
 
-#define CUDA_1D_KERNEL_LOOP(i, n)                                \
-  for (int i = (blockIdx.x * blockDim.x) + threadIdx.x; i < (n); \
-       i += (blockDim.x * gridDim.x))
-
 template <typename integer>
 constexpr __host__ __device__ inline integer ceil_div(integer n, integer m) {
   return (n + m - 1) / m;
 }
 
-template <typename scalar_t>
+// The rows of `a` are staged in shared memory by tiles of consecutive rows
+// (over the flattened batch), and reused by all the nonzeros of these rows
+constexpr int kMatmulThreads = 128;
+constexpr int kMaxRowsPerBlock = 8;
+constexpr int64_t kMaxSharedBytes = 32 * 1024;
+
+// One warp per nonzero, in the order of the CSR form of the mask, which is
+// also the order of the coalesced COO indices
+template <typename scalar_t, bool kSharedA>
 __global__ void matmul_with_sparse_mask_kernel(
-    at::PackedTensorAccessor<scalar_t, 1> output,
-    at::PackedTensorAccessor<scalar_t, 3> a,
-    at::PackedTensorAccessor<scalar_t, 3> b,
-    at::PackedTensorAccessor<int64_t, 2> idxs) {
-  int64_t nnz = output.size(0);
-  int64_t K = a.size(2);
-  CUDA_1D_KERNEL_LOOP(i, nnz) {
-    auto i1 = idxs[0][i];
-    auto i2 = idxs[1][i];
-    auto i3 = idxs[2][i];
-    auto aar = a[i1][i2];
-    auto bar = b[i1][i3];
-    scalar_t r = 0;
-    for (int64_t k = 0; k < K; k++) {
-      r += aar[k] * bar[k];
+    scalar_t* __restrict__ output,
+    const scalar_t* __restrict__ a,
+    const scalar_t* __restrict__ bt,
+    const int* __restrict__ row_offsets,
+    const int* __restrict__ column_indices,
+    int64_t num_rows,
+    int64_t M,
+    int64_t N,
+    int64_t K,
+    int rows_per_block) {
+  using accum_t = at::opmath_type<scalar_t>;
+  extern __shared__ __align__(sizeof(double)) unsigned char smem[];
+  accum_t* a_tile = reinterpret_cast<accum_t*>(smem);
+
+  int64_t row_start = int64_t(blockIdx.x) * rows_per_block;
+  int64_t row_end = min(row_start + rows_per_block, num_rows);
+  if (kSharedA) {
+    const scalar_t* a_rows = a + row_start * K;
+    int64_t tile_size = (row_end - row_start) * K;
+    for (int64_t i = threadIdx.x; i < tile_size; i += blockDim.x) {
+      a_tile[i] = static_cast<accum_t>(a_rows[i]);
+    }
+    __syncthreads();
+  }
+
+  int warp = threadIdx.x / 32;
+  int lane = threadIdx.x % 32;
+  int num_warps = blockDim.x / 32;
+  int64_t row = row_start;
+  for (int nz = row_offsets[row_start] + warp; nz < row_offsets[row_end];
+       nz += num_warps) {
+    // the nonzeros of a warp are increasing, and so are their rows
+    while (row_offsets[row + 1] <= nz) {
+      ++row;
+    }
+    int64_t batch = row / M;
+    const scalar_t* b_row = bt + (batch * N + column_indices[nz]) * K;
+    accum_t r = 0;
+    if (kSharedA) {
+      const accum_t* a_row = a_tile + (row - row_start) * K;
+      for (int64_t k = lane; k < K; k += 32) {
+        r += a_row[k] * static_cast<accum_t>(b_row[k]);
+      }
+    } else {
+      const scalar_t* a_row = a + row * K;
+      for (int64_t k = lane; k < K; k += 32) {
+        r += static_cast<accum_t>(a_row[k]) * static_cast<accum_t>(b_row[k]);
+      }
+    }
+    for (int stride = 16; stride > 0; stride >>= 1) {
+      r += __shfl_xor_sync(0xffffffff, r, stride);
+    }
+    if (lane == 0) {
+      output[nz] = static_cast<scalar_t>(r);
+    }
+  }
+}
+
+// CSR form of a sparse mask of shape [B, M, N], with the rows of all the
+// batch elements concatenated, along with its coalesced COO indices
+struct CsrMask {
+  c10::weak_intrusive_ptr<c10::TensorImpl, c10::UndefinedTensorImpl> mask;
+  int64_t version;
+  at::Tensor indices;
+  at::Tensor row_offsets;
+  at::Tensor column_indices;
+};
+
+// inference tensors can't be modified in place, and have no version counter
+int64_t mask_version(const at::Tensor& mask) {
+  return mask.is_inference() ? 0 : mask._version();
+}
+
+CsrMask compute_csr_mask(const at::Tensor& mask) {
+  auto idxs = mask.coalesce().indices();
+  int64_t M = mask.size(1);
+  int64_t num_rows = mask.size(0) * M;
+  TORCH_CHECK(
+      idxs.size(1) < std::numeric_limits<int>::max(),
+      "mask has too many nonzeros");
+  // the coalesced indices are sorted by batch, row and column
+  auto rows = idxs[0] * M + idxs[1];
+  auto row_offsets = at::searchsorted(
+      rows,
+      at::arange(num_rows + 1, rows.options()),
+      /*out_int32=*/true,
+      /*right=*/false);
+  auto column_indices = idxs[2].to(at::kInt);
+  return CsrMask{
+      c10::weak_intrusive_ptr<c10::TensorImpl, c10::UndefinedTensorImpl>(
+          mask.getIntrusivePtr()),
+      mask_version(mask),
+      idxs,
+      row_offsets,
+      column_indices};
+}
+
+// The masks are usually reused for many steps (e.g. the fixed mask of an
+// attention layer), so the CSR form of the last few masks is cached instead
+// of coalescing and converting them at every call. The entries only hold a
+// weak reference to the masks, and are matched on their identity and version
+CsrMask get_csr_mask(const at::Tensor& mask) {
+  constexpr size_t kCacheSize = 8;
+  static std::mutex mutex;
+  // never destroyed, as the CUDA tensors can't be freed at exit
+  static auto* cache = new std::deque<CsrMask>();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  cache->erase(
+      std::remove_if(
+          cache->begin(),
+          cache->end(),
+          [](const CsrMask& entry) { return entry.mask.expired(); }),
+      cache->end());
+  for (const CsrMask& entry : *cache) {
+    if (entry.mask._unsafe_get_target() == mask.unsafeGetTensorImpl() &&
+        entry.version == mask_version(mask)) {
+      return entry;
     }
-    output[i] = r;
   }
+  CsrMask entry = compute_csr_mask(mask);
+  cache->push_front(entry);
+  if (cache->size() > kCacheSize) {
+    cache->pop_back();
+  }
+  return entry;
 }
 
 at::Tensor matmul_with_sparse_mask(
@@ -67,32 +186,50 @@ at::Tensor matmul_with_sparse_mask(
   int64_t B = a.size(0);
   int64_t M = a.size(1);
   int64_t N = b.size(2);
+  int64_t K = a.size(2);
 
-  auto mask_ = mask.coalesce();
-  auto idxs = mask_.indices();
-  int64_t nnz = idxs.size(1);
-  auto bt = b.transpose(-2, -1);
+  CsrMask csr = get_csr_mask(mask);
+  int64_t nnz = csr.indices.size(1);
+  // the rows of `a` and of `b^T` are read contiguously
+  auto a_ = a.contiguous();
+  auto bt = b.transpose(-2, -1).contiguous();
 
   at::Tensor res = at::empty({nnz}, a.options());
 
-  dim3 grid(std::min(
-      ceil_div(static_cast<int64_t>(nnz), static_cast<int64_t>(512)),
-      static_cast<int64_t>(4096)));
-  dim3 block(512);
-
-  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
-
-  AT_DISPATCH_FLOATING_TYPES_AND_HALF(
-      a.scalar_type(), "matmul_with_sparse_mask_kernel", [&] {
-        matmul_with_sparse_mask_kernel<scalar_t><<<grid, block, 0, stream>>>(
-            res.packed_accessor<scalar_t, 1>(),
-            a.packed_accessor<scalar_t, 3>(),
-            bt.packed_accessor<scalar_t, 3>(),
-            idxs.packed_accessor<int64_t, 2>());
-      });
+  if (nnz > 0) {
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    AT_DISPATCH_FLOATING_TYPES_AND_HALF(
+        a.scalar_type(), "matmul_with_sparse_mask_kernel", [&] {
+          using accum_t = at::opmath_type<scalar_t>;
+          int64_t row_bytes = K * sizeof(accum_t);
+          // the rows which don't fit in shared memory are read directly
+          int rows_per_block = std::min<int64_t>(
+              kMaxRowsPerBlock,
+              kMaxSharedBytes / std::max<int64_t>(row_bytes, 1));
+          bool shared_a = rows_per_block > 0;
+          rows_per_block = std::max(rows_per_block, 1);
+          dim3 grid(ceil_div(B * M, static_cast<int64_t>(rows_per_block)));
+          dim3 block(kMatmulThreads);
+          size_t smem_bytes = shared_a ? rows_per_block * row_bytes : 0;
+          auto kernel = shared_a
+              ? &matmul_with_sparse_mask_kernel<scalar_t, true>
+              : &matmul_with_sparse_mask_kernel<scalar_t, false>;
+          kernel<<<grid, block, smem_bytes, stream>>>(
+              res.data_ptr<scalar_t>(),
+              a_.data_ptr<scalar_t>(),
+              bt.data_ptr<scalar_t>(),
+              csr.row_offsets.data_ptr<int>(),
+              csr.column_indices.data_ptr<int>(),
+              B * M,
+              M,
+              N,
+              K,
+              rows_per_block);
+        });
+    AT_CUDA_CHECK(cudaGetLastError());
+  }
 
-  AT_CUDA_CHECK(cudaGetLastError());
-  auto out = at::sparse_coo_tensor(idxs, res, {B, M, N});
+  auto out = at::sparse_coo_tensor(csr.indices, res, {B, M, N});
 
   return out;
 }
@@ -9,8 +9,7 @@
 #include <ATen/cuda/Atomic.cuh>
 #include <ATen/cuda/CUDAGraphsUtils.cuh>
 
-#include <curand_kernel.h>
-
+#include "philox.h"
 #include "sputnik/vector_utils.h"
 
 namespace {
@@ -146,36 +145,6 @@ __device__ void compute_dot(
   }
 }
 
-/*
-struct RNGMaskGenerator {
-
-  uint64_t seed_;
-  uint64_t offset_;
-  int64_t N_;
-  int64_t global_offset_;
-  curandStatePhilox4_32_10_t state_;
-
-  __device__ __forceinline__ RNGMaskGenerator (at::PhiloxCudaState philox_args)
-{ auto seeds = at:cuda::philox::unpack(philox_args); seed_ = std::get<0>(seeds);
-    offset_ = std::get<1>(seeds);
-  }
-
-  __device__ __forceinline__ void set_sublocation(int64_t x, int64_t y) {
-    int64_t total_offset = global_offset_ + x * N_ + y;
-    // ideally we would use the code below, but initializing the rng
-    // takes a significant portion of time. So we instead modify the seed
-    // so that each thread has a different seed. This has fewer statistical
-    // guarantees than by doing it properly, but is much faster
-    // curand_init(seed_, total_offset, offset_, &state_);
-    curand_init(seed_ + (total_offset << 8) + offset_, 0, 0, &state_);
-  }
-
-  __device__ __forceinline__ float4 generate() {
-      return curand_uniform4(&state_);
-  }
-
-}
-*/
 template <
     typename scalar_t,
     typename vec_t,
@@ -217,11 +186,10 @@ __device__ void apply_masking(
     int64_t N,
     scalar_t p,
     int64_t col_offset) {
-  // strategy: initialize the rng so that each element in the attention
-  // matrix has its own subsequence, so that we can easily retrieve
-  // the element during backward
-
-  curandStatePhilox4_32_10_t state;
+  // strategy: each element in the attention matrix has its own Philox
+  // subsequence, so that we can easily retrieve the element during backward.
+  // The random numbers are computed directly from the counter (see
+  // `philox_uniform4`), without initializing a curand state
   auto seeds = at::cuda::philox::unpack(philox_args);
 
   // we will always sample 4 random floats at a time
@@ -240,15 +208,8 @@ __device__ void apply_masking(
     for (int64_t k_item_idx = 0; k_item_idx < kBlockSizeK;
          k_item_idx += kSampled) {
       int64_t offset = global_offset + q_item_idx * N + k_item_idx + col_offset;
-      // ideally we would use the code below, but initializing the rng
-      // takes a significant portion of time. So we instead modify the seed
-      // so that each thread has a different seed. This has fewer statistical
-      // guarantees than by doing it properly, but is much faster
-      curand_init(
-          std::get<0>(seeds), offset, std::get<1>(seeds) + delta, &state);
-      // curand_init(std::get<0>(seeds) + (offset << 8) + std::get<1>(seeds), 0,
-      // 0, &state);
-      float4 rand = curand_uniform4(&state);
+      float4 rand = philox_uniform4(
+          std::get<0>(seeds), offset, std::get<1>(seeds) + delta);
       for (int kk = 0; kk < kSampled; kk++) {
         if (k_item_idx + kk < kBlockSizeK)
           s_delta[q_item_idx][k_item_idx + kk] *= (&rand.x)[kk] < p;
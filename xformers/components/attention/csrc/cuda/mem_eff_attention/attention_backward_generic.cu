@@ -1,26 +1,35 @@
+#include "../autotune.h"
+#include "../kernel_attributes.h"
+#include "../workspace_arena.h"
+#include "block_mask.h"
+#include "generated_bias.h"
 #include "kernel_backward.h"
+#include "kernel_stats.h"
+#include "rotary_embedding.h"
 
-#define DISPATCH_MAXK(func)                                   \
-  {                                                           \
-    const auto maxK = std::max(query.size(3), value.size(3)); \
-    if (maxK <= 64) {                                         \
-      constexpr int kMaxK = 64;                               \
-      func();                                                 \
-    } else if (maxK <= 128) {                                 \
-      constexpr int kMaxK = 128;                              \
-      func();                                                 \
-    } else {                                                  \
-      constexpr int kMaxK = std::numeric_limits<int>::max();  \
-      func();                                                 \
-    }                                                         \
-  }
-
-#define DISPATCH_KERNEL(QUERY, KEY, VALUE, FUNC)                               \
+// See `backward_variant_max_k`
+#define DISPATCH_MAXK(VARIANT, func)                         \
+  {                                                          \
+    if (VARIANT == 0) {                                      \
+      constexpr int kMaxK = 64;                              \
+      func();                                                \
+    } else if (VARIANT == 1) {                               \
+      constexpr int kMaxK = 128;                             \
+      func();                                                \
+    } else {                                                 \
+      constexpr int kMaxK = std::numeric_limits<int>::max(); \
+      func();                                                \
+    }                                                        \
+  }
+
+// The f16/bf16 Sm80 kernels for large head dims also have a variant with
+// less shared-memory (see `kSmallSmem`), for the GPUs where the default one
+// fits fewer blocks per SM than on the A100. The f32 Sm80 kernels have a
+// variant with TF32 math (see `kTF32`), used when PyTorch allows TF32 for
+// matmuls (`torch.backends.cuda.matmul.allow_tf32`)
+#define DISPATCH_KERNEL(QUERY, KEY, VALUE, VARIANT, FUNC)                      \
   {                                                                            \
-    cudaDeviceProp* properties =                                               \
-        at::cuda::getDeviceProperties(QUERY.device().index());                 \
-    const int computeCapability = properties->major * 10 + properties->minor;  \
-    DISPATCH_MAXK(([&] {                                                       \
+    DISPATCH_MAXK(VARIANT, ([&] {                                              \
       DISPATCH_TYPES(                                                          \
           QUERY, ([&]() {                                                      \
             DISPATCH_ARCHTAG(                                                  \
@@ -31,34 +40,174 @@
                       (QUERY.stride(2) % AlignedAK::kOptimalAlignement == 0 && \
                        KEY.stride(2) % AlignedAK::kOptimalAlignement == 0 &&   \
                        VALUE.stride(2) % AlignedAK::kOptimalAlignement == 0);  \
+                  constexpr bool kHasSmallSmem =                               \
+                      ArchTag::kMinComputeCapability >= 80 &&                  \
+                      AlignedAK::kIsHalf && kMaxK > 64;                        \
+                  bool useSmallSmem = kHasSmallSmem &&                         \
+                      use_small_smem_kernel(                                   \
+                          *properties,                                         \
+                          sizeof(typename AlignedAK::SharedStorage));          \
+                  constexpr bool kHasTF32 =                                    \
+                      ArchTag::kMinComputeCapability >= 80 &&                  \
+                      std::is_same<scalar_t, float>::value;                    \
+                  bool useTF32 =                                               \
+                      kHasTF32 && at::globalContext().allowTF32CuBLAS();       \
                   DISPATCH_BOOL(isAligned, kIsAligned, ([&]() {                \
-                                  using Kernel = AttentionBackwardKernel<      \
-                                      ArchTag,                                 \
-                                      scalar_t,                                \
-                                      kIsAligned,                              \
-                                      kMaxK>;                                  \
-                                  FUNC();                                      \
-                                }))                                            \
+                    DISPATCH_BOOL(useSmallSmem, kSmallSmem, ([&]() {           \
+                      DISPATCH_BOOL(useTF32, kTF32, ([&]() {                   \
+                        using Kernel = AttentionBackwardKernel<                \
+                            ArchTag,                                           \
+                            scalar_t,                                          \
+                            kIsAligned,                                        \
+                            kMaxK,                                             \
+                            kHasSmallSmem && kSmallSmem,                       \
+                            kHasTF32 && kTF32>;                                \
+                        FUNC();                                                \
+                      }))                                                      \
+                    }))                                                        \
+                  }))                                                          \
                 }))                                                            \
           }))                                                                  \
     }));                                                                       \
   }
 
 namespace {
+// The backward is compiled for several maximum head dims (`kMaxK`), which
+// select the block sizes and whether dK/dV are kept in registers. Any
+// variant with `kMaxK >= max(K, Kv)` can run the problem
+constexpr int kNumBackwardVariants = 3;
+int64_t backward_variant_max_k(int variant) {
+  return variant == 0 ? 64
+      : variant == 1  ? 128
+                      : std::numeric_limits<int64_t>::max();
+}
+
+// Computes `delta[b, h, m] = sum_k(grad_out[b, m, h, k] * out[b, m, h, k])`
+// for the kernels which don't compute it themselves (see
+// `kKernelComputesDelta`). The inputs are read once, in their dtype, with a
+// warp per row of `delta`
+template <typename scalar_t>
+__global__ void attention_backward_compute_delta(
+    const scalar_t* __restrict__ grad_out,
+    const scalar_t* __restrict__ out,
+    float* __restrict__ delta, // [B, H, M]
+    int64_t num_rows,
+    int32_t M,
+    int32_t H,
+    int32_t Kv,
+    int64_t gO_strideB,
+    int64_t gO_strideM,
+    int64_t gO_strideH,
+    int64_t o_strideB,
+    int64_t o_strideM,
+    int64_t o_strideH) {
+  constexpr int kWarpSize = 32;
+  int64_t row = int64_t(blockIdx.x) * (blockDim.x / kWarpSize) +
+      threadIdx.x / kWarpSize;
+  if (row >= num_rows) {
+    return;
+  }
+  int32_t lane = threadIdx.x % kWarpSize;
+  int64_t m = row % M;
+  int64_t h = (row / M) % H;
+  int64_t b = row / (int64_t(M) * H);
+  grad_out += b * gO_strideB + m * gO_strideM + h * gO_strideH;
+  out += b * o_strideB + m * o_strideM + h * o_strideH;
+
+  float sum = 0.0f;
+  for (int32_t k = lane; k < Kv; k += kWarpSize) {
+    sum += float(grad_out[k]) * float(out[k]);
+  }
+  for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+    sum += __shfl_xor_sync(0xffffffff, sum, offset);
+  }
+  if (lane == 0) {
+    delta[row] = sum;
+  }
+}
+
 std::tuple<at::Tensor, at::Tensor, at::Tensor>
 mem_efficient_attention_backward_cutlass(
     const at::Tensor& grad_out_,
-    const at::Tensor& query,
-    const at::Tensor& key,
+    const at::Tensor& query_,
+    const at::Tensor& key_,
     const at::Tensor& value,
     const at::Tensor& logsumexp,
     const at::Tensor& out,
-    bool causal) {
+    bool causal,
+    // [b, num_heads, seqlen_q, seqlen_k] - same as in the forward
+    const c10::optional<at::Tensor>& attn_bias,
+    // Dropout probability and RNG state returned by the forward
+    double dropout_p,
+    int64_t rng_seed,
+    int64_t rng_offset,
+    // (causal only) same as in the forward
+    const c10::optional<int64_t> window_size_,
+    // (Mode 1MHK only) same as in the forward
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    const c10::optional<int64_t> max_seqlen_q_,
+    // Same as in the forward. `query` and `key` are the inputs before the
+    // rotation, and so are the gradients returned
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    // Same as in the forward
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    // Number of blocks the queries of every (batch, kv head) are split
+    // across. Chosen automatically if not set
+    const c10::optional<int64_t> num_splits_query_,
+    // Guarantees bitwise identical gradients across runs with the same
+    // inputs (also enabled by `torch.use_deterministic_algorithms(True)`).
+    // The kernels never use atomics - the only reductions across blocks
+    // (dK/dV of the query splits) go through a workspace summed in a fixed
+    // order - so this only disables autotuning, whose choice of kernel
+    // depends on timings. The cost is the throughput lost when autotuning
+    // would have found a faster kernel
+    bool deterministic,
+    // Same as in the forward
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    // Same as in the forward
+    const c10::optional<double> scale_,
+    double softcap) {
 #ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
   TORCH_CHECK(
       false,
       "MemoryEfficient build has been disabled at build time with -DXFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD");
 #else
+  at::Tensor query = query_;
+  at::Tensor key = key_;
+  TORCH_CHECK(rope_cos.has_value() == rope_sin.has_value());
+  TORCH_CHECK(
+      rope_cos.has_value() ||
+          (!rope_positions_q.has_value() && !rope_positions_k.has_value()),
+      "rope_positions_q / rope_positions_k require rope_cos / rope_sin");
+  if (rope_cos.has_value()) {
+    TORCH_CHECK(query_.dim() == 4 && key_.dim() == 4);
+    TORCH_CHECK(
+        !cu_seqlens_q.has_value(), "RoPE is only supported in Mode BMHK");
+    check_rotary_embedding(
+        query_, key_, *rope_cos, *rope_sin, rope_positions_q, rope_positions_k);
+    // Recompute the rotated query and key rather than saving them: unlike
+    // the forward, the rotation can't be done as the tiles are loaded, as
+    // the rotated query and key are also the B operands of dK and dQ
+    query = at::empty(query_.sizes(), query_.options());
+    key = at::empty(key_.sizes(), key_.options());
+    at::cuda::CUDAGuard device_guard(query_.device());
+    apply_rotary_embedding_qk(
+        query_,
+        key_,
+        query,
+        key,
+        *rope_cos,
+        *rope_sin,
+        rope_positions_q,
+        rope_positions_k,
+        /*inverse=*/false);
+  }
   // ndim
   TORCH_CHECK(query.dim() == grad_out_.dim());
   TORCH_CHECK(query.dim() == key.dim());
@@ -74,9 +223,11 @@ mem_efficient_attention_backward_cutlass(
   TORCH_CHECK(key.size(1) == value.size(1));
   TORCH_CHECK(query.size(1) == grad_out_.size(1));
 
-  // Num heads
-  TORCH_CHECK(query.size(2) == key.size(2));
-  TORCH_CHECK(query.size(2) == value.size(2));
+  // Num heads - with MQA/GQA several query heads share the same key/value
+  TORCH_CHECK(key.size(2) == value.size(2));
+  TORCH_CHECK(
+      query.size(2) % key.size(2) == 0,
+      "number of query heads must be a multiple of the number of key/value heads");
   TORCH_CHECK(query.size(2) == grad_out_.size(2));
 
   // Embedding per head
@@ -91,6 +242,72 @@ mem_efficient_attention_backward_cutlass(
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(key);
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(value);
 
+  int64_t max_seqlen_q = query.size(1);
+  TORCH_CHECK(cu_seqlens_q.has_value() == cu_seqlens_k.has_value());
+  if (cu_seqlens_q.has_value()) {
+    TORCH_CHECK(cu_seqlens_q->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(cu_seqlens_k->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(cu_seqlens_q->dim() == 1 && cu_seqlens_k->dim() == 1);
+    CHECK_NOSPARSE_CONTIGUOUS_CUDA((*cu_seqlens_q));
+    CHECK_NOSPARSE_CONTIGUOUS_CUDA((*cu_seqlens_k));
+    TORCH_CHECK(cu_seqlens_q->size(0) == cu_seqlens_k->size(0));
+    TORCH_CHECK(query.size(0) == 1, "cu_seqlen only supports batch_size=1");
+    // Upper bound, see the forward
+    if (max_seqlen_q_.has_value()) {
+      TORCH_CHECK(*max_seqlen_q_ >= 0);
+      max_seqlen_q = std::min(*max_seqlen_q_, max_seqlen_q);
+    } else if (cu_seqlens_q->size(0) > 1) {
+      // Synchronizes with the host
+      max_seqlen_q = (cu_seqlens_q->slice(0, 1) - cu_seqlens_q->slice(0, 0, -1))
+                         .max()
+                         .item<int64_t>();
+    } else {
+      max_seqlen_q = 0;
+    }
+    TORCH_CHECK(
+        !attn_bias.has_value(), "attn_bias is not supported with cu_seqlens");
+    TORCH_CHECK(dropout_p == 0.0, "dropout is not supported with cu_seqlens");
+  }
+
+  if (attn_bias.has_value()) {
+    TORCH_CHECK(attn_bias->scalar_type() == query.scalar_type());
+    TORCH_CHECK(attn_bias->dim() == 4);
+    TORCH_CHECK(attn_bias->size(0) == query.size(0));
+    TORCH_CHECK(attn_bias->size(1) == query.size(2));
+    TORCH_CHECK(attn_bias->size(2) == query.size(1));
+    TORCH_CHECK(attn_bias->size(3) == key.size(1));
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*attn_bias));
+  }
+  check_generated_bias(query, alibi_slopes, rel_pos_bias);
+
+  int64_t window_size = 0;
+  if (window_size_.has_value()) {
+    window_size = *window_size_;
+    TORCH_CHECK(window_size > 0);
+    TORCH_CHECK(causal, "window_size requires causal=True");
+  }
+
+  const double scale =
+      scale_.value_or(1.0 / std::sqrt(double(query.size(3))));
+  TORCH_CHECK(softcap >= 0.0, "softcap should be positive (or 0 to disable)");
+
+  check_block_mask(
+      query, max_seqlen_q, key.size(1), block_mask, block_mask_size);
+  TORCH_CHECK(
+      !block_mask.has_value() ||
+          (!cu_seqlens_q.has_value() && window_size == 0),
+      "block_mask is not supported with cu_seqlens or window_size");
+
+  TORCH_CHECK(dropout_p >= 0.0 && dropout_p < 1.0);
+  const bool use_dropout = dropout_p != 0.0;
+  at::PhiloxCudaState rng_engine_inputs;
+  if (use_dropout) {
+    uint64_t seed, offset;
+    std::memcpy(&seed, &rng_seed, sizeof(seed));
+    std::memcpy(&offset, &rng_offset, sizeof(offset));
+    rng_engine_inputs = at::PhiloxCudaState(seed, offset);
+  }
+
   at::cuda::CUDAGuard device_guard(query.device());
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
@@ -100,15 +317,42 @@ mem_efficient_attention_backward_cutlass(
   int64_t nH = query.size(2);
   int64_t K = query.size(3);
 
-  // It does not make sense to use that in practice,
-  // but let's still make sure we are correct
-  // As we iterate through keys first, we skip
-  // keys with no query associated, so they are not
-  // initialized
-  bool grad_kv_needs_init = causal && N > M;
+  cudaDeviceProp* properties =
+      at::cuda::getDeviceProperties(query.device().index());
+  const int computeCapability = properties->major * 10 + properties->minor;
+
+  // A block processes all the queries of a (batch, kv head). When there are
+  // not enough of those to fill the GPU (eg small batches with long
+  // sequences), the queries are also split across blocks. Every split writes
+  // its partial dK/dV to its own slice of a workspace, which is reduced
+  // once the kernel is done - in a fixed order, without atomics
+  int64_t num_splits_query = 1;
+  if (num_splits_query_.has_value()) {
+    num_splits_query = *num_splits_query_;
+    TORCH_CHECK(num_splits_query >= 1);
+    if (max_seqlen_q == 0) {
+      num_splits_query = 1;
+    }
+  } else {
+    int64_t num_blocks = (cu_seqlens_q.has_value() ? cu_seqlens_q->size(0) - 1
+                                                   : B) *
+        key.size(2);
+    // Every split should still process a few blocks of queries
+    int64_t max_splits = std::min(max_seqlen_q / 256, int64_t(16));
+    if (num_blocks > 0 && num_blocks < properties->multiProcessorCount) {
+      num_splits_query = std::max(
+          std::min(
+              ceil_div(int64_t(properties->multiProcessorCount), num_blocks),
+              max_splits),
+          int64_t(1));
+    }
+  }
+
+  // dK/dV are fully written by the kernel, including the keys no query is
+  // associated with (see `zeroGradKV`), so they don't need to be initialized
   at::Tensor grad_q, grad_k, grad_v;
-  if (!grad_kv_needs_init && query.size(1) == key.size(1) &&
-      query.size(3) == value.size(3) &&
+  if (num_splits_query == 1 && query.size(1) == key.size(1) &&
+      query.size(2) == key.size(2) && query.size(3) == value.size(3) &&
       query.storage().is_alias_of(key.storage()) &&
       query.storage().is_alias_of(value.storage())) {
     // Create one big contiguous chunk
@@ -122,8 +366,26 @@ mem_efficient_attention_backward_cutlass(
     grad_v = chunk.select(2, 2);
   } else {
     grad_q = at::empty_like(query);
-    grad_k = grad_kv_needs_init ? at::zeros_like(key) : at::empty_like(key);
-    grad_v = grad_kv_needs_init ? at::zeros_like(value) : at::empty_like(value);
+    grad_k = at::empty_like(key);
+    grad_v = at::empty_like(value);
+  }
+  if (window_size > 0 || cu_seqlens_q.has_value() || block_mask.has_value()) {
+    // dQ is only overwritten by the first block of keys, which does not see
+    // the queries it is out of the window of (or sequences without keys, or
+    // the queries whose first block of keys is masked)
+    grad_q.zero_();
+  }
+
+  // Every block processes a whole sequence (for a given head): schedule the
+  // most expensive sequences first
+  at::Tensor batch_order;
+  if (cu_seqlens_q.has_value()) {
+    auto seqlens_q = (cu_seqlens_q->slice(0, 1) - cu_seqlens_q->slice(0, 0, -1))
+                         .to(at::kLong);
+    auto seqlens_k = (cu_seqlens_k->slice(0, 1) - cu_seqlens_k->slice(0, 0, -1))
+                         .to(at::kLong);
+    batch_order = std::get<1>((seqlens_q * seqlens_k).sort(0, true))
+                      .to(at::ScalarType::Int);
   }
 
   auto launchKernel = [&](auto _k, int computeCapability) {
@@ -133,14 +395,32 @@ mem_efficient_attention_backward_cutlass(
 
     size_t smem_bytes = sizeof(typename Kernel::SharedStorage);
 
-    // TODO: Fuse this into a kernel?
-    // This is a bottleneck for smaller sequences (M <= 128)
-    auto delta = Kernel::kKernelComputesDelta
-        ? at::empty({B, nH, M}, query.options().dtype(at::ScalarType::Float))
-        : (grad_out.to(at::kFloat) * out.to(at::kFloat))
-              .sum(-1)
-              .transpose(-2, -1)
-              .contiguous();
+    // Temporaries of this call, which are not returned
+    WorkspaceArena workspace = attention_workspace_arena(query.device());
+    auto delta = workspace.empty(
+        {B, nH, M}, query.options().dtype(at::ScalarType::Float));
+    if (!Kernel::kKernelComputesDelta && delta.numel() > 0) {
+      constexpr int kRowsPerBlock = 4;
+      attention_backward_compute_delta<scalar_t>
+          <<<ceil_div(delta.numel(), int64_t(kRowsPerBlock)),
+             kRowsPerBlock * 32,
+             0,
+             stream>>>(
+              (const scalar_t*)grad_out.data_ptr(),
+              (const scalar_t*)out.data_ptr(),
+              (float*)delta.data_ptr(),
+              delta.numel(),
+              int32_t(M),
+              int32_t(nH),
+              int32_t(out.size(3)),
+              grad_out.stride(0),
+              grad_out.stride(1),
+              grad_out.stride(2),
+              out.stride(0),
+              out.stride(1),
+              out.stride(2));
+      AT_CUDA_CHECK(cudaGetLastError());
+    }
     TORCH_INTERNAL_ASSERT(delta.size(0) == B);
     TORCH_INTERNAL_ASSERT(delta.size(1) == nH);
     TORCH_INTERNAL_ASSERT(delta.size(2) == M);
@@ -158,11 +438,26 @@ mem_efficient_attention_backward_cutlass(
     p.delta_ptr = (float*)delta.data_ptr();
     p.head_dim = query.size(3);
     p.head_dim_value = value.size(3);
-    p.num_queries = query.size(1);
+    p.num_queries = max_seqlen_q;
     p.num_keys = key.size(1);
-    p.num_batches = B;
+    p.num_batches = cu_seqlens_q.has_value() ? cu_seqlens_q->size(0) - 1 : B;
+    if (cu_seqlens_q.has_value()) {
+      p.cu_seqlens_q_ptr = (int32_t*)cu_seqlens_q->data_ptr();
+      p.cu_seqlens_k_ptr = (int32_t*)cu_seqlens_k->data_ptr();
+      p.batch_order_ptr = (int32_t*)batch_order.data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.total_keys, key.size(1));
+    }
     p.num_heads = nH;
+    p.num_kv_heads = key.size(2);
     p.causal = causal;
+    ASSIGN_CHECK_OVERFLOW(p.window_size, window_size);
+    p.scale = scale;
+    p.softcap = softcap;
+    p.use_dropout = use_dropout;
+    if (use_dropout) {
+      p.dropout_prob = dropout_p;
+      p.rng_engine_inputs = rng_engine_inputs;
+    }
 
     ASSIGN_CHECK_OVERFLOW(p.gO_strideB, grad_out.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.gO_strideM, grad_out.stride(1));
@@ -171,6 +466,11 @@ mem_efficient_attention_backward_cutlass(
     ASSIGN_CHECK_OVERFLOW(p.o_strideB, out.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.o_strideH, out.stride(2));
 
+    ASSIGN_CHECK_OVERFLOW(p.lse_strideB, logsumexp.stride(0));
+    ASSIGN_CHECK_OVERFLOW(p.lse_strideH, logsumexp.stride(1));
+    ASSIGN_CHECK_OVERFLOW(p.delta_strideB, delta.stride(0));
+    ASSIGN_CHECK_OVERFLOW(p.delta_strideH, delta.stride(1));
+
     ASSIGN_CHECK_OVERFLOW(p.gQ_strideB, grad_q.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.gK_strideB, grad_k.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.gV_strideB, grad_v.stride(0));
@@ -182,6 +482,35 @@ mem_efficient_attention_backward_cutlass(
     TORCH_INTERNAL_ASSERT(p.gK_strideM() == grad_k.stride(1));
     TORCH_INTERNAL_ASSERT(p.gV_strideM() == grad_v.stride(1));
 
+    at::Tensor grad_k_split, grad_v_split;
+    if (num_splits_query > 1) {
+      // The partial dK/dV are kept in f32, and only rounded once reduced
+      grad_k_split = workspace.empty(
+          {num_splits_query, B, N, key.size(2), K},
+          grad_k.options().dtype(at::kFloat));
+      grad_v_split = workspace.empty(
+          {num_splits_query, B, N, value.size(2), value.size(3)},
+          grad_v.options().dtype(at::kFloat));
+      p.grad_key_split_ptr = (float*)grad_k_split.data_ptr();
+      p.grad_value_split_ptr = (float*)grad_v_split.data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.gK_strideSplit, grad_k_split.stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.gV_strideSplit, grad_v_split.stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.gK_strideB, grad_k_split.stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.gV_strideB, grad_v_split.stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.gK_strideH, grad_k_split.stride(3));
+      ASSIGN_CHECK_OVERFLOW(p.gV_strideH, grad_v_split.stride(3));
+      TORCH_INTERNAL_ASSERT(p.gK_strideM() == grad_k_split.stride(2));
+      TORCH_INTERNAL_ASSERT(p.gV_strideM() == grad_v_split.stride(2));
+      // Round up to whole blocks of queries
+      int64_t queries_per_split =
+          ceil_div(ceil_div(max_seqlen_q, num_splits_query),
+                   int64_t(Kernel::kBlockSizeI)) *
+          Kernel::kBlockSizeI;
+      ASSIGN_CHECK_OVERFLOW(p.queries_per_split, queries_per_split);
+      ASSIGN_CHECK_OVERFLOW(
+          p.num_splits_query, ceil_div(max_seqlen_q, queries_per_split));
+    }
+
     ASSIGN_CHECK_OVERFLOW(p.q_strideB, query.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.k_strideB, key.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.v_strideB, value.stride(0));
@@ -192,6 +521,29 @@ mem_efficient_attention_backward_cutlass(
     ASSIGN_CHECK_OVERFLOW(p.k_strideH, key.stride(2));
     ASSIGN_CHECK_OVERFLOW(p.v_strideH, value.stride(2));
 
+    if (attn_bias.has_value()) {
+      p.attn_bias_ptr = (scalar_t*)attn_bias->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideB, attn_bias->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideH, attn_bias->stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideM, attn_bias->stride(2));
+    }
+    if (alibi_slopes.has_value()) {
+      p.alibi_slopes_ptr = (float*)alibi_slopes->data_ptr();
+    }
+    if (rel_pos_bias.has_value()) {
+      p.rel_pos_bias_ptr = (float*)rel_pos_bias->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(
+          p.rel_pos_max_distance, (rel_pos_bias->size(1) - 1) / 2);
+      ASSIGN_CHECK_OVERFLOW(p.rel_pos_bias_strideH, rel_pos_bias->stride(0));
+    }
+    if (block_mask.has_value()) {
+      p.block_mask_ptr = (uint8_t*)block_mask->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_size, block_mask_size);
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideB, block_mask->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideH, block_mask->stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideM, block_mask->stride(2));
+    }
+
     Kernel::check_supported(p);
 
     constexpr auto kernel_fn = attention_kernel_backward_batched<Kernel>;
@@ -200,36 +552,112 @@ mem_efficient_attention_backward_cutlass(
       TORCH_INTERNAL_ASSERT(
           computeCapability >= 70,
           "This kernel requires too much shared memory on this machine!");
-      cudaFuncSetAttribute(
-          kernel_fn, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_bytes);
+      KernelAttributes<Kernel>::set_max_dynamic_smem(
+          kernel_fn, query.device().index(), smem_bytes);
     }
-
-    // second syntax resulted in the error below on windows
-    // error C3495: 'kernel_fn': a simple capture must be a variable
-    // with automatic storage duration declared
-    // in the reaching scope of the lambda
-#ifdef _WIN32
-    cudaFuncAttributes attr;
-    AT_CUDA_CHECK(cudaFuncGetAttributes(&attr, kernel_fn));
     TORCH_INTERNAL_ASSERT(
-        attr.binaryVersion >= Kernel::ArchTag::kMinComputeCapability,
+        KernelAttributes<Kernel>::binary_version(
+            kernel_fn, query.device().index()) >=
+            Kernel::ArchTag::kMinComputeCapability,
         "Something went wrong in the build process");
-#else
-    auto checkBinaryArchMatches = [&]() {
-      cudaFuncAttributes attr;
-      AT_CUDA_CHECK(cudaFuncGetAttributes(&attr, kernel_fn));
-      return attr.binaryVersion >= Kernel::ArchTag::kMinComputeCapability;
-    };
-    TORCH_INTERNAL_ASSERT(
-        checkBinaryArchMatches(), "Something went wrong in the build process");
-#endif
 
     kernel_fn<<<p.getBlocksGrid(), p.getThreadsGrid(), smem_bytes, stream>>>(p);
-  };
 
-  DISPATCH_KERNEL(
-      query, key, value, ([&] { launchKernel(Kernel{}, computeCapability); }));
+    if (num_splits_query > 1) {
+      AT_CUDA_CHECK(cudaGetLastError());
+      grad_k.copy_(grad_k_split.sum(0, /*keepdim=*/false, at::kFloat));
+      grad_v.copy_(grad_v_split.sum(0, /*keepdim=*/false, at::kFloat));
+    }
+  };
+  const int64_t maxK = std::max(query.size(3), value.size(3));
+  auto runVariant = [&](int variant, bool record_stats) {
+    TORCH_CHECK(
+        maxK <= backward_variant_max_k(variant),
+        "kernel variant not supported for this input");
+    DISPATCH_KERNEL(query, key, value, variant, ([&] {
+                      static const std::string kKernelName =
+                          std::string("cutlassB_") +
+                          attention_dtype_name<scalar_t>() +
+                          (kIsAligned ? "_aligned_" : "_notaligned_") +
+                          (kMaxK == std::numeric_limits<int>::max()
+                               ? std::string("kany")
+                               : "k" + std::to_string(kMaxK)) +
+                          "_sm" +
+                          std::to_string(ArchTag::kMinComputeCapability) +
+                          (Kernel::kSmallSmem ? "_smallsmem" : "") +
+                          (Kernel::kTF32 ? "_tf32" : "");
+                      if (record_stats) {
+                        std::vector<const char*> fallbacks;
+                        if (!kIsAligned) {
+                          fallbacks.push_back(attention_unaligned_tensor(
+                              query,
+                              key,
+                              value,
+                              AlignedAK::kOptimalAlignement,
+                              AlignedAK::kOptimalAlignement,
+                              AlignedAK::kOptimalAlignement));
+                        }
+                        if (!Kernel::kOutputInRF) {
+                          // dK/dV do not fit in registers
+                          fallbacks.push_back("grad_kv_in_gmem");
+                        }
+                        if (!Kernel::kKernelComputesDelta) {
+                          fallbacks.push_back("delta_computed_outside_kernel");
+                        }
+                        record_attention_kernel(
+                            "cutlassB", kKernelName, fallbacks);
+                      }
+                      RECORD_FUNCTION(
+                          kKernelName, std::vector<c10::IValue>());
+                      launchKernel(Kernel{}, computeCapability);
+                    }));
+  };
+  int variant = 0;
+  while (maxK > backward_variant_max_k(variant)) {
+    ++variant;
+  }
+  deterministic =
+      deterministic || at::globalContext().deterministicAlgorithms();
+  auto& autotuner = AttentionAutotuner::get();
+  if (autotuner.enabled() && !deterministic) {
+    variant = autotuner.select(
+        make_autotune_key(
+            "bwd",
+            computeCapability,
+            query.scalar_type(),
+            K,
+            value.size(3),
+            causal,
+            autotune_bucket(M),
+            autotune_bucket(N)),
+        kNumBackwardVariants,
+        variant,
+        [&](int candidate) {
+          // dQ is accumulated in place
+          grad_q.zero_();
+          runVariant(candidate, false);
+        });
+    // Initialize dQ again, as the benchmark runs wrote to it
+    if (window_size > 0 || cu_seqlens_q.has_value() ||
+        block_mask.has_value()) {
+      grad_q.zero_();
+    }
+  }
+  runVariant(variant, true);
   AT_CUDA_CHECK(cudaGetLastError());
+  if (rope_cos.has_value()) {
+    // Back-propagate through the rotation, in place
+    apply_rotary_embedding_qk(
+        grad_q,
+        grad_k,
+        grad_q,
+        grad_k,
+        *rope_cos,
+        *rope_sin,
+        rope_positions_q,
+        rope_positions_k,
+        /*inverse=*/true);
+  }
   return std::make_tuple(grad_q, grad_k, grad_v);
 #endif
 } // namespace
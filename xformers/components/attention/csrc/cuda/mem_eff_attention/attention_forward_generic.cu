@@ -1,42 +1,75 @@
+#include "../../kv_cache_quantization.h"
+#include "../autotune.h"
+#include "../kernel_attributes.h"
+#include "../workspace_arena.h"
+#include "block_mask.h"
+#include "generated_bias.h"
+#include "kernel_decode.h"
 #include "kernel_forward.h"
+#include "kernel_stats.h"
+#include "rotary_embedding.h"
 
-#define DISPATCH_BLOCKSIZE(VALUE_HEAD_DIM, FN)        \
-  {                                                   \
-    if (VALUE_HEAD_DIM <= 64) {                       \
-      constexpr bool kIs64x64 = true;                 \
-      constexpr bool kSingleValueIteration = true;    \
-      FN();                                           \
-    } else {                                          \
-      constexpr bool kIs64x64 = false;                \
-      if (VALUE_HEAD_DIM <= 128) {                    \
-        constexpr bool kSingleValueIteration = true;  \
-        FN();                                         \
-      } else {                                        \
-        constexpr bool kSingleValueIteration = false; \
-        FN();                                         \
-      }                                               \
-    }                                                 \
-  }
-
-#define DISPATCH_KERNEL(QUERY, KEY, VALUE, FUNC)                              \
+// See `ForwardVariant`
+#define DISPATCH_BLOCKSIZE(VARIANT, FN)                  \
+  {                                                      \
+    if (VARIANT == kForward64x64) {                      \
+      constexpr int64_t kQueriesPerBlock = 64;           \
+      constexpr int64_t kKeysPerBlock = 64;              \
+      constexpr bool kSingleValueIteration = true;       \
+      FN();                                              \
+    } else if (VARIANT == kForward32x128) {              \
+      constexpr int64_t kQueriesPerBlock = 32;           \
+      constexpr int64_t kKeysPerBlock = 128;             \
+      constexpr bool kSingleValueIteration = true;       \
+      FN();                                              \
+    } else if (VARIANT == kForward32x256) {              \
+      constexpr int64_t kQueriesPerBlock = 32;           \
+      constexpr int64_t kKeysPerBlock = 256;             \
+      constexpr bool kSingleValueIteration = true;       \
+      FN();                                              \
+    } else if (VARIANT == kForward128x32) {              \
+      constexpr int64_t kQueriesPerBlock = 128;          \
+      constexpr int64_t kKeysPerBlock = 32;              \
+      constexpr bool kSingleValueIteration = true;       \
+      FN();                                              \
+    } else {                                             \
+      constexpr int64_t kQueriesPerBlock = 32;           \
+      constexpr int64_t kKeysPerBlock = 128;             \
+      constexpr bool kSingleValueIteration = false;      \
+      FN();                                              \
+    }                                                    \
+  }
+
+// The 32x256 blocks are only compiled for f16/bf16 on Sm80 (see
+// `supports_k256`): the other combinations are never selected, and use the
+// 32x128 kernels at compile time to not reference kernels which don't exist.
+// The f16/bf16 Sm80 kernels with 32x256 blocks also have a variant with
+// less shared-memory (see `kSmallSmem`), for the GPUs where the default one
+// fits fewer blocks per SM than on the A100. The f32 Sm80 kernels have a
+// variant with TF32 math (see `kTF32`), used when PyTorch allows TF32 for
+// matmuls (`torch.backends.cuda.matmul.allow_tf32`)
+#define DISPATCH_KERNEL(QUERY, KEY, VALUE, VARIANT, FUNC)                     \
   {                                                                           \
-    cudaDeviceProp* properties =                                              \
-        at::cuda::getDeviceProperties(QUERY.device().index());                \
-    const int computeCapability = properties->major * 10 + properties->minor; \
     DISPATCH_BLOCKSIZE(                                                       \
-        VALUE.size(-1), ([&]() {                                              \
-          static constexpr int64_t kQueriesPerBlock = kIs64x64 ? 64 : 32;     \
-          static constexpr int64_t kKeysPerBlock = kIs64x64 ? 64 : 128;       \
+        VARIANT, ([&]() {                                                     \
           DISPATCH_TYPES(                                                     \
               QUERY, ([&]() {                                                 \
                 DISPATCH_ARCHTAG(                                             \
                     computeCapability, ([&]() {                               \
+                      constexpr bool kHasK256 =                               \
+                          ArchTag::kMinComputeCapability >= 80 &&             \
+                          cutlass::sizeof_bits<scalar_t>::value == 16;        \
+                      TORCH_INTERNAL_ASSERT(                                  \
+                          kKeysPerBlock != 256 || kHasK256);                  \
+                      constexpr int64_t kDispatchedKeysPerBlock =             \
+                          kKeysPerBlock == 256 && !kHasK256 ? 128             \
+                                                            : kKeysPerBlock;  \
                       using AlignedAK = AttentionKernel<                      \
                           scalar_t,                                           \
                           ArchTag,                                            \
                           true,                                               \
                           kQueriesPerBlock,                                   \
-                          kKeysPerBlock,                                      \
+                          kDispatchedKeysPerBlock,                            \
                           kSingleValueIteration>;                             \
                       /* Run a more efficient kernel (with `isAligned=True`)  \
                       if memory is correctly aligned*/                        \
@@ -44,33 +77,387 @@
                           (QUERY.stride(2) % AlignedAK::kAlignmentQ == 0 &&   \
                            KEY.stride(2) % AlignedAK::kAlignmentK == 0 &&     \
                            VALUE.stride(2) % AlignedAK::kAlignmentV == 0);    \
-                      /* TODO: Should we warn or log somewhere when we use a  \
-                      less efficient kernel due to wrong alignment? */        \
+                      constexpr bool kHasSmallSmem =                          \
+                          ArchTag::kMinComputeCapability >= 80 &&             \
+                          cutlass::sizeof_bits<scalar_t>::value == 16 &&      \
+                          kKeysPerBlock == 256;                               \
+                      bool useSmallSmem = kHasSmallSmem &&                    \
+                          use_small_smem_kernel(                              \
+                              *properties,                                    \
+                              sizeof(typename AlignedAK::SharedStorage));     \
+                      constexpr bool kHasTF32 =                               \
+                          ArchTag::kMinComputeCapability >= 80 &&             \
+                          std::is_same<scalar_t, float>::value &&             \
+                          kKeysPerBlock != 256;                               \
+                      bool useTF32 =                                          \
+                          kHasTF32 && at::globalContext().allowTF32CuBLAS();  \
+                      /* The fallbacks are recorded in the kernel stats */    \
                       DISPATCH_BOOL(isAligned, kIsAligned, ([&]() {           \
-                                      using Kernel = AttentionKernel<         \
-                                          scalar_t,                           \
-                                          ArchTag,                            \
-                                          kIsAligned,                         \
-                                          kQueriesPerBlock,                   \
-                                          kKeysPerBlock,                      \
-                                          kSingleValueIteration>;             \
-                                      FUNC();                                 \
-                                    }))                                       \
+                        DISPATCH_BOOL(useSmallSmem, kSmallSmem, ([&]() {      \
+                          DISPATCH_BOOL(useTF32, kTF32, ([&]() {              \
+                            using Kernel = AttentionKernel<                   \
+                                scalar_t,                                     \
+                                ArchTag,                                      \
+                                kIsAligned,                                   \
+                                kQueriesPerBlock,                             \
+                                kDispatchedKeysPerBlock,                      \
+                                kSingleValueIteration,                        \
+                                false,                                        \
+                                kHasSmallSmem && kSmallSmem,                  \
+                                kHasTF32 && kTF32>;                           \
+                            FUNC();                                           \
+                          }))                                                 \
+                        }))                                                   \
+                      }))                                                     \
                     }))                                                       \
               }));                                                            \
         }));                                                                  \
   }
 
+// int8 query/key (see `kQuantizedQK`): aligned Sm80 kernels only, for the
+// datatype of `VALUE` (f16/bf16)
+#define DISPATCH_QUANTIZED_QK_KERNEL(VALUE, VARIANT, FUNC)                    \
+  {                                                                           \
+    DISPATCH_BLOCKSIZE(                                                       \
+        VARIANT, ([&]() {                                                     \
+          using ArchTag = cutlass::arch::Sm80;                                \
+          auto dispatchKernel = [&](auto _scalar) {                           \
+            using scalar_t = decltype(_scalar);                               \
+            using Kernel = AttentionKernel<                                   \
+                scalar_t,                                                     \
+                ArchTag,                                                      \
+                true,                                                         \
+                kQueriesPerBlock,                                             \
+                kKeysPerBlock,                                                \
+                kSingleValueIteration,                                        \
+                true>;                                                        \
+            FUNC();                                                           \
+          };                                                                  \
+          if (VALUE.scalar_type() == at::ScalarType::Half) {                  \
+            _DISPATCH_TYPE_F16(([&]() { dispatchKernel(scalar_t{}); }));      \
+          } else {                                                            \
+            _DISPATCH_TYPE_BF16(([&]() { dispatchKernel(scalar_t{}); }));     \
+          }                                                                   \
+        }));                                                                  \
+  }
+
+// RoPE on the query/key (see `kRotaryQK`): aligned Sm80 kernels only, for the
+// datatype of `QUERY` (f16/bf16)
+#define DISPATCH_ROTARY_QK_KERNEL(QUERY, VARIANT, FUNC)                       \
+  {                                                                           \
+    DISPATCH_BLOCKSIZE(                                                       \
+        VARIANT, ([&]() {                                                     \
+          using ArchTag = cutlass::arch::Sm80;                                \
+          auto dispatchKernel = [&](auto _scalar) {                           \
+            using scalar_t = decltype(_scalar);                               \
+            using Kernel = AttentionKernel<                                   \
+                scalar_t,                                                     \
+                ArchTag,                                                      \
+                true,                                                         \
+                kQueriesPerBlock,                                             \
+                kKeysPerBlock,                                                \
+                kSingleValueIteration,                                        \
+                false,                                                        \
+                false,                                                        \
+                false,                                                        \
+                true>;                                                        \
+            FUNC();                                                           \
+          };                                                                  \
+          if (QUERY.scalar_type() == at::ScalarType::Half) {                  \
+            _DISPATCH_TYPE_F16(([&]() { dispatchKernel(scalar_t{}); }));      \
+          } else {                                                            \
+            _DISPATCH_TYPE_BF16(([&]() { dispatchKernel(scalar_t{}); }));     \
+          }                                                                   \
+        }));                                                                  \
+  }
+
 namespace {
+// Longest queries for which the keys are split automatically (split-KV)
+constexpr int64_t kMaxAutoSplitKeyQueries = 256;
+
+// Tile shapes compiled for the forward. With `kSingleValueIteration`, the
+// output is kept in registers, which requires the value head dim to fit in a
+// single block of keys: head dims above 128 use 32x256 blocks on Sm80+ for
+// f16/bf16, where there is enough shared-memory for them, and iterate over
+// the value otherwise.
+// Small head dims (<= 32, eg ViTs or speech models) would leave most of the
+// 64 columns of the second matmul empty with 64x64 blocks: 128x32 blocks fill
+// them, and load every block of keys/values once for twice as many queries.
+// New variants go at the end, as the autotuner caches their index
+enum ForwardVariant {
+  kForward64x64 = 0,
+  kForward32x128,
+  kForward32x256,
+  kForward32x128IterateValue,
+  kForward128x32,
+  kNumForwardVariants,
+};
+
+bool forward_variant_supported(
+    int variant,
+    int64_t value_head_dim,
+    bool supports_k256) {
+  switch (variant) {
+    case kForward64x64:
+      return value_head_dim <= 64;
+    case kForward32x128:
+      return value_head_dim <= 128;
+    case kForward32x256:
+      return value_head_dim <= 256 && supports_k256;
+    case kForward128x32:
+      return value_head_dim <= 32;
+    default:
+      return true;
+  }
+}
+
+// Maximum `query_tiles_per_block` of the short-keys kernels - see the
+// forward's Params
+constexpr int64_t kMaxQueryTilesPerBlock = 8;
+
+// The first supported variant is the default one, except for small head dims
+// with enough queries to fill 128x32 blocks
+int default_forward_variant(
+    int64_t value_head_dim,
+    bool supports_k256,
+    int64_t max_seqlen_q) {
+  if (max_seqlen_q >= 128 && value_head_dim <= 32) {
+    return kForward128x32;
+  }
+  int variant = 0;
+  while (
+      !forward_variant_supported(variant, value_head_dim, supports_k256)) {
+    ++variant;
+  }
+  return variant;
+}
+
+// Reduces the partial outputs of the split-KV forward. Every split has
+// its own output normalized over its keys, and the matching logsumexp, so:
+// out = sum_s(exp(lse_s - lse) * out_s) with lse = logsumexp_s(lse_s)
+template <typename scalar_t>
+__global__ void attention_split_key_reduce(
+    const scalar_t* __restrict__ partial_out, // [num_splits, B, M, H, Kv]
+    const float* __restrict__ partial_lse, // [num_splits, B, H, lse_dim]
+    scalar_t* __restrict__ out, // [B, M, H, Kv] - can be strided
+    float* __restrict__ lse, // [B, H, lse_dim] - can be null
+    int32_t num_splits,
+    int32_t M,
+    int32_t H,
+    int32_t Kv,
+    int32_t lse_dim,
+    int64_t out_split_stride,
+    int64_t lse_split_stride,
+    int64_t out_strideB,
+    int64_t out_strideM,
+    int64_t out_strideH) {
+  // One block per row of the output
+  int64_t row = blockIdx.x;
+  int64_t b = row / (M * H);
+  int64_t m = (row / H) % M;
+  int64_t h = row % H;
+  int64_t lse_idx = (b * H + h) * lse_dim + m;
+
+  float lse_max = -std::numeric_limits<float>::infinity();
+  for (int32_t s = 0; s < num_splits; ++s) {
+    lse_max = fmaxf(lse_max, partial_lse[s * lse_split_stride + lse_idx]);
+  }
+  if (lse_max == -std::numeric_limits<float>::infinity()) {
+    // Every split was empty (eg all the keys are masked)
+    for (int32_t k = threadIdx.x; k < Kv; k += blockDim.x) {
+      out[b * out_strideB + m * out_strideM + h * out_strideH + k] =
+          scalar_t(0);
+    }
+    if (lse != nullptr && threadIdx.x == 0) {
+      lse[lse_idx] = lse_max;
+    }
+    return;
+  }
+  float sum_weights = 0;
+  for (int32_t s = 0; s < num_splits; ++s) {
+    sum_weights += expf(partial_lse[s * lse_split_stride + lse_idx] - lse_max);
+  }
+
+  for (int32_t k = threadIdx.x; k < Kv; k += blockDim.x) {
+    float acc = 0;
+    for (int32_t s = 0; s < num_splits; ++s) {
+      float split_lse = partial_lse[s * lse_split_stride + lse_idx];
+      // Empty splits did not write their output
+      if (split_lse != -std::numeric_limits<float>::infinity()) {
+        acc += expf(split_lse - lse_max) *
+            float(partial_out[s * out_split_stride + row * Kv + k]);
+      }
+    }
+    out[b * out_strideB + m * out_strideM + h * out_strideH + k] =
+        scalar_t(acc / sum_weights);
+  }
+  if (lse != nullptr && threadIdx.x == 0) {
+    lse[lse_idx] = lse_max + logf(sum_weights);
+  }
+}
+
+// (Mode 1MHK only) Length of the longest sequence. Synchronizes with the host
+int64_t max_seqlen_from_cu_seqlens(const at::Tensor& cu_seqlens) {
+  if (cu_seqlens.size(0) < 2) {
+    return 0;
+  }
+  return (cu_seqlens.slice(0, 1) - cu_seqlens.slice(0, 0, -1))
+      .max()
+      .item<int64_t>();
+}
+
+// (Mode 1MHK only) Builds the work queue of the persistent scheduler: one
+// `[batch_id, query_tile]` item per block of queries of every sequence,
+// sorted by decreasing number of keys to visit, so that the most expensive
+// tiles are scheduled first. The number of tiles is only known on the device,
+// so the queue is sized with an upper bound and padded with `batch_id = -1`
+at::Tensor build_varlen_work_queue(
+    const at::Tensor& cu_seqlens_q,
+    const at::Tensor& cu_seqlens_k,
+    int64_t total_q,
+    int64_t max_seqlen_q,
+    int64_t queries_per_block,
+    bool causal) {
+  int64_t num_seqs = cu_seqlens_q.size(0) - 1;
+  int64_t num_work_tiles = std::min(
+      ceil_div(total_q, queries_per_block) + num_seqs,
+      num_seqs * ceil_div(max_seqlen_q, queries_per_block));
+  if (num_work_tiles <= 0) {
+    return at::full({1, 2}, -1, cu_seqlens_q.options());
+  }
+  auto seqlens_q = (cu_seqlens_q.slice(0, 1) - cu_seqlens_q.slice(0, 0, -1))
+                       .to(at::kLong);
+  auto seqlens_k = (cu_seqlens_k.slice(0, 1) - cu_seqlens_k.slice(0, 0, -1))
+                       .to(at::kLong);
+  auto tiles_per_seq = at::floor_divide(
+      seqlens_q + (queries_per_block - 1), queries_per_block);
+  auto tiles_cumsum = tiles_per_seq.cumsum(0);
+
+  // Tile `i` belongs to the first sequence with `tiles_cumsum > i`
+  auto slot = at::arange(num_work_tiles, seqlens_q.options());
+  auto batch_id = at::searchsorted(
+      tiles_cumsum, slot, /*out_int32=*/false, /*right=*/true);
+  auto valid = batch_id < num_seqs;
+  batch_id = batch_id.clamp_max(num_seqs - 1);
+  auto query_tile = slot - tiles_cumsum.index({batch_id}) +
+      tiles_per_seq.index({batch_id});
+
+  // Cost estimate: number of keys visited by the tile
+  auto cost = seqlens_k.index({batch_id});
+  if (causal) {
+    cost = at::minimum(
+        cost,
+        at::minimum(
+            (query_tile + 1) * queries_per_block, seqlens_q.index({batch_id})));
+  }
+  cost = at::where(valid, cost, at::full_like(cost, -1));
+  batch_id = at::where(valid, batch_id, at::full_like(batch_id, -1));
+
+  auto order = std::get<1>(cost.sort(/*dim=*/0, /*descending=*/true));
+  return at::stack({batch_id, query_tile}, 1)
+      .index({order})
+      .to(at::kInt)
+      .contiguous();
+}
+
+// Marks the memory of K/V as persisting in the L2 for the kernels launched
+// on `stream` in its scope (sm80+), so that the hot part of a KV-cache can
+// stay in the L2 across the kernels of consecutive layers. The window spans
+// both tensors when they are close enough (eg a single KV buffer), or only
+// the key otherwise. The previous policy of the stream is restored after the
+// launches, and the L2 set-aside for persisting accesses is reserved the
+// first time if the application did not configure it
+class ScopedL2PersistingWindow {
+ public:
+  ScopedL2PersistingWindow(
+      cudaStream_t stream,
+      const cudaDeviceProp& properties,
+      const at::Tensor& key,
+      const at::Tensor& value)
+      : stream_(stream) {
+    cudaStreamCaptureStatus capture_status;
+    AT_CUDA_CHECK(cudaStreamIsCapturing(stream, &capture_status));
+    if (properties.persistingL2CacheMaxSize <= 0 ||
+        properties.accessPolicyMaxWindowSize <= 0 ||
+        capture_status != cudaStreamCaptureStatusNone || key.numel() == 0) {
+      return;
+    }
+    size_t set_aside = 0;
+    AT_CUDA_CHECK(
+        cudaDeviceGetLimit(&set_aside, cudaLimitPersistingL2CacheSize));
+    if (set_aside == 0) {
+      set_aside = properties.persistingL2CacheMaxSize;
+      AT_CUDA_CHECK(
+          cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, set_aside));
+    }
+
+    uintptr_t begin = uintptr_t(key.data_ptr());
+    uintptr_t end = begin + storage_span_bytes(key);
+    if (value.numel() > 0) {
+      uintptr_t v_begin = uintptr_t(value.data_ptr());
+      uintptr_t v_end = v_begin + storage_span_bytes(value);
+      if (std::max(end, v_end) - std::min(begin, v_begin) <=
+          size_t(properties.accessPolicyMaxWindowSize)) {
+        begin = std::min(begin, v_begin);
+        end = std::max(end, v_end);
+      }
+    }
+    size_t num_bytes = std::min(
+        size_t(end - begin), size_t(properties.accessPolicyMaxWindowSize));
+
+    AT_CUDA_CHECK(cudaStreamGetAttribute(
+        stream, cudaStreamAttributeAccessPolicyWindow, &previous_));
+    cudaStreamAttrValue attr = {};
+    attr.accessPolicyWindow.base_ptr = reinterpret_cast<void*>(begin);
+    attr.accessPolicyWindow.num_bytes = num_bytes;
+    // Only the part of the window that fits in the set-aside persists
+    attr.accessPolicyWindow.hitRatio =
+        std::min(1.0f, float(set_aside) / float(num_bytes));
+    attr.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+    attr.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+    AT_CUDA_CHECK(cudaStreamSetAttribute(
+        stream, cudaStreamAttributeAccessPolicyWindow, &attr));
+    active_ = true;
+  }
+
+  ~ScopedL2PersistingWindow() {
+    if (active_) {
+      C10_CUDA_CHECK_WARN(cudaStreamSetAttribute(
+          stream_, cudaStreamAttributeAccessPolicyWindow, &previous_));
+    }
+  }
+
+  bool active() const {
+    return active_;
+  }
+
+ private:
+  static size_t storage_span_bytes(const at::Tensor& t) {
+    int64_t span = 1;
+    for (int64_t d = 0; d < t.dim(); ++d) {
+      span += (t.size(d) - 1) * t.stride(d);
+    }
+    return size_t(span) * t.element_size();
+  }
+
+  cudaStream_t stream_;
+  cudaStreamAttrValue previous_ = {};
+  bool active_ = false;
+};
+
 /*
-  There are 2 modes for using this function.
+  There are 3 modes for using this function.
   (Mode BMHK) With all the heads having the same seqlen
   (Mode 1MHK) `batch=1` with all tokens across batches concatenated
+  (Mode paged) `key` and `value` are a pool of pages
+    [num_pages, page_size, num_heads, K], and `block_tables` gives the pages
+    used by every sequence of the batch
 */
-std::tuple<at::Tensor, at::Tensor> efficient_attention_forward_cutlass(
-    const at::Tensor& query, // [b, seqlen, num_heads, K]
-    const at::Tensor& key, // [b, seqlen, num_heads, K]
-    const at::Tensor& value, // [b, seqlen, num_heads, Kv]
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t>
+efficient_attention_forward_cutlass(
+    const at::Tensor& query_, // [b, seqlen, num_heads, K]
+    const at::Tensor& key_, // [b, seqlen, num_kv_heads, K]
+    const at::Tensor& value, // [b, seqlen, num_kv_heads, Kv]
     // (Mode 1MHK only) [b+1]: cu_seqlens_q[b] contains the
     // position of the first query token for batch $b
     const c10::optional<at::Tensor>& cu_seqlens_q,
@@ -80,29 +467,186 @@ std::tuple<at::Tensor, at::Tensor> efficient_attention_forward_cutlass(
     // (Mode 1MHK only) Maximum sequence length across batches
     const c10::optional<int64_t> max_seqlen_q_,
     bool compute_logsumexp,
-    bool causal) {
+    bool causal,
+    // (Mode paged only) [b, max_pages_per_seq]: block_tables[b, i] is the
+    // page containing keys [i * page_size, (i + 1) * page_size) for batch $b
+    const c10::optional<at::Tensor>& block_tables,
+    // (Mode paged only) [b]: number of valid keys for batch $b
+    const c10::optional<at::Tensor>& seqlens_k,
+    // Number of blocks the keys are split across. Chosen automatically if
+    // not provided - set to 1 to disable the split-KV mode
+    const c10::optional<int64_t> num_splits_key_,
+    // (Mode BMHK only) [b, num_heads, seqlen_q, seqlen_k]: added to the
+    // attention scores. Can be broadcasted (eg with `expand`)
+    const c10::optional<at::Tensor>& attn_bias,
+    // Dropout probability applied to the attention matrix. The seed/offset
+    // returned must be passed to the backward to regenerate the same mask
+    double dropout_p,
+    // (causal only) Every query attends to at most the `window_size` latest
+    // keys, itself included
+    const c10::optional<int64_t> window_size_,
+    // [b, seqlen, num_heads, Kv]: written in place and returned if provided.
+    // Can have any strides as long as the last dimension is contiguous
+    const c10::optional<at::Tensor>& out,
+    // [b, seqlen, num_heads, Kv] float32: scratch buffer used by the kernels
+    // that can't keep the output in registers (in which case it is allocated
+    // if not provided). Same requirements on the strides as `out`
+    const c10::optional<at::Tensor>& output_accum_,
+    // (Mode BMHK only) [max_position, K] float32: if provided, the query and
+    // the key are rotated (RoPE, "rotate_half" convention) before the
+    // attention. See "rotary_embedding.h"
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    // [B, M] / [B, N] int32: positions of the queries / keys for RoPE (their
+    // index in the sequence if not provided)
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    // Biases generated in the kernel from the position of the query and of
+    // the key in their sequence (both starting at 0). See "generated_bias.h"
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    // Block-sparse mask, see "block_mask.h"
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    // Scale of the scores `query @ key.T` (`1 / sqrt(K)` if not set)
+    const c10::optional<double> scale_,
+    // If positive, the scaled scores are soft-capped to
+    // `softcap * tanh(scores / softcap)`, before the bias is added
+    double softcap,
+    // [b, seqlen_q, ceil(seqlen_q / 32)] int32: verification of a tree of
+    // draft tokens (speculative decoding). The queries are the drafts, which
+    // are also the last `seqlen_q` keys: every query attends to all the keys
+    // before them, and to the draft `d` iff the bit `d % 32` of
+    // `tree_mask[b, query, d / 32]` is set (its ancestors and itself)
+    const c10::optional<at::Tensor>& tree_mask,
+    // Keeps K/V in the persisting part of the L2 for the next kernels (see
+    // `ScopedL2PersistingWindow`), eg the KV-cache of the next decoding step
+    bool l2_persist_kv,
+    // [b, seqlen_q, num_heads] / [b, seqlen_k, num_kv_heads] float32: if
+    // provided, the query and the key are int8, and `query @ key.T` runs on
+    // the int8 tensor cores (Sm80+). The scores are dequantized with
+    // `q_scale[b, i, h] * k_scale[b, j, h_kv]` before the softmax, and the
+    // value (and the output) are f16/bf16
+    const c10::optional<at::Tensor>& q_scale,
+    const c10::optional<at::Tensor>& k_scale,
+    // With `k_scale` instead of `q_scale`: the key and the value are a
+    // quantized KV-cache (int8 / int4), see "kv_cache_quantization.h". The
+    // decode kernel dequantizes them as they are loaded. The other kernels
+    // work on a dequantized copy
+    const c10::optional<at::Tensor>& v_scale) {
 #ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
   TORCH_CHECK(
       false,
       "MemoryEfficient build has been disabled at build time with -DXFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD");
 #else
+  at::Tensor query = query_;
+  at::Tensor key = key_;
+  TORCH_CHECK(rope_cos.has_value() == rope_sin.has_value());
+  TORCH_CHECK(
+      rope_cos.has_value() ||
+          (!rope_positions_q.has_value() && !rope_positions_k.has_value()),
+      "rope_positions_q / rope_positions_k require rope_cos / rope_sin");
+  bool fused_rope = false;
+  if (rope_cos.has_value()) {
+    TORCH_CHECK(query_.dim() == 4 && key_.dim() == 4);
+    TORCH_CHECK(
+        !cu_seqlens_q.has_value() && !block_tables.has_value(),
+        "RoPE is only supported in Mode BMHK");
+    TORCH_CHECK(
+        !k_scale.has_value(), "RoPE is not supported with quantized inputs");
+    check_rotary_embedding(
+        query_, key_, *rope_cos, *rope_sin, rope_positions_q, rope_positions_k);
+    cudaDeviceProp* rope_properties =
+        at::cuda::getDeviceProperties(query_.device().index());
+    // Rotates the tiles of the query and the key as they are loaded
+    fused_rope = use_fused_rotary_embedding(
+        query_, key_, rope_properties->major * 10 + rope_properties->minor);
+    if (!fused_rope) {
+      // Rotate the query and the key in a single pass. The rotated tensors
+      // are contiguous, so that we always use the aligned kernels
+      query = at::empty(query_.sizes(), query_.options());
+      key = at::empty(key_.sizes(), key_.options());
+      at::cuda::CUDAGuard device_guard(query_.device());
+      apply_rotary_embedding_qk(
+          query_,
+          key_,
+          query,
+          key,
+          *rope_cos,
+          *rope_sin,
+          rope_positions_q,
+          rope_positions_k,
+          /*inverse=*/false);
+    }
+  }
   TORCH_CHECK(query.dim() == 4);
   TORCH_CHECK(key.dim() == 4);
   TORCH_CHECK(value.dim() == 4);
 
   // Batch sizes
-  TORCH_CHECK(query.size(0) == key.size(0));
-  TORCH_CHECK(query.size(0) == value.size(0));
+  TORCH_CHECK(key.size(0) == value.size(0));
+  if (!block_tables.has_value()) {
+    TORCH_CHECK(query.size(0) == key.size(0));
+  }
 
   // Sequence length
   TORCH_CHECK(key.size(1) == value.size(1));
 
-  // Num heads
-  TORCH_CHECK(query.size(2) == key.size(2));
-  TORCH_CHECK(query.size(2) == value.size(2));
+  // Num heads - with MQA/GQA several query heads share the same key/value
+  TORCH_CHECK(key.size(2) == value.size(2));
+  TORCH_CHECK(
+      query.size(2) % key.size(2) == 0,
+      "number of query heads must be a multiple of the number of key/value heads");
+
+  const bool quantized_qk = q_scale.has_value();
+  const bool quantized_kv = v_scale.has_value();
+  TORCH_CHECK(
+      !(quantized_qk && quantized_kv) &&
+          k_scale.has_value() == (quantized_qk || quantized_kv),
+      "k_scale goes with either q_scale (int8 query/key) or v_scale "
+      "(quantized K/V)");
 
   // Embedding per head
-  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(
+      query.size(3) ==
+      (quantized_kv ? kv_cache_num_channels(key) : key.size(3)));
+
+  if (quantized_qk) {
+    TORCH_CHECK(
+        query.scalar_type() == at::ScalarType::Char &&
+            key.scalar_type() == at::ScalarType::Char,
+        "query and key should be int8 with q_scale / k_scale");
+    TORCH_CHECK(
+        value.scalar_type() == at::ScalarType::Half ||
+            value.scalar_type() == at::ScalarType::BFloat16,
+        "value should be f16 or bf16 with int8 query/key");
+    TORCH_CHECK(
+        !block_tables.has_value(),
+        "block_tables is not supported with int8 query/key");
+    TORCH_CHECK(
+        query.size(3) % 16 == 0,
+        "int8 query/key require a head dim multiple of 16");
+    TORCH_CHECK(
+        q_scale->scalar_type() == at::ScalarType::Float &&
+        k_scale->scalar_type() == at::ScalarType::Float);
+    TORCH_CHECK(q_scale->sizes() == query.sizes().slice(0, 3));
+    TORCH_CHECK(k_scale->sizes() == key.sizes().slice(0, 3));
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*q_scale));
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*k_scale));
+  }
+  int kv_bits = 0;
+  if (quantized_kv) {
+    TORCH_CHECK(
+        query.scalar_type() == at::ScalarType::Half ||
+            query.scalar_type() == at::ScalarType::BFloat16,
+        "query should be f16 or bf16 with quantized K/V");
+    kv_bits = check_quantized_kv_cache(key, *k_scale);
+    TORCH_CHECK(
+        check_quantized_kv_cache(value, *v_scale) == kv_bits,
+        "key and value should be quantized to the same number of bits");
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*k_scale));
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*v_scale));
+  }
 
   int64_t max_seqlen_q, max_seqlen_k;
   TORCH_CHECK(cu_seqlens_q.has_value() == cu_seqlens_k.has_value());
@@ -114,18 +658,122 @@ std::tuple<at::Tensor, at::Tensor> efficient_attention_forward_cutlass(
     CHECK_NOSPARSE_CONTIGUOUS_CUDA((*cu_seqlens_k));
     TORCH_CHECK(cu_seqlens_q->size(0) == cu_seqlens_k->size(0));
     TORCH_CHECK(query.size(0) == 1, "cu_seqlen only supports batch_size=1");
-    TORCH_CHECK(max_seqlen_q_.has_value());
-    max_seqlen_q = *max_seqlen_q_;
+    // The lengths of the sequences are only read on the device, and
+    // `max_seqlen_q` is just an upper bound (it sizes the logsumexp, the grid
+    // and the work queue). If not provided, it is computed from
+    // `cu_seqlens_q`, which synchronizes with the host: an upper bound (eg
+    // the number of queries) allows to replay a single CUDA graph for any
+    // `cu_seqlens` of the same shape. The queries after `cu_seqlens_q[-1]`
+    // are not written to
+    if (max_seqlen_q_.has_value()) {
+      TORCH_CHECK(*max_seqlen_q_ >= 0);
+      max_seqlen_q = std::min(*max_seqlen_q_, query.size(1));
+    } else {
+      max_seqlen_q = max_seqlen_from_cu_seqlens(*cu_seqlens_q);
+    }
     max_seqlen_k = 0; // Will be set inside the kernel
   } else {
     max_seqlen_q = query.size(1);
     max_seqlen_k = key.size(1);
   }
 
+  TORCH_CHECK(!seqlens_k.has_value() || block_tables.has_value());
+  if (block_tables.has_value()) {
+    TORCH_CHECK(
+        !cu_seqlens_q.has_value(),
+        "block_tables is not supported with cu_seqlens");
+    TORCH_CHECK(block_tables->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(block_tables->dim() == 2);
+    TORCH_CHECK(block_tables->size(0) == query.size(0));
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*block_tables));
+    if (seqlens_k.has_value()) {
+      TORCH_CHECK(seqlens_k->scalar_type() == at::ScalarType::Int);
+      TORCH_CHECK(seqlens_k->dim() == 1);
+      TORCH_CHECK(seqlens_k->size(0) == query.size(0));
+      CHECK_NOSPARSE_CONTIGUOUS_CUDA((*seqlens_k));
+    }
+    // Upper bound - the actual length is read from `seqlens_k` in the kernel
+    max_seqlen_k = block_tables->size(1) * key.size(1);
+  }
+
+  if (attn_bias.has_value()) {
+    TORCH_CHECK(
+        !cu_seqlens_q.has_value(), "attn_bias is not supported with cu_seqlens");
+    TORCH_CHECK(
+        attn_bias->scalar_type() ==
+        (quantized_kv ? query.scalar_type() : value.scalar_type()));
+    TORCH_CHECK(attn_bias->dim() == 4);
+    TORCH_CHECK(attn_bias->size(0) == query.size(0));
+    TORCH_CHECK(attn_bias->size(1) == query.size(2));
+    TORCH_CHECK(attn_bias->size(2) == max_seqlen_q);
+    TORCH_CHECK(attn_bias->size(3) >= max_seqlen_k);
+    CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((*attn_bias));
+  }
+
+  check_generated_bias(query, alibi_slopes, rel_pos_bias);
+
+  int64_t window_size = 0;
+  if (window_size_.has_value()) {
+    window_size = *window_size_;
+    TORCH_CHECK(window_size > 0);
+    TORCH_CHECK(causal, "window_size requires causal=True");
+  }
+
+  const double scale =
+      scale_.value_or(1.0 / std::sqrt(double(query.size(3))));
+  TORCH_CHECK(softcap >= 0.0, "softcap should be positive (or 0 to disable)");
+
+  check_block_mask(
+      query, max_seqlen_q, max_seqlen_k, block_mask, block_mask_size);
+  if (tree_mask.has_value()) {
+    TORCH_CHECK(
+        !causal && window_size == 0 && !cu_seqlens_q.has_value() &&
+            !block_mask.has_value(),
+        "tree_mask is not supported with causal, window_size, cu_seqlens or "
+        "block_mask");
+    TORCH_CHECK(tree_mask->is_cuda());
+    TORCH_CHECK(tree_mask->scalar_type() == at::ScalarType::Int);
+    TORCH_CHECK(tree_mask->dim() == 3);
+    TORCH_CHECK(tree_mask->size(0) == query.size(0));
+    TORCH_CHECK(tree_mask->size(1) == query.size(1));
+    TORCH_CHECK(tree_mask->size(2) == ceil_div(query.size(1), int64_t(32)));
+    TORCH_CHECK(tree_mask->stride(2) == 1);
+    // With `seqlens_k`, every sequence should have at least `seqlen_q` keys
+    TORCH_CHECK(
+        max_seqlen_k >= query.size(1), "the drafts should be the last keys");
+  }
+  TORCH_CHECK(
+      !block_mask.has_value() ||
+          (!cu_seqlens_q.has_value() && window_size == 0),
+      "block_mask is not supported with cu_seqlens or window_size");
+
+  TORCH_CHECK(dropout_p >= 0.0 && dropout_p < 1.0);
+  const bool use_dropout = dropout_p != 0.0;
+  TORCH_CHECK(
+      !use_dropout || !cu_seqlens_q.has_value(),
+      "dropout is not supported with cu_seqlens");
+
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(query);
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(key);
   CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA(value);
 
+  for (const auto* buffer : {&out, &output_accum_}) {
+    if (buffer->has_value()) {
+      TORCH_CHECK((*buffer)->dim() == 4);
+      TORCH_CHECK((*buffer)->size(0) == query.size(0));
+      TORCH_CHECK((*buffer)->size(1) == query.size(1));
+      TORCH_CHECK((*buffer)->size(2) == query.size(2));
+      TORCH_CHECK(
+          (*buffer)->size(3) ==
+          (quantized_kv ? kv_cache_num_channels(value) : value.size(3)));
+      CHECK_NOSPARSE_LASTCONTIGUOUS_CUDA((**buffer));
+    }
+  }
+  TORCH_CHECK(
+      !output_accum_.has_value() ||
+          output_accum_->scalar_type() == at::ScalarType::Float,
+      "output_accum must be float32");
+
   at::cuda::CUDAGuard device_guard(query.device());
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
 
@@ -134,62 +782,323 @@ std::tuple<at::Tensor, at::Tensor> efficient_attention_forward_cutlass(
   int64_t N = key.size(1);
   int64_t num_heads = query.size(-2);
   int64_t K = query.size(-1);
-  int64_t Kv = value.size(-1);
+  int64_t Kv = quantized_kv ? kv_cache_num_channels(value) : value.size(-1);
+
+  // Use the decode kernel for a few queries per (batch, head), when it
+  // supports the inputs
+  const int64_t decode_alignment = 16 / query.element_size();
+  // 128 bits loads of every vector of the head dim - of fewer bytes for
+  // quantized K/V
+  const int64_t kv_decode_alignment =
+      quantized_kv ? decode_alignment * kv_bits / 8 : 16;
+  auto decode_aligned = [&](const at::Tensor& t, int64_t alignment_bytes) {
+    const int64_t alignment = alignment_bytes / t.element_size();
+    return uint64_t(t.data_ptr()) % alignment_bytes == 0 &&
+        t.stride(0) % alignment == 0 && t.stride(1) % alignment == 0 &&
+        t.stride(2) % alignment == 0;
+  };
+  const bool use_decode_kernel = max_seqlen_q <=
+          AttentionDecodeKernel<float, 64>::kMaxQueries &&
+      !cu_seqlens_q.has_value() && !attn_bias.has_value() && !use_dropout &&
+      !quantized_qk && !fused_rope && !block_mask.has_value() &&
+      !tree_mask.has_value() && !output_accum_.has_value() &&
+      std::max(K, Kv) <= 256 &&
+      K % decode_alignment == 0 && Kv % decode_alignment == 0 &&
+      decode_aligned(query, 16) && decode_aligned(key, kv_decode_alignment) &&
+      decode_aligned(value, kv_decode_alignment) &&
+      (!quantized_kv ||
+       ((K / k_scale->size(3)) % decode_alignment == 0 &&
+        (Kv / v_scale->size(3)) % decode_alignment == 0));
+  if (quantized_kv && !use_decode_kernel) {
+    // The tensor-core kernels load K/V as `scalar_t`
+    return efficient_attention_forward_cutlass(
+        query,
+        dequantize_kv_cache(key, *k_scale, query.scalar_type()),
+        dequantize_kv_cache(value, *v_scale, query.scalar_type()),
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q_,
+        compute_logsumexp,
+        causal,
+        block_tables,
+        seqlens_k,
+        num_splits_key_,
+        attn_bias,
+        dropout_p,
+        window_size_,
+        out,
+        output_accum_,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt,
+        alibi_slopes,
+        rel_pos_bias,
+        block_mask,
+        block_mask_size,
+        scale_,
+        softcap,
+        tree_mask,
+        l2_persist_kv,
+        c10::nullopt,
+        c10::nullopt,
+        c10::nullopt);
+  }
 
   at::Tensor res;
   at::Tensor logsumexp;
 
-  auto launchKernel = [&](auto _k, int computeCapability) {
+  at::PhiloxCudaState rng_engine_inputs;
+  if (use_dropout) {
+    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        c10::nullopt, at::cuda::detail::getDefaultCUDAGenerator());
+    // See Note [Acquire lock when using random generators]
+    std::lock_guard<std::mutex> lock(gen->mutex_);
+    // each element of the attention matrix gets its own offset
+    rng_engine_inputs =
+        gen->philox_cuda_state(B * num_heads * max_seqlen_q * max_seqlen_k);
+  }
+
+  // (Split-KV only) Reduces the partial results of the splits into `res`
+  // and `logsumexp`
+  auto reduceSplitKey = [&](auto _output_t,
+                            const at::Tensor& split_out,
+                            const at::Tensor& split_lse,
+                            int64_t num_splits_key,
+                            int64_t lse_dim) {
+    using output_t = decltype(_output_t);
+    (void)_output_t;
+    attention_split_key_reduce<output_t>
+        <<<B * M * num_heads, std::min(Kv, int64_t(128)), 0, stream>>>(
+            (const output_t*)split_out.data_ptr(),
+            (const float*)split_lse.data_ptr(),
+            (output_t*)res.data_ptr(),
+            compute_logsumexp ? (float*)logsumexp.data_ptr() : nullptr,
+            num_splits_key,
+            M,
+            num_heads,
+            Kv,
+            lse_dim,
+            split_out.stride(0),
+            split_lse.stride(0),
+            res.stride(0),
+            res.stride(1),
+            res.stride(2));
+    if (compute_logsumexp && lse_dim > M) {
+      // Same padding as in the kernel
+      logsumexp.narrow(2, M, lse_dim - M)
+          .fill_(std::numeric_limits<float>::infinity());
+    }
+  };
+
+  // `kernel_name` is only used to record the cycles of the phases of the
+  // kernel in profiling builds, and is empty when the kernel stats are not
+  // recorded (autotuning)
+  auto launchKernel = [&](auto _k,
+                          int computeCapability,
+                          const std::string& kernel_name) {
     using Kernel = decltype(_k);
     using scalar_t = typename Kernel::scalar_t;
     (void)_k;
 
-    res = at::empty(
-        {B, M, num_heads, Kv},
-        query.options().dtype(
-            TypeTraits<typename Kernel::output_t>::atScalarType()));
+    constexpr int64_t kQueriesPerBlock = Kernel::MM0::ThreadblockShape::kM;
+    constexpr int64_t kKeysPerBlock = Kernel::MM0::ThreadblockShape::kN;
+
+    // Split the keys across several blocks when there are not enough
+    // queries to occupy all the SMs (eg decoding with a long KV-cache). This
+    // is only automatic for short queries without the logsumexp (ie
+    // inference): the backward doesn't split the keys, and longer queries
+    // would pay for the reduction of large partial outputs
+    int64_t num_splits_key = 1;
+    if (num_splits_key_.has_value()) {
+      num_splits_key = *num_splits_key_;
+      TORCH_CHECK(num_splits_key >= 1);
+    } else if (
+        !cu_seqlens_q.has_value() && !output_accum_.has_value() &&
+        !compute_logsumexp && M <= kMaxAutoSplitKeyQueries) {
+      int64_t num_blocks = ceil_div(M, kQueriesPerBlock) * num_heads * B;
+      int64_t num_sms =
+          at::cuda::getDeviceProperties(query.device().index())
+              ->multiProcessorCount;
+      // Every split should still iterate over a few blocks of keys
+      int64_t max_splits =
+          std::min(max_seqlen_k / (4 * kKeysPerBlock), int64_t(128));
+      if (num_blocks > 0 && num_blocks < num_sms && max_splits > 1) {
+        num_splits_key =
+            std::min(ceil_div(2 * num_sms, num_blocks), max_splits);
+      }
+    }
+    int64_t keys_per_split = 0;
+    if (num_splits_key > 1) {
+      TORCH_CHECK(
+          !cu_seqlens_q.has_value(), "split-KV is not supported with cu_seqlens");
+      TORCH_CHECK(
+          !output_accum_.has_value(),
+          "split-KV uses its own output_accum buffer");
+      keys_per_split = ceil_div(
+                           ceil_div(max_seqlen_k, num_splits_key),
+                           kKeysPerBlock) *
+          kKeysPerBlock;
+      num_splits_key = ceil_div(max_seqlen_k, keys_per_split);
+      TORCH_CHECK(B * num_splits_key <= 65535, "too many splits");
+    }
+
+    if (out.has_value()) {
+      TORCH_CHECK(
+          out->scalar_type() ==
+              TypeTraits<typename Kernel::output_t>::atScalarType(),
+          "out has the wrong dtype");
+      res = *out;
+    } else {
+      res = at::empty(
+          {B, M, num_heads, Kv},
+          query.options().dtype(
+              TypeTraits<typename Kernel::output_t>::atScalarType()));
+    }
 
     // NOTE: Should be aligned (by padding) in case M is
     // not a good number for loading during backward
     constexpr decltype(M) kAlignLSE = Kernel::kAlignLSE;
+    const int64_t lse_dim = ceil_div(max_seqlen_q, kAlignLSE) * kAlignLSE;
+    // In Mode 1MHK, there is one row of `lse_dim` per sequence
     logsumexp = at::empty(
-        {B,
+        {cu_seqlens_q.has_value() ? cu_seqlens_q->size(0) - 1 : B,
          num_heads,
-         compute_logsumexp ? ceil_div(max_seqlen_q, kAlignLSE) * kAlignLSE : 0},
+         compute_logsumexp ? lse_dim : 0},
         query.options().dtype(at::ScalarType::Float));
 
+    // Temporaries of this call, which are not returned
+    WorkspaceArena workspace = attention_workspace_arena(query.device());
+
+    // (Split-KV only) Partial results of every split
+    at::Tensor split_out, split_lse;
+    if (num_splits_key > 1) {
+      split_out =
+          workspace.empty({num_splits_key, B, M, num_heads, Kv}, res.options());
+      // Empty splits are skipped by the kernel, and weighted 0 afterwards
+      split_lse = workspace.empty(
+          {num_splits_key, B, num_heads, lse_dim},
+          query.options().dtype(at::ScalarType::Float));
+      split_lse.fill_(-std::numeric_limits<float>::infinity());
+    }
+
     typename Kernel::Params p;
-    p.query_ptr = (scalar_t*)query.data_ptr();
-    p.key_ptr = (scalar_t*)key.data_ptr();
+    p.query_ptr = (typename Kernel::qk_scalar_t*)query.data_ptr();
+    p.key_ptr = (typename Kernel::qk_scalar_t*)key.data_ptr();
     p.value_ptr = (scalar_t*)value.data_ptr();
-    p.logsumexp_ptr = compute_logsumexp
-        ? (typename Kernel::lse_scalar_t*)logsumexp.data_ptr()
-        : nullptr;
+    if (num_splits_key > 1) {
+      p.logsumexp_ptr = (typename Kernel::lse_scalar_t*)split_lse.data_ptr();
+    } else {
+      p.logsumexp_ptr = compute_logsumexp
+          ? (typename Kernel::lse_scalar_t*)logsumexp.data_ptr()
+          : nullptr;
+    }
     at::Tensor output_accum;
     if (Kernel::kNeedsOutputAccumulatorBuffer) {
-      output_accum = at::empty(
-          {B, M, num_heads, Kv},
-          query.options().dtype(
-              TypeTraits<typename Kernel::output_accum_t>::atScalarType()));
+      if (output_accum_.has_value()) {
+        // Same layout as when allocated below with `num_splits_key=1`
+        output_accum = output_accum_->unsqueeze(0);
+      } else {
+        output_accum = workspace.empty(
+            {num_splits_key, B, M, num_heads, Kv},
+            query.options().dtype(
+                TypeTraits<typename Kernel::output_accum_t>::atScalarType()));
+      }
       p.output_accum_ptr =
           (typename Kernel::output_accum_t*)output_accum.data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.o_accum_strideB, output_accum.stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.o_accum_strideM, output_accum.stride(2));
+      ASSIGN_CHECK_OVERFLOW(p.o_accum_strideH, output_accum.stride(3));
     } else {
       p.output_accum_ptr = nullptr;
     }
-    p.output_ptr = (typename Kernel::output_t*)res.data_ptr();
+    at::Tensor kernel_out = num_splits_key > 1 ? split_out[0] : res;
+    p.output_ptr = (typename Kernel::output_t*)(num_splits_key > 1
+                                                    ? split_out.data_ptr()
+                                                    : res.data_ptr());
+    ASSIGN_CHECK_OVERFLOW(p.o_strideB, kernel_out.stride(0));
+    ASSIGN_CHECK_OVERFLOW(p.o_strideM, kernel_out.stride(1));
+    ASSIGN_CHECK_OVERFLOW(p.o_strideH, kernel_out.stride(2));
+    p.num_splits_key = num_splits_key;
+    p.keys_per_split = keys_per_split;
 
     if (cu_seqlens_q.has_value()) {
       p.cu_seqlens_q_ptr = (int32_t*)cu_seqlens_q->data_ptr();
       p.cu_seqlens_k_ptr = (int32_t*)cu_seqlens_k->data_ptr();
     }
+    if (attn_bias.has_value()) {
+      p.attn_bias_ptr = (scalar_t*)attn_bias->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideB, attn_bias->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideH, attn_bias->stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.bias_strideM, attn_bias->stride(2));
+    }
+    if (alibi_slopes.has_value()) {
+      p.alibi_slopes_ptr = (float*)alibi_slopes->data_ptr();
+    }
+    if (rel_pos_bias.has_value()) {
+      p.rel_pos_bias_ptr = (float*)rel_pos_bias->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(
+          p.rel_pos_max_distance, (rel_pos_bias->size(1) - 1) / 2);
+      ASSIGN_CHECK_OVERFLOW(p.rel_pos_bias_strideH, rel_pos_bias->stride(0));
+    }
+    if (tree_mask.has_value()) {
+      p.tree_mask_ptr = (const uint32_t*)tree_mask->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.tree_mask_strideB, tree_mask->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.tree_mask_strideM, tree_mask->stride(1));
+    }
+    if (quantized_qk) {
+      p.q_scale_ptr = (const float*)q_scale->data_ptr();
+      p.k_scale_ptr = (const float*)k_scale->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.q_scale_strideB, q_scale->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.q_scale_strideM, q_scale->stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.k_scale_strideB, k_scale->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.k_scale_strideM, k_scale->stride(1));
+    }
+    if (Kernel::kRotaryQK) {
+      p.rope_cos_ptr = (const float*)rope_cos->data_ptr();
+      p.rope_sin_ptr = (const float*)rope_sin->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.rope_strideM, rope_cos->stride(0));
+      if (rope_positions_q.has_value()) {
+        p.rope_positions_q_ptr = (const int32_t*)rope_positions_q->data_ptr();
+        p.rope_positions_q_strideB = rope_positions_q->stride(0);
+      }
+      if (rope_positions_k.has_value()) {
+        p.rope_positions_k_ptr = (const int32_t*)rope_positions_k->data_ptr();
+        p.rope_positions_k_strideB = rope_positions_k->stride(0);
+      }
+    }
+    if (block_mask.has_value()) {
+      p.block_mask_ptr = (uint8_t*)block_mask->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_size, block_mask_size);
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideB, block_mask->stride(0));
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideH, block_mask->stride(1));
+      ASSIGN_CHECK_OVERFLOW(p.block_mask_strideM, block_mask->stride(2));
+    }
+    if (block_tables.has_value()) {
+      p.block_tables_ptr = (int32_t*)block_tables->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.block_tables_strideB, block_tables->stride(0));
+      p.page_size = key.size(1);
+      if (seqlens_k.has_value()) {
+        p.seqlens_k_ptr = (int32_t*)seqlens_k->data_ptr();
+      }
+    }
 
     p.num_heads = num_heads;
+    p.num_kv_heads = key.size(2);
     p.head_dim = query.size(3);
     p.head_dim_value = value.size(3);
     p.num_queries = max_seqlen_q;
     p.num_keys = max_seqlen_k;
     p.num_batches = cu_seqlens_q.has_value() ? cu_seqlens_q->size(0) - 1 : B;
     p.causal = causal;
+    ASSIGN_CHECK_OVERFLOW(p.window_size, window_size);
+    p.scale = scale;
+    p.softcap = softcap;
+    p.use_dropout = use_dropout;
+    if (use_dropout) {
+      p.dropout_prob = dropout_p;
+      p.rng_engine_inputs = rng_engine_inputs;
+    }
 
     ASSIGN_CHECK_OVERFLOW(p.q_strideB, query.stride(0));
     ASSIGN_CHECK_OVERFLOW(p.k_strideB, key.stride(0));
@@ -207,19 +1116,420 @@ std::tuple<at::Tensor, at::Tensor> efficient_attention_forward_cutlass(
       TORCH_INTERNAL_ASSERT(
           computeCapability >= 70,
           "This kernel requires too much shared memory on this machine!");
-      AT_CUDA_CHECK(cudaFuncSetAttribute(
-          kernel_fn, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_bytes));
+      KernelAttributes<Kernel>::set_max_dynamic_smem(
+          kernel_fn, query.device().index(), smem_bytes);
     }
+
+    // In Mode 1MHK, the grid would be sized by `max_seqlen_q`, and most of the
+    // blocks would exit immediately when the sequence lengths are skewed.
+    // Instead, we launch just enough blocks to fill the GPU, and have them
+    // pull work items from a queue computed on the device (so without
+    // synchronizing with the host)
+    at::Tensor work_queue;
+    if (cu_seqlens_q.has_value()) {
+      work_queue = build_varlen_work_queue(
+          *cu_seqlens_q,
+          *cu_seqlens_k,
+          M,
+          max_seqlen_q,
+          kQueriesPerBlock,
+          causal);
+      int blocks_per_sm =
+          KernelAttributes<Kernel>::max_active_blocks_per_sm(
+              kernel_fn,
+              query.device().index(),
+              Kernel::kNumThreads,
+              smem_bytes);
+      int64_t num_sms = at::cuda::getDeviceProperties(query.device().index())
+                            ->multiProcessorCount;
+      p.work_queue_ptr = (int32_t*)work_queue.data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.num_work_tiles, work_queue.size(0));
+      ASSIGN_CHECK_OVERFLOW(
+          p.num_persistent_blocks,
+          std::max(
+              std::min(
+                  std::max(blocks_per_sm, 1) * num_sms,
+                  work_queue.size(0) * num_heads),
+              int64_t(1)));
+    }
+    // Short keys: several tiles of queries per block, while keeping a couple
+    // of waves of blocks to balance the SMs
+    if (!cu_seqlens_q.has_value() && !causal && num_splits_key == 1 &&
+        max_seqlen_k <= kKeysPerBlock) {
+      int blocks_per_sm =
+          KernelAttributes<Kernel>::max_active_blocks_per_sm(
+              kernel_fn,
+              query.device().index(),
+              Kernel::kNumThreads,
+              smem_bytes);
+      int64_t num_sms = at::cuda::getDeviceProperties(query.device().index())
+                            ->multiProcessorCount;
+      int64_t num_blocks =
+          ceil_div(max_seqlen_q, kQueriesPerBlock) * num_heads * B;
+      ASSIGN_CHECK_OVERFLOW(
+          p.query_tiles_per_block,
+          std::max(
+              std::min(
+                  num_blocks / (2 * std::max(blocks_per_sm, 1) * num_sms),
+                  kMaxQueryTilesPerBlock),
+              int64_t(1)));
+    }
+#ifdef XFORMERS_MEM_EFF_ATTENTION_PROFILE
+    if (!kernel_name.empty()) {
+      dim3 blocks_grid = p.getBlocksGrid();
+      at::Tensor cycles = at::zeros(
+          {int64_t(blocks_grid.x) * blocks_grid.y * blocks_grid.z,
+           Kernel::kNumWarpsPerBlock,
+           kProfileNumPhases},
+          query.options().dtype(at::ScalarType::Long));
+      p.profile_ptr = (int64_t*)cycles.data_ptr();
+      record_attention_profile(kernel_name, cycles);
+    }
+#endif
     Kernel::check_supported(p);
     kernel_fn<<<p.getBlocksGrid(), p.getThreadsGrid(), smem_bytes, stream>>>(p);
+
+    if (num_splits_key > 1) {
+      reduceSplitKey(
+          typename Kernel::output_t{},
+          split_out,
+          split_lse,
+          num_splits_key,
+          lse_dim);
+    }
+  };
+
+  // See `AttentionDecodeKernel`
+  auto launchDecodeKernel = [&](auto _k) {
+    using Kernel = decltype(_k);
+    using scalar_t = typename Kernel::scalar_t;
+    (void)_k;
+
+    // Split the keys until there are enough blocks to fill the GPU
+    int64_t num_rows = B * M * num_heads;
+    int64_t num_splits_key = 1;
+    if (num_splits_key_.has_value()) {
+      num_splits_key = *num_splits_key_;
+      TORCH_CHECK(num_splits_key >= 1);
+    } else {
+      int64_t num_sms = at::cuda::getDeviceProperties(query.device().index())
+                            ->multiProcessorCount;
+      // Every split should still iterate over a few tiles of keys
+      int64_t max_splits =
+          std::min(max_seqlen_k / (4 * Kernel::kKeysPerTile), int64_t(128));
+      if (num_rows > 0 && num_rows < 8 * num_sms && max_splits > 1) {
+        num_splits_key =
+            std::min(ceil_div(8 * num_sms, num_rows), max_splits);
+      }
+    }
+    int64_t keys_per_split = 0;
+    if (num_splits_key > 1 && max_seqlen_k > 0) {
+      keys_per_split = ceil_div(
+                           ceil_div(max_seqlen_k, num_splits_key),
+                           int64_t(Kernel::kKeysPerTile)) *
+          Kernel::kKeysPerTile;
+      num_splits_key = ceil_div(max_seqlen_k, keys_per_split);
+      TORCH_CHECK(num_splits_key <= 65535, "too many splits");
+    } else {
+      num_splits_key = 1;
+    }
+
+    if (out.has_value()) {
+      TORCH_CHECK(
+          out->scalar_type() == query.scalar_type(), "out has the wrong dtype");
+      res = *out;
+    } else {
+      res = at::empty({B, M, num_heads, Kv}, query.options());
+    }
+    // Same layout as for the other kernels
+    const int64_t lse_dim = ceil_div(max_seqlen_q, int64_t(32)) * 32;
+    logsumexp = at::empty(
+        {B, num_heads, compute_logsumexp ? lse_dim : 0},
+        query.options().dtype(at::ScalarType::Float));
+
+    WorkspaceArena workspace = attention_workspace_arena(query.device());
+    at::Tensor split_out, split_lse;
+    if (num_splits_key > 1) {
+      split_out =
+          workspace.empty({num_splits_key, B, M, num_heads, Kv}, res.options());
+      split_lse = workspace.empty(
+          {num_splits_key, B, num_heads, lse_dim},
+          query.options().dtype(at::ScalarType::Float));
+    }
+
+    typename Kernel::Params p;
+    p.query_ptr = (const scalar_t*)query.data_ptr();
+    p.key_ptr = (const typename Kernel::kv_t*)key.data_ptr();
+    p.value_ptr = (const typename Kernel::kv_t*)value.data_ptr();
+    at::Tensor kernel_out = num_splits_key > 1 ? split_out[0] : res;
+    p.output_ptr = (scalar_t*)(num_splits_key > 1 ? split_out.data_ptr()
+                                                  : res.data_ptr());
+    if (num_splits_key > 1) {
+      p.logsumexp_ptr = (float*)split_lse.data_ptr();
+      p.o_strideSplit = split_out.stride(0);
+      p.lse_strideSplit = split_lse.stride(0);
+    } else if (compute_logsumexp) {
+      p.logsumexp_ptr = (float*)logsumexp.data_ptr();
+    }
+    p.o_strideB = kernel_out.stride(0);
+    p.o_strideM = kernel_out.stride(1);
+    p.o_strideH = kernel_out.stride(2);
+    p.num_splits_key = num_splits_key;
+    p.keys_per_split = keys_per_split;
+
+    if (block_tables.has_value()) {
+      p.block_tables_ptr = (int32_t*)block_tables->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(p.block_tables_strideB, block_tables->stride(0));
+      p.page_size = key.size(1);
+      if (seqlens_k.has_value()) {
+        p.seqlens_k_ptr = (int32_t*)seqlens_k->data_ptr();
+      }
+    }
+    if (alibi_slopes.has_value()) {
+      p.alibi_slopes_ptr = (float*)alibi_slopes->data_ptr();
+    }
+    if (rel_pos_bias.has_value()) {
+      p.rel_pos_bias_ptr = (float*)rel_pos_bias->data_ptr();
+      ASSIGN_CHECK_OVERFLOW(
+          p.rel_pos_max_distance, (rel_pos_bias->size(1) - 1) / 2);
+      ASSIGN_CHECK_OVERFLOW(p.rel_pos_bias_strideH, rel_pos_bias->stride(0));
+    }
+
+    p.head_dim = K;
+    p.head_dim_value = Kv;
+    p.num_batches = B;
+    p.num_queries = M;
+    ASSIGN_CHECK_OVERFLOW(p.num_keys, max_seqlen_k);
+    p.num_heads = num_heads;
+    p.num_kv_heads = key.size(2);
+    p.lse_dim = lse_dim;
+    p.causal = causal;
+    ASSIGN_CHECK_OVERFLOW(p.window_size, window_size);
+    p.scale = scale;
+    p.softcap = softcap;
+    // K/V broadcasted over the batch (eg a shared prefix) are read by all
+    // the sequences: keep them. With `l2_persist_kv`, the access policy
+    // window of the stream applies instead
+    using CacheHint = typename Kernel::CacheHint;
+    if (l2_persist_kv) {
+      p.kv_cache_hint = CacheHint::kNormal;
+    } else if (
+        B > 1 && !block_tables.has_value() && key.stride(0) == 0 &&
+        value.stride(0) == 0) {
+      p.kv_cache_hint = CacheHint::kEvictLast;
+    } else {
+      p.kv_cache_hint = CacheHint::kEvictFirst;
+    }
+
+    p.q_strideB = query.stride(0);
+    p.k_strideB = key.stride(0);
+    p.v_strideB = value.stride(0);
+    p.q_strideM = query.stride(1);
+    p.k_strideM = key.stride(1);
+    p.v_strideM = value.stride(1);
+    p.q_strideH = query.stride(2);
+    p.k_strideH = key.stride(2);
+    p.v_strideH = value.stride(2);
+    if (quantized_kv) {
+      p.k_scale_ptr = (const float*)k_scale->data_ptr();
+      p.v_scale_ptr = (const float*)v_scale->data_ptr();
+      p.k_group_size = K / k_scale->size(3);
+      p.v_group_size = Kv / v_scale->size(3);
+      p.k_scale_strideB = k_scale->stride(0);
+      p.k_scale_strideM = k_scale->stride(1);
+      p.k_scale_strideH = k_scale->stride(2);
+      p.v_scale_strideB = v_scale->stride(0);
+      p.v_scale_strideM = v_scale->stride(1);
+      p.v_scale_strideH = v_scale->stride(2);
+    }
+
+    Kernel::check_supported(p);
+    if (num_rows > 0) {
+      attention_decode_kernel<Kernel>
+          <<<p.getBlocksGrid(), p.getThreadsGrid(), 0, stream>>>(p);
+    }
+
+    if (num_splits_key > 1) {
+      reduceSplitKey(scalar_t{}, split_out, split_lse, num_splits_key, lse_dim);
+    } else if (compute_logsumexp && lse_dim > M) {
+      logsumexp.narrow(2, M, lse_dim - M)
+          .fill_(std::numeric_limits<float>::infinity());
+    }
   };
   // Dispatch to the right kernel
-  DISPATCH_KERNEL(query, key, value, ([&]() {
-                    launchKernel(Kernel{}, computeCapability);
-                  }));
+  cudaDeviceProp* properties =
+      at::cuda::getDeviceProperties(query.device().index());
+  const int computeCapability = properties->major * 10 + properties->minor;
+  const bool supports_k256 = computeCapability >= 80 &&
+      query.scalar_type() != at::ScalarType::Float;
+  TORCH_CHECK(
+      !quantized_qk || computeCapability >= 80,
+      "int8 query/key require Sm80+");
+  // For all the kernels launched below
+  c10::optional<ScopedL2PersistingWindow> l2_window;
+  if (l2_persist_kv) {
+    l2_window.emplace(stream, *properties, key, value);
+  }
+  auto runVariant = [&](int variant, bool record_stats) {
+    TORCH_CHECK(
+        forward_variant_supported(variant, Kv, supports_k256),
+        "kernel variant not supported for this input");
+    if (quantized_qk) {
+      DISPATCH_QUANTIZED_QK_KERNEL(value, variant, ([&]() {
+                                     static const std::string kKernelName =
+                                         std::string("cutlassF_") +
+                                         attention_dtype_name<scalar_t>() +
+                                         "_int8qk_" +
+                                         std::to_string(kQueriesPerBlock) +
+                                         "x" + std::to_string(kKeysPerBlock) +
+                                         (kSingleValueIteration ? "_rf" : "") +
+                                         "_sm80";
+                                     if (record_stats) {
+                                       record_attention_kernel(
+                                           "cutlassF", kKernelName, {});
+                                     }
+                                     RECORD_FUNCTION(
+                                         kKernelName,
+                                         std::vector<c10::IValue>());
+                                     launchKernel(
+                                         Kernel{},
+                                         computeCapability,
+                                         record_stats ? kKernelName : "");
+                                   }));
+      return;
+    }
+    if (fused_rope) {
+      DISPATCH_ROTARY_QK_KERNEL(query, variant, ([&]() {
+                                  static const std::string kKernelName =
+                                      std::string("cutlassF_") +
+                                      attention_dtype_name<scalar_t>() +
+                                      "_rope_" +
+                                      std::to_string(kQueriesPerBlock) + "x" +
+                                      std::to_string(kKeysPerBlock) +
+                                      (kSingleValueIteration ? "_rf" : "") +
+                                      "_sm80";
+                                  if (record_stats) {
+                                    record_attention_kernel(
+                                        "cutlassF", kKernelName, {});
+                                  }
+                                  RECORD_FUNCTION(
+                                      kKernelName, std::vector<c10::IValue>());
+                                  launchKernel(
+                                      Kernel{},
+                                      computeCapability,
+                                      record_stats ? kKernelName : "");
+                                }));
+      return;
+    }
+    DISPATCH_KERNEL(query, key, value, variant, ([&]() {
+                      static const std::string kKernelName =
+                          std::string("cutlassF_") +
+                          attention_dtype_name<scalar_t>() +
+                          (kIsAligned ? "_aligned_" : "_notaligned_") +
+                          std::to_string(kQueriesPerBlock) + "x" +
+                          std::to_string(kKeysPerBlock) +
+                          (kSingleValueIteration ? "_rf" : "") + "_sm" +
+                          std::to_string(ArchTag::kMinComputeCapability) +
+                          (Kernel::kSmallSmem ? "_smallsmem" : "") +
+                          (Kernel::kTF32 ? "_tf32" : "");
+                      if (record_stats) {
+                        std::vector<const char*> fallbacks;
+                        if (!kIsAligned) {
+                          fallbacks.push_back(attention_unaligned_tensor(
+                              query,
+                              key,
+                              value,
+                              AlignedAK::kAlignmentQ,
+                              AlignedAK::kAlignmentK,
+                              AlignedAK::kAlignmentV));
+                        }
+                        if (!kSingleValueIteration) {
+                          // The output does not fit in registers
+                          fallbacks.push_back("output_in_gmem");
+                        }
+                        record_attention_kernel(
+                            "cutlassF", kKernelName, fallbacks);
+                      }
+                      RECORD_FUNCTION(
+                          kKernelName, std::vector<c10::IValue>());
+                      launchKernel(
+                          Kernel{},
+                          computeCapability,
+                          record_stats ? kKernelName : "");
+                    }));
+  };
+
+  if (use_decode_kernel) {
+    const int64_t maxK = std::max(K, Kv);
+    auto dispatchDecodeKernel = [&](auto _s, auto kv_bits) {
+      using scalar_t = decltype(_s);
+      constexpr int kKVBits = decltype(kv_bits)::value;
+      static const std::string kKernelName =
+          std::string("cutlassF_decode_") + attention_dtype_name<scalar_t>() +
+          (kKVBits ? "_int" + std::to_string(kKVBits) + "kv" : "");
+      record_attention_kernel("cutlassF", kKernelName, {});
+      RECORD_FUNCTION(kKernelName, std::vector<c10::IValue>());
+      if (maxK <= 64) {
+        launchDecodeKernel(AttentionDecodeKernel<scalar_t, 64, kKVBits>{});
+      } else if (maxK <= 128) {
+        launchDecodeKernel(AttentionDecodeKernel<scalar_t, 128, kKVBits>{});
+      } else {
+        launchDecodeKernel(AttentionDecodeKernel<scalar_t, 256, kKVBits>{});
+      }
+    };
+    if (!quantized_kv) {
+      DISPATCH_TYPES(query, ([&]() {
+                       dispatchDecodeKernel(
+                           scalar_t{}, std::integral_constant<int, 0>{});
+                     }));
+    } else {
+      // Only f16/bf16 queries with quantized K/V
+      auto dispatchKVBits = [&](auto _s) {
+        if (kv_bits == 8) {
+          dispatchDecodeKernel(_s, std::integral_constant<int, 8>{});
+        } else {
+          dispatchDecodeKernel(_s, std::integral_constant<int, 4>{});
+        }
+      };
+      if (query.scalar_type() == at::ScalarType::Half) {
+        _DISPATCH_TYPE_F16(([&]() { dispatchKVBits(scalar_t{}); }));
+      } else {
+        _DISPATCH_TYPE_BF16(([&]() { dispatchKVBits(scalar_t{}); }));
+      }
+    }
+    AT_CUDA_CHECK(cudaGetLastError());
+    return std::make_tuple(res, logsumexp, int64_t(0), int64_t(0));
+  }
+
+  int variant = default_forward_variant(Kv, supports_k256, max_seqlen_q);
+  auto& autotuner = AttentionAutotuner::get();
+  if (autotuner.enabled()) {
+    variant = autotuner.select(
+        make_autotune_key(
+            fused_rope ? "fwd_rope" : "fwd",
+            computeCapability,
+            query.scalar_type(),
+            K,
+            Kv,
+            causal,
+            autotune_bucket(max_seqlen_q),
+            autotune_bucket(max_seqlen_k)),
+        kNumForwardVariants,
+        variant,
+        [&](int candidate) { runVariant(candidate, false); });
+  }
+  runVariant(variant, true);
 
   AT_CUDA_CHECK(cudaGetLastError());
-  return std::make_tuple(res, logsumexp);
+
+  // uint64_t -> int64_t bitwise casting as PyTorch don't support uint64_t
+  // so just fake it as a int64_t
+  int64_t seed = 0, offset = 0;
+  if (use_dropout) {
+    std::memcpy(&seed, &rng_engine_inputs.seed_, sizeof(seed));
+    std::memcpy(&offset, &rng_engine_inputs.offset_.val, sizeof(offset));
+  }
+  return std::make_tuple(res, logsumexp, seed, offset);
 #endif
 }
 } // namespace
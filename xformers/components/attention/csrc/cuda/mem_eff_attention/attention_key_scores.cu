@@ -0,0 +1,239 @@
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include <cmath>
+
+// Attention probability mass received by every key, summed over the queries:
+//   scores[b, h, n] = sum_m(exp(s[b, h, m, n] - lse[b, h, m]))
+// where `s` are the (scaled, soft-capped and masked) scores of the forward,
+// and `lse` its logsumexp. This is what score-based KV-cache eviction needs
+// (eg keeping the "heavy hitters"): the forward never materializes the
+// probabilities, and only knows their normalization at the very end, so they
+// are recomputed in a second pass from the final logsumexp.
+// Every block owns a tile of keys of a (b, h) - kept in shared memory - and
+// loops over the queries which can attend to it, so that no atomics are
+// needed. Every warp computes the scores of a few queries at a time (one key
+// per lane), in float32.
+// This pass is NOT cheap: it computes `Q @ K.T` again, in O(B * H * M * N * K)
+// SIMT FMAs without tensor cores or reuse of the forward's tiles, so it is
+// typically several times slower than the forward itself. It is meant for
+// occasional calls (eg once after a prefill), not for every step.
+// query [B, M, H, K], key [B, N, H_kv, K], logsumexp [B, H, M'] with M' >= M
+// (the forward pads it), scores [B, H, N] float32
+namespace {
+
+constexpr int kWarpSize = 32;
+constexpr int kKeysPerBlock = kWarpSize;
+constexpr int kWarpsPerBlock = 4;
+
+template <typename scalar_t>
+struct AttentionKeyScoresParams {
+  const scalar_t* query;
+  int64_t q_strideB, q_strideM, q_strideH;
+  const scalar_t* key;
+  int64_t k_strideB, k_strideM, k_strideH;
+  const float* lse;
+  int64_t lse_strideB, lse_strideH;
+  float* scores; // [B, H, N]
+  int32_t M, N, H, H_kv, K;
+  float scale;
+  float softcap; // 0 to disable
+  bool causal;
+  int32_t window_size; // 0 to disable
+};
+
+template <typename scalar_t, int kMaxK>
+__global__ void attention_key_scores_kernel(
+    AttentionKeyScoresParams<scalar_t> p) {
+  // Fewer queries at a time for large heads, to stay under 48kb of smem
+  constexpr int kQueriesPerWarp = kMaxK <= 128 ? 4 : 2;
+  // Padded: the keys are written along K and read along N
+  __shared__ float key_smem[kMaxK][kKeysPerBlock + 1];
+  __shared__ float query_smem[kWarpsPerBlock][kQueriesPerWarp][kMaxK];
+  __shared__ float scores_smem[kWarpsPerBlock][kKeysPerBlock];
+
+  int32_t key_start = blockIdx.x * kKeysPerBlock;
+  int32_t h = blockIdx.y;
+  int64_t b = blockIdx.z;
+  int32_t h_kv = h / (p.H / p.H_kv);
+  int32_t warp = threadIdx.x / kWarpSize;
+  int32_t lane = threadIdx.x % kWarpSize;
+
+  const scalar_t* key = p.key + b * p.k_strideB + h_kv * p.k_strideH;
+  for (int32_t i = threadIdx.x; i < kKeysPerBlock * p.K; i += blockDim.x) {
+    int32_t n = i / p.K;
+    int32_t k = i % p.K;
+    key_smem[k][n] = key_start + n < p.N
+        ? float(key[int64_t(key_start + n) * p.k_strideM + k])
+        : 0.0f;
+  }
+  __syncthreads();
+
+  // Queries which can attend to a key of the tile
+  int32_t key_end = min(key_start + kKeysPerBlock, p.N);
+  int32_t query_begin = p.causal ? key_start : 0;
+  int32_t query_end = p.M;
+  if (p.window_size > 0) {
+    query_end = min(query_end, key_end - 1 + p.window_size);
+  }
+
+  const scalar_t* query = p.query + b * p.q_strideB + h * p.q_strideH;
+  const float* lse = p.lse + b * p.lse_strideB + h * p.lse_strideH;
+  int32_t n = key_start + lane;
+  float score = 0.0f;
+  for (int32_t m0 = query_begin + warp * kQueriesPerWarp; m0 < query_end;
+       m0 += kWarpsPerBlock * kQueriesPerWarp) {
+#pragma unroll
+    for (int32_t j = 0; j < kQueriesPerWarp; ++j) {
+      for (int32_t k = lane; k < p.K; k += kWarpSize) {
+        query_smem[warp][j][k] = m0 + j < query_end
+            ? float(query[int64_t(m0 + j) * p.q_strideM + k]) * p.scale
+            : 0.0f;
+      }
+    }
+    __syncwarp();
+    float acc[kQueriesPerWarp] = {};
+#pragma unroll 8
+    for (int32_t k = 0; k < p.K; ++k) {
+      float key_k = key_smem[k][lane];
+#pragma unroll
+      for (int32_t j = 0; j < kQueriesPerWarp; ++j) {
+        acc[j] += query_smem[warp][j][k] * key_k;
+      }
+    }
+    __syncwarp();
+#pragma unroll
+    for (int32_t j = 0; j < kQueriesPerWarp; ++j) {
+      int32_t m = m0 + j;
+      bool masked = m >= query_end || n >= p.N || (p.causal && n > m) ||
+          (p.window_size > 0 && n <= m - p.window_size);
+      if (masked) {
+        continue;
+      }
+      float row_lse = lse[m];
+      // Queries without any key
+      if (row_lse == -INFINITY) {
+        continue;
+      }
+      float s = acc[j];
+      if (p.softcap > 0.0f) {
+        s = p.softcap * tanhf(s / p.softcap);
+      }
+      score += expf(s - row_lse);
+    }
+  }
+
+  scores_smem[warp][lane] = score;
+  __syncthreads();
+  if (warp == 0 && n < p.N) {
+    float total = 0.0f;
+#pragma unroll
+    for (int32_t w = 0; w < kWarpsPerBlock; ++w) {
+      total += scores_smem[w][lane];
+    }
+    p.scores[(b * p.H + h) * p.N + n] = total;
+  }
+}
+
+template <typename scalar_t>
+void dispatch_attention_key_scores(
+    const AttentionKeyScoresParams<scalar_t>& p,
+    int64_t B,
+    cudaStream_t stream) {
+  dim3 grid((p.N + kKeysPerBlock - 1) / kKeysPerBlock, p.H, B);
+  dim3 block(kWarpsPerBlock * kWarpSize);
+  if (p.K <= 64) {
+    attention_key_scores_kernel<scalar_t, 64><<<grid, block, 0, stream>>>(p);
+  } else if (p.K <= 128) {
+    attention_key_scores_kernel<scalar_t, 128><<<grid, block, 0, stream>>>(p);
+  } else {
+    attention_key_scores_kernel<scalar_t, 256><<<grid, block, 0, stream>>>(p);
+  }
+}
+
+at::Tensor attention_key_scores(
+    const at::Tensor& query, // [b, seqlen_q, num_heads, K]
+    const at::Tensor& key, // [b, seqlen_k, num_kv_heads, K]
+    const at::Tensor& logsumexp, // [b, num_heads, seqlen_q'] float32
+    bool causal,
+    const c10::optional<int64_t> window_size,
+    const c10::optional<double> scale,
+    double softcap) {
+  TORCH_CHECK(query.dim() == 4 && key.dim() == 4);
+  TORCH_CHECK(query.is_cuda() && key.device() == query.device());
+  TORCH_CHECK(logsumexp.device() == query.device());
+  TORCH_CHECK(key.scalar_type() == query.scalar_type());
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(3) == key.size(3));
+  TORCH_CHECK(
+      query.size(3) <= 256, "attention_key_scores: K > 256 is not supported");
+  TORCH_CHECK(
+      key.size(2) > 0 && query.size(2) % key.size(2) == 0,
+      "num_heads should be a multiple of num_kv_heads");
+  TORCH_CHECK(query.stride(3) == 1 && key.stride(3) == 1);
+  TORCH_CHECK(logsumexp.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(logsumexp.dim() == 3);
+  TORCH_CHECK(
+      logsumexp.size(0) == query.size(0) &&
+      logsumexp.size(1) == query.size(2));
+  TORCH_CHECK(logsumexp.size(2) >= query.size(1));
+  TORCH_CHECK(logsumexp.stride(2) == 1, "logsumexp should be contiguous in M");
+  int64_t window = window_size.value_or(0);
+  TORCH_CHECK(window == 0 || causal, "window_size requires causal=True");
+  at::cuda::CUDAGuard device_guard(query.device());
+
+  int64_t B = query.size(0);
+  int64_t M = query.size(1);
+  int64_t H = query.size(2);
+  int64_t N = key.size(1);
+  at::Tensor scores =
+      at::zeros({B, H, N}, query.options().dtype(at::ScalarType::Float));
+  if (scores.numel() == 0 || M == 0) {
+    return scores;
+  }
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "attention_key_scores",
+      [&] {
+        AttentionKeyScoresParams<scalar_t> p;
+        p.query = (const scalar_t*)query.data_ptr();
+        p.q_strideB = query.stride(0);
+        p.q_strideM = query.stride(1);
+        p.q_strideH = query.stride(2);
+        p.key = (const scalar_t*)key.data_ptr();
+        p.k_strideB = key.stride(0);
+        p.k_strideM = key.stride(1);
+        p.k_strideH = key.stride(2);
+        p.lse = (const float*)logsumexp.data_ptr();
+        p.lse_strideB = logsumexp.stride(0);
+        p.lse_strideH = logsumexp.stride(1);
+        p.scores = (float*)scores.data_ptr();
+        p.M = M;
+        p.N = N;
+        p.H = H;
+        p.H_kv = key.size(2);
+        p.K = query.size(3);
+        p.scale = scale.has_value() ? float(*scale)
+                                    : float(1.0 / std::sqrt(double(p.K)));
+        p.softcap = softcap;
+        p.causal = causal;
+        p.window_size = window;
+        dispatch_attention_key_scores(p, B, stream);
+      });
+  AT_CUDA_CHECK(cudaGetLastError());
+  return scores;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::attention_key_scores"),
+      TORCH_FN(attention_key_scores));
+}
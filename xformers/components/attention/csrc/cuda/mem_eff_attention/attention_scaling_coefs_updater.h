@@ -87,7 +87,12 @@ struct RegisterOps {
     __syncthreads();
 
     if (thread_id < kQueriesPerBlock) {
-      auto m_prime_exp = exp2f(kLog2e * (m_prime[thread_id] - mi[thread_id]));
+      // `mi` is -inf if all the keys seen so far are masked out for this row
+      // (eg sliding window), in which case nothing has been accumulated yet
+      auto m_prime_exp = mi[thread_id] ==
+              -cutlass::platform::numeric_limits<accum_t>::infinity()
+          ? accum_t(1)
+          : exp2f(kLog2e * (m_prime[thread_id] - mi[thread_id]));
       m_prime[thread_id] = m_prime_exp;
       s_prime[thread_id] *= m_prime_exp;
     }
@@ -106,7 +111,13 @@ struct RegisterOps {
       accum_t mi_row, total_row;
       BASE::iterateRows(
           lane_offset,
-          [&](int accum_m) { mi_row = kLog2e * mi[accum_m]; },
+          [&](int accum_m) {
+            // Avoids `-inf - (-inf)` on fully masked rows
+            mi_row = mi[accum_m] ==
+                    -cutlass::platform::numeric_limits<accum_t>::infinity()
+                ? accum_t(0)
+                : kLog2e * mi[accum_m];
+          },
           [&](int accum_m, int accum_n, int idx) {
             frag[idx] = (kFullColumns || accum_n < max_col)
                 ? exp2f(frag[idx] - mi_row)
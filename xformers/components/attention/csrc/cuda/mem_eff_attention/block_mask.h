@@ -0,0 +1,38 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+// Block-sparse attention: `block_mask` [B, num_heads, ceil(M / size),
+// ceil(N / size)] bool, where `size` is `block_mask_size`. The queries of
+// block `i` only attend to the keys of block `j` if `block_mask[b, h, i, j]`
+// is set, and the kernels skip the other blocks entirely (so the cost is
+// proportional to the number of blocks set). The mask can be broadcasted
+// across the batch (eg with `expand`). Queries whose keys are all masked
+// have a zero output and a logsumexp of `-inf`
+namespace {
+
+void check_block_mask(
+    const at::Tensor& query,
+    int64_t num_queries,
+    int64_t num_keys,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size) {
+  if (!block_mask.has_value()) {
+    return;
+  }
+  // The blocks of the kernels never cross the blocks of the mask
+  TORCH_CHECK(
+      block_mask_size > 0 && block_mask_size % 128 == 0,
+      "block_mask_size must be a positive multiple of 128");
+  TORCH_CHECK(block_mask->scalar_type() == at::ScalarType::Bool);
+  TORCH_CHECK(block_mask->dim() == 4);
+  TORCH_CHECK(block_mask->size(0) == query.size(0));
+  TORCH_CHECK(block_mask->size(1) == query.size(2));
+  TORCH_CHECK(
+      block_mask->size(2) * block_mask_size >= num_queries &&
+          block_mask->size(3) * block_mask_size >= num_keys,
+      "block_mask should have a block for every query and key");
+  TORCH_CHECK(block_mask->is_cuda() && block_mask->stride(3) == 1);
+}
+
+} // namespace
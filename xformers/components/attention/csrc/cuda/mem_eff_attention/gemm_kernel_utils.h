@@ -5,17 +5,49 @@
 ////////////////////////////////////////////////////////////////////////////////
 // Some helper functions
 ////////////////////////////////////////////////////////////////////////////////
+// The dtypes left out of the build (see `XFORMERS_MEM_EFF_ATTENTION_DTYPES`
+// in setup.py) have no kernels, and raise an error instead
+#define _DISPATCH_TYPE_DISABLED(DTYPE_NAME)                                    \
+  TORCH_CHECK(                                                                 \
+      false,                                                                   \
+      DTYPE_NAME " support of the cutlass attention kernels was "              \
+                 "left out of this build (XFORMERS_MEM_EFF_ATTENTION_DTYPES)")
+#ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F32
+#define _DISPATCH_TYPE_F32(func) _DISPATCH_TYPE_DISABLED("fp32")
+#else
+#define _DISPATCH_TYPE_F32(func) \
+  {                              \
+    using scalar_t = float;      \
+    func();                      \
+  }
+#endif
+#ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F16
+#define _DISPATCH_TYPE_F16(func) _DISPATCH_TYPE_DISABLED("half")
+#else
+#define _DISPATCH_TYPE_F16(func)      \
+  {                                   \
+    using scalar_t = cutlass::half_t; \
+    func();                           \
+  }
+#endif
+#ifdef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BF16
+#define _DISPATCH_TYPE_BF16(func) _DISPATCH_TYPE_DISABLED("bf16")
+#else
+#define _DISPATCH_TYPE_BF16(func)         \
+  {                                       \
+    using scalar_t = cutlass::bfloat16_t; \
+    func();                               \
+  }
+#endif
+
 #define DISPATCH_TYPES(tensor, func)                                        \
   {                                                                         \
     if (query.scalar_type() == at::ScalarType::Float) {                     \
-      using scalar_t = float;                                               \
-      func();                                                               \
+      _DISPATCH_TYPE_F32(func);                                             \
     } else if (query.scalar_type() == at::ScalarType::Half) {               \
-      using scalar_t = cutlass::half_t;                                     \
-      func();                                                               \
+      _DISPATCH_TYPE_F16(func);                                             \
     } else if (query.scalar_type() == at::ScalarType::BFloat16) {           \
-      using scalar_t = cutlass::bfloat16_t;                                 \
-      func();                                                               \
+      _DISPATCH_TYPE_BF16(func);                                            \
     } else {                                                                \
       TORCH_CHECK(false, "Only fp32, half & bf16 supported at the moment"); \
     }                                                                       \
@@ -202,6 +234,21 @@ struct DefaultGemmType<
   using Operator = cutlass::arch::OpMultiplyAdd;
 };
 
+// Specialization for tensorcores with int8 - Sm80+ (int32 accumulator)
+template <typename ArchTag>
+struct DefaultGemmType<
+    ArchTag,
+    int8_t,
+    typename cutlass::platform::enable_if<
+        ArchTag::kMinComputeCapability >= 80>::type> {
+  static constexpr int ThreadK = 64;
+  static constexpr int WarpK = 64;
+  static constexpr int kMinimumAlignment = 16;
+  using OpClass = cutlass::arch::OpClassTensorOp;
+  using InstructionShape = cutlass::gemm::GemmShape<16, 8, 32>;
+  using Operator = cutlass::arch::OpMultiplyAddSaturate;
+};
+
 // Specialization for tensorcores with f16 - Volta
 template <>
 struct DefaultGemmType<cutlass::arch::Sm70, cutlass::half_t, void> {
@@ -213,6 +260,20 @@ struct DefaultGemmType<cutlass::arch::Sm70, cutlass::half_t, void> {
   using Operator = cutlass::arch::OpMultiplyAdd;
 };
 
+// With `kTF32`, f32 inputs on Sm80+ use the TF32 tensor cores directly: the
+// inputs are rounded to TF32 once, instead of emulating f32 with 3 TF32 MMAs
+// (`OpMultiplyAddFastF32`). This is about 3x less math, at the precision of
+// `torch.backends.cuda.matmul.allow_tf32`
+template <typename ArchTag, typename scalar_t, bool kTF32>
+struct DefaultGemmTypeTF32 : DefaultGemmType<ArchTag, scalar_t> {};
+
+template <typename ArchTag>
+struct DefaultGemmTypeTF32<ArchTag, float, true>
+    : DefaultGemmType<ArchTag, float> {
+  static_assert(ArchTag::kMinComputeCapability >= 80, "TF32 requires Sm80+");
+  using Operator = cutlass::arch::OpMultiplyAdd;
+};
+
 // Enables to do
 // `auto x = kCondition ? fa(arg) : fb(arg)`
 // when `fa` and `fb` have different types
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+// Biases computed in the kernels from the relative position `key - query`
+// of every score, instead of being read from a [B, H, M, N] tensor:
+// - `alibi_slopes` [num_heads] float32: ALiBi bias `slope[h] * (key - query)`
+// - `rel_pos_bias` [num_heads, 2 * max_distance + 1] float32: element
+//   `max_distance + d` is the bias of the relative position `d`, with `d`
+//   clamped to `[-max_distance, max_distance]`. Bucketed biases (eg T5) are
+//   expanded to this layout for every distance up to the last bucket
+namespace {
+
+void check_generated_bias(
+    const at::Tensor& query,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias) {
+  int64_t num_heads = query.size(2);
+  if (alibi_slopes.has_value()) {
+    TORCH_CHECK(alibi_slopes->scalar_type() == at::ScalarType::Float);
+    TORCH_CHECK(alibi_slopes->dim() == 1);
+    TORCH_CHECK(alibi_slopes->size(0) == num_heads);
+    TORCH_CHECK(alibi_slopes->is_cuda() && alibi_slopes->is_contiguous());
+  }
+  if (rel_pos_bias.has_value()) {
+    TORCH_CHECK(rel_pos_bias->scalar_type() == at::ScalarType::Float);
+    TORCH_CHECK(rel_pos_bias->dim() == 2);
+    TORCH_CHECK(rel_pos_bias->size(0) == num_heads);
+    TORCH_CHECK(
+        rel_pos_bias->size(1) % 2 == 1,
+        "rel_pos_bias should have 2 * max_distance + 1 columns");
+    TORCH_CHECK(rel_pos_bias->is_cuda() && rel_pos_bias->stride(1) == 1);
+  }
+}
+
+} // namespace
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "cutlass/cutlass.h"
+#include "cutlass/layout/pitch_linear.h"
+#include "cutlass/matrix_coord.h"
+
+namespace cutlass {
+namespace transform {
+namespace threadblock {
+
+/// Applies rotary position embeddings (RoPE, "rotate_half" convention) to the
+/// tiles of the query or of the key loaded by `BaseIterator`, a
+/// `PredicatedTileIterator` over an operand of `Q @ K.T`:
+///   x_rot[d] = x[d] * cos[pos, d] - x[d + K/2] * sin[pos, d]   (d < K/2)
+///   x_rot[d] = x[d] * cos[pos, d] + x[d - K/2] * sin[pos, d]   (d >= K/2)
+/// Every tile of `kTileK` channels is loaded along with the tile `K/2`
+/// channels away, which holds the other element of the pairs, so the head dim
+/// should be a multiple of `2 * kTileK`. The rotation is done in registers,
+/// between the global loads and the stores to shared-memory: this requires an
+/// `MmaPipelined`, as `MmaMultistage` copies the tiles with `cp.async`.
+/// `kHeadDimIsRow` is set for the key (column-major [head_dim, num_keys]), and
+/// cleared for the query (row-major [num_queries, head_dim])
+template <typename BaseIterator_, bool kHeadDimIsRow>
+class RotaryTileIterator {
+ public:
+  using BaseIterator = BaseIterator_;
+  using Shape = typename BaseIterator::Shape;
+  using Element = typename BaseIterator::Element;
+  using Layout = typename BaseIterator::Layout;
+  using ThreadMap = typename BaseIterator::ThreadMap;
+  using Params = typename BaseIterator::Params;
+  using Pointer = typename BaseIterator::Pointer;
+  using TensorCoord = typename BaseIterator::TensorCoord;
+  using Index = typename BaseIterator::Index;
+  using LongIndex = typename BaseIterator::LongIndex;
+  using AccessType = typename BaseIterator::AccessType;
+  using Fragment = typename BaseIterator::Fragment;
+  static int const kAdvanceRank = BaseIterator::kAdvanceRank;
+  /// Number of channels of the head dim in a tile
+  static int const kTileK = kHeadDimIsRow ? Shape::kRow : Shape::kColumn;
+
+ private:
+  BaseIterator iterator_;
+  /// The other half of the pairs of the channels of `iterator_`
+  BaseIterator partner_;
+  int32_t half_head_dim_;
+  int32_t num_positions_;
+  /// First channel of the current tile
+  int32_t tile_start_ = 0;
+  /// (channel, position) of the first access of this thread in a tile
+  layout::PitchLinearCoord thread_offset_;
+  const float* cos_ = nullptr;
+  const float* sin_ = nullptr;
+  int32_t table_strideM_ = 0;
+  const int32_t* positions_ = nullptr;
+  int32_t first_position_ = 0;
+
+  /// (channel, position) of `coord`
+  CUTLASS_HOST_DEVICE
+  static layout::PitchLinearCoord to_pitch_linear(TensorCoord const& coord) {
+    return kHeadDimIsRow
+        ? layout::PitchLinearCoord(coord.row(), coord.column())
+        : layout::PitchLinearCoord(coord.column(), coord.row());
+  }
+
+  CUTLASS_HOST_DEVICE
+  static TensorCoord from_pitch_linear(int32_t channel, int32_t position) {
+    return kHeadDimIsRow ? TensorCoord(channel, position)
+                         : TensorCoord(position, channel);
+  }
+
+ public:
+  CUTLASS_HOST_DEVICE
+  RotaryTileIterator(
+      Params const& params,
+      Pointer pointer,
+      TensorCoord extent,
+      int thread_id,
+      TensorCoord const& threadblock_offset)
+      : iterator_(params, pointer, extent, thread_id, threadblock_offset),
+        partner_(
+            params,
+            pointer,
+            extent,
+            thread_id,
+            threadblock_offset +
+                from_pitch_linear(to_pitch_linear(extent).contiguous() / 2, 0)),
+        half_head_dim_(to_pitch_linear(extent).contiguous() / 2),
+        num_positions_(to_pitch_linear(extent).strided()),
+        thread_offset_(
+            ThreadMap::initial_offset(thread_id) +
+            to_pitch_linear(threadblock_offset)) {}
+
+  /// The rows of `cos` / `sin` ([max_position, head_dim]) used for the
+  /// element `i` of the operand are `positions[first_position + i]`, or
+  /// `first_position + i` if `positions` is null
+  CUTLASS_DEVICE
+  void set_rotary_embedding(
+      const float* cos,
+      const float* sin,
+      int32_t table_strideM,
+      const int32_t* positions,
+      int32_t first_position) {
+    cos_ = cos;
+    sin_ = sin;
+    table_strideM_ = table_strideM;
+    positions_ = positions;
+    first_position_ = first_position;
+  }
+
+  CUTLASS_HOST_DEVICE
+  RotaryTileIterator& operator++() {
+    ++iterator_;
+    ++partner_;
+    tile_start_ += kTileK;
+    if (tile_start_ == half_head_dim_) {
+      // The second half of the channels pairs with the first half
+      partner_.add_pointer_offset(-LongIndex(2 * half_head_dim_));
+    }
+    return *this;
+  }
+
+  CUTLASS_HOST_DEVICE
+  void clear_mask(bool enable = true) {
+    iterator_.clear_mask(enable);
+    partner_.clear_mask(enable);
+  }
+
+  CUTLASS_DEVICE
+  void load(Fragment& frag) {
+    iterator_.load(frag);
+    if (tile_start_ >= 2 * half_head_dim_) {
+      // Prefetch past the last tile, with the mask cleared
+      return;
+    }
+    Fragment partner_frag;
+    partner_frag.clear();
+    partner_.load(partner_frag);
+
+    const float partner_sign = tile_start_ < half_head_dim_ ? -1.0f : 1.0f;
+    CUTLASS_PRAGMA_UNROLL
+    for (int s = 0; s < ThreadMap::Iterations::kStrided; ++s) {
+      int32_t row = thread_offset_.strided() + s * ThreadMap::Delta::kStrided;
+      if (row >= num_positions_) {
+        // Out of bounds: zero-filled
+        continue;
+      }
+      int32_t position = positions_ != nullptr
+          ? positions_[first_position_ + row]
+          : first_position_ + row;
+      int64_t table_offset = int64_t(position) * table_strideM_ + tile_start_ +
+          thread_offset_.contiguous();
+      const float* cos_row = cos_ + table_offset;
+      const float* sin_row = sin_ + table_offset;
+      CUTLASS_PRAGMA_UNROLL
+      for (int c = 0; c < ThreadMap::Iterations::kContiguous; ++c) {
+        CUTLASS_PRAGMA_UNROLL
+        for (int v = 0; v < ThreadMap::kElementsPerAccess; ++v) {
+          int idx = (s * ThreadMap::Iterations::kContiguous + c) *
+                  ThreadMap::kElementsPerAccess +
+              v;
+          int channel = c * ThreadMap::Delta::kContiguous + v;
+          float x = float(frag[idx]);
+          float y = float(partner_frag[idx]);
+          frag[idx] = Element(
+              x * __ldg(cos_row + channel) +
+              partner_sign * y * __ldg(sin_row + channel));
+        }
+      }
+    }
+  }
+};
+
+/// No-op for the iterators without RoPE
+template <typename Iterator>
+CUTLASS_DEVICE void set_rotary_embedding(
+    Iterator& iterator,
+    const float* cos,
+    const float* sin,
+    int32_t table_strideM,
+    const int32_t* positions,
+    int32_t first_position) {}
+
+template <typename BaseIterator, bool kHeadDimIsRow>
+CUTLASS_DEVICE void set_rotary_embedding(
+    RotaryTileIterator<BaseIterator, kHeadDimIsRow>& iterator,
+    const float* cos,
+    const float* sin,
+    int32_t table_strideM,
+    const int32_t* positions,
+    int32_t first_position) {
+  iterator.set_rotary_embedding(
+      cos, sin, table_strideM, positions, first_position);
+}
+
+} // namespace threadblock
+} // namespace transform
+} // namespace cutlass
@@ -8,6 +8,8 @@
 #include <cuda_fp16.h>
 
 #include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGeneratorImpl.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
 #include <c10/cuda/CUDAGuard.h>
 
 #include "cutlass/gemm/gemm.h"
@@ -39,6 +41,7 @@
 #include "find_default_mma.h"
 #include "gemm/custom_mma.h"
 #include "mma_from_smem.h"
+#include "philox.h"
 
 #include <inttypes.h>
 
@@ -63,7 +66,12 @@ template <
     // run optimized kernel because memory accesses will be aligned
     bool kIsAligned_,
     // upperbound on `max(value.shape[-1], query.shape[-1])`
-    int kMaxK = std::numeric_limits<int>::max()>
+    int kMaxK = std::numeric_limits<int>::max(),
+    // Fewer pipeline stages and no preloading, for the Sm80 GPUs with less
+    // shared-memory per SM than the A100 - see `use_small_smem_kernel`
+    bool kSmallSmem_ = false,
+    // f32 inputs with TF32 math (Sm80+) - see `DefaultGemmTypeTF32`
+    bool kTF32_ = false>
 struct AttentionBackwardKernel {
   using scalar_t = scalar_t_;
   using output_t = scalar_t;
@@ -71,21 +79,47 @@ struct AttentionBackwardKernel {
   using accum_t = float;
   using ArchTag = ArchTag_;
   static constexpr bool kIsAligned = kIsAligned_;
+  static constexpr bool kSmallSmem = kSmallSmem_;
+  static constexpr bool kTF32 = kTF32_;
+  static_assert(
+      !kSmallSmem || ArchTag::kMinComputeCapability >= 80,
+      "the small shared-memory kernels are for Sm80+");
 
   struct Params {
     // Input tensors
     scalar_t* query_ptr; // [Mq, nH, K]
-    scalar_t* key_ptr; // [Mk, nH, K]
-    scalar_t* value_ptr; // [Mk, nH, Kv]
+    scalar_t* key_ptr; // [Mk, nH_kv, K]
+    scalar_t* value_ptr; // [Mk, nH_kv, Kv]
     lse_scalar_t* logsumexp_ptr; // [nH, Mq]
     scalar_t* output_ptr; // [Mq, nH, Kv]
     scalar_t* grad_output_ptr; // [Mq, nH, Kv]
-    accum_t* delta_ptr; // [Mq, nH]
+    accum_t* delta_ptr; // [nH, Mq]
+    scalar_t* attn_bias_ptr = nullptr; // [nH, Mq, Mk] - can be null
+    // Biases generated from `key - query` - see the forward's Params
+    float* alibi_slopes_ptr = nullptr; // [nH] - can be null
+    float* rel_pos_bias_ptr = nullptr; // [nH, 2 * max_distance + 1]
+    int32_t rel_pos_max_distance = 0;
+    int32_t rel_pos_bias_strideH = 0;
+    // (Mode 1MHK only) sequence `b` is made of the queries/keys
+    // [cu_seqlens_q[b], cu_seqlens_q[b + 1]) / [cu_seqlens_k[b], ...)
+    int32_t* cu_seqlens_q_ptr = nullptr;
+    int32_t* cu_seqlens_k_ptr = nullptr;
+    // (Mode 1MHK only) Sequences processed by the blocks of `blockIdx.z`,
+    // longest first so that they don't end up in the tail of the grid
+    int32_t* batch_order_ptr = nullptr; // [num_batches] - can be null
+    // (Mode 1MHK only) Number of rows of key/value. The rows after the last
+    // sequence are zeroed in dK/dV by its blocks (`num_padding_keys`)
+    int32_t total_keys = 0;
+    int32_t num_padding_keys = 0; // set in `advance_to_block`
 
     // Output tensors
     output_t* grad_query_ptr; //  [Mq, nH, K]
-    output_t* grad_key_ptr; //    [Mk, nH, K]
-    output_t* grad_value_ptr; //  [Mk, nH, Kv]
+    output_t* grad_key_ptr; //    [Mk, nH_kv, K]
+    output_t* grad_value_ptr; //  [Mk, nH_kv, Kv]
+    // (Query-parallel mode only) f32 workspaces for the partial dK/dV of the
+    // splits, written instead of `grad_key_ptr` / `grad_value_ptr`
+    accum_t* grad_key_split_ptr = nullptr; // [num_splits, Mk, nH_kv, K]
+    accum_t* grad_value_split_ptr = nullptr; // [num_splits, Mk, nH_kv, Kv]
 
     // Dimensions/strides
     int32_t head_dim;
@@ -93,12 +127,47 @@ struct AttentionBackwardKernel {
     int32_t num_queries;
     int32_t num_keys;
     int32_t num_heads;
+    // Multi-query / grouped-query attention: `num_heads / num_kv_heads`
+    // consecutive query heads share the same key/value head. A block
+    // processes all the query heads of a group, so that dK/dV are reduced
+    // across the group without going through gmem
+    int32_t num_kv_heads;
+    int32_t head_in_group = 0; // query head processed - see `for_query_head`
     bool causal;
+    // (Causal only) If positive, every query only attends to the
+    // `window_size` latest keys (itself included)
+    int32_t window_size = 0;
+    // Same as in the forward's Params
+    float scale;
+    float softcap = 0.0f;
+    // (Block-sparse only) See the forward's Params. The blocks of queries
+    // processed for a block of keys are aligned on `kBlockSizeI`, so that
+    // they never cross a block of the mask
+    uint8_t* block_mask_ptr = nullptr; // [nH, Mq / size, Mk / size]
+    int32_t block_mask_size = 0;
+    int32_t block_mask_strideM = 0;
+
+    // Dropout - regenerates the mask of the forward pass. See the forward's
+    // Params for how the Philox offset of every element is computed
+    bool use_dropout = false;
+    float dropout_prob = 0.0f;
+    at::PhiloxCudaState rng_engine_inputs;
+    uint64_t dropout_batch_head_rng_offset = 0; // set in `advance_to_block`
+    uint64_t dropout_strideH = 0; // set in `advance_to_block`
+
+    // Query-parallel mode: the queries are split across `num_splits_query`
+    // blocks (`blockIdx.x`), which each write their partial dK/dV to their
+    // own slice of the f32 grad_key/grad_value workspaces
+    // (`gK/gV_strideSplit`), reduced afterwards. `queries_per_split` is a multiple of `kBlockSizeI`
+    int32_t num_splits_query = 1;
+    int32_t queries_per_split = 0;
+    int32_t split_query_start = 0; // set in `advance_to_block`
 
     int32_t q_strideM;
     int32_t k_strideM;
     int32_t v_strideM;
     int32_t gO_strideM;
+    int32_t bias_strideM = 0;
     int8_t gQKV_strideM_multiplier; // 3 for packed, 1 otherwise
 
     CUTLASS_HOST_DEVICE int32_t o_strideM() const {
@@ -108,18 +177,101 @@ struct AttentionBackwardKernel {
       return gQKV_strideM_multiplier * num_heads * head_dim;
     }
     CUTLASS_HOST_DEVICE int32_t gK_strideM() const {
-      return gQKV_strideM_multiplier * num_heads * head_dim;
+      return gQKV_strideM_multiplier * num_kv_heads * head_dim;
     }
     CUTLASS_HOST_DEVICE int32_t gV_strideM() const {
-      return gQKV_strideM_multiplier * num_heads * head_dim_value;
+      return gQKV_strideM_multiplier * num_kv_heads * head_dim_value;
+    }
+    CUTLASS_HOST_DEVICE int32_t num_queries_per_kv() const {
+      return num_heads / num_kv_heads;
+    }
+    // Queries after this one are out of the window of all the keys of the
+    // block starting at `key_start`
+    CUTLASS_HOST_DEVICE int32_t query_end(int32_t key_start) const {
+      if (window_size > 0) {
+        return cutlass::fast_min(
+            num_queries, key_start + int32_t(kBlockSizeJ) + window_size - 1);
+      }
+      return num_queries;
+    }
+    // First query processed for the block of keys starting at `key_start`
+    CUTLASS_HOST_DEVICE int32_t query_start(int32_t key_start) const {
+      if (causal) {
+        int32_t start = key_start;
+        if (block_mask_ptr != nullptr) {
+          // The queries before `key_start` are masked in `processBlockIJ`
+          start = start / kBlockSizeI * kBlockSizeI;
+        }
+        return cutlass::fast_max(start, split_query_start);
+      }
+      return split_query_start;
+    }
+    // (Block-sparse only) Whether the block of queries starting at `query`
+    // of the `head_offset`-th head after this one attends to the block of
+    // keys starting at `key`
+    CUTLASS_DEVICE bool is_block_active(
+        int32_t query,
+        int32_t key,
+        int32_t head_offset = 0) const {
+      return block_mask_ptr
+          [head_offset * block_mask_strideH +
+           (query / block_mask_size) * block_mask_strideM +
+           key / block_mask_size];
+    }
+    // First query from `query` whose block is processed for the keys
+    // starting at `key_start` (or `query_end`)
+    CUTLASS_DEVICE int32_t next_query_start(
+        int32_t query,
+        int32_t key_start,
+        int32_t head_offset = 0) const {
+      if (block_mask_ptr == nullptr) {
+        return query;
+      }
+      int32_t end = query_end(key_start);
+      if (key_start >= num_keys) {
+        return end;
+      }
+      while (query < end && !is_block_active(query, key_start, head_offset)) {
+        query = (query / block_mask_size + 1) * block_mask_size;
+      }
+      return cutlass::fast_min(query, end);
+    }
+    // (Block-sparse only) Moves the block `query`, `key`, `head_offset`
+    // (relative to this head) to the next one processed by the main loop
+    CUTLASS_DEVICE void skip_masked_blocks(
+        int32_t& query,
+        int32_t& key,
+        int32_t& head_offset) const {
+      if (block_mask_ptr == nullptr) {
+        return;
+      }
+      query = next_query_start(query, key, head_offset);
+      while (query >= query_end(key) && key < num_keys) {
+        if (head_in_group + head_offset + 1 < num_queries_per_kv()) {
+          ++head_offset;
+        } else {
+          key += kBlockSizeJ;
+          head_offset = -head_in_group;
+        }
+        query = next_query_start(query_start(key), key, head_offset);
+      }
+    }
+    // (Block-sparse only) Whether the first block of queries of the first
+    // head is skipped for the keys starting at `key_start`. dK/dV are only
+    // overwritten by that block (accumulated for the next ones), so they
+    // have to be initialized in that case
+    CUTLASS_DEVICE bool first_block_masked(int32_t key_start) const {
+      int32_t query = query_start(key_start);
+      return block_mask_ptr != nullptr && query < query_end(key_start) &&
+          !is_block_active(query, key_start);
     }
 
     // Everything below is only used in `advance_to_block`
     // and shouldn't use registers
     int64_t o_strideH;
-    int32_t q_strideH;
-    int32_t k_strideH;
-    int32_t v_strideH;
+    int64_t q_strideH;
+    int64_t k_strideH;
+    int64_t v_strideH;
     int64_t o_strideB;
     int64_t q_strideB;
     int64_t k_strideB;
@@ -134,37 +286,112 @@ struct AttentionBackwardKernel {
     int64_t gQ_strideH;
     int64_t gK_strideH;
     int64_t gV_strideH;
+    int64_t gK_strideSplit = 0;
+    int64_t gV_strideSplit = 0;
+    int64_t bias_strideB = 0;
+    int64_t bias_strideH = 0;
+    int64_t block_mask_strideB = 0;
+    int64_t block_mask_strideH = 0;
+    int64_t lse_strideB;
+    int64_t lse_strideH;
+    int64_t delta_strideB;
+    int64_t delta_strideH;
 
     CUTLASS_DEVICE void advance_to_block() {
-      constexpr int32_t kAlignLSE = 32; // block size of backward
-      auto lse_dim = ceil_div((int32_t)num_queries, kAlignLSE) * kAlignLSE;
+      int32_t batch_id =
+          batch_order_ptr != nullptr ? batch_order_ptr[blockIdx.z] : blockIdx.z;
+      int32_t kv_head_id = blockIdx.y;
+      // first query head of the group
+      int32_t head_id = kv_head_id * num_queries_per_kv();
+
+      if (use_dropout) {
+        dropout_strideH = uint64_t(num_queries) * num_keys;
+        dropout_batch_head_rng_offset =
+            (uint64_t(batch_id) * num_heads + head_id) * dropout_strideH;
+      }
 
-      int32_t batch_id = blockIdx.z;
-      int32_t head_id = blockIdx.y;
+      // Advance to the current batch. In Mode 1MHK, all the sequences are
+      // concatenated along the first dimension of a batch of size 1
+      int64_t q_start = 0, k_start = 0;
+      int64_t gK_offset = 0, gV_offset = 0;
+      if (cu_seqlens_q_ptr != nullptr) {
+        assert(cu_seqlens_k_ptr != nullptr);
+        cu_seqlens_q_ptr += batch_id;
+        cu_seqlens_k_ptr += batch_id;
+        q_start = cu_seqlens_q_ptr[0];
+        k_start = cu_seqlens_k_ptr[0];
+        num_queries = cu_seqlens_q_ptr[1] - q_start;
+        num_keys = cu_seqlens_k_ptr[1] - k_start;
+        if (batch_id == num_batches - 1) {
+          num_padding_keys = total_keys - cu_seqlens_k_ptr[1];
+        }
+        delta_ptr += q_start;
+      } else {
+        query_ptr += batch_id * q_strideB;
+        key_ptr += batch_id * k_strideB;
+        value_ptr += batch_id * v_strideB;
+        output_ptr += batch_id * o_strideB;
+        grad_output_ptr += batch_id * gO_strideB;
+        delta_ptr += batch_id * delta_strideB;
+        if (attn_bias_ptr != nullptr) {
+          attn_bias_ptr += batch_id * bias_strideB;
+        }
+        grad_query_ptr += batch_id * gQ_strideB;
+        gK_offset = batch_id * gK_strideB;
+        gV_offset = batch_id * gV_strideB;
+      }
 
-      query_ptr += batch_id * q_strideB + head_id * q_strideH;
-      key_ptr += batch_id * k_strideB + head_id * k_strideH;
-      value_ptr += batch_id * v_strideB + head_id * v_strideH;
-      logsumexp_ptr += (batch_id * num_heads + head_id) * lse_dim;
-      output_ptr += batch_id * o_strideB + head_id * o_strideH;
-      grad_output_ptr += batch_id * gO_strideB + head_id * gO_strideH;
-      delta_ptr += (batch_id * num_heads + head_id) * num_queries;
+      query_ptr += q_start * q_strideM + head_id * q_strideH;
+      key_ptr += k_start * k_strideM + kv_head_id * k_strideH;
+      value_ptr += k_start * v_strideM + kv_head_id * v_strideH;
+      // The logsumexp is padded to the longest sequence in Mode 1MHK
+      logsumexp_ptr += batch_id * lse_strideB + head_id * lse_strideH;
+      output_ptr += q_start * o_strideM() + head_id * o_strideH;
+      grad_output_ptr += q_start * gO_strideM + head_id * gO_strideH;
+      delta_ptr += head_id * delta_strideH;
+      if (attn_bias_ptr != nullptr) {
+        attn_bias_ptr += head_id * bias_strideH;
+      }
+      if (alibi_slopes_ptr != nullptr) {
+        alibi_slopes_ptr += head_id;
+      }
+      if (rel_pos_bias_ptr != nullptr) {
+        rel_pos_bias_ptr += head_id * rel_pos_bias_strideH;
+      }
+      if (block_mask_ptr != nullptr) {
+        block_mask_ptr +=
+            batch_id * block_mask_strideB + head_id * block_mask_strideH;
+      }
 
-      grad_query_ptr += batch_id * gQ_strideB + head_id * gQ_strideH;
-      grad_key_ptr += batch_id * gK_strideB + head_id * gK_strideH;
-      grad_value_ptr += batch_id * gV_strideB + head_id * gV_strideH;
+      grad_query_ptr += q_start * gQ_strideM() + head_id * gQ_strideH;
+      gK_offset += k_start * gK_strideM() + kv_head_id * gK_strideH;
+      gV_offset += k_start * gV_strideM() + kv_head_id * gV_strideH;
+
+      if (num_splits_query > 1) {
+        split_query_start = blockIdx.x * queries_per_split;
+        num_queries = cutlass::fast_min(
+            num_queries, split_query_start + queries_per_split);
+        grad_key_split_ptr += gK_offset + blockIdx.x * gK_strideSplit;
+        grad_value_split_ptr += gV_offset + blockIdx.x * gV_strideSplit;
+      } else {
+        grad_key_ptr += gK_offset;
+        grad_value_ptr += gV_offset;
+      }
 
       head_dim = warp_uniform(head_dim);
       head_dim_value = warp_uniform(head_dim_value);
       num_queries = warp_uniform(num_queries);
+      split_query_start = warp_uniform(split_query_start);
       num_keys = warp_uniform(num_keys);
       num_heads = warp_uniform(num_heads);
+      num_kv_heads = warp_uniform(num_kv_heads);
 
       gO_strideM = warp_uniform(gO_strideM);
       gQKV_strideM_multiplier = warp_uniform(gQKV_strideM_multiplier);
       q_strideM = warp_uniform(q_strideM);
       k_strideM = warp_uniform(k_strideM);
       v_strideM = warp_uniform(v_strideM);
+      bias_strideM = warp_uniform(bias_strideM);
 
       query_ptr = warp_uniform(query_ptr);
       key_ptr = warp_uniform(key_ptr);
@@ -173,14 +400,61 @@ struct AttentionBackwardKernel {
       output_ptr = warp_uniform(output_ptr);
       grad_output_ptr = warp_uniform(grad_output_ptr);
       delta_ptr = warp_uniform(delta_ptr);
+      attn_bias_ptr = warp_uniform(attn_bias_ptr);
+      alibi_slopes_ptr = warp_uniform(alibi_slopes_ptr);
+      rel_pos_bias_ptr = warp_uniform(rel_pos_bias_ptr);
+      block_mask_ptr = warp_uniform(block_mask_ptr);
 
       grad_query_ptr = warp_uniform(grad_query_ptr);
       grad_key_ptr = warp_uniform(grad_key_ptr);
       grad_value_ptr = warp_uniform(grad_value_ptr);
+      grad_key_split_ptr = warp_uniform(grad_key_split_ptr);
+      grad_value_split_ptr = warp_uniform(grad_value_split_ptr);
+    }
+
+    // (MQA/GQA only) Returns the params to process the `h`-th query head
+    // of the group, starting from the first one
+    CUTLASS_DEVICE Params for_query_head(int32_t h) const {
+      Params p = *this;
+      p.head_in_group = h;
+      p.query_ptr += h * q_strideH;
+      p.logsumexp_ptr += h * lse_strideH;
+      p.output_ptr += h * o_strideH;
+      p.grad_output_ptr += h * gO_strideH;
+      p.delta_ptr += h * delta_strideH;
+      if (attn_bias_ptr != nullptr) {
+        p.attn_bias_ptr += h * bias_strideH;
+      }
+      if (alibi_slopes_ptr != nullptr) {
+        p.alibi_slopes_ptr += h;
+      }
+      if (rel_pos_bias_ptr != nullptr) {
+        p.rel_pos_bias_ptr += h * rel_pos_bias_strideH;
+      }
+      if (block_mask_ptr != nullptr) {
+        p.block_mask_ptr += h * block_mask_strideH;
+      }
+      p.grad_query_ptr += h * gQ_strideH;
+      p.dropout_batch_head_rng_offset += h * dropout_strideH;
+      return p;
+    }
+
+    // Same as in the forward
+    CUTLASS_DEVICE accum_t
+    generated_bias(accum_t alibi_slope, int32_t query, int32_t key) const {
+      int32_t distance = key - query;
+      accum_t bias = alibi_slope * accum_t(distance);
+      if (rel_pos_bias_ptr != nullptr) {
+        distance = cutlass::fast_min(
+            cutlass::fast_max(distance, -rel_pos_max_distance),
+            rel_pos_max_distance);
+        bias += rel_pos_bias_ptr[distance + rel_pos_max_distance];
+      }
+      return bias;
     }
 
     __host__ dim3 getBlocksGrid() const {
-      return dim3(1, num_heads, num_batches);
+      return dim3(num_splits_query, num_kv_heads, num_batches);
     }
     __host__ dim3 getThreadsGrid() const {
       return dim3(kWarpSize, kNumWarpsPerBlock, 1);
@@ -203,8 +477,8 @@ struct AttentionBackwardKernel {
   // rather than going back to gmem everytime
   static constexpr bool kIsHalf = cutlass::sizeof_bits<scalar_t>::value <= 16;
   static constexpr bool kOutputInRF = kIsHalf && kMaxK <= kBlockSizeI;
-  static constexpr bool kPreloadMmas =
-      kIsHalf && ArchTag::kMinComputeCapability >= 80 && kOutputInRF;
+  static constexpr bool kPreloadMmas = kIsHalf &&
+      ArchTag::kMinComputeCapability >= 80 && kOutputInRF && !kSmallSmem;
   static constexpr bool kPrologueQK = kPreloadMmas;
   static constexpr bool kPrologueGV = kPreloadMmas;
   static constexpr bool kPrologueDOV = kPreloadMmas;
@@ -226,7 +500,7 @@ struct AttentionBackwardKernel {
   static constexpr int64_t kMinBlocksPerSm =
       getWarpsPerSm<scalar_t, ArchTag>() / kNumWarpsPerBlock;
 
-  using GemmType = DefaultGemmType<ArchTag, scalar_t>;
+  using GemmType = DefaultGemmTypeTF32<ArchTag, scalar_t, kTF32>;
   using DefaultConfig =
       typename cutlass::gemm::device::DefaultGemmConfiguration<
           typename GemmType::OpClass,
@@ -236,6 +510,8 @@ struct AttentionBackwardKernel {
           scalar_t, // ElementC
           accum_t // ElementAccumulator
           >;
+  // With 2 stages, the matmuls are pipelined as on Sm75
+  static constexpr int kStages = kSmallSmem ? 2 : DefaultConfig::kStages;
   static constexpr auto kOptimalAlignement =
       std::max(DefaultConfig::kAlignmentA, DefaultConfig::kAlignmentB);
   static constexpr auto kMinimumAlignment = GemmType::kMinimumAlignment;
@@ -265,7 +541,7 @@ struct AttentionBackwardKernel {
         ThreadblockShape,
         WarpShape,
         typename GemmType::InstructionShape,
-        DefaultConfig::kStages,
+        kStages,
         typename GemmType::Operator,
         false, // AccumulatorsInRowMajor = false,
         cutlass::gemm::SharedMemoryClearOption::kNone>;
@@ -317,7 +593,7 @@ struct AttentionBackwardKernel {
         typename GemmType::InstructionShape,
         typename DefaultConfig::EpilogueOutputOp,
         void, // ThreadblockSwizzle - not used
-        DefaultConfig::kStages,
+        kStages,
         false, // SplitKSerial
         typename GemmType::Operator>;
 
@@ -335,6 +611,11 @@ struct AttentionBackwardKernel {
     using OutputTileIterator =
         typename cutlass::epilogue::threadblock::MakePrefetchableIterator<
             typename DefaultEpilogue::OutputTileIterator>::Iterator;
+    // (Query-parallel mode) Over the f32 workspace of the split
+    using OutputTileIteratorSplit =
+        cutlass::epilogue::threadblock::PredicatedTileIteratorPrefetch<
+            typename OutputTileIterator::ThreadMap,
+            accum_t>;
   };
 
   struct MatmulDOIVJ {
@@ -359,7 +640,7 @@ struct AttentionBackwardKernel {
         ThreadblockShape,
         WarpShape,
         typename GemmType::InstructionShape,
-        DefaultConfig::kStages,
+        kStages,
         typename GemmType::Operator,
         false, // AccumulatorsInRowMajor = false,
         cutlass::gemm::SharedMemoryClearOption::kNone>;
@@ -402,7 +683,7 @@ struct AttentionBackwardKernel {
         typename GemmType::InstructionShape,
         typename DefaultConfig::EpilogueOutputOp,
         void, // ThreadblockSwizzle - not used
-        DefaultConfig::kStages,
+        kStages,
         false, // SplitKSerial
         typename GemmType::Operator>;
 
@@ -445,7 +726,7 @@ struct AttentionBackwardKernel {
         typename GemmType::InstructionShape,
         typename DefaultConfig::EpilogueOutputOp,
         void, // ThreadblockSwizzle - not used
-        DefaultConfig::kStages,
+        kStages,
         false, // SplitKSerial
         typename GemmType::Operator>;
 
@@ -463,6 +744,11 @@ struct AttentionBackwardKernel {
     using OutputTileIterator =
         typename cutlass::epilogue::threadblock::MakePrefetchableIterator<
             typename DefaultEpilogue::OutputTileIterator>::Iterator;
+    // (Query-parallel mode) Over the f32 workspace of the split
+    using OutputTileIteratorSplit =
+        cutlass::epilogue::threadblock::PredicatedTileIteratorPrefetch<
+            typename OutputTileIterator::ThreadMap,
+            accum_t>;
   };
 
   // See https://fburl.com/gsheet/l5bltspl
@@ -685,6 +971,28 @@ struct AttentionBackwardKernel {
         p.k_strideH % kMinimumAlignment == 0, "key is not correctly aligned");
     TORCH_CHECK(
         p.v_strideH % kMinimumAlignment == 0, "value is not correctly aligned");
+    TORCH_CHECK(
+        p.num_kv_heads > 0 && p.num_heads % p.num_kv_heads == 0,
+        "num_heads must be a multiple of num_kv_heads");
+    TORCH_CHECK(
+        !p.use_dropout || (p.dropout_prob >= 0.0f && p.dropout_prob < 1.0f),
+        "dropout probability must be in [0, 1)");
+    TORCH_CHECK(
+        p.window_size >= 0 && (p.window_size == 0 || p.causal),
+        "window_size requires causal attention");
+    TORCH_CHECK(
+        p.cu_seqlens_q_ptr == nullptr ||
+            (p.attn_bias_ptr == nullptr && !p.use_dropout),
+        "attn_bias and dropout are not supported with cu_seqlens");
+    if (p.block_mask_ptr != nullptr) {
+      TORCH_CHECK(
+          p.block_mask_size > 0 && p.block_mask_size % kBlockSizeI == 0 &&
+              p.block_mask_size % kBlockSizeJ == 0,
+          "block_mask_size must be a multiple of the kernel's blocks");
+      TORCH_CHECK(
+          p.cu_seqlens_q_ptr == nullptr && p.window_size == 0,
+          "block_mask is not supported with cu_seqlens or window_size");
+    }
   }
 
   static CUTLASS_DEVICE void kernel(Params& p_) {
@@ -695,30 +1003,33 @@ struct AttentionBackwardKernel {
     extern __shared__ char smem_buffer[];
     SharedStorage& shared_storage = *((SharedStorage*)smem_buffer);
 
-    auto getQueryStart = [&](int32_t key_start) {
-      if (p.causal) {
-        return key_start;
-      }
-      return 0;
-    };
-
     if (kPrologueQK) {
-      prologueQkNextIteration<true>(shared_storage, p, 0, 0);
+      int32_t query_start = p.query_start(0);
+      int32_t key_start = 0;
+      int32_t head_offset = 0;
+      p.skip_masked_blocks(query_start, key_start, head_offset);
+      prologueQkNextIteration<true>(
+          shared_storage, p, query_start, key_start, head_offset);
     }
 
     // Computes (dO*out).sum(-1) and writes it to `p.delta_ptr`
     if (kKernelComputesDelta) {
       constexpr int kOptimalElements =
           128 / cutlass::sizeof_bits<scalar_t>::value;
-      if (p.head_dim_value % kOptimalElements == 0) {
-        for (int query_start = 0; query_start < p.num_queries;
-             query_start += kBlockSizeI) {
-          computeDelta<kOptimalElements>(p, query_start);
-        }
-      } else {
-        for (int query_start = 0; query_start < p.num_queries;
-             query_start += kBlockSizeI) {
-          computeDelta<1>(p, query_start);
+      for (int32_t h = 0; h < p.num_queries_per_kv(); ++h) {
+        Params const ph = p.for_query_head(h);
+        if (p.head_dim_value % kOptimalElements == 0) {
+          for (int query_start = p.split_query_start;
+               query_start < p.num_queries;
+               query_start += kBlockSizeI) {
+            computeDelta<kOptimalElements>(ph, query_start);
+          }
+        } else {
+          for (int query_start = p.split_query_start;
+               query_start < p.num_queries;
+               query_start += kBlockSizeI) {
+            computeDelta<1>(ph, query_start);
+          }
         }
       }
       __syncthreads();
@@ -729,36 +1040,63 @@ struct AttentionBackwardKernel {
     int32_t key_end = p.num_keys / kBlockSizeJ * kBlockSizeJ;
     for (; key_start < key_end; key_start += kBlockSizeJ) {
       output_frags.clear();
-      int32_t query_start = getQueryStart(key_start);
-      int32_t query_end = query_start +
-          (p.num_queries - query_start) / kBlockSizeI * kBlockSizeI;
-      for (; query_start < query_end; query_start += kBlockSizeI) {
-        processBlockIJ<true>(
-            shared_storage, output_frags, p, query_start, key_start);
+      if (!kOutputInRF && p.first_block_masked(key_start)) {
+        zeroGradKV(p, key_start, key_start + kBlockSizeJ);
+        __syncthreads();
       }
-      // last (partial) query
-      if (query_start < p.num_queries) {
-        processBlockIJ<false>(
-            shared_storage, output_frags, p, query_start, key_start);
+      // dK/dV are accumulated over all the query heads of the group. The
+      // masked blocks of queries (block-sparse only) are skipped
+      for (int32_t h = 0; h < p.num_queries_per_kv(); ++h) {
+        Params const ph = p.for_query_head(h);
+        int32_t query_end = p.query_end(key_start);
+        int32_t query_start =
+            ph.next_query_start(p.query_start(key_start), key_start);
+        for (; query_start + kBlockSizeI <= query_end;
+             query_start =
+                 ph.next_query_start(query_start + kBlockSizeI, key_start)) {
+          processBlockIJ<true>(
+              shared_storage, output_frags, ph, query_start, key_start);
+        }
+        // last (partial) query
+        if (query_start < query_end) {
+          processBlockIJ<false>(
+              shared_storage, output_frags, ph, query_start, key_start);
+        }
       }
       if (kOutputInRF) {
         writeFragsToGmem<true>(shared_storage, output_frags, p, key_start);
+      } else if (p.query_start(key_start) >= p.query_end(key_start)) {
+        zeroGradKV(p, key_start, key_start + kBlockSizeJ);
       }
       __syncthreads();
     }
     // Last (partial) key
     if (key_start != p.num_keys) {
       output_frags.clear();
-      for (int32_t query_start = getQueryStart(key_start);
-           query_start < p.num_queries;
-           query_start += kBlockSizeI) {
-        processBlockIJ<false>(
-            shared_storage, output_frags, p, query_start, key_start);
+      if (!kOutputInRF && p.first_block_masked(key_start)) {
+        zeroGradKV(p, key_start, p.num_keys);
+        __syncthreads();
+      }
+      for (int32_t h = 0; h < p.num_queries_per_kv(); ++h) {
+        Params const ph = p.for_query_head(h);
+        for (int32_t query_start =
+                 ph.next_query_start(p.query_start(key_start), key_start);
+             query_start < p.query_end(key_start);
+             query_start =
+                 ph.next_query_start(query_start + kBlockSizeI, key_start)) {
+          processBlockIJ<false>(
+              shared_storage, output_frags, ph, query_start, key_start);
+        }
       }
       if (kOutputInRF) {
         writeFragsToGmem<false>(shared_storage, output_frags, p, key_start);
+      } else if (p.query_start(key_start) >= p.query_end(key_start)) {
+        zeroGradKV(p, key_start, p.num_keys);
       }
     }
+    if (p.num_padding_keys > 0) {
+      zeroGradKV(p, p.num_keys, p.num_keys + p.num_padding_keys);
+    }
   }
 
   static CUTLASS_DEVICE void loadDi(
@@ -783,7 +1121,7 @@ struct AttentionBackwardKernel {
       int32_t query_start,
       int32_t key_start) {
     cutlass::MatrixCoord no_offset{0, 0};
-    accum_t scale = accum_t(1.0 / std::sqrt(float(p.head_dim)));
+    accum_t scale = p.scale;
     int16_t thread_id = threadIdx.x + threadIdx.y * blockDim.x;
     int8_t warp_id = warp_uniform(threadIdx.y);
     int8_t lane_id = threadIdx.x;
@@ -801,7 +1139,7 @@ struct AttentionBackwardKernel {
     auto prologueGradV = [&](int col) {
       typename MatmulGradV::Mma::IteratorB iterator_dO(
           {int32_t(p.gO_strideM)},
-          p.grad_output_ptr + query_start * p.gO_strideM + col,
+          p.grad_output_ptr + int64_t(query_start) * p.gO_strideM + col,
           {num_queries_in_block, p.head_dim_value - col},
           thread_id,
           no_offset);
@@ -814,7 +1152,7 @@ struct AttentionBackwardKernel {
     auto prologueGradQ = [&](int col) {
       typename MatmulGradQ::Mma::IteratorB iterator_K(
           {int32_t(p.k_strideM)},
-          p.key_ptr + key_start * p.k_strideM + col,
+          p.key_ptr + int64_t(key_start) * p.k_strideM + col,
           {num_keys_in_block, p.head_dim - col},
           thread_id,
           no_offset);
@@ -824,7 +1162,7 @@ struct AttentionBackwardKernel {
     auto prologueGradK = [&](int col) {
       typename MatmulGradK::Mma::IteratorB iterator_Q(
           {int32_t(p.q_strideM)},
-          p.query_ptr + query_start * p.q_strideM + col,
+          p.query_ptr + int64_t(query_start) * p.q_strideM + col,
           {num_queries_in_block, p.head_dim - col},
           thread_id,
           no_offset);
@@ -837,13 +1175,13 @@ struct AttentionBackwardKernel {
     auto prologueDOV = [&]() {
       typename MatmulDOIVJ::Mma::IteratorA iterator_A(
           {int32_t(p.gO_strideM)},
-          p.grad_output_ptr + query_start * p.gO_strideM,
+          p.grad_output_ptr + int64_t(query_start) * p.gO_strideM,
           {num_queries_in_block, p.head_dim_value},
           thread_id,
           no_offset);
       typename MatmulDOIVJ::Mma::IteratorB iterator_B(
           {int32_t(p.v_strideM)},
-          p.value_ptr + key_start * p.v_strideM,
+          p.value_ptr + int64_t(key_start) * p.v_strideM,
           {p.head_dim_value, num_keys_in_block},
           thread_id,
           no_offset);
@@ -855,6 +1193,14 @@ struct AttentionBackwardKernel {
           p.head_dim_value);
     };
 
+    using DOIVJRegistersIter = typename DefaultAttentionScalingCoefsUpdater<
+        typename MatmulDOIVJ::Mma::Operator::IteratorC,
+        typename MatmulDOIVJ::DefaultMma::MmaCore::ElementC,
+        kWarpSize>::Updater;
+    // Soft-cap: derivative `1 - tanh^2` of the capped scores, in the layout
+    // of the MatmulDOIVJ epilogue
+    typename MatmulDOIVJ::Mma::FragmentC fragment_softcap;
+
     /////////////////////////////////////////////////////////////////////////////////////////////////
     // MatmulQK
     /////////////////////////////////////////////////////////////////////////////////////////////////
@@ -870,7 +1216,7 @@ struct AttentionBackwardKernel {
       // k_j
       typename Mma::IteratorA iterator_A(
           {int32_t(p.k_strideM)},
-          p.key_ptr + key_start * p.k_strideM,
+          p.key_ptr + int64_t(key_start) * p.k_strideM,
           {problem_size.m(), problem_size.k()},
           thread_id,
           no_offset);
@@ -878,7 +1224,7 @@ struct AttentionBackwardKernel {
       // q_i.transpose(-2, -1)
       typename Mma::IteratorB iterator_B(
           {int32_t(p.q_strideM)},
-          p.query_ptr + query_start * p.q_strideM,
+          p.query_ptr + int64_t(query_start) * p.q_strideM,
           {problem_size.k(), problem_size.n()},
           thread_id,
           no_offset);
@@ -902,6 +1248,19 @@ struct AttentionBackwardKernel {
       mma.set_zero_outside_bounds(!skipBoundsChecks);
       mma(gemm_k_iterations, accum, iterator_A, iterator_B, accum);
       accum = cutlass::multiplies<typename Mma::FragmentC>()(scale, accum);
+      // The derivative of the soft-cap is computed from the f32 scores, as
+      // recovering it from the probabilities rounded to `scalar_t` is too
+      // imprecise when `tanh` is close to 1
+      typename Mma::FragmentC softcap_grad;
+      if (p.softcap > 0.0f) {
+        const accum_t inv_softcap = 1.0f / p.softcap;
+        CUTLASS_PRAGMA_UNROLL
+        for (int i = 0; i < Mma::FragmentC::kElements; ++i) {
+          accum_t t = tanhf(accum[i] * inv_softcap);
+          accum[i] = p.softcap * t;
+          softcap_grad[i] = (accum_t(1) - t) * (accum_t(1) + t);
+        }
+      }
 
       // Epilogue: add LSE + exp and store that to our shared memory buffer
       // shmem <- (matmul_result -
@@ -911,6 +1270,57 @@ struct AttentionBackwardKernel {
       auto output_tile_coords = cutlass::MatrixCoord{
           warp_idx_mn_0 % Mma::Base::WarpCount::kM,
           warp_idx_mn_0 / Mma::Base::WarpCount::kM};
+      // Add the attention bias used in the forward
+      if (p.attn_bias_ptr != nullptr) {
+        auto lane_offset = MatmulQK::ScalingCoefsUpdater::get_lane_offset(
+            lane_id, warp_id, output_tile_coords);
+        MatmulQK::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              // (don't forget we are transposed!)
+              if (accum_m < num_keys_in_block &&
+                  accum_n < num_queries_in_block) {
+                int64_t bias_idx =
+                    int64_t(query_start + accum_n) * p.bias_strideM +
+                    key_start + accum_m;
+                accum[idx] += accum_t(p.attn_bias_ptr[bias_idx]);
+              }
+            },
+            [&](int accum_m) {});
+      }
+      if (p.alibi_slopes_ptr != nullptr || p.rel_pos_bias_ptr != nullptr) {
+        accum_t alibi_slope =
+            p.alibi_slopes_ptr != nullptr ? *p.alibi_slopes_ptr : accum_t(0);
+        auto lane_offset = MatmulQK::ScalingCoefsUpdater::get_lane_offset(
+            lane_id, warp_id, output_tile_coords);
+        MatmulQK::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              // (don't forget we are transposed!)
+              accum[idx] += p.generated_bias(
+                  alibi_slope, query_start + accum_n, key_start + accum_m);
+            },
+            [&](int accum_m) {});
+      }
+      // Mask out the keys before the window (`key <= query - window_size`)
+      if (p.window_size > 0 &&
+          key_start + p.window_size < query_start + kBlockSizeI) {
+        auto lane_offset = MatmulQK::ScalingCoefsUpdater::get_lane_offset(
+            lane_id, warp_id, output_tile_coords);
+        MatmulQK::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              // (don't forget we are transposed!)
+              if (key_start + accum_m <=
+                  query_start + accum_n - p.window_size) {
+                accum[idx] = -std::numeric_limits<accum_t>::infinity();
+              }
+            },
+            [&](int accum_m) {});
+      }
       // Apply mask
       if (p.causal) {
         auto lane_offset = MatmulQK::ScalingCoefsUpdater::get_lane_offset(
@@ -934,6 +1344,40 @@ struct AttentionBackwardKernel {
       if (kPrologueDOV) {
         prologueDOV();
       }
+      // The layouts of the accumulators of MatmulQK and MatmulDOIVJ differ:
+      // go through the smem of `attn_T`, before the probabilities are stored
+      if (p.softcap > 0.0f) {
+        MatmulQK::B2bGemm::accumToSmem(
+            shared_storage.attn_shared_storage(),
+            softcap_grad,
+            lane_id,
+            output_tile_coords);
+        __syncthreads();
+        using MmaDOIVJ = typename MatmulDOIVJ::Mma;
+        int warp_idx_mn_doivj = warp_id %
+            (MmaDOIVJ::Base::WarpCount::kM * MmaDOIVJ::Base::WarpCount::kN);
+        auto lane_offset = DOIVJRegistersIter::get_lane_offset(
+            lane_id,
+            warp_id,
+            cutlass::MatrixCoord{
+                warp_idx_mn_doivj % MmaDOIVJ::Base::WarpCount::kM,
+                warp_idx_mn_doivj / MmaDOIVJ::Base::WarpCount::kM});
+        auto softcap_T = shared_storage.attn_shared_storage().accum_ref();
+        DOIVJRegistersIter::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              if (skipBoundsChecks ||
+                  (accum_m < num_queries_in_block &&
+                   accum_n < num_keys_in_block)) {
+                fragment_softcap[idx] = softcap_T.at({accum_n, accum_m});
+              } else {
+                fragment_softcap[idx] = 0;
+              }
+            },
+            [&](int accum_m) {});
+        __syncthreads();
+      }
       MatmulQK::B2bGemm::accumApplyLSEToSmem(
           shared_storage.attn_shared_storage(),
           accum,
@@ -946,6 +1390,65 @@ struct AttentionBackwardKernel {
       __syncthreads();
     }
 
+    // Dropout: `attn_T` is needed both with the mask applied (for dV) and
+    // without it (for dS). Keep the latter in registers, in the layout used
+    // by the MatmulDOIVJ epilogue, and apply the mask in smem
+    typename MatmulDOIVJ::Mma::FragmentC fragment_attn_nodropout;
+    if (p.use_dropout) {
+      using Mma = typename MatmulDOIVJ::Mma;
+      int warp_idx_mn_0 =
+          warp_id % (Mma::Base::WarpCount::kM * Mma::Base::WarpCount::kN);
+      auto output_tile_coords = cutlass::MatrixCoord{
+          warp_idx_mn_0 % Mma::Base::WarpCount::kM,
+          warp_idx_mn_0 / Mma::Base::WarpCount::kM};
+      auto lane_offset = DOIVJRegistersIter::get_lane_offset(
+          lane_id, warp_id, output_tile_coords);
+      auto attn_T = shared_storage.attn_shared_storage().accum_ref();
+      DOIVJRegistersIter::iterateRows(
+          lane_offset,
+          [&](int accum_m) {},
+          [&](int accum_m, int accum_n, int idx) {
+            if (skipBoundsChecks ||
+                (accum_m < num_queries_in_block &&
+                 accum_n < num_keys_in_block)) {
+              fragment_attn_nodropout[idx] = attn_T.at({accum_n, accum_m});
+            } else {
+              fragment_attn_nodropout[idx] = 0;
+            }
+          },
+          [&](int accum_m) {});
+      __syncthreads();
+
+      // Same mask as in the forward: each thread handles 4 consecutive keys
+      // of a query at a time (a column of `attn_T`)
+      static_assert(kBlockSizeJ % 4 == 0, "");
+      using attn_t = typename MatmulQK::AccumulatorSharedStorage::Element;
+      const accum_t dropout_scale = 1.0f / (1.0f - p.dropout_prob);
+      const auto seeds = at::cuda::philox::unpack(p.rng_engine_inputs);
+      for (int32_t idx = thread_id * 4; idx < kBlockSizeI * kBlockSizeJ;
+           idx += kNumThreads * 4) {
+        int32_t query = idx / kBlockSizeJ;
+        int32_t key = idx % kBlockSizeJ;
+        if (query >= num_queries_in_block || key >= num_keys_in_block) {
+          continue;
+        }
+        float4 rand = philox_uniform4(
+            std::get<0>(seeds),
+            0,
+            std::get<1>(seeds) + p.dropout_batch_head_rng_offset +
+                uint64_t(query_start + query) * p.num_keys + key_start + key);
+        float keep[4] = {rand.x, rand.y, rand.z, rand.w};
+        CUTLASS_PRAGMA_UNROLL
+        for (int k = 0; k < 4; ++k) {
+          attn_t& value = attn_T.at({key + k, query});
+          value = keep[k] > p.dropout_prob
+              ? attn_t(accum_t(value) * dropout_scale)
+              : attn_t(0);
+        }
+      }
+      __syncthreads();
+    }
+
     /////////////////////////////////////////////////////////////////////////////////////////////////
     // GradV matmul
     //
@@ -957,16 +1460,20 @@ struct AttentionBackwardKernel {
 
       cutlass::gemm::GemmCoord problem_size(
           num_keys_in_block, p.head_dim_value - col, num_queries_in_block);
-      auto createEpilogueIter = [&]() {
-        return typename MatmulGradV::OutputTileIterator(
-            typename MatmulGradV::OutputTileIterator::Params{p.gV_strideM()},
-            p.grad_value_ptr + key_start * p.gV_strideM() + col,
+      auto withEpilogueIter = [&](auto fn) {
+        visitGradKV<MatmulGradV>(
+            p.grad_value_ptr,
+            p.grad_value_split_ptr,
+            p.gV_strideM(),
+            p.num_splits_query > 1,
+            key_start,
+            col,
             {num_keys_in_block, p.head_dim_value - col},
-            thread_id);
+            fn);
       };
       typename Mma::IteratorB iterator_B(
           {int32_t(p.gO_strideM)},
-          p.grad_output_ptr + query_start * p.gO_strideM + col,
+          p.grad_output_ptr + int64_t(query_start) * p.gO_strideM + col,
           {num_queries_in_block, p.head_dim_value - col},
           thread_id,
           no_offset);
@@ -980,7 +1487,7 @@ struct AttentionBackwardKernel {
           problem_size.k());
 
       if (!kOutputInRF) {
-        createEpilogueIter().prefetch_all();
+        withEpilogueIter([&](auto it) { it.prefetch_all(); });
         output_frags.gradV.clear();
       }
       mma.set_prologue_done(kPrologueGV);
@@ -1002,11 +1509,14 @@ struct AttentionBackwardKernel {
       }
 
       if (!kOutputInRF) {
-        accumulateInGmem<MatmulGradV>(
-            shared_storage.gradV_epilogue(),
-            output_frags.gradV,
-            createEpilogueIter(),
-            query_start == 0 || (p.causal && query_start == key_start));
+        withEpilogueIter([&](auto it) {
+          accumulateInGmem<MatmulGradV>(
+              shared_storage.gradV_epilogue(),
+              output_frags.gradV,
+              it,
+              p.head_in_group == 0 &&
+                  query_start == p.query_start(key_start));
+        });
       }
     }
     __syncthreads();
@@ -1018,7 +1528,7 @@ struct AttentionBackwardKernel {
       // do_i
       typename Mma::IteratorA iterator_A(
           {int32_t(p.gO_strideM)},
-          p.grad_output_ptr + query_start * p.gO_strideM,
+          p.grad_output_ptr + int64_t(query_start) * p.gO_strideM,
           {num_queries_in_block, p.head_dim_value},
           thread_id,
           no_offset);
@@ -1026,7 +1536,7 @@ struct AttentionBackwardKernel {
       // v_j.transpose(-2, -1)
       typename Mma::IteratorB iterator_B(
           {int32_t(p.v_strideM)},
-          p.value_ptr + key_start * p.v_strideM,
+          p.value_ptr + int64_t(key_start) * p.v_strideM,
           {p.head_dim_value, num_keys_in_block},
           thread_id,
           no_offset);
@@ -1062,10 +1572,7 @@ struct AttentionBackwardKernel {
       // attn_shared_storage  [smem] <- tmp.T
       // doivj_shared_storage [smem] <- tmp
       {
-        using RegistersIter = typename DefaultAttentionScalingCoefsUpdater<
-            typename Mma::Operator::IteratorC,
-            typename MatmulDOIVJ::DefaultMma::MmaCore::ElementC,
-            kWarpSize>::Updater;
+        using RegistersIter = DOIVJRegistersIter;
         auto lane_offset = RegistersIter::get_lane_offset(
             lane_id, warp_id, output_tile_coords);
         auto attn_T = shared_storage.attn_shared_storage().accum_ref();
@@ -1081,6 +1588,15 @@ struct AttentionBackwardKernel {
                   (accum_m < num_queries_in_block &&
                    accum_n < num_keys_in_block)) {
                 fragment_attn[idx] = attn_T.at({accum_n, accum_m});
+                if (p.use_dropout) {
+                  // dP <- dP * Z, where `attn_T` holds the dropped
+                  // probabilities. A zero there is either dropped, or a
+                  // zero probability, in which case dS is zero anyway
+                  accum[idx] = fragment_attn[idx] == accum_t(0)
+                      ? accum_t(0)
+                      : accum[idx] / (1.0f - p.dropout_prob);
+                  fragment_attn[idx] = fragment_attn_nodropout[idx];
+                }
               } else {
                 fragment_attn[idx] = 0;
               }
@@ -1090,6 +1606,10 @@ struct AttentionBackwardKernel {
 
             });
         accum = (accum - fragment_di) * fragment_attn * scale;
+        if (p.softcap > 0.0f) {
+          // Soft-cap backward: dS * (1 - tanh^2)
+          accum = accum * fragment_softcap;
+        }
         // attn <- attn_T.T
         RegistersIter::iterateRows(
             lane_offset,
@@ -1124,7 +1644,7 @@ struct AttentionBackwardKernel {
       auto createEpilogueIter = [&]() {
         return typename MatmulGradQ::OutputTileIterator(
             typename MatmulGradQ::OutputTileIterator::Params{p.gQ_strideM()},
-            p.grad_query_ptr + query_start * p.gQ_strideM() + col,
+            p.grad_query_ptr + int64_t(query_start) * p.gQ_strideM() + col,
             {problem_size.m(), problem_size.n()},
             thread_id);
       };
@@ -1132,7 +1652,7 @@ struct AttentionBackwardKernel {
       // k_j
       typename Mma::IteratorB iterator_B(
           {int32_t(p.k_strideM)},
-          p.key_ptr + key_start * p.k_strideM + col,
+          p.key_ptr + int64_t(key_start) * p.k_strideM + col,
           {problem_size.k(), problem_size.n()},
           thread_id,
           no_offset);
@@ -1217,19 +1737,23 @@ struct AttentionBackwardKernel {
           num_keys_in_block,
           false ? MatmulGradK::ThreadblockShape::kN : p.head_dim - col,
           num_queries_in_block);
-      auto createEpilogueIter = [&]() {
-        return typename MatmulGradK::OutputTileIterator(
-            typename MatmulGradK::OutputTileIterator::Params{p.gK_strideM()},
-            p.grad_key_ptr + key_start * p.gK_strideM() + col,
+      auto withEpilogueIter = [&](auto fn) {
+        visitGradKV<MatmulGradK>(
+            p.grad_key_ptr,
+            p.grad_key_split_ptr,
+            p.gK_strideM(),
+            p.num_splits_query > 1,
+            key_start,
+            col,
             {num_keys_in_block,
              false ? MatmulGradK::ThreadblockShape::kN : p.head_dim - col},
-            thread_id);
+            fn);
       };
 
       // q_i
       typename Mma::IteratorB iterator_B(
           {int32_t(p.q_strideM)},
-          p.query_ptr + query_start * p.q_strideM + col,
+          p.query_ptr + int64_t(query_start) * p.q_strideM + col,
           {problem_size.k(), problem_size.n()},
           thread_id,
           no_offset);
@@ -1244,7 +1768,7 @@ struct AttentionBackwardKernel {
 
       if (!kOutputInRF) {
         output_frags.gradK.clear();
-        createEpilogueIter().prefetch_all();
+        withEpilogueIter([&](auto it) { it.prefetch_all(); });
       }
 
       auto gemm_k_iterations =
@@ -1266,24 +1790,35 @@ struct AttentionBackwardKernel {
       if (kPrologueQK && isLastColumn) {
         int32_t next_query = query_start + kBlockSizeI;
         int32_t next_key = key_start;
-        if (next_query >= p.num_queries) {
-          next_key = key_start + kBlockSizeJ;
-          next_query = p.causal ? next_key : 0;
+        // relative to the current query head
+        int32_t next_head = 0;
+        if (next_query >= p.query_end(key_start)) {
+          if (p.head_in_group + 1 < p.num_queries_per_kv()) {
+            next_head = 1;
+          } else {
+            next_key = key_start + kBlockSizeJ;
+            next_head = -p.head_in_group;
+          }
+          next_query = p.query_start(next_key);
         }
+        p.skip_masked_blocks(next_query, next_key, next_head);
         DISPATCH_BOOL(next_key != key_start, kForceReloadK, ([&]() {
                         prologueQkNextIteration<kForceReloadK>(
-                            shared_storage, p, next_query, next_key);
+                            shared_storage, p, next_query, next_key, next_head);
                       }));
       }
 
       // Output results
       if (!kOutputInRF) {
-        accumulateInGmem<MatmulGradK>(
-            isLastColumn ? shared_storage.gradK_epilogue_final()
-                         : shared_storage.gradK_epilogue(),
-            output_frags.gradK,
-            createEpilogueIter(),
-            query_start == 0 || (p.causal && query_start == key_start));
+        withEpilogueIter([&](auto it) {
+          accumulateInGmem<MatmulGradK>(
+              isLastColumn ? shared_storage.gradK_epilogue_final()
+                           : shared_storage.gradK_epilogue(),
+              output_frags.gradK,
+              it,
+              p.head_in_group == 0 &&
+                  query_start == p.query_start(key_start));
+        });
       }
     }
   }
@@ -1293,7 +1828,8 @@ struct AttentionBackwardKernel {
       SharedStorage& shared_storage,
       Params const& p,
       int32_t query_start,
-      int32_t key_start) {
+      int32_t key_start,
+      int32_t head_offset = 0) {
     if (query_start >= p.num_queries || key_start >= p.num_keys) {
       return;
     }
@@ -1303,14 +1839,15 @@ struct AttentionBackwardKernel {
     auto thread_id = get_thread_id();
     typename MatmulQK::Mma::IteratorA iterator_A(
         {int32_t(p.k_strideM)},
-        p.key_ptr + key_start * p.k_strideM,
+        p.key_ptr + int64_t(key_start) * p.k_strideM,
         {p.num_keys - key_start, p.head_dim},
         thread_id,
         cutlass::MatrixCoord{0, 0});
 
     typename MatmulQK::Mma::IteratorB iterator_B(
         {int32_t(p.q_strideM)},
-        p.query_ptr + query_start * p.q_strideM,
+        p.query_ptr + head_offset * p.q_strideH +
+            int64_t(query_start) * p.q_strideM,
         {p.head_dim, p.num_queries - query_start},
         thread_id,
         cutlass::MatrixCoord{0, 0});
@@ -1333,35 +1870,121 @@ struct AttentionBackwardKernel {
     int32_t num_keys_in_block = skipBoundsChecks
         ? MatmulQK::Mma::Shape::kM
         : std::min((int32_t)MatmulQK::Mma::Shape::kM, p.num_keys - key_start);
-    typename MatmulGradV::OutputTileIterator outputV_it(
-        typename MatmulGradV::OutputTileIterator::Params{p.gV_strideM()},
-        p.grad_value_ptr + key_start * p.gV_strideM(),
+    visitGradKV<MatmulGradV>(
+        p.grad_value_ptr,
+        p.grad_value_split_ptr,
+        p.gV_strideM(),
+        p.num_splits_query > 1,
+        key_start,
+        0,
         {num_keys_in_block, p.head_dim_value},
-        get_thread_id());
-    accumulateInGmem<MatmulGradV>(
-        shared_storage.gradV_epilogue_final(),
-        output_frags.gradV,
-        outputV_it,
-        true);
-
-    typename MatmulGradK::OutputTileIterator outputK_it(
-        typename MatmulGradK::OutputTileIterator::Params{p.gK_strideM()},
-        p.grad_key_ptr + key_start * p.gK_strideM(),
+        [&](auto outputV_it) {
+          accumulateInGmem<MatmulGradV>(
+              shared_storage.gradV_epilogue_final(),
+              output_frags.gradV,
+              outputV_it,
+              true);
+        });
+
+    visitGradKV<MatmulGradK>(
+        p.grad_key_ptr,
+        p.grad_key_split_ptr,
+        p.gK_strideM(),
+        p.num_splits_query > 1,
+        key_start,
+        0,
         {num_keys_in_block,
          false ? MatmulGradK::ThreadblockShape::kN : p.head_dim},
-        get_thread_id());
-    accumulateInGmem<MatmulGradK>(
-        shared_storage.gradK_epilogue_final(),
-        output_frags.gradK,
-        outputK_it,
-        true);
+        [&](auto outputK_it) {
+          accumulateInGmem<MatmulGradK>(
+              shared_storage.gradK_epilogue_final(),
+              output_frags.gradK,
+              outputK_it,
+              true);
+        });
+  }
+
+  // Calls `fn` with an epilogue iterator over the keys [key_start,
+  // key_start + extent.row()) and the columns [col, col + extent.column()) of
+  // dK or dV (`ptr`), or of the f32 workspace of the split (`split_ptr`) in
+  // query-parallel mode
+  template <typename MatmulT, typename Fn>
+  static CUTLASS_DEVICE void visitGradKV(
+      output_t* ptr,
+      accum_t* split_ptr,
+      int32_t strideM,
+      bool is_split,
+      int32_t key_start,
+      int32_t col,
+      cutlass::MatrixCoord extent,
+      Fn fn) {
+    int64_t offset = int64_t(key_start) * strideM + col;
+    if (is_split) {
+      using Iterator = typename MatmulT::OutputTileIteratorSplit;
+      fn(Iterator(
+          typename Iterator::Params{strideM},
+          split_ptr + offset,
+          extent,
+          get_thread_id()));
+    } else {
+      using Iterator = typename MatmulT::OutputTileIterator;
+      fn(Iterator(
+          typename Iterator::Params{strideM},
+          ptr + offset,
+          extent,
+          get_thread_id()));
+    }
+  }
+
+  // Stores zeros to dK/dV for the keys [key_start, key_end), which no query
+  // contributes to (eg causal with more keys than queries), so that they
+  // don't need to be initialized before the kernel. With `kOutputInRF`,
+  // `writeFragsToGmem` already takes care of that
+  static CUTLASS_DEVICE void zeroGradKV(
+      Params const& p,
+      int32_t key_start,
+      int32_t key_end) {
+    if (p.num_splits_query > 1) {
+      zeroRows(
+          p.grad_key_split_ptr, p.gK_strideM(), p.head_dim, key_start, key_end);
+      zeroRows(
+          p.grad_value_split_ptr,
+          p.gV_strideM(),
+          p.head_dim_value,
+          key_start,
+          key_end);
+    } else {
+      zeroRows(p.grad_key_ptr, p.gK_strideM(), p.head_dim, key_start, key_end);
+      zeroRows(
+          p.grad_value_ptr,
+          p.gV_strideM(),
+          p.head_dim_value,
+          key_start,
+          key_end);
+    }
   }
 
-  template <typename MatmulT>
+  template <typename T>
+  static CUTLASS_DEVICE void zeroRows(
+      T* ptr,
+      int32_t strideM,
+      int32_t dim,
+      int32_t key_start,
+      int32_t key_end) {
+    int32_t thread_id = get_thread_id();
+    int64_t num_keys = key_end - key_start;
+    for (int64_t idx = thread_id; idx < num_keys * dim; idx += kNumThreads) {
+      ptr[int64_t(key_start + idx / dim) * strideM + idx % dim] = T(0);
+    }
+  }
+
+  // `OutputTileIterator` is `MatmulT::OutputTileIterator`, or
+  // `MatmulT::OutputTileIteratorSplit` for the f32 workspaces
+  template <typename MatmulT, typename OutputTileIterator>
   static CUTLASS_DEVICE void accumulateInGmem(
       typename MatmulT::DefaultEpilogue::SharedStorage& epilogue_smem,
       typename MatmulT::Mma::FragmentC const& accum,
-      typename MatmulT::OutputTileIterator output_it,
+      OutputTileIterator output_it,
       bool first) {
     using DefaultEpilogue = typename MatmulT::DefaultEpilogue;
     using DefaultOutputOp = typename MatmulT::DefaultOutputOp;
@@ -1373,7 +1996,7 @@ struct AttentionBackwardKernel {
               : cutlass::epilogue::thread::ScaleType::NoBetaScaling;
           using EpilogueOutputOp =
               typename cutlass::epilogue::thread::LinearCombination<
-                  typename DefaultOutputOp::ElementOutput,
+                  typename OutputTileIterator::Element,
                   DefaultOutputOp::kCount,
                   typename DefaultOutputOp::ElementAccumulator,
                   typename DefaultOutputOp::ElementCompute,
@@ -1383,7 +2006,7 @@ struct AttentionBackwardKernel {
                   typename DefaultEpilogue::Shape,
                   typename Mma::Operator,
                   DefaultEpilogue::kPartitionsK,
-                  typename MatmulT::OutputTileIterator,
+                  OutputTileIterator,
                   typename DefaultEpilogue::AccumulatorFragmentIterator,
                   typename DefaultEpilogue::WarpTileIterator,
                   typename DefaultEpilogue::SharedLoadIterator,
@@ -1421,11 +2044,11 @@ struct AttentionBackwardKernel {
     // resulted in error: "restrict" is not allowed
     const AccessType* __restrict__ grad_output_ptr =
         reinterpret_cast<const AccessType*>(
-            p.grad_output_ptr + (query_start + laneRow) * p.gO_strideM +
-            laneFirstCol);
+            p.grad_output_ptr +
+            int64_t(query_start + laneRow) * p.gO_strideM + laneFirstCol);
     const AccessType* __restrict__ output_ptr =
         reinterpret_cast<const AccessType*>(
-            p.output_ptr + (query_start + laneRow) * p.o_strideM() +
+            p.output_ptr + int64_t(query_start + laneRow) * p.o_strideM() +
             laneFirstCol);
 
     static constexpr int64_t kMaxIters =
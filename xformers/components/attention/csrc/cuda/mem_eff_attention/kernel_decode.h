@@ -0,0 +1,562 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+
+#include "cutlass/array.h"
+#include "cutlass/fast_math.h"
+#include "cutlass/numeric_types.h"
+
+#include "gemm_kernel_utils.h"
+
+// Forward for the decoding phase, where every (batch, head) only has a few
+// queries - eg a new token attending to a KV-cache. The tensor-core kernels
+// process at least 32 queries per block, so most of their work is wasted on
+// such inputs, which are limited by the memory bandwidth anyway.
+// Here, a block computes a single row of the output, over a slice of the keys
+// (split-KV, reduced like the split-KV of the tensor-core kernels), with
+// 128 bits loads of K/V and fp32 accumulation:
+// - for every tile of `kKeysPerTile` keys, groups of `kThreadsPerKey` threads
+//   compute the score of a key each (a few vectors of the head dim per thread)
+// - the running max / sum of the softmax are updated for the whole tile
+// - with the same mapping, every thread accumulates its vectors of the output
+//   over the keys of its group, and the groups are reduced at the end
+// With `kKVBits_` = 8 or 4, K/V are a quantized KV-cache (see
+// "kv_cache_quantization.h"), dequantized in registers as they are loaded:
+// only 1/2 or 1/4 of the bytes of f16/bf16 K/V are read
+template <typename scalar_t_, int kMaxK_, int kKVBits_ = 0>
+struct AttentionDecodeKernel {
+  using scalar_t = scalar_t_;
+  static constexpr int kMaxK = kMaxK_;
+  static constexpr int kKVBits = kKVBits_;
+  static constexpr bool kQuantizedKV = kKVBits != 0;
+  // Storage of K/V - the strides are in bytes when quantized
+  using kv_t = typename cutlass::platform::
+      conditional<kQuantizedKV, uint8_t, scalar_t>::type;
+  static constexpr int kNumThreads = 128;
+  static constexpr int kWarpSize = 32;
+  static constexpr int kNumWarps = kNumThreads / kWarpSize;
+  static constexpr int kElementsPerAccess =
+      128 / cutlass::sizeof_bits<scalar_t>::value;
+  static constexpr int kVectorsPerRow = kMaxK / kElementsPerAccess;
+  static constexpr int kThreadsPerKey =
+      kVectorsPerRow < kWarpSize ? kVectorsPerRow : kWarpSize;
+  static constexpr int kVectorsPerThread = kVectorsPerRow / kThreadsPerKey;
+  static constexpr int kKeysPerIteration = kNumThreads / kThreadsPerKey;
+  // One score per thread
+  static constexpr int kKeysPerTile = kNumThreads;
+  // Maximum number of queries per (batch, head) for which this kernel is
+  // used instead of the tensor-core kernels
+  static constexpr int kMaxQueries = 4;
+  // K/V are loaded with the same vectors as the query: fewer bytes when
+  // quantized (8 for int8, 4 for int4), still coalesced across the lanes
+  static constexpr int kKVAlignment = kQuantizedKV
+      ? kElementsPerAccess * kKVBits / 8
+      : kElementsPerAccess;
+
+  static_assert(kMaxK % kElementsPerAccess == 0, "");
+  static_assert(kWarpSize % kThreadsPerKey == 0, "");
+  static_assert(kVectorsPerRow % kThreadsPerKey == 0, "");
+  static_assert(kKeysPerTile % kKeysPerIteration == 0, "");
+  static_assert(
+      kKVBits == 0 ||
+          ((kKVBits == 8 || kKVBits == 4) &&
+           cutlass::sizeof_bits<scalar_t>::value == 16),
+      "quantized K/V are int8 or int4, with a f16/bf16 query");
+
+  using Vector = cutlass::AlignedArray<scalar_t, kElementsPerAccess>;
+
+  // L2 eviction priority of the loads of K/V (sm80+). Every row of K/V is
+  // only read by the blocks of a head group, which run together: it is
+  // streamed (`kEvictFirst`) so that the KV-cache doesn't evict the data
+  // reused by the next kernels, unless it is shared by the whole batch.
+  // With a hint, the query (read by every split) is loaded with `kEvictLast`
+  enum class CacheHint : int32_t { kNormal = 0, kEvictFirst, kEvictLast };
+
+  struct Params {
+    // Same layouts as in the forward's Params (Mode BMHK or paged)
+    const scalar_t* query_ptr; // [B, M, nH, K]
+    const kv_t* key_ptr; // [B, N, nH_kv, K] - or a pool of pages
+    const kv_t* value_ptr; // [B, N, nH_kv, Kv] - or a pool of pages
+    // With split-KV, every split has its own output and logsumexp
+    // (`o_strideSplit` / `lse_strideSplit`)
+    scalar_t* output_ptr; // [B, M, nH, Kv]
+    float* logsumexp_ptr = nullptr; // [B, nH, lse_dim] - can be null
+
+    int32_t* block_tables_ptr = nullptr; // [B, max_pages_per_seq]
+    int32_t* seqlens_k_ptr = nullptr; // [B] - can be null
+    int32_t block_tables_strideB = 0;
+    int32_t page_size = 0;
+
+    float* alibi_slopes_ptr = nullptr; // [nH] - can be null
+    float* rel_pos_bias_ptr = nullptr; // [nH, 2 * max_distance + 1]
+    int32_t rel_pos_max_distance = 0;
+    int32_t rel_pos_bias_strideH = 0;
+
+    int32_t head_dim;
+    int32_t head_dim_value;
+    int32_t num_batches;
+    int32_t num_queries;
+    int32_t num_keys;
+    int32_t num_heads;
+    int32_t num_kv_heads;
+    int32_t lse_dim;
+    bool causal;
+    int32_t window_size = 0;
+    float scale; // Same as in the forward's Params
+    float softcap = 0.0f;
+    CacheHint kv_cache_hint = CacheHint::kNormal;
+
+    int32_t num_splits_key = 1; // `blockIdx.y`
+    int32_t keys_per_split = 0;
+
+    int64_t q_strideB;
+    int64_t k_strideB;
+    int64_t v_strideB;
+    int64_t o_strideB;
+    int64_t q_strideM;
+    int64_t k_strideM;
+    int64_t v_strideM;
+    int64_t o_strideM;
+    int64_t q_strideH;
+    int64_t k_strideH;
+    int64_t v_strideH;
+    int64_t o_strideH;
+    int64_t o_strideSplit = 0;
+    int64_t lse_strideSplit = 0;
+
+    // Quantized K/V only: scale of every group of `k_group_size` /
+    // `v_group_size` channels of a row (same rows as K/V, paged too)
+    const float* k_scale_ptr = nullptr; // [B, N, nH_kv, K / k_group_size]
+    const float* v_scale_ptr = nullptr; // [B, N, nH_kv, Kv / v_group_size]
+    int32_t k_group_size = 0;
+    int32_t v_group_size = 0;
+    int64_t k_scale_strideB = 0;
+    int64_t k_scale_strideM = 0;
+    int64_t k_scale_strideH = 0;
+    int64_t v_scale_strideB = 0;
+    int64_t v_scale_strideM = 0;
+    int64_t v_scale_strideH = 0;
+
+    // Rows `(b * num_queries + m) * num_heads + h` of the output
+    __host__ dim3 getBlocksGrid() const {
+      return dim3(
+          int64_t(num_batches) * num_queries * num_heads, num_splits_key, 1);
+    }
+    __host__ dim3 getThreadsGrid() const {
+      return dim3(kNumThreads, 1, 1);
+    }
+  };
+
+  static bool __host__ check_supported(Params const& p) {
+    // 128 bits loads of every row of Q (and of K/V if not quantized)
+    constexpr int kAlignmentBytes = 16;
+    constexpr int kKVAlignmentBytes = kKVAlignment * sizeof(kv_t);
+    CHECK_ALIGNED_PTR(p.query_ptr, kAlignmentBytes);
+    CHECK_ALIGNED_PTR(p.key_ptr, kKVAlignmentBytes);
+    CHECK_ALIGNED_PTR(p.value_ptr, kKVAlignmentBytes);
+    for (int64_t stride : {p.q_strideB, p.q_strideM, p.q_strideH}) {
+      XFORMERS_CHECK(
+          stride % kElementsPerAccess == 0,
+          "inputs are not aligned for the decode kernel");
+    }
+    for (int64_t stride :
+         {p.k_strideB,
+          p.k_strideM,
+          p.k_strideH,
+          p.v_strideB,
+          p.v_strideM,
+          p.v_strideH}) {
+      XFORMERS_CHECK(
+          stride % kKVAlignment == 0,
+          "inputs are not aligned for the decode kernel");
+    }
+    if (kQuantizedKV) {
+      // A single scale per vector
+      XFORMERS_CHECK(
+          p.k_scale_ptr != nullptr && p.v_scale_ptr != nullptr,
+          "quantized K/V require their scales");
+      XFORMERS_CHECK(
+          p.k_group_size > 0 && p.k_group_size % kElementsPerAccess == 0 &&
+              p.v_group_size > 0 && p.v_group_size % kElementsPerAccess == 0,
+          "the groups of the quantized K/V are too small");
+    }
+    XFORMERS_CHECK(
+        p.head_dim <= kMaxK && p.head_dim_value <= kMaxK,
+        "head_dim is too large for the decode kernel");
+    XFORMERS_CHECK(
+        p.head_dim % kElementsPerAccess == 0 &&
+            p.head_dim_value % kElementsPerAccess == 0,
+        "head_dim is not aligned for the decode kernel");
+    XFORMERS_CHECK(
+        p.num_queries <= kMaxQueries, "too many queries for the decode kernel");
+    XFORMERS_CHECK(
+        p.window_size >= 0 && (p.window_size == 0 || p.causal),
+        "window_size requires causal attention");
+    return true;
+  }
+
+  // Also used for the rows of the scales of quantized K/V
+  template <typename T>
+  static CUTLASS_DEVICE const T* key_row(
+      Params const& p,
+      const T* ptr,
+      int64_t strideB,
+      int64_t strideM,
+      int32_t batch_id,
+      int32_t key) {
+    if (p.block_tables_ptr == nullptr) {
+      return ptr + batch_id * strideB + key * strideM;
+    }
+    int32_t page = p.block_tables_ptr
+                       [batch_id * p.block_tables_strideB + key / p.page_size];
+    return ptr + int64_t(page) * strideB + (key % p.page_size) * strideM;
+  }
+
+  static CUTLASS_DEVICE uint64_t make_l2_policy(CacheHint hint) {
+    uint64_t policy = 0;
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    if (hint == CacheHint::kEvictFirst) {
+      asm("createpolicy.fractional.L2::evict_first.b64 %0, 1.0;"
+          : "=l"(policy));
+    } else if (hint == CacheHint::kEvictLast) {
+      asm("createpolicy.fractional.L2::evict_last.b64 %0, 1.0;"
+          : "=l"(policy));
+    }
+#endif
+    return policy;
+  }
+
+  // 128 bits load, with the L2 `policy` of `hint`
+  static CUTLASS_DEVICE Vector
+  load_vector(const scalar_t* ptr, CacheHint hint, uint64_t policy) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    if (hint != CacheHint::kNormal) {
+      uint4 data;
+      asm("ld.global.L2::cache_hint.v4.u32 {%0, %1, %2, %3}, [%4], %5;"
+          : "=r"(data.x), "=r"(data.y), "=r"(data.z), "=r"(data.w)
+          : "l"(ptr), "l"(policy));
+      return reinterpret_cast<Vector const&>(data);
+    }
+#endif
+    return *reinterpret_cast<const Vector*>(ptr);
+  }
+
+  // Load of the `kKVAlignment` bytes of a vector of quantized K/V (only
+  // `.x` for int4), with the L2 `policy` of `hint`
+  static CUTLASS_DEVICE uint2
+  load_quantized(const uint8_t* ptr, CacheHint hint, uint64_t policy) {
+    uint2 data = make_uint2(0, 0);
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    if (hint != CacheHint::kNormal) {
+      if (kKVBits == 4) {
+        asm("ld.global.L2::cache_hint.u32 %0, [%1], %2;"
+            : "=r"(data.x)
+            : "l"(ptr), "l"(policy));
+      } else {
+        asm("ld.global.L2::cache_hint.v2.u32 {%0, %1}, [%2], %3;"
+            : "=r"(data.x), "=r"(data.y)
+            : "l"(ptr), "l"(policy));
+      }
+      return data;
+    }
+#endif
+    if (kKVBits == 4) {
+      data.x = *reinterpret_cast<const uint32_t*>(ptr);
+    } else {
+      data = *reinterpret_cast<const uint2*>(ptr);
+    }
+    return data;
+  }
+
+  // Channels [col, col + kElementsPerAccess) of a row of K/V - not yet
+  // multiplied by the scale of their group when quantized
+  static CUTLASS_DEVICE void load_kv(
+      const kv_t* row,
+      int32_t col,
+      CacheHint hint,
+      uint64_t policy,
+      float (&out)[kElementsPerAccess]) {
+    if (!kQuantizedKV) {
+      Vector vec = load_vector(
+          reinterpret_cast<const scalar_t*>(row) + col, hint, policy);
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        out[e] = float(vec[e]);
+      }
+      return;
+    }
+    uint2 packed = load_quantized(
+        reinterpret_cast<const uint8_t*>(row) + col * kKVBits / 8,
+        hint,
+        policy);
+    if (kKVBits == 4) {
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        out[e] = float(int((packed.x >> (4 * e)) & 0xF) - 8);
+      }
+    } else {
+      const int8_t* q = reinterpret_cast<const int8_t*>(&packed);
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        out[e] = float(q[e]);
+      }
+    }
+  }
+
+  static CUTLASS_DEVICE void kernel(Params const& p) {
+    __shared__ float scores[kKeysPerTile];
+    __shared__ float warp_max[kNumWarps];
+    __shared__ float partial_out[kKeysPerIteration][kMaxK];
+    __shared__ float partial_sum[kKeysPerIteration];
+
+    int32_t row = blockIdx.x;
+    int32_t head_id = row % p.num_heads;
+    int32_t query = (row / p.num_heads) % p.num_queries;
+    int32_t batch_id = row / (p.num_heads * p.num_queries);
+    int32_t kv_head_id = head_id / (p.num_heads / p.num_kv_heads);
+    int32_t split_id = blockIdx.y;
+
+    int32_t thread_id = threadIdx.x;
+    int32_t lane_id = thread_id % kWarpSize;
+    int32_t warp_id = thread_id / kWarpSize;
+    int32_t group = thread_id / kThreadsPerKey;
+    int32_t lane_in_group = thread_id % kThreadsPerKey;
+
+    // Keys visited by this block
+    int32_t key_begin = 0;
+    int32_t key_end = p.num_keys;
+    if (p.seqlens_k_ptr != nullptr) {
+      key_end = p.seqlens_k_ptr[batch_id];
+    }
+    if (p.causal) {
+      key_end = cutlass::fast_min(key_end, query + 1);
+    }
+    if (p.window_size > 0) {
+      key_begin = cutlass::fast_max(query - p.window_size + 1, int32_t(0));
+    }
+    if (p.num_splits_key > 1) {
+      key_begin = cutlass::fast_max(key_begin, split_id * p.keys_per_split);
+      key_end = cutlass::fast_min(
+          key_end, (split_id + 1) * p.keys_per_split);
+    }
+
+    const CacheHint kv_hint = p.kv_cache_hint;
+    const uint64_t kv_policy = make_l2_policy(kv_hint);
+    const CacheHint q_hint =
+        kv_hint == CacheHint::kNormal ? kv_hint : CacheHint::kEvictLast;
+    const uint64_t q_policy = make_l2_policy(q_hint);
+
+    // Query vectors of this thread, pre-scaled
+    const float scale = p.scale;
+    const scalar_t* query_ptr = p.query_ptr + batch_id * p.q_strideB +
+        query * p.q_strideM + head_id * p.q_strideH;
+    float q[kVectorsPerThread][kElementsPerAccess];
+    CUTLASS_PRAGMA_UNROLL
+    for (int v = 0; v < kVectorsPerThread; ++v) {
+      int32_t col = (v * kThreadsPerKey + lane_in_group) * kElementsPerAccess;
+      Vector vec;
+      vec.clear();
+      if (col < p.head_dim) {
+        vec = load_vector(query_ptr + col, q_hint, q_policy);
+      }
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        q[v][e] = float(vec[e]) * scale;
+      }
+    }
+    float alibi_slope = 0.0f;
+    if (p.alibi_slopes_ptr != nullptr) {
+      alibi_slope = p.alibi_slopes_ptr[head_id];
+    }
+    const float* rel_pos_bias_ptr = p.rel_pos_bias_ptr == nullptr
+        ? nullptr
+        : p.rel_pos_bias_ptr + head_id * p.rel_pos_bias_strideH;
+
+    const kv_t* key_ptr = p.key_ptr + kv_head_id * p.k_strideH;
+    const kv_t* value_ptr = p.value_ptr + kv_head_id * p.v_strideH;
+    const float* k_scale_ptr = p.k_scale_ptr + kv_head_id * p.k_scale_strideH;
+    const float* v_scale_ptr = p.v_scale_ptr + kv_head_id * p.v_scale_strideH;
+
+    float acc[kVectorsPerThread][kElementsPerAccess];
+    CUTLASS_PRAGMA_UNROLL
+    for (int v = 0; v < kVectorsPerThread; ++v) {
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        acc[v][e] = 0.0f;
+      }
+    }
+    float mi = -std::numeric_limits<float>::infinity();
+    float sum = 0.0f; // of the keys of `group`
+
+    for (int32_t tile_start = key_begin; tile_start < key_end;
+         tile_start += kKeysPerTile) {
+      // Scores of the tile
+      for (int32_t j = group; j < kKeysPerTile; j += kKeysPerIteration) {
+        int32_t key = tile_start + j;
+        float score = 0.0f;
+        if (key < key_end) {
+          const kv_t* k_ptr =
+              key_row(p, key_ptr, p.k_strideB, p.k_strideM, batch_id, key);
+          const float* ks_ptr = kQuantizedKV ? key_row(
+                                                   p,
+                                                   k_scale_ptr,
+                                                   p.k_scale_strideB,
+                                                   p.k_scale_strideM,
+                                                   batch_id,
+                                                   key)
+                                             : nullptr;
+          CUTLASS_PRAGMA_UNROLL
+          for (int v = 0; v < kVectorsPerThread; ++v) {
+            int32_t col =
+                (v * kThreadsPerKey + lane_in_group) * kElementsPerAccess;
+            if (col < p.head_dim) {
+              float k[kElementsPerAccess];
+              load_kv(k_ptr, col, kv_hint, kv_policy, k);
+              float dot = 0.0f;
+              CUTLASS_PRAGMA_UNROLL
+              for (int e = 0; e < kElementsPerAccess; ++e) {
+                dot += q[v][e] * k[e];
+              }
+              score += kQuantizedKV ? dot * ks_ptr[col / p.k_group_size] : dot;
+            }
+          }
+        }
+        // The groups of a warp are reduced together
+        CUTLASS_PRAGMA_UNROLL
+        for (int offset = kThreadsPerKey / 2; offset > 0; offset /= 2) {
+          score += __shfl_xor_sync(0xffffffff, score, offset);
+        }
+        if (lane_in_group == 0) {
+          if (key < key_end) {
+            if (p.softcap > 0.0f) {
+              score = p.softcap * tanhf(score / p.softcap);
+            }
+            int32_t distance = key - query;
+            score += alibi_slope * float(distance);
+            if (rel_pos_bias_ptr != nullptr) {
+              distance = cutlass::fast_min(
+                  cutlass::fast_max(distance, -p.rel_pos_max_distance),
+                  p.rel_pos_max_distance);
+              score += rel_pos_bias_ptr[distance + p.rel_pos_max_distance];
+            }
+          } else {
+            score = -std::numeric_limits<float>::infinity();
+          }
+          scores[j] = score;
+        }
+      }
+      __syncthreads();
+
+      // Update the running max, and compute the probabilities of the tile
+      float score = scores[thread_id];
+      float tile_max = score;
+      CUTLASS_PRAGMA_UNROLL
+      for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+        tile_max =
+            fmaxf(tile_max, __shfl_xor_sync(0xffffffff, tile_max, offset));
+      }
+      if (lane_id == 0) {
+        warp_max[warp_id] = tile_max;
+      }
+      __syncthreads();
+      float new_mi = mi;
+      CUTLASS_PRAGMA_UNROLL
+      for (int w = 0; w < kNumWarps; ++w) {
+        new_mi = fmaxf(new_mi, warp_max[w]);
+      }
+      scores[thread_id] = expf(score - new_mi);
+      float correction = expf(mi - new_mi);
+      mi = new_mi;
+      __syncthreads();
+
+      // Accumulate the output
+      sum *= correction;
+      CUTLASS_PRAGMA_UNROLL
+      for (int v = 0; v < kVectorsPerThread; ++v) {
+        CUTLASS_PRAGMA_UNROLL
+        for (int e = 0; e < kElementsPerAccess; ++e) {
+          acc[v][e] *= correction;
+        }
+      }
+      for (int32_t j = group; j < kKeysPerTile; j += kKeysPerIteration) {
+        int32_t key = tile_start + j;
+        if (key >= key_end) {
+          break;
+        }
+        float prob = scores[j];
+        sum += prob;
+        const kv_t* v_ptr =
+            key_row(p, value_ptr, p.v_strideB, p.v_strideM, batch_id, key);
+        const float* vs_ptr = kQuantizedKV ? key_row(
+                                                 p,
+                                                 v_scale_ptr,
+                                                 p.v_scale_strideB,
+                                                 p.v_scale_strideM,
+                                                 batch_id,
+                                                 key)
+                                           : nullptr;
+        CUTLASS_PRAGMA_UNROLL
+        for (int v = 0; v < kVectorsPerThread; ++v) {
+          int32_t col =
+              (v * kThreadsPerKey + lane_in_group) * kElementsPerAccess;
+          if (col < p.head_dim_value) {
+            float val[kElementsPerAccess];
+            load_kv(v_ptr, col, kv_hint, kv_policy, val);
+            float weight =
+                kQuantizedKV ? prob * vs_ptr[col / p.v_group_size] : prob;
+            CUTLASS_PRAGMA_UNROLL
+            for (int e = 0; e < kElementsPerAccess; ++e) {
+              acc[v][e] += weight * val[e];
+            }
+          }
+        }
+      }
+      __syncthreads();
+    }
+
+    // Reduce the groups
+    CUTLASS_PRAGMA_UNROLL
+    for (int v = 0; v < kVectorsPerThread; ++v) {
+      CUTLASS_PRAGMA_UNROLL
+      for (int e = 0; e < kElementsPerAccess; ++e) {
+        partial_out[group]
+                   [(v * kThreadsPerKey + lane_in_group) * kElementsPerAccess +
+                    e] = acc[v][e];
+      }
+    }
+    if (lane_in_group == 0) {
+      partial_sum[group] = sum;
+    }
+    __syncthreads();
+    float total_sum = 0.0f;
+    for (int g = 0; g < kKeysPerIteration; ++g) {
+      total_sum += partial_sum[g];
+    }
+    // Rows without any key are set to 0, with a logsumexp of -inf (so that
+    // empty splits are ignored by the reduction)
+    float inv_sum = total_sum > 0.0f ? 1.0f / total_sum : 0.0f;
+    scalar_t* output_ptr = p.output_ptr + split_id * p.o_strideSplit +
+        batch_id * p.o_strideB + query * p.o_strideM + head_id * p.o_strideH;
+    for (int32_t col = thread_id; col < p.head_dim_value; col += kNumThreads) {
+      float out = 0.0f;
+      for (int g = 0; g < kKeysPerIteration; ++g) {
+        out += partial_out[g][col];
+      }
+      output_ptr[col] = scalar_t(out * inv_sum);
+    }
+    if (p.logsumexp_ptr != nullptr && thread_id == 0) {
+      p.logsumexp_ptr
+          [split_id * p.lse_strideSplit +
+           (int64_t(batch_id) * p.num_heads + head_id) * p.lse_dim + query] =
+          total_sum > 0.0f ? mi + logf(total_sum)
+                           : -std::numeric_limits<float>::infinity();
+    }
+  }
+};
+
+template <typename AK>
+__global__ void __launch_bounds__(AK::kNumThreads)
+    attention_decode_kernel(typename AK::Params p) {
+  AK::kernel(p);
+}
@@ -1,6 +1,8 @@
 #ifdef HAS_PYTORCH
 #include <ATen/ATen.h>
 #include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGeneratorImpl.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
 #include <c10/cuda/CUDAGuard.h>
 #include <torch/library.h>
 #endif
@@ -27,6 +29,7 @@
 #include "cutlass/gemm/threadblock/default_mma_core_sm80.h"
 #include "cutlass/gemm/threadblock/threadblock_swizzle.h"
 #include "cutlass/matrix_shape.h"
+#include "cutlass/numeric_conversion.h"
 #include "cutlass/platform/platform.h"
 #include "cutlass/transform/threadblock/predicated_tile_iterator.h"
 #include "debug_utils.h"
@@ -34,7 +37,10 @@
 #include "epilogue_rescale_output.h"
 #include "find_default_mma.h"
 #include "gemm_kernel_utils.h"
+#include "iterators/rotary_tile_iterator.h"
+#include "kernel_profile.h"
 #include "mma_from_smem.h"
+#include "philox.h"
 
 #include <inttypes.h>
 
@@ -49,21 +55,71 @@ constexpr int getWarpsPerSm() {
           ? 16
           : 12);
 }
+
+// `IteratorC` over accumulators of type `Element` (with the same layout):
+// the int32 accumulators of an int8 matmul are converted to floats before
+// the softmax
+template <typename IteratorC, typename Element>
+struct AccumulatorIteratorAs {
+  using type = IteratorC;
+};
+
+template <
+    typename Shape,
+    typename ElementC,
+    typename Layout,
+    typename InstructionShape,
+    typename OpDelta,
+    typename Element>
+struct AccumulatorIteratorAs<
+    cutlass::gemm::warp::MmaTensorOpAccumulatorTileIterator<
+        Shape,
+        ElementC,
+        Layout,
+        InstructionShape,
+        OpDelta>,
+    Element> {
+  using type = cutlass::gemm::warp::MmaTensorOpAccumulatorTileIterator<
+      Shape,
+      Element,
+      Layout,
+      InstructionShape,
+      OpDelta>;
+};
 } // namespace
 
 template <
     // The datatype of Q/K/V
     typename scalar_t_,
     // Architecture we are targeting (eg `cutlass::arch::Sm80`)
-    typename ArchTag,
+    typename ArchTag_,
     // If Q/K/V are correctly aligned in memory and we can run a fast kernel
     bool isAligned_,
     int kQueriesPerBlock,
     int kKeysPerBlock,
-    bool kSingleValueIteration // = `value.shape[-1] <= kKeysPerBlock`
-    >
+    bool kSingleValueIteration, // = `value.shape[-1] <= kKeysPerBlock`
+    // If Q/K are int8, with a scale for every token and head. `Q @ K.T` runs
+    // on the int8 tensor cores, and is dequantized before the softmax.
+    // `scalar_t` is the datatype of V (Sm80+ and aligned only)
+    bool kQuantizedQK_ = false,
+    // Fewer pipeline stages, for the Sm80 GPUs with less shared-memory per
+    // SM than the A100 - see `use_small_smem_kernel`
+    bool kSmallSmem_ = false,
+    // f32 inputs with TF32 math (Sm80+) - see `DefaultGemmTypeTF32`
+    bool kTF32_ = false,
+    // RoPE is applied to the query and the key as their tiles are loaded for
+    // `Q @ K.T` (see `RotaryTileIterator`). Sm80+, aligned f16/bf16 only
+    bool kRotaryQK_ = false>
 struct AttentionKernel {
   using scalar_t = scalar_t_;
+  using ArchTag = ArchTag_;
+  static constexpr bool kQuantizedQK = kQuantizedQK_;
+  static constexpr bool kSmallSmem = kSmallSmem_;
+  static constexpr bool kTF32 = kTF32_;
+  static constexpr bool kRotaryQK = kRotaryQK_;
+  // The datatype of Q/K
+  using qk_scalar_t = typename cutlass::platform::
+      conditional<kQuantizedQK, int8_t, scalar_t>::type;
   using accum_t = float;
   using lse_scalar_t = float;
   using output_t = scalar_t;
@@ -72,9 +128,25 @@ struct AttentionKernel {
   // numerical errors
   using output_accum_t = accum_t;
   static constexpr bool kIsAligned = isAligned_;
+  static_assert(
+      !kQuantizedQK ||
+          (ArchTag::kMinComputeCapability >= 80 && kIsAligned &&
+           cutlass::sizeof_bits<scalar_t>::value == 16),
+      "int8 Q/K requires Sm80+, aligned inputs and f16/bf16 values");
+  static_assert(
+      !kSmallSmem || ArchTag::kMinComputeCapability >= 80,
+      "the small shared-memory kernels are for Sm80+");
+  static_assert(
+      !kRotaryQK ||
+          (ArchTag::kMinComputeCapability >= 80 && kIsAligned &&
+           cutlass::sizeof_bits<scalar_t>::value == 16 && !kQuantizedQK &&
+           !kSmallSmem),
+      "RoPE requires Sm80+ and aligned f16/bf16 inputs");
   static constexpr int32_t kAlignLSE = 32; // block size of backward
+  // With 2 stages, the second matmul is pipelined (as on Sm75) and can't
+  // start loading V in advance
   static constexpr bool kPreloadV = ArchTag::kMinComputeCapability >= 80 &&
-      cutlass::sizeof_bits<scalar_t>::value == 16;
+      cutlass::sizeof_bits<scalar_t>::value == 16 && !kSmallSmem;
   static constexpr bool kKeepOutputInRF = kSingleValueIteration;
   static constexpr bool kNeedsOutputAccumulatorBuffer = !kKeepOutputInRF &&
       !cutlass::platform::is_same<output_accum_t, output_t>::value;
@@ -92,11 +164,49 @@ struct AttentionKernel {
 
   struct Params {
     // Input tensors
-    scalar_t* query_ptr; // [num_queries, num_heads, head_dim]
-    scalar_t* key_ptr; // [num_keys, num_heads, head_dim]
-    scalar_t* value_ptr; // [num_keys, num_heads, head_dim_value]
+    qk_scalar_t* query_ptr; // [num_queries, num_heads, head_dim]
+    qk_scalar_t* key_ptr; // [num_keys, num_kv_heads, head_dim]
+    scalar_t* value_ptr; // [num_keys, num_kv_heads, head_dim_value]
     int32_t* cu_seqlens_q_ptr = nullptr;
     int32_t* cu_seqlens_k_ptr = nullptr;
+    // Added to the attention scores before the softmax
+    scalar_t* attn_bias_ptr = nullptr; // [num_heads, num_queries, num_keys]
+    // Biases generated on the fly from the relative position `key - query`,
+    // also added to the scores (see `generated_bias`):
+    // - ALiBi: `alibi_slopes[head] * (key - query)`
+    // - relative position bias: `rel_pos_bias[head, clamp(key - query,
+    //   -rel_pos_max_distance, rel_pos_max_distance) + rel_pos_max_distance]`
+    //   (eg a bucketed T5 bias, expanded for every distance up to the last
+    //   bucket)
+    float* alibi_slopes_ptr = nullptr; // [num_heads] - can be null
+    float* rel_pos_bias_ptr = nullptr; // [num_heads, 2 * max_distance + 1]
+    int32_t rel_pos_max_distance = 0;
+    int32_t rel_pos_bias_strideH = 0;
+
+    // (Paged KV-cache only) `key_ptr` / `value_ptr` point to a pool of pages
+    // of shape [num_pages, page_size, num_heads, head_dim], and
+    // `block_tables_ptr[b, i]` is the page holding keys
+    // [i * page_size, (i + 1) * page_size) of sequence `b`
+    int32_t* block_tables_ptr = nullptr; // [num_batches, max_pages_per_seq]
+    int32_t* seqlens_k_ptr = nullptr; // [num_batches] - can be null
+    int32_t block_tables_strideB = 0;
+    int32_t page_size = 0;
+
+    // (int8 Q/K only) The scores are `q_scale[query] * k_scale[key] *
+    // (query @ key.T)`, with the scales of the head of the query / key
+    const float* q_scale_ptr = nullptr; // [num_queries, num_heads]
+    const float* k_scale_ptr = nullptr; // [num_keys, num_kv_heads]
+    int32_t q_scale_strideM = 0;
+    int32_t k_scale_strideM = 0;
+
+    // (RoPE only, see `kRotaryQK`) The query / key at the index `i` of its
+    // sequence is rotated with the row `rope_positions_q[i]` /
+    // `rope_positions_k[i]` of the tables, or the row `i` if not set
+    const float* rope_cos_ptr = nullptr; // [max_position, head_dim]
+    const float* rope_sin_ptr = nullptr; // [max_position, head_dim]
+    int32_t rope_strideM = 0;
+    const int32_t* rope_positions_q_ptr = nullptr; // [num_queries]
+    const int32_t* rope_positions_k_ptr = nullptr; // [num_keys]
 
     // Output tensors
     output_t* output_ptr; // [num_queries, num_heads, head_dim_value]
@@ -111,34 +221,190 @@ struct AttentionKernel {
     int32_t num_keys;
 
     bool causal;
+    // (Causal only) If positive, every query only attends to the
+    // `window_size` latest keys (itself included). Key blocks entirely out
+    // of the window are skipped
+    int32_t window_size = 0;
+    // Scale of the scores. If `softcap` is positive, the scaled scores are
+    // soft-capped to `softcap * tanh(scores / softcap)` before the bias
+    float scale;
+    float softcap = 0.0f;
+
+    // (Block-sparse only) The query attends to the key only if
+    // `block_mask[batch, head, query / block_mask_size,
+    // key / block_mask_size]` is nonzero. As `block_mask_size` is a multiple
+    // of the blocks of queries and keys, the blocks of the kernel are either
+    // entirely masked, in which case they are skipped, or not masked at all
+    uint8_t* block_mask_ptr = nullptr; // [num_query_blocks, num_key_blocks]
+    int32_t block_mask_size = 0;
+    int32_t block_mask_strideM = 0;
+
+    // (Tree attention only) The queries are draft tokens, which are also the
+    // last `num_queries` keys (`tree_draft_start` onwards): every query
+    // attends to all the keys before, and to the draft `d` iff the bit `d`
+    // of its row of `tree_mask_ptr` is set. Only the last blocks of keys
+    // overlap the drafts, and need the mask
+    const uint32_t* tree_mask_ptr = nullptr; // [num_queries, num_words]
+    int32_t tree_mask_strideM = 0;
+    int32_t tree_draft_start = 0; // set in `advance_to_block`
+
+    // Dropout on the attention probabilities. The mask is generated on the
+    // fly from `rng_engine_inputs`: element (query, key) of batch `b` / head
+    // `h` uses the Philox offset `dropout_batch_head_rng_offset +
+    // query * dropout_strideM + key`, which the backward pass regenerates
+    bool use_dropout = false;
+    float dropout_prob = 0.0f;
+#ifdef HAS_PYTORCH
+    at::PhiloxCudaState rng_engine_inputs;
+#endif
+    uint64_t dropout_batch_head_rng_offset = 0; // set in `advance_to_block`
+    int32_t dropout_strideM = 0; // set in `advance_to_block`
+
+    // (Split-KV only) The keys are split across `num_splits_key` blocks,
+    // each processing at most `keys_per_split` keys. Every split writes its
+    // own output and logsumexp, which are reduced in a second pass
+    int32_t num_splits_key = 1;
+    int32_t keys_per_split = 0;
+    int32_t query_start = 0; // first query of this block - set after advancing
+    int32_t key_start = 0; // first key of this block - set after advancing
+
+    // (Mode 1MHK only) Persistent scheduling: a fixed grid of
+    // `num_persistent_blocks` blocks loops over the work items `[batch_id,
+    // query_tile]` of `work_queue_ptr`, each of them for every head. The
+    // queue is sorted by decreasing cost so that the longest tiles are
+    // scheduled first, and is padded at the end with `batch_id = -1`
+    int32_t* work_queue_ptr = nullptr; // [num_work_tiles, 2]
+    int32_t num_work_tiles = 0;
+    int32_t num_persistent_blocks = 0;
+
+    // (Short keys only) Every block processes `query_tiles_per_block`
+    // consecutive tiles of queries of the same batch and head. When all the
+    // keys fit in a single block of keys (eg cross-attention on a few text
+    // tokens), every tile is a single iteration: the next tiles of the block
+    // read the same keys / values, still in cache, and the setup of the
+    // block is amortized over all of them
+    int32_t query_tiles_per_block = 1;
+
+    // (Profiling builds only) [num_ctas, kNumWarpsPerBlock, kProfileNumPhases]
+    // cycles, zero-initialized (see `kernel_profile.h`)
+    int64_t* profile_ptr = nullptr;
 
     int32_t q_strideM;
     int32_t k_strideM;
     int32_t v_strideM;
+    int32_t bias_strideM = 0;
+    // The output (and its accumulator) can have arbitrary strides, as long as
+    // the last dimension is contiguous, eg to write directly into a slice of
+    // a larger buffer
+    int32_t o_strideM;
+    int32_t o_accum_strideM = 0; // only if `output_accum_ptr` is set
 
     // Everything below is only used in `advance_to_block`
     // and shouldn't use registers
-    int32_t q_strideH;
-    int32_t k_strideH;
-    int32_t v_strideH;
+    int64_t q_strideH;
+    int64_t k_strideH;
+    int64_t v_strideH;
+    int64_t bias_strideH = 0;
+    int64_t o_strideH;
+    int64_t o_accum_strideH = 0;
     int64_t q_strideB;
     int64_t k_strideB;
     int64_t v_strideB;
+    int64_t bias_strideB = 0;
+    int64_t o_strideB;
+    int64_t o_accum_strideB = 0;
+    int64_t block_mask_strideH = 0;
+    int64_t block_mask_strideB = 0;
+    int64_t tree_mask_strideB = 0;
+    int64_t q_scale_strideB = 0;
+    int64_t k_scale_strideB = 0;
+    int64_t rope_positions_q_strideB = 0;
+    int64_t rope_positions_k_strideB = 0;
     int32_t num_batches;
     int32_t num_heads;
-
-    CUTLASS_HOST_DEVICE int32_t o_strideM() const {
-      return head_dim_value * num_heads;
+    // Multi-query / grouped-query attention: `num_heads / num_kv_heads`
+    // consecutive query heads share the same key/value head
+    int32_t num_kv_heads;
+
+    // Returns a pointer to the keys/values starting at `key_start`. With a
+    // paged KV-cache, a block of `kKeysPerBlock` keys never crosses a page
+    // boundary, so the MM0/MM1 iterators can load it as a regular tile
+    CUTLASS_DEVICE qk_scalar_t* key_tile_ptr(int32_t key_start) const {
+      if (block_tables_ptr == nullptr) {
+        return key_ptr + int64_t(key_start) * k_strideM;
+      }
+      return key_ptr +
+          int64_t(block_tables_ptr[key_start / page_size]) * k_strideB +
+          int64_t(key_start % page_size) * k_strideM;
+    }
+    CUTLASS_DEVICE scalar_t* value_tile_ptr(int32_t key_start) const {
+      if (block_tables_ptr == nullptr) {
+        return value_ptr + int64_t(key_start) * v_strideM;
+      }
+      return value_ptr +
+          int64_t(block_tables_ptr[key_start / page_size]) * v_strideB +
+          int64_t(key_start % page_size) * v_strideM;
+    }
+    // First key from `key` whose block is not masked (or `num_keys`)
+    CUTLASS_DEVICE int32_t next_key_start(int32_t key) const {
+      if (block_mask_ptr == nullptr) {
+        return key;
+      }
+      while (key < num_keys && !block_mask_ptr[key / block_mask_size]) {
+        key = (key / block_mask_size + 1) * block_mask_size;
+      }
+      return key;
     }
     // Moves pointers to what we should process
     // Returns "false" if there is no work to do
-    CUTLASS_DEVICE bool advance_to_block() {
-      auto batch_id = blockIdx.z;
-      auto head_id = blockIdx.y;
-      auto query_start = blockIdx.x * kQueriesPerBlock;
-
+    CUTLASS_DEVICE bool advance_to_block(int32_t tile_in_block = 0) {
+      int32_t query_tile = blockIdx.x * query_tiles_per_block + tile_in_block;
+      int32_t head_id = blockIdx.y;
+      int32_t batch_split_id = blockIdx.z;
+      if (causal) {
+        // The blocks are scheduled roughly in the order of their linear id,
+        // while the cost of a query tile grows with its index. Assign the
+        // last query tiles of every head/batch to the first blocks, so that
+        // the tail of the grid is made of the shortest tiles
+        int64_t linear_id = blockIdx.x +
+            int64_t(gridDim.x) * (blockIdx.y + int64_t(gridDim.y) * blockIdx.z);
+        int64_t blocks_per_tile = int64_t(gridDim.y) * gridDim.z;
+        query_tile = gridDim.x - 1 - int32_t(linear_id / blocks_per_tile);
+        int32_t other_id = int32_t(linear_id % blocks_per_tile);
+        head_id = other_id % gridDim.y;
+        batch_split_id = other_id / gridDim.y;
+      }
+      return advance_to_block(
+          batch_split_id / num_splits_key,
+          batch_split_id % num_splits_key,
+          head_id,
+          query_tile * kQueriesPerBlock);
+    }
+    CUTLASS_DEVICE bool advance_to_block(
+        int32_t batch_id,
+        int32_t split_key_id,
+        int32_t head_id,
+        int32_t query_start) {
       auto lse_dim = ceil_div((int32_t)num_queries, kAlignLSE) * kAlignLSE;
 
+      if (num_splits_key > 1) {
+        // Outputs are [num_splits_key, num_batches, ...]
+        int64_t split_offset = int64_t(split_key_id) * num_batches;
+        output_ptr += split_offset * o_strideB;
+        if (output_accum_ptr != nullptr) {
+          output_accum_ptr += split_offset * o_accum_strideB;
+        }
+        logsumexp_ptr += split_offset * num_heads * lse_dim;
+      }
+
+      if (use_dropout) {
+        // Offsets are based on the padded shape, before `num_queries` and
+        // `num_keys` are changed for the current batch
+        dropout_batch_head_rng_offset =
+            (uint64_t(batch_id) * num_heads + head_id) * num_queries * num_keys;
+        dropout_strideM = num_keys;
+      }
+
       int64_t q_start, k_start;
       // Advance to current batch - in case of different sequence lengths
       if (cu_seqlens_q_ptr != nullptr) {
@@ -157,11 +423,32 @@ struct AttentionKernel {
         }
       } else {
         query_ptr += batch_id * q_strideB;
-        key_ptr += batch_id * k_strideB;
-        value_ptr += batch_id * v_strideB;
-        output_ptr += int64_t(batch_id * num_queries) * o_strideM();
+        if (attn_bias_ptr != nullptr) {
+          attn_bias_ptr += batch_id * bias_strideB;
+        }
+        if (block_tables_ptr != nullptr) {
+          // K/V pages are looked up in `key_tile_ptr` / `value_tile_ptr`
+          block_tables_ptr += batch_id * block_tables_strideB;
+          if (seqlens_k_ptr != nullptr) {
+            num_keys = seqlens_k_ptr[batch_id];
+          }
+        } else {
+          key_ptr += batch_id * k_strideB;
+          value_ptr += batch_id * v_strideB;
+        }
+        if (q_scale_ptr != nullptr) {
+          q_scale_ptr += batch_id * q_scale_strideB;
+          k_scale_ptr += batch_id * k_scale_strideB;
+        }
+        if (rope_positions_q_ptr != nullptr) {
+          rope_positions_q_ptr += batch_id * rope_positions_q_strideB;
+        }
+        if (rope_positions_k_ptr != nullptr) {
+          rope_positions_k_ptr += batch_id * rope_positions_k_strideB;
+        }
+        output_ptr += batch_id * o_strideB;
         if (output_accum_ptr != nullptr) {
-          output_accum_ptr += int64_t(batch_id * num_queries) * o_strideM();
+          output_accum_ptr += batch_id * o_accum_strideB;
         }
         q_start = 0;
         k_start = 0;
@@ -169,29 +456,72 @@ struct AttentionKernel {
 
       // Advance to the current batch / head / query_start
       query_ptr += (q_start + query_start) * q_strideM + head_id * q_strideH;
-      key_ptr += k_start * k_strideM + head_id * k_strideH;
-      value_ptr += k_start * v_strideM + head_id * v_strideH;
-      output_ptr += int64_t(q_start + query_start) * o_strideM() +
-          head_id * head_dim_value;
+      auto kv_head_id = head_id / (num_heads / num_kv_heads);
+      key_ptr += k_start * k_strideM + kv_head_id * k_strideH;
+      value_ptr += k_start * v_strideM + kv_head_id * v_strideH;
+      if (q_scale_ptr != nullptr) {
+        q_scale_ptr += (q_start + query_start) * q_scale_strideM + head_id;
+        k_scale_ptr += k_start * k_scale_strideM + kv_head_id;
+      }
+      output_ptr +=
+          int64_t(q_start + query_start) * o_strideM + head_id * o_strideH;
+      if (attn_bias_ptr != nullptr) {
+        attn_bias_ptr +=
+            int64_t(query_start) * bias_strideM + head_id * bias_strideH;
+      }
+      if (alibi_slopes_ptr != nullptr) {
+        alibi_slopes_ptr += head_id;
+      }
+      if (rel_pos_bias_ptr != nullptr) {
+        rel_pos_bias_ptr += head_id * rel_pos_bias_strideH;
+      }
 
       if (output_accum_ptr != nullptr) {
-        output_accum_ptr += int64_t(q_start + query_start) * o_strideM() +
-            head_id * head_dim_value;
+        output_accum_ptr += int64_t(q_start + query_start) * o_accum_strideM +
+            head_id * o_accum_strideH;
       } else {
         // Accumulate directly in the destination buffer (eg for f32)
         output_accum_ptr = (accum_t*)output_ptr;
+        o_accum_strideM = o_strideM;
       }
       if (logsumexp_ptr != nullptr) {
         // lse[batch_id, head_id, query_start]
         logsumexp_ptr +=
-            batch_id * lse_dim * num_heads + head_id * lse_dim + query_start;
+            (int64_t(batch_id) * num_heads + head_id) * lse_dim + query_start;
       }
 
+      if (tree_mask_ptr != nullptr) {
+        tree_mask_ptr += batch_id * tree_mask_strideB;
+        tree_draft_start = num_keys - num_queries;
+      }
       num_queries -= query_start;
+      this->query_start = query_start;
       if (causal) {
         num_keys = cutlass::fast_min(
             int32_t(query_start + kQueriesPerBlock), num_keys);
       }
+      if (window_size > 0) {
+        // First block of keys in the window of `query_start`
+        key_start = cutlass::fast_max(
+                        int32_t(query_start) - window_size + 1, int32_t(0)) /
+            kKeysPerBlock * kKeysPerBlock;
+      }
+      if (num_splits_key > 1) {
+        int32_t split_start = split_key_id * keys_per_split;
+        num_keys = cutlass::fast_min(split_start + keys_per_split, num_keys);
+        key_start = cutlass::fast_max(key_start, split_start);
+      }
+      if (block_mask_ptr != nullptr) {
+        // Row of the mask for the queries of this block
+        block_mask_ptr += batch_id * block_mask_strideB +
+            head_id * block_mask_strideH +
+            (query_start / block_mask_size) * block_mask_strideM;
+        key_start = next_key_start(key_start);
+      }
+      if (num_splits_key > 1 && key_start >= num_keys) {
+        // The logsumexp of this split is initialized to -inf on the host
+        return false;
+      }
       num_batches = 0; // no longer used after
 
       // Make sure the compiler knows these variables are the same on all
@@ -199,21 +529,64 @@ struct AttentionKernel {
       query_ptr = warp_uniform(query_ptr);
       key_ptr = warp_uniform(key_ptr);
       value_ptr = warp_uniform(value_ptr);
+      attn_bias_ptr = warp_uniform(attn_bias_ptr);
+      alibi_slopes_ptr = warp_uniform(alibi_slopes_ptr);
+      rel_pos_bias_ptr = warp_uniform(rel_pos_bias_ptr);
+      block_mask_ptr = warp_uniform(block_mask_ptr);
+      tree_mask_ptr = warp_uniform(tree_mask_ptr);
+      q_scale_ptr = warp_uniform(q_scale_ptr);
+      k_scale_ptr = warp_uniform(k_scale_ptr);
+      rope_positions_q_ptr = warp_uniform(rope_positions_q_ptr);
+      rope_positions_k_ptr = warp_uniform(rope_positions_k_ptr);
+      block_tables_ptr = warp_uniform(block_tables_ptr);
       output_ptr = warp_uniform(output_ptr);
       output_accum_ptr = warp_uniform(output_accum_ptr);
+      o_strideM = warp_uniform(o_strideM);
+      o_accum_strideM = warp_uniform(o_accum_strideM);
       logsumexp_ptr = warp_uniform(logsumexp_ptr);
       num_queries = warp_uniform(num_queries);
       num_keys = warp_uniform(num_keys);
+      this->query_start = warp_uniform(this->query_start);
+      key_start = warp_uniform(key_start);
       head_dim = warp_uniform(head_dim);
       head_dim_value = warp_uniform(head_dim_value);
       return true;
     }
 
+    CUTLASS_HOST_DEVICE bool has_bias() const {
+      return attn_bias_ptr != nullptr || alibi_slopes_ptr != nullptr ||
+          rel_pos_bias_ptr != nullptr;
+    }
+    // Whether the scores are scaled in the accumulator of MM0, rather than
+    // in the exponent of the softmax
+    CUTLASS_HOST_DEVICE bool scales_scores_first() const {
+      return has_bias() || softcap > 0.0f;
+    }
+    // Bias generated for the query `query` and the key `key` of the
+    // current sequence. `alibi_slope` is `*alibi_slopes_ptr` (if set)
+    CUTLASS_DEVICE accum_t
+    generated_bias(accum_t alibi_slope, int32_t query, int32_t key) const {
+      int32_t distance = key - query;
+      accum_t bias = alibi_slope * accum_t(distance);
+      if (rel_pos_bias_ptr != nullptr) {
+        distance = cutlass::fast_min(
+            cutlass::fast_max(distance, -rel_pos_max_distance),
+            rel_pos_max_distance);
+        bias += rel_pos_bias_ptr[distance + rel_pos_max_distance];
+      }
+      return bias;
+    }
+
     __host__ dim3 getBlocksGrid() const {
+      if (work_queue_ptr != nullptr) {
+        return dim3(num_persistent_blocks, 1, 1);
+      }
       return dim3(
-          ceil_div(num_queries, (int32_t)kQueriesPerBlock),
+          ceil_div(
+              ceil_div(num_queries, (int32_t)kQueriesPerBlock),
+              query_tiles_per_block),
           num_heads,
-          num_batches);
+          num_batches * num_splits_key);
     }
     __host__ dim3 getThreadsGrid() const {
       return dim3(kWarpSize, kNumWarpsPerBlock, 1);
@@ -228,18 +601,23 @@ struct AttentionKernel {
       into a shared-memory ("AccumulatorSharedStorage") that is used later as
       operand A for the second matmul (see MM1)
     */
-    using GemmType = DefaultGemmType<ArchTag, scalar_t>;
+    using GemmType = DefaultGemmTypeTF32<ArchTag, qk_scalar_t, kTF32>;
+    // int32 for int8 Q/K
+    using accum_qk_t = typename cutlass::platform::
+        conditional<kQuantizedQK, int32_t, accum_t>::type;
 
     using OpClass = typename GemmType::OpClass;
     using DefaultConfig =
         typename cutlass::gemm::device::DefaultGemmConfiguration<
             OpClass,
             ArchTag,
-            scalar_t,
-            scalar_t,
+            qk_scalar_t,
+            qk_scalar_t,
             scalar_t, // ElementC
-            accum_t // ElementAccumulator
+            accum_qk_t // ElementAccumulator
             >;
+    static constexpr int kStages =
+        kSmallSmem || kRotaryQK ? 2 : DefaultConfig::kStages;
     static constexpr int kAlignmentA =
         kIsAligned ? DefaultConfig::kAlignmentA : GemmType::kMinimumAlignment;
     static constexpr int kAlignmentB =
@@ -247,30 +625,75 @@ struct AttentionKernel {
     using ThreadblockShape = cutlass::gemm::
         GemmShape<kQueriesPerBlock, kKeysPerBlock, GemmType::ThreadK>;
     using WarpShape = cutlass::gemm::GemmShape<32, 32, GemmType::WarpK>;
-    using DefaultMma = typename cutlass::gemm::threadblock::FindDefaultMma<
-        scalar_t, // ElementA,
-        cutlass::layout::RowMajor, // LayoutA,
-        kAlignmentA,
-        scalar_t, // ElementB,
-        cutlass::layout::ColumnMajor, // LayoutB,
-        kAlignmentB,
-        accum_t,
-        cutlass::layout::RowMajor, // LayoutC,
-        OpClass,
-        ArchTag, // ArchTag
-        ThreadblockShape, // ThreadblockShape
-        WarpShape, // WarpShape
-        typename GemmType::InstructionShape, // InstructionShape
-        DefaultConfig::kStages, // Should use `DefaultConfig::kStages`, but that
-                                // uses too much smem
-        typename GemmType::Operator // Operator
-        >::DefaultMma;
+    // With RoPE, the tiles of Q/K are rotated in registers before they are
+    // stored to shared-memory: cutlass' `DefaultMma` with 2 stages is an
+    // `MmaPipelined` (see "find_default_mma.h")
+    using DefaultMma = typename cutlass::platform::conditional<
+        kRotaryQK,
+        cutlass::gemm::threadblock::DefaultMma<
+            qk_scalar_t, // ElementA,
+            cutlass::layout::RowMajor, // LayoutA,
+            kAlignmentA,
+            qk_scalar_t, // ElementB,
+            cutlass::layout::ColumnMajor, // LayoutB,
+            kAlignmentB,
+            accum_qk_t,
+            cutlass::layout::RowMajor, // LayoutC,
+            OpClass,
+            ArchTag, // ArchTag
+            ThreadblockShape, // ThreadblockShape
+            WarpShape, // WarpShape
+            typename GemmType::InstructionShape, // InstructionShape
+            2,
+            typename GemmType::Operator // Operator
+            >,
+        typename cutlass::gemm::threadblock::FindDefaultMma<
+            qk_scalar_t, // ElementA,
+            cutlass::layout::RowMajor, // LayoutA,
+            kAlignmentA,
+            qk_scalar_t, // ElementB,
+            cutlass::layout::ColumnMajor, // LayoutB,
+            kAlignmentB,
+            accum_qk_t,
+            cutlass::layout::RowMajor, // LayoutC,
+            OpClass,
+            ArchTag, // ArchTag
+            ThreadblockShape, // ThreadblockShape
+            WarpShape, // WarpShape
+            typename GemmType::InstructionShape, // InstructionShape
+            kStages,
+            typename GemmType::Operator // Operator
+            >::DefaultMma>::type;
     using MmaCore = typename DefaultMma::MmaCore;
-    using IteratorA = typename DefaultMma::IteratorA;
-    using IteratorB = typename DefaultMma::IteratorB;
-    using Mma = typename DefaultMma::ThreadblockMma;
-    using ScalingCoefsUpdater = typename DefaultAttentionScalingCoefsUpdater<
+    using IteratorA = typename cutlass::platform::conditional<
+        kRotaryQK,
+        cutlass::transform::threadblock::
+            RotaryTileIterator<typename DefaultMma::IteratorA, false>,
+        typename DefaultMma::IteratorA>::type;
+    using IteratorB = typename cutlass::platform::conditional<
+        kRotaryQK,
+        cutlass::transform::threadblock::
+            RotaryTileIterator<typename DefaultMma::IteratorB, true>,
+        typename DefaultMma::IteratorB>::type;
+    using Mma = typename cutlass::platform::conditional<
+        kRotaryQK,
+        cutlass::gemm::threadblock::MmaPipelined<
+            typename MmaCore::Shape,
+            IteratorA,
+            typename MmaCore::SmemIteratorA,
+            IteratorB,
+            typename MmaCore::SmemIteratorB,
+            accum_qk_t,
+            cutlass::layout::RowMajor,
+            typename MmaCore::MmaPolicy>,
+        typename DefaultMma::ThreadblockMma>::type;
+    // The accumulator of `Mma`, once converted to `accum_t`
+    using IteratorC = typename AccumulatorIteratorAs<
         typename Mma::Operator::IteratorC,
+        accum_t>::type;
+    using FragmentC = typename IteratorC::Fragment;
+    using ScalingCoefsUpdater = typename DefaultAttentionScalingCoefsUpdater<
+        IteratorC,
         accum_t,
         kWarpSize>::Updater;
     static_assert(
@@ -282,7 +705,7 @@ struct AttentionKernel {
     // Epilogue to store to shared-memory in a format that we can use later for
     // the second matmul
     using B2bGemm = typename cutlass::gemm::threadblock::B2bGemm<
-        typename Mma::Operator::IteratorC,
+        IteratorC,
         typename Mma::Operator,
         scalar_t,
         WarpShape,
@@ -295,7 +718,7 @@ struct AttentionKernel {
       Second matmul: perform `attn @ V` where `attn` is the attention (not
       normalized) and stored in shared memory
     */
-    using GemmType = DefaultGemmType<ArchTag, scalar_t>;
+    using GemmType = DefaultGemmTypeTF32<ArchTag, scalar_t, kTF32>;
 
     using OpClass = typename GemmType::OpClass;
     using DefaultConfig =
@@ -307,6 +730,7 @@ struct AttentionKernel {
             output_accum_t, // ElementC
             accum_t // ElementAccumulator
             >;
+    static constexpr int kStages = kSmallSmem ? 2 : DefaultConfig::kStages;
     static constexpr int kAlignmentA = DefaultConfig::kAlignmentA; // from smem
     static constexpr int kAlignmentB =
         kIsAligned ? DefaultConfig::kAlignmentB : GemmType::kMinimumAlignment;
@@ -333,7 +757,7 @@ struct AttentionKernel {
         typename GemmType::InstructionShape,
         typename DefaultConfig::EpilogueOutputOp,
         void, // ThreadblockSwizzle - not used
-        DefaultConfig::kStages,
+        kStages,
         false, // SplitKSerial
         typename GemmType::Operator>;
 
@@ -433,14 +857,161 @@ struct AttentionKernel {
         p.k_strideH % kAlignmentK == 0, "key is not correctly aligned");
     XFORMERS_CHECK(
         p.v_strideH % kAlignmentV == 0, "value is not correctly aligned");
+    constexpr int64_t kAlignmentO = MM1::OutputTileIterator::kElementsPerAccess;
+    CHECK_ALIGNED_PTR(p.output_ptr, kAlignmentO);
+    XFORMERS_CHECK(
+        p.o_strideM % kAlignmentO == 0 && p.o_strideH % kAlignmentO == 0 &&
+            p.o_strideB % kAlignmentO == 0,
+        "output is not correctly aligned");
+    if (p.output_accum_ptr != nullptr) {
+      CHECK_ALIGNED_PTR(p.output_accum_ptr, kAlignmentO);
+      XFORMERS_CHECK(
+          p.o_accum_strideM % kAlignmentO == 0 &&
+              p.o_accum_strideH % kAlignmentO == 0 &&
+              p.o_accum_strideB % kAlignmentO == 0,
+          "output_accum is not correctly aligned");
+    }
+    XFORMERS_CHECK(
+        p.num_kv_heads > 0 && p.num_heads % p.num_kv_heads == 0,
+        "num_heads must be a multiple of num_kv_heads");
+    XFORMERS_CHECK(
+        p.attn_bias_ptr == nullptr || p.cu_seqlens_q_ptr == nullptr,
+        "attn_bias is not supported with cu_seqlens");
+    XFORMERS_CHECK(
+        p.rel_pos_bias_ptr == nullptr || p.rel_pos_max_distance >= 0,
+        "invalid rel_pos_max_distance");
+    if (p.block_tables_ptr != nullptr) {
+      XFORMERS_CHECK(
+          p.page_size > 0 && p.page_size % kKeysPerBlock == 0,
+          "page_size must be a multiple of the kernel's keys per block");
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr == nullptr,
+          "paged KV-cache is not supported with cu_seqlens");
+      XFORMERS_CHECK(
+          p.k_strideB % kAlignmentK == 0, "key is not correctly aligned");
+      XFORMERS_CHECK(
+          p.v_strideB % kAlignmentV == 0, "value is not correctly aligned");
+    }
+    if (p.num_splits_key > 1) {
+      XFORMERS_CHECK(
+          p.keys_per_split > 0 && p.keys_per_split % kKeysPerBlock == 0,
+          "keys_per_split must be a multiple of the kernel's keys per block");
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr == nullptr,
+          "split-KV is not supported with cu_seqlens");
+      XFORMERS_CHECK(
+          p.logsumexp_ptr != nullptr, "split-KV requires the logsumexp");
+    }
+    if (kQuantizedQK) {
+      XFORMERS_CHECK(
+          p.q_scale_ptr != nullptr && p.k_scale_ptr != nullptr,
+          "int8 query/key require their scales");
+      XFORMERS_CHECK(
+          p.block_tables_ptr == nullptr,
+          "paged KV-cache is not supported with int8 query/key");
+    }
+    if (kRotaryQK) {
+      XFORMERS_CHECK(
+          p.rope_cos_ptr != nullptr && p.rope_sin_ptr != nullptr,
+          "RoPE requires the cos / sin tables");
+      XFORMERS_CHECK(
+          p.head_dim % (2 * MM0::Mma::Shape::kK) == 0,
+          "RoPE requires a head dim multiple of twice the tiles of MM0");
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr == nullptr && p.block_tables_ptr == nullptr,
+          "RoPE is only supported in Mode BMHK");
+    }
+    XFORMERS_CHECK(
+        p.window_size >= 0 && (p.window_size == 0 || p.causal),
+        "window_size requires causal attention");
+    if (p.block_mask_ptr != nullptr) {
+      XFORMERS_CHECK(
+          p.block_mask_size > 0 && p.block_mask_size % kQueriesPerBlock == 0 &&
+              p.block_mask_size % kKeysPerBlock == 0,
+          "block_mask_size must be a multiple of the kernel's blocks");
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr == nullptr && p.window_size == 0,
+          "block_mask is not supported with cu_seqlens or window_size");
+    }
+    if (p.tree_mask_ptr != nullptr) {
+      XFORMERS_CHECK(
+          !p.causal && p.window_size == 0 && p.cu_seqlens_q_ptr == nullptr &&
+              p.block_mask_ptr == nullptr,
+          "tree_mask is not supported with causal, window_size, cu_seqlens "
+          "or block_mask");
+    }
+    if (p.query_tiles_per_block != 1) {
+      XFORMERS_CHECK(
+          p.query_tiles_per_block > 1 && !p.causal &&
+              p.cu_seqlens_q_ptr == nullptr,
+          "query_tiles_per_block requires non-causal attention in Mode BMHK");
+    }
+    if (p.work_queue_ptr != nullptr) {
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr != nullptr && p.num_splits_key == 1,
+          "the persistent scheduler requires cu_seqlens and no split-KV");
+      XFORMERS_CHECK(
+          p.num_persistent_blocks > 0, "num_persistent_blocks must be set");
+    }
+    if (p.use_dropout) {
+      XFORMERS_CHECK(
+          p.dropout_prob >= 0.0f && p.dropout_prob < 1.0f,
+          "dropout probability must be in [0, 1)");
+      XFORMERS_CHECK(
+          p.cu_seqlens_q_ptr == nullptr,
+          "dropout is not supported with cu_seqlens");
+    }
     return true;
   }
 
+  // Entry point of the kernel: processes the block given by `blockIdx`, or
+  // every work item assigned to this block with the persistent scheduler
+  static void CUTLASS_DEVICE kernel(Params const& params) {
+    if (params.work_queue_ptr == nullptr) {
+      for (int32_t tile = 0; tile < params.query_tiles_per_block; ++tile) {
+        int32_t query_tile = blockIdx.x * params.query_tiles_per_block + tile;
+        if (query_tile * kQueriesPerBlock >= params.num_queries) {
+          return;
+        }
+        Params p = params;
+        if (!p.advance_to_block(tile)) {
+          continue;
+        }
+        attention_kernel(p);
+        // The shared-memory is reused by the next tile
+        __syncthreads();
+      }
+      return;
+    }
+    int32_t num_work_items = params.num_work_tiles * params.num_heads;
+    for (int32_t work_id = blockIdx.x; work_id < num_work_items;
+         work_id += gridDim.x) {
+      int32_t tile_id = work_id / params.num_heads;
+      int32_t batch_id = params.work_queue_ptr[2 * tile_id];
+      if (batch_id < 0) {
+        // Padding - everything afterwards is padding as well
+        break;
+      }
+      Params p = params;
+      if (!p.advance_to_block(
+              batch_id,
+              0,
+              work_id % params.num_heads,
+              params.work_queue_ptr[2 * tile_id + 1] * kQueriesPerBlock)) {
+        continue;
+      }
+      attention_kernel(p);
+      // The shared-memory is reused by the next work item
+      __syncthreads();
+    }
+  }
+
   static void CUTLASS_DEVICE attention_kernel(Params& p) {
     // In this block, we will only ever:
     // - read query[query_start:query_end, :]
     // - write to output[query_start:query_end, :]
 
+    AttentionProfiler profiler;
     extern __shared__ char smem_buffer[];
     SharedStorage& shared_storage = *((SharedStorage*)smem_buffer);
     auto& m_prime = shared_storage.m_prime;
@@ -448,7 +1019,7 @@ struct AttentionKernel {
     auto& si = shared_storage.after_mm0.si;
     auto& mi = shared_storage.mi;
 
-    static_assert(kQueriesPerBlock < kNumWarpsPerBlock * kWarpSize, "");
+    static_assert(kQueriesPerBlock <= kNumWarpsPerBlock * kWarpSize, "");
     if (thread_id() < kQueriesPerBlock) {
       s_prime[thread_id()] = accum_t(0);
       m_prime[thread_id()] =
@@ -461,7 +1032,7 @@ struct AttentionKernel {
     auto createOutputIter = [&](int col) -> typename MM1::OutputTileIterator {
       using OutputTileIterator = typename MM1::OutputTileIterator;
       return OutputTileIterator(
-          typename OutputTileIterator::Params{(int32_t)p.o_strideM()},
+          typename OutputTileIterator::Params{p.o_strideM},
           p.output_ptr,
           typename OutputTileIterator::TensorCoord{
               p.num_queries, p.head_dim_value},
@@ -473,7 +1044,7 @@ struct AttentionKernel {
         typename MM1::OutputTileIteratorAccum {
           using OutputTileIteratorAccum = typename MM1::OutputTileIteratorAccum;
           return OutputTileIteratorAccum(
-              typename OutputTileIteratorAccum::Params{(int32_t)p.o_strideM()},
+              typename OutputTileIteratorAccum::Params{p.o_accum_strideM},
               p.output_accum_ptr,
               typename OutputTileIteratorAccum::TensorCoord{
                   p.num_queries, p.head_dim_value},
@@ -481,9 +1052,56 @@ struct AttentionKernel {
               {0, col});
         };
 
-    // Iterate through keys
-    for (int32_t iter_key_start = 0; iter_key_start < p.num_keys;
-         iter_key_start += kKeysPerBlock) {
+#ifdef HAS_PYTORCH
+    // The dropout mask is generated from these offsets (see `philox.h`)
+    uint64_t dropout_seed = 0;
+    uint64_t dropout_offset = 0;
+    if (p.use_dropout) {
+      const auto seeds = at::cuda::philox::unpack(p.rng_engine_inputs);
+      dropout_seed = std::get<0>(seeds);
+      dropout_offset = std::get<1>(seeds) + p.dropout_batch_head_rng_offset;
+    }
+#endif
+
+    // To make the backward easier, we pad logsumexp with `inf`
+    // this avoids a few bound checks, and is not more expensive during fwd
+    auto writeLogsumexp = [&]() {
+      static_assert(kQueriesPerBlock <= kNumWarpsPerBlock * kWarpSize, "");
+      if (p.logsumexp_ptr && thread_id() < kQueriesPerBlock) {
+        auto lse_dim = ceil_div((int32_t)p.num_queries, kAlignLSE) * kAlignLSE;
+        if (thread_id() < p.num_queries) {
+          p.logsumexp_ptr[thread_id()] = accum_t(mi[thread_id()]) +
+              cutlass::fast_log(accum_t(s_prime[thread_id()]));
+        } else if (thread_id() < lse_dim) {
+          p.logsumexp_ptr[thread_id()] =
+              cutlass::platform::numeric_limits<accum_t>::infinity();
+        }
+      }
+    };
+
+    if (p.block_mask_ptr != nullptr && p.key_start >= p.num_keys) {
+      // All the keys are masked for these queries: the output is zero, and
+      // the logsumexp `-inf` (`mi` and `s_prime` are left as initialized)
+      int32_t num_rows =
+          cutlass::fast_min(int32_t(kQueriesPerBlock), p.num_queries);
+      for (int32_t idx = thread_id(); idx < num_rows * p.head_dim_value;
+           idx += kNumThreads) {
+        p.output_ptr
+            [(idx / p.head_dim_value) * p.o_strideM +
+             idx % p.head_dim_value] = output_t(0);
+      }
+      writeLogsumexp();
+      profiler.end(kProfileSetup);
+      profiler.store(p.profile_ptr, warp_id(), lane_id(), kNumWarpsPerBlock);
+      return;
+    }
+    profiler.end(kProfileSetup);
+
+    // Iterate through keys, skipping the masked blocks
+    int32_t iter_key_next;
+    for (int32_t iter_key_start = p.key_start; iter_key_start < p.num_keys;
+         iter_key_start = iter_key_next) {
+      iter_key_next = p.next_key_start(iter_key_start + kKeysPerBlock);
       int32_t problem_size_0_m =
           cutlass::fast_min((int32_t)kQueriesPerBlock, p.num_queries);
       int32_t problem_size_0_n = cutlass::fast_min(
@@ -495,7 +1113,7 @@ struct AttentionKernel {
       auto prologueV = [&](int blockN) {
         typename MM1::Mma::IteratorB iterator_V(
             typename MM1::IteratorB::Params{MM1::LayoutB(p.v_strideM)},
-            p.value_ptr + iter_key_start * p.v_strideM,
+            p.value_tile_ptr(iter_key_start),
             {problem_size_1_k, problem_size_1_n},
             thread_id(),
             cutlass::MatrixCoord{0, blockN * MM1::Mma::Shape::kN});
@@ -539,10 +1157,26 @@ struct AttentionKernel {
       typename MM0::IteratorB iterator_B(
           typename MM0::IteratorB::Params(
               typename MM0::MmaCore::LayoutB(p.k_strideM)),
-          p.key_ptr + iter_key_start * p.k_strideM,
+          p.key_tile_ptr(iter_key_start),
           {problem_size_0_k, problem_size_0_n},
           thread_id(),
           tb_offset_B);
+      if (kRotaryQK) {
+        cutlass::transform::threadblock::set_rotary_embedding(
+            iterator_A,
+            p.rope_cos_ptr,
+            p.rope_sin_ptr,
+            p.rope_strideM,
+            p.rope_positions_q_ptr,
+            p.query_start);
+        cutlass::transform::threadblock::set_rotary_embedding(
+            iterator_B,
+            p.rope_cos_ptr,
+            p.rope_sin_ptr,
+            p.rope_strideM,
+            p.rope_positions_k_ptr,
+            iter_key_start);
+      }
 
       auto my_warp_id = warp_id();
       auto my_lane_id = lane_id();
@@ -551,31 +1185,108 @@ struct AttentionKernel {
       typename MM0::Mma mma(
           shared_storage.mm0, thread_id(), my_warp_id, my_lane_id);
 
-      typename MM0::Mma::FragmentC accum;
+      typename MM0::Mma::FragmentC accum_qk;
 
-      accum.clear();
+      accum_qk.clear();
 
       auto gemm_k_iterations =
           (problem_size_0_k + MM0::Mma::Shape::kK - 1) / MM0::Mma::Shape::kK;
 
       // Compute threadblock-scoped matrix multiply-add
-      mma(gemm_k_iterations, accum, iterator_A, iterator_B, accum);
+      mma(gemm_k_iterations, accum_qk, iterator_A, iterator_B, accum_qk);
       __syncthreads();
+      profiler.end(kProfileMM0);
 
       if (kPreloadV) {
         prologueV(0);
+        profiler.end(kProfileMM1);
       }
 
-      typename MM0::Mma::Operator::IteratorC::TensorCoord
-          iteratorC_tile_offset = {
-              (tb_tile_offset.m() * MM0::Mma::WarpCount::kM) +
-                  (my_warp_id % MM0::Mma::WarpCount::kM),
-              (tb_tile_offset.n() * MM0::Mma::WarpCount::kN) +
-                  (my_warp_id / MM0::Mma::WarpCount::kM)};
+      typename MM0::IteratorC::TensorCoord iteratorC_tile_offset = {
+          (tb_tile_offset.m() * MM0::Mma::WarpCount::kM) +
+              (my_warp_id % MM0::Mma::WarpCount::kM),
+          (tb_tile_offset.n() * MM0::Mma::WarpCount::kN) +
+              (my_warp_id / MM0::Mma::WarpCount::kM)};
+
+      // Scores in `accum_t` (a no-op unless Q/K are int8)
+      typename MM0::FragmentC accum = cutlass::NumericArrayConverter<
+          accum_t,
+          typename MM0::accum_qk_t,
+          MM0::FragmentC::kElements>()(accum_qk);
+      if (kQuantizedQK) {
+        // Dequantize with the scales of the query and of the key
+        auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
+            lane_id(), warp_id(), iteratorC_tile_offset);
+        accum_t q_scale;
+        MM0::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {
+              q_scale = accum_m < problem_size_0_m
+                  ? p.q_scale_ptr[accum_m * p.q_scale_strideM]
+                  : accum_t(0);
+            },
+            [&](int accum_m, int accum_n, int idx) {
+              accum_t k_scale = accum_n < problem_size_0_n
+                  ? p.k_scale_ptr
+                        [int64_t(iter_key_start + accum_n) *
+                         p.k_scale_strideM]
+                  : accum_t(0);
+              accum[idx] *= q_scale * k_scale;
+            },
+            [&](int accum_m) {});
+      }
+
+      // Soft-cap and add the attention bias. In that case, the scaling is
+      // applied to the scores first, as the bias should not be scaled
+      if (p.scales_scores_first()) {
+        accum = cutlass::multiplies<typename MM0::FragmentC>()(
+            p.scale, accum);
+      }
+      if (p.softcap > 0.0f) {
+        const accum_t inv_softcap = 1.0f / p.softcap;
+        CUTLASS_PRAGMA_UNROLL
+        for (int i = 0; i < MM0::FragmentC::kElements; ++i) {
+          accum[i] = p.softcap * tanhf(accum[i] * inv_softcap);
+        }
+      }
+      if (p.attn_bias_ptr != nullptr) {
+        auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
+            lane_id(), warp_id(), iteratorC_tile_offset);
+        scalar_t* bias_row;
+        MM0::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {
+              bias_row =
+                  p.attn_bias_ptr + accum_m * p.bias_strideM + iter_key_start;
+            },
+            [&](int accum_m, int accum_n, int idx) {
+              if (accum_m < problem_size_0_m && accum_n < problem_size_0_n) {
+                accum[idx] += accum_t(bias_row[accum_n]);
+              }
+            },
+            [&](int accum_m) {});
+      }
+      if (p.alibi_slopes_ptr != nullptr || p.rel_pos_bias_ptr != nullptr) {
+        accum_t alibi_slope =
+            p.alibi_slopes_ptr != nullptr ? *p.alibi_slopes_ptr : accum_t(0);
+        auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
+            lane_id(), warp_id(), iteratorC_tile_offset);
+        MM0::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {},
+            [&](int accum_m, int accum_n, int idx) {
+              // Out of bounds elements are masked in `update`
+              accum[idx] += p.generated_bias(
+                  alibi_slope,
+                  p.query_start + accum_m,
+                  iter_key_start + accum_n);
+            },
+            [&](int accum_m) {});
+      }
 
       // Mask out last if causal
       if (p.causal && p.num_keys - iter_key_start <= kKeysPerBlock) {
-        auto query_start = blockIdx.x * kQueriesPerBlock;
+        auto query_start = p.query_start;
         auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
             lane_id(), warp_id(), iteratorC_tile_offset);
         int32_t last_col;
@@ -592,7 +1303,52 @@ struct AttentionKernel {
             },
             [&](int accum_m) {});
       }
-      DISPATCH_BOOL(iter_key_start == 0, kIsFirst, ([&] {
+      // Mask out the keys before the window (`key <= query - window_size`)
+      if (p.window_size > 0 &&
+          iter_key_start + p.window_size <
+              p.query_start + kQueriesPerBlock) {
+        int32_t query_start = p.query_start;
+        auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
+            lane_id(), warp_id(), iteratorC_tile_offset);
+        int32_t first_masked_col;
+        MM0::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {
+              first_masked_col =
+                  query_start + accum_m - p.window_size - iter_key_start;
+            },
+            [&](int accum_m, int accum_n, int idx) {
+              if (accum_n <= first_masked_col) {
+                accum[idx] =
+                    -cutlass::platform::numeric_limits<accum_t>::infinity();
+              }
+            },
+            [&](int accum_m) {});
+      }
+      // Mask out the drafts which are not ancestors of the query
+      if (p.tree_mask_ptr != nullptr &&
+          iter_key_start + kKeysPerBlock > p.tree_draft_start) {
+        auto lane_offset = MM0::ScalingCoefsUpdater::get_lane_offset(
+            lane_id(), warp_id(), iteratorC_tile_offset);
+        const uint32_t* tree_mask_row;
+        MM0::ScalingCoefsUpdater::iterateRows(
+            lane_offset,
+            [&](int accum_m) {
+              tree_mask_row = p.tree_mask_ptr +
+                  int64_t(p.query_start + accum_m) * p.tree_mask_strideM;
+            },
+            [&](int accum_m, int accum_n, int idx) {
+              int32_t draft = iter_key_start + accum_n - p.tree_draft_start;
+              if (draft >= 0 && accum_m < problem_size_0_m &&
+                  accum_n < problem_size_0_n &&
+                  !((tree_mask_row[draft / 32] >> (draft % 32)) & 1u)) {
+                accum[idx] =
+                    -cutlass::platform::numeric_limits<accum_t>::infinity();
+              }
+            },
+            [&](int accum_m) {});
+      }
+      DISPATCH_BOOL(iter_key_start == p.key_start, kIsFirst, ([&] {
                       DISPATCH_BOOL(
                           p.num_keys - iter_key_start >= kKeysPerBlock,
                           kFullColumns,
@@ -616,7 +1372,8 @@ struct AttentionKernel {
                                 warp_id(),
                                 p.num_keys - iter_key_start,
                                 iteratorC_tile_offset,
-                                1.0f / cutlass::fast_sqrt(float(p.head_dim)));
+                                p.scales_scores_first() ? 1.0f
+                                                        : p.scale);
                           }));
                     }));
 
@@ -632,6 +1389,45 @@ struct AttentionKernel {
 
       __syncthreads();
 
+#ifdef HAS_PYTORCH
+      // Apply the dropout mask to `si`. `s_prime` was already updated with
+      // the probabilities before dropout, so that the output is normalized
+      // the same way as `dropout(softmax(QK^T)) @ V`
+      if (p.use_dropout) {
+        static_assert(kKeysPerBlock % 4 == 0, "");
+        using si_t = typename MM0::AccumulatorSharedStorage::Element;
+        auto si_ref = si.accum_ref();
+        const accum_t dropout_scale = 1.0f / (1.0f - p.dropout_prob);
+        const int32_t query_start = p.query_start;
+        // Each thread handles 4 consecutive keys of a query at a time, which
+        // are generated by a single Philox call
+        for (int32_t idx = thread_id() * 4;
+             idx < kQueriesPerBlock * kKeysPerBlock;
+             idx += kNumThreads * 4) {
+          int32_t i = idx / kKeysPerBlock;
+          int32_t j = idx % kKeysPerBlock;
+          if (i >= problem_size_0_m || j >= problem_size_0_n) {
+            continue;
+          }
+          float4 rand = philox_uniform4(
+              dropout_seed,
+              0,
+              dropout_offset + uint64_t(query_start + i) * p.dropout_strideM +
+                  iter_key_start + j);
+          float keep[4] = {rand.x, rand.y, rand.z, rand.w};
+          CUTLASS_PRAGMA_UNROLL
+          for (int k = 0; k < 4; ++k) {
+            si_t& value = si_ref.at({i, j + k});
+            value = keep[k] > p.dropout_prob
+                ? si_t(accum_t(value) * dropout_scale)
+                : si_t(0);
+          }
+        }
+        __syncthreads();
+      }
+#endif
+      profiler.end(kProfileSoftmax);
+
       //
       // MATMUL: Attn . V
       // Run the matmul `attn @ V` for a block of attn and V.
@@ -655,7 +1451,7 @@ struct AttentionKernel {
 
         typename MM1::Mma::IteratorB iterator_V(
             typename MM1::IteratorB::Params{MM1::LayoutB(p.v_strideM)},
-            p.value_ptr + iter_key_start * p.v_strideM,
+            p.value_tile_ptr(iter_key_start),
             {problem_size_1_k, problem_size_1_n},
             thread_id(),
             cutlass::MatrixCoord{0, blockN * MM1::Mma::Shape::kN});
@@ -676,12 +1472,13 @@ struct AttentionKernel {
         if (kPreloadV && !kSingleValueIteration && blockN + 1 < nBlockN) {
           prologueV(blockN + 1);
         }
+        profiler.end(kProfileMM1);
 
         if (!kKeepOutputInRF) {
           DISPATCH_BOOL(
-              iter_key_start == 0, kIsFirst, ([&] {
+              iter_key_start == p.key_start, kIsFirst, ([&] {
                 DISPATCH_BOOL(
-                    (iter_key_start + kKeysPerBlock) >= p.num_keys,
+                    iter_key_next >= p.num_keys,
                     kIsLast,
                     ([&] {
                       using DefaultEpilogue = typename MM1::DefaultEpilogue;
@@ -741,6 +1538,7 @@ struct AttentionKernel {
           if (!kSingleValueIteration) {
             __syncthreads();
           }
+          profiler.end(kProfileEpilogue);
         }
       }
       __syncthreads(); // we modify `m_prime` after
@@ -788,19 +1586,9 @@ struct AttentionKernel {
     }
 
     // 7. Calculate logsumexp
-    // To make the backward easier, we pad logsumexp with `inf`
-    // this avoids a few bound checks, and is not more expensive during fwd
-    static_assert(kQueriesPerBlock < kNumWarpsPerBlock * kWarpSize, "");
-    if (p.logsumexp_ptr && thread_id() < kQueriesPerBlock) {
-      auto lse_dim = ceil_div((int32_t)p.num_queries, kAlignLSE) * kAlignLSE;
-      if (thread_id() < p.num_queries) {
-        p.logsumexp_ptr[thread_id()] = accum_t(mi[thread_id()]) +
-            cutlass::fast_log(accum_t(s_prime[thread_id()]));
-      } else if (thread_id() < lse_dim) {
-        p.logsumexp_ptr[thread_id()] =
-            cutlass::platform::numeric_limits<accum_t>::infinity();
-      }
-    }
+    writeLogsumexp();
+    profiler.end(kProfileEpilogue);
+    profiler.store(p.profile_ptr, warp_id(), lane_id(), kNumWarpsPerBlock);
   }
 
   static CUTLASS_DEVICE int8_t lane_id() {
@@ -817,10 +1605,7 @@ struct AttentionKernel {
 template <typename AK>
 __global__ void __launch_bounds__(AK::kNumThreads, AK::kMinBlocksPerSm)
     attention_kernel_batched_impl(typename AK::Params p) {
-  if (!p.advance_to_block()) {
-    return;
-  }
-  AK::attention_kernel(p);
+  AK::kernel(p);
 }
 
 template <typename AK>
@@ -855,10 +1640,7 @@ __global__ void __launch_bounds__(AK::kNumThreads, AK::kMinBlocksPerSm)
                                   QUERIES_PER_BLOCK,       \
                                   KEYS_PER_BLOCK,          \
                                   SINGLE_VALUE_ITER>)      \
-  if (!p.advance_to_block()) {                             \
-    return;                                                \
-  }                                                        \
-  Kernel::attention_kernel(p);                             \
+  Kernel::kernel(p);                                       \
   _ATTENTION_KERNEL_FORWARD_END();
 
 #define INSTANTIATE_ATTENTION_KERNEL_FORWARD_DISABLED(              \
@@ -881,6 +1663,160 @@ __global__ void __launch_bounds__(AK::kNumThreads, AK::kMinBlocksPerSm)
       int(__CUDA_ARCH_OR_ZERO__));                                  \
   _ATTENTION_KERNEL_FORWARD_END();
 
+// int8 Q/K (see `kQuantizedQK`) - only aligned, for Sm80+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK( \
+    SCALAR_T,                                              \
+    QUERIES_PER_BLOCK,                                     \
+    KEYS_PER_BLOCK,                                        \
+    SINGLE_VALUE_ITER)                                     \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<         \
+                                  SCALAR_T,                \
+                                  cutlass::arch::Sm80,     \
+                                  true,                    \
+                                  QUERIES_PER_BLOCK,       \
+                                  KEYS_PER_BLOCK,          \
+                                  SINGLE_VALUE_ITER,       \
+                                  true>)                   \
+  Kernel::kernel(p);                                       \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK_DISABLED( \
+    SCALAR_T,                                                       \
+    QUERIES_PER_BLOCK,                                              \
+    KEYS_PER_BLOCK,                                                 \
+    SINGLE_VALUE_ITER)                                              \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<                  \
+                                  SCALAR_T,                         \
+                                  cutlass::arch::Sm80,              \
+                                  true,                             \
+                                  QUERIES_PER_BLOCK,                \
+                                  KEYS_PER_BLOCK,                   \
+                                  SINGLE_VALUE_ITER,                \
+                                  true>)                            \
+  printf(                                                           \
+      "FATAL: this function is for sm80, but was built for sm%d\n", \
+      int(__CUDA_ARCH_OR_ZERO__));                                  \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+// Sm80 kernels with fewer pipeline stages (see `kSmallSmem`)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM( \
+    SCALAR_T,                                            \
+    IS_ALIGNED,                                          \
+    QUERIES_PER_BLOCK,                                   \
+    KEYS_PER_BLOCK,                                      \
+    SINGLE_VALUE_ITER)                                   \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<       \
+                                  SCALAR_T,              \
+                                  cutlass::arch::Sm80,   \
+                                  IS_ALIGNED,            \
+                                  QUERIES_PER_BLOCK,     \
+                                  KEYS_PER_BLOCK,        \
+                                  SINGLE_VALUE_ITER,     \
+                                  false,                 \
+                                  true>)                 \
+  Kernel::kernel(p);                                     \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_DISABLED(   \
+    SCALAR_T,                                                       \
+    IS_ALIGNED,                                                     \
+    QUERIES_PER_BLOCK,                                              \
+    KEYS_PER_BLOCK,                                                 \
+    SINGLE_VALUE_ITER)                                              \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<                  \
+                                  SCALAR_T,                         \
+                                  cutlass::arch::Sm80,              \
+                                  IS_ALIGNED,                       \
+                                  QUERIES_PER_BLOCK,                \
+                                  KEYS_PER_BLOCK,                   \
+                                  SINGLE_VALUE_ITER,                \
+                                  false,                            \
+                                  true>)                            \
+  printf(                                                           \
+      "FATAL: this function is for sm80, but was built for sm%d\n", \
+      int(__CUDA_ARCH_OR_ZERO__));                                  \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+// f32 Sm80 kernels with TF32 math (see `kTF32`)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32(     \
+    IS_ALIGNED,                                        \
+    QUERIES_PER_BLOCK,                                 \
+    KEYS_PER_BLOCK,                                    \
+    SINGLE_VALUE_ITER)                                 \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<     \
+                                  float,               \
+                                  cutlass::arch::Sm80, \
+                                  IS_ALIGNED,          \
+                                  QUERIES_PER_BLOCK,   \
+                                  KEYS_PER_BLOCK,      \
+                                  SINGLE_VALUE_ITER,   \
+                                  false,               \
+                                  false,               \
+                                  true>)               \
+  Kernel::kernel(p);                                   \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_DISABLED(         \
+    IS_ALIGNED,                                                     \
+    QUERIES_PER_BLOCK,                                              \
+    KEYS_PER_BLOCK,                                                 \
+    SINGLE_VALUE_ITER)                                              \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<                  \
+                                  float,                            \
+                                  cutlass::arch::Sm80,              \
+                                  IS_ALIGNED,                       \
+                                  QUERIES_PER_BLOCK,                \
+                                  KEYS_PER_BLOCK,                   \
+                                  SINGLE_VALUE_ITER,                \
+                                  false,                            \
+                                  false,                            \
+                                  true>)                            \
+  printf(                                                           \
+      "FATAL: this function is for sm80, but was built for sm%d\n", \
+      int(__CUDA_ARCH_OR_ZERO__));                                  \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+// RoPE on the query/key (see `kRotaryQK`) - only aligned, for Sm80+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK( \
+    SCALAR_T,                                           \
+    QUERIES_PER_BLOCK,                                  \
+    KEYS_PER_BLOCK,                                     \
+    SINGLE_VALUE_ITER)                                  \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<      \
+                                  SCALAR_T,             \
+                                  cutlass::arch::Sm80,  \
+                                  true,                 \
+                                  QUERIES_PER_BLOCK,    \
+                                  KEYS_PER_BLOCK,       \
+                                  SINGLE_VALUE_ITER,    \
+                                  false,                \
+                                  false,                \
+                                  false,                \
+                                  true>)                \
+  Kernel::kernel(p);                                    \
+  _ATTENTION_KERNEL_FORWARD_END();
+
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_DISABLED(    \
+    SCALAR_T,                                                       \
+    QUERIES_PER_BLOCK,                                              \
+    KEYS_PER_BLOCK,                                                 \
+    SINGLE_VALUE_ITER)                                              \
+  _ATTENTION_KERNEL_FORWARD_BEGIN(AttentionKernel<                  \
+                                  SCALAR_T,                         \
+                                  cutlass::arch::Sm80,              \
+                                  true,                             \
+                                  QUERIES_PER_BLOCK,                \
+                                  KEYS_PER_BLOCK,                   \
+                                  SINGLE_VALUE_ITER,                \
+                                  false,                            \
+                                  false,                            \
+                                  false,                            \
+                                  true>)                            \
+  printf(                                                           \
+      "FATAL: this function is for sm80, but was built for sm%d\n", \
+      int(__CUDA_ARCH_OR_ZERO__));                                  \
+  _ATTENTION_KERNEL_FORWARD_END();
+
 // All kernels are disabled by default
 #define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(...) \
   INSTANTIATE_ATTENTION_KERNEL_FORWARD_DISABLED(50, __VA_ARGS__)
@@ -890,6 +1826,14 @@ __global__ void __launch_bounds__(AK::kNumThreads, AK::kMinBlocksPerSm)
   INSTANTIATE_ATTENTION_KERNEL_FORWARD_DISABLED(75, __VA_ARGS__)
 #define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(...) \
   INSTANTIATE_ATTENTION_KERNEL_FORWARD_DISABLED(80, __VA_ARGS__)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK_DISABLED(__VA_ARGS__)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_DISABLED(__VA_ARGS__)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_DISABLED(__VA_ARGS__)
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_DISABLED(__VA_ARGS__)
 
 // Enable the right one based on __CUDA_ARCH__
 #ifndef __CUDA_ARCH__
@@ -911,4 +1855,16 @@ __global__ void __launch_bounds__(AK::kNumThreads, AK::kMinBlocksPerSm)
 #undef INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80
 #define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(...) \
   INSTANTIATE_ATTENTION_KERNEL_FORWARD(80, __VA_ARGS__)
+#undef INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK_SM80
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_QUANTIZED_QK(__VA_ARGS__)
+#undef INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_SM80
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM(__VA_ARGS__)
+#undef INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32(__VA_ARGS__)
+#undef INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80
+#define INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(...) \
+  INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK(__VA_ARGS__)
 #endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cutlass/cutlass.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// Cycles spent in every phase of the forward kernel
+////////////////////////////////////////////////////////////////////////////////
+// Only in builds with `XFORMERS_MEM_EFF_ATTENTION_PROFILE=1` (which defines
+// `XFORMERS_MEM_EFF_ATTENTION_PROFILE`) - otherwise `AttentionProfiler` is
+// empty, and compiled out.
+// Every thread reads `clock64()` at the end of each phase, and lane 0 of every
+// warp adds its cycles to `profile_ptr[cta, warp, phase]`, which the host
+// then returns with `xformers::_mem_eff_attention_profile` (see
+// `xformers/benchmarks/profile_mem_eff_attention.py` for a summary). The
+// warps synchronize between most phases, so the time waiting for the other
+// warps is counted in the phase which ends with `__syncthreads()`.
+// The loads of K and V are pipelined with the MMAs which use them: they are
+// part of MM0 and MM1.
+enum AttentionProfilePhase : int32_t {
+  // Until the first block of keys: initialization, fully masked blocks
+  kProfileSetup = 0,
+  // Q @ K^T, including the loads of Q and K
+  kProfileMM0,
+  // Masking, online softmax (`attention_scaling_coefs_updater.h`), dropout
+  // and storing the probabilities to shared memory
+  kProfileSoftmax,
+  // attn @ V, including the loads of V
+  kProfileMM1,
+  // Rescaling and writing the output (or `output_accum`), and the logsumexp
+  kProfileEpilogue,
+  kProfileNumPhases,
+};
+
+struct AttentionProfiler {
+#ifdef XFORMERS_MEM_EFF_ATTENTION_PROFILE
+  int64_t cycles[kProfileNumPhases];
+  int64_t last;
+
+  CUTLASS_DEVICE AttentionProfiler() : last(clock64()) {
+    CUTLASS_PRAGMA_UNROLL
+    for (int i = 0; i < kProfileNumPhases; ++i) {
+      cycles[i] = 0;
+    }
+  }
+
+  // The time since the end of the previous phase is counted in `phase`
+  CUTLASS_DEVICE void end(AttentionProfilePhase phase) {
+    int64_t now = clock64();
+    cycles[phase] += now - last;
+    last = now;
+  }
+
+  // `ptr` is [num_ctas, num_warps, kProfileNumPhases]. A block can process
+  // several work items (persistent scheduling), so the cycles are added. Only
+  // lane 0 of a warp writes its row, so there is no need for atomics
+  CUTLASS_DEVICE void store(
+      int64_t* ptr,
+      int32_t warp_id,
+      int32_t lane_id,
+      int32_t num_warps) const {
+    if (ptr == nullptr || lane_id != 0) {
+      return;
+    }
+    int64_t cta = blockIdx.x +
+        int64_t(gridDim.x) * (blockIdx.y + int64_t(gridDim.y) * blockIdx.z);
+    int64_t* row = ptr + (cta * num_warps + warp_id) * kProfileNumPhases;
+    CUTLASS_PRAGMA_UNROLL
+    for (int i = 0; i < kProfileNumPhases; ++i) {
+      row[i] += cycles[i];
+    }
+  }
+#else
+  CUTLASS_DEVICE void end(AttentionProfilePhase) {}
+  CUTLASS_DEVICE void store(int64_t*, int32_t, int32_t, int32_t) const {}
+#endif
+};
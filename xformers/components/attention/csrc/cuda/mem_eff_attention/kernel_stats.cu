@@ -0,0 +1,104 @@
+#include "kernel_stats.h"
+
+#include <torch/library.h>
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+namespace {
+struct AttentionKernelStats {
+  std::mutex mutex;
+  // Sorted, so that the results are stable
+  std::map<std::string, int64_t> kernels;
+  std::map<std::string, int64_t> fallbacks;
+  std::map<std::string, std::vector<at::Tensor>> profiles;
+};
+
+AttentionKernelStats& attention_kernel_stats() {
+  static AttentionKernelStats stats;
+  return stats;
+}
+
+template <typename Map>
+std::tuple<std::vector<std::string>, std::vector<int64_t>> to_lists(
+    const Map& counters) {
+  std::vector<std::string> names;
+  std::vector<int64_t> counts;
+  for (const auto& it : counters) {
+    names.push_back(it.first);
+    counts.push_back(it.second);
+  }
+  return std::make_tuple(names, counts);
+}
+
+// Returns the kernels names and their number of calls, and the same for the
+// fallback reasons
+std::tuple<
+    std::vector<std::string>,
+    std::vector<int64_t>,
+    std::vector<std::string>,
+    std::vector<int64_t>>
+mem_eff_attention_kernel_stats(bool reset) {
+  auto& stats = attention_kernel_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  auto kernels = to_lists(stats.kernels);
+  auto fallbacks = to_lists(stats.fallbacks);
+  if (reset) {
+    stats.kernels.clear();
+    stats.fallbacks.clear();
+  }
+  return std::make_tuple(
+      std::get<0>(kernels),
+      std::get<1>(kernels),
+      std::get<0>(fallbacks),
+      std::get<1>(fallbacks));
+}
+// Returns the kernel names, and for each of them the cycles of the phases of
+// all the CTAs of all its launches (concatenated)
+std::tuple<std::vector<std::string>, std::vector<at::Tensor>>
+mem_eff_attention_profile(bool reset) {
+  auto& stats = attention_kernel_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  std::vector<std::string> names;
+  std::vector<at::Tensor> cycles;
+  for (const auto& it : stats.profiles) {
+    names.push_back(it.first);
+    cycles.push_back(at::cat(it.second));
+  }
+  if (reset) {
+    stats.profiles.clear();
+  }
+  return std::make_tuple(names, cycles);
+}
+} // namespace
+
+void record_attention_profile(const std::string& kernel, at::Tensor cycles) {
+  auto& stats = attention_kernel_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  stats.profiles[kernel].push_back(std::move(cycles));
+}
+
+void record_attention_kernel(
+    const char* op,
+    const std::string& kernel,
+    const std::vector<const char*>& fallbacks) {
+  auto& stats = attention_kernel_stats();
+  std::lock_guard<std::mutex> lock(stats.mutex);
+  stats.kernels[kernel] += 1;
+  for (const char* reason : fallbacks) {
+    stats.fallbacks[std::string(op) + ":" + reason] += 1;
+  }
+}
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(
+      TORCH_SELECTIVE_SCHEMA(
+          "xformers::_mem_eff_attention_kernel_stats(bool reset=False) -> (str[], int[], str[], int[])"),
+      TORCH_FN(mem_eff_attention_kernel_stats));
+  m.def(
+      TORCH_SELECTIVE_SCHEMA(
+          "xformers::_mem_eff_attention_profile(bool reset=True) -> (str[], Tensor[])"),
+      TORCH_FN(mem_eff_attention_profile));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/record_function.h>
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cutlass/bfloat16.h"
+#include "cutlass/half.h"
+
+// Counters of the kernels the cutlass attention ops dispatched to, and of the
+// reasons why a less efficient kernel was used (eg unaligned inputs).
+// They can be queried (and reset) from Python with
+// `xformers::_mem_eff_attention_kernel_stats`.
+// The launches are also wrapped in a `RecordFunction` named after the kernel,
+// so that they show up in the PyTorch profiler, and as NVTX ranges under
+// `torch.autograd.profiler.emit_nvtx()`
+
+// Records a call to `kernel`. `fallbacks` are prefixed with `op`
+void record_attention_kernel(
+    const char* op,
+    const std::string& kernel,
+    const std::vector<const char*>& fallbacks);
+
+// (Profiling builds only) Keeps the cycles of every phase of a launch of
+// `kernel`, [num_ctas, num_warps, num_phases] (see `kernel_profile.h`), until
+// they are queried with `xformers::_mem_eff_attention_profile`
+void record_attention_profile(const std::string& kernel, at::Tensor cycles);
+
+template <typename scalar_t>
+const char* attention_dtype_name() {
+  return std::is_same<scalar_t, float>::value ? "f32"
+      : std::is_same<scalar_t, cutlass::bfloat16_t>::value ? "bf16"
+                                                           : "f16";
+}
+
+// Name of the first tensor which is not aligned enough for the kernels
+// with `kIsAligned=true`
+inline const char* attention_unaligned_tensor(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    int64_t alignment_q,
+    int64_t alignment_k,
+    int64_t alignment_v) {
+  if (query.stride(2) % alignment_q != 0) {
+    return "unaligned_query";
+  }
+  if (key.stride(2) % alignment_k != 0) {
+    return "unaligned_key";
+  }
+  if (value.stride(2) % alignment_v != 0) {
+    return "unaligned_value";
+  }
+  return "unaligned";
+}
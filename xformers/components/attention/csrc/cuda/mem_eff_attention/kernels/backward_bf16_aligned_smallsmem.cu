@@ -0,0 +1,11 @@
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BF16
+#include "../kernel_backward.h"
+INSTANTIATE_ATTENTION_KERNEL_BACKWARD_SM80(
+    cutlass::bfloat16_t,
+    true,
+    std::numeric_limits<int>::max(),
+    true);
+#endif
+#endif
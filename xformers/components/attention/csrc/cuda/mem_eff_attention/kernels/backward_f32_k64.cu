@@ -1,8 +1,10 @@
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F32
 #include "../kernel_backward.h"
 INSTANTIATE_ATTENTION_KERNEL_BACKWARD_SM50(float, false, 64);
 INSTANTIATE_ATTENTION_KERNEL_BACKWARD_SM70(float, false, 64);
 INSTANTIATE_ATTENTION_KERNEL_BACKWARD_SM75(float, false, 64);
 INSTANTIATE_ATTENTION_KERNEL_BACKWARD_SM80(float, false, 64);
 #endif
+#endif
@@ -1,5 +1,6 @@
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BF16
 #include "../kernel_forward.h"
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
     cutlass::bfloat16_t,
@@ -19,6 +20,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
     64,
     64,
     true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
+    cutlass::bfloat16_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     cutlass::bfloat16_t,
     false,
@@ -37,6 +44,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     64,
     64,
     true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
+    cutlass::bfloat16_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     cutlass::bfloat16_t,
     false,
@@ -55,6 +68,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     64,
     64,
     true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
+    cutlass::bfloat16_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     cutlass::bfloat16_t,
     false,
@@ -73,4 +92,11 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     64,
     64,
     true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
+    cutlass::bfloat16_t,
+    false,
+    128,
+    32,
+    true);
+#endif
 #endif
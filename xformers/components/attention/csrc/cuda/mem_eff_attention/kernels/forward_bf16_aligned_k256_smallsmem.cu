@@ -0,0 +1,12 @@
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BF16
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SMALL_SMEM_SM80(
+    cutlass::bfloat16_t,
+    true,
+    32,
+    256,
+    true);
+#endif
+#endif
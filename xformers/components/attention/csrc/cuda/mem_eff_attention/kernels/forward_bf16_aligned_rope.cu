@@ -0,0 +1,31 @@
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BF16
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(
+    cutlass::bfloat16_t,
+    32,
+    128,
+    true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(
+    cutlass::bfloat16_t,
+    32,
+    128,
+    false);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(
+    cutlass::bfloat16_t,
+    64,
+    64,
+    true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(
+    cutlass::bfloat16_t,
+    32,
+    256,
+    true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_ROTARY_QK_SM80(
+    cutlass::bfloat16_t,
+    128,
+    32,
+    true);
+#endif
+#endif
@@ -1,5 +1,6 @@
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F16
 #include "../kernel_forward.h"
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
     cutlass::half_t,
@@ -14,6 +15,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(cutlass::half_t, false, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
+    cutlass::half_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     cutlass::half_t,
     false,
@@ -27,6 +34,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(cutlass::half_t, false, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
+    cutlass::half_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     cutlass::half_t,
     false,
@@ -40,6 +53,12 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(cutlass::half_t, false, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
+    cutlass::half_t,
+    false,
+    128,
+    32,
+    true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     cutlass::half_t,
     false,
@@ -53,4 +72,11 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(cutlass::half_t, false, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
+    cutlass::half_t,
+    false,
+    128,
+    32,
+    true);
+#endif
 #endif
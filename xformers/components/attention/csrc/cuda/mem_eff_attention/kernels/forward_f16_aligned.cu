@@ -1,5 +1,6 @@
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F16
 #include "../kernel_forward.h"
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(cutlass::half_t, true, 32, 128, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
@@ -9,6 +10,7 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(cutlass::half_t, true, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM50(cutlass::half_t, true, 128, 32, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(cutlass::half_t, true, 32, 128, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     cutlass::half_t,
@@ -17,6 +19,7 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(cutlass::half_t, true, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM70(cutlass::half_t, true, 128, 32, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(cutlass::half_t, true, 32, 128, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     cutlass::half_t,
@@ -25,6 +28,7 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(cutlass::half_t, true, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM75(cutlass::half_t, true, 128, 32, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(cutlass::half_t, true, 32, 128, true);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     cutlass::half_t,
@@ -33,4 +37,6 @@ INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(
     128,
     false);
 INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(cutlass::half_t, true, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_SM80(cutlass::half_t, true, 128, 32, true);
+#endif
 #endif
@@ -0,0 +1,10 @@
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F32
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(true, 32, 128, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(true, 32, 128, false);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(true, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_FORWARD_TF32_SM80(true, 128, 32, true);
+#endif
+#endif
@@ -14,6 +14,7 @@ for aligned in "false" "true"; do
                 "f16") dtype="cutlass::half_t" ;;
                 "bf16") dtype="cutlass::bfloat16_t" ;;
             esac
+            dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
             [[ $aligned = "true" ]] && s="_aligned" || s=""
             [[ $maxk = "" ]] && s="${s}" || s="${s}_k$maxk"
             [[ $maxk = "" ]] && maxk_code="" || maxk_code=", $maxk"
@@ -22,6 +23,7 @@ for aligned in "false" "true"; do
             cat <<EOF > $FNAME
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
 #include "../kernel_backward.h"
 EOF
             for sm in 50 70 75 80; do
@@ -29,11 +31,60 @@ EOF
             done;
             cat <<EOF >> $FNAME
 #endif
+#endif
 EOF
         done;
     done;
 done
 
+# BACKWARD - Sm80 kernels with fewer stages, for large head dims on the GPUs
+# with less shared-memory than the A100 (f16/bf16 only)
+for aligned in "false" "true"; do
+    for maxk in 128 ""; do
+        for dtype_name in "f16" "bf16"; do
+            case "$dtype_name" in
+                "f16") dtype="cutlass::half_t" ;;
+                "bf16") dtype="cutlass::bfloat16_t" ;;
+            esac
+            dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
+            [[ $aligned = "true" ]] && s="_aligned" || s=""
+            [[ $maxk = "" ]] && s="${s}" || s="${s}_k$maxk"
+            [[ $maxk = "" ]] && maxk_code="std::numeric_limits<int>::max()" || maxk_code="$maxk"
+            FNAME="${kernel_lower}_${dtype_name}${s}_smallsmem.cu"
+            echo $FNAME
+            cat <<EOF > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
+#include "../kernel_backward.h"
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM80($dtype, $aligned, $maxk_code, true);
+#endif
+#endif
+EOF
+        done;
+    done;
+done
+
+# BACKWARD - f32 with TF32 math (Sm80)
+for aligned in "false" "true"; do
+    for maxk in 64 128 ""; do
+        [[ $aligned = "true" ]] && s="_aligned" || s=""
+        [[ $maxk = "" ]] && s="${s}" || s="${s}_k$maxk"
+        [[ $maxk = "" ]] && maxk_code="std::numeric_limits<int>::max()" || maxk_code="$maxk"
+        FNAME="${kernel_lower}_f32${s}_tf32.cu"
+        echo $FNAME
+        cat <<EOF > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_BACKWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F32
+#include "../kernel_backward.h"
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM80(float, $aligned, $maxk_code, false, true);
+#endif
+#endif
+EOF
+    done;
+done
+
 # FORWARD
 kernel="FORWARD"
 kernel_lower=`echo "\$kernel" | awk '{print tolower($0)}'`
@@ -45,20 +96,143 @@ for aligned in "false" "true"; do
             "f16") dtype="cutlass::half_t" ;;
             "bf16") dtype="cutlass::bfloat16_t" ;;
         esac
+        dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
         FNAME="${kernel_lower}_${dtype_name}${aligned_suffix}.cu"
         echo $FNAME
         cat <<EOF > $FNAME
 // This file is auto-generated. See "generate_kernels.sh"
 #ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
 #include "../kernel_forward.h"
 EOF
         for sm in 50 70 75 80; do
             echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM${sm}($dtype, $aligned, 32, 128, true);" >> $FNAME
             echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM${sm}($dtype, $aligned, 32, 128, false);" >> $FNAME
             echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM${sm}($dtype, $aligned, 64, 64, true);" >> $FNAME
+            echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM${sm}($dtype, $aligned, 128, 32, true);" >> $FNAME
         done;
             cat <<EOF >> $FNAME
 #endif
+#endif
+EOF
+    done;
+done
+
+# FORWARD - head dim up to 256, with the output kept in registers (Sm80,
+# f16/bf16 only: the only combinations `supports_k256` dispatches to)
+for aligned in "false" "true"; do
+    [[ $aligned = "true" ]] && aligned_suffix="_aligned" || aligned_suffix=""
+    for dtype_name in "f16" "bf16"; do
+        case "$dtype_name" in
+            "f16") dtype="cutlass::half_t" ;;
+            "bf16") dtype="cutlass::bfloat16_t" ;;
+        esac
+        dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
+        FNAME="${kernel_lower}_${dtype_name}${aligned_suffix}_k256.cu"
+        echo $FNAME
+        cat <<EOF > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_SM80($dtype, $aligned, 32, 256, true);
+#endif
+#endif
 EOF
     done;
 done
+
+# FORWARD - head dim up to 256, with fewer stages (Sm80, f16/bf16 only)
+for aligned in "false" "true"; do
+    [[ $aligned = "true" ]] && aligned_suffix="_aligned" || aligned_suffix=""
+    for dtype_name in "f16" "bf16"; do
+        case "$dtype_name" in
+            "f16") dtype="cutlass::half_t" ;;
+            "bf16") dtype="cutlass::bfloat16_t" ;;
+        esac
+        dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
+        FNAME="${kernel_lower}_${dtype_name}${aligned_suffix}_k256_smallsmem.cu"
+        echo $FNAME
+        cat <<EOF > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_SMALL_SMEM_SM80($dtype, $aligned, 32, 256, true);
+#endif
+#endif
+EOF
+    done;
+done
+
+# FORWARD - f32 with TF32 math (Sm80)
+for aligned in "false" "true"; do
+    [[ $aligned = "true" ]] && aligned_suffix="_aligned" || aligned_suffix=""
+    FNAME="${kernel_lower}_f32${aligned_suffix}_tf32.cu"
+    echo $FNAME
+    cat <<EOF > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_F32
+#include "../kernel_forward.h"
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_TF32_SM80($aligned, 32, 128, true);
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_TF32_SM80($aligned, 32, 128, false);
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_TF32_SM80($aligned, 64, 64, true);
+INSTANTIATE_ATTENTION_KERNEL_${kernel}_TF32_SM80($aligned, 128, 32, true);
+#endif
+#endif
+EOF
+done
+
+# FORWARD - int8 query/key, with f16/bf16 values (Sm80+, aligned only)
+for dtype_name in "f16" "bf16"; do
+    case "$dtype_name" in
+        "f16") dtype="cutlass::half_t" ;;
+        "bf16") dtype="cutlass::bfloat16_t" ;;
+    esac
+    dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
+    FNAME="${kernel_lower}_${dtype_name}_aligned_int8qk.cu"
+    echo $FNAME
+    cat <<EOF2 > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
+#include "../kernel_forward.h"
+EOF2
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_QUANTIZED_QK_SM80($dtype, 32, 128, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_QUANTIZED_QK_SM80($dtype, 32, 128, false);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_QUANTIZED_QK_SM80($dtype, 64, 64, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_QUANTIZED_QK_SM80($dtype, 32, 256, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_QUANTIZED_QK_SM80($dtype, 128, 32, true);" >> $FNAME
+    cat <<EOF2 >> $FNAME
+#endif
+#endif
+EOF2
+done
+
+# FORWARD - RoPE applied to the query/key as they are loaded (Sm80+, f16/bf16
+# aligned only)
+for dtype_name in "f16" "bf16"; do
+    case "$dtype_name" in
+        "f16") dtype="cutlass::half_t" ;;
+        "bf16") dtype="cutlass::bfloat16_t" ;;
+    esac
+    dtype_upper=`echo "\$dtype_name" | awk '{print toupper($0)}'`
+    FNAME="${kernel_lower}_${dtype_name}_aligned_rope.cu"
+    echo $FNAME
+    cat <<EOF2 > $FNAME
+// This file is auto-generated. See "generate_kernels.sh"
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_FORWARD
+#ifndef XFORMERS_MEM_EFF_ATTENTION_DISABLE_$dtype_upper
+#include "../kernel_forward.h"
+EOF2
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_ROTARY_QK_SM80($dtype, 32, 128, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_ROTARY_QK_SM80($dtype, 32, 128, false);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_ROTARY_QK_SM80($dtype, 64, 64, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_ROTARY_QK_SM80($dtype, 32, 256, true);" >> $FNAME
+    echo "INSTANTIATE_ATTENTION_KERNEL_${kernel}_ROTARY_QK_SM80($dtype, 128, 32, true);" >> $FNAME
+    cat <<EOF2 >> $FNAME
+#endif
+#endif
+EOF2
+done
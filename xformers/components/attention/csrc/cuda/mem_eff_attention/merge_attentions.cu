@@ -0,0 +1,384 @@
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+// Combines attention outputs computed over disjoint sets of keys (eg the
+// splits of split-KV, the shards of ring attention, or a cached prefix and
+// its suffix), using the logsumexp returned by the forward:
+//   lse = log(sum_i(exp(lse_i)))
+//   out = sum_i(exp(lse_i - lse) * out_i)
+// Sets without any key have `lse_i = -inf` and don't contribute. Rows where
+// every set is empty have `out = 0` and `lse = -inf`.
+// The outputs `out_i` are [B, M, H, Kv] in the input dtype, and the `lse_i`
+// are [B, H, M'] float32 with `M' >= M` (the forward pads them), the sums
+// are accumulated in float32 with a warp per row (b, m, h)
+namespace {
+
+constexpr int kMaxMergeInputs = 16;
+constexpr int kWarpSize = 32;
+constexpr int kRowsPerBlock = 4;
+
+template <typename scalar_t>
+struct MergeAttentionsParams {
+  const scalar_t* outs[kMaxMergeInputs];
+  int64_t o_strideB[kMaxMergeInputs];
+  int64_t o_strideM[kMaxMergeInputs];
+  int64_t o_strideH[kMaxMergeInputs];
+  const float* lses[kMaxMergeInputs];
+  int64_t lse_strideB[kMaxMergeInputs];
+  int64_t lse_strideH[kMaxMergeInputs];
+  int32_t num_inputs;
+  int32_t M, H, Kv;
+};
+
+template <typename scalar_t>
+struct MergeAttentionsBackwardParams {
+  MergeAttentionsParams<scalar_t> fwd;
+  const scalar_t* grad_out; // [B, M, H, Kv]
+  int64_t gO_strideB, gO_strideM, gO_strideH;
+  const float* grad_lse; // [B, H, M] - optional
+  int64_t gLse_strideB, gLse_strideH;
+  const float* lse; // [B, H, M]
+  // Same layouts as `outs` / `lses`
+  scalar_t* grad_outs[kMaxMergeInputs];
+  float* grad_lses[kMaxMergeInputs];
+};
+
+// `lse_i` of every input for the row (b, m, h), and their logsumexp
+template <typename scalar_t>
+__device__ float merge_attentions_lse(
+    const MergeAttentionsParams<scalar_t>& p,
+    int64_t b,
+    int64_t m,
+    int64_t h) {
+  float lse_max = -INFINITY;
+  for (int32_t i = 0; i < p.num_inputs; ++i) {
+    float lse_i =
+        p.lses[i][b * p.lse_strideB[i] + h * p.lse_strideH[i] + m];
+    lse_max = fmaxf(lse_max, lse_i);
+  }
+  if (lse_max == -INFINITY) {
+    return -INFINITY;
+  }
+  float sum = 0.0f;
+  for (int32_t i = 0; i < p.num_inputs; ++i) {
+    float lse_i =
+        p.lses[i][b * p.lse_strideB[i] + h * p.lse_strideH[i] + m];
+    sum += expf(lse_i - lse_max);
+  }
+  return lse_max + logf(sum);
+}
+
+template <typename scalar_t>
+__device__ float merge_attentions_weight(
+    const MergeAttentionsParams<scalar_t>& p,
+    int32_t i,
+    int64_t b,
+    int64_t m,
+    int64_t h,
+    float lse) {
+  if (lse == -INFINITY) {
+    return 0.0f;
+  }
+  return expf(p.lses[i][b * p.lse_strideB[i] + h * p.lse_strideH[i] + m] - lse);
+}
+
+template <typename scalar_t>
+__global__ void merge_attentions_kernel(
+    MergeAttentionsParams<scalar_t> p,
+    scalar_t* __restrict__ out, // [B, M, H, Kv]
+    float* __restrict__ lse, // [B, H, M]
+    int64_t num_rows) {
+  int64_t row = int64_t(blockIdx.x) * (blockDim.x / kWarpSize) +
+      threadIdx.x / kWarpSize;
+  if (row >= num_rows) {
+    return;
+  }
+  int32_t lane = threadIdx.x % kWarpSize;
+  // `row` follows the layout of `lse`
+  int64_t m = row % p.M;
+  int64_t h = (row / p.M) % p.H;
+  int64_t b = row / (int64_t(p.M) * p.H);
+
+  float row_lse = merge_attentions_lse(p, b, m, h);
+  float weights[kMaxMergeInputs];
+  const scalar_t* outs[kMaxMergeInputs];
+#pragma unroll
+  for (int32_t i = 0; i < kMaxMergeInputs; ++i) {
+    if (i < p.num_inputs) {
+      weights[i] = merge_attentions_weight(p, i, b, m, h, row_lse);
+      outs[i] = p.outs[i] + b * p.o_strideB[i] + m * p.o_strideM[i] +
+          h * p.o_strideH[i];
+    }
+  }
+  out += ((b * p.M + m) * p.H + h) * p.Kv;
+  for (int32_t k = lane; k < p.Kv; k += kWarpSize) {
+    float acc = 0.0f;
+#pragma unroll
+    for (int32_t i = 0; i < kMaxMergeInputs; ++i) {
+      if (i < p.num_inputs && weights[i] != 0.0f) {
+        acc += weights[i] * float(outs[i][k]);
+      }
+    }
+    out[k] = scalar_t(acc);
+  }
+  if (lane == 0) {
+    lse[row] = row_lse;
+  }
+}
+
+// With `w_i = exp(lse_i - lse)` and `g = grad_out`:
+//   grad_out_i = w_i * g
+//   grad_lse_i = w_i * (<g, out_i> - <g, out> + grad_lse)
+// where `<g, out> = sum_i(w_i * <g, out_i>)` is recomputed in float32
+template <typename scalar_t>
+__global__ void merge_attentions_backward_kernel(
+    MergeAttentionsBackwardParams<scalar_t> p,
+    int64_t num_rows) {
+  const auto& f = p.fwd;
+  int64_t row = int64_t(blockIdx.x) * (blockDim.x / kWarpSize) +
+      threadIdx.x / kWarpSize;
+  if (row >= num_rows) {
+    return;
+  }
+  int32_t lane = threadIdx.x % kWarpSize;
+  int64_t m = row % f.M;
+  int64_t h = (row / f.M) % f.H;
+  int64_t b = row / (int64_t(f.M) * f.H);
+
+  float row_lse = p.lse[row];
+  const scalar_t* grad_out =
+      p.grad_out + b * p.gO_strideB + m * p.gO_strideM + h * p.gO_strideH;
+  float grad_lse = p.grad_lse == nullptr
+      ? 0.0f
+      : p.grad_lse[b * p.gLse_strideB + h * p.gLse_strideH + m];
+
+  float weights[kMaxMergeInputs];
+  float dots[kMaxMergeInputs];
+  float dot_out = 0.0f;
+#pragma unroll
+  for (int32_t i = 0; i < kMaxMergeInputs; ++i) {
+    if (i < f.num_inputs) {
+      weights[i] = merge_attentions_weight(f, i, b, m, h, row_lse);
+      int64_t row_offset =
+          b * f.o_strideB[i] + m * f.o_strideM[i] + h * f.o_strideH[i];
+      const scalar_t* out_i = f.outs[i] + row_offset;
+      scalar_t* grad_out_i = p.grad_outs[i] + row_offset;
+      float dot = 0.0f;
+      for (int32_t k = lane; k < f.Kv; k += kWarpSize) {
+        float g = float(grad_out[k]);
+        dot += g * float(out_i[k]);
+        grad_out_i[k] = scalar_t(weights[i] * g);
+      }
+      for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+        dot += __shfl_xor_sync(0xffffffff, dot, offset);
+      }
+      dots[i] = dot;
+      dot_out += weights[i] * dot;
+    }
+  }
+  if (lane == 0) {
+#pragma unroll
+    for (int32_t i = 0; i < kMaxMergeInputs; ++i) {
+      if (i < f.num_inputs) {
+        p.grad_lses[i][b * f.lse_strideB[i] + h * f.lse_strideH[i] + m] =
+            weights[i] * (dots[i] - dot_out + grad_lse);
+      }
+    }
+  }
+}
+
+// Fills the pointers and strides of `p` from `outs` / `lses`
+template <typename scalar_t>
+void set_merge_attentions_params(
+    MergeAttentionsParams<scalar_t>& p,
+    const std::vector<at::Tensor>& outs,
+    const std::vector<at::Tensor>& lses) {
+  p.num_inputs = outs.size();
+  p.M = outs[0].size(1);
+  p.H = outs[0].size(2);
+  p.Kv = outs[0].size(3);
+  for (size_t i = 0; i < outs.size(); ++i) {
+    p.outs[i] = (const scalar_t*)outs[i].data_ptr();
+    p.o_strideB[i] = outs[i].stride(0);
+    p.o_strideM[i] = outs[i].stride(1);
+    p.o_strideH[i] = outs[i].stride(2);
+    p.lses[i] = (const float*)lses[i].data_ptr();
+    p.lse_strideB[i] = lses[i].stride(0);
+    p.lse_strideH[i] = lses[i].stride(1);
+  }
+}
+
+void check_merge_attentions_inputs(
+    const std::vector<at::Tensor>& outs,
+    const std::vector<at::Tensor>& lses) {
+  TORCH_CHECK(!outs.empty(), "merge_attentions: no input");
+  TORCH_CHECK(outs.size() == lses.size());
+  TORCH_CHECK(
+      outs.size() <= kMaxMergeInputs,
+      "merge_attentions: at most ",
+      kMaxMergeInputs,
+      " inputs are supported, got ",
+      outs.size());
+  const auto& out0 = outs[0];
+  TORCH_CHECK(out0.dim() == 4);
+  for (size_t i = 0; i < outs.size(); ++i) {
+    const auto& out = outs[i];
+    const auto& lse = lses[i];
+    TORCH_CHECK(out.is_cuda() && out.device() == out0.device());
+    TORCH_CHECK(out.scalar_type() == out0.scalar_type());
+    TORCH_CHECK(out.sizes() == out0.sizes());
+    TORCH_CHECK(out.stride(3) == 1, "outs should be contiguous in Kv");
+    TORCH_CHECK(lse.is_cuda() && lse.device() == out0.device());
+    TORCH_CHECK(lse.scalar_type() == at::ScalarType::Float);
+    TORCH_CHECK(lse.dim() == 3);
+    TORCH_CHECK(lse.size(0) == out0.size(0) && lse.size(1) == out0.size(2));
+    TORCH_CHECK(lse.size(2) >= out0.size(1));
+    TORCH_CHECK(lse.stride(2) == 1, "lses should be contiguous in M");
+  }
+}
+
+int64_t merge_attentions_num_blocks(int64_t num_rows) {
+  return (num_rows + kRowsPerBlock - 1) / kRowsPerBlock;
+}
+
+// Returns `out` [B, M, H, Kv] in the dtype of `outs`, and `lse` [B, H, M]
+std::tuple<at::Tensor, at::Tensor> merge_attentions(
+    at::TensorList outs_,
+    at::TensorList lses_) {
+  std::vector<at::Tensor> outs = outs_.vec();
+  std::vector<at::Tensor> lses = lses_.vec();
+  check_merge_attentions_inputs(outs, lses);
+  at::cuda::CUDAGuard device_guard(outs[0].device());
+
+  int64_t B = outs[0].size(0);
+  int64_t M = outs[0].size(1);
+  int64_t H = outs[0].size(2);
+  int64_t Kv = outs[0].size(3);
+  at::Tensor out = at::empty({B, M, H, Kv}, outs[0].options());
+  at::Tensor lse =
+      at::empty({B, H, M}, outs[0].options().dtype(at::ScalarType::Float));
+  int64_t num_rows = lse.numel();
+  if (num_rows == 0) {
+    return std::make_tuple(out, lse);
+  }
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      outs[0].scalar_type(),
+      "merge_attentions",
+      [&] {
+        MergeAttentionsParams<scalar_t> p;
+        set_merge_attentions_params(p, outs, lses);
+        merge_attentions_kernel<scalar_t>
+            <<<merge_attentions_num_blocks(num_rows),
+               kRowsPerBlock * kWarpSize,
+               0,
+               stream>>>(
+                p,
+                (scalar_t*)out.data_ptr(),
+                (float*)lse.data_ptr(),
+                num_rows);
+      });
+  AT_CUDA_CHECK(cudaGetLastError());
+  return std::make_tuple(out, lse);
+}
+
+// Returns the gradients of `outs` and `lses`, in their shapes (the padding
+// of `lses` gets a zero gradient)
+std::tuple<std::vector<at::Tensor>, std::vector<at::Tensor>>
+merge_attentions_backward(
+    const at::Tensor& grad_out,
+    const c10::optional<at::Tensor>& grad_lse,
+    const at::Tensor& lse,
+    at::TensorList outs_,
+    at::TensorList lses_) {
+  std::vector<at::Tensor> outs = outs_.vec();
+  std::vector<at::Tensor> lses = lses_.vec();
+  check_merge_attentions_inputs(outs, lses);
+  at::cuda::CUDAGuard device_guard(outs[0].device());
+
+  int64_t B = outs[0].size(0);
+  int64_t M = outs[0].size(1);
+  int64_t H = outs[0].size(2);
+  TORCH_CHECK(grad_out.sizes() == outs[0].sizes());
+  TORCH_CHECK(grad_out.scalar_type() == outs[0].scalar_type());
+  TORCH_CHECK(grad_out.stride(3) == 1);
+  TORCH_CHECK(lse.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(lse.size(0) == B && lse.size(1) == H && lse.size(2) == M);
+  TORCH_CHECK(lse.is_contiguous());
+  if (grad_lse.has_value()) {
+    TORCH_CHECK(grad_lse->scalar_type() == at::ScalarType::Float);
+    TORCH_CHECK(grad_lse->size(0) == B && grad_lse->size(1) == H);
+    TORCH_CHECK(grad_lse->size(2) >= M && grad_lse->stride(2) == 1);
+  }
+
+  std::vector<at::Tensor> grad_outs;
+  std::vector<at::Tensor> grad_lses;
+  for (size_t i = 0; i < outs.size(); ++i) {
+    grad_outs.push_back(at::empty_strided(
+        outs[i].sizes(), outs[i].strides(), outs[i].options()));
+    grad_lses.push_back(at::empty_strided(
+        lses[i].sizes(), lses[i].strides(), lses[i].options()));
+    if (lses[i].size(2) > M) {
+      grad_lses.back().zero_();
+    }
+  }
+  int64_t num_rows = lse.numel();
+  if (num_rows == 0) {
+    return std::make_tuple(grad_outs, grad_lses);
+  }
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      outs[0].scalar_type(),
+      "merge_attentions_backward",
+      [&] {
+        MergeAttentionsBackwardParams<scalar_t> p;
+        set_merge_attentions_params(p.fwd, outs, lses);
+        p.grad_out = (const scalar_t*)grad_out.data_ptr();
+        p.gO_strideB = grad_out.stride(0);
+        p.gO_strideM = grad_out.stride(1);
+        p.gO_strideH = grad_out.stride(2);
+        p.grad_lse = nullptr;
+        p.gLse_strideB = 0;
+        p.gLse_strideH = 0;
+        if (grad_lse.has_value()) {
+          p.grad_lse = (const float*)grad_lse->data_ptr();
+          p.gLse_strideB = grad_lse->stride(0);
+          p.gLse_strideH = grad_lse->stride(1);
+        }
+        p.lse = (const float*)lse.data_ptr();
+        for (size_t i = 0; i < outs.size(); ++i) {
+          // Same strides as `outs[i]` / `lses[i]`
+          p.grad_outs[i] = (scalar_t*)grad_outs[i].data_ptr();
+          p.grad_lses[i] = (float*)grad_lses[i].data_ptr();
+        }
+        merge_attentions_backward_kernel<scalar_t>
+            <<<merge_attentions_num_blocks(num_rows),
+               kRowsPerBlock * kWarpSize,
+               0,
+               stream>>>(p, num_rows);
+      });
+  AT_CUDA_CHECK(cudaGetLastError());
+  return std::make_tuple(grad_outs, grad_lses);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::merge_attentions"),
+      TORCH_FN(merge_attentions));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::merge_attentions_backward"),
+      TORCH_FN(merge_attentions_backward));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+
+// Counter-based Philox4x32-10, for the dropout masks of the attention
+// kernels. The 4 random numbers of the block `n` of the stream `subsequence`
+// of `seed` are a pure function of `(seed, subsequence, n)`, so any element
+// of a mask is generated directly from its index, without setting up (and
+// keeping in registers) a `curandStatePhilox4_32_10_t`.
+// The numbers are the same as cuRAND's: `philox_uniform4(seed, s, offset)`
+// returns what `curand_init(seed, s, offset, &state)` followed by
+// `curand_uniform4(&state)` would, with 1 Philox evaluation instead of 2 when
+// `offset` is a multiple of 4 (cuRAND eagerly computes the next block).
+namespace {
+
+constexpr uint32_t kPhiloxW32_0 = 0x9E3779B9;
+constexpr uint32_t kPhiloxW32_1 = 0xBB67AE85;
+constexpr uint32_t kPhiloxM4x32_0 = 0xD2511F53;
+constexpr uint32_t kPhiloxM4x32_1 = 0xCD9E8D57;
+
+__device__ __forceinline__ uint4 philox4x32_round(uint4 ctr, uint2 key) {
+  uint32_t hi0 = __umulhi(kPhiloxM4x32_0, ctr.x);
+  uint32_t lo0 = kPhiloxM4x32_0 * ctr.x;
+  uint32_t hi1 = __umulhi(kPhiloxM4x32_1, ctr.z);
+  uint32_t lo1 = kPhiloxM4x32_1 * ctr.z;
+  return make_uint4(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+}
+
+__device__ __forceinline__ uint4 philox4x32_10(uint4 ctr, uint2 key) {
+#pragma unroll
+  for (int i = 0; i < 9; ++i) {
+    ctr = philox4x32_round(ctr, key);
+    key.x += kPhiloxW32_0;
+    key.y += kPhiloxW32_1;
+  }
+  return philox4x32_round(ctr, key);
+}
+
+// Random bits of the block `block` of the stream `subsequence`: the counter
+// is `block + subsequence * 2^64`, the key is the seed
+__device__ __forceinline__ uint4
+philox_block(uint64_t seed, uint64_t subsequence, uint64_t block) {
+  return philox4x32_10(
+      make_uint4(
+          uint32_t(block),
+          uint32_t(block >> 32),
+          uint32_t(subsequence),
+          uint32_t(subsequence >> 32)),
+      make_uint2(uint32_t(seed), uint32_t(seed >> 32)));
+}
+
+// Same mapping as `curand_uniform`, to (0, 1]
+__device__ __forceinline__ float philox_to_uniform(uint32_t x) {
+  constexpr float k2Pow32Inv = 2.3283064e-10f;
+  return x * k2Pow32Inv + k2Pow32Inv / 2.0f;
+}
+
+// Uniform floats of the elements `[offset, offset + 4)` of the stream
+// `subsequence` of `seed`
+__device__ __forceinline__ float4
+philox_uniform4(uint64_t seed, uint64_t subsequence, uint64_t offset) {
+  uint64_t block = offset / 4;
+  uint32_t lane = offset % 4;
+  uint4 r = philox_block(seed, subsequence, block);
+  if (lane != 0) {
+    // The elements span 2 blocks
+    uint64_t next_block = block + 1;
+    uint4 n = philox_block(
+        seed, next_block == 0 ? subsequence + 1 : subsequence, next_block);
+    uint32_t bits[8] = {r.x, r.y, r.z, r.w, n.x, n.y, n.z, n.w};
+    r = make_uint4(
+        bits[lane], bits[lane + 1], bits[lane + 2], bits[lane + 3]);
+  }
+  return make_float4(
+      philox_to_uniform(r.x),
+      philox_to_uniform(r.y),
+      philox_to_uniform(r.z),
+      philox_to_uniform(r.w));
+}
+
+} // namespace
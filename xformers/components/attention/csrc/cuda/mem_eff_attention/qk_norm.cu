@@ -0,0 +1,539 @@
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include <type_traits>
+
+// Per-head RMSNorm / LayerNorm of the query and the key ("QK-norm"), over the
+// head dim and with an optional weight [K] for each of them:
+//   rms_norm:  y = x * rsqrt(mean(x^2) + eps) * weight
+//   otherwise: y = (x - mean(x)) * rsqrt(var(x) + eps) * weight
+// The rows of both tensors are normalized by a single kernel, with a warp per
+// row kept in registers, and the statistics (mean, rstd) of every row are
+// returned for the backward. The inputs can be strided views (eg of a packed
+// `qkv`), as long as the last dimension is contiguous.
+// The backward computes the gradients of the inputs with the same mapping,
+// and those of the weights in a second kernel, which sums over slices of rows
+// query [B, M, H, K], key [B, N, H_kv, K]
+namespace {
+
+constexpr int kWarpSize = 32;
+constexpr int kWarpsPerBlock = 4;
+// The rows are kept in registers
+constexpr int64_t kMaxK = 512;
+
+template <typename scalar_t>
+struct alignas(16) Vec {
+  static constexpr int kSize = 16 / sizeof(scalar_t);
+  scalar_t v[kSize];
+};
+
+template <typename scalar_t>
+__device__ __forceinline__ void load_vec(
+    const scalar_t* ptr,
+    float (&out)[Vec<scalar_t>::kSize]) {
+  Vec<scalar_t> vec = *reinterpret_cast<const Vec<scalar_t>*>(ptr);
+#pragma unroll
+  for (int k = 0; k < Vec<scalar_t>::kSize; ++k) {
+    out[k] = float(vec.v[k]);
+  }
+}
+
+template <typename scalar_t>
+__device__ __forceinline__ void store_vec(
+    scalar_t* ptr,
+    const float (&in)[Vec<scalar_t>::kSize]) {
+  Vec<scalar_t> vec;
+#pragma unroll
+  for (int k = 0; k < Vec<scalar_t>::kSize; ++k) {
+    vec.v[k] = scalar_t(in[k]);
+  }
+  *reinterpret_cast<Vec<scalar_t>*>(ptr) = vec;
+}
+
+__device__ __forceinline__ float warp_sum(float v) {
+#pragma unroll
+  for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+    v += __shfl_xor_sync(0xffffffff, v, offset);
+  }
+  return v;
+}
+
+template <typename scalar_t>
+struct QKNormTensor {
+  // [B, M, H, K], with the last dimension contiguous
+  const scalar_t* x;
+  int64_t strideB;
+  int64_t strideM;
+  int64_t strideH;
+  const scalar_t* weight; // [K] (can be null)
+  // Contiguous [B, M, H, K]: the output of the forward, and the gradient of
+  // `x` in the backward
+  scalar_t* out;
+  // (Backward only) Contiguous gradient of the output
+  const scalar_t* grad = nullptr;
+  int32_t M;
+  int32_t H;
+  int64_t rows; // B * M * H
+
+  __device__ __forceinline__ const scalar_t* row_ptr(int64_t row) const {
+    int64_t h = row % H;
+    int64_t m = (row / H) % M;
+    int64_t b = row / (int64_t(H) * M);
+    return x + b * strideB + m * strideM + h * strideH;
+  }
+};
+
+template <typename scalar_t>
+struct QKNormParams {
+  QKNormTensor<scalar_t> query;
+  QKNormTensor<scalar_t> key;
+  // [query.rows + key.rows]: the rows of the query, then those of the key
+  float* mean;
+  float* rstd;
+  int32_t K;
+  bool rms_norm;
+  float eps;
+
+  // The tensor of the row `row` of `mean` / `rstd`, and its row in it
+  __device__ __forceinline__ const QKNormTensor<scalar_t>& tensor(
+      int64_t& row) const {
+    if (row < query.rows) {
+      return query;
+    }
+    row -= query.rows;
+    return key;
+  }
+};
+
+template <typename scalar_t, int kVecsPerLane>
+__global__ void __launch_bounds__(kWarpsPerBlock* kWarpSize)
+    qk_norm_fw_kernel(QKNormParams<scalar_t> p) {
+  constexpr int kVec = Vec<scalar_t>::kSize;
+  const int lane = threadIdx.x % kWarpSize;
+  const int64_t rows = p.query.rows + p.key.rows;
+
+  for (int64_t row = blockIdx.x * kWarpsPerBlock + threadIdx.x / kWarpSize;
+       row < rows;
+       row += int64_t(gridDim.x) * kWarpsPerBlock) {
+    int64_t tensor_row = row;
+    const QKNormTensor<scalar_t>& t = p.tensor(tensor_row);
+    const scalar_t* x = t.row_ptr(tensor_row);
+    float v[kVecsPerLane][kVec];
+    float sum = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.K) {
+        continue;
+      }
+      load_vec(x + col, v[i]);
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        sum += v[i][k];
+      }
+    }
+    const float mean = p.rms_norm ? 0.0f : warp_sum(sum) / p.K;
+    float var = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col < p.K) {
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          float d = v[i][k] - mean;
+          var += d * d;
+        }
+      }
+    }
+    const float rstd = rsqrtf(warp_sum(var) / p.K + p.eps);
+    if (lane == 0) {
+      p.mean[row] = mean;
+      p.rstd[row] = rstd;
+    }
+
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.K) {
+        continue;
+      }
+      float y[kVec];
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        y[k] = (v[i][k] - mean) * rstd;
+      }
+      if (t.weight != nullptr) {
+        float w[kVec];
+        load_vec(t.weight + col, w);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          y[k] *= w[k];
+        }
+      }
+      store_vec(t.out + tensor_row * p.K + col, y);
+    }
+  }
+}
+
+template <typename scalar_t, int kVecsPerLane>
+__global__ void __launch_bounds__(kWarpsPerBlock* kWarpSize)
+    qk_norm_bw_kernel(QKNormParams<scalar_t> p) {
+  constexpr int kVec = Vec<scalar_t>::kSize;
+  const int lane = threadIdx.x % kWarpSize;
+  const int64_t rows = p.query.rows + p.key.rows;
+
+  for (int64_t row = blockIdx.x * kWarpsPerBlock + threadIdx.x / kWarpSize;
+       row < rows;
+       row += int64_t(gridDim.x) * kWarpsPerBlock) {
+    int64_t tensor_row = row;
+    const QKNormTensor<scalar_t>& t = p.tensor(tensor_row);
+    const scalar_t* x = t.row_ptr(tensor_row);
+    const scalar_t* grad = t.grad + tensor_row * p.K;
+    const float mean = p.mean[row];
+    const float rstd = p.rstd[row];
+    // The gradient of the normalized `x`, and the normalized `x`
+    float dy[kVecsPerLane][kVec];
+    float xhat[kVecsPerLane][kVec];
+    float sum_dy = 0.0f;
+    float sum_dy_xhat = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.K) {
+        continue;
+      }
+      load_vec(grad + col, dy[i]);
+      load_vec(x + col, xhat[i]);
+      float w[kVec];
+      if (t.weight != nullptr) {
+        load_vec(t.weight + col, w);
+      }
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        xhat[i][k] = (xhat[i][k] - mean) * rstd;
+        if (t.weight != nullptr) {
+          dy[i][k] *= w[k];
+        }
+        sum_dy += dy[i][k];
+        sum_dy_xhat += dy[i][k] * xhat[i][k];
+      }
+    }
+    // No gradient through the mean with RMSNorm
+    const float mean_dy = p.rms_norm ? 0.0f : warp_sum(sum_dy) / p.K;
+    const float mean_dy_xhat = warp_sum(sum_dy_xhat) / p.K;
+
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.K) {
+        continue;
+      }
+      float dx[kVec];
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        dx[k] = rstd * (dy[i][k] - mean_dy - xhat[i][k] * mean_dy_xhat);
+      }
+      store_vec(t.out + tensor_row * p.K + col, dx);
+    }
+  }
+}
+
+constexpr int kColumnsPerBlock = 32;
+constexpr int kRowsPerIteration = 8;
+
+// Partial sums of `grad * xhat` (gradient of the weight) over the slice of
+// rows `blockIdx.y` of the query (`blockIdx.z == 0`) or of the key, written
+// to `partial` [2, gridDim.y, K]
+template <typename scalar_t>
+__global__ void __launch_bounds__(kColumnsPerBlock* kRowsPerIteration)
+    qk_norm_bw_weight_kernel(
+        QKNormParams<scalar_t> p,
+        int64_t rows_per_split,
+        float* partial) {
+  __shared__ float sums[kRowsPerIteration][kColumnsPerBlock + 1];
+  const QKNormTensor<scalar_t>& t = blockIdx.z == 0 ? p.query : p.key;
+  if (t.weight == nullptr) {
+    return;
+  }
+  // The statistics of the key are after those of the query
+  const float* mean = p.mean + (blockIdx.z == 0 ? 0 : p.query.rows);
+  const float* rstd = p.rstd + (blockIdx.z == 0 ? 0 : p.query.rows);
+  const int64_t col = int64_t(blockIdx.x) * kColumnsPerBlock + threadIdx.x;
+  int64_t row_end = int64_t(blockIdx.y + 1) * rows_per_split;
+  row_end = row_end < t.rows ? row_end : t.rows;
+  float sum = 0.0f;
+  if (col < p.K) {
+    for (int64_t row = blockIdx.y * rows_per_split + threadIdx.y;
+         row < row_end;
+         row += kRowsPerIteration) {
+      float xhat = (float(t.row_ptr(row)[col]) - mean[row]) * rstd[row];
+      sum += float(t.grad[row * p.K + col]) * xhat;
+    }
+  }
+  sums[threadIdx.y][threadIdx.x] = sum;
+  __syncthreads();
+  if (threadIdx.y == 0 && col < p.K) {
+    float total = 0.0f;
+#pragma unroll
+    for (int r = 0; r < kRowsPerIteration; ++r) {
+      total += sums[r][threadIdx.x];
+    }
+    partial[(int64_t(blockIdx.z) * gridDim.y + blockIdx.y) * p.K + col] =
+        total;
+  }
+}
+
+// Calls `fn` with the (power of 2) number of vectors of every lane for rows
+// of `K` channels
+template <typename scalar_t, typename Fn>
+void dispatch_vecs_per_lane(int64_t K, Fn&& fn) {
+  constexpr int64_t kColsPerVec = kWarpSize * Vec<scalar_t>::kSize;
+  int64_t vecs = (K + kColsPerVec - 1) / kColsPerVec;
+  if (vecs <= 1) {
+    fn(std::integral_constant<int, 1>{});
+  } else if (vecs <= 2) {
+    fn(std::integral_constant<int, 2>{});
+  } else {
+    static_assert(kMaxK <= 4 * kWarpSize * 4, "");
+    fn(std::integral_constant<int, 4>{});
+  }
+}
+
+// Enough warps to fill the GPU, which then loop over the rows
+int64_t num_row_blocks(const at::Tensor& x, int64_t rows) {
+  int64_t num_sms =
+      at::cuda::getDeviceProperties(x.device().index())->multiProcessorCount;
+  int64_t blocks = (rows + kWarpsPerBlock - 1) / kWarpsPerBlock;
+  return std::max(std::min(blocks, 16 * num_sms), int64_t(1));
+}
+
+// The rows are read with 128-bit loads
+at::Tensor aligned_rows(const at::Tensor& x, const char* name) {
+  TORCH_CHECK(x.dim() == 4, "qk_norm: ", name, " should be [B, M, H, K]");
+  TORCH_CHECK(x.is_cuda(), "qk_norm: ", name, " should be a CUDA tensor");
+  TORCH_CHECK(
+      x.scalar_type() == at::ScalarType::Float ||
+          x.scalar_type() == at::ScalarType::Half ||
+          x.scalar_type() == at::ScalarType::BFloat16,
+      "qk_norm: only fp32, half & bf16 are supported");
+  const int64_t K = x.size(3);
+  const int64_t alignment = 16 / x.element_size();
+  TORCH_CHECK(
+      K > 0 && K <= kMaxK && K % alignment == 0,
+      "qk_norm: the head dim should be a multiple of ",
+      alignment,
+      " and at most ",
+      kMaxK,
+      " (got ",
+      K,
+      ")");
+  const bool aligned = x.stride(3) == 1 && x.stride(0) % alignment == 0 &&
+      x.stride(1) % alignment == 0 && x.stride(2) % alignment == 0 &&
+      reinterpret_cast<uintptr_t>(x.data_ptr()) % 16 == 0;
+  // Not `contiguous()`, which is a no-op for a contiguous tensor with a
+  // misaligned storage offset
+  return aligned ? x : x.clone(at::MemoryFormat::Contiguous);
+}
+
+void check_weight(
+    const c10::optional<at::Tensor>& w,
+    const at::Tensor& x,
+    const char* name) {
+  if (w.has_value()) {
+    TORCH_CHECK(
+        w->dim() == 1 && w->size(0) == x.size(3),
+        "qk_norm: ",
+        name,
+        " should be of shape [",
+        x.size(3),
+        "]");
+    TORCH_CHECK(
+        w->scalar_type() == x.scalar_type(), name, " has the wrong dtype");
+    TORCH_CHECK(w->is_cuda(), name, " should be a CUDA tensor");
+    TORCH_CHECK(w->is_contiguous(), name, " should be contiguous");
+  }
+}
+
+template <typename scalar_t>
+QKNormTensor<scalar_t> qk_norm_tensor(
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& w,
+    at::Tensor& out) {
+  QKNormTensor<scalar_t> t;
+  t.x = (const scalar_t*)x.data_ptr();
+  t.strideB = x.stride(0);
+  t.strideM = x.stride(1);
+  t.strideH = x.stride(2);
+  t.weight = w.has_value() ? (const scalar_t*)w->data_ptr() : nullptr;
+  t.out = (scalar_t*)out.data_ptr();
+  t.M = x.size(1);
+  t.H = x.size(2);
+  t.rows = x.size(0) * x.size(1) * x.size(2);
+  return t;
+}
+
+// Returns the normalized query and key (contiguous), and the mean / rstd of
+// their rows (those of the query first)
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> qk_norm(
+    const at::Tensor& query_,
+    const at::Tensor& key_,
+    const c10::optional<at::Tensor>& q_weight,
+    const c10::optional<at::Tensor>& k_weight,
+    bool rms_norm,
+    double eps) {
+  const at::Tensor query = aligned_rows(query_, "query");
+  const at::Tensor key = aligned_rows(key_, "key");
+  TORCH_CHECK(key.scalar_type() == query.scalar_type());
+  TORCH_CHECK(key.device() == query.device());
+  TORCH_CHECK(key.size(3) == query.size(3));
+  check_weight(q_weight, query, "q_weight");
+  check_weight(k_weight, key, "k_weight");
+
+  at::cuda::CUDAGuard device_guard(query.device());
+  at::Tensor out_q = at::empty(query.sizes(), query.options());
+  at::Tensor out_k = at::empty(key.sizes(), key.options());
+  const int64_t K = query.size(3);
+  const int64_t rows = query.numel() / K + key.numel() / K;
+  at::Tensor mean = at::empty({rows}, query.options().dtype(at::kFloat));
+  at::Tensor rstd = at::empty({rows}, query.options().dtype(at::kFloat));
+  if (rows == 0) {
+    return std::make_tuple(out_q, out_k, mean, rstd);
+  }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "qk_norm",
+      [&] {
+        QKNormParams<scalar_t> p;
+        p.query = qk_norm_tensor<scalar_t>(query, q_weight, out_q);
+        p.key = qk_norm_tensor<scalar_t>(key, k_weight, out_k);
+        p.mean = mean.data_ptr<float>();
+        p.rstd = rstd.data_ptr<float>();
+        p.K = K;
+        p.rms_norm = rms_norm;
+        p.eps = eps;
+        dispatch_vecs_per_lane<scalar_t>(p.K, [&](auto vecs_per_lane) {
+          qk_norm_fw_kernel<scalar_t, decltype(vecs_per_lane)::value>
+              <<<num_row_blocks(query, rows),
+                 kWarpsPerBlock * kWarpSize,
+                 0,
+                 at::cuda::getCurrentCUDAStream()>>>(p);
+        });
+        C10_CUDA_KERNEL_LAUNCH_CHECK();
+      });
+  return std::make_tuple(out_q, out_k, mean, rstd);
+}
+
+// Returns the gradients of (query, key, q_weight, k_weight) - those of the
+// weights are undefined when they are not used
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> qk_norm_backward(
+    const at::Tensor& grad_q,
+    const at::Tensor& grad_k,
+    const at::Tensor& query_,
+    const at::Tensor& key_,
+    const at::Tensor& mean,
+    const at::Tensor& rstd,
+    const c10::optional<at::Tensor>& q_weight,
+    const c10::optional<at::Tensor>& k_weight,
+    bool rms_norm) {
+  const at::Tensor query = aligned_rows(query_, "query");
+  const at::Tensor key = aligned_rows(key_, "key");
+  TORCH_CHECK(grad_q.sizes() == query.sizes());
+  TORCH_CHECK(grad_k.sizes() == key.sizes());
+  TORCH_CHECK(grad_q.scalar_type() == query.scalar_type());
+  TORCH_CHECK(grad_k.scalar_type() == key.scalar_type());
+  check_weight(q_weight, query, "q_weight");
+  check_weight(k_weight, key, "k_weight");
+  const int64_t K = query.size(3);
+  const int64_t rows_q = query.numel() / K;
+  const int64_t rows = rows_q + key.numel() / K;
+  TORCH_CHECK(mean.numel() == rows && rstd.numel() == rows);
+  TORCH_CHECK(
+      mean.scalar_type() == at::kFloat && rstd.scalar_type() == at::kFloat);
+
+  at::cuda::CUDAGuard device_guard(query.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  const at::Tensor grad_q_ = grad_q.contiguous();
+  const at::Tensor grad_k_ = grad_k.contiguous();
+  at::Tensor grad_query = at::empty(query.sizes(), query.options());
+  at::Tensor grad_key = at::empty(key.sizes(), key.options());
+  at::Tensor grad_q_weight, grad_k_weight;
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      query.scalar_type(),
+      "qk_norm_backward",
+      [&] {
+        QKNormParams<scalar_t> p;
+        p.query = qk_norm_tensor<scalar_t>(query, q_weight, grad_query);
+        p.key = qk_norm_tensor<scalar_t>(key, k_weight, grad_key);
+        p.query.grad = (const scalar_t*)grad_q_.data_ptr();
+        p.key.grad = (const scalar_t*)grad_k_.data_ptr();
+        p.mean = (float*)mean.data_ptr();
+        p.rstd = (float*)rstd.data_ptr();
+        p.K = K;
+        p.rms_norm = rms_norm;
+        if (rows > 0) {
+          dispatch_vecs_per_lane<scalar_t>(K, [&](auto vecs_per_lane) {
+            qk_norm_bw_kernel<scalar_t, decltype(vecs_per_lane)::value>
+                <<<num_row_blocks(query, rows),
+                   kWarpsPerBlock * kWarpSize,
+                   0,
+                   stream>>>(p);
+          });
+          C10_CUDA_KERNEL_LAUNCH_CHECK();
+        }
+        if (!q_weight.has_value() && !k_weight.has_value()) {
+          return;
+        }
+
+        // Slices of rows so that there are a few blocks per SM
+        const int64_t column_blocks =
+            (K + kColumnsPerBlock - 1) / kColumnsPerBlock;
+        const int64_t num_sms =
+            at::cuda::getDeviceProperties(query.device().index())
+                ->multiProcessorCount;
+        const int64_t max_rows = std::max(rows_q, rows - rows_q);
+        int64_t splits = std::max(
+            std::min(
+                (max_rows + 16 * kRowsPerIteration - 1) /
+                    (16 * kRowsPerIteration),
+                (4 * num_sms + column_blocks - 1) / column_blocks),
+            int64_t(1));
+        TORCH_CHECK(splits <= 65535);
+        const int64_t rows_per_split = (max_rows + splits - 1) / splits;
+        at::Tensor partial =
+            at::zeros({2, splits, K}, query.options().dtype(at::kFloat));
+        if (rows > 0) {
+          qk_norm_bw_weight_kernel<scalar_t>
+              <<<dim3(column_blocks, splits, 2),
+                 dim3(kColumnsPerBlock, kRowsPerIteration),
+                 0,
+                 stream>>>(p, rows_per_split, partial.data_ptr<float>());
+          C10_CUDA_KERNEL_LAUNCH_CHECK();
+        }
+        at::Tensor sums = partial.sum(1).to(query.scalar_type());
+        if (q_weight.has_value()) {
+          grad_q_weight = sums[0];
+        }
+        if (k_weight.has_value()) {
+          grad_k_weight = sums[1];
+        }
+      });
+  return std::make_tuple(grad_query, grad_key, grad_q_weight, grad_k_weight);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(TORCH_SELECTIVE_NAME("xformers::qk_norm"), TORCH_FN(qk_norm));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::qk_norm_backward"),
+      TORCH_FN(qk_norm_backward));
+}
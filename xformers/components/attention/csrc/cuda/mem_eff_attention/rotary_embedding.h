@@ -0,0 +1,199 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+
+// Rotary position embedding (RoPE), in the "rotate_half" convention:
+//   x_rot = x * cos + rotate_half(x) * sin
+//   with rotate_half([x1, x2]) = [-x2, x1]
+// The query / key at the index `i` of its sequence uses the row
+// `positions[b, i]` of the `cos` / `sin` tables, or the row `i` without
+// `positions`.
+// The forward kernels rotate the query and the key as they are loaded when
+// `use_fused_rotary_embedding` (see `RotaryTileIterator`). Otherwise, and in
+// the backward, the rotation of the query and of the key are done in a single
+// pass, and the inverse rotation (used for the gradients) is the transpose:
+//   grad_x = grad * cos + rotate_half^T(grad * sin)
+//   with rotate_half^T([y1, y2]) = [y2, -y1]
+namespace {
+
+// The fused kernels load the head dim in tiles of 32 channels, and rotate
+// each of them with the tile half a head dim away
+constexpr int64_t kFusedRotaryHeadDimAlignment = 64;
+
+template <typename scalar_t>
+struct RotaryEmbeddingTensor {
+  const scalar_t* in; // [B, M, H, K]
+  scalar_t* out; // [B, M, H, K] - can be the same as `in`
+  int64_t in_strideB, in_strideM, in_strideH;
+  int64_t out_strideB, out_strideM, out_strideH;
+  const int32_t* positions; // [B, M] - can be null
+  int64_t positions_strideB;
+  int32_t M, H;
+};
+
+template <typename scalar_t>
+__global__ void rotary_embedding_qk_kernel(
+    RotaryEmbeddingTensor<scalar_t> q,
+    RotaryEmbeddingTensor<scalar_t> k,
+    const float* __restrict__ cos, // [max_seqlen, K]
+    const float* __restrict__ sin, // [max_seqlen, K]
+    int64_t cos_sin_strideM,
+    int32_t B,
+    int32_t K,
+    bool inverse) {
+  // One block per row of `q` or `k`
+  int64_t row = blockIdx.x;
+  int64_t num_q_rows = int64_t(B) * q.M * q.H;
+  const auto& t = row < num_q_rows ? q : k;
+  if (row >= num_q_rows) {
+    row -= num_q_rows;
+  }
+  int64_t b = row / (t.M * t.H);
+  int64_t m = (row / t.H) % t.M;
+  int64_t h = row % t.H;
+  const scalar_t* in =
+      t.in + b * t.in_strideB + m * t.in_strideM + h * t.in_strideH;
+  scalar_t* out =
+      t.out + b * t.out_strideB + m * t.out_strideM + h * t.out_strideH;
+  int64_t position =
+      t.positions != nullptr ? t.positions[b * t.positions_strideB + m] : m;
+  const float* cos_row = cos + position * cos_sin_strideM;
+  const float* sin_row = sin + position * cos_sin_strideM;
+
+  int32_t half = K / 2;
+  for (int32_t d = threadIdx.x; d < half; d += blockDim.x) {
+    float x1 = float(in[d]);
+    float x2 = float(in[d + half]);
+    float y1, y2;
+    if (inverse) {
+      y1 = x1 * cos_row[d] + x2 * sin_row[d + half];
+      y2 = x2 * cos_row[d + half] - x1 * sin_row[d];
+    } else {
+      y1 = x1 * cos_row[d] - x2 * sin_row[d];
+      y2 = x2 * cos_row[d + half] + x1 * sin_row[d + half];
+    }
+    out[d] = scalar_t(y1);
+    out[d + half] = scalar_t(y2);
+  }
+}
+
+template <typename scalar_t>
+RotaryEmbeddingTensor<scalar_t> make_rotary_embedding_tensor(
+    const at::Tensor& in,
+    const at::Tensor& out,
+    const c10::optional<at::Tensor>& positions) {
+  RotaryEmbeddingTensor<scalar_t> t;
+  t.in = (const scalar_t*)in.data_ptr();
+  t.out = (scalar_t*)out.data_ptr();
+  t.in_strideB = in.stride(0);
+  t.in_strideM = in.stride(1);
+  t.in_strideH = in.stride(2);
+  t.out_strideB = out.stride(0);
+  t.out_strideM = out.stride(1);
+  t.out_strideH = out.stride(2);
+  t.positions =
+      positions.has_value() ? (const int32_t*)positions->data_ptr() : nullptr;
+  t.positions_strideB = positions.has_value() ? positions->stride(0) : 0;
+  t.M = in.size(1);
+  t.H = in.size(2);
+  return t;
+}
+
+// Checks the `cos` / `sin` tables and the positions against `query` / `key`
+// [B, M, H, K]. The positions are not read on the host: they should be
+// smaller than `cos.size(0)`
+void check_rotary_embedding(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    const c10::optional<at::Tensor>& positions_q,
+    const c10::optional<at::Tensor>& positions_k) {
+  TORCH_CHECK(cos.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(sin.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(cos.dim() == 2 && sin.dim() == 2);
+  TORCH_CHECK(cos.sizes() == sin.sizes() && cos.strides() == sin.strides());
+  for (auto x : {std::make_pair(&query, &positions_q),
+                 std::make_pair(&key, &positions_k)}) {
+    const auto& positions = *x.second;
+    if (!positions.has_value()) {
+      TORCH_CHECK(cos.size(0) >= x.first->size(1));
+      continue;
+    }
+    TORCH_CHECK(
+        positions->scalar_type() == at::ScalarType::Int,
+        "RoPE positions should be int32");
+    TORCH_CHECK(
+        positions->dim() == 2 && positions->size(0) == x.first->size(0) &&
+            positions->size(1) == x.first->size(1),
+        "RoPE positions should be [batch, seqlen]");
+    TORCH_CHECK(positions->stride(1) == 1 && positions->is_cuda());
+  }
+  TORCH_CHECK(cos.size(1) == query.size(3));
+  TORCH_CHECK(key.size(3) == query.size(3));
+  TORCH_CHECK(query.size(3) % 2 == 0, "RoPE requires an even head dim");
+  TORCH_CHECK(cos.stride(1) == 1 && cos.is_cuda());
+}
+
+// Whether the forward kernels can rotate `query` / `key` as they are loaded:
+// Sm80+, f16/bf16 inputs aligned for the aligned kernels
+bool use_fused_rotary_embedding(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    int compute_capability) {
+  auto aligned = [](const at::Tensor& t) {
+    const int64_t alignment = 16 / t.element_size();
+    return uint64_t(t.data_ptr()) % 16 == 0 && t.stride(0) % alignment == 0 &&
+        t.stride(1) % alignment == 0 && t.stride(2) % alignment == 0;
+  };
+  return compute_capability >= 80 &&
+      (query.scalar_type() == at::ScalarType::Half ||
+       query.scalar_type() == at::ScalarType::BFloat16) &&
+      query.size(3) % kFusedRotaryHeadDimAlignment == 0 && aligned(query) &&
+      aligned(key);
+}
+
+// Writes the rotation (or the inverse rotation) of `q_in` and `k_in` to
+// `q_out` and `k_out`, which can alias the inputs
+void apply_rotary_embedding_qk(
+    const at::Tensor& q_in,
+    const at::Tensor& k_in,
+    const at::Tensor& q_out,
+    const at::Tensor& k_out,
+    const at::Tensor& cos,
+    const at::Tensor& sin,
+    const c10::optional<at::Tensor>& positions_q,
+    const c10::optional<at::Tensor>& positions_k,
+    bool inverse) {
+  int64_t num_rows = q_in.size(0) *
+      (q_in.size(1) * q_in.size(2) + k_in.size(1) * k_in.size(2));
+  if (num_rows == 0) {
+    return;
+  }
+  int64_t K = q_in.size(3);
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      q_in.scalar_type(),
+      "rotary_embedding_qk",
+      [&] {
+        rotary_embedding_qk_kernel<scalar_t>
+            <<<num_rows, std::min(K / 2, int64_t(128)), 0, stream>>>(
+                make_rotary_embedding_tensor<scalar_t>(
+                    q_in, q_out, positions_q),
+                make_rotary_embedding_tensor<scalar_t>(
+                    k_in, k_out, positions_k),
+                (const float*)cos.data_ptr(),
+                (const float*)sin.data_ptr(),
+                cos.stride(0),
+                q_in.size(0),
+                K,
+                inverse);
+      });
+  AT_CUDA_CHECK(cudaGetLastError());
+}
+
+} // namespace
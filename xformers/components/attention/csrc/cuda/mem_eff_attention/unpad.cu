@@ -0,0 +1,272 @@
+#include <ATen/ATen.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include <cub/block/block_reduce.cuh>
+#include <cub/block/block_scan.cuh>
+
+#include <tuple>
+#include <vector>
+
+// Conversion between padded [B, M, ...] inputs with a [B, M] boolean mask of
+// the valid tokens, and the Mode 1MHK layout of the kernels: the valid
+// tokens of all the sequences concatenated as [1, B * M, ...], followed by
+// zeros (as the number of tokens is only known on the device), with
+// `cu_seqlens` [B + 1] and `max_seqlen` [1] int32.
+// The position of every token is computed on the device, so that nothing
+// synchronizes with the host: the kernels ignore the queries / keys after
+// `cu_seqlens[-1]`.
+// Every block handles a sequence, by tiles of `kThreads` tokens: a block
+// scan of the mask of the tile gives the destination of its tokens, which
+// are then copied by all the threads of the block
+namespace {
+
+constexpr int kThreads = 256;
+constexpr int kMaxUnpadInputs = 4;
+
+template <typename vec_t>
+struct UnpadParams {
+  const bool* mask; // [B, M]
+  const int32_t* cu_seqlens; // [B + 1]
+  // [B, M, vecs_per_token] padded / [B * M, vecs_per_token] unpadded
+  const vec_t* src[kMaxUnpadInputs];
+  vec_t* dst[kMaxUnpadInputs];
+  int64_t vecs_per_token[kMaxUnpadInputs];
+  int32_t num_inputs;
+  int32_t B;
+  int64_t M;
+};
+
+__global__ void unpad_seqlens_kernel(
+    const bool* mask,
+    int64_t M,
+    int32_t B,
+    int32_t* seqlens, // [B]
+    int32_t* max_seqlen) {
+  using BlockReduce = cub::BlockReduce<int32_t, kThreads>;
+  __shared__ typename BlockReduce::TempStorage tmp;
+  const bool* row = mask + blockIdx.x * M;
+  int32_t count = 0;
+  for (int64_t m = threadIdx.x; m < M; m += kThreads) {
+    count += row[m] ? 1 : 0;
+  }
+  count = BlockReduce(tmp).Sum(count);
+  if (threadIdx.x == 0) {
+    seqlens[blockIdx.x] = count;
+    atomicMax(max_seqlen, count);
+  }
+}
+
+// `kPad=false`: padded -> unpadded, `kPad=true`: unpadded -> padded
+template <bool kPad, typename vec_t>
+__global__ void __launch_bounds__(kThreads)
+    unpad_kernel(UnpadParams<vec_t> p) {
+  using BlockScan = cub::BlockScan<int32_t, kThreads>;
+  __shared__ typename BlockScan::TempStorage tmp;
+  __shared__ int64_t unpadded_pos[kThreads];
+  __shared__ bool tile_mask[kThreads];
+
+  const int64_t b = blockIdx.x;
+  const bool* row = p.mask + b * p.M;
+  const int64_t row_start = p.cu_seqlens[b];
+  // The padding tokens go after all the valid ones, in order
+  const int64_t pad_start = p.cu_seqlens[p.B] + b * p.M - row_start;
+  int64_t valid_before = 0;
+  for (int64_t m0 = 0; m0 < p.M; m0 += kThreads) {
+    const int64_t m = m0 + threadIdx.x;
+    const bool valid = m < p.M && row[m];
+    int32_t rank, tile_valid;
+    BlockScan(tmp).ExclusiveSum(valid ? 1 : 0, rank, tile_valid);
+    if (m < p.M) {
+      unpadded_pos[threadIdx.x] = valid
+          ? row_start + valid_before + rank
+          : pad_start + (m - valid_before - rank);
+      tile_mask[threadIdx.x] = valid;
+    }
+    __syncthreads();
+
+    const int64_t tile_tokens = min(int64_t(kThreads), p.M - m0);
+    for (int32_t i = 0; i < p.num_inputs; ++i) {
+      const int64_t vecs = p.vecs_per_token[i];
+      for (int64_t idx = threadIdx.x; idx < tile_tokens * vecs;
+           idx += kThreads) {
+        const int64_t t = idx / vecs;
+        const int64_t v = idx % vecs;
+        const int64_t padded = (b * p.M + m0 + t) * vecs + v;
+        const int64_t unpadded = unpadded_pos[t] * vecs + v;
+        if (kPad) {
+          p.dst[i][padded] = tile_mask[t] ? p.src[i][unpadded] : vec_t{};
+        } else {
+          p.dst[i][unpadded] = tile_mask[t] ? p.src[i][padded] : vec_t{};
+        }
+      }
+    }
+    valid_before += tile_valid;
+    __syncthreads();
+  }
+}
+
+void check_padding_mask(const at::Tensor& padding_mask) {
+  TORCH_CHECK(padding_mask.is_cuda());
+  TORCH_CHECK(padding_mask.dim() == 2, "padding_mask should be [B, M]");
+  TORCH_CHECK(padding_mask.scalar_type() == at::ScalarType::Bool);
+  TORCH_CHECK(padding_mask.is_contiguous());
+}
+
+// The tokens of `x` [B, M, ...] as contiguous rows
+at::Tensor padded_rows(const at::Tensor& x, const at::Tensor& padding_mask) {
+  TORCH_CHECK(x.dim() >= 2);
+  TORCH_CHECK(x.device() == padding_mask.device());
+  TORCH_CHECK(
+      x.size(0) == padding_mask.size(0) && x.size(1) == padding_mask.size(1),
+      "inputs should be [B, M, ...] for a [B, M] padding_mask");
+  return x.reshape({x.size(0), x.size(1), -1}).contiguous();
+}
+
+// Largest access width (up to 16 bytes) dividing all the rows
+int64_t vec_bytes_for(
+    const std::vector<at::Tensor>& srcs,
+    const std::vector<at::Tensor>& dsts) {
+  int64_t vec_bytes = 16;
+  for (const auto* tensors : {&srcs, &dsts}) {
+    for (const at::Tensor& t : *tensors) {
+      int64_t row_bytes = t.size(-1) * t.element_size();
+      while (row_bytes % vec_bytes != 0 ||
+             reinterpret_cast<uintptr_t>(t.data_ptr()) % vec_bytes != 0) {
+        vec_bytes /= 2;
+      }
+    }
+  }
+  return vec_bytes;
+}
+
+template <bool kPad, typename vec_t>
+void launch_unpad(
+    const std::vector<at::Tensor>& srcs,
+    const std::vector<at::Tensor>& dsts,
+    const at::Tensor& padding_mask,
+    const at::Tensor& cu_seqlens) {
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  for (size_t first = 0; first < srcs.size(); first += kMaxUnpadInputs) {
+    UnpadParams<vec_t> p;
+    p.mask = padding_mask.data_ptr<bool>();
+    p.cu_seqlens = cu_seqlens.data_ptr<int32_t>();
+    p.B = padding_mask.size(0);
+    p.M = padding_mask.size(1);
+    p.num_inputs = std::min(srcs.size() - first, size_t(kMaxUnpadInputs));
+    for (int32_t i = 0; i < p.num_inputs; ++i) {
+      p.src[i] = reinterpret_cast<const vec_t*>(srcs[first + i].data_ptr());
+      p.dst[i] = reinterpret_cast<vec_t*>(dsts[first + i].data_ptr());
+      p.vecs_per_token[i] =
+          srcs[first + i].size(-1) * srcs[first + i].element_size() /
+          sizeof(vec_t);
+    }
+    unpad_kernel<kPad, vec_t><<<p.B, kThreads, 0, stream>>>(p);
+    AT_CUDA_CHECK(cudaGetLastError());
+  }
+}
+
+// Copies `srcs` to `dsts` (rows of any width, of the same dtype)
+template <bool kPad>
+void dispatch_unpad(
+    const std::vector<at::Tensor>& srcs,
+    const std::vector<at::Tensor>& dsts,
+    const at::Tensor& padding_mask,
+    const at::Tensor& cu_seqlens) {
+  if (padding_mask.numel() == 0 || srcs.empty()) {
+    return;
+  }
+  switch (vec_bytes_for(srcs, dsts)) {
+    case 16:
+      return launch_unpad<kPad, uint4>(srcs, dsts, padding_mask, cu_seqlens);
+    case 8:
+      return launch_unpad<kPad, uint2>(srcs, dsts, padding_mask, cu_seqlens);
+    case 4:
+      return launch_unpad<kPad, uint32_t>(
+          srcs, dsts, padding_mask, cu_seqlens);
+    case 2:
+      return launch_unpad<kPad, uint16_t>(
+          srcs, dsts, padding_mask, cu_seqlens);
+    default:
+      return launch_unpad<kPad, uint8_t>(srcs, dsts, padding_mask, cu_seqlens);
+  }
+}
+
+std::tuple<std::vector<at::Tensor>, at::Tensor, at::Tensor> unpad_inputs(
+    at::TensorList inputs,
+    const at::Tensor& padding_mask) {
+  check_padding_mask(padding_mask);
+  at::cuda::CUDAGuard device_guard(padding_mask.device());
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+
+  // `cu_seqlens` followed by `max_seqlen`, zeroed by a single fill
+  at::Tensor seqlens_buffer =
+      at::zeros({B + 2}, padding_mask.options().dtype(at::ScalarType::Int));
+  at::Tensor cu_seqlens = seqlens_buffer.narrow(0, 0, B + 1);
+  at::Tensor max_seqlen = seqlens_buffer.narrow(0, B + 1, 1);
+  if (B > 0) {
+    at::Tensor seqlens = at::empty({B}, cu_seqlens.options());
+    unpad_seqlens_kernel<<<
+        B,
+        kThreads,
+        0,
+        at::cuda::getCurrentCUDAStream()>>>(
+        padding_mask.data_ptr<bool>(),
+        M,
+        B,
+        seqlens.data_ptr<int32_t>(),
+        max_seqlen.data_ptr<int32_t>());
+    AT_CUDA_CHECK(cudaGetLastError());
+    at::cumsum_out(
+        cu_seqlens.narrow(0, 1, B), seqlens, 0, at::ScalarType::Int);
+  }
+
+  std::vector<at::Tensor> srcs, dsts, outputs;
+  for (const at::Tensor& x : inputs) {
+    srcs.push_back(padded_rows(x, padding_mask));
+    std::vector<int64_t> shape = x.sizes().vec();
+    shape[1] = B * M;
+    shape[0] = 1;
+    outputs.push_back(at::empty(shape, x.options()));
+    dsts.push_back(outputs.back().view({B * M, srcs.back().size(-1)}));
+  }
+  dispatch_unpad<false>(srcs, dsts, padding_mask, cu_seqlens);
+  return std::make_tuple(outputs, cu_seqlens, max_seqlen);
+}
+
+at::Tensor pad_output(
+    const at::Tensor& x,
+    const at::Tensor& padding_mask,
+    const at::Tensor& cu_seqlens) {
+  check_padding_mask(padding_mask);
+  at::cuda::CUDAGuard device_guard(padding_mask.device());
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+  TORCH_CHECK(x.dim() >= 2);
+  TORCH_CHECK(
+      x.size(0) == 1 && x.size(1) == B * M,
+      "x should be [1, B * M, ...] for a [B, M] padding_mask");
+  TORCH_CHECK(x.device() == padding_mask.device());
+  TORCH_CHECK(cu_seqlens.scalar_type() == at::ScalarType::Int);
+  TORCH_CHECK(cu_seqlens.dim() == 1 && cu_seqlens.size(0) == B + 1);
+  TORCH_CHECK(cu_seqlens.is_contiguous());
+
+  std::vector<int64_t> shape = x.sizes().vec();
+  shape[0] = B;
+  shape[1] = M;
+  at::Tensor out = at::empty(shape, x.options());
+  at::Tensor src = x.reshape({B * M, -1}).contiguous();
+  dispatch_unpad<true>(
+      {src}, {out.view({B * M, src.size(-1)})}, padding_mask, cu_seqlens);
+  return out;
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::unpad_inputs"), TORCH_FN(unpad_inputs));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::pad_output"), TORCH_FN(pad_output));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+#include <cuda_runtime.h>
+
+// Helpers for the half / bfloat16 variants of the sputnik kernels. sputnik
+// only has fp32 kernels for the batched ops (and its half kernels need 16-bit
+// column indices and rows padded to an even number of nonzeros), so these
+// variants are written directly in terms of vectors of `kVecSize` consecutive
+// elements, loaded with a single access of up to 16 bytes, and accumulate in
+// float
+namespace sputnik {
+namespace {
+
+constexpr int kReducedWarpSize = 32;
+
+// Loads an element as float, through the read-only cache for float
+template <typename scalar_t>
+__device__ __forceinline__ float LoadFloat(const scalar_t* __restrict__ src) {
+  return static_cast<float>(*src);
+}
+
+__device__ __forceinline__ float LoadFloat(const float* __restrict__ src) {
+  return __ldg(src);
+}
+
+template <typename scalar_t, int kVecSize>
+struct alignas(sizeof(scalar_t) * kVecSize) VecType {
+  scalar_t values[kVecSize];
+};
+
+template <typename scalar_t, int kVecSize>
+__device__ __forceinline__ void LoadVec(
+    const scalar_t* __restrict__ src,
+    float* dst) {
+  VecType<scalar_t, kVecSize> v =
+      *reinterpret_cast<const VecType<scalar_t, kVecSize>*>(src);
+#pragma unroll
+  for (int i = 0; i < kVecSize; ++i) {
+    dst[i] = static_cast<float>(v.values[i]);
+  }
+}
+
+template <typename scalar_t, int kVecSize>
+__device__ __forceinline__ void StoreVec(
+    const float* src,
+    scalar_t* __restrict__ dst) {
+  VecType<scalar_t, kVecSize> v;
+#pragma unroll
+  for (int i = 0; i < kVecSize; ++i) {
+    v.values[i] = static_cast<scalar_t>(src[i]);
+  }
+  *reinterpret_cast<VecType<scalar_t, kVecSize>*>(dst) = v;
+}
+
+// Widest vector (8, 4, 2 or 1 elements) which divides the rows of `n`
+// elements, and to which every pointer is aligned
+template <typename scalar_t>
+int MaxVecSize(int n, std::initializer_list<const void*> ptrs) {
+  for (int vec_size = 16 / sizeof(scalar_t); vec_size > 1; vec_size /= 2) {
+    bool aligned = n % vec_size == 0;
+    for (const void* ptr : ptrs) {
+      aligned = aligned &&
+          reinterpret_cast<uintptr_t>(ptr) % (vec_size * sizeof(scalar_t)) ==
+              0;
+    }
+    if (aligned) {
+      return vec_size;
+    }
+  }
+  return 1;
+}
+
+} // namespace
+} // namespace sputnik
@@ -30,11 +30,15 @@
 #include "sputnik/tiling_utils.h"
 
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
 #include <torch/types.h>
 
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
 
+#include "../batched_pattern.h"
+#include "reduced_precision.h"
+
 namespace sputnik {
 
 namespace {
@@ -319,6 +323,184 @@ cudaError_t CudaSddmm2(
   }
 }
 
+namespace sputnik {
+namespace {
+
+// Nonzeros of a row handled by each warp of the reduced precision kernel
+constexpr int kSddmmNonzerosPerWarp = 32;
+constexpr int kSddmmWarpsPerBlock = 4;
+
+// Half / bfloat16 variant of CudaSddmmKernel2: each warp computes the dot
+// products of a row of the lhs with `kSddmmNonzerosPerWarp` rows of the rhs,
+// with the lanes of the warp splitting the k-dimension in `kVecSize`-wide
+// vectors, and accumulating in float
+template <typename scalar_t, int kVecSize>
+__global__ void __launch_bounds__(kReducedWarpSize* kSddmmWarpsPerBlock)
+    CudaSddmmReducedKernel(
+        int m,
+        int k,
+        int n,
+        const int* __restrict__ row_indices,
+        const int* __restrict__ row_offsets,
+        const int* __restrict__ column_indices,
+        const scalar_t* __restrict__ lhs_matrix,
+        const scalar_t* __restrict__ rhs_matrix,
+        scalar_t* __restrict__ output_values,
+        int nnz) {
+  int m_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (m_index >= m)
+    return;
+  m_index = Load(row_indices + m_index);
+
+  int row_offset = Load(row_offsets + m_index);
+  int nonzeros = Load(row_offsets + m_index + 1) - row_offset;
+  int n_index = blockIdx.y * kSddmmNonzerosPerWarp;
+  if (n_index >= nonzeros)
+    return;
+  nonzeros = Min(nonzeros, n_index + kSddmmNonzerosPerWarp);
+
+  const scalar_t* lhs_row =
+      lhs_matrix + (int64_t(blockIdx.z) * m + m_index) * k;
+  const scalar_t* rhs = rhs_matrix + int64_t(blockIdx.z) * n * k;
+  scalar_t* out = output_values + int64_t(blockIdx.z) * nnz + row_offset;
+
+  float lhs_fragment[kVecSize];
+  float rhs_fragment[kVecSize];
+  for (; n_index < nonzeros; ++n_index) {
+    const scalar_t* rhs_row =
+        rhs + int64_t(Load(column_indices + row_offset + n_index)) * k;
+    float accumulator = 0.0f;
+    for (int idx = threadIdx.x * kVecSize; idx < k;
+         idx += kReducedWarpSize * kVecSize) {
+      LoadVec<scalar_t, kVecSize>(lhs_row + idx, lhs_fragment);
+      LoadVec<scalar_t, kVecSize>(rhs_row + idx, rhs_fragment);
+#pragma unroll
+      for (int i = 0; i < kVecSize; ++i) {
+        accumulator += lhs_fragment[i] * rhs_fragment[i];
+      }
+    }
+    for (int idx = kReducedWarpSize / 2; idx > 0; idx /= 2) {
+      accumulator += __shfl_xor_sync(0xffffffff, accumulator, idx);
+    }
+    if (threadIdx.x == 0) {
+      out[n_index] = static_cast<scalar_t>(accumulator);
+    }
+  }
+}
+
+template <typename scalar_t, int kVecSize>
+cudaError_t CudaSddmmReducedEx(
+    int m,
+    int k,
+    int n,
+    int nonzeros,
+    const int* __restrict__ row_indices,
+    const int* __restrict__ row_offsets,
+    const int* __restrict__ column_indices,
+    const scalar_t* __restrict__ lhs_matrix,
+    const scalar_t* __restrict__ rhs_matrix,
+    scalar_t* __restrict__ output_values,
+    cudaStream_t stream,
+    int batch_size) {
+  dim3 grid_dim(
+      std::ceil(static_cast<float>(m) / kSddmmWarpsPerBlock),
+      std::ceil(static_cast<float>(n) / kSddmmNonzerosPerWarp),
+      batch_size);
+  dim3 block_dim(kReducedWarpSize, kSddmmWarpsPerBlock, 1);
+
+  CudaSddmmReducedKernel<scalar_t, kVecSize>
+      <<<grid_dim, block_dim, 0, stream>>>(
+          m,
+          k,
+          n,
+          row_indices,
+          row_offsets,
+          column_indices,
+          lhs_matrix,
+          rhs_matrix,
+          output_values,
+          nonzeros);
+  return cudaGetLastError();
+}
+
+} // namespace
+
+template <typename scalar_t>
+cudaError_t CudaSddmmReduced(
+    int m,
+    int k,
+    int n,
+    int nonzeros,
+    const int* __restrict__ row_indices,
+    const int* __restrict__ row_offsets,
+    const int* __restrict__ column_indices,
+    const scalar_t* __restrict__ lhs_matrix,
+    const scalar_t* __restrict__ rhs_matrix,
+    scalar_t* __restrict__ output_values,
+    cudaStream_t stream,
+    int batch_size) {
+  switch (MaxVecSize<scalar_t>(k, {lhs_matrix, rhs_matrix})) {
+    case 8:
+      return CudaSddmmReducedEx<scalar_t, 8>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          row_offsets,
+          column_indices,
+          lhs_matrix,
+          rhs_matrix,
+          output_values,
+          stream,
+          batch_size);
+    case 4:
+      return CudaSddmmReducedEx<scalar_t, 4>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          row_offsets,
+          column_indices,
+          lhs_matrix,
+          rhs_matrix,
+          output_values,
+          stream,
+          batch_size);
+    case 2:
+      return CudaSddmmReducedEx<scalar_t, 2>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          row_offsets,
+          column_indices,
+          lhs_matrix,
+          rhs_matrix,
+          output_values,
+          stream,
+          batch_size);
+    default:
+      return CudaSddmmReducedEx<scalar_t, 1>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          row_offsets,
+          column_indices,
+          lhs_matrix,
+          rhs_matrix,
+          output_values,
+          stream,
+          batch_size);
+  }
+}
+
+} // namespace sputnik
+
 at::Tensor sddmm_sputnik(
     const at::Tensor& a,
     const at::Tensor& b,
@@ -329,6 +511,13 @@ at::Tensor sddmm_sputnik(
   TORCH_CHECK(a.dim() == 3);
   TORCH_CHECK(a.size(0) == b.size(0));
   TORCH_CHECK(a.size(2) == b.size(2));
+  TORCH_CHECK(
+      a.scalar_type() == b.scalar_type(), "a should have the same dtype as b");
+  TORCH_CHECK(
+      a.scalar_type() == at::ScalarType::Float ||
+          a.scalar_type() == at::ScalarType::Half ||
+          a.scalar_type() == at::ScalarType::BFloat16,
+      "sddmm_sputnik only supports float, half and bfloat16 inputs");
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
@@ -374,22 +563,52 @@ at::Tensor sddmm_sputnik(
   int n = b.size(1);
 
   int nonzeros = column_indices.size(0);
+  TORCH_CHECK(
+      row_offsets.size(0) == m + 1 || is_batched_pattern(batch, m, row_offsets),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
+
+  // a per-batch pattern is a single [batch * m, batch * n] sparse matrix,
+  // sampled from the [batch * m, k] and [batch * n, k] stacked matrices
+  if (is_batched_pattern(batch, m, row_offsets)) {
+    m *= batch;
+    n *= batch;
+    batch = 1;
+  }
 
   at::Tensor output = at::empty({batch, nonzeros}, a.options());
 
-  AT_CUDA_CHECK(CudaSddmm2(
-      m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      a.data_ptr<float>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      stream,
-      batch));
+  if (a.scalar_type() == at::ScalarType::Float) {
+    AT_CUDA_CHECK(CudaSddmm2(
+        m,
+        k,
+        n,
+        nonzeros,
+        row_indices.data_ptr<int>(),
+        row_offsets.data_ptr<int>(),
+        column_indices.data_ptr<int>(),
+        a.data_ptr<float>(),
+        b.data_ptr<float>(),
+        output.data_ptr<float>(),
+        stream,
+        batch));
+    return output;
+  }
+  AT_DISPATCH_REDUCED_FLOATING_TYPES(a.scalar_type(), "sddmm_sputnik", [&] {
+    AT_CUDA_CHECK(sputnik::CudaSddmmReduced<scalar_t>(
+        m,
+        k,
+        n,
+        nonzeros,
+        row_indices.data_ptr<int>(),
+        row_offsets.data_ptr<int>(),
+        column_indices.data_ptr<int>(),
+        a.data_ptr<scalar_t>(),
+        b.data_ptr<scalar_t>(),
+        output.data_ptr<scalar_t>(),
+        stream,
+        batch));
+  });
 
   return output;
 }
@@ -1,6 +1,7 @@
 // taken from
 // https://github.com/hgyhungry/ge-spmm/blob/master/pytorch-custom/sddmm.cu with
-// slight modifications to add batch support
+// slight modifications to add batch support and to give every block an equal
+// slice of the nonzeros
 #include <ATen/ATen.h>
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
@@ -64,34 +65,36 @@ __global__ void sddmmCOO4Scale(
     if (threadIdx.x == 0) {
       Store<float4, float>(O_cooVal, multi, eid);
     }
-  } else // Dynamic parrallel?
-  {
-    eid = Size - (Size & 15) + (blockIdx.x - (Size / 16));
-    int offset1 = S_cooRowInd[eid] * D_kcols;
-    int offset2 = S_cooColInd[eid] * D_kcols;
-    T multi = 0;
-    int off1 = cid = threadIdx.x + (threadIdx.y << 3);
-    float D1tmp0, D2tmp0;
-    for (int cc = 0; cc < (D_kcols >> 5); cc++) {
-      D1tmp0 = D1_dnVal[offset1 + cid];
-      D2tmp0 = D2_dnVal[offset2 + cid];
-      multi += D1tmp0 * D2tmp0;
-      cid += 32;
-    }
-    int res = D_kcols & 31;
-    D1tmp0 = D2tmp0 = 0;
-    if (res) {
-      if (off1 < res) {
+  } else {
+    // the last block handles the remaining nonzeros one after the other,
+    // with its single warp splitting the k dimension
+    for (eid = Size - (Size & 15); eid < Size; ++eid) {
+      int offset1 = S_cooRowInd[eid] * D_kcols;
+      int offset2 = S_cooColInd[eid] * D_kcols;
+      T multi = 0;
+      int off1 = cid = threadIdx.x + (threadIdx.y << 3);
+      float D1tmp0, D2tmp0;
+      for (int cc = 0; cc < (D_kcols >> 5); cc++) {
         D1tmp0 = D1_dnVal[offset1 + cid];
         D2tmp0 = D2_dnVal[offset2 + cid];
+        multi += D1tmp0 * D2tmp0;
+        cid += 32;
+      }
+      int res = D_kcols & 31;
+      D1tmp0 = D2tmp0 = 0;
+      if (res) {
+        if (off1 < res) {
+          D1tmp0 = D1_dnVal[offset1 + cid];
+          D2tmp0 = D2_dnVal[offset2 + cid];
+        }
+        multi += D1tmp0 * D2tmp0;
+      }
+      for (int stride = 16; stride > 0; stride >>= 1) {
+        multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
+      }
+      if (threadIdx.x == 0 && threadIdx.y == 0) {
+        O_cooVal[eid] = multi;
       }
-      multi += D1tmp0 * D2tmp0;
-    }
-    for (int stride = 16; stride > 0; stride >>= 1) {
-      multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      O_cooVal[eid] = multi;
     }
   }
 }
@@ -151,34 +154,39 @@ __global__ void sddmmCOO2Scale(
     if (threadIdx.x == 0) {
       Store<float4, float>(O_cooVal, multi, eid);
     }
-  } else // Dynamic parrallel?
-  {
-    eid = Size - (Size & 15) + (blockIdx.x - (Size / 16));
-    int offset1 = S_cooRowInd[eid] * D_kcols;
-    int offset2 = S_cooColInd[eid] * D_kcols;
-    T multi = 0;
-    int off1 = cid = threadIdx.x << 1;
-    float2 D1tmp0, D2tmp0;
-    for (int cc = 0; cc < (D_kcols >> 5); cc++) {
-      Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
-      Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
-      multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
-      cid += 32;
-    }
-    int res = D_kcols & 31;
-    D1tmp0.x = D1tmp0.y = D2tmp0.x = D2tmp0.y = 0;
-    if (res) {
-      if (off1 < res) {
+  } else {
+    // the last block handles the remaining nonzeros, one per threadIdx.y.
+    // The groups past the end compute the last nonzero again, so that the
+    // warps stay converged for the shuffles
+    for (int first = Size - (Size & 15); first < Size; first += blockDim.y) {
+      eid = first + threadIdx.y;
+      int e = min(eid, int(Size) - 1);
+      int offset1 = S_cooRowInd[e] * D_kcols;
+      int offset2 = S_cooColInd[e] * D_kcols;
+      T multi = 0;
+      int off1 = cid = threadIdx.x << 1;
+      float2 D1tmp0, D2tmp0;
+      for (int cc = 0; cc < (D_kcols >> 5); cc++) {
         Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
         Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
+        multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
+        cid += 32;
+      }
+      int res = D_kcols & 31;
+      D1tmp0.x = D1tmp0.y = D2tmp0.x = D2tmp0.y = 0;
+      if (res) {
+        if (off1 < res) {
+          Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
+          Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
+        }
+        multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
+      }
+      for (int stride = 8; stride > 0; stride >>= 1) {
+        multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
+      }
+      if (threadIdx.x == 0 && eid < Size) {
+        O_cooVal[eid] = multi;
       }
-      multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
-    }
-    for (int stride = 8; stride > 0; stride >>= 1) {
-      multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      O_cooVal[eid] = multi;
     }
   }
 }
@@ -234,34 +242,39 @@ __global__ void sddmmCOO1Scale(
     if (threadIdx.x == 0) {
       Store<float4, float>(O_cooVal, multi, eid);
     }
-  } else // Dynamic parrallel?
-  {
-    eid = Size - (Size & 15) + (blockIdx.x - (Size / 16));
-    int offset1 = S_cooRowInd[eid] * D_kcols;
-    int offset2 = S_cooColInd[eid] * D_kcols;
-    T multi = 0;
-    int off1 = cid = threadIdx.x;
-    float D1tmp0, D2tmp0;
-    for (int cc = 0; cc < (D_kcols >> 5); cc++) {
-      D1tmp0 = D1_dnVal[offset1 + cid];
-      D2tmp0 = D2_dnVal[offset2 + cid];
-      multi += D1tmp0 * D2tmp0;
-      cid += 32;
-    }
-    int res = D_kcols & 31;
-    D1tmp0 = D2tmp0 = 0;
-    if (res) {
-      if (off1 < res) {
+  } else {
+    // the last block handles the remaining nonzeros, one per threadIdx.y.
+    // The groups past the end compute the last nonzero again, so that the
+    // warps stay converged for the shuffles
+    for (int first = Size - (Size & 15); first < Size; first += blockDim.y) {
+      eid = first + threadIdx.y;
+      int e = min(eid, int(Size) - 1);
+      int offset1 = S_cooRowInd[e] * D_kcols;
+      int offset2 = S_cooColInd[e] * D_kcols;
+      T multi = 0;
+      int off1 = cid = threadIdx.x;
+      float D1tmp0, D2tmp0;
+      for (int cc = 0; cc < (D_kcols >> 5); cc++) {
         D1tmp0 = D1_dnVal[offset1 + cid];
         D2tmp0 = D2_dnVal[offset2 + cid];
+        multi += D1tmp0 * D2tmp0;
+        cid += 32;
+      }
+      int res = D_kcols & 31;
+      D1tmp0 = D2tmp0 = 0;
+      if (res) {
+        if (off1 < res) {
+          D1tmp0 = D1_dnVal[offset1 + cid];
+          D2tmp0 = D2_dnVal[offset2 + cid];
+        }
+        multi += D1tmp0 * D2tmp0;
+      }
+      for (int stride = 16; stride > 0; stride >>= 1) {
+        multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
+      }
+      if (threadIdx.x == 0 && eid < Size) {
+        O_cooVal[eid] = multi;
       }
-      multi += D1tmp0 * D2tmp0;
-    }
-    for (int stride = 16; stride > 0; stride >>= 1) {
-      multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      O_cooVal[eid] = multi;
     }
   }
 }
@@ -273,6 +286,7 @@ __global__ void sddmmCSR2Scale(
     int S_nrows,
     const unsigned long Size,
     int* S_csrRowPtr,
+    const int* S_blockRows,
     int* S_csrColInd,
     T* D1_dnVal_,
     T* D2_dnVal_,
@@ -289,13 +303,17 @@ __global__ void sddmmCSR2Scale(
   T* D2_dnVal = D2_dnVal_ + batch_offset_2;
   T* O_csrVal = O_csrVal_ + batch_offset_out;
 
+  // the nonzeros of this block are in the rows [row_start, row_end)
+  int row_start = S_blockRows[blockIdx.x];
+  int row_end = min(S_blockRows[blockIdx.x + 1] + 1, S_mrows);
+
   if (blockIdx.x < Size / 16) {
     T multi[4] = {0, 0, 0, 0};
     int offset1[4], offset2[4];
     float2 D1tmp[4], D2tmp[4];
     Load<int4, int>(offset2, S_csrColInd, eid);
-    offset1[0] = findRow(S_csrRowPtr, eid, 0, S_mrows);
-    offset1[3] = findRow(S_csrRowPtr, eid + 3, offset1[0], S_mrows);
+    offset1[0] = findRow(S_csrRowPtr, eid, row_start, row_end);
+    offset1[3] = findRow(S_csrRowPtr, eid + 3, offset1[0], row_end);
     offset1[1] = findRow(S_csrRowPtr, eid + 1, offset1[0], offset1[3]);
     offset1[2] = findRow(S_csrRowPtr, eid + 2, offset1[1], offset1[3]);
     selfMulConst4<int>(offset1, D_kcols);
@@ -324,34 +342,39 @@ __global__ void sddmmCSR2Scale(
     if (threadIdx.x == 0) {
       Store<float4, float>(O_csrVal, multi, eid);
     }
-  } else // Dynamic parrallel?
-  {
-    eid = Size - (Size & 15) + (blockIdx.x - (Size / 16));
-    int offset1 = findRow(S_csrRowPtr, eid, 0, S_mrows) * D_kcols;
-    int offset2 = S_csrColInd[eid] * D_kcols;
-    T multi = 0;
-    int off1 = cid = threadIdx.x << 1;
-    float2 D1tmp0, D2tmp0;
-    for (int cc = 0; cc < (D_kcols >> 5); cc++) {
-      Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
-      Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
-      multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
-      cid += 32;
-    }
-    int res = D_kcols & 31;
-    D1tmp0.x = D1tmp0.y = D2tmp0.x = D2tmp0.y = 0;
-    if (res) {
-      if (off1 < res) {
+  } else {
+    // the last block handles the remaining nonzeros, one per threadIdx.y.
+    // The groups past the end compute the last nonzero again, so that the
+    // warps stay converged for the shuffles
+    for (int first = Size - (Size & 15); first < Size; first += blockDim.y) {
+      eid = first + threadIdx.y;
+      int e = min(eid, int(Size) - 1);
+      int offset1 = findRow(S_csrRowPtr, e, row_start, row_end) * D_kcols;
+      int offset2 = S_csrColInd[e] * D_kcols;
+      T multi = 0;
+      int off1 = cid = threadIdx.x << 1;
+      float2 D1tmp0, D2tmp0;
+      for (int cc = 0; cc < (D_kcols >> 5); cc++) {
         Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
         Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
+        multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
+        cid += 32;
+      }
+      int res = D_kcols & 31;
+      D1tmp0.x = D1tmp0.y = D2tmp0.x = D2tmp0.y = 0;
+      if (res) {
+        if (off1 < res) {
+          Load<float2, float>(D1tmp0, D1_dnVal, offset1 + cid);
+          Load<float2, float>(D2tmp0, D2_dnVal, offset2 + cid);
+        }
+        multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
+      }
+      for (int stride = 8; stride > 0; stride >>= 1) {
+        multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
+      }
+      if (threadIdx.x == 0 && eid < Size) {
+        O_csrVal[eid] = multi;
       }
-      multi += vecDot2<float2, float>(D1tmp0, D2tmp0);
-    }
-    for (int stride = 8; stride > 0; stride >>= 1) {
-      multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      O_csrVal[eid] = multi;
     }
   }
 }
@@ -363,6 +386,7 @@ __global__ void sddmmCSR1Scale(
     int S_nrows,
     const unsigned long Size,
     int* S_csrRowPtr,
+    const int* S_blockRows,
     int* S_csrColInd,
     T* D1_dnVal_,
     T* D2_dnVal_,
@@ -379,6 +403,10 @@ __global__ void sddmmCSR1Scale(
   T* D2_dnVal = D2_dnVal_ + batch_offset_2;
   T* O_csrVal = O_csrVal_ + batch_offset_out;
 
+  // the nonzeros of this block are in the rows [row_start, row_end)
+  int row_start = S_blockRows[blockIdx.x];
+  int row_end = min(S_blockRows[blockIdx.x + 1] + 1, S_mrows);
+
   if (blockIdx.x < Size / 16) {
     T multi[4] = {0, 0, 0, 0};
     int offset1[4], offset2[4];
@@ -386,8 +414,8 @@ __global__ void sddmmCSR1Scale(
 
     Load<int4, int>(offset2, S_csrColInd, eid);
 
-    offset1[0] = findRow(S_csrRowPtr, eid, 0, S_mrows);
-    offset1[3] = findRow(S_csrRowPtr, eid + 3, offset1[0], S_mrows);
+    offset1[0] = findRow(S_csrRowPtr, eid, row_start, row_end);
+    offset1[3] = findRow(S_csrRowPtr, eid + 3, offset1[0], row_end);
     offset1[1] = findRow(S_csrRowPtr, eid + 1, offset1[0], offset1[3]);
     offset1[2] = findRow(S_csrRowPtr, eid + 2, offset1[1], offset1[3]);
 
@@ -413,38 +441,64 @@ __global__ void sddmmCSR1Scale(
     if (threadIdx.x == 0) {
       Store<float4, float>(O_csrVal, multi, eid);
     }
-  } else // Dynamic parrallel?
-  {
-    eid = Size - (Size & 15) + (blockIdx.x - (Size / 16));
-    int offset1 = findRow(S_csrRowPtr, eid, 0, S_mrows) * D_kcols;
-    int offset2 = S_csrColInd[eid] * D_kcols;
-    T multi = 0;
-    int off1 = cid = threadIdx.x;
-    float D1tmp0, D2tmp0;
-    for (int cc = 0; cc < (D_kcols >> 5); cc++) {
-      D1tmp0 = D1_dnVal[offset1 + cid];
-      D2tmp0 = D2_dnVal[offset2 + cid];
-      multi += D1tmp0 * D2tmp0;
-      cid += 32;
-    }
-    int res = D_kcols & 31;
-    D1tmp0 = D2tmp0 = 0;
-    if (res) {
-      if (off1 < res) {
+  } else {
+    // the last block handles the remaining nonzeros, one per threadIdx.y.
+    // The groups past the end compute the last nonzero again, so that the
+    // warps stay converged for the shuffles
+    for (int first = Size - (Size & 15); first < Size; first += blockDim.y) {
+      eid = first + threadIdx.y;
+      int e = min(eid, int(Size) - 1);
+      int offset1 = findRow(S_csrRowPtr, e, row_start, row_end) * D_kcols;
+      int offset2 = S_csrColInd[e] * D_kcols;
+      T multi = 0;
+      int off1 = cid = threadIdx.x;
+      float D1tmp0, D2tmp0;
+      for (int cc = 0; cc < (D_kcols >> 5); cc++) {
         D1tmp0 = D1_dnVal[offset1 + cid];
         D2tmp0 = D2_dnVal[offset2 + cid];
+        multi += D1tmp0 * D2tmp0;
+        cid += 32;
+      }
+      int res = D_kcols & 31;
+      D1tmp0 = D2tmp0 = 0;
+      if (res) {
+        if (off1 < res) {
+          D1tmp0 = D1_dnVal[offset1 + cid];
+          D2tmp0 = D2_dnVal[offset2 + cid];
+        }
+        multi += D1tmp0 * D2tmp0;
+      }
+      for (int stride = 16; stride > 0; stride >>= 1) {
+        multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
+      }
+      if (threadIdx.x == 0 && eid < Size) {
+        O_csrVal[eid] = multi;
       }
-      multi += D1tmp0 * D2tmp0;
-    }
-    for (int stride = 16; stride > 0; stride >>= 1) {
-      multi += __shfl_xor_sync(0xffffffff, multi, stride, 32);
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      O_csrVal[eid] = multi;
     }
   }
 }
 
+// Each block computes 4 groups (threadIdx.y) of 4 consecutive nonzeros
+constexpr int kNnzPerBlock = 16;
+
+// Merge-path style partition of the CSR nonzeros in equal slices of
+// kNnzPerBlock: `block_rows[b]` is the row of the first nonzero of block b,
+// and `block_rows[num_blocks]` the last row, so that each block only searches
+// the rows of its own slice (a few rows, even if some rows are very long)
+// instead of the whole matrix
+__global__ void csrBlockRows(
+    const int S_mrows,
+    const int num_blocks,
+    const int* S_csrRowPtr,
+    int* block_rows) {
+  int block = blockIdx.x * blockDim.x + threadIdx.x;
+  if (block < num_blocks) {
+    block_rows[block] = findRow(S_csrRowPtr, block * kNnzPerBlock, 0, S_mrows);
+  } else if (block == num_blocks) {
+    block_rows[block] = S_mrows - 1;
+  }
+}
+
 torch::Tensor sddmm_cuda_coo(
     torch::Tensor rowind,
     torch::Tensor colind,
@@ -461,7 +515,10 @@ torch::Tensor sddmm_cuda_coo(
     return out;
 
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
-  dim3 grid_dim(nnz / 16 + (nnz & 15), batch_size, 1);
+  // one block per slice of kNnzPerBlock nonzeros, the last one possibly
+  // partial
+  const int num_blocks = (nnz + kNnzPerBlock - 1) / kNnzPerBlock;
+  dim3 grid_dim(num_blocks, batch_size, 1);
   if ((k % 4) == 0) {
     dim3 block_dim(8, 4, 1);
     sddmmCOO4Scale<<<grid_dim, block_dim, 0, stream>>>(
@@ -519,8 +576,12 @@ torch::Tensor sddmm_cuda_csr(
     return out;
 
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
-  dim3 grid_dim(nnz / 16 + (nnz & 15), batch_size, 1);
+  const int num_blocks = (nnz + kNnzPerBlock - 1) / kNnzPerBlock;
+  auto block_rows = torch::empty({num_blocks + 1}, rowptr.options());
+  csrBlockRows<<<(num_blocks + 256) / 256, 256, 0, stream>>>(
+      m, num_blocks, rowptr.data_ptr<int>(), block_rows.data_ptr<int>());
 
+  dim3 grid_dim(num_blocks, batch_size, 1);
   if ((k % 2) == 0) {
     dim3 block_dim(16, 4, 1);
     sddmmCSR2Scale<<<grid_dim, block_dim, 0, stream>>>(
@@ -529,6 +590,7 @@ torch::Tensor sddmm_cuda_csr(
         n,
         nnz,
         rowptr.data_ptr<int>(),
+        block_rows.data_ptr<int>(),
         colind.data_ptr<int>(),
         D1.data_ptr<float>(),
         D2.data_ptr<float>(),
@@ -541,6 +603,7 @@ torch::Tensor sddmm_cuda_csr(
         n,
         nnz,
         rowptr.data_ptr<int>(),
+        block_rows.data_ptr<int>(),
         colind.data_ptr<int>(),
         D1.data_ptr<float>(),
         D2.data_ptr<float>(),
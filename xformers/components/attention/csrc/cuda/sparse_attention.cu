@@ -0,0 +1,837 @@
+#include <cmath>
+#include <tuple>
+#include <type_traits>
+
+#include "sputnik/load_store.h"
+
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <torch/types.h>
+
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+
+#include "../batched_pattern.h"
+#include "../compressed_indices.h"
+#include "reduced_precision.h"
+
+// Fused sddmm + sparse softmax + spmm (see the CPU implementation for the
+// formulas of the forward and the backward). A warp processes a row of the
+// pattern, in the order of the `row_indices` swizzle (the rows sorted by
+// decreasing number of nonzeros), and holds the elements `lane + 32 * t` of
+// the rows of q / k / v in the registers of the lane `lane`. The forward
+// computes the scores by tiles of 32 nonzeros, with warp reductions, and
+// adds the tile to the output with an online softmax, so the scores and the
+// probabilities never go through global memory.
+// The backward computes grad_q by rows of the pattern, then grad_k / grad_v
+// by rows of its transpose, so that every gradient has a single writer.
+// The backward of the unfused chain (SparseSoftmaxAttentionBackward*Kernel)
+// follows the same structure, reading the stored probabilities instead of
+// the scores
+namespace {
+
+constexpr int kWarpSize = 32;
+constexpr int kWarpsPerBlock = 4;
+constexpr int kMaxItemsPerLane = 8;
+
+__device__ __forceinline__ float WarpSum(float x) {
+  for (int idx = kWarpSize / 2; idx > 0; idx /= 2) {
+    x += __shfl_xor_sync(0xffffffff, x, idx);
+  }
+  return x;
+}
+
+__device__ __forceinline__ float WarpMax(float x) {
+  for (int idx = kWarpSize / 2; idx > 0; idx /= 2) {
+    x = fmaxf(x, __shfl_xor_sync(0xffffffff, x, idx));
+  }
+  return x;
+}
+
+template <typename scalar_t, int kItemsPerLane>
+__device__ __forceinline__ void LoadRow(
+    const scalar_t* __restrict__ row,
+    int size,
+    float* fragment) {
+#pragma unroll
+  for (int t = 0; t < kItemsPerLane; ++t) {
+    int idx = threadIdx.x + t * kWarpSize;
+    fragment[t] = idx < size ? sputnik::LoadFloat(row + idx) : 0.0f;
+  }
+}
+
+template <typename scalar_t, int kItemsPerLane>
+__device__ __forceinline__ void StoreRow(
+    const float* fragment,
+    float scale,
+    int size,
+    scalar_t* __restrict__ row) {
+#pragma unroll
+  for (int t = 0; t < kItemsPerLane; ++t) {
+    int idx = threadIdx.x + t * kWarpSize;
+    if (idx < size) {
+      row[idx] = static_cast<scalar_t>(fragment[t] * scale);
+    }
+  }
+}
+
+template <int kItemsPerLane>
+__device__ __forceinline__ float WarpDot(const float* a, const float* b) {
+  float x = 0.0f;
+#pragma unroll
+  for (int t = 0; t < kItemsPerLane; ++t) {
+    x += a[t] * b[t];
+  }
+  return WarpSum(x);
+}
+
+template <typename scalar_t, typename index_t, int kItemsPerLane>
+__global__ void __launch_bounds__(kWarpSize* kWarpsPerBlock)
+    SparseAttentionKernel(
+        int m,
+        int k,
+        int kv,
+        int n,
+        const scalar_t* __restrict__ query,
+        const scalar_t* __restrict__ key,
+        const scalar_t* __restrict__ value,
+        const int* __restrict__ row_indices,
+        const int* __restrict__ row_offsets,
+        const index_t* __restrict__ column_indices,
+        float scale,
+        scalar_t* __restrict__ output,
+        float* __restrict__ logsumexp) {
+  int m_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (m_index >= m)
+    return;
+  m_index = sputnik::Load(row_indices + m_index);
+
+  int row_offset = sputnik::Load(row_offsets + m_index);
+  int nonzeros = sputnik::Load(row_offsets + m_index + 1) - row_offset;
+  int64_t row = int64_t(blockIdx.y) * m + m_index;
+  key += int64_t(blockIdx.y) * n * k;
+  value += int64_t(blockIdx.y) * n * kv;
+
+  float q_fragment[kItemsPerLane];
+  float kv_fragment[kItemsPerLane];
+  float accumulator[kItemsPerLane] = {};
+  LoadRow<scalar_t, kItemsPerLane>(query + row * k, k, q_fragment);
+
+  float max = -INFINITY;
+  float sum = 0.0f;
+  for (int tile = 0; tile < nonzeros; tile += kWarpSize) {
+    // The lane `l` holds the column and the score of the nonzero `tile + l`
+    int idx = tile + threadIdx.x;
+    int column = 0;
+    if (idx < nonzeros) {
+      column = sputnik::Load(column_indices + row_offset + idx);
+    }
+    int tile_size = min(kWarpSize, nonzeros - tile);
+    float score = -INFINITY;
+    for (int l = 0; l < tile_size; ++l) {
+      int j = __shfl_sync(0xffffffff, column, l);
+      LoadRow<scalar_t, kItemsPerLane>(key + int64_t(j) * k, k, kv_fragment);
+      float s = WarpDot<kItemsPerLane>(q_fragment, kv_fragment) * scale;
+      if (threadIdx.x == l) {
+        score = s;
+      }
+    }
+
+    float new_max = fmaxf(max, WarpMax(score));
+    float correction = expf(max - new_max);
+    float p = expf(score - new_max);
+    sum = sum * correction + WarpSum(p);
+    max = new_max;
+#pragma unroll
+    for (int t = 0; t < kItemsPerLane; ++t) {
+      accumulator[t] *= correction;
+    }
+    for (int l = 0; l < tile_size; ++l) {
+      float p_l = __shfl_sync(0xffffffff, p, l);
+      int j = __shfl_sync(0xffffffff, column, l);
+      LoadRow<scalar_t, kItemsPerLane>(
+          value + int64_t(j) * kv, kv, kv_fragment);
+#pragma unroll
+      for (int t = 0; t < kItemsPerLane; ++t) {
+        accumulator[t] += p_l * kv_fragment[t];
+      }
+    }
+  }
+
+  StoreRow<scalar_t, kItemsPerLane>(
+      accumulator, sum > 0.0f ? 1.0f / sum : 0.0f, kv, output + row * kv);
+  if (threadIdx.x == 0) {
+    logsumexp[row] = sum > 0.0f ? max + logf(sum) : -INFINITY;
+  }
+}
+
+// grad_q, and `delta = grad_out . out` for SparseAttentionBackwardKVKernel
+template <typename scalar_t, typename index_t, int kItemsPerLane>
+__global__ void __launch_bounds__(kWarpSize* kWarpsPerBlock)
+    SparseAttentionBackwardQKernel(
+        int m,
+        int k,
+        int kv,
+        int n,
+        const scalar_t* __restrict__ grad_out,
+        const scalar_t* __restrict__ query,
+        const scalar_t* __restrict__ key,
+        const scalar_t* __restrict__ value,
+        const scalar_t* __restrict__ output,
+        const float* __restrict__ logsumexp,
+        const int* __restrict__ row_indices,
+        const int* __restrict__ row_offsets,
+        const index_t* __restrict__ column_indices,
+        float scale,
+        scalar_t* __restrict__ grad_query,
+        float* __restrict__ delta) {
+  int m_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (m_index >= m)
+    return;
+  m_index = sputnik::Load(row_indices + m_index);
+
+  int row_offset = sputnik::Load(row_offsets + m_index);
+  int nonzeros = sputnik::Load(row_offsets + m_index + 1) - row_offset;
+  int64_t row = int64_t(blockIdx.y) * m + m_index;
+  key += int64_t(blockIdx.y) * n * k;
+  value += int64_t(blockIdx.y) * n * kv;
+
+  float q_fragment[kItemsPerLane];
+  float g_fragment[kItemsPerLane];
+  float k_fragment[kItemsPerLane];
+  float v_fragment[kItemsPerLane];
+  float grad_q[kItemsPerLane] = {};
+  LoadRow<scalar_t, kItemsPerLane>(query + row * k, k, q_fragment);
+  LoadRow<scalar_t, kItemsPerLane>(grad_out + row * kv, kv, g_fragment);
+  LoadRow<scalar_t, kItemsPerLane>(output + row * kv, kv, v_fragment);
+  float delta_i = WarpDot<kItemsPerLane>(g_fragment, v_fragment);
+  if (threadIdx.x == 0) {
+    delta[row] = delta_i;
+  }
+  float lse_i = logsumexp[row];
+
+  for (int l = 0; l < nonzeros; ++l) {
+    int64_t j = sputnik::Load(column_indices + row_offset + l);
+    LoadRow<scalar_t, kItemsPerLane>(key + j * k, k, k_fragment);
+    LoadRow<scalar_t, kItemsPerLane>(value + j * kv, kv, v_fragment);
+    float p =
+        expf(WarpDot<kItemsPerLane>(q_fragment, k_fragment) * scale - lse_i);
+    float grad_s =
+        p * (WarpDot<kItemsPerLane>(g_fragment, v_fragment) - delta_i);
+#pragma unroll
+    for (int t = 0; t < kItemsPerLane; ++t) {
+      grad_q[t] += grad_s * k_fragment[t];
+    }
+  }
+  StoreRow<scalar_t, kItemsPerLane>(grad_q, scale, k, grad_query + row * k);
+}
+
+// grad_k / grad_v, by rows of the transposed pattern
+template <typename scalar_t, typename index_t, int kItemsPerLane>
+__global__ void __launch_bounds__(kWarpSize* kWarpsPerBlock)
+    SparseAttentionBackwardKVKernel(
+        int m,
+        int k,
+        int kv,
+        int n,
+        const scalar_t* __restrict__ grad_out,
+        const scalar_t* __restrict__ query,
+        const scalar_t* __restrict__ key,
+        const scalar_t* __restrict__ value,
+        const float* __restrict__ logsumexp,
+        const float* __restrict__ delta,
+        const int* __restrict__ row_indices_t,
+        const int* __restrict__ row_offsets_t,
+        const index_t* __restrict__ column_indices_t,
+        float scale,
+        scalar_t* __restrict__ grad_key,
+        scalar_t* __restrict__ grad_value) {
+  int n_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (n_index >= n)
+    return;
+  n_index = sputnik::Load(row_indices_t + n_index);
+
+  int row_offset = sputnik::Load(row_offsets_t + n_index);
+  int nonzeros = sputnik::Load(row_offsets_t + n_index + 1) - row_offset;
+  int64_t row = int64_t(blockIdx.y) * n + n_index;
+  int64_t batch_offset = int64_t(blockIdx.y) * m;
+
+  float k_fragment[kItemsPerLane];
+  float v_fragment[kItemsPerLane];
+  float q_fragment[kItemsPerLane];
+  float g_fragment[kItemsPerLane];
+  float grad_k[kItemsPerLane] = {};
+  float grad_v[kItemsPerLane] = {};
+  LoadRow<scalar_t, kItemsPerLane>(key + row * k, k, k_fragment);
+  LoadRow<scalar_t, kItemsPerLane>(value + row * kv, kv, v_fragment);
+
+  for (int l = 0; l < nonzeros; ++l) {
+    int64_t i =
+        batch_offset + sputnik::Load(column_indices_t + row_offset + l);
+    LoadRow<scalar_t, kItemsPerLane>(query + i * k, k, q_fragment);
+    LoadRow<scalar_t, kItemsPerLane>(grad_out + i * kv, kv, g_fragment);
+    float p = expf(
+        WarpDot<kItemsPerLane>(q_fragment, k_fragment) * scale - logsumexp[i]);
+    float grad_s =
+        p * (WarpDot<kItemsPerLane>(g_fragment, v_fragment) - delta[i]);
+#pragma unroll
+    for (int t = 0; t < kItemsPerLane; ++t) {
+      grad_v[t] += p * g_fragment[t];
+      grad_k[t] += grad_s * q_fragment[t];
+    }
+  }
+  StoreRow<scalar_t, kItemsPerLane>(grad_k, scale, k, grad_key + row * k);
+  StoreRow<scalar_t, kItemsPerLane>(grad_v, 1.0f, kv, grad_value + row * kv);
+}
+
+// grad_q, and `delta = sum_j(attn_dropped * grad_out . v[j])` for
+// SparseSoftmaxAttentionBackwardKKernel
+template <typename scalar_t, typename index_t, int kItemsPerLane>
+__global__ void __launch_bounds__(kWarpSize* kWarpsPerBlock)
+    SparseSoftmaxAttentionBackwardQKernel(
+        int m,
+        int k,
+        int kv,
+        int n,
+        int nonzeros,
+        const scalar_t* __restrict__ grad_out,
+        const scalar_t* __restrict__ key,
+        const scalar_t* __restrict__ value,
+        const scalar_t* __restrict__ attn,
+        const scalar_t* __restrict__ attn_dropped,
+        const int* __restrict__ row_indices,
+        const int* __restrict__ row_offsets,
+        const index_t* __restrict__ column_indices,
+        scalar_t* __restrict__ grad_query,
+        float* __restrict__ delta) {
+  int m_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (m_index >= m)
+    return;
+  m_index = sputnik::Load(row_indices + m_index);
+
+  int row_offset = sputnik::Load(row_offsets + m_index);
+  int row_nonzeros = sputnik::Load(row_offsets + m_index + 1) - row_offset;
+  int64_t row = int64_t(blockIdx.y) * m + m_index;
+  key += int64_t(blockIdx.y) * n * k;
+  value += int64_t(blockIdx.y) * n * kv;
+  attn += int64_t(blockIdx.y) * nonzeros + row_offset;
+  attn_dropped += int64_t(blockIdx.y) * nonzeros + row_offset;
+
+  float g_fragment[kItemsPerLane];
+  float k_fragment[kItemsPerLane];
+  float v_fragment[kItemsPerLane];
+  float grad_q[kItemsPerLane] = {};
+  float attn_k[kItemsPerLane] = {};
+  LoadRow<scalar_t, kItemsPerLane>(grad_out + row * kv, kv, g_fragment);
+
+  float delta_i = 0.0f;
+  for (int l = 0; l < row_nonzeros; ++l) {
+    int64_t j = sputnik::Load(column_indices + row_offset + l);
+    LoadRow<scalar_t, kItemsPerLane>(key + j * k, k, k_fragment);
+    LoadRow<scalar_t, kItemsPerLane>(value + j * kv, kv, v_fragment);
+    float p = sputnik::LoadFloat(attn + l);
+    float p_g = sputnik::LoadFloat(attn_dropped + l) *
+        WarpDot<kItemsPerLane>(g_fragment, v_fragment);
+    delta_i += p_g;
+#pragma unroll
+    for (int t = 0; t < kItemsPerLane; ++t) {
+      grad_q[t] += p_g * k_fragment[t];
+      attn_k[t] += p * k_fragment[t];
+    }
+  }
+#pragma unroll
+  for (int t = 0; t < kItemsPerLane; ++t) {
+    grad_q[t] -= delta_i * attn_k[t];
+  }
+  StoreRow<scalar_t, kItemsPerLane>(grad_q, 1.0f, k, grad_query + row * k);
+  if (threadIdx.x == 0) {
+    delta[row] = delta_i;
+  }
+}
+
+// grad_k, by rows of the transposed pattern
+template <typename scalar_t, typename index_t, int kItemsPerLane>
+__global__ void __launch_bounds__(kWarpSize* kWarpsPerBlock)
+    SparseSoftmaxAttentionBackwardKKernel(
+        int m,
+        int k,
+        int kv,
+        int n,
+        int nonzeros,
+        const scalar_t* __restrict__ grad_out,
+        const scalar_t* __restrict__ query,
+        const scalar_t* __restrict__ value,
+        const scalar_t* __restrict__ attn,
+        const scalar_t* __restrict__ attn_dropped,
+        const float* __restrict__ delta,
+        const int* __restrict__ row_indices_t,
+        const int* __restrict__ row_offsets_t,
+        const index_t* __restrict__ column_indices_t,
+        const int64_t* __restrict__ perm,
+        scalar_t* __restrict__ grad_key) {
+  int n_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (n_index >= n)
+    return;
+  n_index = sputnik::Load(row_indices_t + n_index);
+
+  int row_offset = sputnik::Load(row_offsets_t + n_index);
+  int row_nonzeros = sputnik::Load(row_offsets_t + n_index + 1) - row_offset;
+  int64_t row = int64_t(blockIdx.y) * n + n_index;
+  int64_t batch_offset = int64_t(blockIdx.y) * m;
+  attn += int64_t(blockIdx.y) * nonzeros;
+  attn_dropped += int64_t(blockIdx.y) * nonzeros;
+
+  float v_fragment[kItemsPerLane];
+  float q_fragment[kItemsPerLane];
+  float g_fragment[kItemsPerLane];
+  float grad_k[kItemsPerLane] = {};
+  LoadRow<scalar_t, kItemsPerLane>(value + row * kv, kv, v_fragment);
+
+  for (int l = 0; l < row_nonzeros; ++l) {
+    int64_t i =
+        batch_offset + sputnik::Load(column_indices_t + row_offset + l);
+    int64_t e = __ldg(perm + row_offset + l);
+    LoadRow<scalar_t, kItemsPerLane>(query + i * k, k, q_fragment);
+    LoadRow<scalar_t, kItemsPerLane>(grad_out + i * kv, kv, g_fragment);
+    float grad_s = sputnik::LoadFloat(attn_dropped + e) *
+            WarpDot<kItemsPerLane>(g_fragment, v_fragment) -
+        sputnik::LoadFloat(attn + e) * delta[i];
+#pragma unroll
+    for (int t = 0; t < kItemsPerLane; ++t) {
+      grad_k[t] += grad_s * q_fragment[t];
+    }
+  }
+  StoreRow<scalar_t, kItemsPerLane>(grad_k, 1.0f, k, grad_key + row * k);
+}
+
+// Calls `fn` with the number of elements per lane (as an
+// `std::integral_constant`) for rows of up to `size` elements
+template <typename Fn>
+void DispatchItemsPerLane(int size, Fn&& fn) {
+  TORCH_CHECK(
+      size <= kWarpSize * kMaxItemsPerLane,
+      "sparse attention supports head dimensions up to ",
+      kWarpSize * kMaxItemsPerLane,
+      ", got ",
+      size);
+  if (size <= kWarpSize) {
+    fn(std::integral_constant<int, 1>());
+  } else if (size <= 2 * kWarpSize) {
+    fn(std::integral_constant<int, 2>());
+  } else if (size <= 4 * kWarpSize) {
+    fn(std::integral_constant<int, 4>());
+  } else {
+    fn(std::integral_constant<int, kMaxItemsPerLane>());
+  }
+}
+
+void check_sparse_attention_inputs(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(query.dim() == 3);
+  TORCH_CHECK(key.dim() == 3);
+  TORCH_CHECK(value.dim() == 3);
+  TORCH_CHECK(row_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(query.size(0) == key.size(0));
+  TORCH_CHECK(query.size(0) == value.size(0));
+  TORCH_CHECK(query.size(2) == key.size(2));
+  TORCH_CHECK(key.size(1) == value.size(1));
+  TORCH_CHECK(row_indices.size(0) == query.size(1));
+  TORCH_CHECK(row_offsets.size(0) == query.size(1) + 1);
+  TORCH_CHECK(
+      query.scalar_type() == key.scalar_type() &&
+          query.scalar_type() == value.scalar_type(),
+      "query, key and value should have the same dtype");
+  TORCH_CHECK(
+      query.scalar_type() == at::ScalarType::Float ||
+          query.scalar_type() == at::ScalarType::Half ||
+          query.scalar_type() == at::ScalarType::BFloat16,
+      "sparse attention only supports float, half and bfloat16 inputs");
+
+  for (const at::Tensor* t :
+       {&query, &key, &value, &row_indices, &row_offsets, &column_indices}) {
+    TORCH_CHECK(t->is_cuda(), "sparse attention expects CUDA tensors");
+    TORCH_CHECK(
+        t->device() == query.device(),
+        "sparse attention expects tensors on the same device");
+    TORCH_CHECK(
+        t->is_contiguous(), "sparse attention expects contiguous tensors");
+  }
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse_attention_sputnik(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    double scale) {
+  check_sparse_attention_inputs(
+      query, key, value, row_indices, row_offsets, column_indices);
+  at::cuda::CUDAGuard device_guard(query.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  int batch = query.size(0);
+  int m = query.size(1);
+  int k = query.size(2);
+  int n = key.size(1);
+  int kv = value.size(2);
+
+  at::Tensor output = at::empty({batch, m, kv}, query.options());
+  at::Tensor logsumexp =
+      at::empty({batch, m}, query.options().dtype(at::ScalarType::Float));
+  if (batch == 0 || m == 0) {
+    return std::make_tuple(output, logsumexp);
+  }
+
+  dim3 grid_dim(std::ceil(static_cast<float>(m) / kWarpsPerBlock), batch);
+  dim3 block_dim(kWarpSize, kWarpsPerBlock);
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        query.scalar_type(),
+        "sparse_attention_sputnik",
+        [&] {
+          DispatchItemsPerLane(std::max(k, kv), [&](auto items_per_lane) {
+            constexpr int kItemsPerLane = decltype(items_per_lane)::value;
+            SparseAttentionKernel<scalar_t, index_t, kItemsPerLane>
+                <<<grid_dim, block_dim, 0, stream>>>(
+                    m,
+                    k,
+                    kv,
+                    n,
+                    query.data_ptr<scalar_t>(),
+                    key.data_ptr<scalar_t>(),
+                    value.data_ptr<scalar_t>(),
+                    row_indices.data_ptr<int>(),
+                    row_offsets.data_ptr<int>(),
+                    column_indices.data_ptr<index_t>(),
+                    scale,
+                    output.data_ptr<scalar_t>(),
+                    logsumexp.data_ptr<float>());
+          });
+        });
+  });
+  AT_CUDA_CHECK(cudaGetLastError());
+
+  return std::make_tuple(output, logsumexp);
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+sparse_attention_backward_sputnik(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& output,
+    const at::Tensor& logsumexp,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    double scale) {
+  check_sparse_attention_inputs(
+      query, key, value, row_indices, row_offsets, column_indices);
+  TORCH_CHECK(grad_out.sizes() == output.sizes());
+  TORCH_CHECK(
+      output.size(0) == query.size(0) && output.size(1) == query.size(1) &&
+      output.size(2) == value.size(2));
+  TORCH_CHECK(logsumexp.dim() == 2);
+  TORCH_CHECK(
+      logsumexp.size(0) == query.size(0) && logsumexp.size(1) == query.size(1));
+  TORCH_CHECK(logsumexp.scalar_type() == at::ScalarType::Float);
+  TORCH_CHECK(row_indices_t.dim() == 1);
+  TORCH_CHECK(row_offsets_t.dim() == 1);
+  TORCH_CHECK(column_indices_t.dim() == 1);
+  TORCH_CHECK(row_indices_t.size(0) == key.size(1));
+  TORCH_CHECK(row_offsets_t.size(0) == key.size(1) + 1);
+  TORCH_CHECK(column_indices_t.size(0) == column_indices.size(0));
+  TORCH_CHECK(
+      column_indices_t.scalar_type() == column_indices.scalar_type(),
+      "column_indices and column_indices_t should have the same dtype");
+  for (const at::Tensor* t : {&grad_out,
+                              &output,
+                              &logsumexp,
+                              &row_indices_t,
+                              &row_offsets_t,
+                              &column_indices_t}) {
+    TORCH_CHECK(t->is_cuda(), "sparse attention expects CUDA tensors");
+    TORCH_CHECK(
+        t->device() == query.device(),
+        "sparse attention expects tensors on the same device");
+  }
+  at::cuda::CUDAGuard device_guard(query.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  at::Tensor g = grad_out.contiguous();
+  at::Tensor out = output.contiguous();
+  at::Tensor lse = logsumexp.contiguous();
+  at::Tensor ri_t = row_indices_t.contiguous();
+  at::Tensor ro_t = row_offsets_t.contiguous();
+  at::Tensor ci_t = column_indices_t.contiguous();
+
+  int batch = query.size(0);
+  int m = query.size(1);
+  int k = query.size(2);
+  int n = key.size(1);
+  int kv = value.size(2);
+
+  at::Tensor grad_query = at::empty_like(query);
+  at::Tensor grad_key = at::empty_like(key);
+  at::Tensor grad_value = at::empty_like(value);
+  at::Tensor delta = at::empty_like(lse);
+  if (batch == 0) {
+    return std::make_tuple(grad_query, grad_key, grad_value);
+  }
+
+  dim3 block_dim(kWarpSize, kWarpsPerBlock);
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        query.scalar_type(),
+        "sparse_attention_backward_sputnik",
+        [&] {
+          DispatchItemsPerLane(std::max(k, kv), [&](auto items_per_lane) {
+            constexpr int kItemsPerLane = decltype(items_per_lane)::value;
+            if (m > 0) {
+              dim3 grid_dim(
+                  std::ceil(static_cast<float>(m) / kWarpsPerBlock), batch);
+              SparseAttentionBackwardQKernel<scalar_t, index_t, kItemsPerLane>
+                  <<<grid_dim, block_dim, 0, stream>>>(
+                      m,
+                      k,
+                      kv,
+                      n,
+                      g.data_ptr<scalar_t>(),
+                      query.data_ptr<scalar_t>(),
+                      key.data_ptr<scalar_t>(),
+                      value.data_ptr<scalar_t>(),
+                      out.data_ptr<scalar_t>(),
+                      lse.data_ptr<float>(),
+                      row_indices.data_ptr<int>(),
+                      row_offsets.data_ptr<int>(),
+                      column_indices.data_ptr<index_t>(),
+                      scale,
+                      grad_query.data_ptr<scalar_t>(),
+                      delta.data_ptr<float>());
+              AT_CUDA_CHECK(cudaGetLastError());
+            }
+            if (n > 0) {
+              dim3 grid_dim(
+                  std::ceil(static_cast<float>(n) / kWarpsPerBlock), batch);
+              SparseAttentionBackwardKVKernel<scalar_t, index_t, kItemsPerLane>
+                  <<<grid_dim, block_dim, 0, stream>>>(
+                      m,
+                      k,
+                      kv,
+                      n,
+                      g.data_ptr<scalar_t>(),
+                      query.data_ptr<scalar_t>(),
+                      key.data_ptr<scalar_t>(),
+                      value.data_ptr<scalar_t>(),
+                      lse.data_ptr<float>(),
+                      delta.data_ptr<float>(),
+                      ri_t.data_ptr<int>(),
+                      ro_t.data_ptr<int>(),
+                      ci_t.data_ptr<index_t>(),
+                      scale,
+                      grad_key.data_ptr<scalar_t>(),
+                      grad_value.data_ptr<scalar_t>());
+              AT_CUDA_CHECK(cudaGetLastError());
+            }
+          });
+        });
+  });
+
+  return std::make_tuple(grad_query, grad_key, grad_value);
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse_softmax_attention_backward_sputnik(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& attn,
+    const at::Tensor& attn_dropped,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    const at::Tensor& perm) {
+  TORCH_CHECK(query.dim() == 3);
+  TORCH_CHECK(key.dim() == 3);
+  TORCH_CHECK(value.dim() == 3);
+  TORCH_CHECK(grad_out.dim() == 3);
+  TORCH_CHECK(row_offsets.dim() == 1);
+
+  // a per-batch pattern is the pattern of the stacked batch elements
+  at::Tensor q = query;
+  at::Tensor k_ = key;
+  at::Tensor v = value;
+  at::Tensor g = grad_out.contiguous();
+  if (is_batched_pattern(query.size(0), query.size(1), row_offsets)) {
+    q = query.reshape({1, -1, query.size(2)});
+    k_ = key.reshape({1, -1, key.size(2)});
+    v = value.reshape({1, -1, value.size(2)});
+    g = g.reshape({1, -1, g.size(2)});
+  }
+  check_sparse_attention_inputs(
+      q, k_, v, row_indices, row_offsets, column_indices);
+  TORCH_CHECK(
+      g.size(0) == q.size(0) && g.size(1) == q.size(1) &&
+      g.size(2) == v.size(2));
+  TORCH_CHECK(attn.dim() == 2);
+  TORCH_CHECK(attn.size(0) == q.size(0));
+  TORCH_CHECK(attn.size(1) == column_indices.size(0));
+  TORCH_CHECK(attn.sizes() == attn_dropped.sizes());
+  TORCH_CHECK(
+      attn.scalar_type() == q.scalar_type() &&
+          attn_dropped.scalar_type() == q.scalar_type(),
+      "attn and attn_dropped should have the dtype of query");
+  TORCH_CHECK(row_indices_t.dim() == 1);
+  TORCH_CHECK(row_offsets_t.dim() == 1);
+  TORCH_CHECK(column_indices_t.dim() == 1);
+  TORCH_CHECK(perm.dim() == 1);
+  TORCH_CHECK(row_indices_t.size(0) == k_.size(1));
+  TORCH_CHECK(row_offsets_t.size(0) == k_.size(1) + 1);
+  TORCH_CHECK(column_indices_t.size(0) == column_indices.size(0));
+  TORCH_CHECK(
+      column_indices_t.scalar_type() == column_indices.scalar_type(),
+      "column_indices and column_indices_t should have the same dtype");
+  TORCH_CHECK(perm.size(0) == column_indices.size(0));
+  TORCH_CHECK(perm.scalar_type() == at::ScalarType::Long);
+  for (const at::Tensor* t : {&grad_out,
+                              &attn,
+                              &attn_dropped,
+                              &row_indices_t,
+                              &row_offsets_t,
+                              &column_indices_t,
+                              &perm}) {
+    TORCH_CHECK(t->is_cuda(), "sparse attention expects CUDA tensors");
+    TORCH_CHECK(
+        t->device() == query.device(),
+        "sparse attention expects tensors on the same device");
+  }
+  at::cuda::CUDAGuard device_guard(query.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  at::Tensor p = attn.contiguous();
+  at::Tensor p_dropped = attn_dropped.contiguous();
+  at::Tensor ri_t = row_indices_t.contiguous();
+  at::Tensor ro_t = row_offsets_t.contiguous();
+  at::Tensor ci_t = column_indices_t.contiguous();
+  at::Tensor perm_t = perm.contiguous();
+
+  int batch = q.size(0);
+  int m = q.size(1);
+  int k = q.size(2);
+  int n = k_.size(1);
+  int kv = v.size(2);
+  int nonzeros = column_indices.size(0);
+
+  at::Tensor grad_query = at::empty_like(q);
+  at::Tensor grad_key = at::empty_like(k_);
+  at::Tensor delta =
+      at::empty({batch, m}, q.options().dtype(at::ScalarType::Float));
+  if (batch == 0) {
+    return std::make_tuple(
+        grad_query.view(query.sizes()), grad_key.view(key.sizes()));
+  }
+
+  dim3 block_dim(kWarpSize, kWarpsPerBlock);
+  dispatch_index_type(column_indices, [&](auto index) {
+    using index_t = decltype(index);
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        q.scalar_type(),
+        "sparse_softmax_attention_backward_sputnik",
+        [&] {
+          DispatchItemsPerLane(std::max(k, kv), [&](auto items_per_lane) {
+            constexpr int kItemsPerLane = decltype(items_per_lane)::value;
+            if (m > 0) {
+              dim3 grid_dim(
+                  std::ceil(static_cast<float>(m) / kWarpsPerBlock), batch);
+              SparseSoftmaxAttentionBackwardQKernel<
+                  scalar_t,
+                  index_t,
+                  kItemsPerLane><<<grid_dim, block_dim, 0, stream>>>(
+                      m,
+                      k,
+                      kv,
+                      n,
+                      nonzeros,
+                      g.data_ptr<scalar_t>(),
+                      k_.data_ptr<scalar_t>(),
+                      v.data_ptr<scalar_t>(),
+                      p.data_ptr<scalar_t>(),
+                      p_dropped.data_ptr<scalar_t>(),
+                      row_indices.data_ptr<int>(),
+                      row_offsets.data_ptr<int>(),
+                      column_indices.data_ptr<index_t>(),
+                      grad_query.data_ptr<scalar_t>(),
+                      delta.data_ptr<float>());
+              AT_CUDA_CHECK(cudaGetLastError());
+            }
+            if (n > 0) {
+              dim3 grid_dim(
+                  std::ceil(static_cast<float>(n) / kWarpsPerBlock), batch);
+              SparseSoftmaxAttentionBackwardKKernel<
+                  scalar_t,
+                  index_t,
+                  kItemsPerLane><<<grid_dim, block_dim, 0, stream>>>(
+                      m,
+                      k,
+                      kv,
+                      n,
+                      nonzeros,
+                      g.data_ptr<scalar_t>(),
+                      q.data_ptr<scalar_t>(),
+                      v.data_ptr<scalar_t>(),
+                      p.data_ptr<scalar_t>(),
+                      p_dropped.data_ptr<scalar_t>(),
+                      delta.data_ptr<float>(),
+                      ri_t.data_ptr<int>(),
+                      ro_t.data_ptr<int>(),
+                      ci_t.data_ptr<index_t>(),
+                      perm_t.data_ptr<int64_t>(),
+                      grad_key.data_ptr<scalar_t>());
+              AT_CUDA_CHECK(cudaGetLastError());
+            }
+          });
+        });
+  });
+
+  return std::make_tuple(
+      grad_query.view(query.sizes()), grad_key.view(key.sizes()));
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_sputnik"),
+      TORCH_FN(sparse_attention_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_backward_sputnik"),
+      TORCH_FN(sparse_attention_backward_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME(
+          "xformers::sparse_softmax_attention_backward_sputnik"),
+      TORCH_FN(sparse_softmax_attention_backward_sputnik));
+}
@@ -21,23 +21,28 @@
 #include "sputnik/load_store.h"
 
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
 #include <torch/types.h>
 
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
 
+#include "reduced_precision.h"
+
 namespace sputnik {
 
 namespace {
 
+// The half / bfloat16 values are accumulated in float
+template <typename scalar_t>
 __global__ void SparseSoftmaxKernel(
     int m,
     int n,
-    const float* __restrict__ values,
+    const scalar_t* __restrict__ values,
     const int* __restrict__ row_indices,
     const int* __restrict__ row_offsets,
     const int* __restrict__ column_indices,
-    float* __restrict__ output_values,
+    scalar_t* __restrict__ output_values,
     int nnz) {
   // Calculate the index of the row that this block will process.
   int m_index = blockIdx.x * blockDim.y + threadIdx.y;
@@ -53,10 +58,10 @@ __global__ void SparseSoftmaxKernel(
   int batch_offset = blockIdx.y * nnz;
 
   // Step 1: Find the maximum value in our row.
-  const float* in = values + row_offset + batch_offset;
+  const scalar_t* in = values + row_offset + batch_offset;
   float max = -INFINITY;
   for (int idx = threadIdx.x; idx < nonzeros; idx += blockDim.x) {
-    float x = Load(in + idx);
+    float x = LoadFloat(in + idx);
     max = x > max ? x : max;
   }
   for (int idx = 1; idx < blockDim.x; idx *= 2) {
@@ -68,7 +73,7 @@ __global__ void SparseSoftmaxKernel(
   // once so we don't need to do repeated division.
   float norm = 0.0f;
   for (int idx = threadIdx.x; idx < nonzeros; idx += blockDim.x) {
-    norm += expf(Load(in + idx) - max);
+    norm += expf(LoadFloat(in + idx) - max);
   }
   for (int idx = 1; idx < blockDim.x; idx *= 2) {
     norm += __shfl_xor_sync(0xffffffff, norm, idx);
@@ -77,23 +82,24 @@ __global__ void SparseSoftmaxKernel(
 
   // step 3: Normalize the exponentials of the input and store the
   // results.
-  float* out = output_values + row_offset + batch_offset;
+  scalar_t* out = output_values + row_offset + batch_offset;
   for (int idx = threadIdx.x; idx < nonzeros; idx += blockDim.x) {
-    Store(expf(Load(in + idx) - max) * norm, out + idx);
+    out[idx] = static_cast<scalar_t>(expf(LoadFloat(in + idx) - max) * norm);
   }
 }
 
 } // namespace
 
+template <typename scalar_t>
 cudaError_t SparseSoftmax(
     int m,
     int n,
     int nonzeros,
-    const float* __restrict__ values,
+    const scalar_t* __restrict__ values,
     const int* __restrict__ row_indices,
     const int* __restrict__ row_offsets,
     const int* __restrict__ column_indices,
-    float* __restrict__ output_values,
+    scalar_t* __restrict__ output_values,
     cudaStream_t stream,
     int batch) {
   // NOTE: SparseSoftmaxKernel currently only supports 1 warp per row
@@ -104,7 +110,7 @@ cudaError_t SparseSoftmax(
   dim3 grid_dim(std::ceil(static_cast<float>(m) / kWarpsPerBlock), batch);
   dim3 block_dim(kBlockWidth, kWarpsPerBlock);
 
-  SparseSoftmaxKernel<<<grid_dim, block_dim, 0, stream>>>(
+  SparseSoftmaxKernel<scalar_t><<<grid_dim, block_dim, 0, stream>>>(
       m,
       n,
       values,
@@ -130,6 +136,11 @@ at::Tensor sparse_softmax_sputnik(
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
   TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(
+      values.scalar_type() == at::ScalarType::Float ||
+          values.scalar_type() == at::ScalarType::Half ||
+          values.scalar_type() == at::ScalarType::BFloat16,
+      "sparse_softmax_sputnik only supports float, half and bfloat16 inputs");
 
   TORCH_CHECK(row_indices.is_cuda(), "row_indices must be a CUDA tensor");
   TORCH_CHECK(values.is_cuda(), "values must be a CUDA tensor");
@@ -155,35 +166,49 @@ at::Tensor sparse_softmax_sputnik(
 
   int batch = values.size(0);
   int nonzeros = column_indices.size(0);
+  // per-batch patterns have the rows of all the batch elements
+  int rows = row_offsets.size(0) - 1;
+  TORCH_CHECK(
+      rows == m || (values.size(0) == 1 && m > 0 && rows % m == 0),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
 
   at::Tensor output = at::empty({batch, nonzeros}, values.options());
 
-  AT_CUDA_CHECK(sputnik::SparseSoftmax(
-      m,
-      n,
-      nonzeros,
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      stream,
-      batch));
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_sputnik",
+      [&] {
+        AT_CUDA_CHECK(sputnik::SparseSoftmax<scalar_t>(
+            rows,
+            n,
+            nonzeros,
+            values.data_ptr<scalar_t>(),
+            row_indices.data_ptr<int>(),
+            row_offsets.data_ptr<int>(),
+            column_indices.data_ptr<int>(),
+            output.data_ptr<scalar_t>(),
+            stream,
+            batch));
+      });
 
   return output;
 }
 
 // Taken from sputnik SparseSoftmax with minor modifications
 // to adapt it to perform the backward operation
+template <typename scalar_t>
 __global__ void SparseSoftmaxBackwardKernel(
     int m,
     int n,
-    const float* __restrict__ gradient,
-    const float* __restrict__ values,
+    const scalar_t* __restrict__ gradient,
+    const scalar_t* __restrict__ values,
     const int* __restrict__ row_indices,
     const int* __restrict__ row_offsets,
     const int* __restrict__ column_indices,
-    float* __restrict__ output_values,
+    scalar_t* __restrict__ output_values,
     int nnz) {
   // Calculate the index of the row that this block will process.
   int m_index = blockIdx.x * blockDim.y + threadIdx.y;
@@ -198,23 +223,24 @@ __global__ void SparseSoftmaxBackwardKernel(
 
   int batch_offset = blockIdx.y * nnz;
 
-  const float* in = values + row_offset + batch_offset;
-  const float* grad = gradient + row_offset + batch_offset;
+  const scalar_t* in = values + row_offset + batch_offset;
+  const scalar_t* grad = gradient + row_offset + batch_offset;
 
   // Step 1: Compute the intermediate sum used for the gradient
   float sum = 0.0f;
   for (int idx = threadIdx.x; idx < nonzeros; idx += blockDim.x) {
-    sum += sputnik::Load(in + idx) * sputnik::Load(grad + idx);
+    sum += sputnik::LoadFloat(in + idx) * sputnik::LoadFloat(grad + idx);
   }
   for (int idx = 1; idx < blockDim.x; idx *= 2) {
     sum += __shfl_xor_sync(0xffffffff, sum, idx);
   }
 
   // step 2: Compute the gradients
-  float* out = output_values + row_offset + batch_offset;
+  scalar_t* out = output_values + row_offset + batch_offset;
   for (int idx = threadIdx.x; idx < nonzeros; idx += blockDim.x) {
-    sputnik::Store(
-        sputnik::Load(in + idx) * (sputnik::Load(grad + idx) - sum), out + idx);
+    out[idx] = static_cast<scalar_t>(
+        sputnik::LoadFloat(in + idx) *
+        (sputnik::LoadFloat(grad + idx) - sum));
   }
 }
 
@@ -234,6 +260,15 @@ at::Tensor sparse_softmax_backward_sputnik(
   TORCH_CHECK(values.size(1) == column_indices.size(0));
   TORCH_CHECK(values.size(0) == grad.size(0));
   TORCH_CHECK(values.size(1) == grad.size(1));
+  TORCH_CHECK(
+      values.scalar_type() == grad.scalar_type(),
+      "values should have the same dtype as grad");
+  TORCH_CHECK(
+      values.scalar_type() == at::ScalarType::Float ||
+          values.scalar_type() == at::ScalarType::Half ||
+          values.scalar_type() == at::ScalarType::BFloat16,
+      "sparse_softmax_backward_sputnik only supports float, half and bfloat16 "
+      "inputs");
 
   TORCH_CHECK(grad.is_cuda(), "grad must be a CUDA tensor");
   TORCH_CHECK(row_indices.is_cuda(), "row_indices must be a CUDA tensor");
@@ -275,6 +310,12 @@ at::Tensor sparse_softmax_backward_sputnik(
 
   int batch = values.size(0);
   int nonzeros = column_indices.size(0);
+  // per-batch patterns have the rows of all the batch elements
+  int rows = row_offsets.size(0) - 1;
+  TORCH_CHECK(
+      rows == m || (values.size(0) == 1 && m > 0 && rows % m == 0),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
 
   at::Tensor output = at::empty({batch, nonzeros}, values.options());
 
@@ -283,19 +324,27 @@ at::Tensor sparse_softmax_backward_sputnik(
   // mapped to different rows to enable us to hit max occupancy.
   constexpr int kBlockWidth = 32;
   constexpr int kWarpsPerBlock = 2;
-  dim3 grid_dim(std::ceil(static_cast<float>(m) / kWarpsPerBlock), batch);
+  dim3 grid_dim(std::ceil(static_cast<float>(rows) / kWarpsPerBlock), batch);
   dim3 block_dim(kBlockWidth, kWarpsPerBlock);
 
-  SparseSoftmaxBackwardKernel<<<grid_dim, block_dim, 0, stream>>>(
-      m,
-      n,
-      grad.data_ptr<float>(),
-      values.data_ptr<float>(),
-      row_indices.data_ptr<int>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      output.data_ptr<float>(),
-      nonzeros);
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      values.scalar_type(),
+      "sparse_softmax_backward_sputnik",
+      [&] {
+        SparseSoftmaxBackwardKernel<scalar_t>
+            <<<grid_dim, block_dim, 0, stream>>>(
+                rows,
+                n,
+                grad.data_ptr<scalar_t>(),
+                values.data_ptr<scalar_t>(),
+                row_indices.data_ptr<int>(),
+                row_offsets.data_ptr<int>(),
+                column_indices.data_ptr<int>(),
+                output.data_ptr<scalar_t>(),
+                nonzeros);
+      });
   AT_CUDA_CHECK(cudaGetLastError());
 
   return output;
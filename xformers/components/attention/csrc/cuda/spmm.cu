@@ -17,9 +17,13 @@
 #include <cmath>
 #include <functional>
 #include <string>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include "sputnik/barrier.h"
+#include "sputnik/common.h"
 #include "sputnik/cuda_utils.h"
 #include "sputnik/load_store.h"
 #include "sputnik/memory_aligner.h"
@@ -34,13 +38,43 @@
 #include "sputnik/vector_utils.h"
 
 #include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
 #include <torch/types.h>
 
 #include <ATen/cuda/CUDAContext.h>
 #include <c10/cuda/CUDAGuard.h>
 
+#include "../batched_pattern.h"
+#include "../spmm_activation.h"
+#include "autotune.h"
+#include "reduced_precision.h"
+
 namespace sputnik {
 
+// Epilogue of the spmm, applied to every row `i` of the output while it is
+// still in registers: `out[i] = activation(a[i] @ b + bias[i])`, where `bias`
+// can be null. The kernels also store the pre-activation `a[i] @ b + bias[i]`
+// to `preact` if it is set, which the backward of the GELU needs
+template <typename scalar_t>
+struct SpmmEpilogue {
+  const float* bias = nullptr; // [m]
+  SpmmActivation activation = SpmmActivation::kNone;
+  scalar_t* preact = nullptr; // same shape as the output
+};
+
+__device__ __forceinline__ float ApplyActivation(
+    float x,
+    SpmmActivation activation) {
+  switch (activation) {
+    case SpmmActivation::kRelu:
+      return x > 0 ? x : 0;
+    case SpmmActivation::kGelu:
+      return 0.5f * x * (1.0f + erff(x * float(M_SQRT1_2)));
+    default:
+      return x;
+  }
+}
+
 template <typename Config>
 cudaError_t CudaSpmmEx2(
     int m,
@@ -52,7 +86,7 @@ cudaError_t CudaSpmmEx2(
     const int* __restrict__ row_offsets,
     const typename Config::ScalarIndex* __restrict__ column_indices,
     const typename Config::ScalarValue* __restrict__ dense_matrix,
-    const float* __restrict__ bias,
+    SpmmEpilogue<typename Config::ScalarValue> epilogue,
     typename Config::ScalarValue* __restrict__ output_matrix,
     cudaStream_t stream,
     int batch_size);
@@ -129,7 +163,7 @@ struct SpmmKernel2 {
       const int* __restrict__ row_offsets,
       const ScalarIndex* __restrict__ column_indices,
       const ScalarValue* __restrict__ dense_matrix,
-      const float* __restrict__ bias,
+      SpmmEpilogue<ScalarValue> epilogue,
       ScalarValue* __restrict__ out,
       int nnz) {
     // Calculate this thread block's indices into the M and N dimensions.
@@ -296,15 +330,30 @@ struct SpmmKernel2 {
     /// Write results to the output.
     //
 
-    // Possibly apply the bias and RelU.
-    if (bias != nullptr) {
+    // Possibly apply the bias and the activation.
+    if (epilogue.bias != nullptr) {
       // Bias value is shared across all outputs.
-      const float bias_value = Load(bias + m_index);
+      const float bias_value = Load(epilogue.bias + m_index);
 #pragma unroll
       for (int out_idx = 0; out_idx < kOutputFragmentSize; ++out_idx) {
         output_fragment[out_idx] += bias_value;
+      }
+    }
+    if (epilogue.preact != nullptr) {
+      OutputTile preact_storer(
+          m_index,
+          n_index,
+          n,
+          threadIdx.x,
+          output_fragment,
+          epilogue.preact + blockIdx.z * m * n);
+      preact_storer.Store(predicates_n);
+    }
+    if (epilogue.activation != SpmmActivation::kNone) {
+#pragma unroll
+      for (int out_idx = 0; out_idx < kOutputFragmentSize; ++out_idx) {
         output_fragment[out_idx] =
-            output_fragment[out_idx] > 0 ? output_fragment[out_idx] : 0;
+            ApplyActivation(output_fragment[out_idx], epilogue.activation);
       }
     }
 
@@ -330,7 +379,7 @@ __global__ void __launch_bounds__(Config::kThreadsPerBlock) Kernel2(
     const int* __restrict__ row_offsets,
     const typename Config::ScalarIndex* __restrict__ column_indices,
     const typename Config::ScalarValue* __restrict__ dense_matrix,
-    const float* __restrict__ bias,
+    SpmmEpilogue<typename Config::ScalarValue> epilogue,
     typename Config::ScalarValue* __restrict__ out,
     int nnz) {
   SpmmKernel2<Config>::KernelFn(
@@ -342,7 +391,7 @@ __global__ void __launch_bounds__(Config::kThreadsPerBlock) Kernel2(
       row_offsets,
       column_indices,
       dense_matrix,
-      bias,
+      epilogue,
       out,
       nnz);
 }
@@ -360,7 +409,7 @@ __global__ void __launch_bounds__(
         const int* __restrict__ row_offsets,
         const typename Config::ScalarIndex* __restrict__ column_indices,
         const typename Config::ScalarValue* __restrict__ dense_matrix,
-        const float* __restrict__ bias,
+        SpmmEpilogue<typename Config::ScalarValue> epilogue,
         typename Config::ScalarValue* __restrict__ out,
         int nnz) {
   SpmmKernel2<Config>::KernelFn(
@@ -372,7 +421,7 @@ __global__ void __launch_bounds__(
       row_offsets,
       column_indices,
       dense_matrix,
-      bias,
+      epilogue,
       out,
       nnz);
 }
@@ -387,7 +436,7 @@ typedef std::function<cudaError_t(
     const int*, // row_offsets: ptr to lhs row offsets.
     const int*, // column_indices: ptr to lhs column indices.
     const float*, // dense_matrix: ptr to rhs matrix.
-    const float*, // bias: bias pointer.
+    SpmmEpilogue<float>, // epilogue: bias, activation and pre-activation.
     float*, // output_matrix: ptr to output matrix.
     cudaStream_t,
     int)> // stream: stream to execute in.
@@ -471,6 +520,58 @@ FloatSpmmFn2 GetKernel(int m, int k, int n, int nonzeros) {
   return it->second;
 }
 
+// A kernel for the autotuner, and the problems it supports
+struct SpmmCandidate {
+  FloatSpmmFn2 fn;
+  // `n` must be a multiple of this: the width of the vector loads of the
+  // dense matrix, or the n-dimension tile without predicated loads
+  int n_multiple;
+};
+
+template <typename Config>
+SpmmCandidate MakeCandidate() {
+  int n_multiple = Config::kValuesPerItemX * Config::kElementsPerScalar;
+  if (!Config::kPredicateLoads) {
+    n_multiple = Config::kBlockItemsX * Config::kElementsPerScalar;
+  }
+  return {CudaSpmmEx2<Config>, n_multiple};
+}
+
+// The configs of the heuristic below and of the table above. The variants
+// are persisted by index, so new configs should be appended
+const std::vector<SpmmCandidate>& GetCandidates() {
+  static const std::vector<SpmmCandidate> candidates = {
+      MakeCandidate<SpmmConfig<float, float, float, 1, 32, 32, 32>>(),
+      MakeCandidate<SpmmConfig<float, float2, float2, 2, 32, 32, 16>>(),
+      MakeCandidate<SpmmConfig<float, float4, float, 4, 32, 8, 8>>(),
+      MakeCandidate<SpmmConfig<float, float4, float, 4, 32, 8, 8, 4, false>>(),
+      MakeCandidate<SpmmConfig<float, float4, float2, 4, 32, 16, 8>>(),
+      MakeCandidate<
+          SpmmConfig<float, float4, float2, 4, 32, 16, 8, 4, false>>(),
+      MakeCandidate<SpmmConfig<float, float4, float4, 4, 32, 32, 8>>(),
+      MakeCandidate<
+          SpmmConfig<float, float4, float4, 4, 32, 32, 8, 4, false>>(),
+      MakeCandidate<
+          SpmmConfig<float, float4, float4, 4, 32, 64, 8, 4, false, true, 8>>(),
+      MakeCandidate<SpmmConfig<float, float, float4, 1, 32, 128, 32>>(),
+      MakeCandidate<SpmmConfig<float, float, float4, 4, 8, 32, 8, 4, false>>(),
+      MakeCandidate<
+          SpmmConfig<float, float2, float4, 4, 16, 32, 8, 4, false>>(),
+  };
+  return candidates;
+}
+
+// Kernel selection for the shapes missing from the table, with
+// `XFORMERS_SPMM_AUTOTUNE(_CACHE)`
+class SpmmAutotuner {
+ public:
+  static KernelAutotuner& get() {
+    static KernelAutotuner autotuner(
+        "XFORMERS_SPMM_AUTOTUNE", "XFORMERS_SPMM_AUTOTUNE_CACHE");
+    return autotuner;
+  }
+};
+
 } // namespace
 
 template <typename Config>
@@ -484,7 +585,7 @@ cudaError_t CudaSpmmEx2(
     const int* __restrict__ row_offsets,
     const typename Config::ScalarIndex* __restrict__ column_indices,
     const typename Config::ScalarValue* __restrict__ dense_matrix,
-    const float* __restrict__ bias,
+    SpmmEpilogue<typename Config::ScalarValue> epilogue,
     typename Config::ScalarValue* __restrict__ output_matrix,
     cudaStream_t stream,
     int batch_size) {
@@ -506,7 +607,7 @@ cudaError_t CudaSpmmEx2(
         row_offsets,
         column_indices,
         dense_matrix,
-        bias,
+        epilogue,
         output_matrix,
         nonzeros);
   } else {
@@ -519,14 +620,14 @@ cudaError_t CudaSpmmEx2(
         row_offsets,
         column_indices,
         dense_matrix,
-        bias,
+        epilogue,
         output_matrix,
         nonzeros);
   }
   return cudaGetLastError();
 }
 
-cudaError_t CudaSpmmBiasRelu2(
+cudaError_t CudaSpmmBiasAct2(
     int m,
     int k,
     int n,
@@ -536,7 +637,7 @@ cudaError_t CudaSpmmBiasRelu2(
     const int* __restrict__ row_offsets,
     const int* __restrict__ column_indices,
     const float* __restrict__ dense_matrix,
-    const float* __restrict__ bias,
+    const SpmmEpilogue<float>& epilogue,
     float* __restrict__ output_matrix,
     cudaStream_t stream,
     int batch_size) {
@@ -554,12 +655,66 @@ cudaError_t CudaSpmmBiasRelu2(
         row_offsets,
         column_indices,
         dense_matrix,
-        bias,
+        epilogue,
         output_matrix,
         stream,
         batch_size);
   }
 
+  KernelAutotuner& autotuner = SpmmAutotuner::get();
+  if (autotuner.enabled()) {
+    const std::vector<SpmmCandidate>& candidates = GetCandidates();
+    auto run = [&](int variant) {
+      const SpmmCandidate& candidate = candidates[variant];
+      TORCH_CHECK(n % candidate.n_multiple == 0);
+      AT_CUDA_CHECK(candidate.fn(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size));
+    };
+    // -1 if no candidate could run (or from a cache file that doesn't match
+    // this build): use the heuristic
+    int variant = autotuner.select(
+        make_autotune_key(
+            "spmm",
+            at::cuda::getCurrentDeviceProperties()->major * 10 +
+                at::cuda::getCurrentDeviceProperties()->minor,
+            m,
+            k,
+            n,
+            autotune_bucket(nonzeros),
+            autotune_bucket(batch_size)),
+        candidates.size(),
+        /*fallback=*/-1,
+        run);
+    if (variant >= 0 && variant < int(candidates.size())) {
+      return candidates[variant].fn(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size);
+    }
+  }
+
   // A very simple kernel selection heuristic. For small batch sizes,
   // we use the hybrid kernel variants with float4 sparse matrix loads.
   // For mid to large batch sizes, we use the standard float4 kernel with
@@ -586,7 +741,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -602,7 +757,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -619,7 +774,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -635,7 +790,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -652,7 +807,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -672,7 +827,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -691,7 +846,7 @@ cudaError_t CudaSpmmBiasRelu2(
           row_offsets,
           column_indices,
           dense_matrix,
-          bias,
+          epilogue,
           output_matrix,
           stream,
           batch_size);
@@ -708,7 +863,7 @@ cudaError_t CudaSpmmBiasRelu2(
         row_offsets,
         column_indices,
         dense_matrix,
-        bias,
+        epilogue,
         output_matrix,
         stream,
         batch_size);
@@ -725,7 +880,7 @@ cudaError_t CudaSpmmBiasRelu2(
         row_offsets,
         column_indices,
         dense_matrix,
-        bias,
+        epilogue,
         output_matrix,
         stream,
         batch_size);
@@ -745,7 +900,7 @@ cudaError_t CudaSpmm2(
     float* __restrict__ output_matrix,
     cudaStream_t stream,
     int batch_size) {
-  return CudaSpmmBiasRelu2(
+  return CudaSpmmBiasAct2(
       m,
       k,
       n,
@@ -755,28 +910,250 @@ cudaError_t CudaSpmm2(
       row_offsets,
       column_indices,
       dense_matrix,
-      /* bias = */ nullptr,
+      SpmmEpilogue<float>(),
       output_matrix,
       stream,
       batch_size);
 }
 
+namespace {
+
+constexpr int kSpmmWarpsPerBlock = 4;
+
+// Half / bfloat16 variant of the spmm: each warp computes
+// `kReducedWarpSize * kVecSize` columns of a row of the output, with each
+// lane accumulating `kVecSize` consecutive columns in float. The nonzeros of
+// the row are loaded by tiles of one per lane, and broadcast to the whole
+// warp with shuffles
+template <typename scalar_t, int kVecSize>
+__global__ void __launch_bounds__(kReducedWarpSize* kSpmmWarpsPerBlock)
+    CudaSpmmReducedKernel(
+        int m,
+        int k,
+        int n,
+        const int* __restrict__ row_indices,
+        const scalar_t* __restrict__ values,
+        const int* __restrict__ row_offsets,
+        const int* __restrict__ column_indices,
+        const scalar_t* __restrict__ dense_matrix,
+        SpmmEpilogue<scalar_t> epilogue,
+        scalar_t* __restrict__ output_matrix,
+        int nnz) {
+  int m_index = blockIdx.x * blockDim.y + threadIdx.y;
+  if (m_index >= m)
+    return;
+  m_index = Load(row_indices + m_index);
+
+  int row_offset = Load(row_offsets + m_index);
+  int nonzeros = Load(row_offsets + m_index + 1) - row_offset;
+  // The lanes past the end of the row still take part in the shuffles
+  int n_index = (blockIdx.y * kReducedWarpSize + threadIdx.x) * kVecSize;
+  bool active = n_index < n;
+
+  const scalar_t* row_values =
+      values + int64_t(blockIdx.z) * nnz + row_offset;
+  const int* row_columns = column_indices + row_offset;
+  const scalar_t* dense =
+      dense_matrix + int64_t(blockIdx.z) * k * n + n_index;
+
+  float accumulator[kVecSize] = {};
+  float dense_fragment[kVecSize];
+  for (int tile = 0; tile < nonzeros; tile += kReducedWarpSize) {
+    int idx = tile + threadIdx.x;
+    float value = 0.0f;
+    int column = 0;
+    if (idx < nonzeros) {
+      value = static_cast<float>(row_values[idx]);
+      column = Load(row_columns + idx);
+    }
+    int tile_size = Min(kReducedWarpSize, nonzeros - tile);
+    for (int l = 0; l < tile_size; ++l) {
+      float lhs = __shfl_sync(0xffffffff, value, l);
+      int64_t offset = int64_t(__shfl_sync(0xffffffff, column, l)) * n;
+      if (active) {
+        LoadVec<scalar_t, kVecSize>(dense + offset, dense_fragment);
+#pragma unroll
+        for (int i = 0; i < kVecSize; ++i) {
+          accumulator[i] += lhs * dense_fragment[i];
+        }
+      }
+    }
+  }
+  if (active) {
+    int64_t output_offset = (int64_t(blockIdx.z) * m + m_index) * n + n_index;
+    if (epilogue.bias != nullptr) {
+      const float bias_value = Load(epilogue.bias + m_index);
+#pragma unroll
+      for (int i = 0; i < kVecSize; ++i) {
+        accumulator[i] += bias_value;
+      }
+    }
+    if (epilogue.preact != nullptr) {
+      StoreVec<scalar_t, kVecSize>(
+          accumulator, epilogue.preact + output_offset);
+    }
+    if (epilogue.activation != SpmmActivation::kNone) {
+#pragma unroll
+      for (int i = 0; i < kVecSize; ++i) {
+        accumulator[i] = ApplyActivation(accumulator[i], epilogue.activation);
+      }
+    }
+    StoreVec<scalar_t, kVecSize>(accumulator, output_matrix + output_offset);
+  }
+}
+
+template <typename scalar_t, int kVecSize>
+cudaError_t CudaSpmmReducedEx(
+    int m,
+    int k,
+    int n,
+    int nonzeros,
+    const int* __restrict__ row_indices,
+    const scalar_t* __restrict__ values,
+    const int* __restrict__ row_offsets,
+    const int* __restrict__ column_indices,
+    const scalar_t* __restrict__ dense_matrix,
+    const SpmmEpilogue<scalar_t>& epilogue,
+    scalar_t* __restrict__ output_matrix,
+    cudaStream_t stream,
+    int batch_size) {
+  dim3 grid_dim(
+      ceil(static_cast<float>(m) / kSpmmWarpsPerBlock),
+      ceil(static_cast<float>(n) / (kReducedWarpSize * kVecSize)),
+      batch_size);
+  dim3 block_dim(kReducedWarpSize, kSpmmWarpsPerBlock, 1);
+
+  CudaSpmmReducedKernel<scalar_t, kVecSize>
+      <<<grid_dim, block_dim, 0, stream>>>(
+          m,
+          k,
+          n,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          nonzeros);
+  return cudaGetLastError();
+}
+
+} // namespace
+
+template <typename scalar_t>
+cudaError_t CudaSpmmReduced(
+    int m,
+    int k,
+    int n,
+    int nonzeros,
+    const int* __restrict__ row_indices,
+    const scalar_t* __restrict__ values,
+    const int* __restrict__ row_offsets,
+    const int* __restrict__ column_indices,
+    const scalar_t* __restrict__ dense_matrix,
+    const SpmmEpilogue<scalar_t>& epilogue,
+    scalar_t* __restrict__ output_matrix,
+    cudaStream_t stream,
+    int batch_size) {
+  switch (MaxVecSize<scalar_t>(
+      n, {dense_matrix, output_matrix, epilogue.preact})) {
+    case 8:
+      return CudaSpmmReducedEx<scalar_t, 8>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size);
+    case 4:
+      return CudaSpmmReducedEx<scalar_t, 4>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size);
+    case 2:
+      return CudaSpmmReducedEx<scalar_t, 2>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size);
+    default:
+      return CudaSpmmReducedEx<scalar_t, 1>(
+          m,
+          k,
+          n,
+          nonzeros,
+          row_indices,
+          values,
+          row_offsets,
+          column_indices,
+          dense_matrix,
+          epilogue,
+          output_matrix,
+          stream,
+          batch_size);
+  }
+}
+
 } // namespace sputnik
 
-at::Tensor spmm_sputnik(
+namespace {
+
+// `activation(a @ b + bias)` for the sparse matrix `a` of `m` rows, and its
+// pre-activation if the backward of the activation needs it (empty
+// otherwise). `bias` has one element per row of `a`
+std::tuple<at::Tensor, at::Tensor> spmm_with_epilogue(
     const at::Tensor& b,
     const at::Tensor& row_indices,
     const at::Tensor& values,
     const at::Tensor& row_offsets,
     const at::Tensor& column_indices,
-    int64_t m) {
+    int64_t m,
+    const c10::optional<at::Tensor>& bias,
+    SpmmActivation activation) {
   TORCH_CHECK(b.dim() == 3);
   TORCH_CHECK(values.dim() == 2);
-  TORCH_CHECK(b.size(0) == values.size(0));
+  TORCH_CHECK(
+      b.size(0) == values.size(0) ||
+      (values.size(0) == 1 && is_batched_pattern(b.size(0), m, row_offsets)));
   TORCH_CHECK(row_indices.dim() == 1);
   TORCH_CHECK(row_offsets.dim() == 1);
   TORCH_CHECK(column_indices.dim() == 1);
   TORCH_CHECK(values.size(1) == column_indices.size(0));
+  TORCH_CHECK(
+      values.scalar_type() == b.scalar_type(),
+      "values should have the same dtype as b");
+  TORCH_CHECK(
+      b.scalar_type() == at::ScalarType::Float ||
+          b.scalar_type() == at::ScalarType::Half ||
+          b.scalar_type() == at::ScalarType::BFloat16,
+      "spmm_sputnik only supports float, half and bfloat16 inputs");
 
   TORCH_CHECK(b.is_cuda(), "b must be a CUDA tensor");
   TORCH_CHECK(row_indices.is_cuda(), "row_indices must be a CUDA tensor");
@@ -820,31 +1197,129 @@ at::Tensor spmm_sputnik(
   int n = b.size(2);
 
   int nonzeros = column_indices.size(0);
+  TORCH_CHECK(
+      row_offsets.size(0) == m + 1 || is_batched_pattern(batch, m, row_offsets),
+      "row_offsets should have m + 1 elements, or batch * m + 1 for a "
+      "per-batch pattern");
+
+  at::Tensor output = at::empty({batch, m, n}, b.options());
+  at::Tensor preact = at::empty(
+      {activation == SpmmActivation::kGelu ? batch : 0, m, n}, b.options());
+
+  // The bias is read in float, whatever the type of the matrices
+  at::Tensor bias_f;
+  if (bias.has_value()) {
+    TORCH_CHECK(bias->dim() == 1 && bias->size(0) == m);
+    TORCH_CHECK(bias->is_cuda(), "bias must be a CUDA tensor");
+    bias_f = bias->to(at::kFloat).contiguous();
+  }
+
+  // a per-batch pattern is a single [batch * m, batch * k] sparse matrix
+  // times the [batch * k, n] stacked dense matrices
+  if (is_batched_pattern(batch, m, row_offsets)) {
+    if (bias_f.defined()) {
+      bias_f = bias_f.repeat({batch});
+    }
+    m *= batch;
+    k *= batch;
+    batch = 1;
+  }
+
+  auto make_epilogue = [&](auto* preact_ptr) {
+    sputnik::SpmmEpilogue<std::remove_pointer_t<decltype(preact_ptr)>>
+        epilogue;
+    epilogue.bias = bias_f.defined() ? bias_f.data_ptr<float>() : nullptr;
+    epilogue.activation = activation;
+    epilogue.preact = preact.numel() > 0 ? preact_ptr : nullptr;
+    return epilogue;
+  };
+
   TORCH_CHECK(
       batch == 1 || nonzeros % 4 == 0,
       "If batch size > 1 then number of nonzeros should be a multiple of 4");
 
-  at::Tensor output = at::empty({batch, m, n}, b.options());
+  if (b.scalar_type() == at::ScalarType::Float) {
+    // TODO investigate misaligned address errors in values ptr
+    AT_CUDA_CHECK(sputnik::CudaSpmmBiasAct2(
+        m,
+        k,
+        n,
+        nonzeros,
+        row_indices.data_ptr<int>(),
+        values.data_ptr<float>(),
+        row_offsets.data_ptr<int>(),
+        column_indices.data_ptr<int>(),
+        b.data_ptr<float>(),
+        make_epilogue((float*)preact.data_ptr()),
+        output.data_ptr<float>(),
+        stream,
+        batch));
+    return std::make_tuple(output, preact);
+  }
+  AT_DISPATCH_REDUCED_FLOATING_TYPES(b.scalar_type(), "spmm_sputnik", [&] {
+    AT_CUDA_CHECK(sputnik::CudaSpmmReduced<scalar_t>(
+        m,
+        k,
+        n,
+        nonzeros,
+        row_indices.data_ptr<int>(),
+        values.data_ptr<scalar_t>(),
+        row_offsets.data_ptr<int>(),
+        column_indices.data_ptr<int>(),
+        b.data_ptr<scalar_t>(),
+        make_epilogue((scalar_t*)preact.data_ptr()),
+        output.data_ptr<scalar_t>(),
+        stream,
+        batch));
+  });
+
+  return std::make_tuple(output, preact);
+}
 
-  // TODO investigate misaligned address errors in values ptr
-  AT_CUDA_CHECK(sputnik::CudaSpmm2(
+} // namespace
+
+at::Tensor spmm_sputnik(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m) {
+  return std::get<0>(spmm_with_epilogue(
+      b,
+      row_indices,
+      values,
+      row_offsets,
+      column_indices,
       m,
-      k,
-      n,
-      nonzeros,
-      row_indices.data_ptr<int>(),
-      values.data_ptr<float>(),
-      row_offsets.data_ptr<int>(),
-      column_indices.data_ptr<int>(),
-      b.data_ptr<float>(),
-      output.data_ptr<float>(),
-      stream,
-      batch));
+      c10::nullopt,
+      SpmmActivation::kNone));
+}
 
-  return output;
+std::tuple<at::Tensor, at::Tensor> spmm_bias_act_sputnik(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m,
+    const c10::optional<at::Tensor>& bias,
+    c10::string_view activation) {
+  return spmm_with_epilogue(
+      b,
+      row_indices,
+      values,
+      row_offsets,
+      column_indices,
+      m,
+      bias,
+      parse_spmm_activation(activation));
 }
 
 TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::spmm_sputnik"), TORCH_FN(spmm_sputnik));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::spmm_bias_act_sputnik"),
+      TORCH_FN(spmm_bias_act_sputnik));
 }
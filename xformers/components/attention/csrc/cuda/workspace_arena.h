@@ -0,0 +1,107 @@
+#pragma once
+
+#include <ATen/ATen.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+// Temporaries of the kernels (accumulators, partial results of splits...)
+// carved from one long-lived buffer per (device, stream), instead of being
+// allocated at every call. Opt-in with the environment variable `enable_env`
+// set to 1: the buffer keeps the size of the largest call.
+//
+// Kernels on a stream run in order, so the buffer can be reused by the next
+// call on the stream as soon as the kernels of this one are enqueued. The
+// buffer is locked while a `WorkspaceArena` is alive, as other host threads
+// could enqueue their kernels on the same stream in between. The tensors
+// returned must not outlive the `WorkspaceArena`.
+//
+// During graph capture (the memory would be shared with the graph) or when
+// not enabled, the temporaries are allocated as usual.
+namespace {
+
+class WorkspaceArena {
+ public:
+  WorkspaceArena(const char* enable_env, const at::Device& device) {
+    if (!enabled(enable_env) ||
+        at::cuda::currentStreamCaptureStatus() !=
+            at::cuda::CaptureStatus::None) {
+      return;
+    }
+    c10::StreamId stream = at::cuda::getCurrentCUDAStream(device.index()).id();
+    buffer_ = get_buffer(enable_env, device.index(), stream);
+    lock_ = std::unique_lock<std::mutex>(buffer_->mutex);
+  }
+
+  at::Tensor empty(at::IntArrayRef sizes, const at::TensorOptions& options) {
+    if (buffer_ == nullptr) {
+      return at::empty(sizes, options);
+    }
+    int64_t numel = c10::multiply_integers(sizes);
+    int64_t nbytes =
+        numel * int64_t(c10::elementSize(options.dtype().toScalarType()));
+    if (!buffer_->storage.defined() ||
+        offset_ + nbytes > buffer_->storage.numel()) {
+      // The tensors carved from the previous buffer keep it alive until they
+      // are freed. Grows geometrically so that it settles quickly
+      int64_t size = std::max(
+          offset_ + nbytes,
+          buffer_->storage.defined() ? 2 * buffer_->storage.numel() : 0);
+      buffer_->storage = at::empty({size}, options.dtype(at::ScalarType::Byte));
+      offset_ = 0;
+    }
+    at::Tensor out = buffer_->storage.narrow(0, offset_, nbytes)
+                         .view(options.dtype().toScalarType())
+                         .view(sizes);
+    offset_ += (nbytes + kAlignment - 1) / kAlignment * kAlignment;
+    return out;
+  }
+
+ private:
+  static constexpr int64_t kAlignment = 256;
+
+  struct Buffer {
+    std::mutex mutex;
+    at::Tensor storage;
+  };
+
+  static bool enabled(const char* enable_env) {
+    const char* enabled = std::getenv(enable_env);
+    return enabled != nullptr && std::string(enabled) == "1";
+  }
+
+  static Buffer*
+  get_buffer(const char* enable_env, int device, c10::StreamId stream) {
+    static std::mutex mutex;
+    static std::map<
+        std::tuple<std::string, int, c10::StreamId>,
+        std::unique_ptr<Buffer>>
+        buffers;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& buffer =
+        buffers[std::make_tuple(std::string(enable_env), device, stream)];
+    if (!buffer) {
+      buffer = std::make_unique<Buffer>();
+    }
+    return buffer.get();
+  }
+
+  Buffer* buffer_ = nullptr;
+  std::unique_lock<std::mutex> lock_;
+  int64_t offset_ = 0;
+};
+
+// Temporaries of the cutlass attention ops, with
+// `XFORMERS_MEM_EFF_ATTENTION_WORKSPACE_ARENA`
+inline WorkspaceArena attention_workspace_arena(const at::Device& device) {
+  return WorkspaceArena("XFORMERS_MEM_EFF_ATTENTION_WORKSPACE_ARENA", device);
+}
+
+} // namespace
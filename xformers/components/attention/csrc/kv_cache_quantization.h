@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+// KV-cache quantized to int8, or to int4 packed two per byte as uint8 (the
+// even channel in the low nibble, with an offset of 8 - as the quantized
+// weights of SwiGLU), with a float32 scale for every group of consecutive
+// channels of a (token, head):
+//   key [b, seqlen, num_kv_heads, K] (int8) or [b, seqlen, num_kv_heads, K/2]
+//   k_scale [b, seqlen, num_kv_heads, G], with `K % G == 0`
+// and the same for the value. With a paged KV-cache, the scales are paged
+// like the K/V (`[num_pages, page_size, num_kv_heads, G]`)
+namespace {
+
+// Number of channels of every row of the quantized `cache`
+inline int64_t kv_cache_num_channels(const at::Tensor& cache) {
+  return cache.scalar_type() == at::ScalarType::Byte ? cache.size(-1) * 2
+                                                     : cache.size(-1);
+}
+
+// Returns the number of bits (8 or 4) of the quantized `cache`
+inline int check_quantized_kv_cache(
+    const at::Tensor& cache,
+    const at::Tensor& scale) {
+  TORCH_CHECK(
+      cache.scalar_type() == at::ScalarType::Char ||
+          cache.scalar_type() == at::ScalarType::Byte,
+      "quantized K/V should be int8, or int4 packed in uint8");
+  TORCH_CHECK(cache.dim() == 4);
+  TORCH_CHECK(
+      scale.scalar_type() == at::ScalarType::Float,
+      "the scales of the quantized K/V should be float32");
+  TORCH_CHECK(scale.dim() == 4);
+  TORCH_CHECK(scale.sizes().slice(0, 3) == cache.sizes().slice(0, 3));
+  TORCH_CHECK(
+      scale.size(3) > 0 && kv_cache_num_channels(cache) % scale.size(3) == 0,
+      "the number of channels should be a multiple of the number of groups");
+  return cache.scalar_type() == at::ScalarType::Byte ? 4 : 8;
+}
+
+inline at::Tensor dequantize_kv_cache(
+    const at::Tensor& cache,
+    const at::Tensor& scale,
+    at::ScalarType dtype) {
+  at::Tensor x;
+  if (cache.scalar_type() == at::ScalarType::Byte) {
+    auto low = at::bitwise_and(cache, 15);
+    auto high = at::bitwise_right_shift(cache, 4);
+    x = at::stack({low, high}, -1).flatten(-2).to(at::kFloat) - 8;
+  } else {
+    x = cache.to(at::kFloat);
+  }
+  int64_t G = scale.size(-1);
+  x = x.unflatten(-1, {G, x.size(-1) / G}) * scale.unsqueeze(-1);
+  return x.flatten(-2).to(dtype);
+}
+
+} // namespace
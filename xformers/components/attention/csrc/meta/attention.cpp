@@ -0,0 +1,349 @@
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include "../kv_cache_quantization.h"
+
+// Shape-only kernels of the attention ops for the Meta dispatch key, so that
+// they can be traced with FakeTensors (eg by `torch.compile`) without a graph
+// break. They check the shapes that the outputs depend on, and don't read
+// any data: the outputs have the shapes, dtypes and strides of the outputs of
+// the CUDA kernels
+namespace {
+
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t>
+efficient_attention_forward_cutlass_meta(
+    const at::Tensor& query, // [b, seqlen, num_heads, K]
+    const at::Tensor& key, // [b, seqlen, num_kv_heads, K]
+    const at::Tensor& value, // [b, seqlen, num_kv_heads, Kv]
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    const c10::optional<int64_t> max_seqlen_q_,
+    bool compute_logsumexp,
+    bool causal,
+    const c10::optional<at::Tensor>& block_tables,
+    const c10::optional<at::Tensor>& seqlens_k,
+    const c10::optional<int64_t> num_splits_key,
+    const c10::optional<at::Tensor>& attn_bias,
+    double dropout_p,
+    const c10::optional<int64_t> window_size,
+    const c10::optional<at::Tensor>& out,
+    const c10::optional<at::Tensor>& output_accum,
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    const c10::optional<double> scale,
+    double softcap,
+    const c10::optional<at::Tensor>& tree_mask,
+    bool l2_persist_kv,
+    const c10::optional<at::Tensor>& q_scale,
+    const c10::optional<at::Tensor>& k_scale,
+    const c10::optional<at::Tensor>& v_scale) {
+  TORCH_CHECK(query.dim() == 4);
+  TORCH_CHECK(key.dim() == 4);
+  TORCH_CHECK(value.dim() == 4);
+  TORCH_CHECK(key.size(2) == value.size(2));
+  TORCH_CHECK(query.size(2) % key.size(2) == 0);
+  const bool quantized_kv = v_scale.has_value();
+  TORCH_CHECK(
+      query.size(3) ==
+      (quantized_kv ? kv_cache_num_channels(key) : key.size(3)));
+  TORCH_CHECK(cu_seqlens_q.has_value() == cu_seqlens_k.has_value());
+
+  int64_t B = query.size(0);
+  int64_t M = query.size(1);
+  int64_t num_heads = query.size(2);
+  int64_t Kv = quantized_kv ? kv_cache_num_channels(value) : value.size(3);
+
+  // Same as `efficient_attention_forward_cutlass`
+  int64_t max_seqlen_q = M;
+  if (cu_seqlens_q.has_value()) {
+    // The CUDA op computes it from `cu_seqlens_q`, which sizes the logsumexp
+    TORCH_CHECK(
+        max_seqlen_q_.has_value(),
+        "max_seqlen_q is required with cu_seqlens_q on the meta device");
+    TORCH_CHECK(*max_seqlen_q_ >= 0);
+    max_seqlen_q = std::min(*max_seqlen_q_, max_seqlen_q);
+  }
+
+  // With int8 query/key (`q_scale`), the output has the dtype of the value,
+  // and with a quantized KV-cache (`v_scale`) the dtype of the query
+  const at::TensorOptions options =
+      quantized_kv ? query.options() : value.options();
+  at::Tensor res;
+  if (out.has_value()) {
+    TORCH_CHECK(out->dtype() == options.dtype());
+    TORCH_CHECK(out->sizes() == at::IntArrayRef({B, M, num_heads, Kv}));
+    res = *out;
+  } else {
+    res = at::empty({B, M, num_heads, Kv}, options);
+  }
+
+  // Padded to `kAlignLSE` (the block size of the backward) for all kernels,
+  // with one row per sequence in Mode 1MHK
+  constexpr int64_t kAlignLSE = 32;
+  const int64_t lse_dim =
+      (max_seqlen_q + kAlignLSE - 1) / kAlignLSE * kAlignLSE;
+  at::Tensor logsumexp = at::empty(
+      {cu_seqlens_q.has_value() ? cu_seqlens_q->size(0) - 1 : B,
+       num_heads,
+       compute_logsumexp ? lse_dim : 0},
+      query.options().dtype(at::ScalarType::Float));
+  return std::make_tuple(res, logsumexp, int64_t(0), int64_t(0));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+efficient_attention_backward_cutlass_meta(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& logsumexp,
+    const at::Tensor& out,
+    bool causal,
+    const c10::optional<at::Tensor>& attn_bias,
+    double dropout_p,
+    int64_t rng_seed,
+    int64_t rng_offset,
+    const c10::optional<int64_t> window_size,
+    const c10::optional<at::Tensor>& cu_seqlens_q,
+    const c10::optional<at::Tensor>& cu_seqlens_k,
+    const c10::optional<int64_t> max_seqlen_q,
+    const c10::optional<at::Tensor>& rope_cos,
+    const c10::optional<at::Tensor>& rope_sin,
+    const c10::optional<at::Tensor>& rope_positions_q,
+    const c10::optional<at::Tensor>& rope_positions_k,
+    const c10::optional<at::Tensor>& alibi_slopes,
+    const c10::optional<at::Tensor>& rel_pos_bias,
+    const c10::optional<int64_t> num_splits_query,
+    bool deterministic,
+    const c10::optional<at::Tensor>& block_mask,
+    int64_t block_mask_size,
+    const c10::optional<double> scale,
+    double softcap) {
+  TORCH_CHECK(query.dim() == 4);
+  TORCH_CHECK(key.dim() == 4);
+  TORCH_CHECK(value.dim() == 4);
+  TORCH_CHECK(grad_out.dim() == 4);
+
+  // Same layout as `efficient_attention_backward_cutlass`: the gradients of
+  // a packed qkv are packed as well
+  if (num_splits_query.value_or(1) == 1 && query.size(1) == key.size(1) &&
+      query.size(2) == key.size(2) && query.size(3) == value.size(3) &&
+      query.storage().is_alias_of(key.storage()) &&
+      query.storage().is_alias_of(value.storage())) {
+    at::Tensor chunk = at::empty(
+        {query.size(0), query.size(1), 3, query.size(2), query.size(3)},
+        query.options());
+    return std::make_tuple(
+        chunk.select(2, 0), chunk.select(2, 1), chunk.select(2, 2));
+  }
+  return std::make_tuple(
+      at::empty_like(query), at::empty_like(key), at::empty_like(value));
+}
+
+std::tuple<at::Tensor, at::Tensor, int64_t, int64_t> efficient_attention_meta(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    bool compute_logsumexp,
+    const c10::optional<at::Tensor>& attn_bias,
+    double p) {
+  TORCH_CHECK(query.dim() == 3);
+  TORCH_CHECK(key.dim() == 3);
+  TORCH_CHECK(value.dim() == 3);
+  at::Tensor res = at::empty(
+      {query.size(0), query.size(1), query.size(2)}, query.options());
+  at::Tensor logsumexp =
+      at::empty({query.size(0), query.size(1)}, query.options());
+  return std::make_tuple(res, logsumexp, int64_t(0), int64_t(0));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+efficient_attention_backward_meta(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& logsumexp,
+    const at::Tensor& out,
+    const c10::optional<at::Tensor>& attn_bias,
+    double p,
+    int64_t rng_seed,
+    int64_t rng_offset) {
+  return std::make_tuple(
+      at::empty_like(query), at::empty_like(key), at::empty_like(value));
+}
+
+at::Tensor _temp_dropout_meta(const at::Tensor& out, double p) {
+  // In place
+  return out;
+}
+
+std::tuple<at::Tensor, at::Tensor> merge_attentions_meta(
+    at::TensorList outs,
+    at::TensorList lses) {
+  TORCH_CHECK(!outs.empty() && outs.size() == lses.size());
+  TORCH_CHECK(outs[0].dim() == 4);
+  int64_t B = outs[0].size(0);
+  int64_t M = outs[0].size(1);
+  int64_t H = outs[0].size(2);
+  int64_t Kv = outs[0].size(3);
+  return std::make_tuple(
+      at::empty({B, M, H, Kv}, outs[0].options()),
+      at::empty({B, H, M}, outs[0].options().dtype(at::ScalarType::Float)));
+}
+
+std::tuple<std::vector<at::Tensor>, std::vector<at::Tensor>>
+merge_attentions_backward_meta(
+    const at::Tensor& grad_out,
+    const c10::optional<at::Tensor>& grad_lse,
+    const at::Tensor& lse,
+    at::TensorList outs,
+    at::TensorList lses) {
+  TORCH_CHECK(outs.size() == lses.size());
+  std::vector<at::Tensor> grad_outs;
+  std::vector<at::Tensor> grad_lses;
+  for (size_t i = 0; i < outs.size(); ++i) {
+    grad_outs.push_back(at::empty_strided(
+        outs[i].sizes(), outs[i].strides(), outs[i].options()));
+    grad_lses.push_back(at::empty_strided(
+        lses[i].sizes(), lses[i].strides(), lses[i].options()));
+  }
+  return std::make_tuple(grad_outs, grad_lses);
+}
+
+at::Tensor attention_key_scores_meta(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& logsumexp,
+    bool causal,
+    const c10::optional<int64_t> window_size,
+    const c10::optional<double> scale,
+    double softcap) {
+  TORCH_CHECK(query.dim() == 4 && key.dim() == 4);
+  return at::empty(
+      {query.size(0), query.size(2), key.size(1)},
+      query.options().dtype(at::ScalarType::Float));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor> qk_norm_meta(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const c10::optional<at::Tensor>& q_weight,
+    const c10::optional<at::Tensor>& k_weight,
+    bool rms_norm,
+    double eps) {
+  TORCH_CHECK(query.dim() == 4 && key.dim() == 4);
+  int64_t rows = query.numel() / query.size(3) + key.numel() / key.size(3);
+  auto stats_options = query.options().dtype(at::ScalarType::Float);
+  return std::make_tuple(
+      at::empty(query.sizes(), query.options()),
+      at::empty(key.sizes(), key.options()),
+      at::empty({rows}, stats_options),
+      at::empty({rows}, stats_options));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+qk_norm_backward_meta(
+    const at::Tensor& grad_q,
+    const at::Tensor& grad_k,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& mean,
+    const at::Tensor& rstd,
+    const c10::optional<at::Tensor>& q_weight,
+    const c10::optional<at::Tensor>& k_weight,
+    bool rms_norm) {
+  at::Tensor grad_q_weight, grad_k_weight;
+  if (q_weight.has_value()) {
+    grad_q_weight = at::empty(q_weight->sizes(), q_weight->options());
+  }
+  if (k_weight.has_value()) {
+    grad_k_weight = at::empty(k_weight->sizes(), k_weight->options());
+  }
+  return std::make_tuple(
+      at::empty(query.sizes(), query.options()),
+      at::empty(key.sizes(), key.options()),
+      grad_q_weight,
+      grad_k_weight);
+}
+
+std::tuple<std::vector<at::Tensor>, at::Tensor, at::Tensor> unpad_inputs_meta(
+    at::TensorList inputs,
+    const at::Tensor& padding_mask) {
+  TORCH_CHECK(padding_mask.dim() == 2);
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+  // Sized for all the tokens, as the number of valid ones is data-dependent
+  std::vector<at::Tensor> outputs;
+  for (const at::Tensor& x : inputs) {
+    TORCH_CHECK(x.dim() >= 2 && x.size(0) == B && x.size(1) == M);
+    std::vector<int64_t> shape = x.sizes().vec();
+    shape[0] = 1;
+    shape[1] = B * M;
+    outputs.push_back(at::empty(shape, x.options()));
+  }
+  auto int_options = padding_mask.options().dtype(at::ScalarType::Int);
+  return std::make_tuple(
+      outputs, at::empty({B + 1}, int_options), at::empty({1}, int_options));
+}
+
+at::Tensor pad_output_meta(
+    const at::Tensor& x,
+    const at::Tensor& padding_mask,
+    const at::Tensor& cu_seqlens) {
+  TORCH_CHECK(padding_mask.dim() == 2);
+  int64_t B = padding_mask.size(0);
+  int64_t M = padding_mask.size(1);
+  TORCH_CHECK(x.dim() >= 2 && x.size(0) == 1 && x.size(1) == B * M);
+  std::vector<int64_t> shape = x.sizes().vec();
+  shape[0] = B;
+  shape[1] = M;
+  return at::empty(shape, x.options());
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, Meta, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_forward_cutlass"),
+      TORCH_FN(efficient_attention_forward_cutlass_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_backward_cutlass"),
+      TORCH_FN(efficient_attention_backward_cutlass_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention"),
+      TORCH_FN(efficient_attention_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::efficient_attention_backward"),
+      TORCH_FN(efficient_attention_backward_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::_temp_dropout"),
+      TORCH_FN(_temp_dropout_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::merge_attentions"),
+      TORCH_FN(merge_attentions_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::merge_attentions_backward"),
+      TORCH_FN(merge_attentions_backward_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::attention_key_scores"),
+      TORCH_FN(attention_key_scores_meta));
+  m.impl(TORCH_SELECTIVE_NAME("xformers::qk_norm"), TORCH_FN(qk_norm_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::qk_norm_backward"),
+      TORCH_FN(qk_norm_backward_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::unpad_inputs"),
+      TORCH_FN(unpad_inputs_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::pad_output"), TORCH_FN(pad_output_meta));
+}
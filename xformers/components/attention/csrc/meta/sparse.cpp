@@ -0,0 +1,219 @@
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <tuple>
+
+#include "../batched_pattern.h"
+#include "../spmm_activation.h"
+
+// Shape-only kernels of the sputnik ops for the Meta dispatch key (see
+// "attention.cpp"). The number of nonzeros is the size of `column_indices`,
+// so the shapes never depend on the content of the pattern
+namespace {
+
+at::Tensor sddmm_sputnik_meta(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(a.dim() == 3 && b.dim() == 3);
+  TORCH_CHECK(a.size(0) == b.size(0));
+  TORCH_CHECK(a.size(2) == b.size(2));
+  TORCH_CHECK(column_indices.dim() == 1);
+  // Per-batch patterns have a single row of values
+  int64_t batch =
+      is_batched_pattern(a.size(0), a.size(1), row_offsets) ? 1 : a.size(0);
+  return at::empty({batch, column_indices.size(0)}, a.options());
+}
+
+std::tuple<at::Tensor, at::Tensor> spmm_bias_act_sputnik_meta(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m,
+    const c10::optional<at::Tensor>& bias,
+    c10::string_view activation) {
+  TORCH_CHECK(b.dim() == 3);
+  SpmmActivation act = parse_spmm_activation(activation);
+  int64_t batch = b.size(0);
+  int64_t n = b.size(2);
+  // The pre-activation is only kept for the backward of gelu
+  int64_t preact_batch = act == SpmmActivation::kGelu ? batch : 0;
+  return std::make_tuple(
+      at::empty({batch, m, n}, b.options()),
+      at::empty({preact_batch, m, n}, b.options()));
+}
+
+at::Tensor spmm_sputnik_meta(
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    int64_t m) {
+  return std::get<0>(spmm_bias_act_sputnik_meta(
+      b,
+      row_indices,
+      values,
+      row_offsets,
+      column_indices,
+      m,
+      c10::nullopt,
+      "none"));
+}
+
+at::Tensor sparse_softmax_sputnik_meta(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(values.dim() == 2);
+  TORCH_CHECK(values.size(1) == column_indices.size(0));
+  return at::empty({values.size(0), column_indices.size(0)}, values.options());
+}
+
+at::Tensor sparse_softmax_backward_sputnik_meta(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_indices,
+    const at::Tensor& values,
+    const at::Tensor& gradient,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(values.dim() == 2);
+  TORCH_CHECK(values.sizes() == gradient.sizes());
+  return at::empty({values.size(0), column_indices.size(0)}, values.options());
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse_attention_sputnik_meta(
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    double scale) {
+  TORCH_CHECK(query.dim() == 3 && key.dim() == 3 && value.dim() == 3);
+  int64_t batch = query.size(0);
+  int64_t m = query.size(1);
+  return std::make_tuple(
+      at::empty({batch, m, value.size(2)}, query.options()),
+      at::empty({batch, m}, query.options().dtype(at::ScalarType::Float)));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+sparse_attention_backward_sputnik_meta(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& output,
+    const at::Tensor& logsumexp,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    double scale) {
+  return std::make_tuple(
+      at::empty_like(query), at::empty_like(key), at::empty_like(value));
+}
+
+std::tuple<at::Tensor, at::Tensor>
+sparse_softmax_attention_backward_sputnik_meta(
+    const at::Tensor& grad_out,
+    const at::Tensor& query,
+    const at::Tensor& key,
+    const at::Tensor& value,
+    const at::Tensor& attn,
+    const at::Tensor& attn_dropped,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices,
+    const at::Tensor& row_indices_t,
+    const at::Tensor& row_offsets_t,
+    const at::Tensor& column_indices_t,
+    const at::Tensor& perm) {
+  return std::make_tuple(
+      at::empty(query.sizes(), query.options()),
+      at::empty(key.sizes(), key.options()));
+}
+
+at::Tensor csr_row_swizzle_meta(const at::Tensor& row_offsets) {
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) >= 1);
+  return at::empty({row_offsets.size(0) - 1}, row_offsets.options());
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+csr_transpose_info_meta(
+    int64_t m,
+    int64_t n,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(row_offsets.dim() == 1);
+  TORCH_CHECK(column_indices.dim() == 1);
+  TORCH_CHECK(row_offsets.size(0) == m + 1);
+  int64_t nnz = column_indices.size(0);
+  auto options = column_indices.options();
+  return std::make_tuple(
+      at::empty({n}, options),
+      at::empty({n + 1}, options),
+      at::empty({nnz}, options),
+      at::empty({nnz}, options.dtype(at::ScalarType::Long)));
+}
+
+at::Tensor csr_sddmm_meta(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    const at::Tensor& row_indices,
+    const at::Tensor& row_offsets,
+    const at::Tensor& column_indices) {
+  TORCH_CHECK(a.dim() == 3 && b.dim() == 3);
+  return at::empty({a.size(0), column_indices.size(0)}, a.options());
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, Meta, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sddmm_sputnik"),
+      TORCH_FN(sddmm_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::spmm_sputnik"),
+      TORCH_FN(spmm_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::spmm_bias_act_sputnik"),
+      TORCH_FN(spmm_bias_act_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_sputnik"),
+      TORCH_FN(sparse_softmax_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_softmax_backward_sputnik"),
+      TORCH_FN(sparse_softmax_backward_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_sputnik"),
+      TORCH_FN(sparse_attention_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse_attention_backward_sputnik"),
+      TORCH_FN(sparse_attention_backward_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME(
+          "xformers::sparse_softmax_attention_backward_sputnik"),
+      TORCH_FN(sparse_softmax_attention_backward_sputnik_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_row_swizzle"),
+      TORCH_FN(csr_row_swizzle_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_transpose_info"),
+      TORCH_FN(csr_transpose_info_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::csr_sddmm"), TORCH_FN(csr_sddmm_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::coo_sddmm"), TORCH_FN(csr_sddmm_meta));
+}
@@ -0,0 +1,11 @@
+#include <ATen/ATen.h>
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_attention_sputnik(Tensor query, Tensor key, Tensor value, Tensor row_indices, Tensor row_offsets, Tensor column_indices, float scale) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_attention_backward_sputnik(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor output, Tensor logsumexp, Tensor row_indices, Tensor row_offsets, Tensor column_indices, Tensor row_indices_t, Tensor row_offsets_t, Tensor column_indices_t, float scale) -> (Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse_softmax_attention_backward_sputnik(Tensor grad_out, Tensor query, Tensor key, Tensor value, Tensor attn, Tensor attn_dropped, Tensor row_indices, Tensor row_offsets, Tensor column_indices, Tensor row_indices_t, Tensor row_offsets_t, Tensor column_indices_t, Tensor perm) -> (Tensor, Tensor)"));
+}
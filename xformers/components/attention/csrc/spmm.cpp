@@ -4,4 +4,6 @@
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::spmm_sputnik(Tensor b, Tensor row_indices, Tensor values, Tensor row_offsets, Tensor column_indices, int m) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::spmm_bias_act_sputnik(Tensor b, Tensor row_indices, Tensor values, Tensor row_offsets, Tensor column_indices, int m, Tensor? bias, str activation) -> (Tensor, Tensor)"));
 }
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <ATen/ATen.h>
+
+// Activations that `spmm_bias_act_sputnik` fuses with the product and the
+// bias, while the rows of the output are still in registers
+enum class SpmmActivation { kNone = 0, kRelu = 1, kGelu = 2 };
+
+inline SpmmActivation parse_spmm_activation(c10::string_view activation) {
+  if (activation == "none") {
+    return SpmmActivation::kNone;
+  }
+  if (activation == "relu") {
+    return SpmmActivation::kRelu;
+  }
+  TORCH_CHECK(
+      activation == "gelu",
+      "activation should be one of 'none', 'relu' and 'gelu'");
+  return SpmmActivation::kGelu;
+}
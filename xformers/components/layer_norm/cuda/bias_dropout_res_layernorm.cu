@@ -0,0 +1,663 @@
+#include <cstring>
+#include <type_traits>
+
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAGeneratorImpl.h>
+#include <ATen/cuda/CUDAGraphsUtils.cuh>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include "../../attention/csrc/cuda/mem_eff_attention/philox.h"
+
+namespace {
+/*
+Computes, for `x` [..., N] with the same CUDA kernel for both norm styles:
+
+def bias_dropout_res_layernorm(
+        x, bias, residual, weight, norm_bias, p, pre_norm, eps):
+    z = F.dropout(x + bias, p)
+    if pre_norm:
+        return F.layer_norm(z, [N], weight, norm_bias, eps) + residual
+    z = z + residual
+    return F.layer_norm(z, [N], weight, norm_bias, eps)
+
+Every warp computes whole rows, with 128-bit loads: a row stays in registers
+between its statistics and its normalization, so that x and residual are
+read once, and the output and `z` (saved for the backward) written once.
+The dropout mask is not stored: it is regenerated in the backward from the
+Philox seed/offset (counter-based, see `philox.h`), with one random number
+per element of `x` as in the attention kernels.
+
+The backward computes the gradients of x and residual with the same
+mapping, and the sums over the rows (gradients of weight, norm_bias and
+bias) in a second kernel, which reads the columns in slices of rows
+*/
+constexpr int kWarpSize = 32;
+constexpr int kWarpsPerBlock = 4;
+// The rows are kept in registers
+constexpr int64_t kMaxCols = 4096;
+
+template <typename scalar_t>
+struct alignas(16) Vec {
+  static constexpr int kSize = 16 / sizeof(scalar_t);
+  scalar_t v[kSize];
+};
+
+template <typename scalar_t>
+__device__ __forceinline__ void load_vec(
+    const scalar_t* ptr,
+    float (&out)[Vec<scalar_t>::kSize]) {
+  Vec<scalar_t> vec = *reinterpret_cast<const Vec<scalar_t>*>(ptr);
+#pragma unroll
+  for (int k = 0; k < Vec<scalar_t>::kSize; ++k) {
+    out[k] = float(vec.v[k]);
+  }
+}
+
+template <typename scalar_t>
+__device__ __forceinline__ void store_vec(
+    scalar_t* ptr,
+    const float (&in)[Vec<scalar_t>::kSize]) {
+  Vec<scalar_t> vec;
+#pragma unroll
+  for (int k = 0; k < Vec<scalar_t>::kSize; ++k) {
+    vec.v[k] = scalar_t(in[k]);
+  }
+  *reinterpret_cast<Vec<scalar_t>*>(ptr) = vec;
+}
+
+__device__ __forceinline__ float warp_sum(float v) {
+#pragma unroll
+  for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+    v += __shfl_xor_sync(0xffffffff, v, offset);
+  }
+  return v;
+}
+
+// Multiplies `v` (the elements [offset, offset + kSize) of the mask) by
+// the dropout mask, scaled. `offset` is a multiple of 4, so that every 4
+// elements are generated by a single Philox call
+template <int kSize>
+__device__ __forceinline__ void apply_dropout(
+    uint64_t seed,
+    uint64_t offset,
+    float p,
+    float scale,
+    float (&v)[kSize]) {
+  static_assert(kSize % 4 == 0, "");
+#pragma unroll
+  for (int k = 0; k < kSize; k += 4) {
+    float4 rand = philox_uniform4(seed, 0, offset + k);
+    v[k + 0] *= rand.x > p ? scale : 0.0f;
+    v[k + 1] *= rand.y > p ? scale : 0.0f;
+    v[k + 2] *= rand.z > p ? scale : 0.0f;
+    v[k + 3] *= rand.w > p ? scale : 0.0f;
+  }
+}
+
+template <typename scalar_t>
+struct FwParams {
+  // [rows, cols] (contiguous), the vectors are [cols] (can be null)
+  const scalar_t* x;
+  const scalar_t* bias;
+  const scalar_t* residual;
+  const scalar_t* weight;
+  const scalar_t* norm_bias;
+  scalar_t* out;
+  scalar_t* z;
+  float* mean; // [rows]
+  float* rstd; // [rows]
+  int64_t rows;
+  int32_t cols;
+  float dropout_p;
+  bool pre_norm;
+  float eps;
+  at::PhiloxCudaState philox_args;
+};
+
+template <typename scalar_t, int kVecsPerLane>
+__global__ void __launch_bounds__(kWarpsPerBlock* kWarpSize)
+    bias_dropout_res_layernorm_fw_kernel(FwParams<scalar_t> p) {
+  constexpr int kVec = Vec<scalar_t>::kSize;
+  const int lane = threadIdx.x % kWarpSize;
+  uint64_t seed = 0, offset = 0;
+  if (p.dropout_p > 0.0f) {
+    auto seeds = at::cuda::philox::unpack(p.philox_args);
+    seed = std::get<0>(seeds);
+    offset = std::get<1>(seeds);
+  }
+  const float dropout_scale = 1.0f / (1.0f - p.dropout_p);
+
+  for (int64_t row = blockIdx.x * kWarpsPerBlock + threadIdx.x / kWarpSize;
+       row < p.rows;
+       row += int64_t(gridDim.x) * kWarpsPerBlock) {
+    const int64_t row_start = row * p.cols;
+    float z[kVecsPerLane][kVec];
+    float sum = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.cols) {
+        continue;
+      }
+      load_vec(p.x + row_start + col, z[i]);
+      float tmp[kVec];
+      if (p.bias != nullptr) {
+        load_vec(p.bias + col, tmp);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          z[i][k] += tmp[k];
+        }
+      }
+      if (p.dropout_p > 0.0f) {
+        apply_dropout(
+            seed, offset + row_start + col, p.dropout_p, dropout_scale, z[i]);
+      }
+      if (!p.pre_norm) {
+        load_vec(p.residual + row_start + col, tmp);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          z[i][k] += tmp[k];
+        }
+      }
+      // The statistics are computed on the saved (rounded) `z`, which is
+      // what the backward sees
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        z[i][k] = float(scalar_t(z[i][k]));
+        sum += z[i][k];
+      }
+      store_vec(p.z + row_start + col, z[i]);
+    }
+    const float mean = warp_sum(sum) / p.cols;
+    float var = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col < p.cols) {
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          float d = z[i][k] - mean;
+          var += d * d;
+        }
+      }
+    }
+    const float rstd = rsqrtf(warp_sum(var) / p.cols + p.eps);
+    if (lane == 0) {
+      p.mean[row] = mean;
+      p.rstd[row] = rstd;
+    }
+
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.cols) {
+        continue;
+      }
+      float y[kVec];
+      float tmp[kVec];
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        y[k] = (z[i][k] - mean) * rstd;
+      }
+      if (p.weight != nullptr) {
+        load_vec(p.weight + col, tmp);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          y[k] *= tmp[k];
+        }
+      }
+      if (p.norm_bias != nullptr) {
+        load_vec(p.norm_bias + col, tmp);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          y[k] += tmp[k];
+        }
+      }
+      if (p.pre_norm) {
+        load_vec(p.residual + row_start + col, tmp);
+#pragma unroll
+        for (int k = 0; k < kVec; ++k) {
+          y[k] += tmp[k];
+        }
+      }
+      store_vec(p.out + row_start + col, y);
+    }
+  }
+}
+
+template <typename scalar_t>
+struct BwParams {
+  // [rows, cols] (contiguous), the vectors are [cols] (can be null)
+  const scalar_t* grad_out;
+  const scalar_t* z;
+  const float* mean;
+  const float* rstd;
+  const scalar_t* weight;
+  scalar_t* grad_x;
+  // Null with `pre_norm`: it is `grad_out`
+  scalar_t* grad_residual;
+  int64_t rows;
+  int32_t cols;
+  float dropout_p;
+  bool pre_norm;
+  at::PhiloxCudaState philox_args;
+};
+
+template <typename scalar_t, int kVecsPerLane>
+__global__ void __launch_bounds__(kWarpsPerBlock* kWarpSize)
+    bias_dropout_res_layernorm_bw_kernel(BwParams<scalar_t> p) {
+  constexpr int kVec = Vec<scalar_t>::kSize;
+  const int lane = threadIdx.x % kWarpSize;
+  uint64_t seed = 0, offset = 0;
+  if (p.dropout_p > 0.0f) {
+    auto seeds = at::cuda::philox::unpack(p.philox_args);
+    seed = std::get<0>(seeds);
+    offset = std::get<1>(seeds);
+  }
+  const float dropout_scale = 1.0f / (1.0f - p.dropout_p);
+
+  for (int64_t row = blockIdx.x * kWarpsPerBlock + threadIdx.x / kWarpSize;
+       row < p.rows;
+       row += int64_t(gridDim.x) * kWarpsPerBlock) {
+    const int64_t row_start = row * p.cols;
+    const float mean = p.mean[row];
+    const float rstd = p.rstd[row];
+    // The gradient of the normalized `z`, and the normalized `z`
+    float dy[kVecsPerLane][kVec];
+    float xhat[kVecsPerLane][kVec];
+    float sum_dy = 0.0f;
+    float sum_dy_xhat = 0.0f;
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.cols) {
+        continue;
+      }
+      load_vec(p.grad_out + row_start + col, dy[i]);
+      load_vec(p.z + row_start + col, xhat[i]);
+      float w[kVec];
+      if (p.weight != nullptr) {
+        load_vec(p.weight + col, w);
+      }
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        xhat[i][k] = (xhat[i][k] - mean) * rstd;
+        if (p.weight != nullptr) {
+          dy[i][k] *= w[k];
+        }
+        sum_dy += dy[i][k];
+        sum_dy_xhat += dy[i][k] * xhat[i][k];
+      }
+    }
+    const float mean_dy = warp_sum(sum_dy) / p.cols;
+    const float mean_dy_xhat = warp_sum(sum_dy_xhat) / p.cols;
+
+#pragma unroll
+    for (int i = 0; i < kVecsPerLane; ++i) {
+      const int col = (i * kWarpSize + lane) * kVec;
+      if (col >= p.cols) {
+        continue;
+      }
+      float dz[kVec];
+#pragma unroll
+      for (int k = 0; k < kVec; ++k) {
+        dz[k] = rstd * (dy[i][k] - mean_dy - xhat[i][k] * mean_dy_xhat);
+      }
+      if (!p.pre_norm) {
+        store_vec(p.grad_residual + row_start + col, dz);
+      }
+      if (p.dropout_p > 0.0f) {
+        apply_dropout(
+            seed, offset + row_start + col, p.dropout_p, dropout_scale, dz);
+      }
+      store_vec(p.grad_x + row_start + col, dz);
+    }
+  }
+}
+
+constexpr int kColumnsPerBlock = 32;
+constexpr int kRowsPerIteration = 8;
+
+// Partial sums of `grad_out * xhat` (gradient of the weight), `grad_out` (of
+// the norm bias) and `grad_x` (of the bias) over the slice of rows
+// `blockIdx.y`, written to `partial` [3, gridDim.y, cols]
+template <typename scalar_t>
+__global__ void __launch_bounds__(kColumnsPerBlock* kRowsPerIteration)
+    bias_dropout_res_layernorm_bw_columns_kernel(
+        BwParams<scalar_t> p,
+        bool weight_grads,
+        bool bias_grad,
+        int64_t rows_per_split,
+        float* partial) {
+  __shared__ float sums[3][kRowsPerIteration][kColumnsPerBlock + 1];
+  const int64_t col = int64_t(blockIdx.x) * kColumnsPerBlock + threadIdx.x;
+  int64_t row_end = int64_t(blockIdx.y + 1) * rows_per_split;
+  row_end = row_end < p.rows ? row_end : p.rows;
+  float sum_weight = 0.0f;
+  float sum_norm_bias = 0.0f;
+  float sum_bias = 0.0f;
+  if (col < p.cols) {
+    for (int64_t row = blockIdx.y * rows_per_split + threadIdx.y;
+         row < row_end;
+         row += kRowsPerIteration) {
+      const int64_t idx = row * p.cols + col;
+      if (weight_grads) {
+        float g = float(p.grad_out[idx]);
+        float xhat = (float(p.z[idx]) - p.mean[row]) * p.rstd[row];
+        sum_weight += g * xhat;
+        sum_norm_bias += g;
+      }
+      if (bias_grad) {
+        sum_bias += float(p.grad_x[idx]);
+      }
+    }
+  }
+  sums[0][threadIdx.y][threadIdx.x] = sum_weight;
+  sums[1][threadIdx.y][threadIdx.x] = sum_norm_bias;
+  sums[2][threadIdx.y][threadIdx.x] = sum_bias;
+  __syncthreads();
+  if (threadIdx.y < 3 && col < p.cols) {
+    float total = 0.0f;
+#pragma unroll
+    for (int r = 0; r < kRowsPerIteration; ++r) {
+      total += sums[threadIdx.y][r][threadIdx.x];
+    }
+    partial[(int64_t(threadIdx.y) * gridDim.y + blockIdx.y) * p.cols + col] =
+        total;
+  }
+}
+
+// Calls `fn` with the (power of 2) number of vectors of every lane for rows
+// of `cols` channels
+template <typename scalar_t, typename Fn>
+void dispatch_vecs_per_lane(int64_t cols, Fn&& fn) {
+  constexpr int64_t kColsPerVec = kWarpSize * Vec<scalar_t>::kSize;
+  int64_t vecs = (cols + kColsPerVec - 1) / kColsPerVec;
+  if (vecs <= 1) {
+    fn(std::integral_constant<int, 1>{});
+  } else if (vecs <= 2) {
+    fn(std::integral_constant<int, 2>{});
+  } else if (vecs <= 4) {
+    fn(std::integral_constant<int, 4>{});
+  } else if (vecs <= 8) {
+    fn(std::integral_constant<int, 8>{});
+  } else if (vecs <= 16) {
+    fn(std::integral_constant<int, 16>{});
+  } else {
+    static_assert(kMaxCols <= 32 * kWarpSize * 4, "");
+    fn(std::integral_constant<int, 32>{});
+  }
+}
+
+// Enough warps to fill the GPU, which then loop over the rows
+int64_t num_row_blocks(const at::Tensor& x, int64_t rows) {
+  int64_t num_sms =
+      at::cuda::getDeviceProperties(x.device().index())->multiProcessorCount;
+  int64_t blocks = (rows + kWarpsPerBlock - 1) / kWarpsPerBlock;
+  return std::max(std::min(blocks, 16 * num_sms), int64_t(1));
+}
+
+void check_vector(
+    const c10::optional<at::Tensor>& v,
+    const at::Tensor& x,
+    const char* name) {
+  if (v.has_value()) {
+    TORCH_CHECK(
+        v->dim() == 1 && v->size(0) == x.size(-1),
+        "bias_dropout_res_layernorm: ",
+        name,
+        " should be of shape [",
+        x.size(-1),
+        "]");
+    TORCH_CHECK(
+        v->scalar_type() == x.scalar_type(), name, " has the wrong dtype");
+    TORCH_CHECK(v->is_cuda(), name, " should be a CUDA tensor");
+  }
+}
+
+const void* vector_ptr(const c10::optional<at::Tensor>& v) {
+  return v.has_value() ? v->data_ptr() : nullptr;
+}
+
+void check_rows(const at::Tensor& x) {
+  TORCH_CHECK(x.is_cuda(), "bias_dropout_res_layernorm: expected CUDA tensors");
+  TORCH_CHECK(
+      x.scalar_type() == at::ScalarType::Float ||
+          x.scalar_type() == at::ScalarType::Half ||
+          x.scalar_type() == at::ScalarType::BFloat16,
+      "bias_dropout_res_layernorm: only fp32, half & bf16 are supported");
+  TORCH_CHECK(x.dim() >= 1);
+  const int64_t N = x.size(-1);
+  const int64_t alignment = 16 / x.element_size();
+  TORCH_CHECK(
+      N > 0 && N <= kMaxCols && N % alignment == 0,
+      "bias_dropout_res_layernorm: the last dimension should be a multiple of ",
+      alignment,
+      " and at most ",
+      kMaxCols,
+      " (got ",
+      N,
+      ")");
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, int64_t, int64_t>
+bias_dropout_res_layernorm(
+    const at::Tensor& x,
+    const c10::optional<at::Tensor>& bias,
+    const at::Tensor& residual,
+    const c10::optional<at::Tensor>& weight,
+    const c10::optional<at::Tensor>& norm_bias,
+    double dropout_p,
+    bool pre_norm,
+    double eps) {
+  check_rows(x);
+  TORCH_CHECK(residual.sizes() == x.sizes(), "residual has the wrong shape");
+  TORCH_CHECK(residual.scalar_type() == x.scalar_type());
+  check_vector(bias, x, "bias");
+  check_vector(weight, x, "weight");
+  check_vector(norm_bias, x, "norm_bias");
+  TORCH_CHECK(dropout_p >= 0.0 && dropout_p < 1.0);
+
+  at::cuda::CUDAGuard device_guard(x.device());
+  // The rows are read with 128-bit loads
+  const at::Tensor x_ = x.contiguous();
+  const at::Tensor residual_ = residual.contiguous();
+  const int64_t N = x.size(-1);
+  const int64_t rows = x.numel() / N;
+  at::Tensor out = at::empty_like(x_);
+  at::Tensor z = at::empty_like(x_);
+  at::Tensor mean = at::empty({rows}, x.options().dtype(at::kFloat));
+  at::Tensor rstd = at::empty({rows}, x.options().dtype(at::kFloat));
+
+  at::PhiloxCudaState rng_engine_inputs;
+  if (dropout_p > 0.0) {
+    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        c10::nullopt, at::cuda::detail::getDefaultCUDAGenerator());
+    // See Note [Acquire lock when using random generators]
+    std::lock_guard<std::mutex> lock(gen->mutex_);
+    rng_engine_inputs = gen->philox_cuda_state(rows * N);
+  }
+
+  if (rows > 0) {
+    AT_DISPATCH_FLOATING_TYPES_AND2(
+        at::ScalarType::Half,
+        at::ScalarType::BFloat16,
+        x.scalar_type(),
+        "bias_dropout_res_layernorm",
+        [&] {
+          FwParams<scalar_t> p;
+          p.x = x_.data_ptr<scalar_t>();
+          p.bias = (const scalar_t*)vector_ptr(bias);
+          p.residual = residual_.data_ptr<scalar_t>();
+          p.weight = (const scalar_t*)vector_ptr(weight);
+          p.norm_bias = (const scalar_t*)vector_ptr(norm_bias);
+          p.out = out.data_ptr<scalar_t>();
+          p.z = z.data_ptr<scalar_t>();
+          p.mean = mean.data_ptr<float>();
+          p.rstd = rstd.data_ptr<float>();
+          p.rows = rows;
+          p.cols = N;
+          p.dropout_p = dropout_p;
+          p.pre_norm = pre_norm;
+          p.eps = eps;
+          p.philox_args = rng_engine_inputs;
+          dispatch_vecs_per_lane<scalar_t>(N, [&](auto vecs_per_lane) {
+            bias_dropout_res_layernorm_fw_kernel<
+                scalar_t,
+                decltype(vecs_per_lane)::value>
+                <<<num_row_blocks(x, rows),
+                   kWarpsPerBlock * kWarpSize,
+                   0,
+                   at::cuda::getCurrentCUDAStream()>>>(p);
+          });
+          C10_CUDA_KERNEL_LAUNCH_CHECK();
+        });
+  }
+
+  // uint64_t -> int64_t bitwise casting as PyTorch don't support uint64_t
+  int64_t seed = 0, offset = 0;
+  if (dropout_p > 0.0) {
+    std::memcpy(&seed, &rng_engine_inputs.seed_, sizeof(seed));
+    std::memcpy(&offset, &rng_engine_inputs.offset_.val, sizeof(offset));
+  }
+  return std::make_tuple(out, z, mean, rstd, seed, offset);
+}
+
+// Returns the gradients of (x, bias, residual, weight, norm_bias) - those of
+// bias, weight and norm_bias are undefined when they are not used, and the
+// gradient of residual with `pre_norm` (it is `grad_out`)
+std::tuple<at::Tensor, at::Tensor, at::Tensor, at::Tensor, at::Tensor>
+bias_dropout_res_layernorm_backward(
+    const at::Tensor& grad_out,
+    const at::Tensor& z,
+    const at::Tensor& mean,
+    const at::Tensor& rstd,
+    const c10::optional<at::Tensor>& weight,
+    bool has_bias,
+    bool has_norm_bias,
+    double dropout_p,
+    bool pre_norm,
+    int64_t rng_seed,
+    int64_t rng_offset) {
+  check_rows(z);
+  TORCH_CHECK(z.is_contiguous());
+  TORCH_CHECK(grad_out.sizes() == z.sizes());
+  TORCH_CHECK(grad_out.scalar_type() == z.scalar_type());
+  check_vector(weight, z, "weight");
+  const int64_t N = z.size(-1);
+  const int64_t rows = z.numel() / N;
+  TORCH_CHECK(mean.numel() == rows && rstd.numel() == rows);
+  TORCH_CHECK(
+      mean.scalar_type() == at::kFloat && rstd.scalar_type() == at::kFloat);
+
+  at::cuda::CUDAGuard device_guard(z.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  const at::Tensor grad_out_ = grad_out.contiguous();
+  at::Tensor grad_x = at::empty_like(z);
+  at::Tensor grad_residual;
+  if (!pre_norm) {
+    grad_residual = at::empty_like(z);
+  }
+  at::Tensor grad_bias, grad_weight, grad_norm_bias;
+  const bool weight_grads = weight.has_value() || has_norm_bias;
+
+  at::PhiloxCudaState rng_engine_inputs;
+  if (dropout_p > 0.0) {
+    uint64_t seed, offset;
+    std::memcpy(&seed, &rng_seed, sizeof(seed));
+    std::memcpy(&offset, &rng_offset, sizeof(offset));
+    rng_engine_inputs = at::PhiloxCudaState(seed, offset);
+  }
+
+  AT_DISPATCH_FLOATING_TYPES_AND2(
+      at::ScalarType::Half,
+      at::ScalarType::BFloat16,
+      z.scalar_type(),
+      "bias_dropout_res_layernorm_backward",
+      [&] {
+        BwParams<scalar_t> p;
+        p.grad_out = grad_out_.data_ptr<scalar_t>();
+        p.z = z.data_ptr<scalar_t>();
+        p.mean = mean.data_ptr<float>();
+        p.rstd = rstd.data_ptr<float>();
+        p.weight = (const scalar_t*)vector_ptr(weight);
+        p.grad_x = grad_x.data_ptr<scalar_t>();
+        p.grad_residual =
+            pre_norm ? nullptr : grad_residual.data_ptr<scalar_t>();
+        p.rows = rows;
+        p.cols = N;
+        p.dropout_p = dropout_p;
+        p.pre_norm = pre_norm;
+        p.philox_args = rng_engine_inputs;
+        if (rows > 0) {
+          dispatch_vecs_per_lane<scalar_t>(N, [&](auto vecs_per_lane) {
+            bias_dropout_res_layernorm_bw_kernel<
+                scalar_t,
+                decltype(vecs_per_lane)::value>
+                <<<num_row_blocks(z, rows),
+                   kWarpsPerBlock * kWarpSize,
+                   0,
+                   stream>>>(p);
+          });
+          C10_CUDA_KERNEL_LAUNCH_CHECK();
+        }
+        if (!weight_grads && !has_bias) {
+          return;
+        }
+
+        // Slices of rows so that there are a few blocks per SM
+        const int64_t column_blocks =
+            (N + kColumnsPerBlock - 1) / kColumnsPerBlock;
+        const int64_t num_sms =
+            at::cuda::getDeviceProperties(z.device().index())
+                ->multiProcessorCount;
+        int64_t splits = std::max(
+            std::min(
+                (rows + 16 * kRowsPerIteration - 1) /
+                    (16 * kRowsPerIteration),
+                (4 * num_sms + column_blocks - 1) / column_blocks),
+            int64_t(1));
+        TORCH_CHECK(splits <= 65535);
+        const int64_t rows_per_split = (rows + splits - 1) / splits;
+        at::Tensor partial =
+            at::zeros({3, splits, N}, z.options().dtype(at::kFloat));
+        if (rows > 0) {
+          bias_dropout_res_layernorm_bw_columns_kernel<scalar_t>
+              <<<dim3(column_blocks, splits),
+                 dim3(kColumnsPerBlock, kRowsPerIteration),
+                 0,
+                 stream>>>(
+                  p,
+                  weight_grads,
+                  has_bias,
+                  rows_per_split,
+                  partial.data_ptr<float>());
+          C10_CUDA_KERNEL_LAUNCH_CHECK();
+        }
+        at::Tensor sums = partial.sum(1).to(z.scalar_type());
+        if (weight.has_value()) {
+          grad_weight = sums[0];
+        }
+        if (has_norm_bias) {
+          grad_norm_bias = sums[1];
+        }
+        if (has_bias) {
+          grad_bias = sums[2];
+        }
+      });
+  return std::make_tuple(
+      grad_x, grad_bias, grad_residual, grad_weight, grad_norm_bias);
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::bias_dropout_res_layernorm"),
+      TORCH_FN(bias_dropout_res_layernorm));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::bias_dropout_res_layernorm_backward"),
+      TORCH_FN(bias_dropout_res_layernorm_backward));
+}
@@ -0,0 +1,8 @@
+#include <torch/types.h>
+
+TORCH_LIBRARY_FRAGMENT(xformers, m) {
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bias_dropout_res_layernorm(Tensor x, Tensor? bias, Tensor residual, Tensor? weight, Tensor? norm_bias, float p, bool pre_norm, float eps) -> (Tensor, Tensor, Tensor, Tensor, int, int)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::bias_dropout_res_layernorm_backward(Tensor grad_out, Tensor z, Tensor mean, Tensor rstd, Tensor? weight, bool has_bias, bool has_norm_bias, float p, bool pre_norm, int rng_seed, int rng_offset) -> (Tensor, Tensor, Tensor, Tensor, Tensor)"));
+}
@@ -11,6 +11,10 @@ import torch.nn as nn
 from functorch.compile import memory_efficient_fusion
 
 from xformers.components import ResidualNormStyle
+from xformers.ops import (
+    bias_dropout_res_layernorm,
+    is_fused_bias_dropout_res_layernorm_supported,
+)
 
 
 def _fn(
@@ -75,6 +79,24 @@ class NVFusedBiasDropoutResLayerNorm(torch.nn.Module):
         if not x.is_cuda:
             return _fn(x, self.bias, p, self.layer_norm_style, self.norm, residual)
 
+        # C++/CUDA fused kernel, when xFormers was built with it
+        if self.layer_norm_style in [
+            ResidualNormStyle.Pre,
+            ResidualNormStyle.Post,
+        ] and is_fused_bias_dropout_res_layernorm_supported(
+            x, residual, self.bias, self.norm.weight, self.norm.bias
+        ):
+            return bias_dropout_res_layernorm(
+                x,
+                residual,
+                self.bias,
+                self.norm.weight,
+                self.norm.bias,
+                p,
+                pre_norm=self.layer_norm_style == ResidualNormStyle.Pre,
+                eps=self.norm.eps,
+            )
+
         # AOTAutograd, NVFuser backed path
         aot_fn = memory_efficient_fusion(fn=_fn, static_argnums=(2, 3, 4))
         return aot_fn(x, self.bias, p, self.layer_norm_style, self.norm, residual)
@@ -0,0 +1,190 @@
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include <algorithm>
+
+#include <ATen/cpu/vec/vec.h>
+
+#include "../swiglu_utils.h"
+
+namespace {
+// Rows of x computed together when `x1` / `x2` are not kept: the
+// [kBlockRows, 2 * H] block of `x @ [w0; w1].T` is consumed by the silu * mul
+// while it is still in cache, so `x1` / `x2` are never written to memory
+constexpr int64_t kBlockRows = 64;
+
+// `w0` / `w1` [H, I] as a single [2 * H, I] matrix, for a single gemm:
+// in place when they are the two halves of a packed `w1w2`
+at::Tensor concat_weights(const at::Tensor& w0, const at::Tensor& w1) {
+  if (w0.is_contiguous() && w1.is_contiguous() &&
+      w0.storage().is_alias_of(w1.storage()) &&
+      w1.storage_offset() == w0.storage_offset() + w0.numel()) {
+    return w0.as_strided({2 * w0.size(0), w0.size(1)}, {w0.size(1), 1});
+  }
+  return at::cat({w0, w1});
+}
+
+at::Tensor concat_biases(
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const c10::optional<at::Tensor>& b1) {
+  if (!b0.has_value() && !b1.has_value()) {
+    return at::Tensor();
+  }
+  return at::cat(
+      {b0.has_value() ? *b0 : at::zeros({w0.size(0)}, w0.options()),
+       b1.has_value() ? *b1 : at::zeros({w0.size(0)}, w0.options())});
+}
+
+// x4[r] = silu(x1x2[r, :H]) * x1x2[r, H:]
+template <typename scalar_t>
+void silu_mul_rows(
+    const scalar_t* x1x2,
+    int64_t x1x2_stride,
+    scalar_t* x4,
+    int64_t x4_stride,
+    int64_t num_rows,
+    int64_t H) {
+  using Vec = at::vec::Vectorized<scalar_t>;
+  at::parallel_for(0, num_rows, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t r = begin; r < end; ++r) {
+      const scalar_t* x1 = x1x2 + r * x1x2_stride;
+      const scalar_t* x2 = x1 + H;
+      scalar_t* out = x4 + r * x4_stride;
+      int64_t h = 0;
+      for (; h + Vec::size() <= H; h += Vec::size()) {
+        Vec a = Vec::loadu(x1 + h);
+        Vec b = Vec::loadu(x2 + h);
+        (a / (Vec(scalar_t(1)) + a.neg().exp()) * b).store(out + h);
+      }
+      for (; h < H; ++h) {
+        scalar_t a = x1[h];
+        out[h] = a / (scalar_t(1) + std::exp(-a)) * x2[h];
+      }
+    }
+  });
+}
+
+// Reduced-precision inputs: the epilogue runs in float
+template <>
+void silu_mul_rows<at::BFloat16>(
+    const at::BFloat16* x1x2,
+    int64_t x1x2_stride,
+    at::BFloat16* x4,
+    int64_t x4_stride,
+    int64_t num_rows,
+    int64_t H) {
+  at::parallel_for(0, num_rows, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t r = begin; r < end; ++r) {
+      const at::BFloat16* x1 = x1x2 + r * x1x2_stride;
+      const at::BFloat16* x2 = x1 + H;
+      at::BFloat16* out = x4 + r * x4_stride;
+      for (int64_t h = 0; h < H; ++h) {
+        float a = float(x1[h]);
+        out[h] = at::BFloat16(a / (1.0f + std::exp(-a)) * float(x2[h]));
+      }
+    }
+  });
+}
+
+template <bool kStoreD0D1>
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_cpu(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  TORCH_CHECK(x.dim() >= 1);
+  TORCH_CHECK(w0.dim() == 2);
+  TORCH_CHECK(w1.sizes() == w0.sizes());
+  TORCH_CHECK(x.size(-1) == w0.size(1));
+  TORCH_CHECK(w0.scalar_type() == x.scalar_type());
+  TORCH_CHECK(w1.scalar_type() == x.scalar_type());
+
+  at::Tensor x_2d = flatten_to_matrix(x);
+  int64_t B = x_2d.size(0);
+  int64_t H = w0.size(0);
+  at::Tensor w0w1_t = concat_weights(w0, w1).t();
+  at::Tensor b0b1 = concat_biases(w0, b0, b1);
+  auto gemm = [&](at::Tensor& out, const at::Tensor& rows) {
+    if (b0b1.defined()) {
+      at::addmm_out(out, b0b1, rows, w0w1_t);
+    } else {
+      at::mm_out(out, rows, w0w1_t);
+    }
+  };
+
+  at::Tensor d0, d1;
+  at::Tensor d2 = at::empty({B, H}, x.options());
+  AT_DISPATCH_FLOATING_TYPES_AND(
+      at::ScalarType::BFloat16,
+      x.scalar_type(),
+      "dual_gemm_silu_identity_mul_cpu",
+      [&] {
+        if (kStoreD0D1) {
+          // x1 / x2 are outputs anyway: a single gemm for all the rows
+          at::Tensor x1x2 = at::empty({B, 2 * H}, x.options());
+          gemm(x1x2, x_2d);
+          silu_mul_rows<scalar_t>(
+              x1x2.data_ptr<scalar_t>(),
+              2 * H,
+              d2.data_ptr<scalar_t>(),
+              H,
+              B,
+              H);
+          d0 = x1x2.narrow(1, 0, H);
+          d1 = x1x2.narrow(1, H, H);
+          return;
+        }
+        at::Tensor block =
+            at::empty({std::min(B, kBlockRows), 2 * H}, x.options());
+        for (int64_t row0 = 0; row0 < B; row0 += kBlockRows) {
+          int64_t num_rows = std::min(kBlockRows, B - row0);
+          at::Tensor block_rows = block.narrow(0, 0, num_rows);
+          gemm(block_rows, x_2d.narrow(0, row0, num_rows));
+          silu_mul_rows<scalar_t>(
+              block_rows.data_ptr<scalar_t>(),
+              2 * H,
+              d2.data_ptr<scalar_t>() + row0 * H,
+              H,
+              num_rows,
+              H);
+        }
+      });
+
+  auto out_shape = with_last_dim(x, H);
+  if (d0.defined()) {
+    d0 = d0.view(out_shape);
+    d1 = d1.view(out_shape);
+  }
+  return std::make_tuple(d0, d1, d2.view(out_shape));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  return dual_gemm_silu_identity_mul_cpu<true>(x, w0, b0, w1, b1);
+}
+
+at::Tensor dual_gemm_silu_identity_mul_no_grad(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  return std::get<2>(dual_gemm_silu_identity_mul_cpu<false>(x, w0, b0, w1, b1));
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul"),
+      TORCH_FN(dual_gemm_silu_identity_mul));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul_no_grad"),
+      TORCH_FN(dual_gemm_silu_identity_mul_no_grad));
+}
@@ -0,0 +1,37 @@
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <tuple>
+
+namespace {
+// out_mm = a @ b and out_sum = a.sum(1) (added to the outputs with
+// `accumulate`). On CPU, the gemm goes to BLAS and the reduction is a
+// separate pass over `a`
+std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    at::Tensor& out_mm,
+    at::Tensor& out_sum,
+    bool accumulate) {
+  TORCH_CHECK(a.dim() == 2);
+  TORCH_CHECK(b.dim() == 2);
+  TORCH_CHECK(out_mm.dim() == 2);
+  TORCH_CHECK(out_mm.size(0) == a.size(0));
+  TORCH_CHECK(out_mm.size(1) == b.size(1));
+  TORCH_CHECK(out_sum.dim() == 1);
+
+  if (accumulate) {
+    out_mm.addmm_(a, b);
+    out_sum.add_(a.sum(1));
+  } else {
+    at::mm_out(out_mm, a, b);
+    at::sum_out(out_sum, a, {1});
+  }
+  return std::make_tuple(out_mm, out_sum);
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_fused_operand_sum"),
+      TORCH_FN(gemm_fused_operand_sum));
+}
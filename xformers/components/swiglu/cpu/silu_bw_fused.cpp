@@ -0,0 +1,62 @@
+#include <ATen/ATen.h>
+#include <ATen/Dispatch.h>
+#include <ATen/native/TensorIterator.h>
+#include <ATen/native/cpu/Loops.h>
+#include <ATen/OpMathType.h>
+#include <torch/library.h>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+namespace {
+// Same as the CUDA kernel (see `cuda/silu_bw_fused.cu`)
+std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
+    const at::Tensor& x1,
+    const at::Tensor& x2,
+    const at::Tensor& dx4) {
+  TORCH_CHECK(x2.dim() >= 1);
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(dx4.sizes() == x2.sizes());
+
+  std::vector<int64_t> dx1dx2_shape = x2.sizes().vec();
+  dx1dx2_shape.insert(dx1dx2_shape.end() - 1, 2);
+  at::Tensor dx1dx2 = at::empty(dx1dx2_shape, x2.options());
+  at::Tensor dx1 = dx1dx2.select(-2, 0);
+  at::Tensor dx2 = dx1dx2.select(-2, 1);
+  at::Tensor x4 = at::empty(x2.sizes(), x2.options());
+  auto iter = at::TensorIteratorConfig()
+                  .add_output(dx1)
+                  .add_output(dx2)
+                  .add_output(x4)
+                  .add_input(x1)
+                  .add_input(x2)
+                  .add_input(dx4)
+                  .build();
+
+  AT_DISPATCH_FLOATING_TYPES_AND(
+      at::ScalarType::BFloat16, x2.scalar_type(), "silu_bw_fused_cpu", [&] {
+        using acc_t = at::opmath_type<scalar_t>;
+        at::native::cpu_kernel_multiple_outputs(
+            iter,
+            [](scalar_t x1_, scalar_t x2_, scalar_t dx4_)
+                -> std::tuple<scalar_t, scalar_t, scalar_t> {
+              acc_t sigm = acc_t(1) / (acc_t(1) + std::exp(-acc_t(x1_)));
+              acc_t x3_ = sigm * acc_t(x1_);
+              acc_t dx3_ = acc_t(dx4_) * acc_t(x2_);
+              acc_t dx2_ = acc_t(dx4_) * x3_;
+              acc_t dx1_ =
+                  dx3_ * sigm * (acc_t(1) + acc_t(x1_) * (acc_t(1) - sigm));
+              acc_t x4_ = x3_ * acc_t(x2_);
+              return std::tuple<scalar_t, scalar_t, scalar_t>(
+                  dx1_, dx2_, x4_);
+            });
+      });
+  return std::make_tuple(dx1dx2, x4);
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::silu_bw_fused"),
+      TORCH_FN(silu_bw_fused));
+}
@@ -5,17 +5,64 @@
 #include <c10/cuda/CUDAGuard.h>
 #include <torch/library.h>
 
+#include <type_traits>
+
 #include <43_dual_gemm/device/dual_gemm.h>
 #include <43_dual_gemm/thread/left_silu_and_mul.h>
 
+#include "../../attention/csrc/cuda/autotune.h"
+#include "../../attention/csrc/cuda/kernel_attributes.h"
+#include "../swiglu_utils.h"
+
 namespace {
-template <typename scalar_t>
+// Tiles for large batches (the `B` dimension is the `M` of the gemms)
+struct DualGemmConfigLarge {
+  using ThreadblockShape = cutlass::gemm::GemmShape<128, 64, 32>;
+  using WarpShape = cutlass::gemm::GemmShape<64, 32, 32>;
+  static constexpr int kStages = 3;
+  static constexpr bool kSplitKSerial = false;
+};
+
+// Tiles for decode-size batches: less padding along `B`, and more
+// threadblocks along `H`
+struct DualGemmConfigSmall {
+  using ThreadblockShape = cutlass::gemm::GemmShape<32, 64, 64>;
+  using WarpShape = cutlass::gemm::GemmShape<32, 32, 64>;
+  static constexpr int kStages = 4;
+  static constexpr bool kSplitKSerial = false;
+};
+
+// Same, with the `I` dimension split across threadblocks when there still
+// are too few tiles to fill the GPU
+struct DualGemmConfigSmallSplitK : DualGemmConfigSmall {
+  static constexpr bool kSplitKSerial = true;
+};
+
+// Same tiles with a shorter pipeline, for the Sm80 GPUs with less
+// shared-memory per SM than the A100 (see `use_small_smem_kernel`)
+template <typename Config>
+struct DualGemmConfigSmallSmem : Config {
+  static constexpr int kStages = 2;
+};
+
+// The config to fall back to when `Config` does not fit: itself when its
+// pipeline is already as short as it can be
+template <typename Config>
+using DualGemmConfigSmallSmemFallback = typename std::conditional<
+    (Config::kStages > 2),
+    DualGemmConfigSmallSmem<Config>,
+    Config>::type;
+
+// `kStoreD0D1=false` only writes `d2 = silu(d0) * d1`, for when `d0` and `d1`
+// are not needed for the backward. `d0` and `d1` are undefined then
+template <typename scalar_t, bool kStoreD0D1, typename Config>
 std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
     const at::Tensor& x,
     const at::Tensor& w0,
     const c10::optional<at::Tensor>& b0,
     const at::Tensor& w1,
-    const c10::optional<at::Tensor>& b1
+    const c10::optional<at::Tensor>& b1,
+    int split_k_slices
 ) {
   TORCH_CHECK(x.stride(-1) == 1);
   TORCH_CHECK(w0.stride(-1) == 1);
@@ -28,15 +75,16 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
   int64_t I = x.size(1);
   int64_t H = w0.size(0);
 
-  at::Tensor d0 = at::empty({B, H}, x.options());
-  at::Tensor d1 = at::empty({B, H}, x.options());
-  at::Tensor d2 = at::empty({B, H}, x.options());
+  // The serial split-k reduces d0 / d1 in global memory before computing
+  // d2, so they are needed (as scratch) even if not returned
+  constexpr bool kStoreD0 = kStoreD0D1 || Config::kSplitKSerial;
+  constexpr bool kStoreD1 = kStoreD0;
 
   // templati-ze the cutlass kernel
   cutlass::gemm::GemmCoord problem_size(B, H, I);
 
-  constexpr int kStages = 3;
-  constexpr bool kSplitKSerial = false;
+  constexpr int kStages = Config::kStages;
+  constexpr bool kSplitKSerial = Config::kSplitKSerial;
 
   using ElementOutput = scalar_t;
   using ElementAccumulator = float;
@@ -60,13 +108,10 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
   const ElementCompute alpha1 = ElementCompute(1);
   const ElementCompute beta1 = b1.has_value() ? ElementCompute(1) : ElementCompute(0);
 
-  using ThreadblockShape = cutlass::gemm::GemmShape<128, 64, 32>;
-  using WarpShape = cutlass::gemm::GemmShape<64, 32, 32>;
+  using ThreadblockShape = typename Config::ThreadblockShape;
+  using WarpShape = typename Config::WarpShape;
   using InstructionShape = cutlass::gemm::GemmShape<16, 8, 16>;
 
-  // Optionally, we might not need intermediate GEMM outputs
-  constexpr bool kStoreD0 = true;
-  constexpr bool kStoreD1 = true;
   using ArchTag = cutlass::arch::Sm80;
 
   using DualGemm = cutlass::gemm::device::DualGemm<
@@ -94,9 +139,22 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
   {
     cudaDeviceProp* p = at::cuda::getDeviceProperties(x.device().index());
     TORCH_CHECK(p->major * 10 + p->minor >= ArchTag::kMinComputeCapability, "Only A100+ GPUs are supported");
+    // The default number of stages might only fit a single threadblock per SM
+    if (Config::kStages > 2 &&
+        use_small_smem_kernel(*p, sizeof(typename DualGemm::DualGemmKernel::SharedStorage))) {
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigSmallSmemFallback<Config>>(
+          x, w0, b0, w1, b1, split_k_slices);
+    }
+  }
+
+  at::Tensor d0, d1;
+  if (kStoreD0) {
+    d0 = at::empty({B, H}, x.options());
+    d1 = at::empty({B, H}, x.options());
   }
+  at::Tensor d2 = at::empty({B, H}, x.options());
 
-  int split_k_slices = DualGemm::kSplitKSerial ? 2 : 1;
+  TORCH_CHECK(split_k_slices == 1 || DualGemm::kSplitKSerial);
   using RefA = typename cutlass::TensorRef<typename DualGemm::ElementA, typename DualGemm::LayoutA>;
   using RefB = typename cutlass::TensorRef<typename DualGemm::ElementB, typename DualGemm::LayoutB>;
   using RefC = typename cutlass::TensorRef<typename DualGemm::ElementC, typename DualGemm::LayoutC>;
@@ -107,15 +165,22 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
   if (b1.has_value()) {
     ref_b1 = RefC{(scalar_t*)b1->data_ptr(), typename DualGemm::LayoutC::Stride(0)};
   }
+  // The epilogue does not touch d0 / d1 when they are not stored
+  RefC ref_d0{nullptr, typename DualGemm::LayoutC::Stride(H)};
+  RefC ref_d1{nullptr, typename DualGemm::LayoutC::Stride(H)};
+  if (kStoreD0) {
+    ref_d0 = RefC{(scalar_t*)d0.data_ptr(), typename DualGemm::LayoutC::Stride(d0.stride(0))};
+    ref_d1 = RefC{(scalar_t*)d1.data_ptr(), typename DualGemm::LayoutC::Stride(d1.stride(0))};
+  }
   typename DualGemm::Arguments arguments{
     problem_size,
     RefA{(scalar_t*)x.data_ptr(), typename DualGemm::LayoutA::Stride(x.stride(0))},
     RefB{(scalar_t*)w0.data_ptr(), typename DualGemm::LayoutB::Stride(w0.stride(0))},
     ref_b0,
-    RefC{(scalar_t*)d0.data_ptr(), typename DualGemm::LayoutC::Stride(d0.stride(0))},
+    ref_d0,
     RefB{(scalar_t*)w1.data_ptr(), typename DualGemm::LayoutB::Stride(w1.stride(0))},
     ref_b1,
-    RefC{(scalar_t*)d1.data_ptr(), typename DualGemm::LayoutC::Stride(d1.stride(0))},
+    ref_d1,
     RefC{(scalar_t*)d2.data_ptr(), typename DualGemm::LayoutC::Stride(d2.stride(0))},
     typename DualGemm::EpilogueOutputOp0::Params{alpha0, beta0},
     typename DualGemm::EpilogueOutputOp1::Params{alpha1, beta1},
@@ -126,14 +191,123 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_(
   at::Tensor workspace = at::empty({int64_t(dual_gemm.get_workspace_size(arguments))}, x.options().dtype(at::ScalarType::Byte));
   cutlass::Status status = dual_gemm.can_implement(arguments);
   TORCH_CHECK(status == cutlass::Status::kSuccess, "not supported by this kernel");
-  status = dual_gemm.initialize(arguments, (uint8_t*)workspace.data_ptr());
+  status = dual_gemm.initialize(arguments, (uint8_t*)workspace.data_ptr(), stream);
   TORCH_CHECK(status == cutlass::Status::kSuccess, "kernel initialize failed");
   status = dual_gemm(stream);
   TORCH_CHECK(status == cutlass::Status::kSuccess, "kernel run failed");
+  if (!kStoreD0D1) {
+    return std::make_tuple(at::Tensor(), at::Tensor(), d2);
+  }
   return std::make_tuple(d0, d1, d2);
 }
 
-std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
+// The variants the autotuner picks from: a tile config and a split-k
+enum class DualGemmVariant {
+  kLarge = 0,
+  kSmall,
+  kSmallSplitK2,
+  kSmallSplitK4,
+  kSmallSplitK8,
+  kNumVariants
+};
+
+// Selection with `XFORMERS_SWIGLU_AUTOTUNE(_CACHE)`
+class DualGemmAutotuner {
+ public:
+  static KernelAutotuner& get() {
+    static KernelAutotuner autotuner(
+        "XFORMERS_SWIGLU_AUTOTUNE", "XFORMERS_SWIGLU_AUTOTUNE_CACHE");
+    return autotuner;
+  }
+};
+
+// Small batches get the small tiles, and split the `I` dimension until
+// there are about as many threadblocks as SMs - every slice still doing at
+// least 8 iterations of the mainloop
+DualGemmVariant dual_gemm_heuristic(int64_t B, int64_t H, int64_t I, int num_sms) {
+  using Small = DualGemmConfigSmall::ThreadblockShape;
+  if (B > 64) {
+    return DualGemmVariant::kLarge;
+  }
+  int64_t num_tiles = ((B + Small::kM - 1) / Small::kM) * ((H + Small::kN - 1) / Small::kN);
+  int64_t max_split_k = I / (8 * Small::kK);
+  if (2 * num_tiles > num_sms || max_split_k < 2) {
+    return DualGemmVariant::kSmall;
+  }
+  if (4 * num_tiles > num_sms || max_split_k < 4) {
+    return DualGemmVariant::kSmallSplitK2;
+  }
+  if (8 * num_tiles > num_sms || max_split_k < 8) {
+    return DualGemmVariant::kSmallSplitK4;
+  }
+  return DualGemmVariant::kSmallSplitK8;
+}
+
+template <typename scalar_t, bool kStoreD0D1>
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_variant(
+    DualGemmVariant variant,
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  switch (variant) {
+    case DualGemmVariant::kLarge:
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigLarge>(x, w0, b0, w1, b1, 1);
+    case DualGemmVariant::kSmall:
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigSmall>(x, w0, b0, w1, b1, 1);
+    case DualGemmVariant::kSmallSplitK2:
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigSmallSplitK>(x, w0, b0, w1, b1, 2);
+    case DualGemmVariant::kSmallSplitK4:
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigSmallSplitK>(x, w0, b0, w1, b1, 4);
+    default:
+      TORCH_CHECK(variant == DualGemmVariant::kSmallSplitK8);
+      return dual_gemm_silu_identity_mul_<scalar_t, kStoreD0D1, DualGemmConfigSmallSplitK>(x, w0, b0, w1, b1, 8);
+  }
+}
+
+template <typename scalar_t, bool kStoreD0D1>
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_select(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  int64_t B = x.size(0);
+  int64_t I = x.size(1);
+  int64_t H = w0.size(0);
+  cudaDeviceProp* p = at::cuda::getDeviceProperties(x.device().index());
+  DualGemmVariant variant = dual_gemm_heuristic(B, H, I, p->multiProcessorCount);
+
+  KernelAutotuner& autotuner = DualGemmAutotuner::get();
+  if (autotuner.enabled()) {
+    auto run = [&](int v) {
+      dual_gemm_silu_identity_mul_variant<scalar_t, kStoreD0D1>(
+        DualGemmVariant(v), x, w0, b0, w1, b1);
+    };
+    int selected = autotuner.select(
+      make_autotune_key(
+        "dual_gemm_silu_identity_mul",
+        p->major * 10 + p->minor,
+        x.scalar_type(),
+        kStoreD0D1,
+        autotune_bucket(B),
+        H,
+        I),
+      int(DualGemmVariant::kNumVariants),
+      int(variant),
+      run);
+    if (selected >= 0 && selected < int(DualGemmVariant::kNumVariants)) {
+      variant = DualGemmVariant(selected);
+    }
+  }
+  return dual_gemm_silu_identity_mul_variant<scalar_t, kStoreD0D1>(variant, x, w0, b0, w1, b1);
+}
+
+template <bool kStoreD0D1>
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_dispatch(
     const at::Tensor& x,
     const at::Tensor& w0,
     const c10::optional<at::Tensor>& b0,
@@ -141,18 +315,48 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
     const c10::optional<at::Tensor>& b1
 ) {
   // TODO: Check all params. This would take a lot of lines of code...
-  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(x.dim() >= 1);
   TORCH_CHECK(w0.dim() == 2);
   TORCH_CHECK(w1.dim() == 2);
 
   #define FWD_PARAMS x,w0,b0,w1,b1
 
+  // x is [..., I], and consumed in place as long as it has a row stride
+  at::Tensor x_2d = flatten_to_matrix(x);
+  at::Tensor d0, d1, d2;
   if (x.scalar_type() == at::ScalarType::Half) {
-    return dual_gemm_silu_identity_mul_<cutlass::half_t>(FWD_PARAMS);
+    std::tie(d0, d1, d2) = dual_gemm_silu_identity_mul_select<cutlass::half_t, kStoreD0D1>(x_2d, w0, b0, w1, b1);
   } else {
     TORCH_CHECK(x.scalar_type() == at::ScalarType::BFloat16, "Only supports bf16/f16");
-    return dual_gemm_silu_identity_mul_<cutlass::bfloat16_t>(FWD_PARAMS);
+    std::tie(d0, d1, d2) = dual_gemm_silu_identity_mul_select<cutlass::bfloat16_t, kStoreD0D1>(x_2d, w0, b0, w1, b1);
+  }
+  auto out_shape = with_last_dim(x, w0.size(0));
+  if (d0.defined()) {
+    d0 = d0.view(out_shape);
+    d1 = d1.view(out_shape);
   }
+  return std::make_tuple(d0, d1, d2.view(out_shape));
+}
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  return dual_gemm_silu_identity_mul_dispatch<true>(FWD_PARAMS);
+}
+
+// Only `silu(x @ w0.T + b0) * (x @ w1.T + b1)`, for inference
+at::Tensor dual_gemm_silu_identity_mul_no_grad(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  return std::get<2>(dual_gemm_silu_identity_mul_dispatch<false>(FWD_PARAMS));
 }
 
 std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_autocast(
@@ -173,16 +377,40 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul_autoc
   );
 }
 
+at::Tensor dual_gemm_silu_identity_mul_no_grad_autocast(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return dual_gemm_silu_identity_mul_no_grad(
+    at::autocast::cached_cast(exec_type, x),
+    at::autocast::cached_cast(exec_type, w0),
+    at::autocast::cached_cast(exec_type, b0),
+    at::autocast::cached_cast(exec_type, w1),
+    at::autocast::cached_cast(exec_type, b1)
+  );
+}
+
 } // namespace
 
 TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul"),
       TORCH_FN(dual_gemm_silu_identity_mul));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul_no_grad"),
+      TORCH_FN(dual_gemm_silu_identity_mul_no_grad));
 }
 
 TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
   m.impl(
       TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul"),
       TORCH_FN(dual_gemm_silu_identity_mul_autocast));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul_no_grad"),
+      TORCH_FN(dual_gemm_silu_identity_mul_no_grad_autocast));
 }
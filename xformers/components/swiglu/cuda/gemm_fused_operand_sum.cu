@@ -20,7 +20,8 @@ void gemm_fused_operand_sum_(
     const at::Tensor& a, // col-major
     const at::Tensor& b, // row-major
     at::Tensor& out_mm, // row-major
-    at::Tensor& out_sum // row-major
+    at::Tensor& out_sum, // row-major
+    bool accumulate // out_mm += a @ b
 ) {
   at::cuda::CUDAGuard device_guard(a.device());
   cudaStream_t stream = at::cuda::getCurrentCUDAStream();
@@ -144,7 +145,7 @@ void gemm_fused_operand_sum_(
 
   using ReduceVectorSplitK = cutlass::reduction::device::ReduceSplitK<ReduceVectorSplitKKernel>;
   auto alpha = ElementComputeEpilogue(1);
-  auto beta = ElementComputeEpilogue(0);
+  auto beta = ElementComputeEpilogue(accumulate ? 1 : 0);
 
   int reduce_vector_length = ReduceKForA ? problem_size.m() : problem_size.n();
   int split_k_slices = 1;
@@ -155,7 +156,8 @@ void gemm_fused_operand_sum_(
     {alpha, beta},
     (ElementInputA const*)a.data_ptr(),
     (ElementInputB const*)b.data_ptr(),
-    (ElementOutput*)nullptr,
+    // With `accumulate`, out_mm is also the source of the epilogue
+    (ElementOutput*)(accumulate ? out_mm.data_ptr() : nullptr),
     (ElementOutput*)out_mm.data_ptr(),
     (ElementOutput*)out_sum.data_ptr(),
     problem_size.m() * problem_size.k(),
@@ -165,7 +167,7 @@ void gemm_fused_operand_sum_(
     reduce_vector_length,
     a.stride(1),
     b.stride(0),
-    int64_t(0), // bias
+    accumulate ? out_mm.stride(0) : int64_t(0), // source
     out_mm.stride(0),
     int64_t(1) // out_sum
   };
@@ -186,7 +188,8 @@ std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
     const at::Tensor& a,
     const at::Tensor& b,
     at::Tensor& out_mm,
-    at::Tensor& out_sum
+    at::Tensor& out_sum,
+    bool accumulate
 ) {
   // TODO: Check all params. This would take a lot of lines of code...
   TORCH_CHECK(a.dim() == 2);
@@ -196,7 +199,11 @@ std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
   TORCH_CHECK(out_mm.size(1) == b.size(1));
   TORCH_CHECK(out_sum.dim() == 1);
 
-  #define FWD_PARAMS a,b,out_mm,out_sum
+  // The K-reduction is not scaled by the epilogue, so it is added to
+  // `out_sum` separately (it is only a vector)
+  at::Tensor sum = accumulate ? at::empty_like(out_sum) : out_sum;
+
+  #define FWD_PARAMS a,b,out_mm,sum,accumulate
 
   if (a.scalar_type() == at::ScalarType::Half) {
     TORCH_CHECK(b.scalar_type() == at::ScalarType::Half);
@@ -210,6 +217,9 @@ std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
     TORCH_CHECK(out_sum.scalar_type() == at::ScalarType::BFloat16);
     gemm_fused_operand_sum_<cutlass::bfloat16_t>(FWD_PARAMS);
   }
+  if (accumulate) {
+    out_sum.add_(sum);
+  }
   return std::make_tuple(out_mm, out_sum);
 }
 
@@ -217,7 +227,8 @@ std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum_autocast(
     const at::Tensor& a,
     const at::Tensor& b,
     at::Tensor& out_mm,
-    at::Tensor& out_sum
+    at::Tensor& out_sum,
+    bool accumulate
 ) {
   c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
   auto exec_type = at::autocast::get_autocast_gpu_dtype();
@@ -225,7 +236,8 @@ std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum_autocast(
     at::autocast::cached_cast(exec_type, a),
     at::autocast::cached_cast(exec_type, b),
     out_mm,
-    out_sum
+    out_sum,
+    accumulate
   );
 }
 } // namespace
@@ -0,0 +1,434 @@
+#include <ATen/Tensor.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/ScalarOps.h>
+#include <ATen/autocast_mode.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include "cutlass/cutlass.h"
+#include "cutlass/device_kernel.h"
+#include "cutlass/epilogue/threadblock/epilogue_with_visitor.h"
+#include "cutlass/fast_math.h"
+#include "cutlass/gemm/kernel/default_gemm.h"
+#include "cutlass/gemm/threadblock/threadblock_swizzle.h"
+#include "cutlass/matrix_coord.h"
+#include "cutlass/numeric_conversion.h"
+
+#include "../swiglu_utils.h"
+
+
+namespace {
+/*
+Computes `silu_bw_fused(x1, x2, dx5 @ w3)` in the epilogue of the gemm, so
+that dx4 is never written to global memory:
+
+def gemm_silu_bw_fused(dx5, w3, x1, x2):
+    dx4 = dx5 @ w3
+    return silu_bw_fused(x1, x2, dx4)
+
+The epilogue visitor loads the tiles of x1 / x2 matching the accumulators,
+and stores the tiles of dx1 / dx2 (interleaved as dx1dx2 [B, 2, H]) and x4
+*/
+template <typename OutputTileIterator_, typename ElementAccumulator_>
+class EpilogueVisitorSiluBw {
+ public:
+  using OutputTileIterator = OutputTileIterator_;
+  using ThreadMap = typename OutputTileIterator::ThreadMap;
+  using ElementOutput = typename OutputTileIterator::Element;
+  using ElementAccumulator = ElementAccumulator_;
+  using ElementCompute = float;
+
+  static int const kIterations = OutputTileIterator::kIterations;
+  static int const kElementsPerAccess = OutputTileIterator::kElementsPerAccess;
+
+  using AccumulatorFragment = cutlass::Array<ElementAccumulator, kElementsPerAccess>;
+  using OutputVector = cutlass::Array<ElementOutput, kElementsPerAccess>;
+  using ComputeVector = cutlass::Array<ElementCompute, kElementsPerAccess>;
+  using Fragment = typename OutputTileIterator::Fragment;
+
+  struct Params {
+    typename OutputTileIterator::Params params_x1;
+    typename OutputTileIterator::Params params_x2;
+    typename OutputTileIterator::Params params_dx1dx2;
+    typename OutputTileIterator::Params params_x4;
+    ElementOutput* ptr_x1;
+    ElementOutput* ptr_x2;
+    ElementOutput* ptr_dx1dx2;
+    ElementOutput* ptr_x4;
+    int64_t H;
+
+    CUTLASS_HOST_DEVICE
+    Params() {}
+
+    // All the pointers are row-major [B, H] matrices with the given row
+    // strides, except `dx1dx2` which is [B, 2, H]
+    CUTLASS_HOST_DEVICE
+    Params(
+        ElementOutput* ptr_x1_, int64_t ld_x1,
+        ElementOutput* ptr_x2_, int64_t ld_x2,
+        ElementOutput* ptr_dx1dx2_, int64_t ld_dx1dx2,
+        ElementOutput* ptr_x4_, int64_t ld_x4,
+        int64_t H_):
+      params_x1(cutlass::layout::RowMajor(ld_x1)),
+      params_x2(cutlass::layout::RowMajor(ld_x2)),
+      params_dx1dx2(cutlass::layout::RowMajor(ld_dx1dx2)),
+      params_x4(cutlass::layout::RowMajor(ld_x4)),
+      ptr_x1(ptr_x1_),
+      ptr_x2(ptr_x2_),
+      ptr_dx1dx2(ptr_dx1dx2_),
+      ptr_x4(ptr_x4_),
+      H(H_) {}
+  };
+
+  struct SharedStorage {};
+
+ private:
+  OutputTileIterator iterator_x1_;
+  OutputTileIterator iterator_x2_;
+  OutputTileIterator iterator_dx1_;
+  OutputTileIterator iterator_dx2_;
+  OutputTileIterator iterator_x4_;
+  Fragment fragment_x1_;
+  Fragment fragment_x2_;
+  Fragment fragment_dx1_;
+  Fragment fragment_dx2_;
+  Fragment fragment_x4_;
+
+ public:
+  CUTLASS_DEVICE
+  EpilogueVisitorSiluBw(
+      Params const& params,
+      SharedStorage& shared_storage,
+      cutlass::MatrixCoord const& problem_size,
+      int thread_idx,
+      cutlass::MatrixCoord const& threadblock_offset):
+    iterator_x1_(params.params_x1, params.ptr_x1, problem_size, thread_idx, threadblock_offset),
+    iterator_x2_(params.params_x2, params.ptr_x2, problem_size, thread_idx, threadblock_offset),
+    iterator_dx1_(params.params_dx1dx2, params.ptr_dx1dx2, problem_size, thread_idx, threadblock_offset),
+    iterator_dx2_(params.params_dx1dx2, params.ptr_dx1dx2 + params.H, problem_size, thread_idx, threadblock_offset),
+    iterator_x4_(params.params_x4, params.ptr_x4, problem_size, thread_idx, threadblock_offset) {}
+
+  CUTLASS_DEVICE
+  void begin_epilogue() {}
+
+  CUTLASS_DEVICE
+  void begin_step(int step_idx) {
+    fragment_x1_.clear();
+    fragment_x2_.clear();
+    iterator_x1_.load(fragment_x1_);
+    iterator_x2_.load(fragment_x2_);
+    ++iterator_x1_;
+    ++iterator_x2_;
+  }
+
+  CUTLASS_DEVICE
+  void begin_row(int row_idx) {}
+
+  CUTLASS_DEVICE
+  void visit(
+      int iter_idx,
+      int row_idx,
+      int column_idx,
+      int frag_idx,
+      AccumulatorFragment const& accum) {
+    cutlass::NumericArrayConverter<ElementCompute, ElementOutput, kElementsPerAccess> to_compute;
+    cutlass::NumericArrayConverter<ElementCompute, ElementAccumulator, kElementsPerAccess> accum_to_compute;
+    cutlass::NumericArrayConverter<ElementOutput, ElementCompute, kElementsPerAccess> to_output;
+
+    ComputeVector x1 = to_compute(reinterpret_cast<OutputVector const*>(&fragment_x1_)[frag_idx]);
+    ComputeVector x2 = to_compute(reinterpret_cast<OutputVector const*>(&fragment_x2_)[frag_idx]);
+    ComputeVector dx4 = accum_to_compute(accum);
+    ComputeVector dx1, dx2, x4;
+
+    CUTLASS_PRAGMA_UNROLL
+    for (int i = 0; i < kElementsPerAccess; ++i) {
+      ElementCompute sigm = ElementCompute(1) / (ElementCompute(1) + cutlass::fast_exp(-x1[i]));
+      ElementCompute x3 = sigm * x1[i];
+      ElementCompute dx3 = dx4[i] * x2[i];
+      dx2[i] = dx4[i] * x3;
+      dx1[i] = dx3 * sigm * (ElementCompute(1) + x1[i] * (ElementCompute(1) - sigm));
+      x4[i] = x3 * x2[i];
+    }
+    reinterpret_cast<OutputVector*>(&fragment_dx1_)[frag_idx] = to_output(dx1);
+    reinterpret_cast<OutputVector*>(&fragment_dx2_)[frag_idx] = to_output(dx2);
+    reinterpret_cast<OutputVector*>(&fragment_x4_)[frag_idx] = to_output(x4);
+  }
+
+  CUTLASS_DEVICE
+  void end_row(int row_idx) {}
+
+  CUTLASS_DEVICE
+  void end_step(int step_idx) {
+    iterator_dx1_.store(fragment_dx1_);
+    iterator_dx2_.store(fragment_dx2_);
+    iterator_x4_.store(fragment_x4_);
+    ++iterator_dx1_;
+    ++iterator_dx2_;
+    ++iterator_x4_;
+  }
+
+  CUTLASS_DEVICE
+  void end_epilogue() {}
+};
+
+// Same as `cutlass::gemm::kernel::Gemm` (without split-k), but with an
+// epilogue that runs the visitor over the accumulators
+template <typename Mma_, typename Epilogue_, typename ThreadblockSwizzle_>
+struct GemmWithSiluBwEpilogue {
+  using Mma = Mma_;
+  using Epilogue = Epilogue_;
+  using Visitor = typename Epilogue::Visitor;
+  using ThreadblockSwizzle = ThreadblockSwizzle_;
+  using WarpCount = typename Mma::WarpCount;
+  static int const kThreadCount = 32 * WarpCount::kCount;
+
+  struct Params {
+    cutlass::gemm::GemmCoord problem_size;
+    cutlass::gemm::GemmCoord grid_tiled_shape;
+    int swizzle_log_tile;
+    typename Mma::IteratorA::Params params_A;
+    typename Mma::IteratorA::Element* ptr_A;
+    typename Mma::IteratorB::Params params_B;
+    typename Mma::IteratorB::Element* ptr_B;
+    typename Visitor::Params visitor;
+  };
+
+  union SharedStorage {
+    typename Mma::SharedStorage main_loop;
+    struct {
+      typename Epilogue::SharedStorage epilogue;
+      typename Visitor::SharedStorage visitor;
+    } epilogue;
+  };
+
+  CUTLASS_DEVICE
+  void operator()(Params const& params, SharedStorage& shared_storage) {
+    ThreadblockSwizzle threadblock_swizzle;
+    cutlass::gemm::GemmCoord threadblock_tile_offset =
+        threadblock_swizzle.get_tile_offset(params.swizzle_log_tile);
+    if (params.grid_tiled_shape.m() <= threadblock_tile_offset.m() ||
+        params.grid_tiled_shape.n() <= threadblock_tile_offset.n()) {
+      return;
+    }
+
+    cutlass::MatrixCoord tb_offset_A{threadblock_tile_offset.m() * Mma::Shape::kM, 0};
+    cutlass::MatrixCoord tb_offset_B{0, threadblock_tile_offset.n() * Mma::Shape::kN};
+    int gemm_k_iterations = (params.problem_size.k() + Mma::Shape::kK - 1) / Mma::Shape::kK;
+
+    int thread_idx = threadIdx.x;
+    int warp_idx = __shfl_sync(0xffffffff, threadIdx.x / 32, 0);
+    int lane_idx = threadIdx.x % 32;
+
+    typename Mma::IteratorA iterator_A(
+        params.params_A,
+        params.ptr_A,
+        {params.problem_size.m(), params.problem_size.k()},
+        thread_idx,
+        tb_offset_A);
+    typename Mma::IteratorB iterator_B(
+        params.params_B,
+        params.ptr_B,
+        {params.problem_size.k(), params.problem_size.n()},
+        thread_idx,
+        tb_offset_B);
+
+    Mma mma(shared_storage.main_loop, thread_idx, warp_idx, lane_idx);
+    typename Mma::FragmentC accumulators;
+    accumulators.clear();
+    mma(gemm_k_iterations, accumulators, iterator_A, iterator_B, accumulators);
+
+    cutlass::MatrixCoord threadblock_offset(
+        threadblock_tile_offset.m() * Mma::Shape::kM,
+        threadblock_tile_offset.n() * Mma::Shape::kN);
+    Visitor visitor(
+        params.visitor,
+        shared_storage.epilogue.visitor,
+        params.problem_size.mn(),
+        thread_idx,
+        threadblock_offset);
+    Epilogue epilogue(shared_storage.epilogue.epilogue, thread_idx, warp_idx, lane_idx);
+    epilogue(visitor, accumulators);
+  }
+};
+
+template <typename scalar_t>
+std::tuple<at::Tensor, at::Tensor> gemm_silu_bw_fused_(
+    const at::Tensor& dx5,
+    const at::Tensor& w3,
+    const at::Tensor& x1,
+    const at::Tensor& x2
+) {
+  at::cuda::CUDAGuard device_guard(dx5.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+  int64_t B = dx5.size(0);
+  int64_t O = dx5.size(1);
+  int64_t H = w3.size(1);
+
+  at::Tensor dx1dx2 = at::empty({B, 2, H}, x2.options());
+  at::Tensor x4 = at::empty({B, H}, x2.options());
+
+  // templati-ze the cutlass kernel
+  cutlass::gemm::GemmCoord problem_size(B, H, O);
+
+  constexpr int kStages = 3;
+  constexpr int kAlignment = 128 / cutlass::sizeof_bits<scalar_t>::value;
+
+  using ElementOutput = scalar_t;
+  using ElementAccumulator = float;
+  // Only used to define the default epilogue, whose iterators the visitor
+  // reuses
+  using EpilogueOutputOp = cutlass::epilogue::thread::LinearCombination<
+    ElementOutput,
+    kAlignment,
+    ElementAccumulator,
+    ElementAccumulator
+  >;
+
+  using ThreadblockShape = cutlass::gemm::GemmShape<128, 64, 32>;
+  using WarpShape = cutlass::gemm::GemmShape<64, 32, 32>;
+  using InstructionShape = cutlass::gemm::GemmShape<16, 8, 16>;
+  using ThreadblockSwizzle = cutlass::gemm::threadblock::GemmIdentityThreadblockSwizzle<>;
+  using ArchTag = cutlass::arch::Sm80;
+
+  using DefaultGemmKernel = typename cutlass::gemm::kernel::DefaultGemm<
+    scalar_t, cutlass::layout::RowMajor, kAlignment,
+    scalar_t, cutlass::layout::RowMajor, kAlignment,
+    ElementOutput, cutlass::layout::RowMajor,
+    ElementAccumulator,
+    cutlass::arch::OpClassTensorOp,
+    ArchTag,
+    ThreadblockShape,
+    WarpShape,
+    InstructionShape,
+    EpilogueOutputOp,
+    ThreadblockSwizzle,
+    kStages,
+    false,
+    cutlass::arch::OpMultiplyAdd
+  >::GemmKernel;
+  using Visitor = EpilogueVisitorSiluBw<
+    typename DefaultGemmKernel::Epilogue::OutputTileIterator,
+    ElementAccumulator
+  >;
+  using Epilogue = typename cutlass::epilogue::threadblock::EpilogueWithVisitorFromExistingEpilogue<
+    Visitor,
+    typename DefaultGemmKernel::Epilogue
+  >::Epilogue;
+  using Kernel = GemmWithSiluBwEpilogue<typename DefaultGemmKernel::Mma, Epilogue, ThreadblockSwizzle>;
+  {
+    cudaDeviceProp* p = at::cuda::getDeviceProperties(dx5.device().index());
+    TORCH_CHECK(p->major * 10 + p->minor >= ArchTag::kMinComputeCapability, "Only A100+ GPUs are supported");
+  }
+  TORCH_CHECK(
+    O % kAlignment == 0 && H % kAlignment == 0 &&
+    dx5.stride(0) % kAlignment == 0 && w3.stride(0) % kAlignment == 0 &&
+    x1.stride(0) % kAlignment == 0 && x2.stride(0) % kAlignment == 0,
+    "gemm_silu_bw_fused: the sizes and strides must be multiples of ", kAlignment);
+
+  ThreadblockSwizzle threadblock_swizzle;
+  typename Kernel::Params params;
+  params.problem_size = problem_size;
+  params.grid_tiled_shape = threadblock_swizzle.get_tiled_shape(
+    problem_size,
+    {ThreadblockShape::kM, ThreadblockShape::kN, ThreadblockShape::kK},
+    1);
+  params.swizzle_log_tile = threadblock_swizzle.get_log_tile(params.grid_tiled_shape);
+  params.params_A = typename Kernel::Mma::IteratorA::Params(cutlass::layout::RowMajor(dx5.stride(0)));
+  params.ptr_A = (scalar_t*)dx5.data_ptr();
+  params.params_B = typename Kernel::Mma::IteratorB::Params(cutlass::layout::RowMajor(w3.stride(0)));
+  params.ptr_B = (scalar_t*)w3.data_ptr();
+  params.visitor = typename Visitor::Params(
+    (scalar_t*)x1.data_ptr(), x1.stride(0),
+    (scalar_t*)x2.data_ptr(), x2.stride(0),
+    (scalar_t*)dx1dx2.data_ptr(), dx1dx2.stride(0),
+    (scalar_t*)x4.data_ptr(), x4.stride(0),
+    H);
+
+  dim3 grid = threadblock_swizzle.get_grid_shape(params.grid_tiled_shape);
+  dim3 block(Kernel::kThreadCount, 1, 1);
+  int smem_size = int(sizeof(typename Kernel::SharedStorage));
+  if (smem_size >= (48 << 10)) {
+    AT_CUDA_CHECK(cudaFuncSetAttribute(
+      cutlass::Kernel<Kernel>,
+      cudaFuncAttributeMaxDynamicSharedMemorySize,
+      smem_size));
+  }
+  cutlass::Kernel<Kernel><<<grid, block, smem_size, stream>>>(params);
+  AT_CUDA_CHECK(cudaGetLastError());
+  return std::make_tuple(dx1dx2, x4);
+}
+
+// The loads and stores of the kernel are 128-bit wide: matrices whose
+// pointer or row stride is not 16B-aligned (eg slices) are copied
+at::Tensor aligned_rows(const at::Tensor& x) {
+  const int64_t alignment = 16 / x.element_size();
+  const bool aligned = x.stride(0) % alignment == 0 &&
+      reinterpret_cast<uintptr_t>(x.data_ptr()) % 16 == 0;
+  return aligned ? x : x.clone(at::MemoryFormat::Contiguous);
+}
+
+std::tuple<at::Tensor, at::Tensor> gemm_silu_bw_fused(
+    const at::Tensor& dx5,
+    const at::Tensor& w3,
+    const at::Tensor& x1,
+    const at::Tensor& x2
+) {
+  TORCH_CHECK(dx5.dim() >= 1);
+  TORCH_CHECK(w3.dim() == 2);
+  TORCH_CHECK(dx5.size(-1) == w3.size(0));
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(x2.sizes() == at::IntArrayRef(with_last_dim(dx5, w3.size(1))));
+  TORCH_CHECK(w3.stride(1) == 1);
+  TORCH_CHECK(w3.scalar_type() == dx5.scalar_type());
+  TORCH_CHECK(x1.scalar_type() == dx5.scalar_type());
+  TORCH_CHECK(x2.scalar_type() == dx5.scalar_type());
+
+  // [..., O] and [..., H] inputs, consumed in place when they have a row
+  // stride
+  at::Tensor dx5_2d = aligned_rows(flatten_to_matrix(dx5));
+  at::Tensor w3_aligned = aligned_rows(w3);
+  at::Tensor x1_2d = aligned_rows(flatten_to_matrix(x1));
+  at::Tensor x2_2d = aligned_rows(flatten_to_matrix(x2));
+  #define FWD_PARAMS dx5_2d,w3_aligned,x1_2d,x2_2d
+
+  at::Tensor dx1dx2, x4;
+  if (dx5.scalar_type() == at::ScalarType::Half) {
+    std::tie(dx1dx2, x4) = gemm_silu_bw_fused_<cutlass::half_t>(FWD_PARAMS);
+  } else {
+    TORCH_CHECK(dx5.scalar_type() == at::ScalarType::BFloat16, "Only supports bf16/f16");
+    std::tie(dx1dx2, x4) = gemm_silu_bw_fused_<cutlass::bfloat16_t>(FWD_PARAMS);
+  }
+  std::vector<int64_t> dx1dx2_shape = x2.sizes().vec();
+  dx1dx2_shape.insert(dx1dx2_shape.end() - 1, 2);
+  return std::make_tuple(dx1dx2.view(dx1dx2_shape), x4.view(x2.sizes()));
+}
+
+std::tuple<at::Tensor, at::Tensor> gemm_silu_bw_fused_autocast(
+    const at::Tensor& dx5,
+    const at::Tensor& w3,
+    const at::Tensor& x1,
+    const at::Tensor& x2
+) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return gemm_silu_bw_fused(
+    at::autocast::cached_cast(exec_type, dx5),
+    at::autocast::cached_cast(exec_type, w3),
+    at::autocast::cached_cast(exec_type, x1),
+    at::autocast::cached_cast(exec_type, x2)
+  );
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_silu_bw_fused"),
+      TORCH_FN(gemm_silu_bw_fused));
+}
+
+TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_silu_bw_fused"),
+      TORCH_FN(gemm_silu_bw_fused_autocast));
+}
@@ -10,6 +10,8 @@
 #include <ATen/native/cuda/Loops.cuh>
 #include <ATen/AccumulateType.h>
 
+#include <vector>
+
 
 namespace {
 /*
@@ -32,17 +34,18 @@ std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
     const at::Tensor& dx4
 ) {
   // TODO: Check all params. This would take a lot of lines of code...
-  TORCH_CHECK(x2.dim() == 2);
-  TORCH_CHECK(dx4.dim() == 2);
-  TORCH_CHECK(x2.size(0) == dx4.size(0));
-  TORCH_CHECK(x2.size(1) == dx4.size(1));
+  // Any [..., H] shape and strides: the elementwise kernel takes the
+  // inputs as they are, and the outputs are [..., 2, H] and [..., H]
+  TORCH_CHECK(x2.dim() >= 1);
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(dx4.sizes() == x2.sizes());
 
-  int64_t B = x2.size(0);
-  int64_t H = x2.size(1);
-  at::Tensor dx1dx2 = at::empty({B, 2, H}, x2.options());
-  at::Tensor dx1 = dx1dx2.select(1, 0);
-  at::Tensor dx2 = dx1dx2.select(1, 1);
-  at::Tensor x4 = at::empty({B, H}, x2.options());
+  std::vector<int64_t> dx1dx2_shape = x2.sizes().vec();
+  dx1dx2_shape.insert(dx1dx2_shape.end() - 1, 2);
+  at::Tensor dx1dx2 = at::empty(dx1dx2_shape, x2.options());
+  at::Tensor dx1 = dx1dx2.select(-2, 0);
+  at::Tensor dx2 = dx1dx2.select(-2, 1);
+  at::Tensor x4 = at::empty(x2.sizes(), x2.options());
   auto iter = at::TensorIteratorConfig()
       .add_output(dx1)
       .add_output(dx2)
@@ -0,0 +1,234 @@
+#include <ATen/Tensor.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/library.h>
+
+#include <vector>
+
+#include "cutlass/cutlass.h"
+#include "cutlass/gemm/device/gemm_sparse.h"
+#include "cutlass/tensor_ref.h"
+
+namespace {
+/*
+Linear layers with 2:4 structured sparse weights (at most 2 non-zeros in
+every group of 4 consecutive inputs), on the sparse tensor cores of Sm80+.
+
+The weights are the sparse `A` operand of the CUTLASS SparseGemm, so these
+compute the transposed product: `out.t() = w @ x.t()`. `out` is returned as
+a transposed view, so callers see `F.linear(x, w)` [N, M].
+
+The weights [M, K] are stored compressed by `sparse24_compress`:
+- `values` [M, K / 2]: the 2 kept values of every group of 4
+- `meta` [M, K / 2 / kElementsPerElementE]: the 2-bit positions of the kept
+  values in their group, reordered in the (interleaved) layout expected by
+  the kernel
+*/
+template <typename scalar_t>
+struct Sparse24Gemm {
+  using Gemm = cutlass::gemm::device::SparseGemm<
+      scalar_t,
+      cutlass::layout::RowMajor, // w
+      scalar_t,
+      cutlass::layout::ColumnMajor, // x.t()
+      scalar_t,
+      cutlass::layout::RowMajor, // out.t()
+      float,
+      cutlass::arch::OpClassTensorOp,
+      cutlass::arch::Sm80,
+      cutlass::gemm::GemmShape<128, 128, 64>,
+      cutlass::gemm::GemmShape<64, 64, 64>,
+      cutlass::gemm::GemmShape<16, 8, 32>,
+      cutlass::epilogue::thread::LinearCombination<
+          scalar_t,
+          128 / cutlass::sizeof_bits<scalar_t>::value,
+          float,
+          float>,
+      cutlass::gemm::threadblock::GemmIdentityThreadblockSwizzle<>,
+      3>;
+  using ElementE = typename Gemm::ElementE;
+  using LayoutE = typename Gemm::LayoutE;
+  static constexpr int kSparse = Gemm::kSparse;
+  static constexpr int kElementsPerElementE = Gemm::kElementsPerElementE;
+};
+
+template <typename scalar_t>
+std::tuple<at::Tensor, at::Tensor> sparse24_compress_(const at::Tensor& w) {
+  using Traits = Sparse24Gemm<scalar_t>;
+  using ElementE = typename Traits::ElementE;
+  static_assert(Traits::kSparse == 2, "2:4 sparsity");
+  static_assert(sizeof(ElementE) == 2 || sizeof(ElementE) == 4, "");
+  constexpr int kElementsPerElementE = Traits::kElementsPerElementE;
+
+  int64_t M = w.size(0);
+  int64_t K = w.size(1);
+  TORCH_CHECK(
+      K % (2 * kElementsPerElementE) == 0,
+      "sparse24_compress: the number of inputs must be a multiple of ",
+      2 * kElementsPerElementE);
+  // The metadata is reordered for the kernel within groups of 32 rows
+  TORCH_CHECK(M % 32 == 0, "sparse24_compress: the number of outputs must be a multiple of 32");
+  int64_t K_e = K / 2 / kElementsPerElementE;
+
+  // This is a one-off conversion of the weights: done on the CPU
+  at::Tensor w_cpu = w.to(at::kCPU).contiguous();
+  at::Tensor values = at::empty({M, K / 2}, w_cpu.options());
+  at::Tensor meta = at::empty(
+      {M, K_e},
+      w_cpu.options().dtype(sizeof(ElementE) == 2 ? at::kShort : at::kInt));
+  const scalar_t* src = reinterpret_cast<const scalar_t*>(w_cpu.data_ptr());
+  scalar_t* dst = reinterpret_cast<scalar_t*>(values.data_ptr());
+
+  std::vector<ElementE> meta_rows(M * K_e, 0);
+  for (int64_t m = 0; m < M; ++m) {
+    for (int64_t g = 0; g < K / 4; ++g) {
+      const scalar_t* group = src + m * K + 4 * g;
+      int idx[2];
+      int kept = 0;
+      for (int j = 0; j < 4; ++j) {
+        if (float(group[j]) != 0.0f) {
+          TORCH_CHECK(
+              kept < 2,
+              "sparse24_compress: row ", m, " has more than 2 non-zeros in the inputs [",
+              4 * g, ", ", 4 * g + 4, ")");
+          idx[kept++] = j;
+        }
+      }
+      // Groups with less than 2 non-zeros keep explicit zeros, at
+      // positions still in increasing order
+      for (int j = 0; j < 4 && kept < 2; ++j) {
+        if (kept == 0 || idx[0] != j) {
+          idx[kept++] = j;
+        }
+      }
+      if (idx[0] > idx[1]) {
+        std::swap(idx[0], idx[1]);
+      }
+      dst[m * K / 2 + 2 * g] = group[idx[0]];
+      dst[m * K / 2 + 2 * g + 1] = group[idx[1]];
+      // 2 bits per kept value
+      int64_t v = 2 * g;
+      ElementE bits = ElementE(idx[0] | (idx[1] << 2));
+      meta_rows[m * K_e + v / kElementsPerElementE] |=
+          ElementE(bits << (2 * (v % kElementsPerElementE)));
+    }
+  }
+
+  // Same reordering as `cutlass::reorder_meta` (tools/util/host_reorder.h)
+  cutlass::TensorRef<ElementE, typename Traits::LayoutE> dest(
+      reinterpret_cast<ElementE*>(meta.data_ptr()),
+      Traits::LayoutE::packed({int(M), int(K_e)}));
+  int group = sizeof(ElementE) == 2 ? 32 : 16;
+  int interweave = sizeof(ElementE) == 2 ? 4 : 2;
+  for (int m = 0; m < M; ++m) {
+    for (int k = 0; k < K_e; ++k) {
+      int dest_row = m / group * group + (m % 8) * interweave + (m % group) / 8;
+      int dest_col = k;
+      // Swizzle the 2x2 blocks from Z to N
+      if (dest_row % 2 == 0 && dest_col % 2 == 1) {
+        ++dest_row;
+        --dest_col;
+      } else if (dest_row % 2 == 1 && dest_col % 2 == 0) {
+        --dest_row;
+        ++dest_col;
+      }
+      dest.at({dest_row, dest_col}) = meta_rows[m * K_e + k];
+    }
+  }
+  return std::make_tuple(values.to(w.device()), meta.to(w.device()));
+}
+
+std::tuple<at::Tensor, at::Tensor> sparse24_compress(const at::Tensor& w) {
+  TORCH_CHECK(w.dim() == 2, "sparse24_compress: expected a [M, K] weight");
+  if (w.scalar_type() == at::ScalarType::Half) {
+    return sparse24_compress_<cutlass::half_t>(w);
+  }
+  TORCH_CHECK(w.scalar_type() == at::ScalarType::BFloat16, "Only supports bf16/f16");
+  return sparse24_compress_<cutlass::bfloat16_t>(w);
+}
+
+template <typename scalar_t>
+void sparse24_linear_(
+    const at::Tensor& x, // [N, K], rows contiguous
+    const at::Tensor& values, // [M, K / 2]
+    const at::Tensor& meta,
+    at::Tensor& out_t // [M, N]
+) {
+  using Traits = Sparse24Gemm<scalar_t>;
+  using Gemm = typename Traits::Gemm;
+  using ElementE = typename Traits::ElementE;
+  int64_t M = values.size(0);
+  int64_t K = x.size(1);
+  int64_t N = x.size(0);
+
+  at::cuda::CUDAGuard device_guard(x.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  {
+    cudaDeviceProp* p = at::cuda::getDeviceProperties(x.device().index());
+    TORCH_CHECK(p->major * 10 + p->minor >= 80, "sparse24_linear: only A100+ GPUs are supported");
+  }
+
+  using RefA = cutlass::TensorRef<scalar_t const, typename Gemm::LayoutA>;
+  using RefB = cutlass::TensorRef<scalar_t const, typename Gemm::LayoutB>;
+  using RefC = cutlass::TensorRef<scalar_t, typename Gemm::LayoutC>;
+  using RefE = cutlass::TensorRef<ElementE const, typename Traits::LayoutE>;
+  RefC ref_out{(scalar_t*)out_t.data_ptr(), typename Gemm::LayoutC::Stride(out_t.stride(0))};
+
+  cutlass::gemm::GemmCoord problem_size(M, N, K);
+  typename Gemm::Arguments arguments{
+      problem_size,
+      RefA{(scalar_t const*)values.data_ptr(), typename Gemm::LayoutA::Stride(values.stride(0))},
+      RefB{(scalar_t const*)x.data_ptr(), typename Gemm::LayoutB::Stride(x.stride(0))},
+      // beta = 0: the source is not read
+      ref_out,
+      ref_out,
+      RefE{(ElementE const*)meta.data_ptr(), Traits::LayoutE::packed({int(M), int(meta.size(1))})},
+      {1.0f, 0.0f},
+      1};
+
+  Gemm gemm_op;
+  at::Tensor workspace = at::empty(
+      {int64_t(Gemm::get_workspace_size(arguments))},
+      x.options().dtype(at::ScalarType::Byte));
+  cutlass::Status status = gemm_op.can_implement(arguments);
+  TORCH_CHECK(status == cutlass::Status::kSuccess, "sparse24_linear: not supported by this kernel");
+  status = gemm_op.initialize(arguments, (uint8_t*)workspace.data_ptr(), stream);
+  TORCH_CHECK(status == cutlass::Status::kSuccess, "kernel initialize failed");
+  status = gemm_op(stream);
+  TORCH_CHECK(status == cutlass::Status::kSuccess, "kernel run failed");
+}
+
+at::Tensor sparse24_linear(
+    const at::Tensor& x,
+    const at::Tensor& values,
+    const at::Tensor& meta
+) {
+  TORCH_CHECK(x.dim() == 2 && values.dim() == 2 && meta.dim() == 2);
+  TORCH_CHECK(values.size(1) * 2 == x.size(1), "sparse24_linear: x and the weights have a different number of inputs");
+  TORCH_CHECK(meta.size(0) == values.size(0));
+  TORCH_CHECK(x.stride(1) == 1 && values.is_contiguous() && meta.is_contiguous());
+  TORCH_CHECK(values.scalar_type() == x.scalar_type());
+  TORCH_CHECK(x.is_cuda() && values.is_cuda() && meta.is_cuda());
+
+  at::Tensor out_t = at::empty({values.size(0), x.size(0)}, x.options());
+  if (x.size(0) == 0) {
+    return out_t.t();
+  }
+  if (x.scalar_type() == at::ScalarType::Half) {
+    sparse24_linear_<cutlass::half_t>(x, values, meta, out_t);
+  } else {
+    TORCH_CHECK(x.scalar_type() == at::ScalarType::BFloat16, "Only supports bf16/f16");
+    sparse24_linear_<cutlass::bfloat16_t>(x, values, meta, out_t);
+  }
+  return out_t.t();
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse24_compress"),
+      TORCH_FN(sparse24_compress));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse24_linear"),
+      TORCH_FN(sparse24_linear));
+}
@@ -0,0 +1,499 @@
+#include <algorithm>
+
+#include <ATen/Tensor.h>
+#include <ATen/Dispatch.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/autocast_mode.h>
+#include <c10/cuda/CUDAGuard.h>
+#include <cooperative_groups.h>
+#include <torch/library.h>
+
+
+namespace {
+/*
+Computes the whole packed SwiGLU for a few rows of x, in a single launch:
+
+def swiglu_fused_small_batch(x, w1w2, b1b2, w3, b3):
+    x1 = F.linear(x, w1w2[0], b1b2[0])
+    x2 = F.linear(x, w1w2[1], b1b2[1])
+    x4 = F.silu(x1) * x2
+    return F.linear(x4, w3, b3)
+
+For decode-size batches both gemms are bound by the loads of the weights,
+so every warp computes a full dot product (one hidden / output unit for all
+the rows of x) while streaming a row of the weights once. The kernel is
+persistent: all the blocks are resident (cooperative launch), compute x4
+(which stays in L2), synchronize across the grid and then compute the
+output, which saves the second launch and the gap between the two gemms
+
+`swiglu_fused_small_batch_quantized` is the same kernel with weight-only
+quantized weights, dequantized in registers right after they are loaded
+(so 2x / 4x less bytes to stream for int8 / int4)
+*/
+constexpr int kMaxBatch = 64;
+// Rows of x computed together, while a vector of weights is in registers
+constexpr int kBatchTile = 8;
+constexpr int kVec = 8;
+constexpr int kWarpsPerBlock = 8;
+
+template <typename scalar_t>
+struct alignas(16) Vec {
+  scalar_t v[kVec];
+};
+
+template <typename scalar_t>
+__device__ __forceinline__ void load_vec(const scalar_t* ptr, float (&out)[kVec]) {
+  Vec<scalar_t> vec = *reinterpret_cast<const Vec<scalar_t>*>(ptr);
+#pragma unroll
+  for (int k = 0; k < kVec; ++k) {
+    out[k] = float(vec.v[k]);
+  }
+}
+
+__device__ __forceinline__ float warp_sum(float v) {
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    v += __shfl_xor_sync(0xffffffff, v, offset);
+  }
+  return v;
+}
+
+// Weights stored in `scalar_t`
+template <typename scalar_t>
+struct DenseWeights {
+  struct Row {
+    const scalar_t* ptr;
+
+    __device__ __forceinline__ void load(int k, float (&out)[kVec]) const {
+      load_vec(ptr + k, out);
+    }
+  };
+
+  const scalar_t* ptr;
+  int64_t stride;
+
+  __device__ __forceinline__ Row row(int r) const {
+    return {ptr + r * stride};
+  }
+};
+
+// Weights quantized to int8 (`Int4 = false`) or int4, with a `scalar_t`
+// scale for every group of `group_size` consecutive inputs of a row (one
+// group per row for per-channel scales). int4 values are packed two per
+// byte, the even input in the low nibble, with an offset of 8
+template <typename scalar_t, bool Int4>
+struct QuantizedWeights {
+  static constexpr int kBytesPerVec = Int4 ? kVec / 2 : kVec;
+
+  struct Row {
+    const uint8_t* ptr;
+    const scalar_t* scale;
+    int group_size;
+
+    __device__ __forceinline__ void load(int k, float (&out)[kVec]) const {
+      // `group_size` is a multiple of kVec: a single scale per vector
+      float s = float(scale[k / group_size]);
+      if (Int4) {
+        uint32_t packed = *reinterpret_cast<const uint32_t*>(ptr + k / 2);
+#pragma unroll
+        for (int j = 0; j < kVec; ++j) {
+          out[j] = float(int((packed >> (4 * j)) & 0xF) - 8) * s;
+        }
+      } else {
+        int2 packed = *reinterpret_cast<const int2*>(ptr + k);
+        const int8_t* q = reinterpret_cast<const int8_t*>(&packed);
+#pragma unroll
+        for (int j = 0; j < kVec; ++j) {
+          out[j] = float(q[j]) * s;
+        }
+      }
+    }
+  };
+
+  const uint8_t* ptr;
+  int64_t stride; // in bytes
+  const scalar_t* scale;
+  int64_t scale_stride;
+  int group_size;
+
+  __device__ __forceinline__ Row row(int r) const {
+    return {ptr + r * stride, scale + r * scale_stride, group_size};
+  }
+};
+
+template <typename scalar_t, typename Weights>
+struct SwiGLUSmallBatchParams {
+  const scalar_t* x; // [B, I]
+  Weights w1; // [H, I]
+  Weights w2; // [H, I]
+  const scalar_t* b1; // [H] or nullptr
+  const scalar_t* b2; // [H] or nullptr
+  Weights w3; // [O, H]
+  const scalar_t* b3; // [O] or nullptr
+  scalar_t* x4; // [B, H]
+  scalar_t* out; // [B, O]
+  int64_t x_stride;
+  int B;
+  int I;
+  int H;
+  int O;
+};
+
+// `acc[s][b] = dot(a[b0 + b], w[s])` for the `kNumW` rows of weights `w`
+template <typename scalar_t, typename Row, int kNumW>
+__device__ __forceinline__ void batched_dot(
+    const scalar_t* a,
+    int64_t a_stride,
+    int num_rows,
+    const Row (&w)[kNumW],
+    int K,
+    float (&acc)[kNumW][kBatchTile]) {
+  int lane = threadIdx.x % 32;
+#pragma unroll
+  for (int s = 0; s < kNumW; ++s) {
+#pragma unroll
+    for (int b = 0; b < kBatchTile; ++b) {
+      acc[s][b] = 0;
+    }
+  }
+  for (int k = lane * kVec; k < K; k += 32 * kVec) {
+    float wv[kNumW][kVec];
+#pragma unroll
+    for (int s = 0; s < kNumW; ++s) {
+      w[s].load(k, wv[s]);
+    }
+#pragma unroll
+    for (int b = 0; b < kBatchTile; ++b) {
+      if (b < num_rows) {
+        float av[kVec];
+        load_vec(a + b * a_stride + k, av);
+#pragma unroll
+        for (int s = 0; s < kNumW; ++s) {
+#pragma unroll
+          for (int j = 0; j < kVec; ++j) {
+            acc[s][b] += av[j] * wv[s][j];
+          }
+        }
+      }
+    }
+  }
+#pragma unroll
+  for (int s = 0; s < kNumW; ++s) {
+#pragma unroll
+    for (int b = 0; b < kBatchTile; ++b) {
+      acc[s][b] = warp_sum(acc[s][b]);
+    }
+  }
+}
+
+template <typename scalar_t, typename Weights>
+__global__ void __launch_bounds__(kWarpsPerBlock * 32)
+    swiglu_fused_small_batch_kernel(SwiGLUSmallBatchParams<scalar_t, Weights> p) {
+  using Row = typename Weights::Row;
+  int lane = threadIdx.x % 32;
+  int warp_id = blockIdx.x * kWarpsPerBlock + threadIdx.x / 32;
+  int num_warps = gridDim.x * kWarpsPerBlock;
+
+  // x4[:, h] = silu(x @ w1[h] + b1[h]) * (x @ w2[h] + b2[h])
+  for (int h = warp_id; h < p.H; h += num_warps) {
+    const Row w[2] = {p.w1.row(h), p.w2.row(h)};
+    for (int b0 = 0; b0 < p.B; b0 += kBatchTile) {
+      float acc[2][kBatchTile];
+      int num_rows = min(kBatchTile, p.B - b0);
+      batched_dot<scalar_t, Row, 2>(
+          p.x + b0 * p.x_stride, p.x_stride, num_rows, w, p.I, acc);
+      if (lane < num_rows) {
+        // Each lane writes the hidden unit of one row
+        float x1 = acc[0][0], x2 = acc[1][0];
+#pragma unroll
+        for (int b = 1; b < kBatchTile; ++b) {
+          if (lane == b) {
+            x1 = acc[0][b];
+            x2 = acc[1][b];
+          }
+        }
+        x1 += p.b1 != nullptr ? float(p.b1[h]) : 0.0f;
+        x2 += p.b2 != nullptr ? float(p.b2[h]) : 0.0f;
+        float x3 = x1 / (1.0f + expf(-x1));
+        p.x4[(b0 + lane) * p.H + h] = scalar_t(x3 * x2);
+      }
+    }
+  }
+
+  cooperative_groups::this_grid().sync();
+
+  // out[:, o] = x4 @ w3[o] + b3[o]
+  for (int o = warp_id; o < p.O; o += num_warps) {
+    const Row w[1] = {p.w3.row(o)};
+    for (int b0 = 0; b0 < p.B; b0 += kBatchTile) {
+      float acc[1][kBatchTile];
+      int num_rows = min(kBatchTile, p.B - b0);
+      batched_dot<scalar_t, Row, 1>(
+          p.x4 + b0 * p.H, p.H, num_rows, w, p.H, acc);
+      if (lane < num_rows) {
+        float x5 = acc[0][0];
+#pragma unroll
+        for (int b = 1; b < kBatchTile; ++b) {
+          if (lane == b) {
+            x5 = acc[0][b];
+          }
+        }
+        x5 += p.b3 != nullptr ? float(p.b3[o]) : 0.0f;
+        p.out[(b0 + lane) * p.O + o] = scalar_t(x5);
+      }
+    }
+  }
+}
+
+void check_small_batch_inputs(
+    const at::Tensor& x,
+    int64_t H,
+    int64_t O,
+    const c10::optional<at::Tensor>& b1b2,
+    const c10::optional<at::Tensor>& b3
+) {
+  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(x.size(0) <= kMaxBatch, "swiglu_fused_small_batch: at most ", kMaxBatch, " rows are supported");
+  TORCH_CHECK(
+    x.stride(1) == 1 && x.size(1) % kVec == 0 && x.stride(0) % kVec == 0 && H % kVec == 0,
+    "swiglu_fused_small_batch: the sizes and strides must be multiples of ", kVec);
+  if (b1b2.has_value()) {
+    TORCH_CHECK(b1b2->dim() == 2 && b1b2->size(0) == 2 && b1b2->size(1) == H);
+    TORCH_CHECK(b1b2->scalar_type() == x.scalar_type());
+  }
+  if (b3.has_value()) {
+    TORCH_CHECK(b3->dim() == 1 && b3->size(0) == O);
+    TORCH_CHECK(b3->scalar_type() == x.scalar_type());
+  }
+}
+
+// Launches the kernel for any format of the weights, once they are checked
+template <typename scalar_t, typename Weights>
+at::Tensor launch_small_batch(
+    const at::Tensor& x,
+    Weights w1,
+    Weights w2,
+    const c10::optional<at::Tensor>& b1b2,
+    Weights w3,
+    const c10::optional<at::Tensor>& b3,
+    int64_t H,
+    int64_t O
+) {
+  int64_t B = x.size(0);
+  at::cuda::CUDAGuard device_guard(x.device());
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  cudaDeviceProp* props = at::cuda::getDeviceProperties(x.device().index());
+  TORCH_CHECK(props->cooperativeLaunch, "swiglu_fused_small_batch: cooperative launches are not supported");
+
+  at::Tensor out = at::empty({B, O}, x.options());
+  if (B == 0) {
+    return out;
+  }
+  at::Tensor x4 = at::empty({B, H}, x.options());
+  // contiguous copies of the (small) biases, so that they can be indexed
+  at::Tensor b1b2_c = b1b2.has_value() ? b1b2->contiguous() : at::Tensor();
+  at::Tensor b3_c = b3.has_value() ? b3->contiguous() : at::Tensor();
+
+  SwiGLUSmallBatchParams<scalar_t, Weights> p;
+  p.x = x.data_ptr<scalar_t>();
+  p.w1 = w1;
+  p.w2 = w2;
+  p.b1 = b1b2_c.defined() ? b1b2_c.data_ptr<scalar_t>() : nullptr;
+  p.b2 = b1b2_c.defined() ? p.b1 + H : nullptr;
+  p.w3 = w3;
+  p.b3 = b3_c.defined() ? b3_c.data_ptr<scalar_t>() : nullptr;
+  p.x4 = x4.data_ptr<scalar_t>();
+  p.out = out.data_ptr<scalar_t>();
+  p.x_stride = x.stride(0);
+  p.B = B;
+  p.I = x.size(1);
+  p.H = H;
+  p.O = O;
+
+  auto kernel = swiglu_fused_small_batch_kernel<scalar_t, Weights>;
+  int blocks_per_sm = 0;
+  AT_CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+    &blocks_per_sm, kernel, kWarpsPerBlock * 32, 0));
+  TORCH_INTERNAL_ASSERT(blocks_per_sm > 0);
+  // No more blocks than can be resident (for the grid sync), nor than
+  // there are units to compute
+  int64_t max_units = std::max(H, O);
+  int grid = std::min<int64_t>(
+    int64_t(blocks_per_sm) * props->multiProcessorCount,
+    (max_units + kWarpsPerBlock - 1) / kWarpsPerBlock);
+  void* args[] = {&p};
+  AT_CUDA_CHECK(cudaLaunchCooperativeKernel(
+    (void*)kernel, dim3(grid), dim3(kWarpsPerBlock * 32), args, 0, stream));
+  return out;
+}
+
+at::Tensor swiglu_fused_small_batch(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const c10::optional<at::Tensor>& b3
+) {
+  TORCH_CHECK(w1w2.dim() == 3 && w1w2.size(0) == 2);
+  TORCH_CHECK(w3.dim() == 2);
+  int64_t H = w1w2.size(1);
+  int64_t O = w3.size(0);
+  check_small_batch_inputs(x, H, O, b1b2, b3);
+  TORCH_CHECK(w1w2.size(2) == x.size(1));
+  TORCH_CHECK(w3.size(1) == H);
+  TORCH_CHECK(
+    w1w2.stride(2) == 1 && w3.stride(1) == 1 &&
+    w1w2.stride(0) == H * w1w2.stride(1),
+    "swiglu_fused_small_batch: the inputs should be contiguous in their last dimension");
+  TORCH_CHECK(
+    w1w2.stride(1) % kVec == 0 && w3.stride(0) % kVec == 0,
+    "swiglu_fused_small_batch: the sizes and strides must be multiples of ", kVec);
+  TORCH_CHECK(w1w2.scalar_type() == x.scalar_type());
+  TORCH_CHECK(w3.scalar_type() == x.scalar_type());
+
+  at::Tensor out;
+  AT_DISPATCH_REDUCED_FLOATING_TYPES(x.scalar_type(), "swiglu_fused_small_batch", [&] {
+    using Weights = DenseWeights<scalar_t>;
+    const scalar_t* w1 = w1w2.data_ptr<scalar_t>();
+    out = launch_small_batch<scalar_t>(
+      x,
+      Weights{w1, w1w2.stride(1)},
+      Weights{w1 + w1w2.stride(0), w1w2.stride(1)},
+      b1b2,
+      Weights{w3.data_ptr<scalar_t>(), w3.stride(0)},
+      b3,
+      H,
+      O);
+  });
+  return out;
+}
+
+// `q` [..., N, K] (int8) or [..., N, K / 2] (int4, as uint8) and `scale`
+// [..., N, G]: returns the size of the groups (K / G)
+int64_t check_quantized_weight(const at::Tensor& q, const at::Tensor& scale, int64_t K, const at::Tensor& x) {
+  TORCH_CHECK(
+    q.scalar_type() == at::ScalarType::Char || q.scalar_type() == at::ScalarType::Byte,
+    "quantized weights should be int8, or int4 packed in uint8");
+  bool int4 = q.scalar_type() == at::ScalarType::Byte;
+  TORCH_CHECK(q.size(-1) == (int4 ? K / 2 : K), "quantized weights: unexpected size ", q.size(-1), " for ", K, " inputs");
+  TORCH_CHECK(scale.dim() == q.dim());
+  for (int64_t i = 0; i < q.dim() - 1; ++i) {
+    TORCH_CHECK(scale.size(i) == q.size(i), "quantized weights: the scales should have one row per row of the weights");
+  }
+  TORCH_CHECK(scale.scalar_type() == x.scalar_type(), "quantized weights: the scales should be of the type of x");
+  TORCH_CHECK(scale.stride(-1) == 1 && q.stride(-1) == 1);
+  int64_t G = scale.size(-1);
+  TORCH_CHECK(G > 0 && K % G == 0 && (K / G) % kVec == 0,
+    "quantized weights: the groups should be of a size multiple of ", kVec);
+  // 128-bit loads of the activations, 64/32-bit loads of the weights
+  TORCH_CHECK(q.stride(-2) % (int4 ? kVec / 2 : kVec) == 0,
+    "quantized weights: the strides must be multiples of ", int4 ? kVec / 2 : kVec);
+  return K / G;
+}
+
+at::Tensor swiglu_fused_small_batch_quantized(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const at::Tensor& w1w2_scale,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const at::Tensor& w3_scale,
+    const c10::optional<at::Tensor>& b3
+) {
+  TORCH_CHECK(w1w2.dim() == 3 && w1w2.size(0) == 2);
+  TORCH_CHECK(w3.dim() == 2);
+  TORCH_CHECK(w1w2.scalar_type() == w3.scalar_type(), "w1w2 and w3 should be quantized the same way");
+  int64_t H = w1w2.size(1);
+  int64_t O = w3.size(0);
+  check_small_batch_inputs(x, H, O, b1b2, b3);
+  int64_t group_size_12 = check_quantized_weight(w1w2, w1w2_scale, x.size(1), x);
+  int64_t group_size_3 = check_quantized_weight(w3, w3_scale, H, x);
+  TORCH_CHECK(
+    w1w2.stride(0) == H * w1w2.stride(1) && w1w2_scale.stride(0) == H * w1w2_scale.stride(1),
+    "swiglu_fused_small_batch_quantized: w1 and w2 should be packed");
+
+  at::Tensor out;
+  AT_DISPATCH_REDUCED_FLOATING_TYPES(x.scalar_type(), "swiglu_fused_small_batch_quantized", [&] {
+    auto launch = [&](auto weights_tag) {
+      using Weights = decltype(weights_tag);
+      const uint8_t* w1 = static_cast<const uint8_t*>(w1w2.data_ptr());
+      const scalar_t* s1 = w1w2_scale.data_ptr<scalar_t>();
+      out = launch_small_batch<scalar_t>(
+        x,
+        Weights{w1, w1w2.stride(1), s1, w1w2_scale.stride(1), int(group_size_12)},
+        Weights{w1 + w1w2.stride(0), w1w2.stride(1), s1 + w1w2_scale.stride(0), w1w2_scale.stride(1), int(group_size_12)},
+        b1b2,
+        Weights{static_cast<const uint8_t*>(w3.data_ptr()), w3.stride(0), w3_scale.data_ptr<scalar_t>(), w3_scale.stride(0), int(group_size_3)},
+        b3,
+        H,
+        O);
+    };
+    if (w1w2.scalar_type() == at::ScalarType::Byte) {
+      launch(QuantizedWeights<scalar_t, true>{});
+    } else {
+      launch(QuantizedWeights<scalar_t, false>{});
+    }
+  });
+  return out;
+}
+
+at::Tensor swiglu_fused_small_batch_autocast(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const c10::optional<at::Tensor>& b3
+) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return swiglu_fused_small_batch(
+    at::autocast::cached_cast(exec_type, x),
+    at::autocast::cached_cast(exec_type, w1w2),
+    at::autocast::cached_cast(exec_type, b1b2),
+    at::autocast::cached_cast(exec_type, w3),
+    at::autocast::cached_cast(exec_type, b3)
+  );
+}
+
+// The quantized weights are kept as they are: only the activations, the
+// scales and the biases are cast
+at::Tensor swiglu_fused_small_batch_quantized_autocast(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const at::Tensor& w1w2_scale,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const at::Tensor& w3_scale,
+    const c10::optional<at::Tensor>& b3
+) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return swiglu_fused_small_batch_quantized(
+    at::autocast::cached_cast(exec_type, x),
+    w1w2,
+    at::autocast::cached_cast(exec_type, w1w2_scale),
+    at::autocast::cached_cast(exec_type, b1b2),
+    w3,
+    at::autocast::cached_cast(exec_type, w3_scale),
+    at::autocast::cached_cast(exec_type, b3)
+  );
+}
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch"),
+      TORCH_FN(swiglu_fused_small_batch));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch_quantized"),
+      TORCH_FN(swiglu_fused_small_batch_quantized));
+}
+
+TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch"),
+      TORCH_FN(swiglu_fused_small_batch_autocast));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch_quantized"),
+      TORCH_FN(swiglu_fused_small_batch_quantized_autocast));
+}
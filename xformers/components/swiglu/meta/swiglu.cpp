@@ -0,0 +1,156 @@
+#include <ATen/ATen.h>
+#include <torch/library.h>
+#include <tuple>
+#include <vector>
+
+#include "../swiglu_utils.h"
+
+// Shape-only kernels of the SwiGLU ops for the Meta dispatch key, so that
+// they can be traced with FakeTensors (eg by `torch.compile`). The forward
+// and backward of `swiglu_packedw` only dispatch to these ops and to ATen
+// ops, so they are traced through as well.
+// `sparse24_compress` is not included: it is a one-off conversion of the
+// weights, and the size of its metadata depends on the kernel
+namespace {
+
+std::tuple<at::Tensor, at::Tensor, at::Tensor>
+dual_gemm_silu_identity_mul_meta(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  TORCH_CHECK(x.dim() >= 1);
+  TORCH_CHECK(w0.dim() == 2);
+  TORCH_CHECK(w1.sizes() == w0.sizes());
+  TORCH_CHECK(x.size(-1) == w0.size(1));
+  auto out_shape = with_last_dim(x, w0.size(0));
+  return std::make_tuple(
+      at::empty(out_shape, x.options()),
+      at::empty(out_shape, x.options()),
+      at::empty(out_shape, x.options()));
+}
+
+at::Tensor dual_gemm_silu_identity_mul_no_grad_meta(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1) {
+  TORCH_CHECK(x.dim() >= 1);
+  TORCH_CHECK(w0.dim() == 2);
+  TORCH_CHECK(w1.sizes() == w0.sizes());
+  TORCH_CHECK(x.size(-1) == w0.size(1));
+  return at::empty(with_last_dim(x, w0.size(0)), x.options());
+}
+
+at::Tensor swiglu_fused_small_batch_meta(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const c10::optional<at::Tensor>& b3) {
+  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(w1w2.dim() == 3 && w1w2.size(0) == 2);
+  TORCH_CHECK(w3.dim() == 2 && w3.size(1) == w1w2.size(1));
+  return at::empty({x.size(0), w3.size(0)}, x.options());
+}
+
+at::Tensor swiglu_fused_small_batch_quantized_meta(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const at::Tensor& w1w2_scale,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const at::Tensor& w3_scale,
+    const c10::optional<at::Tensor>& b3) {
+  TORCH_CHECK(x.dim() == 2);
+  TORCH_CHECK(w3.dim() == 2);
+  return at::empty({x.size(0), w3.size(0)}, x.options());
+}
+
+at::Tensor sparse24_linear_meta(
+    const at::Tensor& x,
+    const at::Tensor& values,
+    const at::Tensor& meta) {
+  TORCH_CHECK(x.dim() == 2 && values.dim() == 2 && meta.dim() == 2);
+  TORCH_CHECK(values.size(1) * 2 == x.size(1));
+  // Computed transposed, see `cuda/sparse24_linear.cu`
+  return at::empty({values.size(0), x.size(0)}, x.options()).t();
+}
+
+std::tuple<at::Tensor, at::Tensor> silu_bw_fused_meta(
+    const at::Tensor& x1,
+    const at::Tensor& x2,
+    const at::Tensor& dx4) {
+  TORCH_CHECK(x2.dim() >= 1);
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(dx4.sizes() == x2.sizes());
+  std::vector<int64_t> dx1dx2_shape = x2.sizes().vec();
+  dx1dx2_shape.insert(dx1dx2_shape.end() - 1, 2);
+  return std::make_tuple(
+      at::empty(dx1dx2_shape, x2.options()),
+      at::empty(x2.sizes(), x2.options()));
+}
+
+std::tuple<at::Tensor, at::Tensor> gemm_silu_bw_fused_meta(
+    const at::Tensor& dx5,
+    const at::Tensor& w3,
+    const at::Tensor& x1,
+    const at::Tensor& x2) {
+  TORCH_CHECK(dx5.dim() >= 1);
+  TORCH_CHECK(w3.dim() == 2);
+  TORCH_CHECK(dx5.size(-1) == w3.size(0));
+  TORCH_CHECK(x1.sizes() == x2.sizes());
+  TORCH_CHECK(x2.sizes() == at::IntArrayRef(with_last_dim(dx5, w3.size(1))));
+  std::vector<int64_t> dx1dx2_shape = x2.sizes().vec();
+  dx1dx2_shape.insert(dx1dx2_shape.end() - 1, 2);
+  return std::make_tuple(
+      at::empty(dx1dx2_shape, x2.options()),
+      at::empty(x2.sizes(), x2.options()));
+}
+
+std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum_meta(
+    const at::Tensor& a,
+    const at::Tensor& b,
+    at::Tensor& out_mm,
+    at::Tensor& out_sum,
+    bool accumulate) {
+  TORCH_CHECK(a.dim() == 2);
+  TORCH_CHECK(b.dim() == 2);
+  TORCH_CHECK(out_mm.dim() == 2);
+  TORCH_CHECK(out_mm.size(0) == a.size(0));
+  TORCH_CHECK(out_mm.size(1) == b.size(1));
+  TORCH_CHECK(out_sum.dim() == 1);
+  // Written in place
+  return std::make_tuple(out_mm, out_sum);
+}
+
+} // namespace
+
+TORCH_LIBRARY_IMPL(xformers, Meta, m) {
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul"),
+      TORCH_FN(dual_gemm_silu_identity_mul_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::dual_gemm_silu_identity_mul_no_grad"),
+      TORCH_FN(dual_gemm_silu_identity_mul_no_grad_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch"),
+      TORCH_FN(swiglu_fused_small_batch_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::swiglu_fused_small_batch_quantized"),
+      TORCH_FN(swiglu_fused_small_batch_quantized_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::sparse24_linear"),
+      TORCH_FN(sparse24_linear_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::silu_bw_fused"),
+      TORCH_FN(silu_bw_fused_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_silu_bw_fused"),
+      TORCH_FN(gemm_silu_bw_fused_meta));
+  m.impl(
+      TORCH_SELECTIVE_NAME("xformers::gemm_fused_operand_sum"),
+      TORCH_FN(gemm_fused_operand_sum_meta));
+}
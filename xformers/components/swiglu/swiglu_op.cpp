@@ -3,8 +3,20 @@
 TORCH_LIBRARY_FRAGMENT(xformers, m) {
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::dual_gemm_silu_identity_mul(Tensor x, Tensor w1, Tensor? b1, Tensor w2, Tensor? b2) -> (Tensor, Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::dual_gemm_silu_identity_mul_no_grad(Tensor x, Tensor w1, Tensor? b1, Tensor w2, Tensor? b2) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::swiglu_fused_small_batch(Tensor x, Tensor w1w2, Tensor? b1b2, Tensor w3, Tensor? b3) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::swiglu_fused_small_batch_quantized(Tensor x, Tensor w1w2, Tensor w1w2_scale, Tensor? b1b2, Tensor w3, Tensor w3_scale, Tensor? b3) -> Tensor"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse24_compress(Tensor w) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::sparse24_linear(Tensor x, Tensor values, Tensor meta) -> Tensor"));
   m.def(TORCH_SELECTIVE_SCHEMA(
       "xformers::silu_bw_fused(Tensor x1, Tensor x2, Tensor dx4) -> (Tensor, Tensor)"));
   m.def(TORCH_SELECTIVE_SCHEMA(
-      "xformers::gemm_fused_operand_sum(Tensor a, Tensor b, Tensor out_mm, Tensor out_sum) -> (Tensor, Tensor)"));
+      "xformers::gemm_silu_bw_fused(Tensor dx5, Tensor w3, Tensor x1, Tensor x2) -> (Tensor, Tensor)"));
+  m.def(TORCH_SELECTIVE_SCHEMA(
+      "xformers::gemm_fused_operand_sum(Tensor a, Tensor b, Tensor out_mm, Tensor out_sum, bool accumulate=False) -> (Tensor, Tensor)"));
 }
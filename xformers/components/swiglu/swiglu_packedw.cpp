@@ -1,9 +1,16 @@
 #include <ATen/core/dispatch/Dispatcher.h>
 #include <ATen/autocast_mode.h>
+#include <ATen/core/grad_mode.h>
+#include <c10/core/Event.h>
+#include <c10/core/StreamGuard.h>
+#include <c10/core/impl/VirtualGuardImpl.h>
 #include <torch/library.h>
 #include <torch/csrc/autograd/custom_function.h>
+#include <torch/csrc/autograd/variable.h>
 #include <torch/csrc/api/include/torch/nn/modules/linear.h>
 
+#include "swiglu_utils.h"
+
 namespace {
 // Kernels implemented in `cuda/`
 std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
@@ -18,6 +25,54 @@ std::tuple<at::Tensor, at::Tensor, at::Tensor> dual_gemm_silu_identity_mul(
     .typed<decltype(dual_gemm_silu_identity_mul)>();
   return op.call(x, w0, b0, w1, b1);
 }
+at::Tensor dual_gemm_silu_identity_mul_no_grad(
+    const at::Tensor& x,
+    const at::Tensor& w0,
+    const c10::optional<at::Tensor>& b0,
+    const at::Tensor& w1,
+    const c10::optional<at::Tensor>& b1
+) {
+  static auto op = c10::Dispatcher::singleton()
+    .findSchemaOrThrow("xformers::dual_gemm_silu_identity_mul_no_grad", "")
+    .typed<decltype(dual_gemm_silu_identity_mul_no_grad)>();
+  return op.call(x, w0, b0, w1, b1);
+}
+at::Tensor swiglu_fused_small_batch(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const c10::optional<at::Tensor>& b3
+) {
+  static auto op = c10::Dispatcher::singleton()
+    .findSchemaOrThrow("xformers::swiglu_fused_small_batch", "")
+    .typed<decltype(swiglu_fused_small_batch)>();
+  return op.call(x, w1w2, b1b2, w3, b3);
+}
+at::Tensor swiglu_fused_small_batch_quantized(
+    const at::Tensor& x,
+    const at::Tensor& w1w2,
+    const at::Tensor& w1w2_scale,
+    const c10::optional<at::Tensor>& b1b2,
+    const at::Tensor& w3,
+    const at::Tensor& w3_scale,
+    const c10::optional<at::Tensor>& b3
+) {
+  static auto op = c10::Dispatcher::singleton()
+    .findSchemaOrThrow("xformers::swiglu_fused_small_batch_quantized", "")
+    .typed<decltype(swiglu_fused_small_batch_quantized)>();
+  return op.call(x, w1w2, w1w2_scale, b1b2, w3, w3_scale, b3);
+}
+at::Tensor sparse24_linear(
+    const at::Tensor& x,
+    const at::Tensor& values,
+    const at::Tensor& meta
+) {
+  static auto op = c10::Dispatcher::singleton()
+    .findSchemaOrThrow("xformers::sparse24_linear", "")
+    .typed<decltype(sparse24_linear)>();
+  return op.call(x, values, meta);
+}
 std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
     const at::Tensor& x1,
     const at::Tensor& x2,
@@ -28,16 +83,28 @@ std::tuple<at::Tensor, at::Tensor> silu_bw_fused(
     .typed<decltype(silu_bw_fused)>();
   return op.call(x1, x2, dx4);
 }
+std::tuple<at::Tensor, at::Tensor> gemm_silu_bw_fused(
+    const at::Tensor& dx5,
+    const at::Tensor& w3,
+    const at::Tensor& x1,
+    const at::Tensor& x2
+) {
+  static auto op = c10::Dispatcher::singleton()
+    .findSchemaOrThrow("xformers::gemm_silu_bw_fused", "")
+    .typed<decltype(gemm_silu_bw_fused)>();
+  return op.call(dx5, w3, x1, x2);
+}
 std::tuple<at::Tensor, at::Tensor> gemm_fused_operand_sum(
     const at::Tensor& a,
     const at::Tensor& b,
     at::Tensor& out_mm,
-    at::Tensor& out_sum
+    at::Tensor& out_sum,
+    bool accumulate
 ) {
   static auto op = c10::Dispatcher::singleton()
     .findSchemaOrThrow("xformers::gemm_fused_operand_sum", "")
     .typed<decltype(gemm_fused_operand_sum)>();
-  return op.call(a, b, out_mm, out_sum);
+  return op.call(a, b, out_mm, out_sum, accumulate);
 }
 
 bool shapesMatch(at::Tensor x, std::vector<int64_t> expectedShape) {
@@ -69,11 +136,91 @@ std::string shapeToStr(c10::IntArrayRef shape) {
     #X, shapeToStr(X.sizes()).c_str(), shapeToStr({__VA_ARGS__}).c_str() \
   );
 
+// For decode-size batches, the whole MLP runs in a single (persistent)
+// kernel, which does not write x1 / x2 at all. Only possible when they are
+// not needed for the backward
+bool use_fused_small_batch(const at::Tensor& x, const at::Tensor& w1w2, const at::Tensor& w3) {
+  return x.size(0) <= 64 && x.is_cuda() &&
+    x.stride(1) == 1 && x.stride(0) % 8 == 0 &&
+    w1w2.is_contiguous() && w1w2.size(1) % 8 == 0 && w1w2.size(2) % 8 == 0 &&
+    w3.stride(1) == 1 && w3.stride(0) % 8 == 0;
+}
+
+// With `accumulate_grad`, the gradients of the weights are added directly
+// into the `.grad` of the parameters once it exists (eg from the previous
+// micro-batch), instead of being allocated and then added by autograd.
+// This is only possible when the input is a whole parameter or a view
+// covering all of it (like `w1w2` for a packed `w12.weight`).
+// As this bypasses `AccumulateGrad`, parameters with gradient hooks (user
+// hooks, but also DDP/FSDP which reduce the gradients from such hooks) keep
+// getting their gradients through autograd
+bool has_grad_hooks(const at::Tensor& leaf) {
+  auto grad_acc = torch::autograd::impl::try_get_grad_accumulator(leaf);
+  if (grad_acc != nullptr &&
+      (!grad_acc->pre_hooks().empty() || !grad_acc->tensor_pre_hooks().empty() ||
+       !grad_acc->post_hooks().empty())) {
+    return true;
+  }
+  return !torch::autograd::impl::hooks(leaf).empty() ||
+    torch::autograd::impl::post_acc_grad_hooks(leaf) != nullptr;
+}
+
+at::Tensor grad_accumulation_leaf(const at::Tensor& w) {
+  if (!w.requires_grad() || !w.is_contiguous()) {
+    return at::Tensor();
+  }
+  at::Tensor leaf = w.is_view() ? w._base() : w;
+  if (!leaf.is_leaf() || !leaf.is_contiguous() ||
+      leaf.numel() != w.numel() || leaf.storage_offset() != w.storage_offset() ||
+      has_grad_hooks(leaf)) {
+    return at::Tensor();
+  }
+  return leaf;
+}
+
+at::Tensor grad_accumulation_buffer(torch::autograd::AutogradContext *ctx, const std::string& name, c10::IntArrayRef shape, at::ScalarType dtype) {
+  auto it = ctx->saved_data.find(name);
+  if (it == ctx->saved_data.end() || at::GradMode::is_enabled()) {
+    return at::Tensor();
+  }
+  at::Tensor leaf = it->second.toTensor();
+  at::Tensor grad = leaf.defined() ? leaf.grad() : at::Tensor();
+  if (!grad.defined() || grad.layout() != at::kStrided ||
+      grad.requires_grad() || grad.scalar_type() != dtype ||
+      !grad.is_contiguous()) {
+    return at::Tensor();
+  }
+  return grad.view(shape);
+}
+
 class SwiGLUPackedWeights : public torch::autograd::Function<SwiGLUPackedWeights> {
  public:
   static at::Tensor forward(
-      torch::autograd::AutogradContext *ctx, const at::Tensor& x, const at::Tensor& w1w2, const c10::optional<at::Tensor>& b1b2, const at::Tensor w3, const c10::optional<at::Tensor>& b3) {
+      torch::autograd::AutogradContext *ctx, const at::Tensor& x_nd, const at::Tensor& w1w2, const c10::optional<at::Tensor>& b1b2, const at::Tensor w3, const c10::optional<at::Tensor>& b3, bool recompute, bool accumulate_grad, bool overlap_wgrad) {
     at::AutoDispatchBelowADInplaceOrView g;
+    ctx->saved_data["overlap_wgrad"] = overlap_wgrad;
+    if (accumulate_grad) {
+      ctx->saved_data["leaf_w1w2"] = grad_accumulation_leaf(w1w2);
+      ctx->saved_data["leaf_w3"] = grad_accumulation_leaf(w3);
+      if (b1b2.has_value()) {
+        ctx->saved_data["leaf_b1b2"] = grad_accumulation_leaf(b1b2.value());
+      }
+      if (b3.has_value()) {
+        ctx->saved_data["leaf_b3"] = grad_accumulation_leaf(b3.value());
+      }
+    }
+    // [..., I] inputs are computed as a [-1, I] matrix, in place if its
+    // rows are strided
+    auto x = flatten_to_matrix(x_nd);
+    auto out_shape = with_last_dim(x_nd, w3.size(0));
+    ctx->saved_data["x_shape"] = x_nd.sizes().vec();
+    if (recompute && use_fused_small_batch(x, w1w2, w3)) {
+      ctx->save_for_backward({x, w1w2, w3, b1b2.has_value() ? b1b2.value() : at::Tensor()});
+      ctx->saved_data["recompute"] = true;
+      ctx->saved_data["has_b1b2"] = b1b2.has_value();
+      ctx->saved_data["has_b3"] = b3.has_value();
+      return swiglu_fused_small_batch(x, w1w2, b1b2, w3, b3).view(out_shape);
+    }
     auto w1 = w1w2[0];
     auto w2 = w1w2[1];
     c10::optional<at::Tensor> b1, b2;
@@ -81,29 +228,51 @@ class SwiGLUPackedWeights : public torch::autograd::Function<SwiGLUPackedWeights
       b1 = b1b2.value()[0];
       b2 = b1b2.value()[1];
     }
+    // With `recompute`, only x is kept and x1 / x2 are computed again in
+    // the backward: the forward only needs to write x4
     at::Tensor x1, x2, x4;
-    std::tie(x1, x2, x4) = dual_gemm_silu_identity_mul(x, w1, b1, w2, b2);
+    if (recompute) {
+      x4 = dual_gemm_silu_identity_mul_no_grad(x, w1, b1, w2, b2);
+    } else {
+      std::tie(x1, x2, x4) = dual_gemm_silu_identity_mul(x, w1, b1, w2, b2);
+    }
     auto x5 = torch::nn::functional::linear(x4, w3, b3.has_value() ? b3.value() : at::Tensor());
 
-    ctx->save_for_backward({x, w1w2, w3, x1, x2});
+    if (recompute) {
+      ctx->save_for_backward({x, w1w2, w3, b1b2.has_value() ? b1b2.value() : at::Tensor()});
+    } else {
+      ctx->save_for_backward({x, w1w2, w3, x1, x2});
+    }
+    ctx->saved_data["recompute"] = recompute;
     ctx->saved_data["has_b1b2"] = b1b2.has_value();
     ctx->saved_data["has_b3"] = b3.has_value();
-    return x5;
+    return x5.view(out_shape);
   }
 
   static torch::autograd::variable_list backward(torch::autograd::AutogradContext *ctx, torch::autograd::variable_list grad_outputs) {
     at::AutoDispatchBelowADInplaceOrView g;
 
     // Unpack variables
-    auto dx5 = grad_outputs[0];
+    auto dx5 = flatten_to_matrix(grad_outputs[0]);
     auto saved = ctx->get_saved_variables();
     auto x = saved[0];
     auto w1w2 = saved[1];
     auto w3 = saved[2];
-    auto x1 = saved[3];
-    auto x2 = saved[4];
     bool has_b1b2 = ctx->saved_data["has_b1b2"].toBool();
     bool has_b3 = ctx->saved_data["has_b3"].toBool();
+    bool overlap_wgrad = ctx->saved_data["overlap_wgrad"].toBool();
+    at::Tensor x1, x2;
+    if (ctx->saved_data["recompute"].toBool()) {
+      c10::optional<at::Tensor> b1, b2;
+      if (has_b1b2) {
+        b1 = saved[3][0];
+        b2 = saved[3][1];
+      }
+      std::tie(x1, x2, std::ignore) = dual_gemm_silu_identity_mul(x, w1w2[0], b1, w1w2[1], b2);
+    } else {
+      x1 = saved[3];
+      x2 = saved[4];
+    }
     int64_t B = x.size(0);
     int64_t H = x2.size(1);
     int64_t I = x.size(1);
@@ -117,68 +286,262 @@ class SwiGLUPackedWeights : public torch::autograd::Function<SwiGLUPackedWeights
     // Compute BW
     at::Tensor dx1dx2, x4;
     TORCH_INTERNAL_ASSERT(dx5.size(1) == w3.size(0));
-    auto dx4 = torch::mm(dx5, w3);
-    std::tie(dx1dx2, x4) = silu_bw_fused(x1, x2, dx4);
+    // dx4 = dx5 @ w3 only goes through registers when the silu backward is
+    // fused in the epilogue of the gemm, which needs 128-bit aligned rows
+    bool fuse_dx4 = dx5.is_cuda() && dx5.stride(1) == 1 && dx5.stride(0) % 8 == 0 &&
+      w3.stride(1) == 1 && w3.stride(0) % 8 == 0 && O % 8 == 0 && H % 8 == 0;
+    if (fuse_dx4) {
+      std::tie(dx1dx2, x4) = gemm_silu_bw_fused(dx5, w3, x1, x2);
+    } else {
+      auto dx4 = torch::mm(dx5, w3);
+      std::tie(dx1dx2, x4) = silu_bw_fused(x1, x2, dx4);
+    }
     TORCH_INTERNAL_ASSERT_SHAPE(dx1dx2, B, 2, H);
     TORCH_INTERNAL_ASSERT_SHAPE(x4, B, H);
     x1.reset();
     x2.reset();
-    dx4.reset();
 
-    at::Tensor db3, dw3;
+    TORCH_INTERNAL_ASSERT(dx1dx2.is_contiguous());
+    TORCH_INTERNAL_ASSERT(w1w2.is_contiguous());
+    TORCH_INTERNAL_ASSERT(dx5.size(0) == x4.size(0));
+    w1w2 = w1w2.view({2 * H, I});
+    dx1dx2 = dx1dx2.view({B, 2 * H});
 
+    // Weight gradients: the outputs are allocated on the current stream,
+    // even when they are computed on the side stream
+    auto dw3_acc = grad_accumulation_buffer(ctx, "leaf_w3", {O, H}, dx5.scalar_type());
+    auto db3_acc = grad_accumulation_buffer(ctx, "leaf_b3", {O}, dx5.scalar_type());
+    bool accumulate_3 = dw3_acc.defined() && (!has_b3 || db3_acc.defined());
+    auto dw1dw2_acc = grad_accumulation_buffer(ctx, "leaf_w1w2", {2 * H, I}, dx1dx2.scalar_type());
+    auto db1db2_acc = grad_accumulation_buffer(ctx, "leaf_b1b2", {2 * H}, dx1dx2.scalar_type());
+    bool accumulate_12 = dw1dw2_acc.defined() && (!has_b1b2 || db1db2_acc.defined());
+    at::Tensor dw3 = accumulate_3 ? dw3_acc : torch::empty({O, H}, w3.options());
+    at::Tensor dw1dw2 = accumulate_12 ? dw1dw2_acc : torch::empty({2 * H, I}, w1w2.options());
+    at::Tensor db3, db1db2;
     if (has_b3) {
-      db3 = torch::empty({O}, w3.options());
-      dw3 = torch::empty({O, H}, w3.options());
-      TORCH_INTERNAL_ASSERT(dx5.size(0) == x4.size(0));
-      gemm_fused_operand_sum(dx5.transpose(-2, -1), x4, dw3, db3);
-    } else {
-      dw3 = torch::mm(dx5.transpose(-2, -1), x4);
+      db3 = accumulate_3 ? db3_acc : torch::empty({O}, w3.options());
+    }
+    if (has_b1b2) {
+      db1db2 = accumulate_12 ? db1db2_acc : torch::empty({2 * H}, w1w2.options());
+    }
+
+    // With `overlap_wgrad` (on CUDA), the weight gradients are computed on a side
+    // stream, concurrently with dx on the current stream. Their inputs are
+    // recorded on the side stream, so that their memory is not reused by
+    // the current stream before they are consumed
+    const c10::Device device = dx5.device();
+    c10::impl::VirtualGuardImpl guard_impl(device.type());
+    c10::optional<c10::Stream> wgrad_stream;
+    if (overlap_wgrad && device.is_cuda()) {
+      wgrad_stream = guard_impl.getStreamFromGlobalPool(device);
+      c10::Event inputs_ready(device.type());
+      inputs_ready.record(guard_impl.getStream(device));
+      inputs_ready.block(*wgrad_stream);
+      for (const at::Tensor& t : {dx5, x4, dx1dx2, x}) {
+        guard_impl.recordDataPtrOnStream(t.storage().data_ptr(), *wgrad_stream);
+      }
+    }
+    {
+      c10::OptionalStreamGuard stream_guard(wgrad_stream);
+      if (has_b3) {
+        gemm_fused_operand_sum(dx5.transpose(-2, -1), x4, dw3, db3, accumulate_3);
+      } else if (accumulate_3) {
+        dw3.addmm_(dx5.transpose(-2, -1), x4);
+      } else {
+        torch::mm_out(dw3, dx5.transpose(-2, -1), x4);
+      }
+
+      // backward of linear1 + linear2 - packed
+      if (has_b1b2) {
+        gemm_fused_operand_sum(dx1dx2.transpose(-2, -1), x, dw1dw2, db1db2, accumulate_12);
+      } else if (accumulate_12) {
+        dw1dw2.addmm_(dx1dx2.transpose(-2, -1), x);
+      } else {
+        torch::mm_out(dw1dw2, dx1dx2.transpose(-2, -1), x);
+      }
     }
     x4.reset();
     dx5.reset();
 
-    TORCH_INTERNAL_ASSERT(dx1dx2.is_contiguous());
-    TORCH_INTERNAL_ASSERT(w1w2.is_contiguous());
-
-    w1w2 = w1w2.view({2 * H, I});
-    dx1dx2 = dx1dx2.view({B, 2 * H});
     auto dx = torch::mm(dx1dx2, w1w2);
+    if (wgrad_stream.has_value()) {
+      c10::Event wgrad_done(device.type());
+      wgrad_done.record(*wgrad_stream);
+      wgrad_done.block(guard_impl.getStream(device));
+    }
 
-    // backward of linear1 + linear2 - packed
-    at::Tensor dw1dw2, db1db2;
-    if (has_b1b2) {
-      dw1dw2 = torch::empty({2 * H, I}, w1w2.options());
-      db1db2 = torch::empty({2 * H}, w1w2.options());
-      gemm_fused_operand_sum(dx1dx2.transpose(-2, -1), x, dw1dw2, db1db2);
-      db1db2 = db1db2.view({2, H});
+    if (accumulate_3) {
+      // Already in the `.grad` of the parameters
+      dw3.reset();
+      db3.reset();
+    }
+    if (accumulate_12) {
+      dw1dw2.reset();
+      db1db2.reset();
     } else {
-      dw1dw2 = torch::mm(dx1dx2.transpose(-2, -1), x);
+      dw1dw2 = dw1dw2.view({2, H, I});
+      if (has_b1b2) {
+        db1db2 = db1db2.view({2, H});
+      }
     }
 
-    return {dx, dw1dw2.view({2, H, I}), db1db2, dw3, db3};
+    dx = dx.view(ctx->saved_data["x_shape"].toIntVector());
+    return {dx, dw1dw2, db1db2, dw3, db3, at::Tensor(), at::Tensor(), at::Tensor()};
   }
 };
 
-at::Tensor swiglu_packedw_autograd(const at::Tensor& x, const at::Tensor& w1w2, const c10::optional<at::Tensor> b1b2, const at::Tensor w3, const c10::optional<at::Tensor> b3) {
-  return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3);
+// Inference: x1 / x2 are not needed for the backward, so the dual-gemm only
+// writes x4
+at::Tensor swiglu_packedw_no_grad(const at::Tensor& x_nd, const at::Tensor& w1w2, const c10::optional<at::Tensor>& b1b2, const at::Tensor& w3, const c10::optional<at::Tensor>& b3, bool recompute, bool accumulate_grad, bool overlap_wgrad) {
+  at::AutoDispatchBelowADInplaceOrView g;
+  auto x = flatten_to_matrix(x_nd);
+  auto out_shape = with_last_dim(x_nd, w3.size(0));
+  if (use_fused_small_batch(x, w1w2, w3)) {
+    return swiglu_fused_small_batch(x, w1w2, b1b2, w3, b3).view(out_shape);
+  }
+  c10::optional<at::Tensor> b1, b2;
+  if (b1b2.has_value()) {
+    b1 = b1b2.value()[0];
+    b2 = b1b2.value()[1];
+  }
+  auto x4 = dual_gemm_silu_identity_mul_no_grad(x, w1w2[0], b1, w1w2[1], b2);
+  return torch::nn::functional::linear(x4, w3, b3.has_value() ? b3.value() : at::Tensor()).view(out_shape);
+}
+
+// Weight-only quantized weights `q` (int8, or int4 packed two per byte in
+// uint8, the even input in the low nibble with an offset of 8) with a scale
+// per group of inputs `scale` [..., N, G]
+at::Tensor dequantize_weight(const at::Tensor& q, const at::Tensor& scale) {
+  at::Tensor w;
+  if (q.scalar_type() == at::ScalarType::Byte) {
+    auto low = at::bitwise_and(q, 15);
+    auto high = at::bitwise_right_shift(q, 4);
+    w = at::stack({low, high}, -1).flatten(-2).to(at::kFloat) - 8;
+  } else {
+    TORCH_CHECK(q.scalar_type() == at::ScalarType::Char, "quantized weights should be int8, or int4 packed in uint8");
+    w = q.to(at::kFloat);
+  }
+  std::vector<int64_t> group_shape = w.sizes().vec();
+  int64_t K = group_shape.back();
+  int64_t G = scale.size(-1);
+  TORCH_CHECK(K % G == 0);
+  group_shape.back() = G;
+  group_shape.push_back(K / G);
+  w = w.view(group_shape) * scale.to(at::kFloat).unsqueeze(-1);
+  return w.flatten(-2).to(scale.scalar_type());
+}
+
+// Inference with weight-only quantized w1w2 / w3 (see `dequantize_weight`).
+// Decode-size batches are bound by the loads of the weights, and dequantize
+// them in registers in the fused kernel. Larger batches are compute-bound:
+// the weights are dequantized once, for the regular gemms
+at::Tensor swiglu_packedw_quantized(const at::Tensor& x_nd, const at::Tensor& w1w2, const at::Tensor& w1w2_scale, const c10::optional<at::Tensor>& b1b2, const at::Tensor& w3, const at::Tensor& w3_scale, const c10::optional<at::Tensor>& b3) {
+  at::AutoDispatchBelowADInplaceOrView g;
+  auto x = flatten_to_matrix(x_nd);
+  if (x.size(0) <= 64 && x.stride(1) == 1 && x.stride(0) % 8 == 0) {
+    auto out = swiglu_fused_small_batch_quantized(x, w1w2, w1w2_scale, b1b2, w3, w3_scale, b3);
+    return out.view(with_last_dim(x_nd, w3.size(0)));
+  }
+  return swiglu_packedw_no_grad(
+    x_nd,
+    dequantize_weight(w1w2, w1w2_scale),
+    b1b2,
+    dequantize_weight(w3, w3_scale),
+    b3,
+    false,
+    false,
+    false);
+}
+
+// Inference with 2:4 sparse weights, compressed by `sparse24_compress`:
+// `w1w2` as a [2 * H, I] matrix and `w3` [O, H]. Both projections run on
+// the sparse tensor cores, and the bias / silu / mul in between are
+// elementwise
+at::Tensor swiglu_packedw_sparse24(const at::Tensor& x_nd, const at::Tensor& w1w2_values, const at::Tensor& w1w2_meta, const c10::optional<at::Tensor>& b1b2, const at::Tensor& w3_values, const at::Tensor& w3_meta, const c10::optional<at::Tensor>& b3) {
+  at::AutoDispatchBelowADInplaceOrView g;
+  auto x = flatten_to_matrix(x_nd);
+  TORCH_CHECK(w1w2_values.dim() == 2 && w1w2_values.size(0) % 2 == 0);
+  int64_t H = w1w2_values.size(0) / 2;
+  int64_t O = w3_values.size(0);
+  auto x1x2 = sparse24_linear(x, w1w2_values, w1w2_meta);
+  if (b1b2.has_value()) {
+    x1x2.add_(b1b2->view({2 * H}));
+  }
+  auto x4 = at::empty({x.size(0), H}, x.options());
+  at::mul_out(x4, at::silu(x1x2.narrow(1, 0, H)), x1x2.narrow(1, H, H));
+  x1x2.reset();
+  auto x5 = sparse24_linear(x4, w3_values, w3_meta);
+  if (b3.has_value()) {
+    x5.add_(*b3);
+  }
+  return x5.contiguous().view(with_last_dim(x_nd, O));
+}
+
+at::Tensor swiglu_packedw_autograd(const at::Tensor& x, const at::Tensor& w1w2, const c10::optional<at::Tensor> b1b2, const at::Tensor w3, const c10::optional<at::Tensor> b3, bool recompute, bool accumulate_grad, bool overlap_wgrad) {
+  bool requires_grad = at::GradMode::is_enabled() && (
+    x.requires_grad() || w1w2.requires_grad() || w3.requires_grad() ||
+    (b1b2.has_value() && b1b2->requires_grad()) ||
+    (b3.has_value() && b3->requires_grad()));
+  if (!requires_grad) {
+    return swiglu_packedw_no_grad(x, w1w2, b1b2, w3, b3, recompute, accumulate_grad, overlap_wgrad);
+  }
+  return SwiGLUPackedWeights::apply(x, w1w2, b1b2, w3, b3, recompute, accumulate_grad, overlap_wgrad);
 }
 
-at::Tensor swiglu_packedw_autocast(const at::Tensor& x, const at::Tensor& w1w2, const c10::optional<at::Tensor> b1b2, const at::Tensor w3, const c10::optional<at::Tensor> b3) {
+at::Tensor swiglu_packedw_autocast(const at::Tensor& x, const at::Tensor& w1w2, const c10::optional<at::Tensor> b1b2, const at::Tensor w3, const c10::optional<at::Tensor> b3, bool recompute, bool accumulate_grad, bool overlap_wgrad) {
   c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
   auto exec_type = at::autocast::get_autocast_gpu_dtype();
-  return SwiGLUPackedWeights::apply(
+  return swiglu_packedw_autograd(
     at::autocast::cached_cast(exec_type, x),
     at::autocast::cached_cast(exec_type, w1w2),
     at::autocast::cached_cast(exec_type, b1b2),
     at::autocast::cached_cast(exec_type, w3),
+    at::autocast::cached_cast(exec_type, b3),
+    recompute,
+    accumulate_grad,
+    overlap_wgrad
+  );
+}
+
+// The quantized weights are kept as they are: only the activations, the
+// scales and the biases are cast
+at::Tensor swiglu_packedw_quantized_autocast(const at::Tensor& x, const at::Tensor& w1w2, const at::Tensor& w1w2_scale, const c10::optional<at::Tensor>& b1b2, const at::Tensor& w3, const at::Tensor& w3_scale, const c10::optional<at::Tensor>& b3) {
+  c10::impl::ExcludeDispatchKeyGuard no_autocast(c10::DispatchKey::Autocast);
+  auto exec_type = at::autocast::get_autocast_gpu_dtype();
+  return swiglu_packedw_quantized(
+    at::autocast::cached_cast(exec_type, x),
+    w1w2,
+    at::autocast::cached_cast(exec_type, w1w2_scale),
+    at::autocast::cached_cast(exec_type, b1b2),
+    w3,
+    at::autocast::cached_cast(exec_type, w3_scale),
     at::autocast::cached_cast(exec_type, b3)
   );
 }
 }
 
 TORCH_LIBRARY(xformers, m) {
-  m.def("swiglu_packedw(Tensor x, Tensor w1w2, Tensor? b1b2, Tensor w3, Tensor? b3) -> Tensor");
+  m.def("swiglu_packedw(Tensor x, Tensor w1w2, Tensor? b1b2, Tensor w3, Tensor? b3, bool recompute=False, bool accumulate_grad=False, bool overlap_wgrad=False) -> Tensor");
+  m.def("swiglu_packedw_sparse24(Tensor x, Tensor w1w2_values, Tensor w1w2_meta, Tensor? b1b2, Tensor w3_values, Tensor w3_meta, Tensor? b3) -> Tensor");
+  m.def("swiglu_packedw_quantized(Tensor x, Tensor w1w2, Tensor w1w2_scale, Tensor? b1b2, Tensor w3, Tensor w3_scale, Tensor? b3) -> Tensor");
+}
+
+// Reached directly under `torch.inference_mode`
+TORCH_LIBRARY_IMPL(xformers, CPU, m) {
+  m.impl("swiglu_packedw", swiglu_packedw_no_grad);
+}
+
+TORCH_LIBRARY_IMPL(xformers, CUDA, m) {
+  m.impl("swiglu_packedw", swiglu_packedw_no_grad);
+  m.impl("swiglu_packedw_quantized", swiglu_packedw_quantized);
+  m.impl("swiglu_packedw_sparse24", swiglu_packedw_sparse24);
+}
+
+// Shapes only, from the ops in `meta/` (eg for `torch.compile`)
+TORCH_LIBRARY_IMPL(xformers, Meta, m) {
+  m.impl("swiglu_packedw", swiglu_packedw_no_grad);
+  m.impl("swiglu_packedw_quantized", swiglu_packedw_quantized);
+  m.impl("swiglu_packedw_sparse24", swiglu_packedw_sparse24);
 }
 
 TORCH_LIBRARY_IMPL(xformers, Autograd, m) {
@@ -187,4 +550,5 @@ TORCH_LIBRARY_IMPL(xformers, Autograd, m) {
 
 TORCH_LIBRARY_IMPL(xformers, Autocast, m) {
   m.impl("swiglu_packedw", swiglu_packedw_autocast);
+  m.impl("swiglu_packedw_quantized", swiglu_packedw_quantized_autocast);
 }
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <vector>
+
+#include <ATen/ATen.h>
+
+namespace {
+
+// `x` of shape [..., K] as a [-1, K] matrix with contiguous rows, for the
+// gemms. This is a view of `x` (with its row stride) when the leading dims
+// can be collapsed, eg for [batch, seq, K] activations or a slice of a wider
+// [..., K'] tensor, and a copy otherwise
+inline at::Tensor flatten_to_matrix(const at::Tensor& x) {
+  TORCH_CHECK(x.dim() >= 1, "expected at least 1 dimension");
+  const at::Tensor& rows = x.stride(-1) == 1 ? x : x.contiguous();
+  return rows.reshape({-1, rows.size(-1)});
+}
+
+// The shape of `x` with its last dimension replaced by `last`
+inline std::vector<int64_t> with_last_dim(const at::Tensor& x, int64_t last) {
+  std::vector<int64_t> sizes = x.sizes().vec();
+  sizes.back() = last;
+  return sizes;
+}
+
+} // namespace
@@ -5,17 +5,46 @@
 
 import torch
 
+from .bias_dropout_res_layernorm import (  # noqa: F401
+    BiasDropoutResLayerNormOp,
+    bias_dropout_res_layernorm,
+    is_fused_bias_dropout_res_layernorm_supported,
+)
 from .memory_efficient_attention import (  # noqa: F401
     AttentionMask,
     AttentionOpBase,
     AttentionOpDispatch,
     LowerTriangularMask,
+    LowerTriangularMaskWithWindow,
     MemoryEfficientAttentionCutlassFwdFlashBwOp,
+    MemoryEfficientAttentionCutlassGroupedOp,
     MemoryEfficientAttentionCutlassOp,
+    MemoryEfficientAttentionCutlassQKVPackedOp,
     MemoryEfficientAttentionFlashAttentionOp,
     MemoryEfficientAttentionOp,
+    MemoryEfficientAttentionQKNormOp,
+    MergeAttentionsOp,
+    PadOutputOp,
+    TreeAttentionMask,
+    UnpadInputsOp,
+    attention_key_scores,
     memory_efficient_attention,
+    memory_efficient_attention_grouped,
+    memory_efficient_attention_int8_qk,
+    memory_efficient_attention_kernel_stats,
+    memory_efficient_attention_profile,
+    memory_efficient_attention_qk_norm,
+    memory_efficient_attention_qkvpacked,
+    memory_efficient_attention_quantized_kv,
+    memory_efficient_attention_shared_prefix,
+    memory_efficient_attention_with_key_scores,
+    merge_attentions,
+    pad_output,
+    quantize_kv_cache,
+    quantize_qk_per_token,
+    unpad_inputs,
 )
+from .ring_attention import RingAttentionOp, ring_attention  # noqa: F401
 from .swiglu_op import (  # noqa: F401
     SwiGLU,
     SwiGLUEagerOp,
@@ -25,6 +54,14 @@ from .swiglu_op import (  # noqa: F401
     SwiGLUPackedFusedOp,
     _info,
     swiglu,
+    swiglu_quantize_weight,
+    swiglu_quantized,
+    swiglu_sparse24,
+    swiglu_sparse24_compress,
+)
+from .swiglu_tensor_parallel import (  # noqa: F401
+    SwiGLUTensorParallelOp,
+    swiglu_tensor_parallel,
 )
 from .unbind import get_stack_strides, stack_or_none, unbind  # noqa: F401
 
@@ -0,0 +1,148 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Optional
+
+import torch
+import torch.nn.functional as F
+
+from .common import get_xformers_operator
+
+# Rows are kept in registers by the CUDA kernels
+_MAX_COLS = 4096
+
+
+class BiasDropoutResLayerNormOp(torch.autograd.Function):
+    """
+    Fused ``x + bias``, dropout, residual and LayerNorm in a single CUDA
+    kernel (and a row kernel + a column reduction kernel for the backward).
+    The dropout mask is regenerated in the backward from the seed/offset of
+    the forward, and ``z`` (the input of the LayerNorm) is saved
+    """
+
+    FORWARD_OPERATOR = get_xformers_operator("bias_dropout_res_layernorm")
+    BACKWARD_OPERATOR = get_xformers_operator("bias_dropout_res_layernorm_backward")
+
+    @staticmethod
+    def forward(ctx, x, bias, residual, weight, norm_bias, p, pre_norm, eps):
+        out, z, mean, rstd, rng_seed, rng_offset = (
+            BiasDropoutResLayerNormOp.FORWARD_OPERATOR(
+                x, bias, residual, weight, norm_bias, p, pre_norm, eps
+            )
+        )
+        ctx.save_for_backward(z, mean, rstd, weight)
+        ctx.has_bias = bias is not None
+        ctx.has_norm_bias = norm_bias is not None
+        ctx.p = p
+        ctx.pre_norm = pre_norm
+        ctx.rng_seed = rng_seed
+        ctx.rng_offset = rng_offset
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        z, mean, rstd, weight = ctx.saved_tensors
+        dx, dbias, dresidual, dweight, dnorm_bias = (
+            BiasDropoutResLayerNormOp.BACKWARD_OPERATOR(
+                grad,
+                z,
+                mean,
+                rstd,
+                weight,
+                ctx.has_bias,
+                ctx.has_norm_bias,
+                ctx.p,
+                ctx.pre_norm,
+                ctx.rng_seed,
+                ctx.rng_offset,
+            )
+        )
+        if ctx.pre_norm:
+            dresidual = grad
+        return (
+            dx,
+            dbias if ctx.has_bias else None,
+            dresidual,
+            dweight if weight is not None else None,
+            dnorm_bias if ctx.has_norm_bias else None,
+            None,
+            None,
+            None,
+        )
+
+
+def _bias_dropout_res_layernorm_torch(
+    x: torch.Tensor,
+    residual: torch.Tensor,
+    bias: Optional[torch.Tensor],
+    weight: Optional[torch.Tensor],
+    norm_bias: Optional[torch.Tensor],
+    p: float,
+    pre_norm: bool,
+    eps: float,
+) -> torch.Tensor:
+    z = x + bias if bias is not None else x
+    z = F.dropout(z, p) if p > 0.0 else z
+    if pre_norm:
+        return F.layer_norm(z, [z.shape[-1]], weight, norm_bias, eps) + residual
+    return F.layer_norm(z + residual, [z.shape[-1]], weight, norm_bias, eps)
+
+
+def is_fused_bias_dropout_res_layernorm_supported(
+    x: torch.Tensor, residual: torch.Tensor, *vectors: Optional[torch.Tensor]
+) -> bool:
+    """
+    Whether `bias_dropout_res_layernorm` runs the fused kernel for these
+    inputs (``vectors`` are the bias / weight / norm_bias)
+    """
+    if BiasDropoutResLayerNormOp.FORWARD_OPERATOR.__name__ == "no_such_operator":
+        return False
+    return (
+        x.is_cuda
+        and x.dtype in [torch.float, torch.half, torch.bfloat16]
+        and residual.dtype == x.dtype
+        and residual.shape == x.shape
+        and 0 < x.shape[-1] <= _MAX_COLS
+        and x.shape[-1] % (16 // x.element_size()) == 0
+        and all(
+            v is None or (v.dtype == x.dtype and v.shape == x.shape[-1:])
+            for v in vectors
+        )
+    )
+
+
+def bias_dropout_res_layernorm(
+    x: torch.Tensor,
+    residual: torch.Tensor,
+    bias: Optional[torch.Tensor] = None,
+    weight: Optional[torch.Tensor] = None,
+    norm_bias: Optional[torch.Tensor] = None,
+    p: float = 0.0,
+    pre_norm: bool = False,
+    eps: float = 1e-5,
+) -> torch.Tensor:
+    """
+    Computes, for ``x`` and ``residual`` [..., N]:
+
+    - ``z = dropout(x + bias, p)``
+    - ``layer_norm(z + residual)`` (post-norm, the default)
+    - or ``layer_norm(z) + residual`` if ``pre_norm``
+
+    where ``weight`` / ``norm_bias`` [N] are the affine parameters of the
+    LayerNorm. All the vectors are optional.
+
+    On CUDA, with N a multiple of 8 (4 for fp32) and at most 4096, and all the
+    tensors of the same dtype, this runs a single fused kernel (C++/CUDA,
+    without nvFuser or Triton), and falls back to the PyTorch ops otherwise
+    """
+    if not is_fused_bias_dropout_res_layernorm_supported(
+        x, residual, bias, weight, norm_bias
+    ):
+        return _bias_dropout_res_layernorm_torch(
+            x, residual, bias, weight, norm_bias, p, pre_norm, eps
+        )
+    return BiasDropoutResLayerNormOp.apply(
+        x, bias, residual, weight, norm_bias, float(p), pre_norm, float(eps)
+    )
@@ -5,13 +5,25 @@
 
 
 import math
-from dataclasses import dataclass
+from dataclasses import dataclass, replace
 from types import SimpleNamespace
-from typing import Any, List, Mapping, Optional, Set, Type, Union
+from typing import (
+    Any,
+    Dict,
+    List,
+    Mapping,
+    Optional,
+    Sequence,
+    Set,
+    Tuple,
+    Type,
+    Union,
+)
 
 import torch
 
 from .common import get_xformers_operator
+from .unbind import _stack_fw
 
 try:
     from .. import _C_flashattention  # type: ignore[attr-defined]
@@ -47,6 +59,96 @@ class LowerTriangularMask(AttentionMask):
         return self._tensor
 
 
+class LowerTriangularMaskWithWindow(LowerTriangularMask):
+    """
+    Causal mask where every query only attends to the ``window_size`` latest
+    keys (itself included)
+    """
+
+    def __init__(self, window_size: int, *tensor_args, **tensor_kwargs) -> None:
+        super().__init__(*tensor_args, **tensor_kwargs)
+        self.window_size = window_size
+
+    def to_tensor(self) -> torch.Tensor:
+        if self._tensor is None:
+            causal = super().to_tensor()
+            out_of_window = torch.tril(
+                torch.full_like(causal, float("-inf"), dtype=torch.float32),
+                diagonal=-self.window_size,
+            )
+            self._tensor = (causal.float() + out_of_window).to(causal.dtype)
+        return self._tensor
+
+
+class TreeAttentionMask(AttentionMask):
+    """
+    Mask of the verification of a tree of draft tokens (speculative
+    decoding): the queries are the ``num_draft`` drafts, which are also the
+    last ``num_draft`` keys. Every query attends to all the keys before the
+    drafts (the prefix), and to the drafts which are its ancestors in the tree
+    (itself included).
+
+    ``bitmask`` is an int32 tensor of shape
+    [batch, num_draft, ceil(num_draft / 32)]: draft ``j`` is an ancestor of
+    draft ``i`` if the bit ``j % 32`` of ``bitmask[b, i, j // 32]`` is set.
+    Only supported in the forward of the cutlass operator.
+    """
+
+    def __init__(self, bitmask: torch.Tensor, num_keys: int) -> None:
+        if bitmask.ndim != 3 or bitmask.dtype != torch.int32:
+            raise ValueError(
+                f"Invalid bitmask: {bitmask.shape} ({bitmask.dtype}). Expected "
+                "int32 of shape [batch, num_draft, ceil(num_draft / 32)]."
+            )
+        if bitmask.shape[2] != (bitmask.shape[1] + 31) // 32:
+            raise ValueError(f"Invalid bitmask shape: {bitmask.shape}")
+        if num_keys < bitmask.shape[1]:
+            raise ValueError("The drafts should be the last keys")
+        self.bitmask = bitmask
+        self.num_keys = num_keys
+
+    @classmethod
+    def from_parents(cls, parents: torch.Tensor, num_keys: int) -> "TreeAttentionMask":
+        """
+        Mask from the index of the parent of every draft ([batch, num_draft],
+        ``-1`` for the drafts whose parent is the last token of the prefix)
+        """
+        B, n = parents.shape
+        device = parents.device
+        # Ancestors at a distance < 2**k and 2**k-th ancestor, by pointer
+        # jumping. Index `n` is a sentinel for the nodes above the roots
+        jump = torch.where(parents < 0, n, parents).long()
+        jump = torch.cat([jump, torch.full([B, 1], n, device=device)], dim=1)
+        ancestors = torch.eye(n + 1, dtype=torch.bool, device=device)
+        ancestors = ancestors.unsqueeze(0).repeat(B, 1, 1)
+        ancestors[:, n, n] = False
+        for _ in range(max(n - 1, 0).bit_length()):
+            ancestors = ancestors | torch.gather(
+                ancestors, 1, jump.unsqueeze(-1).expand(-1, -1, n + 1)
+            )
+            jump = torch.gather(jump, 1, jump)
+        ancestors = ancestors[:, :n, :n]
+
+        num_words = (n + 31) // 32
+        ancestors = torch.nn.functional.pad(ancestors, [0, num_words * 32 - n])
+        weights = 2 ** torch.arange(32, device=device, dtype=torch.int64)
+        words = (ancestors.view(B, n, num_words, 32).long() * weights).sum(-1)
+        # Bit 31 is the sign bit of the int32 words
+        words = torch.where(words >= 2**31, words - 2**32, words)
+        return cls(words.to(torch.int32), num_keys)
+
+    def to_tensor(self) -> torch.Tensor:
+        B, n, num_words = self.bitmask.shape
+        shifts = torch.arange(32, device=self.bitmask.device, dtype=torch.int32)
+        bits = (self.bitmask.unsqueeze(-1) >> shifts) & 1
+        ancestors = bits.reshape(B, n, num_words * 32)[:, :, :n].bool()
+        bias = torch.zeros(
+            [B, 1, n, self.num_keys], dtype=torch.float, device=self.bitmask.device
+        )
+        bias[:, 0, :, self.num_keys - n :].masked_fill_(~ancestors, float("-inf"))
+        return bias
+
+
 class AttentionOpBase(torch.autograd.Function):
     """
     Manually doing what our efficient kernels do with Pytorch.
@@ -70,6 +172,11 @@ class AttentionOpBase(torch.autograd.Function):
     SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {type(None)}
     SUPPORTS_DROPOUT: bool
     SUPPORTS_DIFFERENT_VALUE_EMBED: bool = False
+    # Multi-query / grouped-query attention (fewer key/value heads than query heads)
+    SUPPORTS_DIFFERENT_NUM_KV_HEADS: bool = False
+    # Custom scale and soft-capping of the scores, as the last two arguments of
+    # `forward` / `forward_no_grad`
+    SUPPORTS_CUSTOM_SCALE: bool = False
     NAME: str
 
     _TEST_BATCH_SIZES: List[int] = [1, 300]
@@ -159,12 +266,16 @@ class AttentionOpBase(torch.autograd.Function):
             return False
         if not cls.SUPPORTS_DIFFERENT_VALUE_EMBED and d.k != d.kv:
             return False
+        if not cls.SUPPORTS_DIFFERENT_NUM_KV_HEADS and d.num_kv_heads != d.num_heads:
+            return False
         if max(d.k, d.kv) > cls.SUPPORTED_MAX_K:
             return False
         if d.attn_bias_type not in cls.SUPPORTED_ATTN_BIAS_TYPES:
             return False
         if d.has_dropout and not cls.SUPPORTS_DROPOUT:
             return False
+        if d.has_softcap and not cls.SUPPORTS_CUSTOM_SCALE:
+            return False
         # bfloat16 is only supported on A100+
         # ... although the kernels can still run and give the
         # correct result
@@ -180,6 +291,8 @@ class MemoryEfficientAttentionOp(AttentionOpBase):
     FORWARD_OPERATOR = get_xformers_operator("efficient_attention")
     SUPPORTED_DEVICES = {"cuda", "cpu"}
     SUPPORTED_DTYPES = {torch.float}
+    # The CPU kernels also take half-precision inputs, and compute in float32
+    SUPPORTED_CPU_DTYPES = {torch.float, torch.half, torch.bfloat16}
     SUPPORTED_MAX_K: float = 32
     SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {type(None), torch.Tensor}
     SUPPORTS_DROPOUT = True
@@ -191,6 +304,10 @@ class MemoryEfficientAttentionOp(AttentionOpBase):
 
     @classmethod
     def supports(cls, d: "AttentionOpDispatch") -> bool:
+        device_type = d.device if isinstance(d.device, str) else d.device.type
+        if device_type == "cpu" and d.dtype in cls.SUPPORTED_CPU_DTYPES:
+            # Otherwise, the same limitations as in float32 apply
+            d = replace(d, dtype=torch.float)
         if not super(MemoryEfficientAttentionOp, cls).supports(d):
             return False
         buffer_size = 8
@@ -199,6 +316,37 @@ class MemoryEfficientAttentionOp(AttentionOpBase):
                 return True
         return False
 
+    # The CPU kernels take the BMHK tensors as they are, without the copies
+    # to and from BMK
+    @classmethod
+    def forward_no_grad(
+        cls,
+        query: torch.Tensor,
+        key: torch.Tensor,
+        value: torch.Tensor,
+        attn_bias: Optional[Union[torch.Tensor, AttentionMask]],
+        p: float,
+    ) -> torch.Tensor:
+        if query.device.type == "cpu":
+            return cls._forward_no_grad_bmk(query, key, value, attn_bias, p)
+        return super(MemoryEfficientAttentionOp, cls).forward_no_grad(
+            query, key, value, attn_bias, p
+        )
+
+    @classmethod
+    def forward(cls, ctx, query, key, value, attn_bias, p):
+        if query.device.type == "cpu":
+            return cls._forward_bmk(ctx, query, key, value, attn_bias, p)
+        return super(MemoryEfficientAttentionOp, cls).forward(
+            ctx, query, key, value, attn_bias, p
+        )
+
+    @classmethod
+    def backward(cls, ctx, grad):
+        if grad.device.type == "cpu":
+            return cls._backward_bmk(ctx, grad)
+        return super(MemoryEfficientAttentionOp, cls).backward(ctx, grad)
+
     @classmethod
     def _forward_no_grad_bmk(
         cls,
@@ -247,20 +395,97 @@ class MemoryEfficientAttentionOp(AttentionOpBase):
 
 class MemoryEfficientAttentionCutlassOp(AttentionOpBase):
     FORWARD_OPERATOR = get_xformers_operator("efficient_attention_forward_cutlass")
+    # Forward + backward with the autograd/autocast in C++ (see `apply_cpp`)
+    AUTOGRAD_OPERATOR = get_xformers_operator("efficient_attention_cutlass")
     SUPPORTED_DEVICES = {"cuda"}
+    # On Sm80+, f32 runs with TF32 math if `torch.backends.cuda.matmul.allow_tf32`
     SUPPORTED_DTYPES = {torch.float, torch.half, torch.bfloat16}
     SUPPORTED_MAX_K = math.inf
-    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {type(None), LowerTriangularMask}
-    SUPPORTS_DROPOUT = False
+    SUPPORTED_ATTN_BIAS_TYPES: Set[Any] = {
+        type(None),
+        torch.Tensor,
+        LowerTriangularMask,
+        LowerTriangularMaskWithWindow,
+        TreeAttentionMask,
+    }
+    SUPPORTS_DROPOUT = True
     SUPPORTS_DIFFERENT_VALUE_EMBED = True
+    SUPPORTS_DIFFERENT_NUM_KV_HEADS = True
+    SUPPORTS_CUSTOM_SCALE = True
     NAME = "cutlass"
 
     _TEST_K: List[int] = [
-        32,  # 64x64 kernel
+        32,  # 64x64 kernel (128x32 with 128+ queries)
         128,  # 64x128 kernel
         256,  # 64x128 with accumulation in gmem
     ]
 
+    @classmethod
+    def _bias_tensor(
+        cls, query: torch.Tensor, attn_bias: Optional[Union[torch.Tensor, AttentionMask]]
+    ) -> Optional[torch.Tensor]:
+        if attn_bias is None or isinstance(
+            attn_bias, (LowerTriangularMask, TreeAttentionMask)
+        ):
+            return None
+        if not isinstance(attn_bias, torch.Tensor):
+            raise NotImplementedError("Unsupported attn_bias type")
+        # Legacy format: [batch * num_heads, seqlen_q, seqlen_k]
+        if attn_bias.ndim == 3:
+            attn_bias = attn_bias.reshape(
+                [query.shape[0], query.shape[2], query.shape[1], attn_bias.shape[-1]]
+            )
+        return attn_bias.to(query.dtype)
+
+    @classmethod
+    def _window_size(
+        cls, attn_bias: Optional[Union[torch.Tensor, AttentionMask]]
+    ) -> Optional[int]:
+        if isinstance(attn_bias, LowerTriangularMaskWithWindow):
+            return attn_bias.window_size
+        return None
+
+    @classmethod
+    def _tree_mask(
+        cls, attn_bias: Optional[Union[torch.Tensor, AttentionMask]]
+    ) -> Optional[torch.Tensor]:
+        if isinstance(attn_bias, TreeAttentionMask):
+            return attn_bias.bitmask
+        return None
+
+    @classmethod
+    def _head_dim_alignment(cls, device, dtype: torch.dtype) -> int:
+        cap = torch.cuda.get_device_capability(device)
+        sm = cap[0] * 10 + cap[1]
+        bits_per_scalar = {torch.float: 32, torch.half: 16, torch.bfloat16: 16}[dtype]
+        matmul_alignment_mn = 1
+        if sm >= 80:
+            matmul_alignment_mn = 4
+        if cls.uses_tensorcores(device, bits_per_scalar == 16):
+            matmul_alignment_mn = max(matmul_alignment_mn, 128 // bits_per_scalar)
+        return matmul_alignment_mn
+
+    @classmethod
+    def _pad_head_dims(
+        cls, query: torch.Tensor, key: torch.Tensor, value: torch.Tensor
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """
+        The tensor-core kernels need head dims multiple of the matmul
+        alignment, and the others (eg small float32 heads with a bias or
+        dropout) are zero-padded: the scores don't change (the scale is
+        always passed to the kernels), and the extra channels of the output
+        are sliced off
+        """
+        alignment = cls._head_dim_alignment(query.device, query.dtype)
+        K, Kv = query.shape[-1], value.shape[-1]
+        pad_k, pad_kv = -K % alignment, -Kv % alignment
+        if pad_k == 0 and pad_kv == 0:
+            return query, key, value
+        query = torch.nn.functional.pad(query, [0, pad_k])
+        key = torch.nn.functional.pad(key, [0, pad_k])
+        value = torch.nn.functional.pad(value, [0, pad_kv])
+        return query, key, value
+
     @classmethod
     def forward_no_grad(
         cls,
@@ -269,9 +494,13 @@ class MemoryEfficientAttentionCutlassOp(AttentionOpBase):
         value: torch.Tensor,
         attn_bias: Optional[Union[torch.Tensor, AttentionMask]],
         p: float,
+        scale: Optional[float] = None,
+        softcap: float = 0.0,
     ) -> torch.Tensor:
-        if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
-            raise NotImplementedError("Unsupported attn_bias type")
+        Kv = value.shape[-1]
+        if scale is None:
+            scale = query.shape[-1] ** -0.5
+        query, key, value = cls._pad_head_dims(query, key, value)
         return cls.FORWARD_OPERATOR(
             query=query,
             key=key,
@@ -281,14 +510,25 @@ class MemoryEfficientAttentionCutlassOp(AttentionOpBase):
             max_seqlen_q=-1,
             compute_logsumexp=False,
             causal=isinstance(attn_bias, LowerTriangularMask),
-        )[0]
+            attn_bias=cls._bias_tensor(query, attn_bias),
+            dropout_p=p,
+            window_size=cls._window_size(attn_bias),
+            scale=scale,
+            softcap=softcap,
+            tree_mask=cls._tree_mask(attn_bias),
+        )[0][..., :Kv]
 
     @classmethod
-    def forward(cls, ctx, query, key, value, attn_bias, p):
-        if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
-            raise NotImplementedError("Unsupported attn_bias type")
+    def forward(cls, ctx, query, key, value, attn_bias, p, scale=None, softcap=0.0):
+        if isinstance(attn_bias, TreeAttentionMask):
+            raise NotImplementedError("TreeAttentionMask does not support gradients")
         causal = isinstance(attn_bias, LowerTriangularMask)
-        out, lse = cls.FORWARD_OPERATOR(
+        bias = cls._bias_tensor(query, attn_bias)
+        K, Kv = query.shape[-1], value.shape[-1]
+        if scale is None:
+            scale = K**-0.5
+        query, key, value = cls._pad_head_dims(query, key, value)
+        out, lse, rng_seed, rng_offset = cls.FORWARD_OPERATOR(
             query=query,
             key=key,
             value=value,
@@ -297,41 +537,76 @@ class MemoryEfficientAttentionCutlassOp(AttentionOpBase):
             max_seqlen_q=-1,
             compute_logsumexp=True,
             causal=causal,
+            attn_bias=bias,
+            dropout_p=p,
+            window_size=cls._window_size(attn_bias),
+            scale=scale,
+            softcap=softcap,
         )
-        ctx.save_for_backward(query, key, value, lse, out)
+        ctx.save_for_backward(query, key, value, lse, out, bias)
         ctx.p = p
+        ctx.rng_seed = rng_seed
+        ctx.rng_offset = rng_offset
         ctx.causal = causal
-        return out
+        ctx.window_size = cls._window_size(attn_bias)
+        ctx.scale = scale
+        ctx.softcap = softcap
+        ctx.head_dims = (K, Kv)
+        return out[..., :Kv]
 
     @classmethod
-    def uses_tensorcores(cls, d: "AttentionOpDispatch", is_half: bool) -> bool:
-        sm_major = torch.cuda.get_device_capability(d.device)[0]
+    def supports_cpp(
+        cls, attn_bias: Optional[Union[torch.Tensor, AttentionMask]]
+    ) -> bool:
+        if cls.AUTOGRAD_OPERATOR.__name__ == "no_such_operator":
+            return False
+        return attn_bias is None or isinstance(
+            attn_bias, (torch.Tensor, LowerTriangularMask)
+        )
+
+    @classmethod
+    def apply_cpp(
+        cls,
+        query: torch.Tensor,
+        key: torch.Tensor,
+        value: torch.Tensor,
+        attn_bias: Optional[Union[torch.Tensor, AttentionMask]],
+        p: float,
+        scale: Optional[float] = None,
+        softcap: float = 0.0,
+    ) -> torch.Tensor:
+        """
+        Same as `apply` (and `forward_no_grad`), but the padding, the ctx and
+        the backward stay in C++ - which matters for small shapes, where they
+        cost as much as the kernels. Also scriptable
+        """
+        return cls.AUTOGRAD_OPERATOR(
+            query,
+            key,
+            value,
+            attn_bias if isinstance(attn_bias, torch.Tensor) else None,
+            causal=isinstance(attn_bias, LowerTriangularMask),
+            p=p,
+            window_size=cls._window_size(attn_bias),
+            scale=scale,
+            softcap=softcap,
+        )
+
+    @classmethod
+    def uses_tensorcores(cls, device, is_half: bool) -> bool:
+        sm_major = torch.cuda.get_device_capability(device)[0]
         if sm_major >= 8:
             return True
         if sm_major >= 7:
             return is_half
         return False
 
-    @classmethod
-    def supports(cls, d: "AttentionOpDispatch") -> bool:
-        if not super(MemoryEfficientAttentionCutlassOp, cls).supports(d):
-            return False
-        cap = torch.cuda.get_device_capability(d.device)
-        sm = cap[0] * 10 + cap[1]
-        bits_per_scalar = {torch.float: 32, torch.half: 16, torch.bfloat16: 16}[d.dtype]
-        uses_tensorcores = cls.uses_tensorcores(d, bits_per_scalar == 16)
-        matmul_alignment_mn = 1
-        if sm >= 80:
-            matmul_alignment_mn = 4
-        if uses_tensorcores:
-            matmul_alignment_mn = max(matmul_alignment_mn, 128 // bits_per_scalar)
-        if (d.k % matmul_alignment_mn != 0) or (d.kv % matmul_alignment_mn != 0):
-            return False
-        return True
-
     @classmethod
     def backward(cls, ctx, grad):
-        query, key, value, lse, out = ctx.saved_tensors
+        query, key, value, lse, out, bias = ctx.saved_tensors
+        K, Kv = ctx.head_dims
+        if Kv != out.shape[-1]:
+            grad = torch.nn.functional.pad(grad, [0, out.shape[-1] - Kv])
 
         dtype = query.dtype
         (
@@ -346,8 +621,135 @@ class MemoryEfficientAttentionCutlassOp(AttentionOpBase):
             lse,
             out.to(dtype),
             causal=ctx.causal,
+            attn_bias=bias,
+            dropout_p=ctx.p,
+            rng_seed=ctx.rng_seed,
+            rng_offset=ctx.rng_offset,
+            window_size=ctx.window_size,
+            scale=ctx.scale,
+            softcap=ctx.softcap,
         )
-        return grad_q, grad_k, grad_v, None, None
+        if K != query.shape[-1] or Kv != value.shape[-1]:
+            grad_q = grad_q[..., :K]
+            grad_k = grad_k[..., :K]
+            grad_v = grad_v[..., :Kv]
+        # NOTE: There is no gradient for `attn_bias`
+        return grad_q, grad_k, grad_v, None, None, None, None
+
+
+class MemoryEfficientAttentionCutlassQKVPackedOp(MemoryEfficientAttentionCutlassOp):
+    """
+    Same as `MemoryEfficientAttentionCutlassOp`, for a single packed input
+    ``qkv`` of shape [batch, seqlen, 3, num_heads, K] (eg the output of a
+    fused projection). The gradient is returned as a single packed tensor,
+    without a concatenation.
+    """
+
+    @classmethod
+    def _unpack(cls, qkv: torch.Tensor) -> Tuple[torch.Tensor, ...]:
+        if qkv.ndim != 5 or qkv.shape[2] != 3:
+            raise ValueError(
+                f"Invalid shape for qkv: {qkv.shape}. "
+                "Expected shape [batch, seqlen, 3, num_heads, K]."
+            )
+        # Views of a contiguous packed tensor are always aligned for the
+        # supported head dims (see `supports`): make sure we never hit the
+        # slower `kIsAligned=false` kernels
+        bits_per_scalar = torch.finfo(qkv.dtype).bits
+        alignment = 128 // bits_per_scalar
+        if qkv.stride(-1) != 1 or any(
+            s % alignment != 0 for s in qkv.stride()[:-1]
+        ):
+            qkv = qkv.contiguous()
+        return qkv.unbind(2)
+
+    @classmethod
+    def forward_no_grad(  # type: ignore
+        cls,
+        qkv: torch.Tensor,
+        attn_bias: Optional[Union[torch.Tensor, AttentionMask]],
+        p: float,
+    ) -> torch.Tensor:
+        query, key, value = cls._unpack(qkv)
+        return super().forward_no_grad(query, key, value, attn_bias, p)
+
+    @classmethod
+    def forward(cls, ctx, qkv, attn_bias, p):  # type: ignore
+        query, key, value = cls._unpack(qkv)
+        return super().forward(ctx, query, key, value, attn_bias, p)
+
+    @classmethod
+    def backward(cls, ctx, grad):  # type: ignore
+        grad_q, grad_k, grad_v, *_ = super().backward(ctx, grad)
+        # The backward allocates the gradients in a single [B, M, 3, H, K]
+        # chunk when Q/K/V are views of the same tensor
+        return _stack_fw((grad_q, grad_k, grad_v), dim=2), None, None
+
+
+class MemoryEfficientAttentionCutlassGroupedOp(torch.autograd.Function):
+    """
+    Runs the cutlass kernels on sequences concatenated along the first
+    dimension of a [1, total_seqlen, num_heads, K] batch, where sequence
+    ``s`` is made of the queries ``[cu_seqlens_q[s], cu_seqlens_q[s + 1])``
+    and of the keys/values ``[cu_seqlens_k[s], cu_seqlens_k[s + 1])``.
+    The sequences are all processed by a single kernel launch, with
+    ``cu_seqlens`` as the problem table - see `memory_efficient_attention_grouped`
+    """
+
+    @staticmethod
+    def forward(  # type: ignore
+        ctx,
+        query,
+        key,
+        value,
+        cu_seqlens_q,
+        cu_seqlens_k,
+        max_seqlen_q,
+        causal,
+        scale=None,
+        softcap=0.0,
+    ):
+        out, lse, _, _ = MemoryEfficientAttentionCutlassOp.FORWARD_OPERATOR(
+            query=query,
+            key=key,
+            value=value,
+            cu_seqlens_q=cu_seqlens_q,
+            cu_seqlens_k=cu_seqlens_k,
+            max_seqlen_q=max_seqlen_q,
+            compute_logsumexp=any(x.requires_grad for x in [query, key, value]),
+            causal=causal,
+            scale=scale,
+            softcap=softcap,
+        )
+        ctx.save_for_backward(query, key, value, lse, out, cu_seqlens_q, cu_seqlens_k)
+        ctx.max_seqlen_q = max_seqlen_q
+        ctx.causal = causal
+        ctx.scale = scale
+        ctx.softcap = softcap
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        query, key, value, lse, out, cu_seqlens_q, cu_seqlens_k = ctx.saved_tensors
+        (
+            grad_q,
+            grad_k,
+            grad_v,
+        ) = torch.ops.xformers.efficient_attention_backward_cutlass(
+            grad.to(query.dtype),
+            query,
+            key,
+            value,
+            lse,
+            out,
+            causal=ctx.causal,
+            cu_seqlens_q=cu_seqlens_q,
+            cu_seqlens_k=cu_seqlens_k,
+            max_seqlen_q=ctx.max_seqlen_q,
+            scale=ctx.scale,
+            softcap=ctx.softcap,
+        )
+        return grad_q, grad_k, grad_v, None, None, None, None, None, None
 
 
 class MemoryEfficientAttentionFlashAttentionOp(AttentionOpBase):
@@ -630,6 +1032,7 @@ class MemoryEfficientAttentionCutlassFwdFlashBwOp(MemoryEfficientAttentionCutlas
     FW_OP = MemoryEfficientAttentionCutlassOp
     BW_OP = MemoryEfficientAttentionFlashAttentionOp
     SUPPORTED_DTYPES = BW_OP.SUPPORTED_DTYPES.intersection(FW_OP.SUPPORTED_DTYPES)
+    SUPPORTS_CUSTOM_SCALE = False
     NAME = "fctls_bflsh"
 
     @classmethod
@@ -638,7 +1041,7 @@ class MemoryEfficientAttentionCutlassFwdFlashBwOp(MemoryEfficientAttentionCutlas
 
     @classmethod
     def backward(cls, ctx, grad):
-        query, key, value, lse, out = ctx.saved_tensors
+        query, key, value, lse, out, _ = ctx.saved_tensors
         ctx_flash = SimpleNamespace()
 
         ctx_flash.causal = ctx.causal
@@ -647,7 +1050,7 @@ class MemoryEfficientAttentionCutlassFwdFlashBwOp(MemoryEfficientAttentionCutlas
             ctx_flash, query, key, value
         )
         ctx_flash.kernel_output_shape = (query.shape[0], query.shape[1], value.shape[2])
-        ctx_flash.softmax_scale = query.shape[-1] ** (-0.5)
+        ctx_flash.softmax_scale = ctx.scale
         rng_state = None
 
         out = out.reshape(ctx_flash.kernel_output_shape)
@@ -671,10 +1074,14 @@ class AttentionOpDispatch:
     kv: int = -1
     batch_size: int = -1
     num_heads: int = 1
+    num_kv_heads: int = -1
+    has_softcap: bool = False
 
     def __post_init__(self):
         if self.kv == -1:
             self.kv = self.k
+        if self.num_kv_heads == -1:
+            self.num_kv_heads = self.num_heads
 
     def _is_cutlass_fwd_faster_than_flash(self) -> bool:
         # Very small batch sizes - if batch size specified
@@ -708,10 +1115,12 @@ class AttentionOpDispatch:
         value: torch.Tensor,
         attn_bias: Optional[Union[torch.Tensor, AttentionMask]] = None,
         p: float = 0.0,
+        softcap: Optional[float] = None,
     ) -> "AttentionOpDispatch":
-        B, H = query.shape[0], 1
+        B, H, Hkv = query.shape[0], 1, 1
         if query.ndim == 4:
             H = query.shape[2]
+            Hkv = key.shape[2]
         return AttentionOpDispatch(
             dtype=query.dtype,
             device=query.device,
@@ -723,7 +1132,842 @@ class AttentionOpDispatch:
             q_len=query.shape[1],
             batch_size=B,
             num_heads=H,
+            num_kv_heads=Hkv,
+            has_softcap=bool(softcap),
+        )
+
+
+def memory_efficient_attention_qkvpacked(
+    qkv: torch.Tensor,
+    attn_bias: Optional[Union[torch.Tensor, AttentionMask]] = None,
+    p: float = 0.0,
+) -> torch.Tensor:
+    """
+    Same as `memory_efficient_attention`, where query, key and value are
+    packed in a single tensor of shape [batch, seqlen, 3, num_heads, K].
+    Returns the output of shape [batch, seqlen, num_heads, K], and the gradient
+    of ``qkv`` is computed as a single packed tensor.
+    """
+    op = MemoryEfficientAttentionCutlassQKVPackedOp
+    if qkv.ndim != 5 or qkv.shape[2] != 3:
+        raise ValueError(
+            f"Invalid shape for qkv: {qkv.shape}. "
+            "Expected shape [batch, seqlen, 3, num_heads, K]."
+        )
+    if isinstance(attn_bias, torch.Tensor) and (
+        attn_bias.device != qkv.device or attn_bias.dtype != qkv.dtype
+    ):
+        raise ValueError(
+            f"attn_bias ({attn_bias.dtype} on {attn_bias.device}) should have "
+            f"the dtype and the device of qkv ({qkv.dtype} on {qkv.device})"
+        )
+    query, key, value = qkv.unbind(2)
+    d = AttentionOpDispatch.from_arguments(
+        query=query, key=key, value=value, attn_bias=attn_bias, p=p
+    )
+    if not op.supports(d):
+        raise NotImplementedError(f"{op.NAME} does not support this input: {d}")
+    if not qkv.requires_grad:
+        return op.forward_no_grad(qkv=qkv, attn_bias=attn_bias, p=p)
+    return op.apply(qkv, attn_bias, p)
+
+
+def memory_efficient_attention_grouped(
+    queries: Sequence[torch.Tensor],
+    keys: Sequence[torch.Tensor],
+    values: Sequence[torch.Tensor],
+    attn_bias: Optional[LowerTriangularMask] = None,
+) -> List[torch.Tensor]:
+    """
+    Computes ``memory_efficient_attention(queries[i], keys[i], values[i], attn_bias)``
+    for many independent problems at once, eg attention over crops of
+    different sizes. Every problem is of shape [batch, seqlen, num_heads, K],
+    and can have its own batch size and sequence lengths.
+
+    All the problems with the same dtype, number of heads and head dims are
+    computed in a single kernel launch (forward and backward), instead of one
+    launch per problem. Their sequences are concatenated, so this is mostly
+    useful when the problems are too small to fill the GPU on their own.
+
+    Only ``attn_bias=None`` and `LowerTriangularMask` are supported, without
+    dropout.
+    """
+    if not (len(queries) == len(keys) == len(values)):
+        raise ValueError("queries, keys and values should have the same length")
+    if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
+        raise NotImplementedError(f"Unsupported attn_bias type: {type(attn_bias)}")
+    causal = isinstance(attn_bias, LowerTriangularMask)
+    window_size = MemoryEfficientAttentionCutlassOp._window_size(attn_bias)
+    if window_size is not None:
+        raise NotImplementedError("LowerTriangularMaskWithWindow is not supported")
+
+    groups: Dict[Tuple[Any, ...], List[int]] = {}
+    for i, (query, key, value) in enumerate(zip(queries, keys, values)):
+        if query.ndim != 4:
+            raise ValueError(
+                f"Invalid shape for query: {query.shape}. "
+                "Expected shape [batch, seqlen, num_heads, K]."
+            )
+        group = (
+            query.dtype,
+            query.device,
+            query.shape[2],
+            key.shape[2],
+            query.shape[3],
+            value.shape[3],
+        )
+        groups.setdefault(group, []).append(i)
+
+    outputs: List[Optional[torch.Tensor]] = [None] * len(queries)
+    for indices in groups.values():
+        cu_seqlens_q, cu_seqlens_k = [0], [0]
+        for i in indices:
+            batch, seqlen_q = queries[i].shape[:2]
+            seqlen_k = keys[i].shape[1]
+            if keys[i].shape[0] != batch or values[i].shape[0] != batch:
+                raise ValueError(f"Problem {i}: inconsistent batch sizes")
+            for _ in range(batch):
+                cu_seqlens_q.append(cu_seqlens_q[-1] + seqlen_q)
+                cu_seqlens_k.append(cu_seqlens_k[-1] + seqlen_k)
+        device = queries[indices[0]].device
+        query, key, value = [
+            torch.cat([x[i].reshape([1, -1, *x[i].shape[2:]]) for i in indices], dim=1)
+            for x in [queries, keys, values]
+        ]
+        out = MemoryEfficientAttentionCutlassGroupedOp.apply(
+            query,
+            key,
+            value,
+            torch.tensor(cu_seqlens_q, dtype=torch.int32, device=device),
+            torch.tensor(cu_seqlens_k, dtype=torch.int32, device=device),
+            max(queries[i].shape[1] for i in indices),
+            causal,
+        )
+        for i, out_i in zip(
+            indices, out.split([queries[i].shape[:2].numel() for i in indices], dim=1)
+        ):
+            outputs[i] = out_i.reshape([*queries[i].shape[:-1], values[i].shape[-1]])
+    return outputs  # type: ignore
+
+
+class MergeAttentionsOp(torch.autograd.Function):
+    """
+    Fused `merge_attentions`, with the partial outputs followed by their
+    logsumexp as arguments
+    """
+
+    @staticmethod
+    def forward(ctx, *outs_and_lses):  # type: ignore
+        num_inputs = len(outs_and_lses) // 2
+        outs, lses = outs_and_lses[:num_inputs], outs_and_lses[num_inputs:]
+        out, lse = torch.ops.xformers.merge_attentions(outs, lses)
+        ctx.save_for_backward(lse, *outs, *lses)
+        ctx.num_inputs = num_inputs
+        return out, lse
+
+    @staticmethod
+    def backward(ctx, grad_out, grad_lse):
+        lse, *outs_and_lses = ctx.saved_tensors
+        outs = outs_and_lses[: ctx.num_inputs]
+        lses = outs_and_lses[ctx.num_inputs :]
+        grad_outs, grad_lses = torch.ops.xformers.merge_attentions_backward(
+            grad_out.to(outs[0].dtype).contiguous(),
+            grad_lse,
+            lse,
+            outs,
+            lses,
+        )
+        return (*grad_outs, *grad_lses)
+
+
+def merge_attentions(
+    outs: Sequence[torch.Tensor], lses: Sequence[torch.Tensor]
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Combines attention outputs computed over disjoint sets of keys (eg the
+    splits of a long sequence, or a cached prefix and its suffix) into the
+    attention over all the keys, using the logsumexp of every set.
+
+    ``outs`` are [batch, seqlen, num_heads, Kv] with the same dtype, and
+    ``lses`` the logsumexp [batch, num_heads, >= seqlen] returned by the cutlass
+    forward. Sets without any key have a logsumexp of ``-inf``.
+    Returns the merged output (in the dtype of ``outs``, accumulated in
+    float32) and its logsumexp [batch, num_heads, seqlen], in a single kernel
+    per chunk of 16 inputs. Both are differentiable.
+    """
+    outs, lses = list(outs), list(lses)
+    assert len(outs) == len(lses) and outs
+    chunk = 16
+    while len(outs) > chunk:
+        out, lse = MergeAttentionsOp.apply(*outs[:chunk], *lses[:chunk])
+        outs, lses = [out] + outs[chunk:], [lse] + lses[chunk:]
+    return MergeAttentionsOp.apply(*outs, *lses)
+
+
+class UnpadInputsOp(torch.autograd.Function):
+    """
+    Fused `unpad_inputs`, with the padding mask followed by the inputs as
+    arguments
+    """
+
+    @staticmethod
+    def forward(ctx, padding_mask, *inputs):  # type: ignore
+        outputs, cu_seqlens, max_seqlen = torch.ops.xformers.unpad_inputs(
+            inputs, padding_mask
         )
+        ctx.save_for_backward(padding_mask, cu_seqlens)
+        ctx.mark_non_differentiable(cu_seqlens, max_seqlen)
+        return (*outputs, cu_seqlens, max_seqlen)
+
+    @staticmethod
+    def backward(ctx, *grads):
+        padding_mask, cu_seqlens = ctx.saved_tensors
+        return (
+            None,
+            *[
+                torch.ops.xformers.pad_output(grad, padding_mask, cu_seqlens)
+                for grad in grads[:-2]
+            ],
+        )
+
+
+class PadOutputOp(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, x, padding_mask, cu_seqlens):  # type: ignore
+        ctx.save_for_backward(padding_mask)
+        return torch.ops.xformers.pad_output(x, padding_mask, cu_seqlens)
+
+    @staticmethod
+    def backward(ctx, grad):
+        (padding_mask,) = ctx.saved_tensors
+        (grad_x,), _, _ = torch.ops.xformers.unpad_inputs(
+            [grad.contiguous()], padding_mask
+        )
+        return grad_x, None, None
+
+
+def unpad_inputs(
+    inputs: Sequence[torch.Tensor], padding_mask: torch.Tensor
+) -> Tuple[List[torch.Tensor], torch.Tensor, int]:
+    """
+    Converts inputs of shape [batch, seqlen, ...] padded according to
+    ``padding_mask`` [batch, seqlen] (``True`` for the valid tokens) to the
+    layout of ``cu_seqlens_q`` / ``cu_seqlens_k`` in
+    `MemoryEfficientAttentionCutlassOp`: the valid tokens of all the
+    sequences concatenated as [1, batch * seqlen, ...], followed by zeros.
+
+    Returns the converted inputs, the ``cu_seqlens`` [batch + 1] (int32 on the
+    device, computed without synchronizing with the host), and ``seqlen``: an
+    upper bound of the length of the sequences, to pass as ``max_seqlen_q``
+    so that the attention doesn't synchronize either. The attention kernels
+    ignore the tokens after ``cu_seqlens[-1]``. Use `pad_output` for the
+    inverse conversion of the output::
+
+        (q, k, v), cu_seqlens, max_seqlen = unpad_inputs([q, k, v], padding_mask)
+        out, _, _, _ = MemoryEfficientAttentionCutlassOp.FORWARD_OPERATOR(
+            q,
+            k,
+            v,
+            cu_seqlens_q=cu_seqlens,
+            cu_seqlens_k=cu_seqlens,
+            max_seqlen_q=max_seqlen,
+            compute_logsumexp=False,
+            causal=False,
+        )
+        out = pad_output(out, padding_mask, cu_seqlens)
+    """
+    *outputs, cu_seqlens, _ = UnpadInputsOp.apply(padding_mask, *inputs)
+    return outputs, cu_seqlens, padding_mask.shape[1]
+
+
+def pad_output(
+    x: torch.Tensor, padding_mask: torch.Tensor, cu_seqlens: torch.Tensor
+) -> torch.Tensor:
+    """
+    Inverse of `unpad_inputs`: scatters ``x`` [1, batch * seqlen, ...] back to
+    [batch, seqlen, ...], with zeros for the padding tokens
+    """
+    return PadOutputOp.apply(x, padding_mask, cu_seqlens)
+
+
+def memory_efficient_attention_shared_prefix(
+    query: torch.Tensor,
+    prefix_key: torch.Tensor,
+    prefix_value: torch.Tensor,
+    suffix_key: torch.Tensor,
+    suffix_value: torch.Tensor,
+    causal: bool = False,
+    block_tables: Optional[torch.Tensor] = None,
+    seqlens_k: Optional[torch.Tensor] = None,
+) -> torch.Tensor:
+    """
+    Attention of a batch of sequences whose keys/values all start with the
+    same prefix (eg a system prompt shared by concurrent requests), without
+    reading the prefix once per sequence (cascade attention).
+
+    The queries of the whole batch [batch, seqlen, num_heads, K] first attend
+    to the prefix ``prefix_key`` / ``prefix_value`` [1, prefix_len, num_kv_heads, K]
+    as a single problem, then every sequence attends to its own suffix
+    ``suffix_key`` / ``suffix_value`` [batch, suffix_len, num_kv_heads, K]. The
+    two partial results are combined with their logsumexp.
+
+    The suffix can also be a paged KV-cache (``block_tables`` and
+    ``seqlens_k``, see the cutlass forward), and ``causal`` only applies
+    to it.
+    Inference only: the output does not require grad.
+    """
+    op = MemoryEfficientAttentionCutlassOp
+    if query.ndim != 4 or prefix_key.ndim != 4 or prefix_key.shape[0] != 1:
+        raise ValueError(
+            "Expected query of shape [batch, seqlen, num_heads, K] and prefix_key "
+            "of shape [1, prefix_len, num_kv_heads, K]"
+        )
+    B, M, H, _ = query.shape
+    with torch.no_grad():
+        prefix_out, prefix_lse, _, _ = op.FORWARD_OPERATOR(
+            query=query.reshape([1, B * M, H, query.shape[-1]]),
+            key=prefix_key,
+            value=prefix_value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=None,
+            compute_logsumexp=True,
+            causal=False,
+        )
+        suffix_out, suffix_lse, _, _ = op.FORWARD_OPERATOR(
+            query=query,
+            key=suffix_key,
+            value=suffix_value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=None,
+            compute_logsumexp=True,
+            causal=causal,
+            block_tables=block_tables,
+            seqlens_k=seqlens_k,
+        )
+        # [1, H, B * M] -> [B, H, M]
+        prefix_lse = prefix_lse[0, :, : B * M].unflatten(1, (B, M)).transpose(0, 1)
+        out, _ = merge_attentions(
+            [prefix_out.reshape(suffix_out.shape), suffix_out],
+            [prefix_lse, suffix_lse],
+        )
+        return out
+
+
+def quantize_qk_per_token(x: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Symmetric int8 quantization of a query or key [batch, seqlen, num_heads, K]
+    for `memory_efficient_attention_int8_qk`, with a scale per token and head.
+    Returns the quantized tensor (int8, same shape) and the scales
+    (float32 [batch, seqlen, num_heads])
+    """
+    scale = x.float().abs().amax(-1).clamp(min=1e-8) / 127
+    q = (x.float() / scale.unsqueeze(-1)).round().clamp(-127, 127)
+    return q.to(torch.int8), scale
+
+
+def memory_efficient_attention_int8_qk(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    q_scale: torch.Tensor,
+    k_scale: torch.Tensor,
+    attn_bias: Optional[Union[torch.Tensor, AttentionMask]] = None,
+    scale: Optional[float] = None,
+) -> torch.Tensor:
+    """
+    Attention with an int8 ``query`` [batch, seqlen_q, num_heads, K] and
+    ``key`` [batch, seqlen_k, num_kv_heads, K], eg the prefill of a model with
+    a quantized KV-cache. ``q_scale`` [batch, seqlen_q, num_heads] and
+    ``k_scale`` [batch, seqlen_k, num_kv_heads] are their scales (see
+    `quantize_qk_per_token`): the scores are
+    ``scale * q_scale[i] * k_scale[j] * (query[i] @ key[j])``.
+
+    ``query @ key.T`` runs on the int8 tensor cores (cutlass, Sm80+), while
+    ``value`` and the output are f16/bf16. ``attn_bias`` can be a tensor (in
+    the dtype of the value), or a `LowerTriangularMask`.
+    Inference only: the output does not require grad.
+    """
+    op = MemoryEfficientAttentionCutlassOp
+    if query.ndim != 4 or key.ndim != 4:
+        raise ValueError(
+            "Expected query and key of shape [batch, seqlen, num_heads, K]"
+        )
+    bias = None
+    if isinstance(attn_bias, torch.Tensor):
+        bias = attn_bias.to(value.dtype)
+    elif attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
+        raise NotImplementedError(f"Unsupported attn_bias type: {type(attn_bias)}")
+    if scale is None:
+        scale = query.shape[-1] ** -0.5
+    # The int8 kernels load 16 channels at a time: the zero channels added
+    # don't change the scores
+    pad = -query.shape[-1] % 16
+    if pad:
+        query = torch.nn.functional.pad(query, [0, pad])
+        key = torch.nn.functional.pad(key, [0, pad])
+    with torch.no_grad():
+        return op.FORWARD_OPERATOR(
+            query=query,
+            key=key,
+            value=value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=-1,
+            compute_logsumexp=False,
+            causal=isinstance(attn_bias, LowerTriangularMask),
+            attn_bias=bias,
+            window_size=op._window_size(attn_bias),
+            scale=scale,
+            q_scale=q_scale,
+            k_scale=k_scale,
+        )[0]
+
+
+def quantize_kv_cache(
+    x: torch.Tensor, bits: int = 8, group_size: Optional[int] = None
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Symmetric quantization of a key or value [batch, seqlen, num_kv_heads, K]
+    for `memory_efficient_attention_quantized_kv`, with a scale per token and
+    head, or per group of ``group_size`` channels.
+    Returns the quantized tensor (int8 [..., K], or int4 packed two per byte
+    as uint8 [..., K // 2]: the even channel in the low nibble, with an offset
+    of 8) and the scales (float32 [..., K // group_size])
+    """
+    if bits not in [4, 8]:
+        raise ValueError(f"Only int8 and int4 are supported (got {bits} bits)")
+    K = x.shape[-1]
+    group_size = group_size or K
+    if K % group_size != 0:
+        raise ValueError(f"Invalid group_size={group_size} for {K} channels")
+    qmax = 2 ** (bits - 1) - 1
+    x_groups = x.float().unflatten(-1, (K // group_size, group_size))
+    scale = x_groups.abs().amax(-1).clamp(min=1e-8) / qmax
+    q = (x_groups / scale.unsqueeze(-1)).round().clamp(-qmax - 1, qmax).flatten(-2)
+    if bits == 4:
+        q = (q + 8).to(torch.uint8)
+        q = q[..., ::2] | (q[..., 1::2] << 4)
+    else:
+        q = q.to(torch.int8)
+    return q, scale
+
+
+def memory_efficient_attention_quantized_kv(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    k_scale: torch.Tensor,
+    v_scale: torch.Tensor,
+    causal: bool = False,
+    block_tables: Optional[torch.Tensor] = None,
+    seqlens_k: Optional[torch.Tensor] = None,
+    scale: Optional[float] = None,
+) -> torch.Tensor:
+    """
+    Attention of a f16/bf16 ``query`` [batch, seqlen_q, num_heads, K] to a
+    quantized KV-cache ``key`` / ``value`` with their scales ``k_scale`` /
+    ``v_scale``, as returned by `quantize_kv_cache` (int8, or int4 with
+    groups), which takes 2x / 4x less memory than f16/bf16 K/V.
+
+    When decoding (at most 4 queries per sequence), K/V are dequantized in
+    registers by the decode kernel, which only reads their quantized bytes.
+    Otherwise, the attention runs on a dequantized copy of K/V.
+    The KV-cache can be paged (``block_tables`` and ``seqlens_k``, see the
+    cutlass forward), in which case the scales are paged as well:
+    [num_pages, page_size, num_kv_heads, G].
+    Inference only: the output does not require grad.
+    """
+    op = MemoryEfficientAttentionCutlassOp
+    with torch.no_grad():
+        return op.FORWARD_OPERATOR(
+            query=query,
+            key=key,
+            value=value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=None,
+            compute_logsumexp=False,
+            causal=causal,
+            block_tables=block_tables,
+            seqlens_k=seqlens_k,
+            scale=scale,
+            k_scale=k_scale,
+            v_scale=v_scale,
+        )[0]
+
+
+def attention_key_scores(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    logsumexp: torch.Tensor,
+    attn_bias: Optional[AttentionMask] = None,
+    scale: Optional[float] = None,
+    softcap: Optional[float] = None,
+) -> torch.Tensor:
+    """
+    Attention probability mass received by every key, summed over the
+    queries: ``scores[b, h, n] = sum_m(softmax(query @ key.T)[b, h, m, n])``,
+    as float32 [batch, num_heads, seqlen_k]. This is what score-based
+    KV-cache eviction needs (eg keeping the "heavy hitters" of the cache).
+
+    ``logsumexp`` [batch, num_heads, seqlen_q'] is returned by the cutlass
+    forward with ``compute_logsumexp=True``, and ``attn_bias`` / ``scale`` /
+    ``softcap`` should be the same as for the forward. The probabilities are
+    recomputed in a second pass without materializing them. This pass
+    computes ``query @ key.T`` again without tensor cores, so it is
+    usually several times slower than the attention forward itself.
+    ``attn_bias`` can be `LowerTriangularMask` (or with a window).
+    Inference only: the output does not require grad.
+    """
+    if query.ndim != 4 or key.ndim != 4:
+        raise ValueError(
+            "Expected query and key of shape [batch, seqlen, num_heads, K]"
+        )
+    if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
+        raise NotImplementedError(f"Unsupported attn_bias type: {type(attn_bias)}")
+    with torch.no_grad():
+        return get_xformers_operator("attention_key_scores")(
+            query,
+            key,
+            logsumexp,
+            causal=isinstance(attn_bias, LowerTriangularMask),
+            window_size=MemoryEfficientAttentionCutlassOp._window_size(attn_bias),
+            scale=scale,
+            softcap=softcap or 0.0,
+        )
+
+
+def memory_efficient_attention_with_key_scores(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    attn_bias: Optional[AttentionMask] = None,
+    scale: Optional[float] = None,
+    softcap: Optional[float] = None,
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Cutlass attention [batch, seqlen, num_heads, K] which also returns the
+    accumulated probability of every key (see `attention_key_scores`), eg to
+    evict the least attended entries of a KV-cache after the prefill.
+    Returns ``(out, scores)``, inference only. The scores are computed in a
+    separate and slower pass after the forward; it is not fused into it.
+    """
+    op = MemoryEfficientAttentionCutlassOp
+    if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
+        raise NotImplementedError(f"Unsupported attn_bias type: {type(attn_bias)}")
+    with torch.no_grad():
+        out, lse, _, _ = op.FORWARD_OPERATOR(
+            query=query,
+            key=key,
+            value=value,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=None,
+            compute_logsumexp=True,
+            causal=isinstance(attn_bias, LowerTriangularMask),
+            window_size=op._window_size(attn_bias),
+            scale=scale,
+            softcap=softcap or 0.0,
+        )
+    return out, attention_key_scores(query, key, lse, attn_bias, scale, softcap)
+
+
+def _qk_norm_torch(
+    x: torch.Tensor, weight: Optional[torch.Tensor], rms_norm: bool, eps: float
+) -> torch.Tensor:
+    x32 = x.float()
+    if not rms_norm:
+        x32 = x32 - x32.mean(-1, keepdim=True)
+    x32 = x32 * torch.rsqrt(x32.pow(2).mean(-1, keepdim=True) + eps)
+    if weight is not None:
+        x32 = x32 * weight.float()
+    return x32.to(x.dtype)
+
+
+class MemoryEfficientAttentionQKNormOp(torch.autograd.Function):
+    """
+    ``memory_efficient_attention(norm(query), norm(key), value)`` with the
+    cutlass kernels, where the per-head norms of ``query`` and ``key`` run in
+    a single kernel (see `memory_efficient_attention_qk_norm`). Only the
+    inputs are saved for the backward: the normalized query and key are
+    recomputed by the backward (which is cheap compared to the attention
+    backward) rather than kept alive
+    """
+
+    NORM_OPERATOR = get_xformers_operator("qk_norm")
+    NORM_BACKWARD_OPERATOR = get_xformers_operator("qk_norm_backward")
+
+    @staticmethod
+    def forward(  # type: ignore
+        ctx, query, key, value, q_weight, k_weight, attn_bias, p, scale, rms_norm, eps
+    ):
+        op = MemoryEfficientAttentionCutlassOp
+        q_norm, k_norm, _, _ = MemoryEfficientAttentionQKNormOp.NORM_OPERATOR(
+            query, key, q_weight, k_weight, rms_norm, eps
+        )
+        bias = op._bias_tensor(query, attn_bias)
+        K, Kv = query.shape[-1], value.shape[-1]
+        if scale is None:
+            scale = K**-0.5
+        q_norm, k_norm, value_padded = op._pad_head_dims(q_norm, k_norm, value)
+        out, lse, rng_seed, rng_offset = op.FORWARD_OPERATOR(
+            query=q_norm,
+            key=k_norm,
+            value=value_padded,
+            cu_seqlens_q=None,
+            cu_seqlens_k=None,
+            max_seqlen_q=-1,
+            compute_logsumexp=True,
+            causal=isinstance(attn_bias, LowerTriangularMask),
+            attn_bias=bias,
+            dropout_p=p,
+            window_size=op._window_size(attn_bias),
+            scale=scale,
+        )
+        ctx.save_for_backward(query, key, value, q_weight, k_weight, lse, out, bias)
+        ctx.p = p
+        ctx.rng_seed = rng_seed
+        ctx.rng_offset = rng_offset
+        ctx.causal = isinstance(attn_bias, LowerTriangularMask)
+        ctx.window_size = op._window_size(attn_bias)
+        ctx.scale = scale
+        ctx.rms_norm = rms_norm
+        ctx.eps = eps
+        return out[..., :Kv]
+
+    @staticmethod
+    def backward(ctx, grad):
+        op = MemoryEfficientAttentionCutlassOp
+        query, key, value, q_weight, k_weight, lse, out, bias = ctx.saved_tensors
+        q_norm, k_norm, mean, rstd = MemoryEfficientAttentionQKNormOp.NORM_OPERATOR(
+            query, key, q_weight, k_weight, ctx.rms_norm, ctx.eps
+        )
+        K, Kv = query.shape[-1], value.shape[-1]
+        q_norm, k_norm, value_padded = op._pad_head_dims(q_norm, k_norm, value)
+        if Kv != out.shape[-1]:
+            grad = torch.nn.functional.pad(grad, [0, out.shape[-1] - Kv])
+        (
+            grad_q_norm,
+            grad_k_norm,
+            grad_v,
+        ) = torch.ops.xformers.efficient_attention_backward_cutlass(
+            grad.to(query.dtype),
+            q_norm,
+            k_norm,
+            value_padded,
+            lse,
+            out,
+            causal=ctx.causal,
+            attn_bias=bias,
+            dropout_p=ctx.p,
+            rng_seed=ctx.rng_seed,
+            rng_offset=ctx.rng_offset,
+            window_size=ctx.window_size,
+            scale=ctx.scale,
+        )
+        (
+            grad_q,
+            grad_k,
+            grad_q_weight,
+            grad_k_weight,
+        ) = MemoryEfficientAttentionQKNormOp.NORM_BACKWARD_OPERATOR(
+            grad_q_norm[..., :K],
+            grad_k_norm[..., :K],
+            query,
+            key,
+            mean,
+            rstd,
+            q_weight,
+            k_weight,
+            ctx.rms_norm,
+        )
+        return (
+            grad_q,
+            grad_k,
+            grad_v[..., :Kv],
+            grad_q_weight if q_weight is not None else None,
+            grad_k_weight if k_weight is not None else None,
+            None,
+            None,
+            None,
+            None,
+            None,
+        )
+
+
+def memory_efficient_attention_qk_norm(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    attn_bias: Optional[Union[torch.Tensor, AttentionMask]] = None,
+    p: float = 0.0,
+    scale: Optional[float] = None,
+    *,
+    q_weight: Optional[torch.Tensor] = None,
+    k_weight: Optional[torch.Tensor] = None,
+    norm: str = "rms",
+    eps: float = 1e-6,
+) -> torch.Tensor:
+    """
+    Attention with "QK-norm": ``query`` and ``key`` [batch, seqlen, num_heads, K]
+    are normalized over the head dim before the attention, with an RMSNorm
+    (``norm="rms"``) or a LayerNorm without bias (``norm="layer"``), and the
+    optional weights ``q_weight`` / ``k_weight`` [K].
+
+    On CUDA, with a head dim multiple of 8 (4 for f32) and at most 512, the
+    norms of the query and the key run in a single kernel. Only the inputs are
+    saved for the backward (not the normalized query and key), and the
+    gradients of the norms are fused in a single kernel as well.
+    Falls back to PyTorch ops and `memory_efficient_attention` otherwise.
+    ``attn_bias`` can be a tensor or a `LowerTriangularMask`
+    """
+    if norm not in ["rms", "layer"]:
+        raise ValueError(f"Invalid norm: {norm} (expected 'rms' or 'layer')")
+    rms_norm = norm == "rms"
+    alignment = 16 // query.element_size()
+    if (
+        MemoryEfficientAttentionQKNormOp.NORM_OPERATOR.__name__ == "no_such_operator"
+        or not query.is_cuda
+        or query.ndim != 4
+        or query.shape[-1] % alignment != 0
+        or query.shape[-1] > 512
+        or isinstance(attn_bias, TreeAttentionMask)
+        or (
+            attn_bias is not None
+            and not isinstance(attn_bias, (torch.Tensor, LowerTriangularMask))
+        )
+    ):
+        return memory_efficient_attention(
+            _qk_norm_torch(query, q_weight, rms_norm, eps),
+            _qk_norm_torch(key, k_weight, rms_norm, eps),
+            value,
+            attn_bias,
+            p,
+            scale=scale,
+        )
+    return MemoryEfficientAttentionQKNormOp.apply(
+        query, key, value, q_weight, k_weight, attn_bias, p, scale, rms_norm, eps
+    )
+
+
+def memory_efficient_attention_kernel_stats(
+    reset: bool = False,
+) -> Dict[str, Dict[str, int]]:
+    """
+    Returns how many times every cutlass kernel was launched (``"kernels"``),
+    and why less efficient kernels had to be used (``"fallbacks"``, eg
+    ``"cutlassF:unaligned_key"``), since the start of the process or the
+    last reset.
+    The launches also show up under their kernel name in the PyTorch profiler,
+    and as NVTX ranges with ``torch.autograd.profiler.emit_nvtx()``.
+    """
+    kernels, kernel_counts, fallbacks, fallback_counts = get_xformers_operator(
+        "_mem_eff_attention_kernel_stats"
+    )(reset)
+    return {
+        "kernels": dict(zip(kernels, kernel_counts)),
+        "fallbacks": dict(zip(fallbacks, fallback_counts)),
+    }
+
+
+# Phases of `kernel_profile.h`, in order
+MEMORY_EFFICIENT_ATTENTION_PROFILE_PHASES = [
+    "setup",
+    "mm0",
+    "softmax",
+    "mm1",
+    "epilogue",
+]
+
+
+def memory_efficient_attention_profile(reset: bool = True) -> Dict[str, torch.Tensor]:
+    """
+    For builds with ``XFORMERS_MEM_EFF_ATTENTION_PROFILE=1``: returns, for every
+    cutlass forward kernel launched since the last reset, the cycles spent by
+    every warp of every CTA in each of the
+    ``MEMORY_EFFICIENT_ATTENTION_PROFILE_PHASES``, as an int64 tensor of shape
+    [num_ctas, num_warps, num_phases] (with the CTAs of all the launches
+    concatenated). Empty for other builds.
+    ``python xformers/benchmarks/profile_mem_eff_attention.py`` summarizes them.
+    """
+    names, cycles = get_xformers_operator("_mem_eff_attention_profile")(reset)
+    return dict(zip(names, cycles))
+
+
+def _nested_max_seqlen(x: torch.Tensor) -> Optional[int]:
+    # Cached by the nested tensor when it is known (eg built from a list of
+    # tensors). Otherwise, the kernel computes it from the offsets
+    max_seqlen = getattr(x, "_metadata_cache", {}).get("max_seqlen")
+    return None if max_seqlen is None else int(max_seqlen)
+
+
+def _memory_efficient_attention_nested(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    attn_bias: Optional[Union[torch.Tensor, AttentionMask]],
+    p: float,
+    op,
+    scale: Optional[float],
+    softcap: Optional[float],
+) -> torch.Tensor:
+    """
+    `memory_efficient_attention` for jagged nested tensors of shape
+    [batch, (seqlen), num_heads, K]: their values are already the
+    concatenated sequences that the cutlass kernels take with ``cu_seqlens``,
+    so they are used in place, with the offsets of the nested tensors as
+    ``cu_seqlens``. The output is a nested tensor with the offsets of ``query``
+    """
+    if not hasattr(torch, "jagged"):
+        raise NotImplementedError(
+            "memory_efficient_attention: nested tensors require PyTorch 2.2+ "
+            f"(for layout=torch.jagged), but got PyTorch {torch.__version__}"
+        )
+    for name, x in [("query", query), ("key", key), ("value", value)]:
+        if not x.is_nested or x.layout != torch.jagged:
+            raise ValueError(
+                f"{name} should be a nested tensor with layout=torch.jagged, "
+                "like query"
+            )
+        if x.dim() != 4 or x._ragged_idx != 1:
+            raise ValueError(
+                f"Invalid shape for {name}: {x.shape}. "
+                "Expected shape [batch, (seqlen), num_heads, K]."
+            )
+        if getattr(x, "_lengths", None) is not None:
+            # eg from `torch.nested.narrow`: the sequences are not contiguous
+            # in `values()`, which `cu_seqlens` can't describe
+            raise NotImplementedError(
+                f"{name}: nested tensors with holes (non-contiguous sequences) "
+                "are not supported"
+            )
+    if attn_bias is not None and not isinstance(attn_bias, LowerTriangularMask):
+        raise NotImplementedError(f"Unsupported attn_bias type: {type(attn_bias)}")
+    if MemoryEfficientAttentionCutlassOp._window_size(attn_bias) is not None:
+        raise NotImplementedError("LowerTriangularMaskWithWindow is not supported")
+    if p != 0.0:
+        raise NotImplementedError("Dropout is not supported with nested tensors")
+    if op is not None and op is not MemoryEfficientAttentionCutlassOp:
+        raise NotImplementedError(
+            f"{op.NAME} does not support nested tensors, only "
+            f"{MemoryEfficientAttentionCutlassOp.NAME} does"
+        )
+
+    offsets_q = query.offsets()
+    out = MemoryEfficientAttentionCutlassGroupedOp.apply(
+        query.values().unsqueeze(0),
+        key.values().unsqueeze(0),
+        value.values().unsqueeze(0),
+        offsets_q.to(torch.int32),
+        key.offsets().to(torch.int32),
+        _nested_max_seqlen(query),
+        isinstance(attn_bias, LowerTriangularMask),
+        scale,
+        softcap or 0.0,
+    )
+    return torch.nested.nested_tensor_from_jagged(out[0], offsets_q)
 
 
 def memory_efficient_attention(
@@ -734,6 +1978,8 @@ def memory_efficient_attention(
     p: float = 0.0,
     *,
     op=None,
+    scale: Optional[float] = None,
+    softcap: Optional[float] = None,
 ):
     """
     Implements the memory-efficient attention mechanism following
@@ -743,8 +1989,29 @@ def memory_efficient_attention(
         [batch, seqlen, num_heads, K]
         [batch, seqlen, K] (Legacy format)
     Inputs can be non-contiguous - we only require the last dimension's stride to be 0
+
+    For multi-query / grouped-query attention, ``key`` and ``value`` can have
+    fewer heads than ``query`` (``num_heads`` must be a multiple of it). Every key/value
+    head is shared by ``num_heads // num_kv_heads`` consecutive query heads.
+
+    ``query``, ``key`` and ``value`` can also be nested tensors with
+    ``layout=torch.jagged``, of shape [batch, (seqlen), num_heads, K], where
+    every sequence has its own length (and the keys their own lengths). They
+    are processed in the layout of the nested tensors, without padding nor
+    copies (only ``attn_bias=None`` and `LowerTriangularMask`, without
+    dropout).
+
+    The scores ``query @ key.T`` are scaled by ``scale`` (``1 / sqrt(K)`` by
+    default). If ``softcap`` is set, the scaled scores are soft-capped to
+    ``softcap * tanh(scores / softcap)`` before the bias is added (cutlass
+    only). The cutlass kernels apply both in the forward and the backward,
+    and the other operators get a scaled copy of the query.
     """
 
+    if getattr(query, "is_nested", False):
+        return _memory_efficient_attention_nested(
+            query, key, value, attn_bias, p, op, scale, softcap
+        )
     if query.ndim not in [3, 4]:
         raise ValueError(
             f"Invalid shape for query: {query.shape}. "
@@ -759,12 +2026,24 @@ def memory_efficient_attention(
 
     if op is None:
         op = AttentionOpDispatch.from_arguments(
-            query=query, key=key, value=value, attn_bias=attn_bias, p=p
+            query=query, key=key, value=value, attn_bias=attn_bias, p=p, softcap=softcap
         ).op
 
+    extra_args: Tuple[Any, ...] = ()
+    if op.SUPPORTS_CUSTOM_SCALE:
+        extra_args = (scale, softcap or 0.0)
+    elif softcap:
+        raise NotImplementedError(f"{op.NAME} does not support softcap")
+    elif scale is not None:
+        query = query * (scale * query.shape[-1] ** 0.5)
+
+    if op is MemoryEfficientAttentionCutlassOp and op.supports_cpp(attn_bias):
+        return op.apply_cpp(query, key, value, attn_bias, p, *extra_args).reshape(
+            output_shape
+        )
     # fast-path that doesn't require computing the logsumexp for backward computation
     if all(x.requires_grad is False for x in [query, key, value]):
-        return op.forward_no_grad(
-            query=query, key=key, value=value, attn_bias=attn_bias, p=p
-        ).reshape(output_shape)
-    return op.apply(query, key, value, attn_bias, p).reshape(output_shape)
+        return op.forward_no_grad(query, key, value, attn_bias, p, *extra_args).reshape(
+            output_shape
+        )
+    return op.apply(query, key, value, attn_bias, p, *extra_args).reshape(output_shape)
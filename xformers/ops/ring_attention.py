@@ -0,0 +1,199 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Any, List, Optional, Sequence
+
+import torch
+import torch.distributed as dist
+
+from .memory_efficient_attention import (
+    MemoryEfficientAttentionCutlassOp,
+    merge_attentions,
+)
+
+# The cutlass backward reads the logsumexp by blocks of 32 queries
+_LSE_ALIGNMENT = 32
+
+
+class _RingComm:
+    """
+    Sends tensors to the next rank of ``group`` while receiving the same
+    amount from the previous one.
+    The transfers are asynchronous: with NCCL they run on the communicator's
+    own stream, and overlap with the kernels launched on the current stream
+    until `wait` is called.
+    """
+
+    def __init__(self, group: Optional[Any]) -> None:
+        self.rank = dist.get_rank(group)
+        self.world_size = dist.get_world_size(group)
+        self.group = group
+        next_rank = (self.rank + 1) % self.world_size
+        prev_rank = (self.rank - 1) % self.world_size
+        if group is not None:
+            if hasattr(dist, "get_global_rank"):
+                get_global_rank = dist.get_global_rank
+            else:
+                get_global_rank = dist.distributed_c10d._get_global_rank
+            next_rank = get_global_rank(group, next_rank)
+            prev_rank = get_global_rank(group, prev_rank)
+        self.next_rank, self.prev_rank = next_rank, prev_rank
+        self._reqs: List[Any] = []
+        self._recv: List[torch.Tensor] = []
+        self._sent: List[torch.Tensor] = []
+
+    def exchange(self, tensors: Sequence[torch.Tensor]) -> None:
+        assert not self._reqs, "previous exchange not waited for"
+        if self.world_size == 1:
+            self._recv = list(tensors)
+            return
+        ops = []
+        self._recv = []
+        for x in tensors:
+            recv = torch.empty_like(x)
+            ops.append(dist.P2POp(dist.isend, x, self.next_rank, self.group))
+            ops.append(dist.P2POp(dist.irecv, recv, self.prev_rank, self.group))
+            self._recv.append(recv)
+        self._reqs = dist.batch_isend_irecv(ops)
+        # Keeps the tensors sent alive until the transfer is done
+        self._sent = list(tensors)
+
+    def wait(self) -> List[torch.Tensor]:
+        for req in self._reqs:
+            req.wait()
+        self._reqs, self._sent = [], []
+        recv, self._recv = self._recv, []
+        return recv
+
+
+class RingAttentionOp(torch.autograd.Function):
+    """
+    Attention over a sequence sharded across the ranks of a process group,
+    see `ring_attention`
+    """
+
+    @staticmethod
+    def forward(ctx, query, key, value, causal, group):  # type: ignore
+        op = MemoryEfficientAttentionCutlassOp
+        comm = _RingComm(group)
+        rank, world_size = comm.rank, comm.world_size
+        outs, lses = [], []
+        key, value = key.contiguous(), value.contiguous()
+        k, v = key, value
+        for step in range(world_size):
+            # The shard of keys/values received at `step`
+            src = (rank - step) % world_size
+            if step + 1 < world_size:
+                comm.exchange([k, v])
+            if not causal or src <= rank:
+                out, lse, _, _ = op.FORWARD_OPERATOR(
+                    query=query,
+                    key=k,
+                    value=v,
+                    cu_seqlens_q=None,
+                    cu_seqlens_k=None,
+                    max_seqlen_q=None,
+                    compute_logsumexp=True,
+                    causal=causal and src == rank,
+                )
+                outs.append(out)
+                lses.append(lse)
+            if step + 1 < world_size:
+                k, v = comm.wait()
+        if len(outs) == 1:
+            out, lse = outs[0], lses[0]
+        else:
+            out, partial_lse = merge_attentions(outs, lses)
+            M = query.shape[1]
+            # Padded with +inf like the kernel's LSE: the backward reads the
+            # padding of the last block of queries
+            lse = partial_lse.new_full(
+                [*partial_lse.shape[:2], -(-M // _LSE_ALIGNMENT) * _LSE_ALIGNMENT],
+                float("inf"),
+            )
+            lse[:, :, :M] = partial_lse
+        ctx.save_for_backward(query, key, value, out, lse)
+        ctx.causal = causal
+        ctx.group = group
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        query, key, value, out, lse = ctx.saved_tensors
+        causal = ctx.causal
+        kv_comm, grad_kv_comm = _RingComm(ctx.group), _RingComm(ctx.group)
+        rank, world_size = kv_comm.rank, kv_comm.world_size
+        grad = grad.to(query.dtype)
+        grad_q = torch.zeros(query.shape, dtype=torch.float, device=query.device)
+        k, v = key, value
+        for step in range(world_size):
+            src = (rank - step) % world_size
+            if step + 1 < world_size:
+                kv_comm.exchange([k, v])
+            grads = None
+            if not causal or src <= rank:
+                # The gradients of a shard only depend on the final output
+                # and logsumexp, not on the other shards
+                grads = torch.ops.xformers.efficient_attention_backward_cutlass(
+                    grad, query, k, v, lse, out, causal=causal and src == rank
+                )
+                grad_q += grads[0]
+            # The gradients of `k` / `v` travel around the ring with them,
+            # accumulated in float32 by every rank they pass through
+            if step == 0:
+                grad_k = torch.zeros(k.shape, dtype=torch.float, device=k.device)
+                grad_v = torch.zeros(v.shape, dtype=torch.float, device=v.device)
+            else:
+                grad_k, grad_v = grad_kv_comm.wait()
+            if grads is not None:
+                grad_k += grads[1]
+                grad_v += grads[2]
+            # After the last step, this brings them back to their shard
+            grad_kv_comm.exchange([grad_k, grad_v])
+            if step + 1 < world_size:
+                k, v = kv_comm.wait()
+        grad_k, grad_v = grad_kv_comm.wait()
+        return (
+            grad_q.to(query.dtype),
+            grad_k.to(key.dtype),
+            grad_v.to(value.dtype),
+            None,
+            None,
+        )
+
+
+def ring_attention(
+    query: torch.Tensor,
+    key: torch.Tensor,
+    value: torch.Tensor,
+    causal: bool = False,
+    group: Optional[Any] = None,
+) -> torch.Tensor:
+    """
+    Attention over a sequence sharded across the ranks of ``group`` (the
+    default process group if None), for contexts too long for a single GPU.
+
+    Every rank passes its shard of the queries [batch, seqlen, num_heads, K]
+    and of the keys/values [batch, seqlen_kv, num_kv_heads, K/Kv], with the
+    shards in rank order along the sequence. The keys/values go around the
+    ring of ranks, and the transfer of the next shard overlaps with the
+    kernels of the current one. The partial outputs are merged with their
+    logsumexp (see `merge_attentions`) and the output of the local queries is
+    returned.
+    The backward sends the keys/values around the ring again, along with their
+    gradients, which end up on the rank which holds the shard.
+
+    With ``causal=True``, query ``i`` of the whole sequence attends to the
+    keys ``<= i``, which requires shards of the same length for the queries
+    and the keys. Ranks skip the shards after their own, so the last ranks
+    do most of the work.
+    """
+    if causal and query.shape[1] != key.shape[1]:
+        raise ValueError(
+            "ring_attention with causal=True requires shards of the same "
+            f"length for the queries and the keys, got {query.shape[1]} and "
+            f"{key.shape[1]}"
+        )
+    return RingAttentionOp.apply(query, key, value, causal, group)
@@ -8,6 +8,7 @@ from typing import Dict, Optional, Sequence, Tuple, Union
 
 import torch
 import torch.nn.functional as F
+import torch.utils.checkpoint
 from torch import nn
 
 from .common import get_xformers_operator
@@ -242,6 +243,17 @@ def _only_half_or_autocast(op: SwiGLUOpDispatch) -> bool:
     )
 
 
+def _only_sm80_half_or_cpu(op: SwiGLUOpDispatch) -> bool:
+    # The packed op also has CPU kernels, for any floating-point dtype
+    device_type = op.device if isinstance(op.device, str) else op.device.type
+    if device_type == "cpu":
+        return (
+            op.dtype in [torch.float, torch.double, torch.bfloat16]
+            and SwiGLUPackedFusedOp.info() == "available"
+        )
+    return _only_sm80(op) and _only_half_or_autocast(op)
+
+
 def _bias_enabled(op: SwiGLUOpDispatch) -> bool:
     return op.bias_enabled
 
@@ -256,7 +268,7 @@ SwiGLUPackedFusedOp = _ForwardToFunc(
     get_xformers_operator("swiglu_packedw"),
     True,
     "fused.p.cpp",
-    constraints=[_only_sm80, _only_half_or_autocast],
+    constraints=[_only_sm80_half_or_cpu],
 )
 SwiGLUEagerOp = _ForwardToFunc(
     _eager_functional_swiglu,
@@ -280,6 +292,9 @@ def swiglu(
     b3: Optional[torch.Tensor],
     *,
     op: SwiGLUOp = None,
+    recompute: bool = False,
+    accumulate_grad: bool = False,
+    overlap_wgrad: bool = False,
 ) -> torch.Tensor:
     """
     Computes a SwiGLU block given the weights/bias of the 3
@@ -287,12 +302,25 @@ def swiglu(
     It is recommended to keep `op=None` so the best implementation
     available for the inputs will be used.
 
+    With `recompute=True`, only `x` is saved for the backward, and the
+    hidden activations are computed again there (one extra dual-gemm, but
+    two `[B, H]` tensors less of activation memory)
+
+    With `accumulate_grad=True` (gradient accumulation), the packed op adds
+    the gradients of the weights directly into their existing `.grad`
+    instead of allocating new ones. As this bypasses autograd's
+    gradient accumulation, it is off by default, and weights with gradient
+    hooks (including the ones registered by DDP/FSDP) still get their
+    gradients through autograd
+
+    With `overlap_wgrad=True`, the backward of the packed op computes the
+    gradients of the weights on a side stream, concurrently with the
+    gradient of `x`
+
     NOTE: It's better to provide w1/w2 and b1/b2 are packed together
         to allow for faster implementations
     """
 
-    batch_shape = x.shape[:-1]
-    x = x.reshape([-1, x.shape[-1]])
     if w1.ndim != 2 or w1.shape != w2.shape:
         raise ValueError(f"Invalid shapes for w1: {w1.shape} / w2: {w2.shape}")
     if b1 is not None:
@@ -311,7 +339,15 @@ def swiglu(
         op = SwiGLUOpDispatch.from_arguments(x, w1, b1, w2, b2, w3, b3).op
 
     if not op.PACKED_WEIGHTS:
-        return op(x, w1, b1, w2, b2, w3, b3).reshape([*batch_shape, -1])
+        batch_shape = x.shape[:-1]
+        x = x.reshape([-1, x.shape[-1]])
+        if recompute and torch.is_grad_enabled():
+            out = torch.utils.checkpoint.checkpoint(
+                op, x, w1, b1, w2, b2, w3, b3, use_reentrant=False
+            )
+        else:
+            out = op(x, w1, b1, w2, b2, w3, b3)
+        return out.reshape([*batch_shape, -1])
     w1w2 = stack_or_none((w1, w2), dim=0)
     if b1 is not None and b2 is not None:
         b1b2: Optional[torch.Tensor] = stack_or_none((b1, b2), dim=0)
@@ -323,7 +359,86 @@ def swiglu(
 
     if w1w2 is None:
         raise NotImplementedError("w1/w2 needs to be properly packed")
-    return op(x, w1w2, b1b2, w3, b3).reshape([*batch_shape, -1])
+    # The packed op takes `[..., I]` inputs directly, so that strided views
+    # (eg a slice of a larger activation) are not copied
+    return op(x, w1w2, b1b2, w3, b3, recompute, accumulate_grad, overlap_wgrad)
+
+
+def swiglu_quantize_weight(
+    w: torch.Tensor, bits: int = 8, group_size: Optional[int] = None
+) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Symmetric weight-only quantization of `w` [..., K] for `swiglu_quantized`,
+    with a scale per output channel, or per group of `group_size` inputs.
+    Returns the quantized weights (int8 [..., K], or int4 packed two per byte
+    as uint8 [..., K // 2]: the even input in the low nibble, with an offset
+    of 8) and the scales [..., K // group_size], in the dtype of `w`
+    """
+    if bits not in [4, 8]:
+        raise ValueError(f"Only int8 and int4 are supported (got {bits} bits)")
+    K = w.shape[-1]
+    group_size = group_size or K
+    if K % group_size != 0:
+        raise ValueError(f"Invalid group_size={group_size} for {K} inputs")
+    qmax = 2 ** (bits - 1) - 1
+    w_groups = w.float().unflatten(-1, (K // group_size, group_size))
+    scale = w_groups.abs().amax(-1).clamp(min=1e-8) / qmax
+    q = (w_groups / scale.unsqueeze(-1)).round().clamp(-qmax - 1, qmax).flatten(-2)
+    if bits == 4:
+        q = (q + 8).to(torch.uint8)
+        q = q[..., ::2] | (q[..., 1::2] << 4)
+    else:
+        q = q.to(torch.int8)
+    return q, scale.to(w.dtype)
+
+
+def swiglu_quantized(
+    x: torch.Tensor,
+    w1w2: torch.Tensor,
+    w1w2_scale: torch.Tensor,
+    b1b2: Optional[torch.Tensor],
+    w3: torch.Tensor,
+    w3_scale: torch.Tensor,
+    b3: Optional[torch.Tensor],
+) -> torch.Tensor:
+    """
+    Inference-only SwiGLU with weight-only quantized weights, as returned by
+    `swiglu_quantize_weight` for the packed `w1w2` [2, H, I] and `w3` [O, H].
+
+    For decode-size batches, the weights are dequantized in registers
+    and only their quantized bytes are read from memory
+    """
+    return torch.ops.xformers.swiglu_packedw_quantized(
+        x, w1w2, w1w2_scale, b1b2, w3, w3_scale, b3
+    )
+
+
+def swiglu_sparse24(
+    x: torch.Tensor,
+    w1w2: Tuple[torch.Tensor, torch.Tensor],
+    b1b2: Optional[torch.Tensor],
+    w3: Tuple[torch.Tensor, torch.Tensor],
+    b3: Optional[torch.Tensor],
+) -> torch.Tensor:
+    """
+    Inference-only SwiGLU with 2:4 structured sparse weights (at most 2
+    non-zeros in every group of 4 consecutive inputs), which run on the
+    sparse tensor cores of A100+ GPUs.
+    `w1w2` and `w3` are the (values, metadata) returned by
+    `swiglu_sparse24_compress` for the packed [2 * H, I] weight of w1/w2 and
+    for w3 [O, H]
+    """
+    return torch.ops.xformers.swiglu_packedw_sparse24(
+        x, w1w2[0], w1w2[1], b1b2, w3[0], w3[1], b3
+    )
+
+
+def swiglu_sparse24_compress(w: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Compresses a 2:4 sparse weight [M, K] for `swiglu_sparse24`. Raises if a
+    group of 4 inputs has more than 2 non-zeros
+    """
+    return torch.ops.xformers.sparse24_compress(w)
 
 
 class SwiGLU(nn.Module):
@@ -339,6 +454,9 @@ class SwiGLU(nn.Module):
         bias: bool = True,
         *,
         _pack_weights: bool = True,
+        recompute: bool = False,
+        accumulate_grad: bool = False,
+        overlap_wgrad: bool = False,
     ) -> None:
         super().__init__()
         out_features = out_features or in_features
@@ -357,9 +475,19 @@ class SwiGLU(nn.Module):
         self.out_features = out_features
         self.in_features = in_features
         self.op = None
+        self.recompute = recompute
+        self.accumulate_grad = accumulate_grad
+        self.overlap_wgrad = overlap_wgrad
 
     def forward(self, x: torch.Tensor) -> torch.Tensor:
-        return swiglu(x, *self._ordered_params(), op=self.op)
+        return swiglu(
+            x,
+            *self._ordered_params(),
+            op=self.op,
+            recompute=self.recompute,
+            accumulate_grad=self.accumulate_grad,
+            overlap_wgrad=self.overlap_wgrad,
+        )
 
     def _ordered_params(self):
         """Used for testing - returns ordered arguments for operators"""
@@ -0,0 +1,240 @@
+# Copyright (c) Facebook, Inc. and its affiliates. All rights reserved.
+#
+# This source code is licensed under the BSD license found in the
+# LICENSE file in the root directory of this source tree.
+
+from typing import Any, List, Optional, Tuple
+
+import torch
+import torch.distributed as dist
+
+from .swiglu_op import SwiGLUOp, swiglu
+
+
+def _all_gather(x: torch.Tensor, group: Optional[Any]) -> Tuple[torch.Tensor, Any]:
+    """
+    Concatenates the rows of ``x`` of all the ranks, in rank order.
+    Asynchronous: the result can only be used after ``wait()``
+    """
+    out = x.new_empty([dist.get_world_size(group) * x.shape[0], *x.shape[1:]])
+    if hasattr(dist, "all_gather_into_tensor"):
+        all_gather = dist.all_gather_into_tensor
+    else:
+        all_gather = dist._all_gather_base
+    return out, all_gather(out, x.contiguous(), group=group, async_op=True)
+
+
+def _reduce_scatter(x: torch.Tensor, group: Optional[Any]) -> Tuple[torch.Tensor, Any]:
+    """
+    Sums ``x`` over all the ranks, and returns the block of rows of this rank.
+    Asynchronous: the result can only be used after ``wait()``
+    """
+    out = x.new_empty([x.shape[0] // dist.get_world_size(group), *x.shape[1:]])
+    if hasattr(dist, "reduce_scatter_tensor"):
+        reduce_scatter = dist.reduce_scatter_tensor
+    else:
+        reduce_scatter = dist._reduce_scatter_base
+    return out, reduce_scatter(out, x.contiguous(), group=group, async_op=True)
+
+
+def _local_swiglu(
+    x: torch.Tensor,
+    w1w2: torch.Tensor,
+    b1b2: Optional[torch.Tensor],
+    w3: torch.Tensor,
+    op: Optional[SwiGLUOp],
+) -> torch.Tensor:
+    # The bias of the last layer is added once, after the reduction
+    return swiglu(
+        x,
+        w1w2[0],
+        b1b2[0] if b1b2 is not None else None,
+        w1w2[1],
+        b1b2[1] if b1b2 is not None else None,
+        w3,
+        None,
+        op=op,
+    )
+
+
+class SwiGLUTensorParallelOp(torch.autograd.Function):
+    """
+    SwiGLU with its hidden features sharded across the ranks of a process
+    group, see `swiglu_tensor_parallel`
+    """
+
+    @staticmethod
+    def forward(  # type: ignore
+        ctx, x, w1w2, b1b2, w3, b3, group, num_chunks, sequence_parallel, op
+    ):
+        x_shape = x.shape
+        x = x.reshape([-1, x.shape[-1]])
+        chunk_rows = max(1, -(-x.shape[0] // num_chunks))
+        chunks = x.split(chunk_rows)
+        needs_grad = any(ctx.needs_input_grad[:4])
+        # Each chunk is its own graph, so that the backward of a chunk can
+        # overlap with the reduction of the gradients of the previous one
+        leaves = [
+            None if w is None else w.detach().requires_grad_(w.requires_grad)
+            for w in [w1w2, b1b2, w3]
+        ]
+        inputs: List[torch.Tensor] = []
+        partials: List[torch.Tensor] = []
+        outs: List[torch.Tensor] = []
+        works: List[Any] = []
+        with torch.set_grad_enabled(needs_grad):
+            if sequence_parallel:
+                gathered = _all_gather(chunks[0], group)
+            for i, x_chunk in enumerate(chunks):
+                if sequence_parallel:
+                    x_chunk, work = gathered
+                    work.wait()
+                    if i + 1 < len(chunks):
+                        gathered = _all_gather(chunks[i + 1], group)
+                x_chunk = x_chunk.detach().requires_grad_(ctx.needs_input_grad[0])
+                partial = _local_swiglu(x_chunk, *leaves, op=op)
+                # The gemms of the next chunk run while this one is reduced.
+                # The reduction is in place for the all-reduce: the backward
+                # of the chunk doesn't read its output
+                if sequence_parallel:
+                    out, work = _reduce_scatter(partial.detach(), group)
+                else:
+                    out = partial.detach()
+                    work = dist.all_reduce(out, group=group, async_op=True)
+                inputs.append(x_chunk)
+                partials.append(partial)
+                outs.append(out)
+                works.append(work)
+        for work in works:
+            work.wait()
+        out = torch.cat(outs)
+        if b3 is not None:
+            out += b3
+
+        if needs_grad:
+            ctx.inputs, ctx.partials, ctx.leaves = inputs, partials, leaves
+        ctx.x_shape = x_shape
+        ctx.chunk_rows = chunk_rows
+        ctx.group = group
+        ctx.sequence_parallel = sequence_parallel
+        ctx.has_b3 = b3 is not None
+        return out.reshape([*x_shape[:-1], out.shape[-1]])
+
+    @staticmethod
+    def backward(ctx, grad):  # type: ignore
+        group, sequence_parallel = ctx.group, ctx.sequence_parallel
+        grad = grad.reshape([-1, grad.shape[-1]])
+        grad_chunks = grad.split(ctx.chunk_rows)
+        grad_b3 = None
+        if ctx.has_b3 and ctx.needs_input_grad[4]:
+            grad_b3 = grad.sum(0)
+            if sequence_parallel:
+                # Each rank only has the gradients of its own rows
+                dist.all_reduce(grad_b3, group=group)
+        if not any(ctx.needs_input_grad[:4]):
+            return (None, None, None, None, grad_b3, None, None, None, None)
+
+        leaves = [w for w in ctx.leaves if w is not None and w.requires_grad]
+        grad_leaves: List[Optional[torch.Tensor]] = [None] * len(leaves)
+        grad_xs: List[torch.Tensor] = []
+        works: List[Any] = []
+        if sequence_parallel:
+            gathered = _all_gather(grad_chunks[0], group)
+        for i, (x_chunk, partial) in enumerate(zip(ctx.inputs, ctx.partials)):
+            if sequence_parallel:
+                grad_chunk, work = gathered
+                work.wait()
+                if i + 1 < len(grad_chunks):
+                    gathered = _all_gather(grad_chunks[i + 1], group)
+            else:
+                grad_chunk = grad_chunks[i]
+            wrt = ([x_chunk] if x_chunk.requires_grad else []) + leaves
+            grads = list(torch.autograd.grad(partial, wrt, grad_chunk))
+            if x_chunk.requires_grad:
+                # Every rank has a partial sum of the gradient of `x` (over
+                # its hidden features): reduced while the next chunk runs
+                grad_x = grads.pop(0)
+                if sequence_parallel:
+                    grad_x, work = _reduce_scatter(grad_x, group)
+                else:
+                    work = dist.all_reduce(grad_x, group=group, async_op=True)
+                grad_xs.append(grad_x)
+                works.append(work)
+            grad_leaves = [
+                g if acc is None else acc.add_(g) for acc, g in zip(grad_leaves, grads)
+            ]
+        # Frees the activations
+        ctx.inputs, ctx.partials = [], []
+        for work in works:
+            work.wait()
+
+        grad_weights: List[Optional[torch.Tensor]] = []
+        for w in ctx.leaves:
+            if w is not None and w.requires_grad:
+                grad_weights.append(grad_leaves.pop(0))
+            else:
+                grad_weights.append(None)
+        grad_x = None
+        if grad_xs:
+            grad_x = torch.cat(grad_xs).reshape(ctx.x_shape)
+        return (grad_x, *grad_weights, grad_b3, None, None, None, None)
+
+
+def swiglu_tensor_parallel(
+    x: torch.Tensor,
+    w1w2: torch.Tensor,
+    b1b2: Optional[torch.Tensor],
+    w3: torch.Tensor,
+    b3: Optional[torch.Tensor],
+    group: Optional[Any] = None,
+    *,
+    num_chunks: int = 4,
+    sequence_parallel: bool = False,
+    op: Optional[SwiGLUOp] = None,
+) -> torch.Tensor:
+    """
+    SwiGLU with tensor parallelism: the hidden features are sharded across
+    the ranks of ``group`` (the default process group if None).
+
+    Every rank passes its shard of the packed weights: ``w1w2`` [2, H, I] and
+    ``b1b2`` [2, H] are sharded along the hidden features (column-parallel),
+    and ``w3`` [O, H] as well (row-parallel). ``b3`` [O] is not sharded.
+    Every rank computes a partial output over its hidden features, which are
+    summed over the ranks.
+
+    The rows of ``x`` are processed by ``num_chunks`` chunks, and the
+    reduction of a chunk overlaps with the gemms of the next one. The
+    backward does the same for the gradient of ``x``.
+
+    By default, ``x`` [..., I] and the output [..., O] are the same on all
+    the ranks, and the partial outputs are all-reduced.
+    With ``sequence_parallel=True``, every rank passes its own rows of ``x``
+    instead (all the ranks with the same number): they are all-gathered
+    before the layer, and the partial outputs are reduce-scattered back, so
+    that every rank gets the output of its rows.
+    """
+    if w1w2.ndim != 3 or w1w2.shape[0] != 2:
+        raise ValueError(f"Invalid shape for w1w2: {w1w2.shape}")
+    if b1b2 is not None and b1b2.shape != w1w2.shape[:2]:
+        raise ValueError(f"Invalid shapes for w1w2: {w1w2.shape} / b1b2: {b1b2.shape}")
+    if w3.ndim != 2 or w3.shape[1] != w1w2.shape[1]:
+        raise ValueError(f"Invalid shapes for w1w2: {w1w2.shape} / w3: {w3.shape}")
+    if b3 is not None and (b3.ndim != 1 or b3.shape[0] != w3.shape[0]):
+        raise ValueError(f"Invalid shapes for w3: {w3.shape} / b3: {b3.shape}")
+    if num_chunks < 1:
+        raise ValueError(f"Invalid num_chunks: {num_chunks}")
+
+    if dist.get_world_size(group) == 1:
+        return swiglu(
+            x,
+            w1w2[0],
+            b1b2[0] if b1b2 is not None else None,
+            w1w2[1],
+            b1b2[1] if b1b2 is not None else None,
+            w3,
+            b3,
+            op=op,
+        )
+    return SwiGLUTensorParallelOp.apply(
+        x, w1w2, b1b2, w3, b3, group, num_chunks, sequence_parallel, op
+    )
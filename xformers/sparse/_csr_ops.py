@@ -3,14 +3,16 @@
 # This source code is licensed under the BSD license found in the
 # LICENSE file in the root directory of this source tree.
 
+import math
 
 import torch
 
-from .utils import _csr_to_coo, _transpose_with_info
+from .utils import _csr_to_coo, _get_compressed_indices, _transpose_with_info
 
 
 def _should_use_coo(a, sparsity):
-    if not a.is_cuda:
+    # the coo / csr_ge kernels only support float32
+    if not a.is_cuda or a.dtype != torch.float32:
         return False
     B, M, K = a.shape
     # amortize overhead of converting from csr to coo
@@ -27,12 +29,17 @@ def _should_use_coo(a, sparsity):
 
 
 def _should_use_csr_ge(a, sparsity):
-    if not a.is_cuda:
+    if not a.is_cuda or a.dtype != torch.float32:
         return False
     return sparsity > 0.99
 
 
 def _sddmm_func(a, b, row_indices, row_offsets, column_indices):
+    # only sputnik supports per-batch patterns
+    if row_offsets.shape[0] != a.shape[1] + 1:
+        return torch.ops.xformers.sddmm_sputnik(
+            a, b, row_indices, row_offsets, column_indices
+        )
     sparsity = 1 - column_indices.shape[0] / (a.shape[1] * b.shape[1])
     if _should_use_coo(a, sparsity):
         m = a.shape[-2]
@@ -164,3 +171,218 @@ class _spmm(torch.autograd.Function):
         )
 
         return grad_dense, None, grad_sparse, None, None, None, None
+
+
+class _spmm_bias_act(torch.autograd.Function):
+    """
+    activation(a @ b + bias[:, None]) for a sparse `a` with `m` rows, with the
+    bias and the activation fused in the epilogue of the spmm kernel
+    """
+
+    @staticmethod
+    def forward(
+        ctx,
+        b,
+        row_indices,
+        values,
+        row_offsets,
+        column_indices,
+        m,
+        _transp_info,
+        bias,
+        activation,
+    ):
+        b = b.contiguous()
+        out, preact = torch.ops.xformers.spmm_bias_act_sputnik(
+            b, row_indices, values, row_offsets, column_indices, m, bias, activation
+        )
+
+        # the derivative of relu only needs the output, gelu needs its input
+        ctx.save_for_backward(
+            b,
+            row_indices,
+            values,
+            row_offsets,
+            column_indices,
+            out if activation == "relu" else preact,
+            *_transp_info,
+        )
+        ctx.activation = activation
+        ctx.bias_dtype = None if bias is None else bias.dtype
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            b,
+            row_indices,
+            values,
+            row_offsets,
+            column_indices,
+            act_input,
+            *_transp_info,
+        ) = ctx.saved_tensors
+        k = b.shape[1]
+
+        grad = grad.contiguous()
+        if ctx.activation == "relu":
+            grad = grad * (act_input > 0)
+        elif ctx.activation == "gelu":
+            x = act_input.float()
+            cdf = 0.5 * (1 + torch.erf(x * 0.5**0.5))
+            pdf = torch.exp(-0.5 * x * x) * (2 * math.pi) ** -0.5
+            grad = (grad * (cdf + x * pdf)).to(act_input.dtype)
+
+        grad_bias = None
+        if ctx.bias_dtype is not None:
+            grad_bias = grad.sum((0, 2), dtype=torch.float32).to(ctx.bias_dtype)
+
+        # gradients w.r.t. values
+        grad_sparse = _sddmm_func(grad, b, row_indices, row_offsets, column_indices)
+
+        (
+            row_indices_t,
+            values_t,
+            row_offsets_t,
+            column_indices_t,
+        ) = _transpose_with_info(values, _transp_info)
+
+        grad_dense = torch.ops.xformers.spmm_sputnik(
+            grad, row_indices_t, values_t, row_offsets_t, column_indices_t, k
+        )
+
+        return (
+            grad_dense,
+            None,
+            grad_sparse,
+            None,
+            None,
+            None,
+            None,
+            grad_bias,
+            None,
+        )
+
+
+class _sparse_attention(torch.autograd.Function):
+    """
+    softmax(scale * q @ k^T) @ v over the nonzeros of the pattern, without
+    materializing the attention matrix
+    """
+
+    @staticmethod
+    def forward(
+        ctx, q, k, v, row_indices, row_offsets, column_indices, _transp_info, scale
+    ):
+        q, k, v = q.contiguous(), k.contiguous(), v.contiguous()
+        row_indices_t, row_offsets_t, column_indices_t, _ = _transp_info
+        # the indices of the pattern and of its transpose share a dtype
+        size = max(row_offsets.shape[0], row_offsets_t.shape[0]) - 1
+        column_indices = _get_compressed_indices(column_indices, size)
+        column_indices_t = _get_compressed_indices(column_indices_t, size)
+        out, lse = torch.ops.xformers.sparse_attention_sputnik(
+            q, k, v, row_indices, row_offsets, column_indices, scale
+        )
+        ctx.save_for_backward(
+            q,
+            k,
+            v,
+            out,
+            lse,
+            row_indices,
+            row_offsets,
+            column_indices,
+            row_indices_t,
+            row_offsets_t,
+            column_indices_t,
+        )
+        ctx.scale = scale
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        q, k, v, out, lse, *pattern = ctx.saved_tensors
+        grad_q, grad_k, grad_v = torch.ops.xformers.sparse_attention_backward_sputnik(
+            grad.contiguous(), q, k, v, out, lse, *pattern, ctx.scale
+        )
+        return grad_q, grad_k, grad_v, None, None, None, None, None
+
+
+class _sparse_softmax_attention(torch.autograd.Function):
+    """
+    dropout(softmax(q @ k^T)) @ v over the nonzeros of the pattern. The
+    attention probabilities are kept for the backward, which computes the
+    gradients of q and k in a single fused pass, without materializing the
+    gradients of the probabilities and of the scores
+    """
+
+    @staticmethod
+    def forward(
+        ctx, q, k, v, row_indices, row_offsets, column_indices, _transp_info, p
+    ):
+        q, k, v = q.contiguous(), k.contiguous(), v.contiguous()
+        m, n = q.shape[1], k.shape[1]
+        scores = _sddmm_func(q, k, row_indices, row_offsets, column_indices)
+        attn = torch.ops.xformers.sparse_softmax_sputnik(
+            m, n, row_indices, scores, row_offsets, column_indices
+        )
+        attn_dropped = attn
+        if p > 0.0:
+            attn_dropped = torch.nn.functional.dropout(attn, p)
+        out = torch.ops.xformers.spmm_sputnik(
+            v, row_indices, attn_dropped, row_offsets, column_indices, m
+        )
+        ctx.save_for_backward(
+            q,
+            k,
+            v,
+            attn,
+            attn_dropped,
+            row_indices,
+            row_offsets,
+            column_indices,
+            *_transp_info,
+        )
+        return out
+
+    @staticmethod
+    def backward(ctx, grad):
+        (
+            q,
+            k,
+            v,
+            attn,
+            attn_dropped,
+            row_indices,
+            row_offsets,
+            column_indices,
+            *_transp_info,
+        ) = ctx.saved_tensors
+        n = k.shape[1]
+
+        grad = grad.contiguous()
+        op = torch.ops.xformers.sparse_softmax_attention_backward_sputnik
+        grad_q, grad_k = op(
+            grad,
+            q,
+            k,
+            v,
+            attn,
+            attn_dropped,
+            row_indices,
+            row_offsets,
+            column_indices,
+            *_transp_info,
+        )
+
+        (
+            row_indices_t,
+            attn_t,
+            row_offsets_t,
+            column_indices_t,
+        ) = _transpose_with_info(attn_dropped, _transp_info)
+        grad_v = torch.ops.xformers.spmm_sputnik(
+            grad, row_indices_t, attn_t, row_offsets_t, column_indices_t, n
+        )
+
+        return grad_q, grad_k, grad_v, None, None, None, None, None
@@ -11,7 +11,7 @@ from xformers.sparse import _csr_ops
 from xformers.sparse.utils import (
     _csr_to_coo,
     _dense3d_to_sparse,
-    _diffsort,
+    _get_row_indices,
     _get_transpose_info,
     _transpose_with_info,
 )
@@ -35,7 +35,7 @@ class SparseCSRTensor(torch.Tensor):
         assert values.ndim == 2
 
         self.__row_offsets = row_offsets.contiguous()
-        self.__row_indices = _diffsort(row_offsets).to(row_offsets.dtype)
+        self.__row_indices = _get_row_indices(self.__row_offsets)
         self.__column_indices = column_indices.contiguous()
         self.__values = values.contiguous()
 
@@ -4,8 +4,12 @@
 # LICENSE file in the root directory of this source tree.
 
 
+import weakref
+
 import torch
 
+import xformers
+
 
 def _coo_to_csr(m, n, row_indices, column_indices):
     # assumes coalesced coo
@@ -23,10 +27,20 @@ def _csr_to_coo(m, n, row_offsets, column_indices):
 
 
 def _diffsort(a):
+    if _has_csr_ops(a):
+        return torch.ops.xformers.csr_row_swizzle(a)
     return torch.argsort(torch.diff(a), dim=0, descending=True)
 
 
-def _get_transpose_info(m, n, row_indices, row_offsets, column_indices):
+def _has_csr_ops(row_offsets):
+    return (
+        xformers._is_sparse_available
+        and row_offsets.dtype == torch.int32
+        and row_offsets.device.type in ("cpu", "cuda")
+    )
+
+
+def _compute_transpose_info(m, n, row_indices, row_offsets, column_indices):
     # strategy:
     # - uncompress the rows to have data in COO format
     # - get permutation for stable sort of the columns to get the rows for the transposed matrix
@@ -45,6 +59,78 @@ def _get_transpose_info(m, n, row_indices, row_offsets, column_indices):
     return row_indices_t, row_offsets_t, column_indices_t, perm
 
 
+class _PatternCache:
+    """
+    Caches values computed from the tensors of a sparsity pattern, which is
+    usually fixed for a given layer, so that the steps reusing the same pattern
+    don't recompute them. The entries are keyed by the identity (and version)
+    of the tensors, so that looking them up never reads the pattern itself,
+    and go away with them (the values must not hold these tensors).
+    """
+
+    def __init__(self):
+        self._entries = {}
+
+    def _key(self, tensors, args):
+        return tuple(id(t) for t in tensors) + tuple(args)
+
+    def get(self, tensors, args=()):
+        entry = self._entries.get(self._key(tensors, args))
+        if entry is None:
+            return None
+        refs, versions, value = entry
+        if any(r() is not t for r, t in zip(refs, tensors)):
+            return None
+        if versions != tuple(t._version for t in tensors):
+            return None
+        return value
+
+    def set(self, tensors, value, args=()):
+        key = self._key(tensors, args)
+
+        def _evict(_, key=key):
+            self._entries.pop(key, None)
+
+        refs = tuple(weakref.ref(t, _evict) for t in tensors)
+        versions = tuple(t._version for t in tensors)
+        self._entries[key] = (refs, versions, value)
+
+
+_row_indices_cache = _PatternCache()
+_transpose_info_cache = _PatternCache()
+_compressed_indices_cache = _PatternCache()
+
+
+def _get_row_indices(row_offsets):
+    row_indices = _row_indices_cache.get((row_offsets,))
+    if row_indices is None:
+        row_indices = _diffsort(row_offsets).to(row_offsets.dtype)
+        _row_indices_cache.set((row_offsets,), row_indices)
+    return row_indices
+
+
+def _get_transpose_info(m, n, row_indices, row_offsets, column_indices):
+    info = _transpose_info_cache.get((row_offsets, column_indices), (m, n))
+    if info is None:
+        info = _compute_transpose_info(m, n, row_indices, row_offsets, column_indices)
+        _transpose_info_cache.set((row_offsets, column_indices), info, (m, n))
+    return info
+
+
+def _get_compressed_indices(indices, size):
+    """
+    `indices` (of values in [0, size)) as int16 when they fit, which the
+    fused sparse attention kernels read at half the bandwidth
+    """
+    if size > torch.iinfo(torch.int16).max + 1 or indices.dtype != torch.int32:
+        return indices
+    compressed = _compressed_indices_cache.get((indices,))
+    if compressed is None:
+        compressed = indices.to(torch.int16)
+        _compressed_indices_cache.set((indices,), compressed)
+    return compressed
+
+
 def _transpose_with_info(values, _transpose_info):
     row_indices_t, row_offsets_t, column_indices_t, perm = _transpose_info
     values_t = values[:, perm]
@@ -63,6 +149,7 @@ def _nonzero_mask_to_sparse_csr_indices(mask, device):
 
     assert len(mask.shape) == 2
     index_dtype = torch.int32
+    mask = mask.to(device)
 
     # Calculate the offset of each row.
     row_offsets = mask.sum(dim=-1, dtype=index_dtype).cumsum(dim=-1, dtype=index_dtype)
@@ -73,13 +160,42 @@ def _nonzero_mask_to_sparse_csr_indices(mask, device):
 
     # Extract the column indices for the nonzero values.
     column_indices = torch.where(mask)[1].to(index_dtype).contiguous()
+    return row_indices, row_offsets, column_indices
+
+
+def _nonzero_mask_to_batched_csr_indices(mask, device):
+    """
+    Converts a dense 3d mask, with a different pattern for each batch element,
+    to the block-diagonal csr pattern taken by the sputnik ops for per-batch
+    patterns: the rows of the batch elements are concatenated, and the columns
+    of batch element b are offset by b times the number of columns.
+    """
+
+    assert len(mask.shape) == 3
+    index_dtype = torch.int32
+    mask = mask.to(device)
+    B, m, n = mask.shape
+
+    row_offsets = mask.reshape(B * m, n).sum(dim=-1, dtype=index_dtype)
+    row_offsets = row_offsets.cumsum(dim=-1, dtype=index_dtype)
+    row_offsets = torch.nn.functional.pad(row_offsets, (1, 0))
+    row_indices = _diffsort(row_offsets).to(index_dtype)
 
-    row_indices = row_indices.to(device)
-    row_offsets = row_offsets.to(device)
-    column_indices = column_indices.to(device)
+    b_idx, _, col_idx = torch.where(mask)
+    column_indices = (b_idx * n + col_idx).to(index_dtype).contiguous()
     return row_indices, row_offsets, column_indices
 
 
+def _dense3d_to_batched_sparse(matrix, device):
+    assert len(matrix.shape) == 3
+    mask = matrix != 0
+    values = matrix[mask].reshape(1, -1).to(device)
+    row_indices, row_offsets, column_indices = _nonzero_mask_to_batched_csr_indices(
+        mask, device
+    )
+    return values, row_indices, row_offsets, column_indices
+
+
 def _dense_to_sparse(matrix, device):
     """Converts dense 2d matrix to a csr sparse matrix."""
 